@@ -0,0 +1,277 @@
+#include "libcoro.h"
+#include "corobus.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/**
+ * Benchmarks of the libcoro / corobus hot paths. Unlike test.c
+ * this measures speed, not correctness. The output is
+ * machine-readable, one 'key value unit' triple per line, so the
+ * numbers can be tracked across releases.
+ *
+ * Build with 'make bench' (or 'make bench_asm' for the asm switch
+ * backend).
+ */
+
+static double
+now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void
+report(const char *key, double value, const char *unit)
+{
+	printf("%s %.2f %s\n", key, value, unit);
+}
+
+////////////////////////////////////////////////////////////////////
+
+struct yield_ctx {
+	uint64_t iter_count;
+};
+
+static void *
+yield_worker_f(void *arg)
+{
+	struct yield_ctx *ctx = arg;
+	for (uint64_t i = 0; i < ctx->iter_count; ++i)
+		coro_yield();
+	return NULL;
+}
+
+/** Cost of one coro_yield() with 2 coroutines switching. */
+static void
+bench_yield(uint64_t iter_count)
+{
+	struct yield_ctx ctx = { .iter_count = iter_count };
+	struct coro *c1 = coro_new(yield_worker_f, &ctx);
+	struct coro *c2 = coro_new(yield_worker_f, &ctx);
+	double t = now_sec();
+	coro_sched_run();
+	t = now_sec() - t;
+	coro_join(c1);
+	coro_join(c2);
+	report("yield_ns", t / (iter_count * 2) * 1e9, "ns/switch");
+}
+
+/** Cost of spawning and joining short-lived coroutines. */
+static void *
+noop_f(void *arg)
+{
+	(void)arg;
+	return NULL;
+}
+
+static void
+bench_spawn(uint64_t iter_count)
+{
+	double t = now_sec();
+	for (uint64_t i = 0; i < iter_count; ++i) {
+		struct coro *c = coro_new(noop_f, NULL);
+		coro_sched_run();
+		coro_join(c);
+	}
+	t = now_sec() - t;
+	report("spawn_join_ns", t / iter_count * 1e9, "ns/coro");
+}
+
+////////////////////////////////////////////////////////////////////
+
+struct bus_ctx {
+	struct coro_bus *bus;
+	int channel;
+	uint64_t msg_count;
+	unsigned batch;
+};
+
+static void *
+bus_sender_f(void *arg)
+{
+	struct bus_ctx *ctx = arg;
+#if NEED_BATCH
+	if (ctx->batch > 1) {
+		unsigned *data = calloc(ctx->batch, sizeof(*data));
+		uint64_t sent = 0;
+		while (sent < ctx->msg_count) {
+			int rc = coro_bus_send_v(ctx->bus, ctx->channel, data,
+				ctx->batch);
+			if (rc < 0)
+				break;
+			sent += rc;
+		}
+		free(data);
+		return NULL;
+	}
+#endif
+	for (uint64_t i = 0; i < ctx->msg_count; ++i) {
+		if (coro_bus_send(ctx->bus, ctx->channel, i) != 0)
+			break;
+	}
+	return NULL;
+}
+
+static void *
+bus_receiver_f(void *arg)
+{
+	struct bus_ctx *ctx = arg;
+#if NEED_BATCH
+	if (ctx->batch > 1) {
+		unsigned *data = calloc(ctx->batch, sizeof(*data));
+		uint64_t got = 0;
+		while (got < ctx->msg_count) {
+			int rc = coro_bus_recv_v(ctx->bus, ctx->channel, data,
+				ctx->batch);
+			if (rc < 0)
+				break;
+			got += rc;
+		}
+		free(data);
+		return NULL;
+	}
+#endif
+	unsigned data;
+	for (uint64_t i = 0; i < ctx->msg_count; ++i) {
+		if (coro_bus_recv(ctx->bus, ctx->channel, &data) != 0)
+			break;
+	}
+	return NULL;
+}
+
+/**
+ * Send/recv throughput on one channel with the given depth, number
+ * of sender/receiver pairs, and batch size (1 = single-message
+ * calls).
+ */
+static void
+bench_bus(uint64_t msg_count, size_t depth, int pair_count, unsigned batch)
+{
+	struct coro_bus *bus = coro_bus_new();
+	int channel = coro_bus_channel_open(bus, depth);
+	struct bus_ctx ctx = {
+		.bus = bus,
+		.channel = channel,
+		.msg_count = msg_count / pair_count,
+		.batch = batch,
+	};
+	struct coro **coros = calloc(pair_count * 2, sizeof(*coros));
+	for (int i = 0; i < pair_count; ++i) {
+		coros[i * 2] = coro_new(bus_sender_f, &ctx);
+		coros[i * 2 + 1] = coro_new(bus_receiver_f, &ctx);
+	}
+	double t = now_sec();
+	coro_sched_run();
+	t = now_sec() - t;
+	for (int i = 0; i < pair_count * 2; ++i)
+		coro_join(coros[i]);
+	free(coros);
+	coro_bus_channel_close(bus, channel);
+	coro_bus_delete(bus);
+
+	char key[128];
+	snprintf(key, sizeof(key), "bus_depth_%zu_pairs_%d_batch_%u",
+		depth, pair_count, batch);
+	report(key, msg_count / t / 1e6, "Mmsg/sec");
+}
+
+#if NEED_BROADCAST
+
+struct broadcast_ctx {
+	struct coro_bus *bus;
+	int *channels;
+	int channel_count;
+	uint64_t msg_count;
+};
+
+static void *
+broadcast_sender_f(void *arg)
+{
+	struct broadcast_ctx *ctx = arg;
+	for (uint64_t i = 0; i < ctx->msg_count; ++i) {
+		if (coro_bus_broadcast(ctx->bus, i) != 0)
+			break;
+	}
+	return NULL;
+}
+
+static void *
+broadcast_receiver_f(void *arg)
+{
+	struct bus_ctx *ctx = arg;
+	unsigned data;
+	for (uint64_t i = 0; i < ctx->msg_count; ++i) {
+		if (coro_bus_recv(ctx->bus, ctx->channel, &data) != 0)
+			break;
+	}
+	return NULL;
+}
+
+/** Broadcast fan-out cost across the given channel count. */
+static void
+bench_broadcast(uint64_t msg_count, int channel_count, size_t depth)
+{
+	struct coro_bus *bus = coro_bus_new();
+	struct broadcast_ctx ctx = {
+		.bus = bus,
+		.channels = calloc(channel_count, sizeof(int)),
+		.channel_count = channel_count,
+		.msg_count = msg_count,
+	};
+	struct bus_ctx *rctxs = calloc(channel_count, sizeof(*rctxs));
+	struct coro **coros = calloc(channel_count + 1, sizeof(*coros));
+	for (int i = 0; i < channel_count; ++i) {
+		ctx.channels[i] = coro_bus_channel_open(bus, depth);
+		rctxs[i] = (struct bus_ctx) {
+			.bus = bus,
+			.channel = ctx.channels[i],
+			.msg_count = msg_count,
+		};
+		coros[i] = coro_new(broadcast_receiver_f, &rctxs[i]);
+	}
+	coros[channel_count] = coro_new(broadcast_sender_f, &ctx);
+	double t = now_sec();
+	coro_sched_run();
+	t = now_sec() - t;
+	for (int i = 0; i <= channel_count; ++i)
+		coro_join(coros[i]);
+	for (int i = 0; i < channel_count; ++i)
+		coro_bus_channel_close(bus, ctx.channels[i]);
+	coro_bus_delete(bus);
+	free(coros);
+	free(rctxs);
+	free(ctx.channels);
+
+	char key[128];
+	snprintf(key, sizeof(key), "broadcast_channels_%d", channel_count);
+	report(key, t / msg_count * 1e9, "ns/broadcast");
+}
+
+#endif /* NEED_BROADCAST */
+
+int
+main(void)
+{
+	coro_sched_init();
+
+	bench_yield(1000 * 1000);
+	bench_spawn(100 * 1000);
+
+	bench_bus(1000 * 1000, 1, 1, 1);
+	bench_bus(1000 * 1000, 64, 1, 1);
+	bench_bus(1000 * 1000, 65536, 1, 1);
+	bench_bus(1000 * 1000, 64, 16, 1);
+#if NEED_BATCH
+	bench_bus(4000 * 1000, 65536, 1, 1024);
+#endif
+#if NEED_BROADCAST
+	bench_broadcast(100 * 1000, 8, 16);
+	bench_broadcast(100 * 1000, 64, 16);
+#endif
+
+	coro_sched_destroy();
+	return 0;
+}
@@ -2,56 +2,106 @@
 
 #include "libcoro.h"
 #include "rlist.h"
+#include "trace.h"
 
 #include <assert.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+/**
+ * Message storage of a channel - a power-of-two ring buffer. Both
+ * append and pop are O(1) per message: the read position just
+ * wraps around, no data is ever slid towards the buffer start.
+ */
 struct data_vector {
 	unsigned *data;
+	/** How many messages are stored. */
 	size_t size;
+	/** Ring capacity, always a power of two or zero. */
 	size_t capacity;
+	/** Read position, wraps via the capacity mask. */
+	size_t head;
+	/** Stored bytes, maintained by append and pop. */
+	size_t bytes;
+	/**
+	 * Bus-wide byte counter this vector contributes to, so the
+	 * bus total never requires scanning the channels.
+	 */
+	size_t *bus_bytes;
 };
 
-#if 0 /* Uncomment this if want to use */
+/**
+ * Grow the ring so it fits @a new_size messages. The stored
+ * messages are linearized into the start of the new buffer.
+ */
+static void
+data_vector_reserve(struct data_vector *vector, size_t new_size)
+{
+	if (new_size <= vector->capacity)
+		return;
+	size_t new_capacity = vector->capacity == 0 ? 4 : vector->capacity;
+	while (new_capacity < new_size)
+		new_capacity *= 2;
+	unsigned *new_data = malloc(sizeof(new_data[0]) * new_capacity);
+	size_t mask = vector->capacity - 1;
+	for (size_t i = 0; i < vector->size; ++i)
+		new_data[i] = vector->data[(vector->head + i) & mask];
+	free(vector->data);
+	vector->data = new_data;
+	vector->capacity = new_capacity;
+	vector->head = 0;
+}
 
-/** Append @a count messages in @a data to the end of the vector. */
+/** Append @a count messages in @a data to the end of the ring. */
 static void
 data_vector_append_many(struct data_vector *vector,
 	const unsigned *data, size_t count)
 {
-	if (vector->size + count > vector->capacity) {
-		if (vector->capacity == 0)
-			vector->capacity = 4;
-		else
-			vector->capacity *= 2;
-		if (vector->capacity < vector->size + count)
-			vector->capacity = vector->size + count;
-		vector->data = realloc(vector->data,
-			sizeof(vector->data[0]) * vector->capacity);
-	}
-	memcpy(&vector->data[vector->size], data, sizeof(data[0]) * count);
+	data_vector_reserve(vector, vector->size + count);
+	size_t mask = vector->capacity - 1;
+	size_t pos = (vector->head + vector->size) & mask;
+	size_t tail_room = vector->capacity - pos;
+	size_t part = count < tail_room ? count : tail_room;
+	memcpy(&vector->data[pos], data, sizeof(data[0]) * part);
+	memcpy(&vector->data[0], data + part, sizeof(data[0]) * (count - part));
 	vector->size += count;
+	size_t bytes = sizeof(data[0]) * count;
+	vector->bytes += bytes;
+	if (vector->bus_bytes != NULL)
+		*vector->bus_bytes += bytes;
 }
 
-/** Append a single message to the vector. */
+/** Append a single message to the ring. */
 static void
 data_vector_append(struct data_vector *vector, unsigned data)
 {
 	data_vector_append_many(vector, &data, 1);
 }
 
-/** Pop @a count of messages into @a data from the head of the vector. */
+/** Pop @a count of messages into @a data from the head of the ring. */
 static void
 data_vector_pop_first_many(struct data_vector *vector, unsigned *data, size_t count)
 {
 	assert(count <= vector->size);
-	memcpy(data, vector->data, sizeof(data[0]) * count);
+	size_t mask = vector->capacity - 1;
+	size_t tail_room = vector->capacity - vector->head;
+	size_t part = count < tail_room ? count : tail_room;
+	memcpy(data, &vector->data[vector->head], sizeof(data[0]) * part);
+	memcpy(data + part, &vector->data[0], sizeof(data[0]) * (count - part));
+	vector->head = (vector->head + count) & mask;
 	vector->size -= count;
-	memmove(vector->data, &vector->data[count], vector->size * sizeof(vector->data[0]));
+	size_t bytes = sizeof(data[0]) * count;
+	assert(vector->bytes >= bytes);
+	vector->bytes -= bytes;
+	if (vector->bus_bytes != NULL) {
+		assert(*vector->bus_bytes >= bytes);
+		*vector->bus_bytes -= bytes;
+	}
 }
 
-/** Pop a single message from the head of the vector. */
+/** Pop a single message from the head of the ring. */
 static unsigned
 data_vector_pop_first(struct data_vector *vector)
 {
@@ -60,8 +110,6 @@ data_vector_pop_first(struct data_vector *vector)
 	return data;
 }
 
-#endif
-
 /**
  * One coroutine waiting to be woken up in a list of other
  * suspended coros.
@@ -76,8 +124,6 @@ struct wakeup_queue {
 	struct rlist coros;
 };
 
-#if 0 /* Uncomment this if want to use */
-
 /** Suspend the current coroutine until it is woken up. */
 static void
 wakeup_queue_suspend_this(struct wakeup_queue *queue)
@@ -85,10 +131,40 @@ wakeup_queue_suspend_this(struct wakeup_queue *queue)
 	struct wakeup_entry entry;
 	entry.coro = coro_this();
 	rlist_add_tail_entry(&queue->coros, &entry, base);
+	TRACE_PROBE2(corobus, suspend, queue, entry.coro);
 	coro_suspend();
 	rlist_del_entry(&entry, base);
 }
 
+/**
+ * Same as wakeup_queue_suspend_this(), but the engine's timer
+ * wheel wakes the entry up on its own when the timeout elapses -
+ * O(1) per wait, no watchdog coroutine.
+ *
+ * @retval 0 Woken up explicitly before the deadline.
+ * @retval -1 The timeout elapsed.
+ */
+static int
+wakeup_queue_suspend_this_timeout(struct wakeup_queue *queue, double timeout)
+{
+	struct wakeup_entry entry;
+	entry.coro = coro_this();
+	rlist_add_tail_entry(&queue->coros, &entry, base);
+	TRACE_PROBE2(corobus, suspend, queue, entry.coro);
+	int rc = coro_suspend_timeout(timeout);
+	rlist_del_entry(&entry, base);
+	return rc;
+}
+
+/** Monotonic clock for the deadlines, same as the engine's. */
+static double
+coro_bus_time_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
 /** Wakeup the first coroutine in the queue. */
 static void
 wakeup_queue_wakeup_first(struct wakeup_queue *queue)
@@ -100,7 +176,27 @@ wakeup_queue_wakeup_first(struct wakeup_queue *queue)
 	coro_wakeup(entry->coro);
 }
 
-#endif
+/**
+ * Wakeup all the coroutines in the queue at once, with a single
+ * scheduler operation instead of a chain of one-by-one wakeups.
+ * The entries are detached from the queue right away, so the queue
+ * can be safely destroyed afterwards even before the waiters
+ * resume.
+ */
+static void
+wakeup_queue_wakeup_all(struct wakeup_queue *queue)
+{
+	struct coro *batch[16];
+	while (!rlist_empty(&queue->coros)) {
+		size_t count = 0;
+		while (count < 16 && !rlist_empty(&queue->coros)) {
+			struct wakeup_entry *entry = rlist_shift_entry(
+				&queue->coros, struct wakeup_entry, base);
+			batch[count++] = entry->coro;
+		}
+		coro_wakeup_many(batch, count);
+	}
+}
 
 struct coro_bus_channel {
 	/** Channel max capacity. */
@@ -113,11 +209,68 @@ struct coro_bus_channel {
 	struct data_vector data;
 };
 
+enum {
+	/** Capacity of the external ingress ring, per bus. */
+	CORO_BUS_EXTERNAL_RING_SIZE = 1024,
+};
+
+/** One message pushed into the bus by a foreign thread. */
+struct coro_bus_external_slot {
+	/**
+	 * Sequence number making the slot state unambiguous for
+	 * the lock-free ring: a slot is free for the producer of
+	 * ticket N when seq == N, and ready for the consumer when
+	 * seq == N + 1.
+	 */
+	uint64_t seq;
+	int channel;
+	unsigned data;
+};
+
+/**
+ * Multi-producer single-consumer ring for messages produced
+ * outside of the coroutine engine. Producers claim a ticket with
+ * one CAS and publish their slot with a release store; the single
+ * consumer is the engine's poll hook, which drains the ring into
+ * the channels at the start of every scheduler iteration.
+ */
+struct coro_bus_external_ring {
+	struct coro_bus_external_slot slots[CORO_BUS_EXTERNAL_RING_SIZE];
+	/** Producers' ticket counter. */
+	uint64_t tail;
+	/** Consumer position, touched only by the drain. */
+	uint64_t head;
+};
+
 struct coro_bus {
 	struct coro_bus_channel **channels;
 	int channel_count;
+	/**
+	 * Stack of free descriptors, so opening a channel takes
+	 * the top one in O(1) instead of scanning the array for a
+	 * NULL slot. A stale descriptor is detected in O(1) too -
+	 * its slot is NULL.
+	 */
+	int *free_descs;
+	int free_desc_count;
+	/** How many channels are open right now. */
+	size_t open_count;
+	/** Bytes stored in all the channels together. */
+	size_t used_bytes;
+	/** Bus-wide cap on the stored bytes. Zero - unlimited. */
+	size_t memory_limit;
+	/** Senders blocked on the bus-wide cap. */
+	struct wakeup_queue mem_waiters;
+	/** Ingress of messages from foreign threads. */
+	struct coro_bus_external_ring external;
+	/** Link in the global list of buses, for the poll hook. */
+	struct rlist link;
 };
 
+/** All the buses alive, drained by the shared poll hook. */
+static struct rlist coro_bus_all;
+static int coro_bus_count = 0;
+
 static enum coro_bus_error_code global_error = CORO_BUS_ERR_NONE;
 
 enum coro_bus_error_code
@@ -132,151 +285,563 @@ coro_bus_errno_set(enum coro_bus_error_code err)
 	global_error = err;
 }
 
+/**
+ * Find a channel by its descriptor. Returns NULL when the
+ * descriptor is invalid or closed. Doesn't touch the global error.
+ */
+static struct coro_bus_channel *
+coro_bus_lookup(struct coro_bus *bus, int channel)
+{
+	if (channel < 0 || channel >= bus->channel_count)
+		return NULL;
+	return bus->channels[channel];
+}
+
+/** Same as coro_bus_lookup(), but sets the global error. */
+static struct coro_bus_channel *
+coro_bus_find_channel(struct coro_bus *bus, int channel)
+{
+	struct coro_bus_channel *ch = coro_bus_lookup(bus, channel);
+	if (ch == NULL)
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+	return ch;
+}
+
+/**
+ * Whether the bus-wide memory cap still allows storing more
+ * messages. The byte totals are maintained by the vector append
+ * and pop - no channel scanning here.
+ */
+static bool
+coro_bus_mem_has_space(const struct coro_bus *bus)
+{
+	return bus->memory_limit == 0 || bus->used_bytes < bus->memory_limit;
+}
+
+/**
+ * Drain the external ingress ring into the channels. Runs in the
+ * scheduler context. Stops at the first message whose channel is
+ * full, keeping the ring order and pushing the backpressure onto
+ * the producers; messages to closed channels are dropped.
+ */
+static void
+coro_bus_external_drain(struct coro_bus *bus)
+{
+	struct coro_bus_external_ring *ring = &bus->external;
+	while (true) {
+		struct coro_bus_external_slot *slot = &ring->slots[
+			ring->head % CORO_BUS_EXTERNAL_RING_SIZE];
+		uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		/* Empty, or a producer is still writing the slot. */
+		if (seq != ring->head + 1)
+			break;
+		struct coro_bus_channel *ch = coro_bus_lookup(bus,
+			slot->channel);
+		if (ch != NULL) {
+			if (ch->data.size >= ch->size_limit ||
+			    !coro_bus_mem_has_space(bus))
+				break;
+			data_vector_append(&ch->data, slot->data);
+			wakeup_queue_wakeup_first(&ch->recv_queue);
+		}
+		__atomic_store_n(&slot->seq,
+			ring->head + CORO_BUS_EXTERNAL_RING_SIZE,
+			__ATOMIC_RELEASE);
+		++ring->head;
+	}
+}
+
+static void
+coro_bus_poll(void *arg)
+{
+	(void)arg;
+	struct coro_bus *bus;
+	rlist_foreach_entry(bus, &coro_bus_all, link)
+		coro_bus_external_drain(bus);
+}
+
 struct coro_bus *
 coro_bus_new(void)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return NULL;
+	struct coro_bus *bus = calloc(1, sizeof(*bus));
+	rlist_create(&bus->mem_waiters.coros);
+	for (uint64_t i = 0; i < CORO_BUS_EXTERNAL_RING_SIZE; ++i)
+		bus->external.slots[i].seq = i;
+	if (coro_bus_count++ == 0) {
+		rlist_create(&coro_bus_all);
+		coro_sched_set_poll_cb(coro_bus_poll, NULL);
+	}
+	rlist_add_tail_entry(&coro_bus_all, bus, link);
+	return bus;
 }
 
 void
 coro_bus_delete(struct coro_bus *bus)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
+	for (int i = 0; i < bus->channel_count; ++i) {
+		if (bus->channels[i] != NULL)
+			coro_bus_channel_close(bus, i);
+	}
+	rlist_del_entry(bus, link);
+	if (--coro_bus_count == 0)
+		coro_sched_set_poll_cb(NULL, NULL);
+	free(bus->channels);
+	free(bus->free_descs);
+	free(bus);
 }
 
 int
 coro_bus_channel_open(struct coro_bus *bus, size_t size_limit)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)size_limit;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
+	struct coro_bus_channel *ch = calloc(1, sizeof(*ch));
+	ch->size_limit = size_limit;
+	ch->data.bus_bytes = &bus->used_bytes;
+	rlist_create(&ch->send_queue.coros);
+	rlist_create(&ch->recv_queue.coros);
+	++bus->open_count;
 	/*
-	 * One of the tests will force you to reuse the channel
-	 * descriptors. It means, that if your maximal channel
-	 * descriptor is N, and you have any free descriptor in
-	 * the range 0-N, then you should open the new channel on
-	 * that old descriptor.
-	 *
-	 * A more precise instruction - check if any of the
-	 * bus->channels[i] with i = 0 -> bus->channel_count is
-	 * free (== NULL). If yes - reuse the slot. Don't grow the
-	 * bus->channels array, when have space in it.
+	 * Reuse a free descriptor when there is one, so the
+	 * channel array doesn't grow infinitely under open/close
+	 * churn. The free descriptors sit in a stack - no slot
+	 * scanning.
 	 */
-	return -1;
+	if (bus->free_desc_count > 0) {
+		int idx = bus->free_descs[--bus->free_desc_count];
+		assert(bus->channels[idx] == NULL);
+		bus->channels[idx] = ch;
+		return idx;
+	}
+	int idx = bus->channel_count;
+	int new_count = idx == 0 ? 4 : idx * 2;
+	bus->channels = realloc(bus->channels,
+		sizeof(bus->channels[0]) * new_count);
+	memset(&bus->channels[idx], 0,
+		sizeof(bus->channels[0]) * (new_count - idx));
+	bus->free_descs = realloc(bus->free_descs,
+		sizeof(bus->free_descs[0]) * new_count);
+	bus->channel_count = new_count;
+	/* The slots above the taken one become free descriptors. */
+	for (int i = new_count - 1; i > idx; --i)
+		bus->free_descs[bus->free_desc_count++] = i;
+	bus->channels[idx] = ch;
+	return idx;
 }
 
 void
 coro_bus_channel_close(struct coro_bus *bus, int channel)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
+	struct coro_bus_channel *ch = coro_bus_find_channel(bus, channel);
+	assert(ch != NULL);
+	/*
+	 * The waiters are detached from the queues before the
+	 * channel memory is freed, so on wakeup they don't touch
+	 * the destroyed lists. They will re-lookup the channel,
+	 * find the slot empty, and get the no-channel error.
+	 */
+	bus->channels[channel] = NULL;
+	assert(bus->free_desc_count < bus->channel_count);
+	bus->free_descs[bus->free_desc_count++] = channel;
+	wakeup_queue_wakeup_all(&ch->send_queue);
+	wakeup_queue_wakeup_all(&ch->recv_queue);
 	/*
-	 * Be very attentive here. What happens, if the channel is
-	 * closed while there are coroutines waiting on it? For
-	 * example, the channel was empty, and some coros were
-	 * waiting on its recv_queue.
-	 *
-	 * If you wakeup those coroutines and just delete the
-	 * channel right away, then those waiting coroutines might
-	 * on wakeup try to reference invalid memory.
-	 *
-	 * Can happen, for example, if you use an intrusive list
-	 * (rlist), delete the list itself (by deleting the
-	 * channel), and then the coroutines on wakeup would try
-	 * to remove themselves from the already destroyed list.
-	 *
-	 * Think how you could address that. Remove all the
-	 * waiters from the list before freeing it? Yield this
-	 * coroutine after waking up the waiters but before
-	 * freeing the channel, so the waiters could safely leave?
+	 * The unconsumed messages die with the channel - return
+	 * their bytes to the bus-wide budget and let the senders
+	 * blocked on the cap retry.
 	 */
+	assert(bus->used_bytes >= ch->data.bytes);
+	bus->used_bytes -= ch->data.bytes;
+	assert(bus->open_count > 0);
+	--bus->open_count;
+	wakeup_queue_wakeup_all(&bus->mem_waiters);
+	free(ch->data.data);
+	free(ch);
+}
+
+void
+coro_bus_set_memory_limit(struct coro_bus *bus, size_t limit)
+{
+	bus->memory_limit = limit;
+	/* Raising or dropping the cap can unblock the waiters. */
+	if (coro_bus_mem_has_space(bus))
+		wakeup_queue_wakeup_all(&bus->mem_waiters);
+}
+
+void
+coro_bus_stats_get(const struct coro_bus *bus, struct coro_bus_stats *stats)
+{
+	stats->channel_count = bus->open_count;
+	stats->used_bytes = bus->used_bytes;
+	stats->message_count = bus->used_bytes / sizeof(unsigned);
+	stats->memory_limit = bus->memory_limit;
 }
 
 int
 coro_bus_send(struct coro_bus *bus, int channel, unsigned data)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	/*
-	 * Try sending in a loop, until success. If error, then
-	 * check which one is that. If 'wouldblock', then suspend
-	 * this coroutine and try again when woken up.
-	 *
-	 * If see the channel has space, then wakeup the first
-	 * coro in the send-queue. That is needed so when there is
-	 * enough space for many messages, and many coroutines are
-	 * waiting, they would then wake each other up one by one
-	 * as lone as there is still space.
-	 */
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	while (true) {
+		enum coro_bus_error_code err =
+			coro_bus_try_send_st(bus, channel, data);
+		if (err == CORO_BUS_ERR_NONE) {
+			struct coro_bus_channel *ch =
+				coro_bus_lookup(bus, channel);
+			/*
+			 * If there still is space, pass the baton to
+			 * the next suspended sender, so a burst of
+			 * freed space is consumed by a chain of
+			 * wakeups.
+			 */
+			if (ch != NULL && ch->data.size < ch->size_limit &&
+			    coro_bus_mem_has_space(bus))
+				wakeup_queue_wakeup_first(&ch->send_queue);
+			return 0;
+		}
+		if (err != CORO_BUS_ERR_WOULD_BLOCK) {
+			coro_bus_errno_set(err);
+			return -1;
+		}
+		struct coro_bus_channel *ch = coro_bus_find_channel(bus,
+			channel);
+		if (ch == NULL)
+			return -1;
+		/*
+		 * Wait either for the channel itself or for the
+		 * bus-wide cap, whichever is the blocker. The cap
+		 * waiters are woken by any receive on any channel.
+		 */
+		if (ch->data.size >= ch->size_limit)
+			wakeup_queue_suspend_this(&ch->send_queue);
+		else
+			wakeup_queue_suspend_this(&bus->mem_waiters);
+	}
+}
+
+enum coro_bus_error_code
+coro_bus_try_send_st(struct coro_bus *bus, int channel, unsigned data)
+{
+	struct coro_bus_channel *ch = coro_bus_lookup(bus, channel);
+	if (ch == NULL)
+		return CORO_BUS_ERR_NO_CHANNEL;
+	if (ch->data.size >= ch->size_limit ||
+	    !coro_bus_mem_has_space(bus))
+		return CORO_BUS_ERR_WOULD_BLOCK;
+	data_vector_append(&ch->data, data);
+	TRACE_PROBE3(corobus, send, bus, channel, ch->data.size);
+	wakeup_queue_wakeup_first(&ch->recv_queue);
+	return CORO_BUS_ERR_NONE;
 }
 
 int
 coro_bus_try_send(struct coro_bus *bus, int channel, unsigned data)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	/*
-	 * Append data if has space. Otherwise 'wouldblock' error.
-	 * Wakeup the first coro in the recv-queue! To let it know
-	 * there is data.
-	 */
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
+	enum coro_bus_error_code err = coro_bus_try_send_st(bus, channel,
+		data);
+	if (err == CORO_BUS_ERR_NONE)
+		return 0;
+	coro_bus_errno_set(err);
 	return -1;
 }
 
+int
+coro_bus_send_timeout(struct coro_bus *bus, int channel, unsigned data,
+		      double timeout)
+{
+	double deadline = coro_bus_time_now() + timeout;
+	while (true) {
+		enum coro_bus_error_code err = coro_bus_try_send_st(bus,
+			channel, data);
+		if (err == CORO_BUS_ERR_NONE) {
+			struct coro_bus_channel *ch =
+				coro_bus_lookup(bus, channel);
+			/* Same baton passing as in coro_bus_send(). */
+			if (ch != NULL && ch->data.size < ch->size_limit &&
+			    coro_bus_mem_has_space(bus))
+				wakeup_queue_wakeup_first(&ch->send_queue);
+			return 0;
+		}
+		if (err != CORO_BUS_ERR_WOULD_BLOCK) {
+			coro_bus_errno_set(err);
+			return -1;
+		}
+		struct coro_bus_channel *ch = coro_bus_find_channel(bus,
+			channel);
+		if (ch == NULL)
+			return -1;
+		double left = deadline - coro_bus_time_now();
+		if (left <= 0) {
+			coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+			return -1;
+		}
+		/*
+		 * The suspend result is deliberately not checked - a
+		 * wakeup racing with the deadline can still carry a
+		 * baton, and the retry above either consumes it or
+		 * finds the deadline passed and gives up.
+		 */
+		if (ch->data.size >= ch->size_limit)
+			wakeup_queue_suspend_this_timeout(&ch->send_queue,
+							  left);
+		else
+			wakeup_queue_suspend_this_timeout(&bus->mem_waiters,
+							  left);
+	}
+}
+
 int
 coro_bus_recv(struct coro_bus *bus, int channel, unsigned *data)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	while (true) {
+		enum coro_bus_error_code err =
+			coro_bus_try_recv_st(bus, channel, data);
+		if (err == CORO_BUS_ERR_NONE) {
+			struct coro_bus_channel *ch =
+				coro_bus_lookup(bus, channel);
+			/* Same baton passing as in coro_bus_send(). */
+			if (ch != NULL && ch->data.size > 0)
+				wakeup_queue_wakeup_first(&ch->recv_queue);
+			return 0;
+		}
+		if (err != CORO_BUS_ERR_WOULD_BLOCK) {
+			coro_bus_errno_set(err);
+			return -1;
+		}
+		struct coro_bus_channel *ch = coro_bus_find_channel(bus,
+			channel);
+		if (ch == NULL)
+			return -1;
+		wakeup_queue_suspend_this(&ch->recv_queue);
+	}
+}
+
+enum coro_bus_error_code
+coro_bus_try_recv_st(struct coro_bus *bus, int channel, unsigned *data)
+{
+	struct coro_bus_channel *ch = coro_bus_lookup(bus, channel);
+	if (ch == NULL)
+		return CORO_BUS_ERR_NO_CHANNEL;
+	if (ch->data.size == 0)
+		return CORO_BUS_ERR_WOULD_BLOCK;
+	*data = data_vector_pop_first(&ch->data);
+	TRACE_PROBE3(corobus, recv, bus, channel, ch->data.size);
+	wakeup_queue_wakeup_first(&ch->send_queue);
+	wakeup_queue_wakeup_first(&bus->mem_waiters);
+	return CORO_BUS_ERR_NONE;
 }
 
 int
 coro_bus_try_recv(struct coro_bus *bus, int channel, unsigned *data)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
+	enum coro_bus_error_code err = coro_bus_try_recv_st(bus, channel,
+		data);
+	if (err == CORO_BUS_ERR_NONE)
+		return 0;
+	coro_bus_errno_set(err);
 	return -1;
 }
 
+int
+coro_bus_recv_timeout(struct coro_bus *bus, int channel, unsigned *data,
+		      double timeout)
+{
+	double deadline = coro_bus_time_now() + timeout;
+	while (true) {
+		enum coro_bus_error_code err =
+			coro_bus_try_recv_st(bus, channel, data);
+		if (err == CORO_BUS_ERR_NONE) {
+			struct coro_bus_channel *ch =
+				coro_bus_lookup(bus, channel);
+			/* Same baton passing as in coro_bus_recv(). */
+			if (ch != NULL && ch->data.size > 0)
+				wakeup_queue_wakeup_first(&ch->recv_queue);
+			return 0;
+		}
+		if (err != CORO_BUS_ERR_WOULD_BLOCK) {
+			coro_bus_errno_set(err);
+			return -1;
+		}
+		struct coro_bus_channel *ch = coro_bus_find_channel(bus,
+			channel);
+		if (ch == NULL)
+			return -1;
+		double left = deadline - coro_bus_time_now();
+		if (left <= 0) {
+			coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+			return -1;
+		}
+		/* The result is ignored for the same baton-race
+		 * reason as in coro_bus_send_timeout(). */
+		wakeup_queue_suspend_this_timeout(&ch->recv_queue, left);
+	}
+}
+
+int
+coro_bus_select(struct coro_bus *bus, const struct coro_bus_select *ops,
+	int count)
+{
+	while (true) {
+		/* First a cheap readiness pass without suspension. */
+		for (int i = 0; i < count; ++i) {
+			struct coro_bus_channel *ch = coro_bus_lookup(bus,
+				ops[i].channel);
+			if (ch == NULL) {
+				coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+				return -1;
+			}
+			if (ops[i].event == CORO_BUS_SELECT_RECV) {
+				if (ch->data.size > 0)
+					return i;
+			} else {
+				if (ch->data.size < ch->size_limit)
+					return i;
+			}
+		}
+		/*
+		 * Nothing is ready - park this coroutine in all the
+		 * wait queues at once and suspend. Whichever channel
+		 * changes first wakes it up; the entries are then
+		 * detached and the readiness pass is retried.
+		 */
+		struct wakeup_entry entries[count];
+		for (int i = 0; i < count; ++i) {
+			struct coro_bus_channel *ch = coro_bus_lookup(bus,
+				ops[i].channel);
+			assert(ch != NULL);
+			entries[i].coro = coro_this();
+			struct wakeup_queue *queue =
+				ops[i].event == CORO_BUS_SELECT_RECV ?
+				&ch->recv_queue : &ch->send_queue;
+			rlist_add_tail_entry(&queue->coros, &entries[i], base);
+		}
+		coro_suspend();
+		for (int i = 0; i < count; ++i)
+			rlist_del_entry(&entries[i], base);
+	}
+}
+
+int
+coro_bus_send_external(struct coro_bus *bus, int channel, unsigned data)
+{
+	struct coro_bus_external_ring *ring = &bus->external;
+	uint64_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	while (true) {
+		struct coro_bus_external_slot *slot = &ring->slots[
+			pos % CORO_BUS_EXTERNAL_RING_SIZE];
+		uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			/*
+			 * The slot is free - claim the ticket. On
+			 * failure the CAS re-reads the tail into pos.
+			 */
+			if (!__atomic_compare_exchange_n(&ring->tail, &pos,
+			    pos + 1, true, __ATOMIC_RELAXED,
+			    __ATOMIC_RELAXED))
+				continue;
+			slot->channel = channel;
+			slot->data = data;
+			__atomic_store_n(&slot->seq, pos + 1,
+				__ATOMIC_RELEASE);
+			return 0;
+		}
+		if (seq < pos) {
+			/* The consumer hasn't freed the slot - full. */
+			return -1;
+		}
+		/* Someone claimed this ticket already - catch up. */
+		pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	}
+}
 
 #if NEED_BROADCAST
 
+/**
+ * All-or-nothing broadcast: one pass checks every channel's free
+ * space, and only when all of them can take the message, a second
+ * pass appends it everywhere. No channel is ever left with a
+ * half-delivered broadcast. The first waiter of each non-empty
+ * recv queue is woken with one batched scheduler call. On
+ * WOULD_BLOCK the first full channel is returned via @a blocked,
+ * for the blocking wrapper to wait on; NULL there means the
+ * bus-wide memory cap is the blocker, not a channel.
+ */
+static enum coro_bus_error_code
+coro_bus_try_broadcast_st(struct coro_bus *bus, unsigned data,
+	struct coro_bus_channel **blocked)
+{
+	int found = 0;
+	for (int i = 0; i < bus->channel_count; ++i) {
+		struct coro_bus_channel *ch = bus->channels[i];
+		if (ch == NULL)
+			continue;
+		++found;
+		if (ch->data.size >= ch->size_limit) {
+			*blocked = ch;
+			return CORO_BUS_ERR_WOULD_BLOCK;
+		}
+	}
+	if (found == 0)
+		return CORO_BUS_ERR_NO_CHANNEL;
+	/* The broadcast is all-or-nothing for the cap too. */
+	if (bus->memory_limit != 0 && bus->used_bytes +
+	    found * sizeof(unsigned) > bus->memory_limit) {
+		*blocked = NULL;
+		return CORO_BUS_ERR_WOULD_BLOCK;
+	}
+	struct coro *batch[16];
+	size_t batch_count = 0;
+	for (int i = 0; i < bus->channel_count; ++i) {
+		struct coro_bus_channel *ch = bus->channels[i];
+		if (ch == NULL)
+			continue;
+		data_vector_append(&ch->data, data);
+		if (rlist_empty(&ch->recv_queue.coros))
+			continue;
+		struct wakeup_entry *entry = rlist_first_entry(
+			&ch->recv_queue.coros, struct wakeup_entry, base);
+		batch[batch_count++] = entry->coro;
+		if (batch_count == 16) {
+			coro_wakeup_many(batch, batch_count);
+			batch_count = 0;
+		}
+	}
+	if (batch_count > 0)
+		coro_wakeup_many(batch, batch_count);
+	return CORO_BUS_ERR_NONE;
+}
+
 int
 coro_bus_broadcast(struct coro_bus *bus, unsigned data)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)data;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	while (true) {
+		struct coro_bus_channel *blocked = NULL;
+		enum coro_bus_error_code err = coro_bus_try_broadcast_st(bus,
+			data, &blocked);
+		if (err == CORO_BUS_ERR_NONE)
+			return 0;
+		if (err != CORO_BUS_ERR_WOULD_BLOCK) {
+			coro_bus_errno_set(err);
+			return -1;
+		}
+		/*
+		 * Wait until the full channel - or the bus-wide cap -
+		 * drains. Afterwards the whole check restarts from
+		 * scratch - other channels could have filled up or
+		 * closed meanwhile.
+		 */
+		if (blocked != NULL)
+			wakeup_queue_suspend_this(&blocked->send_queue);
+		else
+			wakeup_queue_suspend_this(&bus->mem_waiters);
+	}
 }
 
 int
 coro_bus_try_broadcast(struct coro_bus *bus, unsigned data)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)data;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
+	struct coro_bus_channel *blocked;
+	enum coro_bus_error_code err = coro_bus_try_broadcast_st(bus, data,
+		&blocked);
+	if (err == CORO_BUS_ERR_NONE)
+		return 0;
+	coro_bus_errno_set(err);
 	return -1;
 }
 
@@ -287,49 +852,101 @@ coro_bus_try_broadcast(struct coro_bus *bus, unsigned data)
 int
 coro_bus_send_v(struct coro_bus *bus, int channel, const unsigned *data, unsigned count)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	(void)count;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	while (true) {
+		int rc = coro_bus_try_send_v(bus, channel, data, count);
+		if (rc >= 0) {
+			struct coro_bus_channel *ch =
+				coro_bus_find_channel(bus, channel);
+			/* Baton passing, as in coro_bus_send(). */
+			if (ch != NULL && ch->data.size < ch->size_limit &&
+			    coro_bus_mem_has_space(bus))
+				wakeup_queue_wakeup_first(&ch->send_queue);
+			return rc;
+		}
+		if (coro_bus_errno() != CORO_BUS_ERR_WOULD_BLOCK)
+			return -1;
+		struct coro_bus_channel *ch =
+			coro_bus_find_channel(bus, channel);
+		if (ch == NULL)
+			return -1;
+		/* Same queue choice as in coro_bus_send(). */
+		if (ch->data.size >= ch->size_limit)
+			wakeup_queue_suspend_this(&ch->send_queue);
+		else
+			wakeup_queue_suspend_this(&bus->mem_waiters);
+	}
 }
 
 int
 coro_bus_try_send_v(struct coro_bus *bus, int channel, const unsigned *data, unsigned count)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	(void)count;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	struct coro_bus_channel *ch = coro_bus_find_channel(bus, channel);
+	if (ch == NULL)
+		return -1;
+	if (ch->data.size >= ch->size_limit ||
+	    !coro_bus_mem_has_space(bus)) {
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+	size_t space = ch->size_limit - ch->data.size;
+	if (count > space)
+		count = space;
+	if (bus->memory_limit != 0) {
+		size_t mem_space = (bus->memory_limit - bus->used_bytes +
+			sizeof(unsigned) - 1) / sizeof(unsigned);
+		if (count > mem_space)
+			count = mem_space;
+	}
+	/*
+	 * The whole batch lands into the ring in one append - at
+	 * most two memcpy calls - and the receivers are woken up
+	 * once per batch, not once per message.
+	 */
+	data_vector_append_many(&ch->data, data, count);
+	wakeup_queue_wakeup_first(&ch->recv_queue);
+	return count;
 }
 
 int
 coro_bus_recv_v(struct coro_bus *bus, int channel, unsigned *data, unsigned capacity)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	(void)capacity;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	while (true) {
+		int rc = coro_bus_try_recv_v(bus, channel, data, capacity);
+		if (rc >= 0) {
+			struct coro_bus_channel *ch =
+				coro_bus_find_channel(bus, channel);
+			/* Baton passing, as in coro_bus_recv(). */
+			if (ch != NULL && ch->data.size > 0)
+				wakeup_queue_wakeup_first(&ch->recv_queue);
+			return rc;
+		}
+		if (coro_bus_errno() != CORO_BUS_ERR_WOULD_BLOCK)
+			return -1;
+		struct coro_bus_channel *ch =
+			coro_bus_find_channel(bus, channel);
+		if (ch == NULL)
+			return -1;
+		wakeup_queue_suspend_this(&ch->recv_queue);
+	}
 }
 
 int
 coro_bus_try_recv_v(struct coro_bus *bus, int channel, unsigned *data, unsigned capacity)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	(void)capacity;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	struct coro_bus_channel *ch = coro_bus_find_channel(bus, channel);
+	if (ch == NULL)
+		return -1;
+	if (ch->data.size == 0) {
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+	size_t count = capacity;
+	if (count > ch->data.size)
+		count = ch->data.size;
+	data_vector_pop_first_many(&ch->data, data, count);
+	wakeup_queue_wakeup_first(&ch->send_queue);
+	wakeup_queue_wakeup_first(&bus->mem_waiters);
+	return count;
 }
 
 #endif
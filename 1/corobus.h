@@ -7,8 +7,8 @@
  * macros. It is important to define these macros here, in the
  * header, because it is used by tests.
  */
-#define NEED_BROADCAST 0
-#define NEED_BATCH 0
+#define NEED_BROADCAST 1
+#define NEED_BATCH 1
 
 enum coro_bus_error_code {
 	CORO_BUS_ERR_NONE = 0,
@@ -62,6 +62,40 @@ coro_bus_channel_open(struct coro_bus *bus, size_t size_limit);
 void
 coro_bus_channel_close(struct coro_bus *bus, int channel);
 
+/**
+ * Cap the bytes the bus may hold in all its channels together.
+ * The per-channel size_limit bounds message counts, so one user
+ * opening many deep channels can still exhaust the memory - this
+ * is the bus-wide guard against that. Once the stored bytes reach
+ * the cap, the senders block (or get CORO_BUS_ERR_WOULD_BLOCK from
+ * the try-variants) until receivers drain some data, even when
+ * their own channel has space. Zero means unlimited - the default.
+ * @param bus Bus to set the cap on.
+ * @param limit Cap on the stored bytes, 0 to remove it.
+ */
+void
+coro_bus_set_memory_limit(struct coro_bus *bus, size_t limit);
+
+/** Memory statistics of a bus. */
+struct coro_bus_stats {
+	/** How many channels are open. */
+	size_t channel_count;
+	/** Messages stored in all the channels together. */
+	size_t message_count;
+	/** Bytes stored in all the channels together. */
+	size_t used_bytes;
+	/** The bus-wide cap on the stored bytes, 0 when unlimited. */
+	size_t memory_limit;
+};
+
+/**
+ * Get the memory statistics of the bus. O(1) - the byte totals are
+ * maintained on every append and pop, not recounted by scanning
+ * the channels.
+ */
+void
+coro_bus_stats_get(const struct coro_bus *bus, struct coro_bus_stats *stats);
+
 /**
  * Send the given message to the specified channel. If the channel
  * is full, the function should suspend the current coroutine and
@@ -93,6 +127,34 @@ coro_bus_send(struct coro_bus *bus, int channel, unsigned data);
 int
 coro_bus_try_send(struct coro_bus *bus, int channel, unsigned data);
 
+/**
+ * Same as coro_bus_try_send(), but the result is returned directly
+ * and the global coro_bus_errno() is never touched. Meant for hot
+ * polling loops which would otherwise pay a global store and load
+ * per attempt.
+ */
+enum coro_bus_error_code
+coro_bus_try_send_st(struct coro_bus *bus, int channel, unsigned data);
+
+/**
+ * Same as coro_bus_send(), but wait no longer than the timeout.
+ * The deadline sits in the engine's timer wheel next to the
+ * suspended coroutine - the wait costs O(1) scheduling work and
+ * needs no watchdog coroutine.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel to send data to.
+ * @param data Data to send.
+ * @param timeout How long to wait for free space, in seconds.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the timeout elapsed first.
+ */
+int
+coro_bus_send_timeout(struct coro_bus *bus, int channel, unsigned data,
+		      double timeout);
+
 /**
  * Recv a message from the specified channel. If the channel is
  * empty, the function should suspend the current coroutine and
@@ -126,6 +188,86 @@ coro_bus_recv(struct coro_bus *bus, int channel, unsigned *data);
 int
 coro_bus_try_recv(struct coro_bus *bus, int channel, unsigned *data);
 
+/**
+ * Same as coro_bus_try_recv(), but the result is returned directly,
+ * without touching the global coro_bus_errno().
+ */
+enum coro_bus_error_code
+coro_bus_try_recv_st(struct coro_bus *bus, int channel, unsigned *data);
+
+/**
+ * Same as coro_bus_recv(), but wait no longer than the timeout.
+ * Costs O(1) scheduling work per wait like coro_bus_send_timeout().
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel to send data to.
+ * @param data Output parameter to save the data to.
+ * @param timeout How long to wait for a message, in seconds.
+ *
+ * @retval 0 Success. Data output is filled with the received
+ *     message.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the timeout elapsed first.
+ */
+int
+coro_bus_recv_timeout(struct coro_bus *bus, int channel, unsigned *data,
+		      double timeout);
+
+/** What to wait for in coro_bus_select(). */
+enum coro_bus_select_event {
+	/** The channel has data to receive. */
+	CORO_BUS_SELECT_RECV,
+	/** The channel has space to send. */
+	CORO_BUS_SELECT_SEND,
+};
+
+/** One watched channel of a select set. */
+struct coro_bus_select {
+	/** Descriptor of the channel to watch. */
+	int channel;
+	/** Readiness condition to wait for. */
+	enum coro_bus_select_event event;
+};
+
+/**
+ * Wait until any of the given channels becomes ready, suspending
+ * the current coroutine on all of them at once instead of polling
+ * them in a loop. The ready condition is not consumed - use the
+ * try-variants on the returned channel afterwards.
+ * @param bus Bus where the channels are located.
+ * @param ops Watched channels with their conditions.
+ * @param count Size of @a ops.
+ *
+ * @retval >=0 Index in @a ops of a ready channel.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - one of the channels doesn't
+ *       exist or was closed during the wait.
+ */
+int
+coro_bus_select(struct coro_bus *bus, const struct coro_bus_select *ops,
+	int count);
+
+/**
+ * Push a message into the channel from a foreign thread, outside
+ * of the coroutine engine. The message lands into a lock-free
+ * ingress ring - one CAS, no syscalls - and is delivered into the
+ * channel by the engine at the start of its next scheduler
+ * iteration, waking the receivers as a regular send would. The
+ * delivery keeps the ring order: a message to a full channel
+ * blocks the ones behind it until the channel drains. The channel
+ * descriptor is validated only at delivery - a message to a closed
+ * channel is silently dropped. Does not touch coro_bus_errno(),
+ * which is not thread-safe.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel to send data to.
+ * @param data Data to send.
+ *
+ * @retval 0 Success. The message is queued for delivery.
+ * @retval -1 The ingress ring is full - retry later.
+ */
+int
+coro_bus_send_external(struct coro_bus *bus, int channel, unsigned data);
+
 
 #if NEED_BROADCAST /* Bonus 1 */
 
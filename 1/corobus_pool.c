@@ -0,0 +1,88 @@
+#include "corobus_pool.h"
+#include "../4/thread_pool.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+/** One in-flight offload; freed by the reaping. */
+struct coro_bus_offload_ctx {
+	struct coro_bus *bus;
+	int channel;
+	coro_bus_offload_f func;
+	void *arg;
+	struct thread_task *task;
+	struct coro_bus_offload_ctx *next;
+};
+
+/**
+ * Treiber stack of the offloads whose completion was delivered. A
+ * worker pushes its context here right before returning from the
+ * task function, so a join of a retired task is momentary. Reaped
+ * lazily by the next offload, finally by coro_bus_offload_reap().
+ */
+static struct coro_bus_offload_ctx *coro_bus_offload_retired = NULL;
+
+static void *
+coro_bus_offload_task_f(void *arg)
+{
+	struct coro_bus_offload_ctx *ctx = arg;
+	unsigned data = ctx->func(ctx->arg);
+	/*
+	 * A full ring only means the scheduler did not drain it yet -
+	 * back off shortly and retry, the completion must not be lost.
+	 * The retirement comes strictly after the delivery: a reaper
+	 * joining a retired task must never end up waiting on this
+	 * loop, the scheduler itself can be the reaper.
+	 */
+	while (coro_bus_send_external(ctx->bus, ctx->channel, data) != 0) {
+		struct timespec ts = {0, 100 * 1000};
+		nanosleep(&ts, NULL);
+	}
+	struct coro_bus_offload_ctx *head =
+		__atomic_load_n(&coro_bus_offload_retired, __ATOMIC_RELAXED);
+	do {
+		ctx->next = head;
+	} while (!__atomic_compare_exchange_n(&coro_bus_offload_retired, &head,
+		ctx, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	return NULL;
+}
+
+void
+coro_bus_offload_reap(void)
+{
+	struct coro_bus_offload_ctx *ctx = __atomic_exchange_n(
+		&coro_bus_offload_retired, NULL, __ATOMIC_ACQUIRE);
+	while (ctx != NULL) {
+		struct coro_bus_offload_ctx *next = ctx->next;
+		void *result;
+		thread_task_join(ctx->task, &result);
+		thread_task_delete(ctx->task);
+		free(ctx);
+		ctx = next;
+	}
+}
+
+int
+coro_bus_offload(struct coro_bus *bus, int channel, struct thread_pool *pool,
+		 coro_bus_offload_f func, void *arg)
+{
+	coro_bus_offload_reap();
+	struct coro_bus_offload_ctx *ctx = malloc(sizeof(*ctx));
+	if (ctx == NULL)
+		return -1;
+	ctx->bus = bus;
+	ctx->channel = channel;
+	ctx->func = func;
+	ctx->arg = arg;
+	ctx->next = NULL;
+	if (thread_task_new(&ctx->task, coro_bus_offload_task_f, ctx) != 0) {
+		free(ctx);
+		return -1;
+	}
+	if (thread_pool_push_task(pool, ctx->task) != 0) {
+		thread_task_delete(ctx->task);
+		free(ctx);
+		return -1;
+	}
+	return 0;
+}
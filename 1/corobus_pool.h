@@ -0,0 +1,43 @@
+#pragma once
+
+#include "corobus.h"
+
+struct thread_pool;
+
+/**
+ * Bridge from the thread pool of ../4 into the bus. CPU work is
+ * offloaded to the pool workers and the completion comes back as an
+ * ordinary bus message: the worker pushes the result through the
+ * thread-safe ingress ring, the scheduler's poll hook delivers it
+ * into the channel, and the waiting coroutine wakes through the
+ * normal recv queue. One handoff instead of a coroutine polling
+ * thread_task_join() with a zero timeout - no wasted wakeups on
+ * either side.
+ */
+
+/** Offloaded work; the returned value is the delivered message. */
+typedef unsigned (*coro_bus_offload_f)(void *arg);
+
+/**
+ * Run func(arg) on the pool and deliver its return value into the
+ * channel of the bus when it completes. The bus and the channel have
+ * to stay open until the completion is received. When the ingress
+ * ring is momentarily full, the worker retries until the scheduler
+ * drains it. The internal task bookkeeping is reclaimed lazily by
+ * the following offloads - call coro_bus_offload_reap() once at
+ * shutdown, before deleting the pool.
+ *
+ * @retval 0 Success.
+ * @retval -1 The pool rejected the task, or out of memory.
+ */
+int
+coro_bus_offload(struct coro_bus *bus, int channel, struct thread_pool *pool,
+		 coro_bus_offload_f func, void *arg);
+
+/**
+ * Join and free the bookkeeping of the completed offloads. Has to be
+ * called after the last completion was delivered and before the pool
+ * is deleted.
+ */
+void
+coro_bus_offload_reap(void);
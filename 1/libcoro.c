@@ -1,5 +1,6 @@
 #include "libcoro.h"
 
+#include "crlist.h"
 #include "rlist.h"
 
 #include <assert.h>
@@ -10,6 +11,29 @@
 #include <signal.h>
 #include <errno.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+
+/**
+ * Context switch backend. The default one is the portable
+ * sigaltstack/sigsetjmp trampoline. With CORO_BACKEND_ASM=1 (see
+ * the 'test_asm' Makefile target) the switch is done by a few
+ * hand-written instructions swapping only the callee-saved
+ * registers and the stack pointer, which is several times cheaper
+ * per coro_yield() than the setjmp machinery.
+ */
+#ifndef CORO_BACKEND_ASM
+#define CORO_BACKEND_ASM 0
+#endif
+
+#if CORO_BACKEND_ASM && !defined(__x86_64__) && !defined(__aarch64__)
+#error "The asm switch backend supports only x86_64 and aarch64"
+#endif
 
 #define handle_error() do {														\
 	printf("Error %s\n", strerror(errno));										\
@@ -22,6 +46,137 @@ enum coro_state {
 	CORO_STATE_FINISHED,
 };
 
+enum {
+	/** How many distinct stack sizes the stack pool can cache. */
+	CORO_STACK_TIER_COUNT = 4,
+	/** Default high-water mark of free stacks kept per tier. */
+	CORO_STACK_POOL_DEFAULT_LIMIT = 64,
+	/** Slot count of the timer wheel. */
+	CORO_TIMER_WHEEL_SIZE = 256,
+	/** Entry count of the scheduling trace ring. */
+	CORO_TRACE_RING_SIZE = 1024,
+	/** Filler byte for the stack usage watermarking. */
+	CORO_STACK_POISON_BYTE = 0xCA,
+	/** Hard cap on the worker thread count in the M:N mode. */
+	CORO_WORKER_MAX = 64,
+};
+
+/** Types of traced scheduling events. */
+enum coro_trace_event {
+	CORO_TRACE_RESUME,
+	CORO_TRACE_SUSPEND,
+	CORO_TRACE_WAKEUP,
+};
+
+static const char *coro_trace_event_strs[] = {
+	"resume",
+	"suspend",
+	"wakeup",
+};
+
+/** One record in the scheduling trace ring. */
+struct coro_trace_record {
+	double time;
+	enum coro_trace_event event;
+	const struct coro *coro;
+};
+
+/** Width of one timer wheel slot, in seconds. */
+#define CORO_TIMER_RESOLUTION 0.001
+
+/** Monotonic time in seconds. */
+static double
+coro_time_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Header of a free stack, stored right in the stack memory while
+ * it sits in the pool. The memory is not used by anybody else at
+ * that point.
+ */
+struct coro_stack {
+	struct rlist link;
+};
+
+/**
+ * Pool of mapped, guard-page-protected stacks of one size, kept
+ * hot for reuse by new coroutines.
+ */
+struct coro_stack_tier {
+	/** Usable stack size. Zero while the tier is unclaimed. */
+	size_t stack_size;
+	/** The free stacks, with their count cached in the head. */
+	struct crlist stacks;
+};
+
+/**
+ * Map a new stack of the given usable size with a PROT_NONE guard
+ * page below it, so an overflow hits the guard instead of silently
+ * corrupting the neighbour allocations. The mapping is lazy -
+ * MAP_NORESERVE plus the default on-first-touch commit mean a
+ * mostly idle coroutine pins only the few pages it actually uses,
+ * not the whole reservation.
+ */
+static void *
+coro_stack_map(size_t stack_size)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	assert(stack_size % page_size == 0);
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+	flags |= MAP_NORESERVE;
+#endif
+	char *mem = mmap(NULL, stack_size + page_size, PROT_READ | PROT_WRITE,
+		flags, -1, 0);
+	if (mem == MAP_FAILED)
+		handle_error();
+	if (mprotect(mem, page_size, PROT_NONE) != 0)
+		handle_error();
+	return mem + page_size;
+}
+
+/**
+ * Fill the committed pages of the stack with the poison pattern,
+ * so the next owner's real usage can be told from the previous
+ * one's leftovers. Only the resident pages are written - poisoning
+ * must not commit what the lazy mapping has not committed yet.
+ */
+static void
+coro_stack_poison(void *stack, size_t stack_size)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	unsigned char vec[64];
+	char *pos = stack;
+	char *end = pos + stack_size;
+	while (pos < end) {
+		size_t chunk = (end - pos) / page_size;
+		if (chunk > sizeof(vec))
+			chunk = sizeof(vec);
+		if (mincore(pos, chunk * page_size, (void *)vec) != 0)
+			handle_error();
+		for (size_t i = 0; i < chunk; ++i) {
+			if ((vec[i] & 1) != 0) {
+				memset(pos + i * page_size,
+					CORO_STACK_POISON_BYTE, page_size);
+			}
+		}
+		pos += chunk * page_size;
+	}
+}
+
+
+static void
+coro_stack_unmap(void *stack, size_t stack_size)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	if (munmap((char *)stack - page_size, stack_size + page_size) != 0)
+		handle_error();
+}
+
 /** Main coroutine structure, its context. */
 struct coro {
 	/** Coroutine state. */
@@ -30,20 +185,101 @@ struct coro {
 	void *ret;
 	/** Stack, used by the coroutine. */
 	void *stack;
+	/** Usable size of the stack. */
+	size_t stack_size;
+	/**
+	 * The stack was used by a previous owner and its watermark
+	 * has to be rearmed before the new function runs.
+	 */
+	bool stack_needs_poison;
 	/** An argument for the function func. */
 	void *func_arg;
 	/** A function to call as a coroutine. */
 	coro_f func;
+	/** Ready queue class the coroutine is scheduled in. */
+	enum coro_prio prio;
+	/**
+	 * Spawn order id, see coro_sched_record_start(). The
+	 * scheduler context is 0, the spawned coroutines count from 1.
+	 */
+	uint64_t id;
+	/** Scheduling statistics, see coro_stat_get(). */
+	struct coro_stat stat;
+#if CORO_BACKEND_ASM
+	/**
+	 * Last remembered coroutine context - just the stack
+	 * pointer. The callee-saved registers live on the stack
+	 * right below it.
+	 */
+	void *ctx;
+#else
 	/** Last remembered coroutine context. */
 	sigjmp_buf ctx;
+#endif
+	/**
+	 * Deadline of the timer the coroutine waits on, if any.
+	 */
+	double deadline;
+	/** Whether the last timed suspension hit its deadline. */
+	bool timed_out;
+	/** Link in a timer wheel slot. Empty when not waiting. */
+	struct rlist timer_link;
 	/**
 	 * Coroutine which is trying to join this one right now.
 	 */
 	struct coro *joiner;
+	/**
+	 * The coroutine won't be joined - the engine reclaims it
+	 * right when its function returns, see coro_detach().
+	 */
+	bool is_detached;
 	/** Links in a coroutine list, used by the scheduler. */
 	struct rlist link;
+	/** Coroutine-local storage, see coro_local_set(). */
+	void *local[CORO_LOCAL_SLOT_COUNT];
+	/**
+	 * Engine whose ready queue the coroutine sits in (or sat in
+	 * last). In the multi-threaded mode a coroutine migrates
+	 * between the engine shards - wakeups and the accounting
+	 * follow this pointer. Protected by the scheduler lock.
+	 */
+	struct coro_engine *engine;
+	/** Engine whose timer wheel the coroutine waits in, if any. */
+	struct coro_engine *timer_engine;
+	/** Engine whose epoll set the coroutine waits in, if any. */
+	struct coro_engine *fd_engine;
+	/** The fd the coroutine waits on, see coro_fd_wait(). */
+	int wait_fd;
+	/** Readiness events the fd wait ended with. */
+	int fd_events;
+	/**
+	 * Whether the last remembered context is complete. In the
+	 * multi-threaded mode a coroutine can become runnable on one
+	 * thread while the thread it ran on is still in the middle of
+	 * switching away from it - the resumer must not jump into the
+	 * context until this flag says it is fully parked.
+	 */
+	bool ctx_is_saved;
 };
 
+/**
+ * Rearm the watermark of the running coroutine's stack - poison
+ * the dead part below the caller's own frame. Only makes sense
+ * right at a (re)start, when nothing below the body frame is
+ * alive. The margin covers the compiler placing locals freely
+ * within the frame.
+ */
+static void
+coro_stack_poison_below(struct coro *c)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	char *sp = (char *)__builtin_frame_address(0) - 256;
+	char *stack = c->stack;
+	if (sp <= stack)
+		return;
+	coro_stack_poison(stack, (sp - stack) / page_size * page_size);
+}
+
 struct coro_engine {
 	/**
 	 * Scheduler is the main coroutine - it represents the
@@ -59,15 +295,65 @@ struct coro_engine {
 	 */
 	struct rlist coros_running_now;
 	/**
-	 * Coroutines to run in the next iteration of the loop.
-	 * The list gets populated by wakeups and yields and new
-	 * coros.
+	 * Coroutines to run in the next iteration of the loop, one
+	 * ready queue per priority class. The lists get populated
+	 * by wakeups and yields and new coros, and are drained into
+	 * coros_running_now in priority order, so within one pass
+	 * the high-priority coros always go first.
 	 */
-	struct rlist coros_running_next;
-	/** Joined coroutines to be reused. */
-	struct rlist coros_pool;
+	struct rlist coros_running_next[CORO_PRIO_COUNT];
+	/** Joined coroutines to be reused, their count cached. */
+	struct crlist coros_pool;
 	/** Total number of coroutines, including the pool. */
 	size_t coro_count;
+	/**
+	 * Free stacks kept mapped for reuse, grouped by stack size.
+	 * A stack lands here when its coroutine struct is retired,
+	 * and is picked up by the next spawn of the same size,
+	 * skipping both mmap and the guard page setup.
+	 */
+	struct coro_stack_tier stack_pool[CORO_STACK_TIER_COUNT];
+	/** High-water mark of free stacks kept per tier. */
+	size_t stack_pool_limit;
+	/**
+	 * Hashed timer wheel. A timed-out coroutine lands into the
+	 * slot of its deadline tick; slots are scanned lazily as
+	 * the time passes, so insertion and expiration both cost
+	 * O(1) amortized. An entry hashed into an already passed
+	 * slot of a future rotation is simply left in place until
+	 * its turn.
+	 */
+	struct rlist timer_wheel[CORO_TIMER_WHEEL_SIZE];
+	/** How many coroutines wait in the wheel. */
+	size_t timer_count;
+	/** The last tick up to which the wheel was processed. */
+	uint64_t timer_tick;
+	/**
+	 * Epoll set of the fds the coroutines wait on, see
+	 * coro_fd_wait(). Created lazily on the first wait, so the
+	 * engines of programs which never wait on fds don't hold
+	 * descriptors.
+	 */
+	int epoll_fd;
+	/** How many coroutines wait on fds in the set. */
+	size_t fd_wait_count;
+	/** When the currently running coroutine was switched in. */
+	double run_start;
+	/**
+	 * The coroutine this engine is switching away from right now.
+	 * The destination side of the switch publishes its parked
+	 * context, see coro_engine_switch_ack().
+	 */
+	struct coro *switch_from;
+	/** Ring of recent scheduling events. */
+	struct coro_trace_record trace[CORO_TRACE_RING_SIZE];
+	/** Write position in the trace ring. */
+	size_t trace_pos;
+	/** Set by the SIGUSR1 handler, checked by the run loop. */
+	volatile sig_atomic_t trace_dump_requested;
+	/** Called at the start of every scheduler loop iteration. */
+	coro_poll_f poll_cb;
+	void *poll_arg;
 	/**
 	 * Buffer, used by the coroutine constructor to escape
 	 * from the signal handler back into the constructor to
@@ -76,35 +362,559 @@ struct coro_engine {
 	sigjmp_buf start_point;
 };
 
+static struct coro_engine glob_engine;
+
+/**
+ * The M:N mode - coro_sched_run_workers() runs one engine shard per
+ * worker thread. One global lock protects everything the shards can
+ * touch in each other: the ready queues, the coroutine states, the
+ * timer wheels and the idle/busy accounting. The lock is taken only
+ * while the flag is set, so the single-threaded mode pays nothing
+ * but a branch on a cold global.
+ */
+static bool coro_is_mt = false;
+static pthread_mutex_t coro_mt_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Signaled on cross-thread wakeups and on the run completion. */
+static pthread_cond_t coro_mt_cond = PTHREAD_COND_INITIALIZER;
+/** All the engine shards, for the work stealing. */
+static struct coro_engine *coro_engines[CORO_WORKER_MAX];
+static int coro_engine_count = 0;
+/** How many shards are inside a scheduler pass right now. */
+static int coro_mt_busy = 0;
+/** Set once by whoever detects that all the work has drained. */
+static bool coro_mt_done = false;
+
+/** Engine shard owned by this thread. */
+static __thread struct coro_engine *coro_this_engine = NULL;
+
+/**
+ * The engine of the calling thread. Coroutines migrate between the
+ * shards, so any engine pointer saved across a context switch can
+ * be stale - the current engine must be re-fetched after every
+ * resume.
+ */
+static inline struct coro_engine *
+coro_engine_current(void)
+{
+	return coro_this_engine != NULL ? coro_this_engine : &glob_engine;
+}
+
+static inline void
+coro_mt_lock_acquire(void)
+{
+	if (coro_is_mt)
+		pthread_mutex_lock(&coro_mt_lock);
+}
+
+static inline void
+coro_mt_lock_release(void)
+{
+	if (coro_is_mt)
+		pthread_mutex_unlock(&coro_mt_lock);
+}
+
 static void
 coro_engine_create(struct coro_engine *engine)
 {
 	memset(engine, 0, sizeof(*engine));
 	rlist_create(&engine->sched.link);
 	rlist_create(&engine->coros_running_now);
-	rlist_create(&engine->coros_running_next);
-	rlist_create(&engine->coros_pool);
+	for (int i = 0; i < CORO_PRIO_COUNT; ++i)
+		rlist_create(&engine->coros_running_next[i]);
+	crlist_create(&engine->coros_pool);
+	for (int i = 0; i < CORO_STACK_TIER_COUNT; ++i)
+		crlist_create(&engine->stack_pool[i].stacks);
+	engine->stack_pool_limit = CORO_STACK_POOL_DEFAULT_LIMIT;
+	for (int i = 0; i < CORO_TIMER_WHEEL_SIZE; ++i)
+		rlist_create(&engine->timer_wheel[i]);
+	engine->timer_tick = coro_time_now() / CORO_TIMER_RESOLUTION;
+	engine->epoll_fd = -1;
+	engine->run_start = coro_time_now();
 }
 
+/**
+ * Record one scheduling event into the trace ring. Cross-thread
+ * wakeups trace into the target's ring concurrently with its owner,
+ * hence the atomic position. A racing record can come out torn in
+ * the dump - tolerable for a debug ring.
+ */
+static inline void
+coro_engine_trace(struct coro_engine *engine, enum coro_trace_event event,
+	const struct coro *coro, double now)
+{
+	size_t pos = __atomic_fetch_add(&engine->trace_pos, 1,
+		__ATOMIC_RELAXED);
+	struct coro_trace_record *r = &engine->trace[pos % CORO_TRACE_RING_SIZE];
+	r->time = now;
+	r->event = event;
+	r->coro = coro;
+}
+
+/** Print the trace ring, oldest events first. */
 static void
-coro_engine_resume_next(struct coro_engine *engine)
+coro_engine_trace_dump(struct coro_engine *engine)
 {
-	assert(!rlist_empty(&engine->coros_running_now));
-	struct coro *to = rlist_shift_entry(&engine->coros_running_now,
-		struct coro, link);
-	struct coro *from = engine->this;
-	assert(from != NULL);
+	size_t count = engine->trace_pos < CORO_TRACE_RING_SIZE ?
+		engine->trace_pos : CORO_TRACE_RING_SIZE;
+	size_t begin = engine->trace_pos - count;
+	fprintf(stderr, "coro trace, %zu events:\n", count);
+	for (size_t i = 0; i < count; ++i) {
+		const struct coro_trace_record *r =
+			&engine->trace[(begin + i) % CORO_TRACE_RING_SIZE];
+		const char *name = r->coro == &engine->sched ?
+			"sched" : "coro";
+		fprintf(stderr, "%.9f %s %s %p\n", r->time,
+			coro_trace_event_strs[r->event], name,
+			(const void *)r->coro);
+	}
+}
 
-	engine->this = NULL;
+/**
+ * Record/replay of the scheduling decisions, see
+ * coro_sched_record_start(). Single-threaded only, hence the plain
+ * globals.
+ */
+enum coro_replay_mode {
+	CORO_REPLAY_OFF,
+	CORO_REPLAY_RECORD,
+	CORO_REPLAY_FORCE,
+};
+
+static enum coro_replay_mode coro_replay_mode = CORO_REPLAY_OFF;
+/** The decision log - a ring when recording, a script when forcing. */
+static uint64_t *coro_replay_log = NULL;
+static size_t coro_replay_capacity = 0;
+/** How many decisions were recorded or replayed so far. */
+static size_t coro_replay_pos = 0;
+/** The replayed run deviated from the script. */
+static bool coro_replay_diverged = false;
+/** Next spawn id; restarts when a recording or a replay starts. */
+static uint64_t coro_id_next = 1;
+
+/** Log one resume decision into the record ring. */
+static inline void
+coro_replay_record(const struct coro *to)
+{
+	coro_replay_log[coro_replay_pos % coro_replay_capacity] = to->id;
+	++coro_replay_pos;
+}
+
+/**
+ * Take the coroutine the script demands from the ready list. When
+ * the script is over, or the wanted coroutine is not ready - the run
+ * has diverged - fall back to the natural head.
+ */
+static struct coro *
+coro_replay_take(struct coro_engine *engine)
+{
+	if (coro_replay_pos < coro_replay_capacity) {
+		uint64_t id = coro_replay_log[coro_replay_pos++];
+		struct coro *c;
+		rlist_foreach_entry(c, &engine->coros_running_now, link) {
+			if (c->id == id) {
+				rlist_del_entry(c, link);
+				return c;
+			}
+		}
+		coro_replay_diverged = true;
+	}
+	return rlist_shift_entry(&engine->coros_running_now, struct coro,
+		link);
+}
+
+static void
+coro_engine_wakeup_do(struct coro_engine *engine, struct coro *coro);
+
+/** Wake up the coroutines whose deadlines have passed. */
+static void
+coro_engine_timers_expire(struct coro_engine *engine)
+{
+	double now = coro_time_now();
+	uint64_t now_tick = now / CORO_TIMER_RESOLUTION;
+	coro_mt_lock_acquire();
+	if (engine->timer_count == 0) {
+		engine->timer_tick = now_tick;
+		coro_mt_lock_release();
+		return;
+	}
+	size_t woken = 0;
+	uint64_t steps = now_tick - engine->timer_tick + 1;
+	if (steps > CORO_TIMER_WHEEL_SIZE)
+		steps = CORO_TIMER_WHEEL_SIZE;
+	for (uint64_t i = 0; i < steps; ++i) {
+		struct rlist *slot = &engine->timer_wheel[
+			(engine->timer_tick + i) % CORO_TIMER_WHEEL_SIZE];
+		struct coro *c, *tmp;
+		rlist_foreach_entry_safe(c, slot, timer_link, tmp) {
+			/*
+			 * Woken up externally already - it unregisters
+			 * its timer itself after the resume. Touching
+			 * it here would race with that.
+			 */
+			if (c->state != CORO_STATE_SUSPENDED)
+				continue;
+			/* Belongs to a future wheel rotation. */
+			if (c->deadline > now)
+				continue;
+			rlist_del_entry(c, timer_link);
+			assert(engine->timer_count > 0);
+			--engine->timer_count;
+			c->timed_out = true;
+			coro_engine_wakeup_do(engine, c);
+			++woken;
+		}
+	}
+	engine->timer_tick = now_tick;
+	coro_mt_lock_release();
+	if (coro_is_mt && woken > 0)
+		pthread_cond_broadcast(&coro_mt_cond);
+}
+
+/** Find the nearest deadline in the wheel. Used only when idle. */
+static double
+coro_engine_timers_next_deadline(const struct coro_engine *engine)
+{
+	assert(engine->timer_count > 0);
+	double deadline = -1;
+	for (int i = 0; i < CORO_TIMER_WHEEL_SIZE; ++i) {
+		struct coro *c;
+		rlist_foreach_entry(c, &engine->timer_wheel[i], timer_link) {
+			if (deadline < 0 || c->deadline < deadline)
+				deadline = c->deadline;
+		}
+	}
+	return deadline;
+}
+
+/** Take a hot stack from the pool, or map a new one. */
+static void *
+coro_engine_stack_acquire(struct coro_engine *engine, size_t stack_size)
+{
+	for (int i = 0; i < CORO_STACK_TIER_COUNT; ++i) {
+		struct coro_stack_tier *tier = &engine->stack_pool[i];
+		if (tier->stack_size != stack_size ||
+		    crlist_empty(&tier->stacks))
+			continue;
+		struct coro_stack *s = crlist_shift_entry(&tier->stacks,
+			struct coro_stack, link);
+		/* The header bytes are not poison - repair them. */
+		memset(s, CORO_STACK_POISON_BYTE, sizeof(*s));
+		return s;
+	}
+	return coro_stack_map(stack_size);
+}
+
+/**
+ * Return a stack to the pool. When the matching tier is at its
+ * high-water mark, the stack is unmapped instead, so the memory
+ * goes back to the OS under pressure.
+ */
+static void
+coro_engine_stack_release(struct coro_engine *engine, void *stack,
+	size_t stack_size)
+{
+	struct coro_stack_tier *tier = NULL;
+	for (int i = 0; i < CORO_STACK_TIER_COUNT; ++i) {
+		struct coro_stack_tier *t = &engine->stack_pool[i];
+		if (t->stack_size == stack_size ||
+		    (tier == NULL && t->stack_size == 0))
+			tier = t;
+		if (t->stack_size == stack_size)
+			break;
+	}
+	if (tier == NULL ||
+	    crlist_size(&tier->stacks) >= engine->stack_pool_limit) {
+		coro_stack_unmap(stack, stack_size);
+		return;
+	}
+	tier->stack_size = stack_size;
+	coro_stack_poison(stack, stack_size);
+	/*
+	 * Let the kernel take the pooled pages back under pressure.
+	 * The poison either survives until the reuse or reads back
+	 * as zeroes - the watermark treats both as untouched.
+	 */
+#ifdef MADV_FREE
+	if (madvise(stack, stack_size, MADV_FREE) != 0)
+		handle_error();
+#else
+	if (madvise(stack, stack_size, MADV_DONTNEED) != 0)
+		handle_error();
+#endif
+	struct coro_stack *s = stack;
+	rlist_create(&s->link);
+	crlist_add_entry(&tier->stacks, s, link);
+}
+
+#if CORO_BACKEND_ASM
+
+/**
+ * The switch itself. Saves the callee-saved registers on the
+ * current stack, remembers the stack pointer in @a from_ctx,
+ * installs @a to_ctx as the new stack pointer, and restores the
+ * registers from there. The caller-saved registers don't need
+ * saving - for the compiler this is just a regular function call.
+ */
+void
+coro_asm_switch(void **from_ctx, void *to_ctx);
+
+/**
+ * First frame of a new coroutine. Crafted by the constructor so
+ * that the first switch into the coroutine 'returns' here with the
+ * coro and engine pointers in callee-saved registers. Moves them
+ * into the argument registers and enters the C body.
+ */
+void
+coro_asm_entry(void);
+
+static void
+coro_asm_body(struct coro *c, struct coro_engine *engine);
+
+#ifdef __x86_64__
+
+__asm__(
+	"\t.text\n"
+	"\t.align 16\n"
+	"\t.globl coro_asm_switch\n"
+	"\t.type coro_asm_switch, @function\n"
+	"coro_asm_switch:\n"
+	"\tpushq %rbp\n"
+	"\tpushq %rbx\n"
+	"\tpushq %r12\n"
+	"\tpushq %r13\n"
+	"\tpushq %r14\n"
+	"\tpushq %r15\n"
+	"\tmovq %rsp, (%rdi)\n"
+	"\tmovq %rsi, %rsp\n"
+	"\tpopq %r15\n"
+	"\tpopq %r14\n"
+	"\tpopq %r13\n"
+	"\tpopq %r12\n"
+	"\tpopq %rbx\n"
+	"\tpopq %rbp\n"
+	"\tretq\n"
+	"\t.size coro_asm_switch, . - coro_asm_switch\n"
+	"\t.globl coro_asm_entry\n"
+	"\t.type coro_asm_entry, @function\n"
+	"coro_asm_entry:\n"
+	"\tmovq %r12, %rdi\n"
+	"\tmovq %rbx, %rsi\n"
+	"\tcallq coro_asm_body\n"
+	"\t.size coro_asm_entry, . - coro_asm_entry\n"
+);
+
+/** Build the first frame on a fresh stack. */
+static void
+coro_ctx_create(struct coro *c, struct coro_engine *engine)
+{
+	uintptr_t top = ((uintptr_t)c->stack + c->stack_size) &
+		~(uintptr_t)15;
+	void **sp = (void **)top;
+	/*
+	 * The slot the first switch 'returns' through. The
+	 * alignment is picked so the ABI-required stack alignment
+	 * holds inside the entry.
+	 */
+	*--sp = (void *)(uintptr_t)coro_asm_entry;
+	*--sp = NULL;			/* rbp. */
+	*--sp = engine;			/* rbx. */
+	*--sp = c;			/* r12. */
+	*--sp = NULL;			/* r13. */
+	*--sp = NULL;			/* r14. */
+	*--sp = NULL;			/* r15. */
+	c->ctx = sp;
+}
+
+#elif defined(__aarch64__)
+
+__asm__(
+	"\t.text\n"
+	"\t.align 4\n"
+	"\t.globl coro_asm_switch\n"
+	"\t.type coro_asm_switch, @function\n"
+	"coro_asm_switch:\n"
+	"\tstp x29, x30, [sp, #-160]!\n"
+	"\tstp x19, x20, [sp, #16]\n"
+	"\tstp x21, x22, [sp, #32]\n"
+	"\tstp x23, x24, [sp, #48]\n"
+	"\tstp x25, x26, [sp, #64]\n"
+	"\tstp x27, x28, [sp, #80]\n"
+	"\tstp d8, d9, [sp, #96]\n"
+	"\tstp d10, d11, [sp, #112]\n"
+	"\tstp d12, d13, [sp, #128]\n"
+	"\tstp d14, d15, [sp, #144]\n"
+	"\tmov x9, sp\n"
+	"\tstr x9, [x0]\n"
+	"\tmov sp, x1\n"
+	"\tldp x19, x20, [sp, #16]\n"
+	"\tldp x21, x22, [sp, #32]\n"
+	"\tldp x23, x24, [sp, #48]\n"
+	"\tldp x25, x26, [sp, #64]\n"
+	"\tldp x27, x28, [sp, #80]\n"
+	"\tldp d8, d9, [sp, #96]\n"
+	"\tldp d10, d11, [sp, #112]\n"
+	"\tldp d12, d13, [sp, #128]\n"
+	"\tldp d14, d15, [sp, #144]\n"
+	"\tldp x29, x30, [sp], #160\n"
+	"\tret\n"
+	"\t.size coro_asm_switch, . - coro_asm_switch\n"
+	"\t.globl coro_asm_entry\n"
+	"\t.type coro_asm_entry, @function\n"
+	"coro_asm_entry:\n"
+	"\tmov x0, x19\n"
+	"\tmov x1, x20\n"
+	"\tbl coro_asm_body\n"
+	"\t.size coro_asm_entry, . - coro_asm_entry\n"
+);
+
+/** Build the first frame on a fresh stack. */
+static void
+coro_ctx_create(struct coro *c, struct coro_engine *engine)
+{
+	uintptr_t top = ((uintptr_t)c->stack + c->stack_size) &
+		~(uintptr_t)15;
+	void **sp = (void **)(top - 160);
+	memset(sp, 0, 160);
+	/* x30 - where the first switch 'returns'. */
+	sp[1] = (void *)(uintptr_t)coro_asm_entry;
+	sp[2] = c;			/* x19. */
+	sp[3] = engine;			/* x20. */
+	c->ctx = sp;
+}
+
+#endif
+
+#endif /* CORO_BACKEND_ASM */
+
+/** Switch from one coroutine context into another. */
+static void
+coro_ctx_switch(struct coro *from, struct coro *to)
+{
+#if CORO_BACKEND_ASM
+	coro_asm_switch(&from->ctx, to->ctx);
+#else
 	if (sigsetjmp(from->ctx, 0) == 0)
 		siglongjmp(to->ctx, 1);
-	assert(rlist_empty(&from->link));
+#endif
+}
+
+static void
+coro_engine_adopt(struct coro_engine *engine, struct coro *coro);
+
+/**
+ * Retire a finished detached coroutine - release its stack into
+ * the stack pool and free the struct. Nothing of the coroutine
+ * survives, so the caller must be off its stack already: either
+ * on the destination side of the switch away from it, or the
+ * coroutine finished and parked earlier.
+ */
+static void
+coro_engine_reclaim_detached(struct coro_engine *engine, struct coro *c)
+{
+	assert(c->is_detached);
+	assert(c->state == CORO_STATE_FINISHED);
+	assert(c->joiner == NULL);
+	assert(rlist_empty(&c->link));
+	assert(rlist_empty(&c->timer_link));
+	coro_mt_lock_acquire();
+	coro_engine_adopt(engine, c);
+	coro_mt_lock_release();
+	coro_engine_stack_release(engine, c->stack, c->stack_size);
+	free(c);
+	assert(engine->coro_count > 0);
+	--engine->coro_count;
+}
+
+/**
+ * First steps on the destination side of a context switch: register
+ * the arrived coroutine as the current one of this thread's engine
+ * and publish the parked context of whoever the thread switched
+ * away from, so it can be resumed elsewhere. Has to run right after
+ * landing, both in coro_engine_switch_to() and at the coroutine
+ * body entry.
+ */
+static void
+coro_engine_switch_ack(struct coro *self)
+{
+	struct coro_engine *engine = coro_engine_current();
+	assert(rlist_empty(&self->link));
 	assert(engine->this == NULL);
-	engine->this = from;
+	engine->this = self;
+	struct coro *prev = engine->switch_from;
+	engine->switch_from = NULL;
+	if (prev->is_detached && prev->state == CORO_STATE_FINISHED) {
+		/*
+		 * The parked context will never be resumed - reclaim
+		 * the coroutine now that this thread is off its stack,
+		 * instead of publishing the context.
+		 */
+		coro_engine_reclaim_detached(engine, prev);
+		return;
+	}
+	__atomic_store_n(&prev->ctx_is_saved, true, __ATOMIC_RELEASE);
 }
 
+/** Switch into the given coroutine, accounting the stats. */
 static void
-coro_engine_suspend(struct coro_engine *engine)
+coro_engine_switch_to(struct coro_engine *engine, struct coro *to)
+{
+	struct coro *from = engine->this;
+	assert(from != NULL);
+	if (coro_is_mt) {
+		/*
+		 * The target can become runnable here before the
+		 * thread it ran on has finished switching away from
+		 * it. Wait until its context is fully parked.
+		 */
+		while (!__atomic_load_n(&to->ctx_is_saved, __ATOMIC_ACQUIRE))
+			sched_yield();
+	}
+
+	double now = coro_time_now();
+	from->stat.run_time += now - engine->run_start;
+	++to->stat.switch_count;
+	engine->run_start = now;
+	coro_engine_trace(engine, CORO_TRACE_RESUME, to, now);
+
+	engine->this = NULL;
+	engine->switch_from = from;
+	to->ctx_is_saved = false;
+	coro_ctx_switch(from, to);
+	/*
+	 * Control is back, but possibly on a different thread - the
+	 * engine captured above must not be touched anymore.
+	 */
+	coro_engine_switch_ack(from);
+}
+
+static void
+coro_engine_resume_next(struct coro_engine *engine)
+{
+	coro_mt_lock_acquire();
+	assert(!rlist_empty(&engine->coros_running_now));
+	struct coro *to;
+	if (coro_replay_mode == CORO_REPLAY_FORCE && !coro_is_mt) {
+		to = coro_replay_take(engine);
+	} else {
+		to = rlist_shift_entry(&engine->coros_running_now,
+			struct coro, link);
+		if (coro_replay_mode == CORO_REPLAY_RECORD && !coro_is_mt)
+			coro_replay_record(to);
+	}
+	coro_mt_lock_release();
+	coro_engine_switch_to(engine, to);
+}
+
+/**
+ * First half of a suspension - mark the current coroutine
+ * suspended. The caller then switches away with
+ * coro_engine_resume_next(). Split in two so the waiters can
+ * publish their state under the same lock section as their wait
+ * predicate check in the multi-threaded mode - otherwise a
+ * cross-thread wakeup could slip in between and get lost.
+ */
+static void
+coro_engine_suspend_start(struct coro_engine *engine)
 {
 	struct coro *this = engine->this;
 	if (this == NULL) {
@@ -115,21 +925,148 @@ coro_engine_suspend(struct coro_engine *engine)
 	assert(rlist_empty(&this->link));
 	assert(this->state == CORO_STATE_RUNNING);
 	this->state = CORO_STATE_SUSPENDED;
+	++this->stat.suspend_count;
+	coro_engine_trace(engine, CORO_TRACE_SUSPEND, this, coro_time_now());
+}
+
+static void
+coro_engine_suspend(struct coro_engine *engine)
+{
+	coro_mt_lock_acquire();
+	coro_engine_suspend_start(engine);
+	coro_mt_lock_release();
 	coro_engine_resume_next(engine);
 }
 
+/**
+ * Suspend the current coroutine, but let the timer wheel wake it
+ * up when the timeout passes. Returns 0 when woken up explicitly
+ * before the deadline, -1 on timeout.
+ */
+static int
+coro_engine_suspend_timeout(struct coro_engine *engine, double timeout)
+{
+	struct coro *this = engine->this;
+	assert(this != NULL);
+	assert(rlist_empty(&this->timer_link));
+	this->deadline = coro_time_now() + timeout;
+	this->timed_out = false;
+	uint64_t tick = this->deadline / CORO_TIMER_RESOLUTION;
+	coro_mt_lock_acquire();
+	rlist_add_tail_entry(
+		&engine->timer_wheel[tick % CORO_TIMER_WHEEL_SIZE], this,
+		timer_link);
+	++engine->timer_count;
+	this->timer_engine = engine;
+	coro_engine_suspend_start(engine);
+	coro_mt_lock_release();
+	coro_engine_resume_next(engine);
+	if (!this->timed_out) {
+		/*
+		 * Woken up externally - unregister the timer. The
+		 * resume could have landed on a different thread, so
+		 * the wheel is found via the coroutine, not via the
+		 * engine captured above.
+		 */
+		coro_mt_lock_acquire();
+		rlist_del_entry(this, timer_link);
+		assert(this->timer_engine->timer_count > 0);
+		--this->timer_engine->timer_count;
+		coro_mt_lock_release();
+		return 0;
+	}
+	return -1;
+}
+
+/**
+ * Move the coroutine into the given engine's books. The coroutine
+ * counters are per-engine and are checked on destruction, so a
+ * migration must transfer the count along. Called with the
+ * scheduler lock held in the multi-threaded mode.
+ */
+static void
+coro_engine_adopt(struct coro_engine *engine, struct coro *coro)
+{
+	if (coro->engine == engine)
+		return;
+	assert(coro->engine->coro_count > 0);
+	--coro->engine->coro_count;
+	++engine->coro_count;
+	coro->engine = engine;
+}
+
 static void
 coro_engine_yield(struct coro_engine *engine)
 {
 	struct coro *this = engine->this;
 	assert(rlist_empty(&this->link));
 	assert(this->state == CORO_STATE_RUNNING);
-	rlist_add_tail_entry(&engine->coros_running_next, this, link);
+	coro_mt_lock_acquire();
+	coro_engine_adopt(engine, this);
+	rlist_add_tail_entry(&engine->coros_running_next[this->prio], this,
+		link);
+	coro_mt_lock_release();
 	coro_engine_resume_next(engine);
 }
 
+/**
+ * Hand the control straight to the target coroutine, without a
+ * pass through the scheduler. The current coroutine stays
+ * runnable, like after a plain yield. Note that the handoff
+ * ignores the priority classes - the target runs right now no
+ * matter its priority.
+ */
 static void
-coro_engine_wakeup(struct coro_engine *engine, struct coro *coro)
+coro_engine_yield_to(struct coro_engine *engine, struct coro *target)
+{
+	struct coro *this = engine->this;
+	assert(this != NULL);
+	assert(rlist_empty(&this->link));
+	assert(this->state == CORO_STATE_RUNNING);
+	if (target == this)
+		return;
+	coro_mt_lock_acquire();
+	if (target->state == CORO_STATE_FINISHED) {
+		/* Nobody to hand over to - degrade to a fair yield. */
+		coro_mt_lock_release();
+		coro_engine_yield(engine);
+		return;
+	}
+	if (target->state == CORO_STATE_SUSPENDED) {
+		target->state = CORO_STATE_RUNNING;
+		coro_engine_trace(engine, CORO_TRACE_WAKEUP, target,
+			coro_time_now());
+	} else {
+		assert(target->state == CORO_STATE_RUNNING);
+		if (coro_is_mt && rlist_empty(&target->link)) {
+			/*
+			 * Executing on another thread right now - a
+			 * handoff is impossible, fall back to a fair
+			 * yield.
+			 */
+			coro_mt_lock_release();
+			coro_engine_yield(engine);
+			return;
+		}
+		/* Already runnable - pull it out of the ready queue. */
+		assert(!rlist_empty(&target->link));
+		rlist_del_entry(target, link);
+	}
+	coro_engine_adopt(engine, target);
+	coro_engine_adopt(engine, this);
+	rlist_add_tail_entry(&engine->coros_running_next[this->prio], this,
+		link);
+	coro_mt_lock_release();
+	coro_engine_switch_to(engine, target);
+}
+
+/**
+ * The wakeup itself. Called with the scheduler lock held in the
+ * multi-threaded mode - there the coroutine goes to the ready queue
+ * of its own engine shard, not of the waker's one.
+ */
+static void
+coro_engine_wakeup_do(struct coro_engine *engine, struct coro *coro)
 {
 	if (coro->state == CORO_STATE_RUNNING)
 		return;
@@ -138,7 +1075,197 @@ coro_engine_wakeup(struct coro_engine *engine, struct coro *coro)
 	assert(coro->state == CORO_STATE_SUSPENDED);
 	assert(rlist_empty(&coro->link));
 	coro->state = CORO_STATE_RUNNING;
-	rlist_add_tail_entry(&engine->coros_running_next, coro, link);
+	struct coro_engine *home = coro_is_mt ? coro->engine : engine;
+	coro_engine_trace(home, CORO_TRACE_WAKEUP, coro, coro_time_now());
+	rlist_add_tail_entry(&home->coros_running_next[coro->prio], coro,
+		link);
+}
+
+static void
+coro_engine_wakeup(struct coro_engine *engine, struct coro *coro)
+{
+	coro_mt_lock_acquire();
+	coro_engine_wakeup_do(engine, coro);
+	coro_mt_lock_release();
+	if (coro_is_mt)
+		pthread_cond_broadcast(&coro_mt_cond);
+}
+
+/**
+ * Collect the fds which became ready and wake their waiting
+ * coroutines. @a timeout_ms goes straight to epoll: zero makes it a
+ * non-blocking poll for the busy passes, -1 blocks until an event
+ * when there is nothing else to do.
+ */
+static void
+coro_engine_fds_dispatch(struct coro_engine *engine, int timeout_ms)
+{
+	struct epoll_event evs[16];
+	int rc = epoll_wait(engine->epoll_fd, evs, 16, timeout_ms);
+	if (rc < 0) {
+		if (errno == EINTR)
+			return;
+		handle_error();
+	}
+	for (int i = 0; i < rc; ++i) {
+		struct coro *c = evs[i].data.ptr;
+		int events = 0;
+		if ((evs[i].events & EPOLLIN) != 0)
+			events |= CORO_FD_READ;
+		if ((evs[i].events & EPOLLOUT) != 0)
+			events |= CORO_FD_WRITE;
+		/* Errors and hangups must wake the waiter too. */
+		if ((evs[i].events & (EPOLLERR | EPOLLHUP)) != 0)
+			events |= CORO_FD_READ | CORO_FD_WRITE;
+		c->fd_events = events;
+		coro_engine_wakeup(engine, c);
+	}
+}
+
+/**
+ * Park the current coroutine in the engine's epoll set until the fd
+ * is ready. The registration is one-shot - the fd is removed from
+ * the set right after the resume, also when the coroutine was woken
+ * up explicitly instead.
+ */
+static int
+coro_engine_fd_wait(struct coro_engine *engine, int fd, int events)
+{
+	struct coro *this = engine->this;
+	assert(this != NULL);
+	assert(events != 0);
+	assert((events & ~(CORO_FD_READ | CORO_FD_WRITE)) == 0);
+	if (engine->epoll_fd < 0) {
+		engine->epoll_fd = epoll_create1(0);
+		if (engine->epoll_fd < 0)
+			handle_error();
+	}
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	if ((events & CORO_FD_READ) != 0)
+		ev.events |= EPOLLIN;
+	if ((events & CORO_FD_WRITE) != 0)
+		ev.events |= EPOLLOUT;
+	ev.events |= EPOLLONESHOT;
+	ev.data.ptr = this;
+	if (epoll_ctl(engine->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+		handle_error();
+	this->fd_events = 0;
+	this->fd_engine = engine;
+	this->wait_fd = fd;
+	coro_mt_lock_acquire();
+	++engine->fd_wait_count;
+	coro_engine_suspend_start(engine);
+	coro_mt_lock_release();
+	coro_engine_resume_next(engine);
+	/*
+	 * The resume could have landed on a different thread - the
+	 * set the fd sits in is found via the coroutine, not via the
+	 * engine captured above.
+	 */
+	struct coro_engine *origin = this->fd_engine;
+	this->fd_engine = NULL;
+	if (epoll_ctl(origin->epoll_fd, EPOLL_CTL_DEL, this->wait_fd,
+	    NULL) != 0)
+		handle_error();
+	coro_mt_lock_acquire();
+	assert(origin->fd_wait_count > 0);
+	--origin->fd_wait_count;
+	coro_mt_lock_release();
+	return this->fd_events;
+}
+
+/**
+ * Wakeup a whole batch of coroutines, entering the ready queues
+ * with one splice per priority class instead of one list insertion
+ * per coroutine. In the multi-threaded mode the coroutines are
+ * spread over their home shards, so the batch degrades to a loop
+ * under one lock acquisition.
+ */
+static void
+coro_engine_wakeup_many(struct coro_engine *engine, struct coro **coros,
+	size_t count)
+{
+	if (coro_is_mt) {
+		pthread_mutex_lock(&coro_mt_lock);
+		for (size_t i = 0; i < count; ++i)
+			coro_engine_wakeup_do(engine, coros[i]);
+		pthread_mutex_unlock(&coro_mt_lock);
+		pthread_cond_broadcast(&coro_mt_cond);
+		return;
+	}
+	struct rlist batch[CORO_PRIO_COUNT];
+	for (int i = 0; i < CORO_PRIO_COUNT; ++i)
+		rlist_create(&batch[i]);
+	for (size_t i = 0; i < count; ++i) {
+		struct coro *c = coros[i];
+		if (c->state != CORO_STATE_SUSPENDED)
+			continue;
+		c->state = CORO_STATE_RUNNING;
+		assert(rlist_empty(&c->link));
+		rlist_add_tail_entry(&batch[c->prio], c, link);
+	}
+	for (int i = 0; i < CORO_PRIO_COUNT; ++i)
+		rlist_splice_tail(&engine->coros_running_next[i], &batch[i]);
+}
+
+/**
+ * Steal about half of some other shard's ready queues. Only the
+ * next-pass queues are up for grabs - a shard's current pass is its
+ * own. Called with the scheduler lock held.
+ */
+static bool
+coro_engine_steal(struct coro_engine *thief)
+{
+	for (int e = 0; e < coro_engine_count; ++e) {
+		struct coro_engine *victim = coro_engines[e];
+		if (victim == thief)
+			continue;
+		bool found = false;
+		for (int i = 0; i < CORO_PRIO_COUNT; ++i) {
+			struct rlist *queue = &victim->coros_running_next[i];
+			size_t count = 0;
+			struct rlist *item;
+			rlist_foreach(item, queue)
+				++count;
+			for (size_t j = 0; j < (count + 1) / 2; ++j) {
+				struct coro *c = rlist_shift_entry(queue,
+					struct coro, link);
+				coro_engine_adopt(thief, c);
+				rlist_add_tail_entry(
+					&thief->coros_running_next[i], c,
+					link);
+				found = true;
+			}
+		}
+		if (found)
+			return true;
+	}
+	return false;
+}
+
+/**
+ * Whether the whole multi-threaded run has drained - nothing is
+ * ready, nothing is being run and no timers are ticking on any
+ * shard. Called with the scheduler lock held.
+ */
+static bool
+coro_engine_mt_all_idle(void)
+{
+	if (coro_mt_busy != 0)
+		return false;
+	for (int e = 0; e < coro_engine_count; ++e) {
+		struct coro_engine *engine = coro_engines[e];
+		if (engine->timer_count != 0)
+			return false;
+		if (engine->fd_wait_count != 0)
+			return false;
+		for (int i = 0; i < CORO_PRIO_COUNT; ++i) {
+			if (!rlist_empty(&engine->coros_running_next[i]))
+				return false;
+		}
+	}
+	return true;
 }
 
 static void
@@ -146,10 +1273,106 @@ coro_engine_run(struct coro_engine *engine)
 {
 	while (true) {
 		assert(rlist_empty(&engine->coros_running_now));
-		rlist_splice_tail(&engine->coros_running_now,
-			&engine->coros_running_next);
-		if (rlist_empty(&engine->coros_running_now))
-			break;
+		if (engine->poll_cb != NULL)
+			engine->poll_cb(engine->poll_arg);
+		if (engine->fd_wait_count > 0)
+			coro_engine_fds_dispatch(engine, 0);
+		coro_engine_timers_expire(engine);
+		coro_mt_lock_acquire();
+		for (int i = 0; i < CORO_PRIO_COUNT; ++i) {
+			rlist_splice_tail(&engine->coros_running_now,
+				&engine->coros_running_next[i]);
+		}
+		if (coro_is_mt && rlist_empty(&engine->coros_running_now) &&
+		    coro_engine_steal(engine)) {
+			for (int i = 0; i < CORO_PRIO_COUNT; ++i) {
+				rlist_splice_tail(&engine->coros_running_now,
+					&engine->coros_running_next[i]);
+			}
+		}
+		bool have_work = !rlist_empty(&engine->coros_running_now);
+		if (have_work && coro_is_mt)
+			++coro_mt_busy;
+		coro_mt_lock_release();
+		if (engine->trace_dump_requested) {
+			engine->trace_dump_requested = 0;
+			coro_engine_trace_dump(engine);
+		}
+		if (!have_work) {
+			if (!coro_is_mt) {
+				if (engine->timer_count == 0 &&
+				    engine->fd_wait_count == 0)
+					break;
+				/*
+				 * Everybody waits on timers or on fds -
+				 * block until the nearest deadline or an
+				 * fd event instead of spinning. Negative
+				 * means no deadline at all.
+				 */
+				double timeout = -1;
+				if (engine->timer_count != 0) {
+					timeout =
+						coro_engine_timers_next_deadline(
+							engine) - coro_time_now();
+					if (timeout < 0)
+						timeout = 0;
+				}
+				/*
+				 * With a poll callback set, wake up at
+				 * the wheel resolution to pump the
+				 * external events.
+				 */
+				if (engine->poll_cb != NULL &&
+				    (timeout < 0 ||
+				     timeout > CORO_TIMER_RESOLUTION))
+					timeout = CORO_TIMER_RESOLUTION;
+				if (engine->fd_wait_count > 0) {
+					int ms = -1;
+					if (timeout == 0)
+						ms = 0;
+					else if (timeout > 0)
+						ms = timeout * 1000 + 1;
+					coro_engine_fds_dispatch(engine, ms);
+				} else if (timeout > 0) {
+					struct timespec ts;
+					ts.tv_sec = timeout;
+					ts.tv_nsec = (timeout - ts.tv_sec) *
+						1e9;
+					nanosleep(&ts, NULL);
+				}
+				continue;
+			}
+			/*
+			 * Nothing to run and nothing to steal. Either
+			 * the whole run has drained, or some other
+			 * shard is still busy and can produce work -
+			 * wait for a wakeup, re-checking the timers
+			 * and the steal targets at the wheel
+			 * resolution.
+			 */
+			pthread_mutex_lock(&coro_mt_lock);
+			if (coro_mt_done) {
+				pthread_mutex_unlock(&coro_mt_lock);
+				break;
+			}
+			if (coro_engine_mt_all_idle()) {
+				coro_mt_done = true;
+				pthread_mutex_unlock(&coro_mt_lock);
+				pthread_cond_broadcast(&coro_mt_cond);
+				break;
+			}
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += CORO_TIMER_RESOLUTION * 1e9;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_nsec -= 1000000000;
+				++ts.tv_sec;
+			}
+			pthread_cond_timedwait(&coro_mt_cond, &coro_mt_lock,
+				&ts);
+			pthread_mutex_unlock(&coro_mt_lock);
+			continue;
+		}
 
 		assert(engine->this == NULL);
 		engine->this = &engine->sched;
@@ -159,12 +1382,21 @@ coro_engine_run(struct coro_engine *engine)
 		 * comes back in the end of this iteration of the
 		 * loop.
 		 */
+		coro_mt_lock_acquire();
 		rlist_add_tail_entry(&engine->coros_running_now,
 			&engine->sched, link);
+		coro_mt_lock_release();
 		coro_engine_resume_next(engine);
 		assert(rlist_empty(&engine->coros_running_now));
 		assert(engine->this == &engine->sched);
 		engine->this = NULL;
+		if (coro_is_mt) {
+			pthread_mutex_lock(&coro_mt_lock);
+			assert(coro_mt_busy > 0);
+			--coro_mt_busy;
+			pthread_mutex_unlock(&coro_mt_lock);
+			pthread_cond_broadcast(&coro_mt_cond);
+		}
 	}
 }
 
@@ -173,19 +1405,75 @@ coro_engine_destroy(struct coro_engine *engine)
 {
 	assert(engine->this == NULL);
 	assert(rlist_empty(&engine->coros_running_now));
-	assert(rlist_empty(&engine->coros_running_next));
-	while (!rlist_empty(&engine->coros_pool)) {
-		struct coro *c = rlist_shift_entry(&engine->coros_pool,
+	for (int i = 0; i < CORO_PRIO_COUNT; ++i)
+		assert(rlist_empty(&engine->coros_running_next[i]));
+	while (!crlist_empty(&engine->coros_pool)) {
+		struct coro *c = crlist_shift_entry(&engine->coros_pool,
 			struct coro, link);
-		free(c->stack);
+		coro_stack_unmap(c->stack, c->stack_size);
 		free(c);
 		assert(engine->coro_count > 0);
 		--engine->coro_count;
 	}
 	assert(engine->coro_count == 0);
+	for (int i = 0; i < CORO_STACK_TIER_COUNT; ++i) {
+		struct coro_stack_tier *tier = &engine->stack_pool[i];
+		while (!crlist_empty(&tier->stacks)) {
+			struct coro_stack *s = crlist_shift_entry(&tier->stacks,
+				struct coro_stack, link);
+			coro_stack_unmap(s, tier->stack_size);
+		}
+	}
+	assert(engine->fd_wait_count == 0);
+	if (engine->epoll_fd >= 0)
+		close(engine->epoll_fd);
 	memset(engine, '#', sizeof(*engine));
 }
 
+#if CORO_BACKEND_ASM
+
+/**
+ * Body of a coroutine with the asm backend. Entered via
+ * coro_asm_entry right on the new stack, no signals involved.
+ * Mirrors the loop of coro_body() below - when the coroutine
+ * finishes, it waits in-place for a possible restart from the
+ * pool. Referenced only from the asm entry, hence the 'used'
+ * attribute.
+ */
+__attribute__((used)) static void
+coro_asm_body(struct coro *c, struct coro_engine *engine)
+{
+	/*
+	 * The creation-time engine - the coroutine can be stolen by
+	 * another shard before its first run, so the current engine
+	 * is re-fetched on every resume instead.
+	 */
+	(void)engine;
+	coro_engine_switch_ack(c);
+	while (true) {
+		if (c->stack_needs_poison) {
+			c->stack_needs_poison = false;
+			coro_stack_poison_below(c);
+		}
+		c->ret = c->func(c->func_arg);
+		c->func = NULL;
+		coro_mt_lock_acquire();
+		assert(c->state == CORO_STATE_RUNNING);
+		c->state = CORO_STATE_FINISHED;
+		if (c->joiner != NULL)
+			coro_engine_wakeup_do(coro_engine_current(),
+				c->joiner);
+		coro_mt_lock_release();
+		if (coro_is_mt)
+			pthread_cond_broadcast(&coro_mt_cond);
+		coro_engine_resume_next(coro_engine_current());
+		assert(c->state == CORO_STATE_RUNNING);
+		assert(c->func != NULL);
+	}
+}
+
+#else /* !CORO_BACKEND_ASM */
+
 static __thread struct coro_engine *new_coro_engine = NULL;
 
 /**
@@ -211,17 +1499,27 @@ coro_body(int signum)
 		siglongjmp(my_engine->start_point, 1);
 	/*
 	 * If the execution is here, then the coroutine should
-	 * finally start work.
+	 * finally start work. Possibly on another thread already -
+	 * my_engine above is only valid for the construction.
 	 */
-	my_engine->this = c;
+	coro_engine_switch_ack(c);
 	while (true) {
+		if (c->stack_needs_poison) {
+			c->stack_needs_poison = false;
+			coro_stack_poison_below(c);
+		}
 		c->ret = c->func(c->func_arg);
 		c->func = NULL;
+		coro_mt_lock_acquire();
 		assert(c->state == CORO_STATE_RUNNING);
 		c->state = CORO_STATE_FINISHED;
 		if (c->joiner != NULL)
-			coro_engine_wakeup(my_engine, c->joiner);
-		coro_engine_resume_next(my_engine);
+			coro_engine_wakeup_do(coro_engine_current(),
+				c->joiner);
+		coro_mt_lock_release();
+		if (coro_is_mt)
+			pthread_cond_broadcast(&coro_mt_cond);
+		coro_engine_resume_next(coro_engine_current());
 		/*
 		 * Here it is restarted already, must have its
 		 * state restored.
@@ -231,20 +1529,47 @@ coro_body(int signum)
 	}
 }
 
+#endif /* !CORO_BACKEND_ASM */
+
 static struct coro *
-coro_engine_spawn_new(struct coro_engine *engine, coro_f func, void *func_arg)
+coro_engine_spawn_new(struct coro_engine *engine, coro_f func, void *func_arg,
+	enum coro_prio prio)
 {
 	struct coro *c = malloc(sizeof(*c));
 	c->state = CORO_STATE_RUNNING;
 	c->ret = NULL;
-	int stack_size = 1024 * 1024;
-	if (stack_size < SIGSTKSZ)
+	size_t stack_size = 1024 * 1024;
+	if (stack_size < (size_t)SIGSTKSZ)
 		stack_size = SIGSTKSZ;
-	c->stack = malloc(stack_size);
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	stack_size = (stack_size + page_size - 1) / page_size * page_size;
+	c->stack = coro_engine_stack_acquire(engine, stack_size);
+	c->stack_size = stack_size;
+	/*
+	 * A stack from the pool was poisoned on release, a fresh one
+	 * reads as zeroes - either way the watermark is armed.
+	 */
+	c->stack_needs_poison = false;
 	c->func = func;
 	c->func_arg = func_arg;
+	c->prio = prio;
+	memset(&c->stat, 0, sizeof(c->stat));
 	c->joiner = NULL;
+	c->is_detached = false;
 	rlist_create(&c->link);
+	rlist_create(&c->timer_link);
+	memset(c->local, 0, sizeof(c->local));
+	c->engine = engine;
+	c->timer_engine = NULL;
+	/* The freshly built context is parked until the first run. */
+	c->ctx_is_saved = true;
+#if CORO_BACKEND_ASM
+	/*
+	 * With the asm backend the first frame is simply built on
+	 * the new stack by hand - no signal work is needed at all.
+	 */
+	coro_ctx_create(c, engine);
+#else
 	/*
 	 * SIGUSR2 is used. First of all, block new signals to be
 	 * able to set a new handler.
@@ -268,7 +1593,7 @@ coro_engine_spawn_new(struct coro_engine *engine, coro_f func, void *func_arg)
 	/* Create that new stack. */
 	stack_t oldst, newst;
 	newst.ss_sp = c->stack;
-	newst.ss_size = stack_size;
+	newst.ss_size = c->stack_size;
 	newst.ss_flags = 0;
 	if (sigaltstack(&newst, &oldst) != 0)
 		handle_error();
@@ -305,51 +1630,128 @@ coro_engine_spawn_new(struct coro_engine *engine, coro_f func, void *func_arg)
 		handle_error();
 	if (sigprocmask(SIG_SETMASK, &olds, NULL) != 0)
 		handle_error();
+#endif /* !CORO_BACKEND_ASM */
 
 	/* Now scheduler can work with that coroutine. */
 	++engine->coro_count;
 	assert(rlist_empty(&c->link));
-	rlist_add_tail_entry(&engine->coros_running_next, c, link);
+	coro_mt_lock_acquire();
+	c->id = coro_id_next++;
+	rlist_add_tail_entry(&engine->coros_running_next[prio], c, link);
+	coro_mt_lock_release();
+	if (coro_is_mt)
+		pthread_cond_broadcast(&coro_mt_cond);
 	return c;
 }
 
 static struct coro *
-coro_engine_spawn(struct coro_engine *engine, coro_f func, void *func_arg)
+coro_engine_spawn(struct coro_engine *engine, coro_f func, void *func_arg,
+	enum coro_prio prio)
 {
-	if (rlist_empty(&engine->coros_pool))
-		return coro_engine_spawn_new(engine, func, func_arg);
+	if (crlist_empty(&engine->coros_pool))
+		return coro_engine_spawn_new(engine, func, func_arg, prio);
 
-	struct coro *c = rlist_shift_entry(&engine->coros_pool,
+	struct coro *c = crlist_shift_entry(&engine->coros_pool,
 		struct coro, link);
+	/*
+	 * The stack still carries the previous owner's data plus the
+	 * parked body continuation - it is re-poisoned from inside
+	 * the body, which knows what is dead.
+	 */
+	c->stack_needs_poison = true;
 	c->func = func;
 	c->func_arg = func_arg;
+	c->prio = prio;
+	memset(&c->stat, 0, sizeof(c->stat));
+	memset(c->local, 0, sizeof(c->local));
 	c->state = CORO_STATE_RUNNING;
+	assert(!c->is_detached);
+	assert(c->engine == engine);
+	assert(c->ctx_is_saved);
 	assert(rlist_empty(&c->link));
-	rlist_add_tail_entry(&engine->coros_running_next, c, link);
+	coro_mt_lock_acquire();
+	c->id = coro_id_next++;
+	rlist_add_tail_entry(&engine->coros_running_next[prio], c, link);
+	coro_mt_lock_release();
+	if (coro_is_mt)
+		pthread_cond_broadcast(&coro_mt_cond);
 	return c;
 }
 
 static void *
 coro_engine_join(struct coro_engine *engine, struct coro *coro)
 {
+	struct coro *self = engine->this;
+	coro_mt_lock_acquire();
+	assert(!coro->is_detached);
 	assert(coro->joiner == NULL);
-	coro->joiner = engine->this;
+	coro->joiner = self;
+	/*
+	 * The finish check and the suspension must sit under one
+	 * lock section - otherwise the finish can slip in between
+	 * and its wakeup gets lost.
+	 */
 	while (coro->state == CORO_STATE_RUNNING ||
-		coro->state == CORO_STATE_SUSPENDED)
-		coro_engine_suspend(engine);
+	       coro->state == CORO_STATE_SUSPENDED) {
+		engine = coro_engine_current();
+		coro_engine_suspend_start(engine);
+		coro_mt_lock_release();
+		coro_engine_resume_next(engine);
+		coro_mt_lock_acquire();
+	}
 	assert(coro->state == CORO_STATE_FINISHED);
-	assert(coro->joiner == engine->this);
+	assert(coro->joiner == self);
 	coro->joiner = NULL;
+	/* The joiner could have been resumed on another thread. */
+	engine = coro_engine_current();
+	coro_engine_adopt(engine, coro);
+	coro_mt_lock_release();
 	void *ret = coro->ret;
 	coro->ret = NULL;
 	assert(rlist_empty(&coro->link));
-	rlist_add_entry(&engine->coros_pool, coro, link);
+	if (crlist_size(&engine->coros_pool) < engine->stack_pool_limit) {
+		crlist_add_entry(&engine->coros_pool, coro, link);
+	} else {
+		/*
+		 * Too many idle coroutines - retire the struct, but
+		 * keep the warmed stack in the pool if there is
+		 * space.
+		 */
+		coro_engine_stack_release(engine, coro->stack,
+			coro->stack_size);
+		free(coro);
+		assert(engine->coro_count > 0);
+		--engine->coro_count;
+	}
 	return ret;
 }
 
-//////////////////////////////////////////////////////////////////
+static void
+coro_engine_detach(struct coro_engine *engine, struct coro *coro)
+{
+	coro_mt_lock_acquire();
+	assert(!coro->is_detached);
+	assert(coro->joiner == NULL);
+	if (coro->state != CORO_STATE_FINISHED) {
+		/* Still alive - the finish switch will reclaim it. */
+		coro->is_detached = true;
+		coro_mt_lock_release();
+		return;
+	}
+	coro->is_detached = true;
+	coro_mt_lock_release();
+	if (coro_is_mt) {
+		/*
+		 * Finished, but the thread it ran on can still be in
+		 * the middle of switching off its stack.
+		 */
+		while (!__atomic_load_n(&coro->ctx_is_saved, __ATOMIC_ACQUIRE))
+			sched_yield();
+	}
+	coro_engine_reclaim_detached(engine, coro);
+}
 
-static struct coro_engine glob_engine;
+//////////////////////////////////////////////////////////////////
 
 void
 coro_sched_init(void)
@@ -363,44 +1765,453 @@ coro_sched_run(void)
 	coro_engine_run(&glob_engine);
 }
 
+static void *
+coro_worker_main(void *arg)
+{
+	struct coro_engine *engine = arg;
+	coro_this_engine = engine;
+	coro_engine_run(engine);
+	coro_this_engine = NULL;
+	return NULL;
+}
+
+/**
+ * The extra engine shards of the multi-threaded runs. They outlive
+ * the runs themselves - finished coroutines keep referencing their
+ * shard until joined, so the shards can be drained and destroyed
+ * only in coro_sched_destroy(), when everything is joined back.
+ * An array of pointers, not of engines - the engines hold intrusive
+ * list heads and are pointed at by their coroutines, so their
+ * addresses must survive the array growing for a wider run.
+ */
+static struct coro_engine **coro_extra_engines = NULL;
+static int coro_extra_count = 0;
+
+void
+coro_sched_run_workers(int worker_count)
+{
+	assert(worker_count > 0);
+	if (worker_count > CORO_WORKER_MAX)
+		worker_count = CORO_WORKER_MAX;
+	if (worker_count == 1) {
+		coro_engine_run(&glob_engine);
+		return;
+	}
+	int extra_count = worker_count - 1;
+	if (extra_count > coro_extra_count) {
+		coro_extra_engines = realloc(coro_extra_engines,
+			extra_count * sizeof(*coro_extra_engines));
+		for (int i = coro_extra_count; i < extra_count; ++i) {
+			coro_extra_engines[i] =
+				malloc(sizeof(*coro_extra_engines[i]));
+			coro_engine_create(coro_extra_engines[i]);
+		}
+		coro_extra_count = extra_count;
+	}
+	pthread_t *threads = malloc(extra_count * sizeof(*threads));
+	coro_engines[0] = &glob_engine;
+	coro_engine_count = 1;
+	for (int i = 0; i < extra_count; ++i)
+		coro_engines[coro_engine_count++] = coro_extra_engines[i];
+	coro_mt_busy = 0;
+	coro_mt_done = false;
+	coro_is_mt = true;
+	for (int i = 0; i < extra_count; ++i) {
+		if (pthread_create(&threads[i], NULL, coro_worker_main,
+				   coro_extra_engines[i]) != 0)
+			handle_error();
+	}
+	coro_this_engine = &glob_engine;
+	coro_engine_run(&glob_engine);
+	for (int i = 0; i < extra_count; ++i)
+		pthread_join(threads[i], NULL);
+	coro_this_engine = NULL;
+	coro_is_mt = false;
+	coro_engine_count = 0;
+	free(threads);
+}
+
 void
 coro_sched_destroy(void)
 {
+	for (int i = 0; i < coro_extra_count; ++i) {
+		coro_engine_destroy(coro_extra_engines[i]);
+		free(coro_extra_engines[i]);
+	}
+	free(coro_extra_engines);
+	coro_extra_engines = NULL;
+	coro_extra_count = 0;
 	coro_engine_destroy(&glob_engine);
 }
 
+void
+coro_sched_set_poll_cb(coro_poll_f cb, void *arg)
+{
+	glob_engine.poll_cb = cb;
+	glob_engine.poll_arg = arg;
+}
+
+void
+coro_sched_set_stack_pool_limit(size_t limit)
+{
+	glob_engine.stack_pool_limit = limit;
+}
+
 struct coro *
 coro_this(void)
 {
-	return glob_engine.this;
+	return coro_engine_current()->this;
+}
+
+void
+coro_local_set(int slot, void *value)
+{
+	assert(slot >= 0 && slot < CORO_LOCAL_SLOT_COUNT);
+	struct coro *this = coro_engine_current()->this;
+	assert(this != NULL);
+	this->local[slot] = value;
+}
+
+void *
+coro_local_get(int slot)
+{
+	assert(slot >= 0 && slot < CORO_LOCAL_SLOT_COUNT);
+	struct coro *this = coro_engine_current()->this;
+	assert(this != NULL);
+	return this->local[slot];
 }
 
 struct coro *
 coro_new(coro_f func, void *func_arg)
 {
-	return coro_engine_spawn(&glob_engine, func, func_arg);
+	return coro_engine_spawn(coro_engine_current(), func, func_arg,
+		CORO_PRIO_NORMAL);
+}
+
+struct coro *
+coro_new_with_prio(coro_f func, void *func_arg, enum coro_prio prio)
+{
+	assert(prio < CORO_PRIO_COUNT);
+	return coro_engine_spawn(coro_engine_current(), func, func_arg, prio);
 }
 
 void *
 coro_join(struct coro *coro)
 {
-	return coro_engine_join(&glob_engine, coro);
+	return coro_engine_join(coro_engine_current(), coro);
+}
+
+void
+coro_detach(struct coro *coro)
+{
+	coro_engine_detach(coro_engine_current(), coro);
 }
 
 void
 coro_suspend(void)
 {
-	coro_engine_suspend(&glob_engine);
+	coro_engine_suspend(coro_engine_current());
+}
+
+int
+coro_suspend_timeout(double timeout)
+{
+	return coro_engine_suspend_timeout(coro_engine_current(), timeout);
+}
+
+void
+coro_sleep(double duration)
+{
+	int rc = coro_engine_suspend_timeout(coro_engine_current(), duration);
+	/* A sleeping coroutine is not woken up externally. */
+	(void)rc;
+}
+
+int
+coro_fd_wait(int fd, int events)
+{
+	return coro_engine_fd_wait(coro_engine_current(), fd, events);
 }
 
 void
 coro_yield(void)
 {
-	coro_engine_yield(&glob_engine);
+	coro_engine_yield(coro_engine_current());
+}
+
+void
+coro_yield_to(struct coro *coro)
+{
+	coro_engine_yield_to(coro_engine_current(), coro);
 }
 
 void
 coro_wakeup(struct coro *coro)
 {
-	coro_engine_wakeup(&glob_engine, coro);
+	coro_engine_wakeup(coro_engine_current(), coro);
+}
+
+void
+coro_wakeup_many(struct coro **coros, size_t count)
+{
+	coro_engine_wakeup_many(coro_engine_current(), coros, count);
+}
+
+void
+coro_stat_get(const struct coro *coro, struct coro_stat *stat)
+{
+	*stat = coro->stat;
+}
+
+size_t
+coro_stack_high_water(const struct coro *coro)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	char *stack = coro->stack;
+	char *end = stack + coro->stack_size;
+	unsigned char vec[64];
+	/*
+	 * Find the lowest resident page - everything below it was
+	 * never touched and doesn't even need reading.
+	 */
+	char *pos = stack;
+	char *low = end;
+	while (pos < end && low == end) {
+		size_t chunk = (end - pos) / page_size;
+		if (chunk > sizeof(vec))
+			chunk = sizeof(vec);
+		if (mincore(pos, chunk * page_size, (void *)vec) != 0)
+			handle_error();
+		for (size_t i = 0; i < chunk; ++i) {
+			if ((vec[i] & 1) != 0) {
+				low = pos + i * page_size;
+				break;
+			}
+		}
+		pos += chunk * page_size;
+	}
+	/*
+	 * Scan up to the deepest byte the coroutine has written.
+	 * Untouched memory holds either the poison pattern (a stack
+	 * reused via the pool) or zeroes (a freshly committed page).
+	 */
+	while (low < end &&
+	       (*low == (char)CORO_STACK_POISON_BYTE || *low == 0))
+		++low;
+	return end - low;
+}
+
+size_t
+coro_sched_queue_depth(void)
+{
+	struct coro_engine *engine = &glob_engine;
+	size_t depth = 0;
+	struct rlist *item;
+	rlist_foreach(item, &engine->coros_running_now)
+		++depth;
+	for (int i = 0; i < CORO_PRIO_COUNT; ++i) {
+		rlist_foreach(item, &engine->coros_running_next[i])
+			++depth;
+	}
+	/* The scheduler itself can sit in the run list. */
+	if (!rlist_empty(&engine->sched.link))
+		--depth;
+	return depth;
+}
+
+void
+coro_sched_trace_dump(void)
+{
+	coro_engine_trace_dump(&glob_engine);
+}
+
+static void
+coro_trace_dump_sig_handler(int signum)
+{
+	(void)signum;
+	glob_engine.trace_dump_requested = 1;
+}
+
+void
+coro_sched_trace_dump_on_sigusr1(void)
+{
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = coro_trace_dump_sig_handler;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, NULL);
+}
+
+/*
+ * Watchdog of non-yielding coroutines, see
+ * coro_sched_watchdog_start(). The checker is a plain sibling
+ * thread, not a SIGALRM handler - it reads foreign engine fields
+ * and samples stacks with mincore(), none of which belongs in a
+ * signal context.
+ */
+static pthread_t coro_watchdog_thread;
+static bool coro_watchdog_is_running = false;
+static double coro_watchdog_budget = 0;
+static uint64_t coro_watchdog_stall_count = 0;
+/** Tells the checker thread to wrap up. */
+static bool coro_watchdog_stop_flag = false;
+
+/* One engine check of the watchdog pass, reporting a new stall. */
+static void
+coro_watchdog_check(struct coro_engine *engine, const struct coro **reported,
+	double *reported_start)
+{
+	/*
+	 * The fields are owned by the engine's thread - the loads can
+	 * race with a switch and come out mismatched. A misread can at
+	 * worst delay the report by one pass: the stall predicate has
+	 * to hold across the re-check below, and a genuinely stuck
+	 * coroutine keeps both fields frozen.
+	 */
+	struct coro *this = __atomic_load_n(&engine->this, __ATOMIC_RELAXED);
+	double start = engine->run_start;
+	if (this == NULL || this == &engine->sched) {
+		*reported = NULL;
+		return;
+	}
+	double now = coro_time_now();
+	if (now - start <= coro_watchdog_budget)
+		return;
+	if (*reported == this && *reported_start == start) {
+		/* The same stall - already reported. */
+		return;
+	}
+	if (__atomic_load_n(&engine->this, __ATOMIC_RELAXED) != this ||
+	    engine->run_start != start)
+		return;
+	*reported = this;
+	*reported_start = start;
+	++coro_watchdog_stall_count;
+	/*
+	 * The stack sample is safe for the same reason the stall was
+	 * detected at all - the coroutine is pinned on the engine by
+	 * its own refusal to yield, so its stack is live.
+	 */
+	fprintf(stderr, "coro watchdog: coro %llu (%p) is running %.3f sec "
+		"without yielding, stack high water %zu bytes\n",
+		(unsigned long long)this->id, (void *)this, now - start,
+		coro_stack_high_water(this));
+}
+
+static void *
+coro_watchdog_f(void *arg)
+{
+	(void)arg;
+	/* The last reported stall of each engine, to report once. */
+	const struct coro *reported[CORO_WORKER_MAX] = {NULL};
+	double reported_start[CORO_WORKER_MAX] = {0};
+	while (!__atomic_load_n(&coro_watchdog_stop_flag, __ATOMIC_ACQUIRE)) {
+		double interval = coro_watchdog_budget / 2;
+		struct timespec ts;
+		ts.tv_sec = interval;
+		ts.tv_nsec = (interval - ts.tv_sec) * 1e9;
+		nanosleep(&ts, NULL);
+		int count = __atomic_load_n(&coro_engine_count,
+			__ATOMIC_RELAXED);
+		if (count == 0) {
+			/* The single-threaded mode - one global engine. */
+			coro_watchdog_check(&glob_engine, &reported[0],
+				&reported_start[0]);
+			continue;
+		}
+		for (int i = 0; i < count; ++i) {
+			coro_watchdog_check(coro_engines[i], &reported[i],
+				&reported_start[i]);
+		}
+	}
+	return NULL;
+}
+
+int
+coro_sched_watchdog_start(double budget)
+{
+	if (coro_watchdog_is_running || budget <= 0)
+		return -1;
+	coro_watchdog_budget = budget;
+	coro_watchdog_stall_count = 0;
+	coro_watchdog_stop_flag = false;
+	if (pthread_create(&coro_watchdog_thread, NULL, coro_watchdog_f,
+			   NULL) != 0)
+		return -1;
+	coro_watchdog_is_running = true;
+	return 0;
+}
+
+uint64_t
+coro_sched_watchdog_stop(void)
+{
+	if (!coro_watchdog_is_running)
+		return 0;
+	__atomic_store_n(&coro_watchdog_stop_flag, true, __ATOMIC_RELEASE);
+	pthread_join(coro_watchdog_thread, NULL);
+	coro_watchdog_is_running = false;
+	return coro_watchdog_stall_count;
+}
+
+int
+coro_sched_record_start(size_t capacity)
+{
+	if (coro_replay_mode != CORO_REPLAY_OFF || capacity == 0)
+		return -1;
+	coro_replay_log = malloc(capacity * sizeof(*coro_replay_log));
+	if (coro_replay_log == NULL)
+		return -1;
+	coro_replay_capacity = capacity;
+	coro_replay_pos = 0;
+	coro_id_next = 1;
+	coro_replay_mode = CORO_REPLAY_RECORD;
+	return 0;
+}
+
+size_t
+coro_sched_record_stop(uint64_t *ids, size_t capacity)
+{
+	if (coro_replay_mode != CORO_REPLAY_RECORD)
+		return 0;
+	size_t total = coro_replay_pos;
+	size_t kept = total < coro_replay_capacity ?
+		total : coro_replay_capacity;
+	size_t count = kept < capacity ? kept : capacity;
+	size_t begin = total - count;
+	for (size_t i = 0; i < count; ++i)
+		ids[i] = coro_replay_log[(begin + i) % coro_replay_capacity];
+	free(coro_replay_log);
+	coro_replay_log = NULL;
+	coro_replay_mode = CORO_REPLAY_OFF;
+	return total;
+}
+
+int
+coro_sched_replay_start(const uint64_t *ids, size_t count)
+{
+	if (coro_replay_mode != CORO_REPLAY_OFF)
+		return -1;
+	coro_replay_log = malloc(count * sizeof(*coro_replay_log));
+	if (coro_replay_log == NULL)
+		return -1;
+	memcpy(coro_replay_log, ids, count * sizeof(*ids));
+	coro_replay_capacity = count;
+	coro_replay_pos = 0;
+	coro_replay_diverged = false;
+	coro_id_next = 1;
+	coro_replay_mode = CORO_REPLAY_FORCE;
+	return 0;
+}
+
+int
+coro_sched_replay_stop(void)
+{
+	if (coro_replay_mode != CORO_REPLAY_FORCE)
+		return -1;
+	bool is_exact = !coro_replay_diverged &&
+		coro_replay_pos == coro_replay_capacity;
+	free(coro_replay_log);
+	coro_replay_log = NULL;
+	coro_replay_mode = CORO_REPLAY_OFF;
+	return is_exact ? 0 : -1;
 }
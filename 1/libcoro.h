@@ -1,10 +1,31 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 struct coro;
 typedef void *(*coro_f)(void *);
 
+/**
+ * Priority classes of the ready queue. Within one scheduler pass
+ * the higher-priority coroutines always run before the lower ones,
+ * so their wakeup-to-run latency stays bounded. Every class is
+ * drained on every pass - a low-priority coroutine can be delayed
+ * within a pass, but never starved across passes.
+ */
+enum coro_prio {
+	CORO_PRIO_HIGH = 0,
+	CORO_PRIO_NORMAL,
+	CORO_PRIO_LOW,
+	CORO_PRIO_COUNT,
+};
+
+enum {
+	/** How many coroutine-local storage slots each coro has. */
+	CORO_LOCAL_SLOT_COUNT = 8,
+};
+
 /** Initialize the coroutines engine. */
 void
 coro_sched_init(void);
@@ -16,6 +37,39 @@ coro_sched_init(void);
 void
 coro_sched_run(void);
 
+typedef void (*coro_poll_f)(void *arg);
+
+/**
+ * Install a callback invoked at the start of every iteration of
+ * the scheduler loop, before the ready coroutines run. Meant for
+ * pumping events from outside the engine into it, e.g. draining
+ * queues filled by foreign threads. While a callback is set and
+ * the engine idles on timers, it wakes up at the timer wheel
+ * resolution to poll instead of sleeping until the nearest
+ * deadline. The run still ends when nothing is runnable and no
+ * timers are armed - an application fed only from outside has to
+ * keep e.g. a timer coroutine alive for the duration. In the
+ * multi-threaded mode the callback runs only on the thread which
+ * called coro_sched_run_workers(). NULL removes the callback.
+ */
+void
+coro_sched_set_poll_cb(coro_poll_f cb, void *arg);
+
+/**
+ * Same as coro_sched_run(), but the coroutines are executed on the
+ * given number of threads - the calling one plus worker_count - 1
+ * extra ones. Each thread runs its own engine shard and steals
+ * ready coroutines from the other shards when its own queues drain,
+ * so CPU-bound workloads scale with the cores. The coroutines can
+ * migrate between the threads at any suspension point - the bodies
+ * must synchronize their access to shared data themselves, e.g.
+ * with coro-aware locks. Returns when the work has drained on all
+ * the shards. With worker_count of 1 behaves exactly like
+ * coro_sched_run(), which stays lock-free.
+ */
+void
+coro_sched_run_workers(int worker_count);
+
 /**
  * Destroy the coroutines engine. All coros must be finished by
  * now.
@@ -23,10 +77,168 @@ coro_sched_run(void);
 void
 coro_sched_destroy(void);
 
+/**
+ * Set how many free coroutine stacks the engine keeps mapped for
+ * reuse. Above the limit the stacks are returned to the OS right
+ * when their coroutines are joined.
+ */
+void
+coro_sched_set_stack_pool_limit(size_t limit);
+
 /** Get the currently working coroutine. */
 struct coro *
 coro_this(void);
 
+/**
+ * Coroutine-local storage - a fixed array of pointer slots in each
+ * coroutine, for keying per-coro context without an external map
+ * looked up on coro_this(). Both accessors are an indexed load into
+ * the current coroutine, nothing more. The slot ids are a
+ * convention between the subsystems of the application; all slots
+ * read as NULL in a freshly created coroutine, including one
+ * recycled through the internal pool.
+ */
+void
+coro_local_set(int slot, void *value);
+
+void *
+coro_local_get(int slot);
+
+/** Statistics of a single coroutine. */
+struct coro_stat {
+	/** How many times the coroutine was switched into. */
+	uint64_t switch_count;
+	/** How many times it suspended itself. */
+	uint64_t suspend_count;
+	/** Total time the coroutine spent running, in seconds. */
+	double run_time;
+};
+
+/**
+ * Get the statistics of the given coroutine. Cheap - the counters
+ * are maintained on every switch anyway.
+ */
+void
+coro_stat_get(const struct coro *coro, struct coro_stat *stat);
+
+/**
+ * Measured high-water mark of the coroutine's stack usage, in
+ * bytes. Stacks are reserved lazily and filled with a poison
+ * pattern on reuse, so the deepest byte the coroutine ever wrote
+ * can be found by scanning for the pattern. An estimate - a run of
+ * zeroes at the very bottom of the used part is indistinguishable
+ * from untouched memory. Useful for sizing the stacks from real
+ * data instead of guessing.
+ */
+size_t
+coro_stack_high_water(const struct coro *coro);
+
+/**
+ * How many coroutines are sitting in the ready queues right now,
+ * waiting for their turn to run.
+ */
+size_t
+coro_sched_queue_depth(void);
+
+/**
+ * Dump the in-memory ring of recent scheduling events (resumes,
+ * suspends, wakeups) to stderr. Useful to find a coroutine hogging
+ * the engine without attaching a debugger.
+ */
+void
+coro_sched_trace_dump(void);
+
+/**
+ * Install a SIGUSR1 handler which makes the scheduler dump the
+ * trace ring on the next iteration of its loop.
+ */
+void
+coro_sched_trace_dump_on_sigusr1(void);
+
+/**
+ * Start the watchdog of non-yielding coroutines. A sibling thread
+ * checks a couple of times per budget whether the engine is still
+ * on the same coroutine it was on last time: one stuck in a compute
+ * loop freezes everything sharing the engine, and without the
+ * watchdog it is only found post-mortem. A coroutine observed
+ * running for more than 'budget' seconds without yielding is
+ * reported to stderr - its spawn id, how long it has been running
+ * and a sample of its stack (the high-water usage, telling how deep
+ * the stuck code sits) - once per stall, not once per check. The
+ * scheduler pays nothing for the detection: the checker reads the
+ * per-switch timestamp the switch path maintains anyway.
+ *
+ * @retval 0 Success.
+ * @retval -1 The watchdog is already running, the budget is not
+ *     positive, or the thread failed to start.
+ */
+int
+coro_sched_watchdog_start(double budget);
+
+/**
+ * Stop the watchdog thread. Returns how many stalls it reported
+ * since the start.
+ */
+uint64_t
+coro_sched_watchdog_stop(void);
+
+/**
+ * Start recording the scheduler's resume decisions. Every decision
+ * of which coroutine to switch into next is logged as the
+ * coroutine's spawn id - the scheduler context is id 0, the created
+ * coroutines get 1, 2, ... in spawn order, and the id counter
+ * restarts here so a recorded run and a replayed one number their
+ * coroutines alike. The log is a preallocated ring of 'capacity'
+ * entries - the recording allocates nothing on the hot path, and an
+ * overlong run simply keeps the last 'capacity' decisions.
+ * Single-threaded runs only - the worker mode is inherently
+ * non-deterministic.
+ *
+ * @retval 0 Success.
+ * @retval -1 A recording or a replay is already active, or the
+ *     capacity is zero, or the ring failed to allocate.
+ */
+int
+coro_sched_record_start(size_t capacity);
+
+/**
+ * Stop recording. Up to 'capacity' last logged decisions are copied
+ * into 'ids', oldest first. Returns how many decisions were made in
+ * total - more than the copied amount means the ring wrapped and
+ * only the tail of the schedule was kept.
+ */
+size_t
+coro_sched_record_stop(uint64_t *ids, size_t capacity);
+
+/**
+ * Force the scheduler to repeat the given sequence of resume
+ * decisions, e.g. one captured with coro_sched_record_stop(). At
+ * every decision the scripted coroutine is picked from the ready
+ * ones instead of the queue head, so a pathological schedule
+ * captured in production reproduces deterministically offline. The
+ * spawn id counter restarts like in coro_sched_record_start() - the
+ * program has to spawn its coroutines in the recorded order for the
+ * ids to match. Once the script ends, or when a scripted coroutine
+ * is not ready at its turn, the scheduler falls back to the natural
+ * order.
+ *
+ * @retval 0 Success.
+ * @retval -1 A recording or a replay is already active, or the
+ *     script failed to allocate.
+ */
+int
+coro_sched_replay_start(const uint64_t *ids, size_t count);
+
+/**
+ * Stop the replay.
+ *
+ * @retval 0 The whole script was followed exactly.
+ * @retval -1 The run diverged from the script, or ended before the
+ *     script did.
+ */
+int
+coro_sched_replay_stop(void);
+
 /**
  * Create a new coroutine. The function won't yield. The coroutine
  * will start execution automatically on the next iteration of the
@@ -38,6 +250,13 @@ coro_this(void);
 struct coro *
 coro_new(coro_f func, void *func_arg);
 
+/**
+ * Same as coro_new(), but the coroutine is scheduled in the given
+ * priority class instead of CORO_PRIO_NORMAL.
+ */
+struct coro *
+coro_new_with_prio(coro_f func, void *func_arg, enum coro_prio prio);
+
 /**
  * Join a coroutine. When joined, its resources are freed, and the
  * result of its callback function is returned. Each coroutine
@@ -46,6 +265,20 @@ coro_new(coro_f func, void *func_arg);
 void *
 coro_join(struct coro *coro);
 
+/**
+ * Detach a coroutine instead of joining it. The engine reclaims a
+ * detached coroutine right when its function returns: the struct
+ * is freed and the stack goes back into the stack pool with its
+ * pages madvise()d away, so fire-and-forget coroutines don't hold
+ * dead stacks until somebody joins them. The return value of a
+ * detached coroutine is discarded, and the handle must not be
+ * used once the function has returned - no join, no wakeup.
+ * Detaching an already finished coroutine reclaims it on the
+ * spot. Can be called by the coroutine on itself.
+ */
+void
+coro_detach(struct coro *coro);
+
 /**
  * Pause the current coroutine until its explicitly woken up with
  * coro_wakeup(). Can be used to wait for some event, which will
@@ -54,6 +287,49 @@ coro_join(struct coro *coro);
 void
 coro_suspend(void);
 
+/**
+ * Same as coro_suspend(), but the coroutine is woken up by the
+ * engine on its own when the timeout elapses. Costs O(1)
+ * scheduling work - the waiters sit in a timer wheel, not in a
+ * sorted list. While all the coroutines are waiting on timers, the
+ * engine blocks instead of spinning.
+ *
+ * @retval 0 Woken up explicitly before the deadline.
+ * @retval -1 The timeout elapsed.
+ */
+int
+coro_suspend_timeout(double timeout);
+
+/**
+ * Block the current coroutine for the given number of seconds,
+ * letting the other coroutines work meanwhile.
+ */
+void
+coro_sleep(double duration);
+
+/** Readiness conditions of coro_fd_wait(). */
+enum coro_fd_event {
+	CORO_FD_READ = 1,
+	CORO_FD_WRITE = 2,
+};
+
+/**
+ * Suspend the current coroutine until the fd is ready for any of
+ * the requested events - a mask of enum coro_fd_event. While all
+ * the coroutines wait on fds or timers, the engine blocks in epoll
+ * instead of spinning, so an idle I/O-bound service costs no CPU.
+ * The registration is one-shot: the fd leaves the engine's epoll
+ * set right when the wait ends, and has to be re-armed for the
+ * next wait. One waiting coroutine per fd at a time.
+ *
+ * @retval >0 Mask of the events the fd is ready for. Errors and
+ *     hangups report as both - the following read or write will
+ *     surface the real errno.
+ * @retval 0 Woken up explicitly with coro_wakeup() instead.
+ */
+int
+coro_fd_wait(int fd, int events);
+
 /**
  * Pause the current coroutine until the next iteration of the
  * scheduler. Can be used to let the other coroutines work for a
@@ -62,6 +338,16 @@ coro_suspend(void);
 void
 coro_yield(void);
 
+/**
+ * Hand the control straight to the given coroutine, skipping the
+ * scheduler pass - one switch instead of two when the producer
+ * knows its consumer. The current coroutine stays runnable, like
+ * after coro_yield(). The target is woken up if it was suspended.
+ * Beware that the handoff ignores the priority classes.
+ */
+void
+coro_yield_to(struct coro *coro);
+
 /**
  * Wakeup a coroutine. If it was suspended, then it is going to be
  * continued on the next iteration of the scheduler. Otherwise
@@ -69,3 +355,12 @@ coro_yield(void);
  */
 void
 coro_wakeup(struct coro *coro);
+
+/**
+ * Wakeup a batch of coroutines at once. Does the same as calling
+ * coro_wakeup() in a loop, but enters the scheduler ready queues
+ * with a single splice per priority class, which is much cheaper
+ * for wide fan-outs like broadcasts.
+ */
+void
+coro_wakeup_many(struct coro **coros, size_t count);
@@ -2,6 +2,9 @@
 
 #include "unit.h"
 
+#include <string.h>
+#include <time.h>
+
 ////////////////////////////////////////////////////////////////////////////////
 
 static void *
@@ -162,6 +165,276 @@ test_wakeup_of_finished(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+enum {
+	TEST_REPLAY_CORO_COUNT = 3,
+	TEST_REPLAY_YIELD_COUNT = 4,
+	TEST_REPLAY_STEP_COUNT =
+		TEST_REPLAY_CORO_COUNT * TEST_REPLAY_YIELD_COUNT,
+	TEST_REPLAY_SCRIPT_MAX = 128,
+};
+
+struct test_replay_ctx {
+	int id;
+	int *order;
+	int *order_count;
+};
+
+static void *
+test_replay_coro_f(void *arg)
+{
+	struct test_replay_ctx *ctx = arg;
+	for (int i = 0; i < TEST_REPLAY_YIELD_COUNT; ++i) {
+		ctx->order[(*ctx->order_count)++] = ctx->id;
+		coro_yield();
+	}
+	return NULL;
+}
+
+/** One full scheduler run of yielding coroutines logging their order. */
+static void
+test_replay_run(int *order, int *order_count)
+{
+	struct test_replay_ctx ctxs[TEST_REPLAY_CORO_COUNT];
+	struct coro *coros[TEST_REPLAY_CORO_COUNT];
+	for (int i = 0; i < TEST_REPLAY_CORO_COUNT; ++i) {
+		ctxs[i].id = i;
+		ctxs[i].order = order;
+		ctxs[i].order_count = order_count;
+		coros[i] = coro_new(test_replay_coro_f, &ctxs[i]);
+	}
+	coro_sched_run();
+	for (int i = 0; i < TEST_REPLAY_CORO_COUNT; ++i)
+		unit_check(coro_join(coros[i]) == NULL, "replay worker rc");
+}
+
+static void
+test_record_replay(void)
+{
+	unit_test_start();
+
+	int order1[TEST_REPLAY_STEP_COUNT];
+	int count1 = 0;
+	unit_check(coro_sched_record_start(TEST_REPLAY_SCRIPT_MAX) == 0,
+		   "start recording");
+	unit_check(coro_sched_record_start(TEST_REPLAY_SCRIPT_MAX) == -1,
+		   "no recording of a recording");
+	test_replay_run(order1, &count1);
+	uint64_t script[TEST_REPLAY_SCRIPT_MAX];
+	size_t total = coro_sched_record_stop(script, TEST_REPLAY_SCRIPT_MAX);
+	unit_check(total > 0 && total <= TEST_REPLAY_SCRIPT_MAX,
+		   "got the whole schedule");
+	unit_check(count1 == TEST_REPLAY_STEP_COUNT, "all the steps ran");
+
+	// The same script replays into the same execution order.
+	int order2[TEST_REPLAY_STEP_COUNT];
+	int count2 = 0;
+	unit_check(coro_sched_replay_start(script, total) == 0,
+		   "start replaying");
+	test_replay_run(order2, &count2);
+	unit_check(coro_sched_replay_stop() == 0, "the script was followed");
+	unit_check(count2 == count1 &&
+		   memcmp(order1, order2, count1 * sizeof(*order1)) == 0,
+		   "same order");
+
+	// A script with the first two decisions swapped forces an
+	// order the natural scheduler would not produce.
+	unit_assert(total >= 2 && script[0] != script[1] &&
+		    script[0] != 0 && script[1] != 0);
+	uint64_t tmp = script[0];
+	script[0] = script[1];
+	script[1] = tmp;
+	int order3[TEST_REPLAY_STEP_COUNT];
+	int count3 = 0;
+	unit_check(coro_sched_replay_start(script, total) == 0,
+		   "start a forced replay");
+	test_replay_run(order3, &count3);
+	unit_check(coro_sched_replay_stop() == 0, "the forced script held");
+	unit_check(count3 == count1 && order3[0] == order1[1] &&
+		   order3[1] == order1[0], "the forced order differs");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static double
+test_time_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void *
+test_watchdog_spin_f(void *arg)
+{
+	(void)arg;
+	/* A compute loop well past the watchdog budget, no yields. */
+	double deadline = test_time_now() + 0.15;
+	while (test_time_now() < deadline)
+		;
+	return NULL;
+}
+
+static void *
+test_watchdog_polite_f(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < 10; ++i)
+		coro_yield();
+	return NULL;
+}
+
+static void
+test_watchdog(void)
+{
+	unit_test_start();
+
+	unit_msg("a yielding run stays silent");
+	unit_check(coro_sched_watchdog_start(0.05) == 0, "watchdog started");
+	unit_check(coro_sched_watchdog_start(0.05) == -1,
+		   "no second watchdog");
+	struct coro *polite = coro_new(test_watchdog_polite_f, NULL);
+	coro_sched_run();
+	unit_assert(coro_join(polite) == NULL);
+	unit_check(coro_sched_watchdog_stop() == 0,
+		   "no stalls in a polite run");
+
+	unit_msg("a compute loop past the budget is caught");
+	unit_check(coro_sched_watchdog_start(0.05) == 0,
+		   "watchdog restarted");
+	struct coro *spinner = coro_new(test_watchdog_spin_f, NULL);
+	polite = coro_new(test_watchdog_polite_f, NULL);
+	coro_sched_run();
+	unit_assert(coro_join(spinner) == NULL);
+	unit_assert(coro_join(polite) == NULL);
+	unit_check(coro_sched_watchdog_stop() == 1,
+		   "the spinner was caught, and reported once");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+enum {
+	TEST_WORKERS_CORO_COUNT = 16,
+	TEST_WORKERS_YIELD_COUNT = 100,
+	TEST_WORKERS_ROUND_COUNT = 50,
+	TEST_WORKERS_CHILD_COUNT = 4,
+	TEST_WORKERS_MAX = 4,
+};
+
+static void *
+test_workers_yield_f(void *arg)
+{
+	/*
+	 * The counter is shared between the worker threads - only the
+	 * atomic builtins touch it.
+	 */
+	int *done_count = arg;
+	for (int i = 0; i < TEST_WORKERS_YIELD_COUNT; ++i)
+		coro_yield();
+	__atomic_add_fetch(done_count, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+struct test_workers_pair_ctx {
+	struct coro *peer;
+	int *turn;
+	int me;
+};
+
+static void *
+test_workers_pair_f(void *arg)
+{
+	struct test_workers_pair_ctx *ctx = arg;
+	for (int i = 0; i < TEST_WORKERS_ROUND_COUNT; ++i) {
+		/*
+		 * The peer's turn-flip and wakeup can land between the
+		 * check and the suspension here - the timeout turns
+		 * such a lost wakeup into a retry instead of a hang.
+		 */
+		while (__atomic_load_n(ctx->turn, __ATOMIC_ACQUIRE) !=
+		       ctx->me)
+			coro_suspend_timeout(0.001);
+		__atomic_store_n(ctx->turn, 1 - ctx->me, __ATOMIC_RELEASE);
+		coro_wakeup(ctx->peer);
+	}
+	return NULL;
+}
+
+static void *
+test_workers_sleep_f(void *arg)
+{
+	int *done_count = arg;
+	for (int i = 0; i < 5; ++i)
+		coro_sleep(0.002);
+	__atomic_add_fetch(done_count, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+static void *
+test_workers_spawn_f(void *arg)
+{
+	int *done_count = arg;
+	struct coro *kids[TEST_WORKERS_CHILD_COUNT];
+	for (int i = 0; i < TEST_WORKERS_CHILD_COUNT; ++i)
+		kids[i] = coro_new(test_workers_yield_f, done_count);
+	for (int i = 0; i < TEST_WORKERS_CHILD_COUNT; ++i)
+		unit_assert(coro_join(kids[i]) == NULL);
+	__atomic_add_fetch(done_count, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+static void
+test_sched_workers(void)
+{
+	unit_test_start();
+
+	/*
+	 * The same mixed load on every worker count, 1 included - it
+	 * must degenerate to the plain single-threaded run. The runs
+	 * also reuse the worker shards created by the previous
+	 * iterations.
+	 */
+	for (int workers = 1; workers <= TEST_WORKERS_MAX; ++workers) {
+		unit_msg("%d workers", workers);
+		int done_count = 0;
+		struct coro *coros[TEST_WORKERS_CORO_COUNT];
+		for (int i = 0; i < TEST_WORKERS_CORO_COUNT; ++i)
+			coros[i] = coro_new(test_workers_yield_f,
+				&done_count);
+		int turn = 0;
+		struct test_workers_pair_ctx pairs[2] = {
+			{NULL, &turn, 0},
+			{NULL, &turn, 1},
+		};
+		struct coro *ping = coro_new(test_workers_pair_f, &pairs[0]);
+		struct coro *pong = coro_new(test_workers_pair_f, &pairs[1]);
+		pairs[0].peer = pong;
+		pairs[1].peer = ping;
+		struct coro *sleeper = coro_new(test_workers_sleep_f,
+			&done_count);
+		struct coro *spawner = coro_new(test_workers_spawn_f,
+			&done_count);
+		coro_sched_run_workers(workers);
+		unit_check(coro_join(ping) == NULL, "ping-pong side one");
+		unit_check(coro_join(pong) == NULL, "ping-pong side two");
+		unit_check(coro_join(sleeper) == NULL, "timer user");
+		unit_check(coro_join(spawner) == NULL, "nested spawner");
+		for (int i = 0; i < TEST_WORKERS_CORO_COUNT; ++i)
+			unit_assert(coro_join(coros[i]) == NULL);
+		unit_check(done_count == TEST_WORKERS_CORO_COUNT +
+			   TEST_WORKERS_CHILD_COUNT + 2,
+			   "every coroutine ran to completion");
+		unit_check(coro_sched_queue_depth() == 0, "all drained");
+	}
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 static void *
 coro_main_f(void *arg)
 {
@@ -182,6 +455,9 @@ main(void)
 	coro_sched_run();
 	void *rc = coro_join(main_coro);
 	unit_check(rc == NULL, "main coro rc");
+	test_record_replay();
+	test_watchdog();
+	test_sched_workers();
 	coro_sched_destroy();
 	return 0;
 }
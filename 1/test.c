@@ -1,7 +1,10 @@
 #include "libcoro.h"
 
 #include "unit.h"
+#include "crlist.h"
 #include "corobus.h"
+#include "corobus_pool.h"
+#include "../4/thread_pool.h"
 
 #include <string.h>
 
@@ -101,6 +104,70 @@ recv_join(struct ctx_recv *ctx)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+struct crlist_test_item {
+	struct rlist link;
+	int value;
+};
+
+/*
+ * The counted list backing the engine's coroutine and stack pools.
+ * The count has to stay honest through every mutation, including
+ * the O(1) batch splices.
+ */
+static void
+test_crlist(void)
+{
+	unit_test_start();
+	struct crlist list;
+	crlist_create(&list);
+	unit_check(crlist_empty(&list), "created empty");
+	unit_check(crlist_size(&list) == 0, "created size 0");
+
+	struct crlist_test_item items[5];
+	for (int i = 0; i < 5; ++i) {
+		items[i].value = i;
+		crlist_add_tail_entry(&list, &items[i], link);
+	}
+	unit_check(crlist_size(&list) == 5, "size after adds");
+	struct crlist_test_item *it = crlist_first_entry(&list,
+		struct crlist_test_item, link);
+	unit_check(it->value == 0, "first entry");
+	it = crlist_last_entry(&list, struct crlist_test_item, link);
+	unit_check(it->value == 4, "last entry");
+
+	it = crlist_shift_entry(&list, struct crlist_test_item, link);
+	unit_check(it->value == 0, "shift returns the head");
+	it = crlist_shift_tail_entry(&list, struct crlist_test_item, link);
+	unit_check(it->value == 4, "shift_tail returns the tail");
+	crlist_del_entry(&list, &items[2], link);
+	unit_check(crlist_size(&list) == 2, "size after removals");
+
+	unit_msg("batch splice between two lists");
+	struct crlist other;
+	crlist_create(&other);
+	crlist_add_entry(&other, &items[0], link);
+	crlist_splice_tail(&list, &other);
+	unit_check(crlist_size(&list) == 3, "splice target counts both");
+	unit_check(crlist_empty(&other), "splice source is empty");
+	unit_check(crlist_size(&other) == 0, "splice source size 0");
+	it = crlist_last_entry(&list, struct crlist_test_item, link);
+	unit_check(it->value == 0, "spliced item went to the tail");
+
+	int order[3] = {1, 3, 0};
+	int pos = 0;
+	crlist_foreach_entry(it, &list, link)
+		unit_assert(it->value == order[pos++]);
+	unit_check(pos == 3, "foreach walked the merged list");
+
+	struct crlist_test_item *tmp;
+	crlist_foreach_entry_safe(it, &list, link, tmp)
+		crlist_del_entry(&list, it, link);
+	unit_check(crlist_empty(&list), "drained empty");
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 static void
 test_basic(void)
 {
@@ -1603,10 +1670,195 @@ test_recv_vector_blocking_recv_many(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+struct ctx_offload_recv {
+	struct coro_bus *bus;
+	int channel;
+	int count;
+	unsigned sum;
+	bool is_done;
+	struct coro *worker;
+};
+
+static void *
+offload_recv_f(void *arg)
+{
+	struct ctx_offload_recv *ctx = arg;
+	for (int i = 0; i < ctx->count; ++i) {
+		unsigned data;
+		unit_assert(coro_bus_recv(ctx->bus, ctx->channel, &data) == 0);
+		ctx->sum += data;
+	}
+	ctx->is_done = true;
+	return NULL;
+}
+
+static unsigned
+test_offload_work_f(void *arg)
+{
+	return *(unsigned *)arg * 2;
+}
+
+static void
+test_offload(void)
+{
+	unit_test_start();
+	struct thread_pool *pool;
+	unit_fail_if(thread_pool_new(3, &pool) != 0);
+	struct coro_bus *bus = coro_bus_new();
+	int channel = coro_bus_channel_open(bus, 16);
+	unit_assert(channel >= 0);
+
+	unit_msg("the receiver blocks in a normal recv");
+	struct ctx_offload_recv ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.bus = bus;
+	ctx.channel = channel;
+	ctx.count = 10;
+	ctx.worker = coro_new(offload_recv_f, &ctx);
+
+	unit_msg("offload the work");
+	unsigned args[10];
+	for (int i = 0; i < 10; ++i) {
+		args[i] = i;
+		unit_assert(coro_bus_offload(bus, channel, pool,
+			test_offload_work_f, &args[i]) == 0);
+	}
+	/*
+	 * Everybody waits outside of the engine now - the sleeps keep
+	 * it alive until the completions arrive through the ingress.
+	 */
+	while (!ctx.is_done)
+		coro_sleep(0.001);
+	unit_assert(coro_join(ctx.worker) == NULL);
+	unit_check(ctx.sum == 90, "every result was delivered");
+
+	coro_bus_offload_reap();
+	coro_bus_channel_close(bus, channel);
+	coro_bus_delete(bus);
+	unit_check(thread_pool_delete(pool) == 0, "the pool drained");
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct ctx_timed {
+	struct coro_bus *bus;
+	int channel;
+	unsigned data;
+	double timeout;
+	int rc;
+	enum coro_bus_error_code err;
+	bool is_done;
+	struct coro *worker;
+};
+
+static void *
+recv_timeout_f(void *arg)
+{
+	struct ctx_timed *ctx = arg;
+	ctx->rc = coro_bus_recv_timeout(ctx->bus, ctx->channel, &ctx->data,
+					ctx->timeout);
+	ctx->err = coro_bus_errno();
+	ctx->is_done = true;
+	return NULL;
+}
+
+static void *
+send_timeout_f(void *arg)
+{
+	struct ctx_timed *ctx = arg;
+	ctx->rc = coro_bus_send_timeout(ctx->bus, ctx->channel, ctx->data,
+					ctx->timeout);
+	ctx->err = coro_bus_errno();
+	ctx->is_done = true;
+	return NULL;
+}
+
+static void
+test_timeout(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 2);
+	unit_assert(c1 >= 0);
+
+	unit_msg("a timed recv on an empty channel gives up");
+	struct ctx_timed ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.bus = bus;
+	ctx.channel = c1;
+	ctx.timeout = 0.01;
+	ctx.worker = coro_new(recv_timeout_f, &ctx);
+	/* Nobody wakes it up - the engine's timer wheel has to. */
+	unit_assert(coro_join(ctx.worker) == NULL);
+	unit_check(ctx.rc == -1 && ctx.err == CORO_BUS_ERR_WOULD_BLOCK,
+		   "recv timed out");
+
+	unit_msg("a message before the deadline ends the wait");
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.bus = bus;
+	ctx.channel = c1;
+	ctx.timeout = 10;
+	ctx.worker = coro_new(recv_timeout_f, &ctx);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+	unit_assert(coro_bus_send(bus, c1, 123) == 0);
+	unit_assert(coro_join(ctx.worker) == NULL);
+	unit_check(ctx.rc == 0 && ctx.data == 123, "recv made it in time");
+
+	unit_msg("a timed send on a full channel gives up");
+	unit_assert(coro_bus_try_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_try_send(bus, c1, 2) == 0);
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.bus = bus;
+	ctx.channel = c1;
+	ctx.data = 3;
+	ctx.timeout = 0.01;
+	ctx.worker = coro_new(send_timeout_f, &ctx);
+	unit_assert(coro_join(ctx.worker) == NULL);
+	unit_check(ctx.rc == -1 && ctx.err == CORO_BUS_ERR_WOULD_BLOCK,
+		   "send timed out");
+
+	unit_msg("freed space before the deadline ends the wait");
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.bus = bus;
+	ctx.channel = c1;
+	ctx.data = 3;
+	ctx.timeout = 10;
+	ctx.worker = coro_new(send_timeout_f, &ctx);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+	unsigned data = 0;
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 1);
+	unit_assert(coro_join(ctx.worker) == NULL);
+	unit_check(ctx.rc == 0, "send made it in time");
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 2);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 3);
+
+	unit_msg("a closed channel beats the deadline");
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.bus = bus;
+	ctx.channel = c1;
+	ctx.timeout = 10;
+	ctx.worker = coro_new(recv_timeout_f, &ctx);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+	coro_bus_channel_close(bus, c1);
+	unit_assert(coro_join(ctx.worker) == NULL);
+	unit_check(ctx.rc == -1 && ctx.err == CORO_BUS_ERR_NO_CHANNEL,
+		   "no channel error");
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 static void *
 coro_main_f(void *arg)
 {
 	(void)arg;
+	test_crlist();
 	test_basic();
 	test_channel_reopen();
 	test_multiple_channels();
@@ -1635,6 +1887,9 @@ coro_main_f(void *arg)
 	test_recv_vector_basic();
 	test_recv_vector_blocking();
 	test_recv_vector_blocking_recv_many();
+
+	test_offload();
+	test_timeout();
 	return NULL;
 }
 
@@ -2,15 +2,175 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+enum {
+	/** Default byte size of one arena chunk. */
+	PARSER_ARENA_CHUNK_SIZE = 4096,
+	/**
+	 * How many recycled chunks and arenas the parser keeps, see
+	 * parser_recycle(). A cap so one burst of huge lines doesn't
+	 * pin their memory forever.
+	 */
+	PARSER_RECYCLE_LIMIT = 32,
+};
+
+struct parser_arena_chunk {
+	struct parser_arena_chunk *next;
+	uint32_t used;
+	uint32_t size;
+	char data[];
+};
+
+/**
+ * Bump allocator for everything a single command line owns. One
+ * line typically fits into one chunk, so parsing does a couple of
+ * mallocs instead of one per expression and argument, and deletion
+ * frees the chunk list instead of walking the whole tree.
+ */
+struct parser_arena {
+	struct parser_arena_chunk *chunks;
+	/**
+	 * Parser to pull recycled chunks from. Only valid while the
+	 * line is being parsed - a finished line never allocates.
+	 */
+	struct parser *parser;
+	/** Link in the parser's free arena list. */
+	struct parser_arena *free_next;
+};
 
 struct parser {
 	char *buffer;
 	uint32_t size;
 	uint32_t capacity;
+	/**
+	 * Free lists of the arena parts of recycled command lines.
+	 * Parsing takes chunks from here before going to malloc, so
+	 * a steady stream of similar lines allocates nothing per
+	 * line, see parser_recycle().
+	 */
+	struct parser_arena_chunk *free_chunks;
+	uint32_t free_chunk_count;
+	struct parser_arena *free_arenas;
+	uint32_t free_arena_count;
+	/**
+	 * Parse cache - raw line bytes mapped to an already built
+	 * command line, see parser_set_cache_limit(). Off by
+	 * default.
+	 */
+	struct parser_cache_entry *cache;
+	uint32_t cache_capacity;
+	uint32_t cache_count;
+	uint32_t cache_limit;
+	/**
+	 * Borrowed input region scanned in place, without copying into
+	 * the buffer, see parser_feed_mmap(). Drained after the owned
+	 * buffer, consumed by advancing borrow_pos - no memmove.
+	 */
+	const char *borrow;
+	uint32_t borrow_size;
+	uint32_t borrow_pos;
+	/** The mapping to munmap when drained; NULL for plain borrows. */
+	void *map_base;
+	size_t map_size;
+};
+
+/** One cached line - the key bytes and the parsed template. */
+struct parser_cache_entry {
+	char *key;
+	uint32_t key_len;
+	uint32_t hash;
+	/** Owns its arena, deleted as a regular line. */
+	struct command_line *line;
 };
 
+enum {
+	/** How far a cache lookup probes from the hash slot. */
+	PARSER_CACHE_PROBE_WINDOW = 8,
+};
+
+static struct parser_arena *
+parser_arena_new(struct parser *p)
+{
+	struct parser_arena *arena = p->free_arenas;
+	if (arena != NULL) {
+		p->free_arenas = arena->free_next;
+		assert(p->free_arena_count > 0);
+		--p->free_arena_count;
+	} else {
+		arena = malloc(sizeof(*arena));
+	}
+	arena->chunks = NULL;
+	arena->parser = p;
+	arena->free_next = NULL;
+	return arena;
+}
+
+/** Take a recycled chunk fitting the size, if there is one. */
+static struct parser_arena_chunk *
+parser_take_free_chunk(struct parser *p, uint32_t size)
+{
+	struct parser_arena_chunk **link = &p->free_chunks;
+	for (struct parser_arena_chunk *c = *link; c != NULL;
+	     link = &c->next, c = c->next) {
+		if (c->size < size)
+			continue;
+		*link = c->next;
+		assert(p->free_chunk_count > 0);
+		--p->free_chunk_count;
+		c->used = 0;
+		return c;
+	}
+	return NULL;
+}
+
+static void *
+parser_arena_alloc(struct parser_arena *arena, uint32_t size)
+{
+	/* Keep the allocations pointer-aligned. */
+	size = (size + 7) & ~(uint32_t)7;
+	struct parser_arena_chunk *chunk = arena->chunks;
+	if (chunk == NULL || chunk->size - chunk->used < size) {
+		uint32_t chunk_size = PARSER_ARENA_CHUNK_SIZE;
+		if (chunk_size < size)
+			chunk_size = size;
+		chunk = parser_take_free_chunk(arena->parser, chunk_size);
+		if (chunk == NULL) {
+			chunk = malloc(sizeof(*chunk) + chunk_size);
+			chunk->used = 0;
+			chunk->size = chunk_size;
+		}
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+	}
+	void *res = chunk->data + chunk->used;
+	chunk->used += size;
+	return res;
+}
+
+static void
+parser_arena_delete(struct parser_arena *arena)
+{
+	struct parser_arena_chunk *chunk = arena->chunks;
+	while (chunk != NULL) {
+		struct parser_arena_chunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	free(arena);
+}
+
 enum token_type {
 	TOKEN_TYPE_NONE,
 	TOKEN_TYPE_STR,
@@ -23,21 +183,38 @@ enum token_type {
 	TOKEN_TYPE_BACKGROUND,
 };
 
+/**
+ * A token is built right in the line's arena - the bytes are copied
+ * out of the parser buffer exactly once, while unescaping, and the
+ * result is handed over to the command line as is, with no extra
+ * strdup.
+ */
 struct token {
 	enum token_type type;
+	/** Arena of the line being parsed, owns the data. */
+	struct parser_arena *arena;
 	char *data;
 	uint32_t size;
 	uint32_t capacity;
 };
 
+static void
+token_append(struct token *t, char c);
+
+/**
+ * Zero-terminate the token and detach its bytes. The token doesn't
+ * own any memory, so 'detach' just means the next token starts a new
+ * arena allocation.
+ */
 static char *
-token_strdup(const struct token *t)
+token_take(struct token *t)
 {
 	assert(t->type == TOKEN_TYPE_STR);
 	assert(t->size > 0);
-	char *res = malloc(t->size + 1);
-	memcpy(res, t->data, t->size);
-	res[t->size] = 0;
+	token_append(t, 0);
+	char *res = t->data;
+	t->data = NULL;
+	t->capacity = 0;
 	return res;
 }
 
@@ -45,14 +222,41 @@ static void
 token_append(struct token *t, char c)
 {
 	if (t->size == t->capacity) {
+		/* Same abandon-and-double growth as the args array. */
 		t->capacity = (t->capacity + 1) * 2;
-		t->data = realloc(t->data, sizeof(*t->data) * t->capacity);
+		char *new_data = parser_arena_alloc(t->arena,
+			sizeof(*t->data) * t->capacity);
+		memcpy(new_data, t->data, t->size);
+		t->data = new_data;
 	} else {
 		assert(t->size < t->capacity);
 	}
 	t->data[t->size++] = c;
 }
 
+/**
+ * Append a whole run of bytes at once - one growth check and one
+ * memcpy instead of a per-byte loop. This is where the bulk of a
+ * typical token lands, see parse_token().
+ */
+static void
+token_append_many(struct token *t, const char *data, uint32_t count)
+{
+	if (t->capacity - t->size < count) {
+		/* Same abandon-and-double growth as the args array. */
+		uint32_t new_capacity = (t->capacity + 1) * 2;
+		if (new_capacity - t->size < count)
+			new_capacity = t->size + count;
+		char *new_data = parser_arena_alloc(t->arena,
+			sizeof(*t->data) * new_capacity);
+		memcpy(new_data, t->data, t->size);
+		t->data = new_data;
+		t->capacity = new_capacity;
+	}
+	memcpy(t->data + t->size, data, count);
+	t->size += count;
+}
+
 static void
 token_reset(struct token *t)
 {
@@ -61,44 +265,293 @@ token_reset(struct token *t)
 }
 
 static void
-command_append_arg(struct command *cmd, char *arg)
+command_append_arg(struct parser_arena *arena, struct command *cmd,
+		   char *arg, uint32_t arg_len)
 {
 	if (cmd->arg_count == cmd->arg_capacity) {
+		/*
+		 * The arena can't realloc - the old arrays are simply
+		 * abandoned in place. With exponential growth the
+		 * waste stays bounded by the final array size.
+		 */
 		cmd->arg_capacity = (cmd->arg_capacity + 1) * 2;
-		cmd->args = realloc(cmd->args, sizeof(*cmd->args) * cmd->arg_capacity);
+		char **new_args = parser_arena_alloc(arena,
+			sizeof(*cmd->args) * cmd->arg_capacity);
+		memcpy(new_args, cmd->args,
+			sizeof(*cmd->args) * cmd->arg_count);
+		cmd->args = new_args;
+		uint32_t *new_lens = parser_arena_alloc(arena,
+			sizeof(*cmd->arg_lens) * cmd->arg_capacity);
+		memcpy(new_lens, cmd->arg_lens,
+			sizeof(*cmd->arg_lens) * cmd->arg_count);
+		cmd->arg_lens = new_lens;
 	} else {
 		assert(cmd->arg_count < cmd->arg_capacity);
 	}
+	cmd->arg_lens[cmd->arg_count] = arg_len;
 	cmd->args[cmd->arg_count++] = arg;
 }
 
 void
 command_line_delete(struct command_line *line)
 {
-	while (line->head != NULL) {
-		struct expr *e = line->head;
-		if (e->type == EXPR_TYPE_COMMAND) {
-			struct command *cmd = &e->cmd;
-			free(cmd->exe);
-			for (uint32_t i = 0; i < cmd->arg_count; ++i)
-				free(cmd->args[i]);
-			free(cmd->args);
+	/*
+	 * The line and everything it references live in the arena -
+	 * one chunk list walk frees it all.
+	 */
+	parser_arena_delete(line->arena);
+}
+
+void
+parser_recycle(struct parser *p, struct command_line *line)
+{
+	struct parser_arena *arena = line->arena;
+	struct parser_arena_chunk *chunk = arena->chunks;
+	while (chunk != NULL) {
+		struct parser_arena_chunk *next = chunk->next;
+		if (p->free_chunk_count < PARSER_RECYCLE_LIMIT) {
+			chunk->next = p->free_chunks;
+			p->free_chunks = chunk;
+			++p->free_chunk_count;
+		} else {
+			free(chunk);
 		}
-		line->head = e->next;
-		free(e);
+		chunk = next;
+	}
+	if (p->free_arena_count < PARSER_RECYCLE_LIMIT) {
+		arena->chunks = NULL;
+		arena->free_next = p->free_arenas;
+		p->free_arenas = arena;
+		++p->free_arena_count;
+	} else {
+		free(arena);
 	}
-	free(line->out_file);
-	free(line);
 }
 
-static void
-command_line_append(struct command_line *line, struct expr *e)
+/**
+ * Append a zeroed expression cell of the given type to the line's
+ * flattened array and return it. The array grows with the same
+ * abandon-and-double pattern as the args - the old cells are copied
+ * over and left behind in the arena, so on average an append lands
+ * in place and the final layout is one contiguous span.
+ */
+static struct expr *
+command_line_append(struct parser_arena *arena, struct command_line *line,
+		    enum expr_type type)
 {
-	if (line->head == NULL)
-		line->head = e;
-	else
+	if (line->expr_count == line->expr_capacity) {
+		line->expr_capacity = (line->expr_capacity + 1) * 2;
+		struct expr *new_exprs = parser_arena_alloc(arena,
+			sizeof(*new_exprs) * line->expr_capacity);
+		memcpy(new_exprs, line->exprs,
+			sizeof(*new_exprs) * line->expr_count);
+		/* The chain must follow the cells into the new array. */
+		for (uint32_t i = 0; i + 1 < line->expr_count; ++i)
+			new_exprs[i].next = &new_exprs[i + 1];
+		line->exprs = new_exprs;
+		if (line->expr_count > 0)
+			line->tail = &new_exprs[line->expr_count - 1];
+	} else {
+		assert(line->expr_count < line->expr_capacity);
+	}
+	struct expr *e = &line->exprs[line->expr_count++];
+	memset(e, 0, sizeof(*e));
+	e->type = type;
+	line->head = &line->exprs[0];
+	if (line->tail != NULL)
 		line->tail->next = e;
 	line->tail = e;
+	return e;
+}
+
+/**
+ * Deep-copy a parsed line into a fresh arena. Structure and string
+ * copies only - no tokenization, no unescaping. This is both how a
+ * cache hit is materialized and how a parsed line is turned into a
+ * cache template.
+ */
+static struct command_line *
+command_line_clone(struct parser *p, const struct command_line *src)
+{
+	struct parser_arena *arena = parser_arena_new(p);
+	struct command_line *line = parser_arena_alloc(arena, sizeof(*line));
+	memset(line, 0, sizeof(*line));
+	line->arena = arena;
+	line->out_type = src->out_type;
+	line->is_background = src->is_background;
+	if (src->out_file != NULL) {
+		uint32_t len = strlen(src->out_file) + 1;
+		line->out_file = parser_arena_alloc(arena, len);
+		memcpy(line->out_file, src->out_file, len);
+	}
+	/* The source count is known - the copy is contiguous at once. */
+	line->expr_capacity = src->expr_count;
+	if (src->expr_count > 0)
+		line->exprs = parser_arena_alloc(arena,
+			sizeof(*line->exprs) * src->expr_count);
+	for (uint32_t ei = 0; ei < src->expr_count; ++ei) {
+		const struct expr *se = &src->exprs[ei];
+		struct expr *e = &line->exprs[line->expr_count++];
+		memset(e, 0, sizeof(*e));
+		e->type = se->type;
+		if (se->type == EXPR_TYPE_COMMAND) {
+			const struct command *sc = &se->cmd;
+			struct command *c = &e->cmd;
+			c->exe_len = sc->exe_len;
+			c->exe = parser_arena_alloc(arena, sc->exe_len + 1);
+			memcpy(c->exe, sc->exe, sc->exe_len + 1);
+			c->arg_count = sc->arg_count;
+			c->arg_capacity = sc->arg_count;
+			if (sc->arg_count > 0) {
+				c->args = parser_arena_alloc(arena,
+					sizeof(*c->args) * sc->arg_count);
+				c->arg_lens = parser_arena_alloc(arena,
+					sizeof(*c->arg_lens) * sc->arg_count);
+			}
+			for (uint32_t i = 0; i < sc->arg_count; ++i) {
+				c->arg_lens[i] = sc->arg_lens[i];
+				c->args[i] = parser_arena_alloc(arena,
+					sc->arg_lens[i] + 1);
+				memcpy(c->args[i], sc->args[i],
+					sc->arg_lens[i] + 1);
+			}
+		}
+		if (ei > 0)
+			line->exprs[ei - 1].next = e;
+	}
+	if (line->expr_count > 0) {
+		line->head = &line->exprs[0];
+		line->tail = &line->exprs[line->expr_count - 1];
+	}
+	return line;
+}
+
+static void
+parser_consume(struct parser *p, uint32_t size);
+
+static const char *
+parser_input(const struct parser *p, uint32_t *size);
+
+static uint32_t
+parser_cache_hash(const char *data, uint32_t len)
+{
+	/* FNV-1a. */
+	uint32_t h = 2166136261u;
+	for (uint32_t i = 0; i < len; ++i) {
+		h ^= (unsigned char)data[i];
+		h *= 16777619;
+	}
+	return h;
+}
+
+/**
+ * The cache key of the buffer's upcoming content - everything up
+ * to and including the first newline. Zero when there is no
+ * complete line yet. Lines with embedded newlines (quoted or
+ * escaped) don't match their key and simply bypass the cache.
+ */
+static uint32_t
+parser_cache_key_len(const struct parser *p, const char *input,
+		     uint32_t input_size)
+{
+	(void)p;
+	const char *nl = memchr(input, '\n', input_size);
+	if (nl == NULL)
+		return 0;
+	return nl + 1 - input;
+}
+
+/** Look the upcoming line up and materialize a copy on a hit. */
+static struct command_line *
+parser_cache_lookup(struct parser *p)
+{
+	uint32_t input_size;
+	const char *input = parser_input(p, &input_size);
+	uint32_t key_len = parser_cache_key_len(p, input, input_size);
+	if (key_len == 0)
+		return NULL;
+	uint32_t hash = parser_cache_hash(input, key_len);
+	uint32_t mask = p->cache_capacity - 1;
+	for (uint32_t i = 0; i < PARSER_CACHE_PROBE_WINDOW; ++i) {
+		struct parser_cache_entry *e = &p->cache[(hash + i) & mask];
+		if (e->key == NULL)
+			return NULL;
+		if (e->hash != hash || e->key_len != key_len ||
+		    memcmp(e->key, input, key_len) != 0)
+			continue;
+		struct command_line *res = command_line_clone(p, e->line);
+		parser_consume(p, key_len);
+		return res;
+	}
+	return NULL;
+}
+
+/**
+ * Remember a freshly parsed line under its raw bytes. An occupied
+ * probe window evicts its first entry - with a few hundred hot
+ * lines and a capacity of twice the limit that is rare.
+ */
+static void
+parser_cache_insert(struct parser *p, const char *key, uint32_t key_len,
+		    const struct command_line *line)
+{
+	uint32_t hash = parser_cache_hash(key, key_len);
+	uint32_t mask = p->cache_capacity - 1;
+	struct parser_cache_entry *victim = &p->cache[hash & mask];
+	for (uint32_t i = 0; i < PARSER_CACHE_PROBE_WINDOW; ++i) {
+		struct parser_cache_entry *e = &p->cache[(hash + i) & mask];
+		if (e->key == NULL) {
+			if (p->cache_count >= p->cache_limit)
+				break;
+			victim = e;
+			break;
+		}
+		if (e->hash == hash && e->key_len == key_len &&
+		    memcmp(e->key, key, key_len) == 0)
+			return;
+	}
+	if (victim->key != NULL) {
+		free(victim->key);
+		command_line_delete(victim->line);
+	} else {
+		++p->cache_count;
+	}
+	victim->key = malloc(key_len);
+	memcpy(victim->key, key, key_len);
+	victim->key_len = key_len;
+	victim->hash = hash;
+	victim->line = command_line_clone(p, line);
+}
+
+static void
+parser_cache_free(struct parser *p)
+{
+	for (uint32_t i = 0; i < p->cache_capacity; ++i) {
+		struct parser_cache_entry *e = &p->cache[i];
+		if (e->key == NULL)
+			continue;
+		free(e->key);
+		command_line_delete(e->line);
+	}
+	free(p->cache);
+	p->cache = NULL;
+	p->cache_capacity = 0;
+	p->cache_count = 0;
+	p->cache_limit = 0;
+}
+
+void
+parser_set_cache_limit(struct parser *p, uint32_t limit)
+{
+	parser_cache_free(p);
+	if (limit == 0)
+		return;
+	uint32_t capacity = 16;
+	while (capacity < limit * 2)
+		capacity *= 2;
+	p->cache = calloc(capacity, sizeof(*p->cache));
+	p->cache_capacity = capacity;
+	p->cache_limit = limit;
 }
 
 struct parser *
@@ -107,8 +560,8 @@ parser_new(void)
 	return calloc(1, sizeof(struct parser));
 }
 
-void
-parser_feed(struct parser *p, const char *str, uint32_t len)
+static void
+parser_feed_copy(struct parser *p, const char *str, uint32_t len)
 {
 	uint32_t cap = p->capacity - p->size;
 	if (cap < len) {
@@ -123,9 +576,124 @@ parser_feed(struct parser *p, const char *str, uint32_t len)
 	assert(p->size <= p->capacity);
 }
 
+/** Drop the borrowed region, unmapping it if the parser owns it. */
+static void
+parser_borrow_release(struct parser *p)
+{
+	if (p->map_base != NULL)
+		munmap(p->map_base, p->map_size);
+	p->map_base = NULL;
+	p->map_size = 0;
+	p->borrow = NULL;
+	p->borrow_size = 0;
+	p->borrow_pos = 0;
+}
+
+/**
+ * Copy the unconsumed tail of the borrowed region into the owned
+ * buffer and let the region go - needed when new input arrives
+ * while the borrowed bytes aren't fully drained, so the parser is
+ * back to the single-buffer case.
+ */
+static void
+parser_borrow_migrate(struct parser *p)
+{
+	parser_feed_copy(p, p->borrow + p->borrow_pos,
+			 p->borrow_size - p->borrow_pos);
+	parser_borrow_release(p);
+}
+
+/**
+ * The input region the next line comes from. The owned buffer
+ * drains before the borrowed one - it holds the older bytes.
+ */
+static const char *
+parser_input(const struct parser *p, uint32_t *size)
+{
+	if (p->size > 0 || p->borrow == NULL) {
+		*size = p->size;
+		return p->buffer;
+	}
+	*size = p->borrow_size - p->borrow_pos;
+	return p->borrow + p->borrow_pos;
+}
+
+void
+parser_feed(struct parser *p, const char *str, uint32_t len)
+{
+	if (p->borrow != NULL)
+		parser_borrow_migrate(p);
+	parser_feed_copy(p, str, len);
+}
+
+void
+parser_feed_borrowed(struct parser *p, const char *str, uint32_t len)
+{
+	if (p->size > 0 || p->borrow != NULL) {
+		/* Older input is pending - can't scan two regions. */
+		parser_feed(p, str, len);
+		return;
+	}
+	p->borrow = str;
+	p->borrow_size = len;
+	p->borrow_pos = 0;
+}
+
+int
+parser_feed_mmap(struct parser *p, const char *path)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return -1;
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	if (st.st_size > UINT32_MAX || p->size > 0 || p->borrow != NULL) {
+		/*
+		 * Too big for the 32-bit offsets, or older input is
+		 * pending - feed by copying and let the mapping go.
+		 */
+		const char *pos = map;
+		off_t left = st.st_size;
+		while (left > 0) {
+			uint32_t chunk = left > (off_t)UINT32_MAX / 2 ?
+				UINT32_MAX / 2 : (uint32_t)left;
+			parser_feed(p, pos, chunk);
+			pos += chunk;
+			left -= chunk;
+		}
+		munmap(map, st.st_size);
+		return 0;
+	}
+	p->borrow = map;
+	p->borrow_size = st.st_size;
+	p->borrow_pos = 0;
+	p->map_base = map;
+	p->map_size = st.st_size;
+	return 0;
+}
+
 static void
 parser_consume(struct parser *p, uint32_t size)
 {
+	if (p->size == 0 && p->borrow != NULL) {
+		assert(p->borrow_size - p->borrow_pos >= size);
+		p->borrow_pos += size;
+		if (p->borrow_pos == p->borrow_size)
+			parser_borrow_release(p);
+		return;
+	}
 	assert(p->size >= size);
 	if (size == p->size) {
 		p->size = 0;
@@ -135,6 +703,171 @@ parser_consume(struct parser *p, uint32_t size)
 	p->size -= size;
 }
 
+/**
+ * Bytes the tokenizer has to look at one by one - whitespace,
+ * quotes, escapes, separators and the comment sign. Everything else
+ * flows into the token unchanged.
+ */
+static bool
+parser_char_is_special(char c)
+{
+	switch(c) {
+	case ' ':
+	case '\t':
+	case '\r':
+	case '\n':
+	case '\'':
+	case '"':
+	case '\\':
+	case '&':
+	case '|':
+	case '>':
+	case '#':
+		return true;
+	default:
+		return false;
+	}
+}
+
+#if defined(__ARM_NEON)
+
+/**
+ * Offset of the first matching lane in a NEON comparison result,
+ * or 16 when nothing matched. NEON has no movemask - the standard
+ * substitute narrows each 8-bit lane to a 4-bit nibble and scans
+ * the resulting 64-bit mask.
+ */
+static inline uint32_t
+parser_neon_match_offset(uint8x16_t eq)
+{
+	uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(
+		vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+	if (mask == 0)
+		return 16;
+	return __builtin_ctzll(mask) / 4;
+}
+
+#endif
+
+/**
+ * How many leading bytes of [pos, end) are plain token bytes -
+ * nothing from parser_char_is_special(). Classifies 16 bytes per
+ * step where the target has vector compares; the scalar tail
+ * handles the last incomplete block.
+ */
+static uint32_t
+scan_plain(const char *pos, const char *end)
+{
+	const char *begin = pos;
+#if defined(__SSE2__) || defined(__ARM_NEON)
+	/*
+	 * Probe the first block byte by byte. Short runs are the
+	 * common case - single-char args, separators right ahead - and
+	 * for them the full vector classify costs more than it saves.
+	 * The vector loop only starts once a whole block of 16 plain
+	 * bytes is already behind.
+	 */
+	const char *probe_end = end - pos < 16 ? end : pos + 16;
+	while (pos < probe_end && !parser_char_is_special(*pos))
+		++pos;
+	if (pos < probe_end || pos == end)
+		return pos - begin;
+#endif
+#if defined(__SSE2__)
+	while (end - pos >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)pos);
+		__m128i m = _mm_cmpeq_epi8(v, _mm_set1_epi8(' '));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\'')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('&')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('|')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('>')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('#')));
+		int mask = _mm_movemask_epi8(m);
+		if (mask != 0)
+			return pos - begin + __builtin_ctz(mask);
+		pos += 16;
+	}
+#elif defined(__ARM_NEON)
+	while (end - pos >= 16) {
+		uint8x16_t v = vld1q_u8((const uint8_t *)pos);
+		uint8x16_t m = vceqq_u8(v, vdupq_n_u8(' '));
+		m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8('\t')));
+		m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8('\r')));
+		m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8('\n')));
+		m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8('\'')));
+		m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8('"')));
+		m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8('\\')));
+		m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8('&')));
+		m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8('|')));
+		m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8('>')));
+		m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8('#')));
+		uint32_t offset = parser_neon_match_offset(m);
+		if (offset < 16)
+			return pos - begin + offset;
+		pos += 16;
+	}
+#endif
+	while (pos < end && !parser_char_is_special(*pos))
+		++pos;
+	return pos - begin;
+}
+
+/**
+ * Same as scan_plain(), but inside a quoted region, where only the
+ * closing quote matters - plus the escape character inside double
+ * quotes. Single quotes take backslashes literally.
+ */
+static uint32_t
+scan_quoted(const char *pos, const char *end, char quote)
+{
+	const char *begin = pos;
+#if defined(__SSE2__) || defined(__ARM_NEON)
+	/* Same short-run probe as in scan_plain(). */
+	const char *probe_end = end - pos < 16 ? end : pos + 16;
+	while (pos < probe_end && *pos != quote &&
+	       (quote != '"' || *pos != '\\'))
+		++pos;
+	if (pos < probe_end || pos == end)
+		return pos - begin;
+#endif
+#if defined(__SSE2__)
+	while (end - pos >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)pos);
+		__m128i m = _mm_cmpeq_epi8(v, _mm_set1_epi8(quote));
+		if (quote == '"') {
+			m = _mm_or_si128(m,
+				_mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+		}
+		int mask = _mm_movemask_epi8(m);
+		if (mask != 0)
+			return pos - begin + __builtin_ctz(mask);
+		pos += 16;
+	}
+#elif defined(__ARM_NEON)
+	while (end - pos >= 16) {
+		uint8x16_t v = vld1q_u8((const uint8_t *)pos);
+		uint8x16_t m = vceqq_u8(v, vdupq_n_u8(quote));
+		if (quote == '"') {
+			m = vorrq_u8(m,
+				vceqq_u8(v, vdupq_n_u8('\\')));
+		}
+		uint32_t offset = parser_neon_match_offset(m);
+		if (offset < 16)
+			return pos - begin + offset;
+		pos += 16;
+	}
+#endif
+	while (pos < end && *pos != quote &&
+	       (quote != '"' || *pos != '\\'))
+		++pos;
+	return pos - begin;
+}
+
 static uint32_t
 parse_token(const char *pos, const char *end, struct token *out)
 {
@@ -151,6 +884,23 @@ parse_token(const char *pos, const char *end, struct token *out)
 	}
 	char quote = 0;
 	while (pos < end) {
+		/*
+		 * Bulk-copy the stretch of bytes the tokenizer doesn't
+		 * have to inspect - the scalar switch below only ever
+		 * sees the interesting ones. On a long word or quoted
+		 * string this is one vector scan and one memcpy instead
+		 * of a per-byte state machine.
+		 */
+		uint32_t plain;
+		if (quote == 0)
+			plain = scan_plain(pos, end);
+		else
+			plain = scan_quoted(pos, end, quote);
+		if (plain != 0) {
+			token_append_many(out, pos, plain);
+			pos += plain;
+			continue;
+		}
 		char c = *pos;
 		switch(c) {
 		case '\'':
@@ -249,13 +999,25 @@ parse_token(const char *pos, const char *end, struct token *out)
 		case '\r':
 			if (quote != 0)
 				goto append_and_next;
-			assert(out->size > 0);
+			if (out->size == 0) {
+				/*
+				 * Nothing collected yet - happens right
+				 * behind a consumed line continuation.
+				 * Keep skipping the whitespace.
+				 */
+				++pos;
+				continue;
+			}
 			out->type = TOKEN_TYPE_STR;
 			return pos + 1 - begin;
 		case '\n':
 			if (quote != 0)
 				goto append_and_next;
-			assert(out->size > 0);
+			if (out->size == 0) {
+				/* A continuation right before the end. */
+				out->type = TOKEN_TYPE_NEW_LINE;
+				return pos + 1 - begin;
+			}
 			out->type = TOKEN_TYPE_STR;
 			return pos - begin;
 		case '#':
@@ -287,11 +1049,23 @@ parse_token(const char *pos, const char *end, struct token *out)
 enum parser_error
 parser_pop_next(struct parser *p, struct command_line **out)
 {
-	struct command_line *line = calloc(1, sizeof(*line));
-	char *pos = p->buffer;
+	if (p->cache != NULL) {
+		struct command_line *hit = parser_cache_lookup(p);
+		if (hit != NULL) {
+			*out = hit;
+			return PARSER_ERR_NONE;
+		}
+	}
+	struct parser_arena *arena = parser_arena_new(p);
+	struct command_line *line = parser_arena_alloc(arena, sizeof(*line));
+	memset(line, 0, sizeof(*line));
+	line->arena = arena;
+	uint32_t input_size;
+	const char *pos = parser_input(p, &input_size);
 	const char *begin = pos;
-	char *end = pos + p->size;
+	const char *end = pos + input_size;
 	struct token token = {0};
+	token.arena = arena;
 	enum parser_error res = PARSER_ERR_NONE;
 
 	while (pos < end) {
@@ -303,13 +1077,14 @@ parser_pop_next(struct parser *p, struct command_line **out)
 		switch(token.type) {
 		case TOKEN_TYPE_STR:
 			if (line->tail != NULL && line->tail->type == EXPR_TYPE_COMMAND) {
-				command_append_arg(&line->tail->cmd, token_strdup(&token));
+				uint32_t len = token.size;
+				command_append_arg(arena, &line->tail->cmd,
+					token_take(&token), len);
 				continue;
 			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_COMMAND;
-			e->cmd.exe = token_strdup(&token);
-			command_line_append(line, e);
+			e = command_line_append(arena, line, EXPR_TYPE_COMMAND);
+			e->cmd.exe_len = token.size;
+			e->cmd.exe = token_take(&token);
 			continue;
 		case TOKEN_TYPE_NEW_LINE:
 			/* Skip new lines. */
@@ -325,9 +1100,7 @@ parser_pop_next(struct parser *p, struct command_line **out)
 				res = PARSER_ERR_PIPE_WITH_LEFT_ARG_NOT_A_COMMAND;
 				goto return_error;
 			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_PIPE;
-			command_line_append(line, e);
+			command_line_append(arena, line, EXPR_TYPE_PIPE);
 			continue;
 		case TOKEN_TYPE_AND:
 			if (line->tail == NULL) {
@@ -338,9 +1111,7 @@ parser_pop_next(struct parser *p, struct command_line **out)
 				res = PARSER_ERR_AND_WITH_LEFT_ARG_NOT_A_COMMAND;
 				goto return_error;
 			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_AND;
-			command_line_append(line, e);
+			command_line_append(arena, line, EXPR_TYPE_AND);
 			continue;
 		case TOKEN_TYPE_OR:
 			if (line->tail == NULL) {
@@ -351,9 +1122,7 @@ parser_pop_next(struct parser *p, struct command_line **out)
 				res = PARSER_ERR_OR_WITH_LEFT_ARG_NOT_A_COMMAND;
 				goto return_error;
 			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_OR;
-			command_line_append(line, e);
+			command_line_append(arena, line, EXPR_TYPE_OR);
 			continue;
 		case TOKEN_TYPE_OUT_NEW:
 		case TOKEN_TYPE_OUT_APPEND:
@@ -380,7 +1149,7 @@ close_and_return:
 			res = PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG;
 			goto return_error;
 		}
-		line->out_file = token_strdup(&token);
+		line->out_file = token_take(&token);
 		used = parse_token(pos, end, &token);
 		if (used == 0)
 			goto return_no_line;
@@ -395,11 +1164,21 @@ close_and_return:
 	}
 	if (token.type == TOKEN_TYPE_NEW_LINE) {
 		assert(line->tail != NULL);
-		parser_consume(p, pos - begin);
+		uint32_t used_total = pos - begin;
 		if (line->tail->type != EXPR_TYPE_COMMAND) {
+			parser_consume(p, used_total);
 			res = PARSER_ERR_ENDS_NOT_WITH_A_COMMAND;
 			goto return_no_line;
 		}
+		/*
+		 * Only lines whose bytes end at their first newline
+		 * can be found by the cache key - don't remember the
+		 * rest.
+		 */
+		if (p->cache != NULL &&
+		    memchr(begin, '\n', used_total - 1) == NULL)
+			parser_cache_insert(p, begin, used_total, line);
+		parser_consume(p, used_total);
 		res = PARSER_ERR_NONE;
 		*out = line;
 		goto return_final;
@@ -426,17 +1205,30 @@ return_error:
 	goto return_no_line;
 
 return_no_line:
-	command_line_delete(line);
+	parser_recycle(p, line);
 	*out = NULL;
 
 return_final:
-	free(token.data);
 	return res;
 }
 
 void
 parser_delete(struct parser *p)
 {
+	parser_borrow_release(p);
+	parser_cache_free(p);
+	struct parser_arena_chunk *chunk = p->free_chunks;
+	while (chunk != NULL) {
+		struct parser_arena_chunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	struct parser_arena *arena = p->free_arenas;
+	while (arena != NULL) {
+		struct parser_arena *next = arena->free_next;
+		free(arena);
+		arena = next;
+	}
 	free(p->buffer);
 	free(p);
 }
@@ -4,6 +4,7 @@
 #include <stdint.h>
 
 struct parser;
+struct parser_arena;
 
 enum parser_error {
 	PARSER_ERR_NONE,
@@ -20,7 +21,15 @@ enum parser_error {
 
 struct command {
 	char *exe;
+	/** Length of exe, without the terminating zero. */
+	uint32_t exe_len;
 	char** args;
+	/**
+	 * Lengths of the args, same indexes as in the args array. The
+	 * strings are zero-terminated anyway, but having the sizes at
+	 * hand saves the consumers a strlen() per word.
+	 */
+	uint32_t *arg_lens;
 	uint32_t arg_count;
 	uint32_t arg_capacity;
 };
@@ -36,6 +45,12 @@ struct expr {
 	enum expr_type type;
 	/** Valid if the type is COMMAND. */
 	struct command cmd;
+	/**
+	 * The following expression of the line. All the expressions
+	 * sit in one contiguous array, see command_line, so this
+	 * always points at the next array cell - kept for the
+	 * consumers walking the chain.
+	 */
 	struct expr *next;
 };
 
@@ -46,12 +61,31 @@ enum output_type {
 };
 
 struct command_line {
+	/**
+	 * The expressions, left to right, in one contiguous arena
+	 * array - executing a long pipeline is a linear scan over it
+	 * with perfect prefetch instead of a pointer chase over
+	 * scattered nodes. Commands and the operators between them
+	 * alternate, so the consumers can index the cells directly.
+	 * Grown by doubling while the line is parsed; the capacity is
+	 * parser-internal.
+	 */
+	struct expr *exprs;
+	uint32_t expr_count;
+	uint32_t expr_capacity;
+	/** &exprs[0] and &exprs[expr_count - 1], NULL when empty. */
 	struct expr *head;
 	struct expr *tail;
 	enum output_type out_type;
 	/** Valid if the out type is FILE. */
 	char *out_file;
 	bool is_background;
+	/**
+	 * Arena holding all the memory of the line - the line
+	 * struct itself, the expressions and the strings. Freed
+	 * whole in command_line_delete().
+	 */
+	struct parser_arena *arena;
 };
 
 void
@@ -63,8 +97,52 @@ parser_new(void);
 void
 parser_feed(struct parser *p, const char *str, uint32_t len);
 
+/**
+ * Same as parser_feed(), but the bytes are not copied - the parser
+ * scans the caller's memory in place and consumes it by advancing
+ * an offset, so batch-parsing a big in-memory script costs no
+ * second pass over its bytes. The region must stay valid until it
+ * is fully parsed or the parser is deleted. If older input is
+ * still pending the call degrades to a plain copying feed.
+ */
+void
+parser_feed_borrowed(struct parser *p, const char *str, uint32_t len);
+
+/**
+ * Map the whole file at @a path and feed it as a borrowed region.
+ * The mapping is owned by the parser and unmapped when the last
+ * line is consumed, or at parser_delete(). Returns 0 on success,
+ * -1 with errno set when the file can't be opened or mapped.
+ */
+int
+parser_feed_mmap(struct parser *p, const char *path);
+
 enum parser_error
 parser_pop_next(struct parser *p, struct command_line **out);
 
+/**
+ * Enable a parse cache of up to @a limit distinct lines, keyed by
+ * the raw line bytes. When a fed line matches a cached one
+ * byte-for-byte, parser_pop_next() returns a copy of the cached
+ * result without tokenizing anything - for workloads feeding the
+ * same few hundred lines millions of times this removes nearly
+ * all the parsing work. The returned lines are owned by the
+ * caller as usual. Zero disables and drops the cache - the
+ * default. Lines with embedded newlines bypass the cache.
+ */
+void
+parser_set_cache_limit(struct parser *p, uint32_t limit);
+
+/**
+ * Same as command_line_delete(), but the line's memory goes into
+ * the parser's free lists instead of being freed, and the next
+ * lines are built out of it - a steady stream of similar lines is
+ * then parsed with no allocations per line. The kept amount is
+ * capped, the overflow is freed as usual. The parser doesn't have
+ * to be the one which produced the line.
+ */
+void
+parser_recycle(struct parser *p, struct command_line *line);
+
 void
 parser_delete(struct parser *p);
@@ -0,0 +1,187 @@
+#include "parser.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * Benchmarks of the parser hot paths. Unlike parser_test.c this
+ * measures speed, not correctness - a regression gate for the
+ * tokenizer and the arena allocator. Each corpus is a bundled set
+ * of generated lines shaped after a real workload class. A run
+ * feeds and pops the corpus line by line; the first run warms the
+ * caches and the parser's free lists, then the median of the timed
+ * runs is reported. The output is machine-readable, one
+ * 'key value unit' triple per line, so the numbers can be tracked
+ * across releases.
+ *
+ * Build with 'make bench'.
+ */
+
+enum {
+	BENCH_RUN_COUNT = 7,
+	BENCH_REPEAT_COUNT = 2000,
+};
+
+static double
+now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void
+report(const char *key, double value, const char *unit)
+{
+	printf("%s %.2f %s\n", key, value, unit);
+}
+
+static int
+double_cmp(const void *a, const void *b)
+{
+	double l = *(const double *)a;
+	double r = *(const double *)b;
+	return l < r ? -1 : l > r;
+}
+
+////////////////////////////////////////////////////////////////////
+
+struct corpus {
+	char **lines;
+	uint32_t *lens;
+	uint32_t count;
+	uint32_t capacity;
+	size_t byte_count;
+};
+
+static void
+corpus_add(struct corpus *c, const char *fmt, ...)
+{
+	char buf[4096];
+	va_list va;
+	va_start(va, fmt);
+	int len = vsnprintf(buf, sizeof(buf), fmt, va);
+	va_end(va);
+	if (c->count == c->capacity) {
+		c->capacity = c->capacity == 0 ? 64 : c->capacity * 2;
+		c->lines = realloc(c->lines, c->capacity * sizeof(*c->lines));
+		c->lens = realloc(c->lens, c->capacity * sizeof(*c->lens));
+	}
+	c->lines[c->count] = strdup(buf);
+	c->lens[c->count] = len;
+	c->byte_count += len;
+	++c->count;
+}
+
+static void
+corpus_free(struct corpus *c)
+{
+	for (uint32_t i = 0; i < c->count; ++i)
+		free(c->lines[i]);
+	free(c->lines);
+	free(c->lens);
+}
+
+/** Short commands chained with pipes and logic operators. */
+static void
+corpus_make_pipe_heavy(struct corpus *c)
+{
+	for (int i = 0; i < 200; ++i) {
+		corpus_add(c, "cat file%d.txt | grep pattern%d | sort -u | "
+			   "uniq -c | wc -l && echo ok%d || echo fail%d\n",
+			   i, i, i, i);
+		corpus_add(c, "ls -la dir%d | awk body | head -n %d | "
+			   "tail -n 3 > out%d.txt\n", i, i + 5, i);
+	}
+}
+
+/** Long quoted strings, both kinds of quotes, escapes inside. */
+static void
+corpus_make_quote_heavy(struct corpus *c)
+{
+	for (int i = 0; i < 200; ++i) {
+		corpus_add(c, "echo \"a rather long double quoted string "
+			   "number %d with \\\"escaped\\\" parts and a pipe "
+			   "| inside\" 'a single quoted one with spaces and "
+			   "specials > & #%d' \"trailing %d\"\n", i, i, i);
+	}
+}
+
+/** One command with many long unquoted words. */
+static void
+corpus_make_long_argv(struct corpus *c)
+{
+	char buf[4096];
+	for (int i = 0; i < 100; ++i) {
+		int pos = snprintf(buf, sizeof(buf), "program%d", i);
+		for (int j = 0; j < 40; ++j) {
+			pos += snprintf(buf + pos, sizeof(buf) - pos,
+					" --option-with-a-long-name-%d-%d="
+					"/some/deep/path/to/a/file%d", i, j, j);
+		}
+		corpus_add(c, "%s\n", buf);
+	}
+}
+
+/**
+ * Parse the whole corpus once, line by line - each line is fed and
+ * popped separately like an interactive shell would, so the
+ * parser's internal buffer stays small. The lines are recycled to
+ * exercise the steady state of the arena free lists.
+ */
+static void
+corpus_run(struct parser *p, const struct corpus *c)
+{
+	for (uint32_t i = 0; i < c->count; ++i) {
+		parser_feed(p, c->lines[i], c->lens[i]);
+		struct command_line *line = NULL;
+		enum parser_error err = parser_pop_next(p, &line);
+		if (err != PARSER_ERR_NONE || line == NULL) {
+			fprintf(stderr, "corpus line %u failed to parse\n", i);
+			exit(1);
+		}
+		parser_recycle(p, line);
+	}
+}
+
+static void
+bench_corpus(const char *name, void (*make)(struct corpus *))
+{
+	struct corpus c = {0};
+	make(&c);
+	struct parser *p = parser_new();
+	/* Warmup - populate the free lists, fault the corpus in. */
+	corpus_run(p, &c);
+
+	double times[BENCH_RUN_COUNT];
+	for (int run = 0; run < BENCH_RUN_COUNT; ++run) {
+		double t = now_sec();
+		for (int i = 0; i < BENCH_REPEAT_COUNT; ++i)
+			corpus_run(p, &c);
+		times[run] = now_sec() - t;
+	}
+	parser_delete(p);
+	qsort(times, BENCH_RUN_COUNT, sizeof(times[0]), double_cmp);
+	double median = times[BENCH_RUN_COUNT / 2];
+	uint64_t line_count = (uint64_t)c.count * BENCH_REPEAT_COUNT;
+	double byte_count = (double)c.byte_count * BENCH_REPEAT_COUNT;
+
+	char key[128];
+	snprintf(key, sizeof(key), "%s_throughput", name);
+	report(key, byte_count / median / 1e6, "MB/sec");
+	snprintf(key, sizeof(key), "%s_lines", name);
+	report(key, line_count / median / 1e6, "Mlines/sec");
+	corpus_free(&c);
+}
+
+int
+main(void)
+{
+	bench_corpus("pipe_heavy", corpus_make_pipe_heavy);
+	bench_corpus("quote_heavy", corpus_make_quote_heavy);
+	bench_corpus("long_argv", corpus_make_long_argv);
+	return 0;
+}
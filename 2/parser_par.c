@@ -0,0 +1,220 @@
+#include "parser_par.h"
+#include "../4/thread_pool.h"
+
+#include <stdlib.h>
+
+enum {
+	/**
+	 * Default target chunk size. A 50 MB script makes ~200 chunks
+	 * out of it - enough to balance across any sane core count
+	 * while the per-task overhead stays invisible.
+	 */
+	PAR_CHUNK_TARGET = 256 * 1024,
+};
+
+/** One popped result of a chunk, in the chunk's own order. */
+struct par_result {
+	enum parser_error err;
+	/** NULL when err says the line didn't parse. */
+	struct command_line *line;
+};
+
+/** One independently parsed piece of the input. */
+struct par_chunk {
+	const char *str;
+	uint32_t len;
+	struct thread_task *task;
+	bool is_joined;
+	/** The lines of the chunk, recorded by the task in order. */
+	struct par_result *results;
+	int result_count;
+	int result_capacity;
+	/** The consumer's cursor over the results. */
+	int pos;
+};
+
+struct parser_par {
+	struct thread_pool *pool;
+	uint32_t chunk_size;
+	struct par_chunk **chunks;
+	int chunk_count;
+	int chunk_capacity;
+	/** The consumer's cursor over the chunks. */
+	int pos;
+};
+
+/**
+ * The task body: one private parser eats the whole chunk and the
+ * results pile up in the chunk. No locks - until the join nobody
+ * else looks at the chunk.
+ */
+static void *
+par_chunk_parse(void *arg)
+{
+	struct par_chunk *chunk = arg;
+	struct parser *parser = parser_new();
+	parser_feed_borrowed(parser, chunk->str, chunk->len);
+	while (true) {
+		struct command_line *line = NULL;
+		enum parser_error err = parser_pop_next(parser, &line);
+		if (err == PARSER_ERR_NONE && line == NULL)
+			break;
+		if (chunk->result_count == chunk->result_capacity) {
+			int new_capacity = chunk->result_capacity == 0 ?
+				16 : chunk->result_capacity * 2;
+			struct par_result *new_results = realloc(
+				chunk->results,
+				new_capacity * sizeof(*new_results));
+			if (new_results == NULL) {
+				/* Out of memory - drop the tail. */
+				if (line != NULL)
+					command_line_delete(line);
+				break;
+			}
+			chunk->results = new_results;
+			chunk->result_capacity = new_capacity;
+		}
+		chunk->results[chunk->result_count].err = err;
+		chunk->results[chunk->result_count].line = line;
+		++chunk->result_count;
+	}
+	parser_delete(parser);
+	return NULL;
+}
+
+/** Wrap [str, str + len) into a chunk and hand it to the pool. */
+static int
+par_chunk_push(struct parser_par *p, const char *str, uint32_t len)
+{
+	if (p->chunk_count == p->chunk_capacity) {
+		int new_capacity = p->chunk_capacity == 0 ?
+			16 : p->chunk_capacity * 2;
+		struct par_chunk **new_chunks = realloc(p->chunks,
+			new_capacity * sizeof(*new_chunks));
+		if (new_chunks == NULL)
+			return -1;
+		p->chunks = new_chunks;
+		p->chunk_capacity = new_capacity;
+	}
+	struct par_chunk *chunk = calloc(1, sizeof(*chunk));
+	if (chunk == NULL)
+		return -1;
+	chunk->str = str;
+	chunk->len = len;
+	if (thread_task_new(&chunk->task, par_chunk_parse, chunk) != 0) {
+		free(chunk);
+		return -1;
+	}
+	p->chunks[p->chunk_count++] = chunk;
+	if (thread_pool_push_task(p->pool, chunk->task) != 0) {
+		/* The pool is full - parse right here instead. */
+		par_chunk_parse(chunk);
+		thread_task_delete(chunk->task);
+		chunk->task = NULL;
+		chunk->is_joined = true;
+	}
+	return 0;
+}
+
+struct parser_par *
+parser_par_new(struct thread_pool *pool, uint32_t chunk_size)
+{
+	struct parser_par *p = calloc(1, sizeof(*p));
+	if (p == NULL)
+		return NULL;
+	p->pool = pool;
+	p->chunk_size = chunk_size != 0 ? chunk_size : PAR_CHUNK_TARGET;
+	return p;
+}
+
+int
+parser_par_feed(struct parser_par *p, const char *str, uint32_t len)
+{
+	/*
+	 * One quick pass over the bytes to find the safe split spots.
+	 * The scan tracks the same states the tokenizer does - quotes,
+	 * escapes, comments - so a newline inside any of them never
+	 * becomes a boundary. Per byte it is a few compares, nothing
+	 * against the parsing work the chunks carry away.
+	 */
+	uint32_t begin = 0;
+	char quote = 0;
+	bool in_comment = false;
+	for (uint32_t i = 0; i < len; ++i) {
+		char c = str[i];
+		if (in_comment) {
+			if (c != '\n')
+				continue;
+			in_comment = false;
+		} else if (c == '\\' && quote != '\'') {
+			/* The escaped byte, maybe a newline - skip it. */
+			++i;
+			continue;
+		} else if (quote != 0) {
+			if (c == quote)
+				quote = 0;
+			continue;
+		} else if (c == '\'' || c == '"') {
+			quote = c;
+			continue;
+		} else if (c == '#') {
+			in_comment = true;
+			continue;
+		} else if (c != '\n') {
+			continue;
+		}
+		/* A safe newline. Close the chunk once it is big enough. */
+		if (i + 1 - begin < p->chunk_size)
+			continue;
+		if (par_chunk_push(p, str + begin, i + 1 - begin) != 0)
+			return -1;
+		begin = i + 1;
+	}
+	if (begin < len && par_chunk_push(p, str + begin, len - begin) != 0)
+		return -1;
+	return 0;
+}
+
+enum parser_error
+parser_par_pop_next(struct parser_par *p, struct command_line **out)
+{
+	while (p->pos < p->chunk_count) {
+		struct par_chunk *chunk = p->chunks[p->pos];
+		if (!chunk->is_joined) {
+			void *result;
+			thread_task_join(chunk->task, &result);
+			thread_task_delete(chunk->task);
+			chunk->task = NULL;
+			chunk->is_joined = true;
+		}
+		if (chunk->pos < chunk->result_count) {
+			struct par_result *r = &chunk->results[chunk->pos++];
+			*out = r->line;
+			return r->err;
+		}
+		++p->pos;
+	}
+	*out = NULL;
+	return PARSER_ERR_NONE;
+}
+
+void
+parser_par_delete(struct parser_par *p)
+{
+	for (int i = 0; i < p->chunk_count; ++i) {
+		struct par_chunk *chunk = p->chunks[i];
+		if (!chunk->is_joined) {
+			void *result;
+			thread_task_join(chunk->task, &result);
+			thread_task_delete(chunk->task);
+		}
+		for (int j = chunk->pos; j < chunk->result_count; ++j) {
+			if (chunk->results[j].line != NULL)
+				command_line_delete(chunk->results[j].line);
+		}
+		free(chunk->results);
+		free(chunk);
+	}
+	free(p->chunks);
+	free(p);
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "parser.h"
+
+struct thread_pool;
+
+/**
+ * Parallel front-end over the parser. A fed region is split at safe
+ * line boundaries into chunks, each chunk is parsed by its own
+ * parser instance as a task on the caller's thread pool, and the
+ * lines come back merged in the input order - the consumer sees
+ * exactly the sequential stream while the parsing itself scales
+ * with the cores.
+ */
+struct parser_par;
+
+/**
+ * Create the front-end on top of @a pool. The pool is borrowed -
+ * the caller owns it and may share it with other work. @a
+ * chunk_size is the target chunk byte size, 0 for the default;
+ * smaller chunks balance better, bigger ones amortize the per-task
+ * overhead. Returns NULL when out of memory.
+ */
+struct parser_par *
+parser_par_new(struct thread_pool *pool, uint32_t chunk_size);
+
+/**
+ * Split the region and parse the chunks in parallel. The bytes are
+ * borrowed like in parser_feed_borrowed() - the region must stay
+ * valid until all its lines are popped or the front-end is deleted.
+ * A chunk boundary is only ever placed behind a newline outside
+ * quotes and comments and not escaped, so quoted and continued
+ * lines never get torn. Each fed region parses independently - it
+ * should end with a newline, an unterminated trailing line never
+ * completes. Returns 0, or -1 when out of memory.
+ */
+int
+parser_par_feed(struct parser_par *p, const char *str, uint32_t len);
+
+/**
+ * Pop the next line, in the original input order, exactly like
+ * parser_pop_next() would produce it. Joins the owning chunk's task
+ * on first access - consuming the early lines overlaps with the
+ * later chunks still parsing. *out is NULL when everything fed so
+ * far is consumed.
+ */
+enum parser_error
+parser_par_pop_next(struct parser_par *p, struct command_line **out);
+
+/** Join the leftover tasks, free the unpopped lines. */
+void
+parser_par_delete(struct parser_par *p);
@@ -1,8 +1,11 @@
 #include "parser.h"
+#include "parser_par.h"
+#include "../4/thread_pool.h"
 
 #include "unit.h"
 
 #include <string.h>
+#include <unistd.h>
 
 static void
 test_one_word(void)
@@ -364,6 +367,21 @@ test_escape_outside_of_string(void)
 	unit_check(e->next == NULL, "no more exprs");
 	command_line_delete(line);
 
+	unit_msg("Whitespace right behind an escaped new line");
+	/*
+	 * echo a \
+	 *  b
+	 */
+	str = "echo a \\\n b\n";
+	parser_feed(p, str, strlen(str));
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	e = line->head;
+	unit_check(strcmp(e->cmd.exe, "echo") == 0, "exe");
+	unit_check(e->cmd.arg_count == 2, "arg count");
+	unit_check(strcmp(e->cmd.args[0], "a") == 0, "arg[0]");
+	unit_check(strcmp(e->cmd.args[1], "b") == 0, "arg[1]");
+	command_line_delete(line);
+
 	parser_delete(p);
 	unit_test_finish();
 }
@@ -819,6 +837,229 @@ test_errors(void)
 	unit_test_finish();
 }
 
+static void
+test_recycle(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+
+	/* A recycled line's memory serves the next lines. */
+	for (int i = 0; i < 10; ++i) {
+		parser_feed(p, "echo one two | grep three && ls\n", 32);
+		unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE,
+			   "parse");
+		unit_check(line != NULL, "got line");
+		struct expr *e = line->head;
+		unit_check(e->type == EXPR_TYPE_COMMAND, "expr type");
+		unit_check(strcmp(e->cmd.exe, "echo") == 0, "exe");
+		unit_check(e->cmd.arg_count == 2, "arg count");
+		unit_check(strcmp(e->cmd.args[1], "two") == 0, "arg");
+		parser_recycle(p, line);
+	}
+	/* Deleting the parser frees whatever it kept. */
+	parser_feed(p, "ls\n", 3);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	/* A line can also outlive the parser when deleted normally. */
+	parser_delete(p);
+	unit_check(strcmp(line->head->cmd.exe, "ls") == 0, "exe");
+	command_line_delete(line);
+	unit_test_finish();
+}
+
+static void
+test_parse_cache(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+	parser_set_cache_limit(p, 16);
+
+	const char *text = "echo \"a b\" two | grep three > out.txt &\n";
+	uint32_t text_len = strlen(text);
+	/* The first pop parses and caches, the rest hit. */
+	for (int i = 0; i < 5; ++i) {
+		parser_feed(p, text, text_len);
+		unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE,
+			   "parse");
+		unit_check(line != NULL, "got line");
+		struct expr *e = line->head;
+		unit_check(e->type == EXPR_TYPE_COMMAND, "expr type");
+		unit_check(strcmp(e->cmd.exe, "echo") == 0, "exe");
+		unit_check(e->cmd.arg_count == 2, "arg count");
+		unit_check(strcmp(e->cmd.args[0], "a b") == 0, "arg 0");
+		unit_check(e->cmd.args[0][e->cmd.arg_lens[0]] == 0,
+			   "arg 0 is terminated");
+		unit_check(e->next != NULL &&
+			   e->next->type == EXPR_TYPE_PIPE, "pipe");
+		unit_check(strcmp(line->out_file, "out.txt") == 0, "out file");
+		unit_check(line->out_type == OUTPUT_TYPE_FILE_NEW,
+			   "out type is new");
+		unit_check(line->is_background, "background");
+		/* Cached copies recycle like ordinary lines. */
+		parser_recycle(p, line);
+	}
+	/* Different bytes must not hit. */
+	parser_feed(p, "echo other\n", 11);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(strcmp(line->head->cmd.args[0], "other") == 0, "arg");
+	command_line_delete(line);
+	/* Disabling drops the cache. */
+	parser_set_cache_limit(p, 0);
+	parser_feed(p, text, text_len);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(strcmp(line->head->cmd.exe, "echo") == 0, "exe");
+	command_line_delete(line);
+	parser_delete(p);
+	unit_test_finish();
+}
+
+static void
+test_feed_borrowed(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+
+	/* Two complete lines and an incomplete tail, zero-copy. */
+	const char *text = "echo one | grep two\nls -la\npwd";
+	parser_feed_borrowed(p, text, strlen(text));
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(strcmp(line->head->cmd.exe, "echo") == 0, "exe 1");
+	unit_check(line->head->next != NULL &&
+		   line->head->next->type == EXPR_TYPE_PIPE, "pipe");
+	command_line_delete(line);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(strcmp(line->head->cmd.exe, "ls") == 0, "exe 2");
+	command_line_delete(line);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(line == NULL, "tail is incomplete");
+	/* A copying feed migrates the borrowed tail into the buffer. */
+	parser_feed(p, "\n", 1);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(strcmp(line->head->cmd.exe, "pwd") == 0, "exe 3");
+	command_line_delete(line);
+	parser_delete(p);
+	unit_test_finish();
+}
+
+static void
+test_feed_mmap(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+
+	const char *path = "test_feed_mmap.txt";
+	FILE *f = fopen(path, "w");
+	unit_check(f != NULL, "create the script file");
+	fprintf(f, "echo \"a b\" > out.txt\ncat in.txt | wc -l &\n");
+	fclose(f);
+
+	unit_check(parser_feed_mmap(p, path) == 0, "map the file");
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(strcmp(line->head->cmd.exe, "echo") == 0, "exe 1");
+	unit_check(strcmp(line->head->cmd.args[0], "a b") == 0, "arg");
+	unit_check(strcmp(line->out_file, "out.txt") == 0, "out file");
+	command_line_delete(line);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(strcmp(line->head->cmd.exe, "cat") == 0, "exe 2");
+	unit_check(line->is_background, "background");
+	command_line_delete(line);
+	/* Fully drained - the mapping is gone, the parser is empty. */
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(line == NULL, "no more lines");
+
+	unit_check(parser_feed_mmap(p, "no_such_file.txt") == -1,
+		   "missing file fails");
+	unlink(path);
+	parser_delete(p);
+	unit_test_finish();
+}
+
+static void
+test_parallel(void)
+{
+	unit_test_start();
+	/*
+	 * A script with everything the splitter must not tear: quoted
+	 * newlines, continuations, comments with quotes in them, and a
+	 * broken line in the middle. Repeated so the tiny chunk size
+	 * makes many chunks out of it.
+	 */
+	const char *piece =
+		"echo one\n"
+		"echo 'multi\nline'\n"
+		"echo a \\\n b\n"
+		"# it's a comment\n"
+		"| bad\n"
+		"echo \"done\"\n";
+	enum { PIECE_COUNT = 50 };
+	size_t piece_len = strlen(piece);
+	char *script = malloc(piece_len * PIECE_COUNT + 1);
+	unit_check(script != NULL, "alloc the script");
+	for (int i = 0; i < PIECE_COUNT; ++i)
+		memcpy(script + i * piece_len, piece, piece_len + 1);
+	uint32_t script_len = piece_len * PIECE_COUNT;
+
+	struct thread_pool *pool;
+	unit_check(thread_pool_new(4, &pool) == 0, "create the pool");
+	/* A 64 byte chunk target tears at nearly every safe newline. */
+	struct parser_par *par = parser_par_new(pool, 64);
+	unit_check(par != NULL, "create the front-end");
+	unit_check(parser_par_feed(par, script, script_len) == 0, "feed");
+
+	/* The reference stream from the sequential parser. */
+	struct parser *seq = parser_new();
+	parser_feed(seq, script, script_len);
+
+	int line_count = 0;
+	int err_count = 0;
+	bool is_same = true;
+	while (true) {
+		struct command_line *line = NULL;
+		struct command_line *ref = NULL;
+		enum parser_error err = parser_par_pop_next(par, &line);
+		enum parser_error ref_err = parser_pop_next(seq, &ref);
+		is_same = is_same && err == ref_err;
+		if (err != PARSER_ERR_NONE) {
+			++err_count;
+			if (ref != NULL)
+				command_line_delete(ref);
+			continue;
+		}
+		if (line == NULL) {
+			is_same = is_same && ref == NULL;
+			break;
+		}
+		++line_count;
+		is_same = is_same && ref != NULL &&
+			strcmp(line->head->cmd.exe, ref->head->cmd.exe) == 0 &&
+			line->head->cmd.arg_count == ref->head->cmd.arg_count;
+		command_line_delete(line);
+		if (ref != NULL)
+			command_line_delete(ref);
+	}
+	unit_check(line_count == 4 * PIECE_COUNT, "all the lines came out");
+	unit_check(err_count == PIECE_COUNT, "every broken line reported");
+	unit_check(is_same, "the merged stream matches the sequential one");
+	parser_delete(seq);
+	parser_par_delete(par);
+
+	/* Deletion with unpopped lines cleans up after itself. */
+	par = parser_par_new(pool, 64);
+	unit_check(parser_par_feed(par, script, script_len) == 0, "feed again");
+	struct command_line *line = NULL;
+	unit_check(parser_par_pop_next(par, &line) == PARSER_ERR_NONE &&
+		   line != NULL, "pop one line");
+	command_line_delete(line);
+	parser_par_delete(par);
+
+	unit_check(thread_pool_delete(pool) == 0, "delete the pool");
+	free(script);
+	unit_test_finish();
+}
+
 int
 main(void)
 {
@@ -834,5 +1075,10 @@ main(void)
 	test_logical_operators();
 	test_background();
 	test_errors();
+	test_recycle();
+	test_parse_cache();
+	test_feed_borrowed();
+	test_feed_mmap();
+	test_parallel();
 	return 0;
 }
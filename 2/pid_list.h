@@ -2,124 +2,399 @@
 
 #include <stdlib.h>
 #include <assert.h>
+#include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 
-#define BG_PROC_ARR_INIT_SIZE 10
-#define BG_PROC_ARR_GROW_COEFF 2
+/*
+ * Hash-indexed table of background process ids. The old registry was
+ * a flat array scanned linearly with one waitpid(pid, WNOHANG) per
+ * tracked job on every reap, so reaping cost grew with the number of
+ * live background jobs. The table gives O(1) insert/remove.
+ *
+ * Completion discovery is pidfd-based where the kernel supports it:
+ * every inserted pid gets a pidfd_open() descriptor registered in an
+ * epoll set, and the reap handles exactly the children whose fds
+ * became readable - O(ready) work, no waitpid sweeps and no SIGCHLD
+ * involvement at all. Each exited child is then reaped with a
+ * targeted waitpid(pid), so the reap can never steal the exit status
+ * of a foreground child being waited elsewhere, which the old
+ * waitpid(-1, WNOHANG) drain could. The drain remains as the
+ * fallback when pidfd_open() or epoll are unavailable.
+ *
+ * Open addressing with linear probing; pids 0 and -1 never name real
+ * children, so they serve as the free and the deleted slot markers.
+ */
 
-struct process_registry {
-	size_t size;
-	size_t capacity;
-	pid_t *children;
+#define PID_TABLE_INIT_CAPACITY 16
+#define PID_TABLE_SLOT_FREE ((pid_t)0)
+#define PID_TABLE_SLOT_DELETED ((pid_t)-1)
+
+struct pid_table {
+    /** Number of live pids. */
+    size_t count;
+    /** Live pids plus deleted-slot markers. */
+    size_t used;
+    /** Slot count, always a power of two. */
+    size_t capacity;
+    pid_t *slots;
+    /** Pidfds of the live pids, same indexes as the slots. */
+    int *pidfds;
+    /** Epoll set of the pidfds, -1 in the fallback mode. */
+    int epoll_fd;
+    /**
+     * Set when some child couldn't get a pidfd - the reap then
+     * falls back to the waitpid(-1, WNOHANG) drain for all of
+     * them, pidfds included.
+     */
+    int use_wait_drain;
 };
 
 static inline int
-initialize_process_registry(struct process_registry *arr)
+pid_table_pidfd_open(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static inline int
+pid_table_init(struct pid_table *table)
 {
-    if (arr == NULL) {
+    if (table == NULL) {
         return 1;
     }
-    arr->size = 0;
-    arr->capacity = 10;
-    arr->children = (pid_t *)malloc(sizeof(pid_t) * arr->capacity);
-    if (arr->children == NULL) {
+    table->count = 0;
+    table->used = 0;
+    table->capacity = PID_TABLE_INIT_CAPACITY;
+    table->slots = (pid_t *)calloc(table->capacity, sizeof(pid_t));
+    if (table->slots == NULL) {
         return 1;
     }
-
+    table->pidfds = (int *)malloc(table->capacity * sizeof(int));
+    if (table->pidfds == NULL) {
+        free(table->slots);
+        table->slots = NULL;
+        return 1;
+    }
+    for (size_t i = 0; i < table->capacity; ++i) {
+        table->pidfds[i] = -1;
+    }
+    table->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    table->use_wait_drain = table->epoll_fd < 0;
     return 0;
 }
 
 static inline void
-release_process_registry(struct process_registry *arr)
+pid_table_free(struct pid_table *table)
 {
-    if (arr != NULL && arr->children != NULL) {
-        size_t size = 0;
-        while(arr->children[size] != 0 && size < arr->size){
-            size++;
-        }
-        if(size > 0){
-          free(arr->children);
-          arr->children = NULL;
+    if (table == NULL || table->slots == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < table->capacity; ++i) {
+        if (table->pidfds[i] >= 0) {
+            close(table->pidfds[i]);
         }
     }
+    if (table->epoll_fd >= 0) {
+        close(table->epoll_fd);
+        table->epoll_fd = -1;
+    }
+    free(table->pidfds);
+    table->pidfds = NULL;
+    free(table->slots);
+    table->slots = NULL;
 }
 
-static inline int
-adjust_process_registry_capacity(struct process_registry *arr)
+static inline size_t
+pid_table_hash(pid_t pid, size_t capacity)
 {
-    if (!arr) return 1;
-
-    size_t target_capacity = 0;
-    size_t threshold = BG_PROC_ARR_INIT_SIZE;
-    size_t factor = BG_PROC_ARR_GROW_COEFF;
+    return ((size_t)pid * 2654435761u) & (capacity - 1);
+}
 
-    if (arr->size * factor < arr->capacity && arr->size > threshold) {
-        target_capacity = arr->capacity / factor;
-    } else if (arr->size == arr->capacity) {
-        target_capacity = arr->capacity * factor;
+/** Put the pid into its slot. The pidfd travels along on rehash. */
+static inline void
+pid_table_place(struct pid_table *table, pid_t pid, int pidfd)
+{
+    size_t index = pid_table_hash(pid, table->capacity);
+    while (table->slots[index] != PID_TABLE_SLOT_FREE &&
+           table->slots[index] != PID_TABLE_SLOT_DELETED) {
+        assert(table->slots[index] != pid);
+        index = (index + 1) & (table->capacity - 1);
+    }
+    if (table->slots[index] == PID_TABLE_SLOT_FREE) {
+        table->used++;
     }
+    table->slots[index] = pid;
+    table->pidfds[index] = pidfd;
+    table->count++;
+}
 
-    if (!target_capacity) return 0;
+static inline int
+pid_table_rehash(struct pid_table *table, size_t new_capacity)
+{
+    pid_t *old_slots = table->slots;
+    int *old_pidfds = table->pidfds;
+    size_t old_capacity = table->capacity;
 
-    pid_t *temp_children = (pid_t *)realloc(arr->children, sizeof(pid_t) * target_capacity);
-    if (!temp_children) return 1;
+    table->slots = (pid_t *)calloc(new_capacity, sizeof(pid_t));
+    if (table->slots == NULL) {
+        table->slots = old_slots;
+        return 1;
+    }
+    table->pidfds = (int *)malloc(new_capacity * sizeof(int));
+    if (table->pidfds == NULL) {
+        free(table->slots);
+        table->slots = old_slots;
+        table->pidfds = old_pidfds;
+        return 1;
+    }
+    for (size_t i = 0; i < new_capacity; ++i) {
+        table->pidfds[i] = -1;
+    }
+    table->capacity = new_capacity;
+    table->count = 0;
+    table->used = 0;
+    for (size_t i = 0; i < old_capacity; ++i) {
+        pid_t pid = old_slots[i];
+        if (pid != PID_TABLE_SLOT_FREE && pid != PID_TABLE_SLOT_DELETED) {
+            pid_table_place(table, pid, old_pidfds[i]);
+        }
+    }
+    free(old_slots);
+    free(old_pidfds);
+    return 0;
+}
 
-    arr->children = temp_children;
-    arr->capacity = target_capacity;
+static inline int
+pid_table_insert(struct pid_table *table, pid_t pid)
+{
+    if (table == NULL || table->slots == NULL) {
+        return 1;
+    }
+    /* Keep the load factor under 3/4, counting the tombstones. */
+    if ((table->used + 1) * 4 > table->capacity * 3) {
+        size_t new_capacity = table->capacity;
+        if ((table->count + 1) * 2 > table->capacity) {
+            new_capacity *= 2;
+        }
+        if (pid_table_rehash(table, new_capacity) != 0) {
+            return 1;
+        }
+    }
+    int pidfd = -1;
+    if (table->epoll_fd >= 0) {
+        pidfd = pid_table_pidfd_open(pid);
+        if (pidfd >= 0) {
+            struct epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLIN;
+            ev.data.u64 = (uint64_t)pid;
+            if (epoll_ctl(table->epoll_fd, EPOLL_CTL_ADD, pidfd, &ev) != 0) {
+                close(pidfd);
+                pidfd = -1;
+            }
+        }
+        if (pidfd < 0) {
+            /* The kernel can't watch this child - drain instead. */
+            table->use_wait_drain = 1;
+        }
+    }
+    pid_table_place(table, pid, pidfd);
     return 0;
 }
 
 static inline int
-check_completed_processes(struct process_registry *arr)
+pid_table_remove(struct pid_table *table, pid_t pid)
 {
-    if (!arr) return 1;
+    if (table == NULL || table->slots == NULL) {
+        return 1;
+    }
+    size_t index = pid_table_hash(pid, table->capacity);
+    while (table->slots[index] != PID_TABLE_SLOT_FREE) {
+        if (table->slots[index] == pid) {
+            table->slots[index] = PID_TABLE_SLOT_DELETED;
+            if (table->pidfds[index] >= 0) {
+                /* Closing also removes it from the epoll set. */
+                close(table->pidfds[index]);
+                table->pidfds[index] = -1;
+            }
+            table->count--;
+            return 0;
+        }
+        index = (index + 1) & (table->capacity - 1);
+    }
+    return 1;
+}
 
-    size_t index = 0;
-    while (index < arr->size) {
-        if (waitpid(arr->children[index], NULL, WNOHANG) > 0) {
-            arr->size--;
+/**
+ * Handle one batch of epoll readiness events: reap each exited
+ * child with a targeted waitpid and drop it from the table.
+ * @a timeout_ms goes to epoll - zero polls, -1 blocks until some
+ * child exits. Returns how many children were handled, -1 on an
+ * epoll error.
+ */
+static inline int
+pid_table_reap_ready(struct pid_table *table, int timeout_ms)
+{
+    struct epoll_event evs[32];
+    int rc = epoll_wait(table->epoll_fd, evs,
+                        (int)(sizeof(evs) / sizeof(evs[0])), timeout_ms);
+    if (rc < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+    for (int i = 0; i < rc; ++i) {
+        pid_t pid = (pid_t)evs[i].data.u64;
+        waitpid(pid, NULL, WNOHANG);
+        pid_table_remove(table, pid);
+    }
+    return rc;
+}
 
-            if (index < arr->size) {
-                memmove(&arr->children[index], &arr->children[index + 1], sizeof(pid_t) * (arr->size - index));
+/*
+ * Reap every already-exited child. With pidfds the kernel hands
+ * over exactly the exited ones - O(ready); the fallback drains
+ * waitpid(-1, WNOHANG), where children not present in the table
+ * (there shouldn't be any at the call sites) are reaped and
+ * ignored.
+ */
+static inline int
+pid_table_reap_batch(struct pid_table *table)
+{
+    if (table == NULL) {
+        return 1;
+    }
+    if (!table->use_wait_drain) {
+        while (table->count > 0) {
+            int rc = pid_table_reap_ready(table, 0);
+            if (rc < 0) {
+                return 1;
+            }
+            if (rc == 0) {
+                break;
             }
-        } else {
-            index++;
         }
+        return 0;
     }
-
-    return adjust_process_registry_capacity(arr);
+    while (table->count > 0) {
+        pid_t pid = waitpid(-1, NULL, WNOHANG);
+        if (pid <= 0) {
+            break;
+        }
+        pid_table_remove(table, pid);
+    }
+    return 0;
 }
 
+/* Block until every tracked child exits. */
 static inline int
-pid_array_wait_and_free(struct process_registry *arr)
+pid_table_wait_all(struct pid_table *table)
 {
-    if (!arr) return -1;
+    if (table == NULL) {
+        return 1;
+    }
+    if (!table->use_wait_drain) {
+        while (table->count > 0) {
+            if (pid_table_reap_ready(table, -1) < 0) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+    while (table->count > 0) {
+        pid_t pid = waitpid(-1, NULL, 0);
+        if (pid <= 0) {
+            break;
+        }
+        pid_table_remove(table, pid);
+    }
+    return 0;
+}
 
-    int final_status = 0;
-    size_t current_child = 0;
+/*
+ * Fixed-size lock-free SPSC ring of exited pids. For programs which
+ * discover exits in a SIGCHLD handler instead of the pidfd set: the
+ * handler pushes the pid it reaped and returns, the main loop drains
+ * the ring into the table at its leisure. Push and pop are one
+ * relaxed load, one acquire load and one release store each - no
+ * locks, no signal masking anywhere, and push is async-signal-safe.
+ * Single producer (the handler), single consumer (the main loop).
+ * The shell itself runs on pidfds and doesn't install a handler.
+ */
 
-    while (current_child < arr->size) {
-        int process_status;
-        waitpid(arr->children[current_child], &process_status, 0);
+enum {
+    /** Ring slot count, a power of two. */
+    PID_RING_CAPACITY = 1024,
+};
 
-        if (WIFEXITED(process_status)) {
-            final_status = WEXITSTATUS(process_status);
-        }
-        current_child++;
-    }
+struct pid_ring {
+    pid_t slots[PID_RING_CAPACITY];
+    /** Written by the producer only, grows forever. */
+    size_t head;
+    /** Written by the consumer only, chases the head. */
+    size_t tail;
+};
 
-    release_process_registry(arr);
-    return final_status;
+static inline void
+pid_ring_init(struct pid_ring *ring)
+{
+    memset(ring, 0, sizeof(*ring));
 }
 
+/**
+ * Push an exited pid. Safe to call from a signal handler. Returns
+ * 1 when the ring is full - the pid is then left for a fallback
+ * waitpid(-1, WNOHANG) drain, never lost.
+ */
 static inline int
-register_process(struct process_registry *arr, pid_t child)
+pid_ring_push(struct pid_ring *ring, pid_t pid)
 {
-    if (!arr) return 1;
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head - tail == PID_RING_CAPACITY) {
+        return 1;
+    }
+    ring->slots[head & (PID_RING_CAPACITY - 1)] = pid;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
 
-    arr->children[arr->size] = child;
-    arr->size++;
+/** Pop one pid. Returns 1 when the ring is empty. */
+static inline int
+pid_ring_pop(struct pid_ring *ring, pid_t *pid)
+{
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return 1;
+    }
+    *pid = ring->slots[tail & (PID_RING_CAPACITY - 1)];
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
 
-    return adjust_process_registry_capacity(arr);
+/*
+ * Drain the ring into the table - each popped pid is reaped if the
+ * handler didn't already do so, and dropped from the table. O(ready),
+ * like the pidfd reap.
+ */
+static inline int
+pid_table_drain_ring(struct pid_table *table, struct pid_ring *ring)
+{
+    if (table == NULL || ring == NULL) {
+        return 1;
+    }
+    pid_t pid;
+    while (pid_ring_pop(ring, &pid) == 0) {
+        waitpid(pid, NULL, WNOHANG);
+        pid_table_remove(table, pid);
+    }
+    return 0;
 }
@@ -1,11 +1,26 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
 #include <sys/wait.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <spawn.h>
+#include <limits.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include "parser.h"
+#include "pid_list.h"
+#include "perf.h"
+
+extern char **environ;
 
 
 #define BG_PROC_ARR_INIT_SIZE 10
@@ -95,6 +110,142 @@ check_completed_processes(struct process_registry *arr)
     return adjust_process_registry_capacity(arr);
 }
 
+/*
+ * Per-command telemetry, enabled by setting the SHELL_PROFILE
+ * environment variable. Each foreground stage records its wall time
+ * from spawn to reap, its CPU time from the wait4() rusage, and its
+ * queue delay - how long after the pipeline launch began the stage
+ * actually got spawned. Aggregated per command name in a small
+ * fixed table and dumped to stderr at exit, so the hot stages of a
+ * generated script show up without an strace run. The overhead per
+ * launch is two clock reads and a table probe. Background jobs are
+ * reaped through the pidfd set and aren't profiled.
+ */
+
+enum {
+    PROFILE_TABLE_CAPACITY = 256,
+    PROFILE_INFLIGHT_CAPACITY = 64,
+    PROFILE_NAME_MAX = 64,
+};
+
+struct profile_entry {
+    char name[PROFILE_NAME_MAX];
+    uint64_t run_count;
+    uint64_t wall_ns;
+    uint64_t max_wall_ns;
+    uint64_t cpu_ns;
+    uint64_t queue_ns;
+};
+
+/** One spawned but not yet reaped stage. */
+struct profile_inflight {
+    pid_t pid;
+    struct profile_entry *entry;
+    uint64_t launch_ns;
+    uint64_t spawn_ns;
+};
+
+static int shell_profile_enabled = 0;
+static struct profile_entry profile_table[PROFILE_TABLE_CAPACITY];
+static size_t profile_table_count = 0;
+static struct profile_inflight profile_inflight[PROFILE_INFLIGHT_CAPACITY];
+
+static struct profile_entry *
+profile_entry_find(const char *name)
+{
+    size_t hash = 5381;
+    for (const char *c = name; *c != 0; ++c) {
+        hash = hash * 31 + (unsigned char)*c;
+    }
+    for (size_t i = 0; i < PROFILE_TABLE_CAPACITY; ++i) {
+        struct profile_entry *e =
+            &profile_table[(hash + i) % PROFILE_TABLE_CAPACITY];
+        if (e->name[0] == 0) {
+            /* Keep one slot free so the probing terminates. */
+            if (profile_table_count + 1 >= PROFILE_TABLE_CAPACITY) {
+                return NULL;
+            }
+            snprintf(e->name, sizeof(e->name), "%s", name);
+            ++profile_table_count;
+            return e;
+        }
+        if (strncmp(e->name, name, PROFILE_NAME_MAX - 1) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void
+profile_process_started(const char *name, pid_t pid, uint64_t launch_ns)
+{
+    if (!shell_profile_enabled) return;
+
+    struct profile_entry *entry = profile_entry_find(name);
+    if (entry == NULL) return;
+
+    for (size_t i = 0; i < PROFILE_INFLIGHT_CAPACITY; ++i) {
+        struct profile_inflight *f = &profile_inflight[i];
+        if (f->pid != 0) continue;
+        f->pid = pid;
+        f->entry = entry;
+        f->launch_ns = launch_ns;
+        f->spawn_ns = perf_time_ns();
+        return;
+    }
+}
+
+static void
+profile_process_finished(pid_t pid, const struct rusage *usage)
+{
+    if (!shell_profile_enabled) return;
+
+    uint64_t now = perf_time_ns();
+    for (size_t i = 0; i < PROFILE_INFLIGHT_CAPACITY; ++i) {
+        struct profile_inflight *f = &profile_inflight[i];
+        if (f->pid != pid) continue;
+        struct profile_entry *e = f->entry;
+        uint64_t wall = now - f->spawn_ns;
+        ++e->run_count;
+        e->wall_ns += wall;
+        if (wall > e->max_wall_ns) {
+            e->max_wall_ns = wall;
+        }
+        e->queue_ns += f->spawn_ns - f->launch_ns;
+        e->cpu_ns +=
+            (uint64_t)usage->ru_utime.tv_sec * 1000000000 +
+            (uint64_t)usage->ru_utime.tv_usec * 1000 +
+            (uint64_t)usage->ru_stime.tv_sec * 1000000000 +
+            (uint64_t)usage->ru_stime.tv_usec * 1000;
+        f->pid = 0;
+        return;
+    }
+}
+
+/** One line per command, same 'key=value' style as the histograms. */
+static void
+profile_dump(void)
+{
+    if (!shell_profile_enabled || profile_table_count == 0) return;
+
+    dprintf(STDERR_FILENO, "command profile:\n");
+    for (size_t i = 0; i < PROFILE_TABLE_CAPACITY; ++i) {
+        const struct profile_entry *e = &profile_table[i];
+        if (e->name[0] == 0) continue;
+        dprintf(STDERR_FILENO,
+            "  %s: runs=%llu wall_us=%llu avg_wall_us=%llu "
+            "max_wall_us=%llu cpu_us=%llu queue_us=%llu\n",
+            e->name,
+            (unsigned long long)e->run_count,
+            (unsigned long long)(e->wall_ns / 1000),
+            (unsigned long long)(e->run_count == 0 ?
+                0 : e->wall_ns / e->run_count / 1000),
+            (unsigned long long)(e->max_wall_ns / 1000),
+            (unsigned long long)(e->cpu_ns / 1000),
+            (unsigned long long)(e->queue_ns / 1000));
+    }
+}
+
 static inline int
 pid_array_wait_and_free(struct process_registry *arr)
 {
@@ -105,7 +256,11 @@ pid_array_wait_and_free(struct process_registry *arr)
 
     while (current_child < arr->size) {
         int process_status;
-        waitpid(arr->children[current_child], &process_status, 0);
+        struct rusage usage;
+        pid_t pid = arr->children[current_child];
+        if (wait4(pid, &process_status, 0, &usage) == pid) {
+            profile_process_finished(pid, &usage);
+        }
 
         if (WIFEXITED(process_status)) {
             final_status = WEXITSTATUS(process_status);
@@ -162,23 +317,412 @@ perform_directory_transition(const struct expr *expression)
     return result;
 }
 
+#define EXEC_CACHE_BUCKET_COUNT 64
+
+struct exec_cache_entry {
+    char *name;
+    char *path;
+    struct exec_cache_entry *next;
+};
+
+/*
+ * Cache of resolved executable paths. execvp re-walks $PATH with a
+ * stat per directory on every single command; a shell session runs
+ * the same few commands over and over, so the resolved absolute path
+ * is remembered per name and the walk happens once. The cache is
+ * flushed whenever $PATH itself changes.
+ */
+static struct exec_cache_entry *exec_cache[EXEC_CACHE_BUCKET_COUNT];
+static char *exec_cache_path_env = NULL;
+
+static size_t
+exec_cache_hash(const char *name)
+{
+    size_t hash = 5381;
+    while (*name != 0) {
+        hash = hash * 31 + (unsigned char)*name++;
+    }
+    return hash % EXEC_CACHE_BUCKET_COUNT;
+}
+
 static void
-spawn_process_with_arguments(const struct expr *expression)
+exec_cache_flush(void)
 {
-    if (!expression) return;
+    for (size_t i = 0; i < EXEC_CACHE_BUCKET_COUNT; ++i) {
+        struct exec_cache_entry *e = exec_cache[i];
+        while (e != NULL) {
+            struct exec_cache_entry *next = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            e = next;
+        }
+        exec_cache[i] = NULL;
+    }
+}
 
-    size_t arg_count = expression->cmd.arg_count;
-    char **arg_vector = (char **)calloc(arg_count + 2, sizeof(char *));
+static const char *
+exec_cache_resolve(const char *name)
+{
+    if (strchr(name, '/') != NULL) {
+        return name;
+    }
 
-    if (!arg_vector) return;
+    const char *path_env = getenv("PATH");
+    if (path_env == NULL) {
+        return NULL;
+    }
+    if (exec_cache_path_env == NULL ||
+        strcmp(exec_cache_path_env, path_env) != 0) {
+        exec_cache_flush();
+        free(exec_cache_path_env);
+        exec_cache_path_env = strdup(path_env);
+    }
+
+    size_t bucket = exec_cache_hash(name);
+    for (struct exec_cache_entry *e = exec_cache[bucket]; e != NULL; e = e->next) {
+        if (strcmp(e->name, name) == 0) {
+            return e->path;
+        }
+    }
+
+    size_t name_len = strlen(name);
+    const char *pos = path_env;
+    char candidate[PATH_MAX];
+    while (1) {
+        const char *colon = strchr(pos, ':');
+        size_t dir_len = colon != NULL ? (size_t)(colon - pos) : strlen(pos);
+        /* An empty $PATH component means the current directory. */
+        const char *dir = dir_len == 0 ? "." : pos;
+        if (dir_len == 0) {
+            dir_len = 1;
+        }
+        if (dir_len + 1 + name_len < sizeof(candidate)) {
+            memcpy(candidate, dir, dir_len);
+            candidate[dir_len] = '/';
+            memcpy(candidate + dir_len + 1, name, name_len + 1);
+            if (access(candidate, X_OK) == 0) {
+                struct exec_cache_entry *e = malloc(sizeof(*e));
+                if (e == NULL) {
+                    return NULL;
+                }
+                e->name = strdup(name);
+                e->path = strdup(candidate);
+                e->next = exec_cache[bucket];
+                exec_cache[bucket] = e;
+                return e->path;
+            }
+        }
+        if (colon == NULL) {
+            break;
+        }
+        pos = colon + 1;
+    }
+    return NULL;
+}
+
+#define GLOB_CACHE_BUCKET_COUNT 64
+
+/*
+ * Native glob expansion of the argv words. A word whose last path
+ * component contains *, ? or [ is replaced by the sorted matching
+ * entries of its directory, or kept literal when nothing matches -
+ * the same as an interactive shell without nullglob. The directory
+ * listings are cached per path and revalidated by mtime, so a
+ * script expanding patterns against the same huge directory over
+ * and over pays for one readdir scan, not one per pattern, and no
+ * /bin/sh round trip at all. Patterns in non-final components are
+ * left literal.
+ */
+struct glob_dir_cache_entry {
+    char *path;
+    struct timespec mtime;
+    /** The directory entries, sorted with strcmp. */
+    char **names;
+    size_t name_count;
+    size_t name_capacity;
+    struct glob_dir_cache_entry *next;
+};
+
+static struct glob_dir_cache_entry *glob_cache[GLOB_CACHE_BUCKET_COUNT];
+
+static size_t
+glob_cache_hash(const char *path)
+{
+    size_t hash = 5381;
+    while (*path != 0) {
+        hash = hash * 31 + (unsigned char)*path++;
+    }
+    return hash % GLOB_CACHE_BUCKET_COUNT;
+}
+
+static int
+glob_name_cmp(const void *a, const void *b)
+{
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+static void
+glob_cache_free(void)
+{
+    for (size_t i = 0; i < GLOB_CACHE_BUCKET_COUNT; ++i) {
+        struct glob_dir_cache_entry *e = glob_cache[i];
+        while (e != NULL) {
+            struct glob_dir_cache_entry *next = e->next;
+            for (size_t j = 0; j < e->name_count; ++j) {
+                free(e->names[j]);
+            }
+            free(e->names);
+            free(e->path);
+            free(e);
+            e = next;
+        }
+        glob_cache[i] = NULL;
+    }
+}
+
+/** Get the cached listing of the directory, rescanning if its mtime moved. */
+static struct glob_dir_cache_entry *
+glob_cache_dir(const char *dir)
+{
+    struct stat st;
+    if (stat(dir, &st) != 0) {
+        return NULL;
+    }
+    size_t bucket = glob_cache_hash(dir);
+    struct glob_dir_cache_entry *e;
+    for (e = glob_cache[bucket]; e != NULL; e = e->next) {
+        if (strcmp(e->path, dir) == 0) {
+            break;
+        }
+    }
+    if (e != NULL && e->mtime.tv_sec == st.st_mtim.tv_sec &&
+        e->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        return e;
+    }
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        return NULL;
+    }
+    if (e == NULL) {
+        e = (struct glob_dir_cache_entry *)calloc(1, sizeof(*e));
+        if (e == NULL) {
+            closedir(d);
+            return NULL;
+        }
+        e->path = strdup(dir);
+        e->next = glob_cache[bucket];
+        glob_cache[bucket] = e;
+    } else {
+        for (size_t j = 0; j < e->name_count; ++j) {
+            free(e->names[j]);
+        }
+        e->name_count = 0;
+    }
+    e->mtime = st.st_mtim;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        if (e->name_count == e->name_capacity) {
+            size_t new_capacity =
+                e->name_capacity == 0 ? 64 : e->name_capacity * 2;
+            char **names = (char **)realloc(e->names,
+                new_capacity * sizeof(char *));
+            if (names == NULL) {
+                break;
+            }
+            e->names = names;
+            e->name_capacity = new_capacity;
+        }
+        e->names[e->name_count++] = strdup(de->d_name);
+    }
+    closedir(d);
+    qsort(e->names, e->name_count, sizeof(char *), glob_name_cmp);
+    return e;
+}
 
-    arg_vector[0] = expression->cmd.exe;
-    memcpy(arg_vector + 1, expression->cmd.args, sizeof(char *) * arg_count);
-    arg_vector[arg_count + 1] = NULL;
+static int
+glob_word_has_magic(const char *s)
+{
+    for (; *s != 0; ++s) {
+        if (*s == '*' || *s == '?' || *s == '[') {
+            return 1;
+        }
+    }
+    return 0;
+}
 
-    execvp(expression->cmd.exe, arg_vector);
+/*
+ * Strings produced by the expansion of the argv being built. Reset
+ * at every launch - by then the previous spawn has taken its copy.
+ */
+static char **glob_string_scratch = NULL;
+static size_t glob_string_count = 0;
+static size_t glob_string_capacity = 0;
 
-    free(arg_vector);
+static void
+glob_string_scratch_reset(void)
+{
+    for (size_t i = 0; i < glob_string_count; ++i) {
+        free(glob_string_scratch[i]);
+    }
+    glob_string_count = 0;
+}
+
+static void
+glob_string_scratch_free(void)
+{
+    glob_string_scratch_reset();
+    free(glob_string_scratch);
+    glob_string_scratch = NULL;
+    glob_string_capacity = 0;
+}
+
+/** Glue the pattern's directory prefix to a matched name. */
+static char *
+glob_string_make(const char *prefix, size_t prefix_len, const char *name)
+{
+    if (glob_string_count == glob_string_capacity) {
+        size_t new_capacity =
+            glob_string_capacity == 0 ? 16 : glob_string_capacity * 2;
+        char **scratch = (char **)realloc(glob_string_scratch,
+            new_capacity * sizeof(char *));
+        if (scratch == NULL) {
+            return NULL;
+        }
+        glob_string_scratch = scratch;
+        glob_string_capacity = new_capacity;
+    }
+    size_t name_len = strlen(name);
+    char *res = (char *)malloc(prefix_len + name_len + 1);
+    if (res == NULL) {
+        return NULL;
+    }
+    memcpy(res, prefix, prefix_len);
+    memcpy(res + prefix_len, name, name_len + 1);
+    glob_string_scratch[glob_string_count++] = res;
+    return res;
+}
+
+/*
+ * Reusable scratch for the argv of the stage being launched. The
+ * strings themselves are the parser-owned buffers - they outlive
+ * both the spawn and the fork - so assembling argv is a memcpy of
+ * the pointers into this array, with zero allocations per launch
+ * once the array has grown to the widest argv seen. One stage is
+ * launched at a time, so a single scratch is enough.
+ */
+static char **exec_argv_scratch = NULL;
+static size_t exec_argv_scratch_capacity = 0;
+
+static void
+exec_argv_scratch_free(void)
+{
+    free(exec_argv_scratch);
+    exec_argv_scratch = NULL;
+    exec_argv_scratch_capacity = 0;
+}
+
+static int
+exec_argv_append(size_t *count, char *arg)
+{
+    if (*count == exec_argv_scratch_capacity) {
+        size_t new_capacity = exec_argv_scratch_capacity == 0 ?
+            16 : exec_argv_scratch_capacity * 2;
+        char **vector = (char **)realloc(exec_argv_scratch,
+            new_capacity * sizeof(char *));
+        if (!vector) return 1;
+        exec_argv_scratch = vector;
+        exec_argv_scratch_capacity = new_capacity;
+    }
+    exec_argv_scratch[(*count)++] = arg;
+    return 0;
+}
+
+/*
+ * Append the sorted matches of the pattern. Returns how many were
+ * appended; zero means the caller keeps the word literal.
+ */
+static size_t
+glob_expand_into_argv(size_t *count, char *pattern)
+{
+    const char *slash = strrchr(pattern, '/');
+    const char *name_pattern = slash == NULL ? pattern : slash + 1;
+    char dir_buf[PATH_MAX];
+    const char *dir = ".";
+    size_t prefix_len = 0;
+    if (slash != NULL) {
+        prefix_len = slash + 1 - pattern;
+        size_t dir_len = slash == pattern ? 1 : (size_t)(slash - pattern);
+        if (dir_len >= sizeof(dir_buf)) {
+            return 0;
+        }
+        memcpy(dir_buf, pattern, dir_len);
+        dir_buf[dir_len] = 0;
+        dir = dir_buf;
+        /* A pattern in the directory part stays literal. */
+        if (glob_word_has_magic(dir)) {
+            return 0;
+        }
+    }
+    struct glob_dir_cache_entry *e = glob_cache_dir(dir);
+    if (e == NULL) {
+        return 0;
+    }
+    size_t added = 0;
+    for (size_t i = 0; i < e->name_count; ++i) {
+        if (fnmatch(name_pattern, e->names[i], FNM_PERIOD) != 0) {
+            continue;
+        }
+        char *res = glob_string_make(pattern, prefix_len, e->names[i]);
+        if (res == NULL || exec_argv_append(count, res) != 0) {
+            return added;
+        }
+        ++added;
+    }
+    return added;
+}
+
+static char **
+build_argument_vector(const struct expr *expression)
+{
+    glob_string_scratch_reset();
+    size_t count = 0;
+    if (exec_argv_append(&count, expression->cmd.exe) != 0) {
+        return NULL;
+    }
+    for (uint32_t i = 0; i < expression->cmd.arg_count; ++i) {
+        char *arg = expression->cmd.args[i];
+        if (glob_word_has_magic(arg) &&
+            glob_expand_into_argv(&count, arg) > 0) {
+            continue;
+        }
+        if (exec_argv_append(&count, arg) != 0) {
+            return NULL;
+        }
+    }
+    if (exec_argv_append(&count, NULL) != 0) {
+        return NULL;
+    }
+    return exec_argv_scratch;
+}
+
+static void
+spawn_process_with_arguments(const struct expr *expression)
+{
+    if (!expression) return;
+
+    char **arg_vector = build_argument_vector(expression);
+    if (!arg_vector) return;
+
+    const char *resolved = exec_cache_resolve(expression->cmd.exe);
+    if (resolved != NULL) {
+        execv(resolved, arg_vector);
+    } else {
+        execvp(expression->cmd.exe, arg_vector);
+    }
 }
 
 static int
@@ -194,6 +738,220 @@ static int determine_operator_expression_is_terminal(const struct expr *e)
     return (e->next == NULL || (e->next->type == EXPR_TYPE_AND || e->next->type == EXPR_TYPE_OR)) ? 1 : 0;
 }
 
+/*
+ * A '... | cat > file' tail is a pure pass-through: instead of
+ * spawning the cat, the parent splice(2)s the last pipe straight into
+ * the output file in kernel space - no exec for the cat and no
+ * userspace copy per byte. Only foreground pipelines qualify - for a
+ * background one the shell would have to sit in the relay loop.
+ */
+static int
+stage_is_splice_tail(const struct expr *stage, enum output_type out_type,
+    int should_wait)
+{
+    return should_wait && out_type != OUTPUT_TYPE_STDOUT &&
+        strcmp(stage->cmd.exe, "cat") == 0 && stage->cmd.arg_count == 0;
+}
+
+/* Move every byte of 'pipe_fd' into 'out_file' without lifting it
+ * into userspace. Returns the elided cat's exit status: 0 or 1. */
+static int
+splice_pipe_to_file(int pipe_fd, const char *out_file,
+    enum output_type out_type)
+{
+    int flags = O_CREAT | O_WRONLY |
+        (out_type == OUTPUT_TYPE_FILE_NEW ? O_TRUNC : 0);
+    int out_fd = open(out_file, flags, S_IRWXU | S_IRWXG | S_IRWXO);
+    if (out_fd == -1) {
+        dprintf(STDERR_FILENO, "Output file error\n");
+        return 1;
+    }
+    /*
+     * The append mode goes through the file position - splice()
+     * rejects O_APPEND descriptors outright.
+     */
+    if (out_type == OUTPUT_TYPE_FILE_APPEND &&
+        lseek(out_fd, 0, SEEK_END) == -1) {
+        close(out_fd);
+        return 1;
+    }
+    int status = 0;
+    while (1) {
+        ssize_t moved = splice(pipe_fd, NULL, out_fd, NULL,
+            1024 * 1024, SPLICE_F_MORE);
+        if (moved > 0) {
+            continue;
+        }
+        if (moved == 0) {
+            break;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EINVAL || errno == ENOSYS) {
+            /* The target can not take pipe pages directly - fall
+             * back to a plain copy loop. */
+            char buf[64 * 1024];
+            ssize_t got;
+            while ((got = read(pipe_fd, buf, sizeof(buf))) != 0) {
+                if (got < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    status = 1;
+                    break;
+                }
+                ssize_t off = 0;
+                while (off < got) {
+                    ssize_t put = write(out_fd, buf + off, got - off);
+                    if (put < 0) {
+                        if (errno == EINTR) {
+                            continue;
+                        }
+                        status = 1;
+                        break;
+                    }
+                    off += put;
+                }
+                if (off < got) {
+                    break;
+                }
+            }
+            break;
+        }
+        status = 1;
+        break;
+    }
+    close(out_fd);
+    return status;
+}
+
+/*
+ * Fast path for pipelines without builtins. All the pipes are created
+ * up front in one pass and the stages are spawned back-to-back with
+ * posix_spawnp, so a long pipeline starts without a fork+setup round
+ * trip per stage. The pipe fds are O_CLOEXEC - the spawned children
+ * only keep the ends dup2-ed onto their stdin/stdout, the parent
+ * closes everything right after the spawn loop.
+ */
+static struct exec_result
+launch_pipeline_prespawned(struct expr *stages, size_t stage_count,
+    const char *out_file, enum output_type out_type, int should_wait)
+{
+    /*
+     * The stages sit in the line's flattened expression array with
+     * the pipe cells between them, so stage i is simply the cell
+     * 2 * i - a linear scan over one span, no pointer array to
+     * build and no node chasing per stage.
+     */
+    struct process_registry process_ids;
+    if (initialize_process_registry(&process_ids) != 0) {
+        dprintf(STDERR_FILENO, "Memory allocation failed\n");
+        return assemble_execution_outcome(0, 1, NULL, 0);
+    }
+    uint64_t launch_ns = shell_profile_enabled ? perf_time_ns() : 0;
+
+    size_t spawn_count = stage_count;
+    if (stage_count >= 2 &&
+        stage_is_splice_tail(&stages[(stage_count - 1) * 2], out_type,
+            should_wait)) {
+        spawn_count = stage_count - 1;
+    }
+
+    size_t pipe_count = stage_count - 1;
+    int *pipe_fds = (int *)malloc(sizeof(int) * 2 * pipe_count);
+    for (size_t i = 0; i < pipe_count; ++i) {
+        if (pipe2(pipe_fds + i * 2, O_CLOEXEC) != 0) {
+            dprintf(STDERR_FILENO, "Pipe creation error at command %zu\n", i);
+            for (size_t j = 0; j < i * 2; ++j) {
+                close(pipe_fds[j]);
+            }
+            free(pipe_fds);
+            release_process_registry(&process_ids);
+            return assemble_execution_outcome(0, 1, NULL, 0);
+        }
+    }
+
+    for (size_t i = 0; i < spawn_count; ++i) {
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+
+        if (i > 0) {
+            posix_spawn_file_actions_adddup2(&actions,
+                pipe_fds[(i - 1) * 2], STDIN_FILENO);
+        } else if (!should_wait) {
+            posix_spawn_file_actions_addclose(&actions, STDIN_FILENO);
+        }
+
+        if (i + 1 < stage_count) {
+            posix_spawn_file_actions_adddup2(&actions,
+                pipe_fds[i * 2 + 1], STDOUT_FILENO);
+        } else if (out_type != OUTPUT_TYPE_STDOUT) {
+            posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, out_file,
+                O_CREAT | O_WRONLY | (out_type == OUTPUT_TYPE_FILE_NEW ? O_TRUNC : O_APPEND),
+                S_IRWXU | S_IRWXG | S_IRWXO);
+        }
+
+        struct expr *stage = &stages[i * 2];
+        char **arg_vector = build_argument_vector(stage);
+        const char *resolved = exec_cache_resolve(stage->cmd.exe);
+        pid_t child_process_id;
+        int spawn_result;
+        if (arg_vector == NULL) {
+            spawn_result = 1;
+        } else if (resolved != NULL) {
+            spawn_result = posix_spawn(&child_process_id, resolved,
+                &actions, NULL, arg_vector, environ);
+        } else {
+            spawn_result = posix_spawnp(&child_process_id, stage->cmd.exe,
+                &actions, NULL, arg_vector, environ);
+        }
+        posix_spawn_file_actions_destroy(&actions);
+
+        if (spawn_result != 0) {
+            dprintf(STDERR_FILENO, "Process creation failed\n");
+            continue;
+        }
+
+        if (register_process(&process_ids, child_process_id) != 0) {
+            dprintf(STDERR_FILENO, "Failed to track process\n");
+            break;
+        }
+        profile_process_started(stage->cmd.exe, child_process_id,
+            launch_ns);
+    }
+
+    /* With an elided cat the parent keeps the last pipe's read end
+     * and relays it into the output file itself. */
+    int relay_fd = -1;
+    if (spawn_count != stage_count) {
+        relay_fd = pipe_fds[(pipe_count - 1) * 2];
+    }
+    for (size_t i = 0; i < pipe_count * 2; ++i) {
+        if (pipe_fds[i] != relay_fd) {
+            close(pipe_fds[i]);
+        }
+    }
+    free(pipe_fds);
+
+    int relay_status = 0;
+    if (relay_fd != -1) {
+        relay_status = splice_pipe_to_file(relay_fd, out_file, out_type);
+        close(relay_fd);
+    }
+
+    if (should_wait) {
+        int status = pid_array_wait_and_free(&process_ids);
+        /* The pipeline status is the last stage's - the elided cat's. */
+        if (relay_fd != -1) {
+            status = relay_status;
+        }
+        return assemble_execution_outcome(0, status, NULL, 0);
+    }
+
+    return assemble_execution_outcome(0, 0, process_ids.children, process_ids.size);
+}
+
 static struct exec_result
 execute_pipeline(struct expr *pipeline_start,
     const char *out_file, enum output_type out_type, int should_wait)
@@ -203,12 +961,45 @@ execute_pipeline(struct expr *pipeline_start,
         return assemble_execution_outcome(0, 1, NULL, 0);
     }
 
+    /*
+     * The exprs sit in one contiguous array and within a pipeline
+     * segment commands and pipes alternate, command first - check
+     * that while counting, the prespawn path indexes the cells
+     * directly relying on it.
+     */
+    size_t stage_count = 0;
+    int has_builtin = 0;
+    int is_alternating = 1;
+    size_t cell = 0;
+    for (struct expr *e = pipeline_start;
+         e && !determine_expression_is_operator(e); e = e->next, ++cell) {
+        if (e->type != EXPR_TYPE_COMMAND) {
+            if (cell % 2 == 0) {
+                is_alternating = 0;
+            }
+            continue;
+        }
+        if (cell % 2 != 0) {
+            is_alternating = 0;
+        }
+        if (strcmp("cd", e->cmd.exe) == 0 || strcmp("exit", e->cmd.exe) == 0) {
+            has_builtin = 1;
+        }
+        stage_count++;
+    }
+
+    if (stage_count >= 2 && !has_builtin && is_alternating) {
+        return launch_pipeline_prespawned(pipeline_start, stage_count,
+            out_file, out_type, should_wait);
+    }
+
     struct process_registry process_ids;
     if (initialize_process_registry(&process_ids) != 0) {
         dprintf(STDERR_FILENO, "Memory allocation failed\n");
         return assemble_execution_outcome(0, 1, NULL, 0);
     }
 
+    uint64_t launch_ns = shell_profile_enabled ? perf_time_ns() : 0;
     size_t command_index = 0;
     int io_descriptors[3] = {STDIN_FILENO, STDOUT_FILENO, -1};
     struct expr *current_expression = pipeline_start;
@@ -329,6 +1120,8 @@ execute_pipeline(struct expr *pipeline_start,
                 dprintf(STDERR_FILENO, "Failed to track process\n");
                 break;
             }
+            profile_process_started(current_expression->cmd.exe,
+                child_process_id, launch_ns);
         }
 
         if (io_descriptors[0] != STDIN_FILENO) {
@@ -384,24 +1177,38 @@ execute_command_line(const struct command_line *line) {
     return d;
 }
 
-int
-main(void)
+/*
+ * Feed everything arriving on in_fd through the parser and execute
+ * it. Returns the status of the last executed line. *out_need_exit
+ * is set when the exit builtin fired - the caller decides whether
+ * that ends the whole process or just this input. With flush_tail
+ * the stream's last line runs even without a trailing newline - a
+ * script arriving over a socket often lacks one, and leaving its
+ * tail in the parser buffer would glue it to the next script.
+ */
+static int
+run_input(struct parser *parser_instance, int in_fd,
+    struct pid_table *background_processes, int flush_tail,
+    int *out_need_exit)
 {
     const size_t buffer_size = 1024;
     char data_buffer[buffer_size];
     ssize_t read_result;
-    struct parser *parser_instance = parser_new();
     int final_return_code = 0;
+    int eof = 0;
 
-    struct process_registry background_processes;
-    if (initialize_process_registry(&background_processes) != 0) {
-        dprintf(STDERR_FILENO, "Initialization failure\n");
-        parser_delete(parser_instance);
-        return 1;
-    }
-
-    while ((read_result = read(STDIN_FILENO, data_buffer, buffer_size)) > 0) {
-        parser_feed(parser_instance, data_buffer, read_result);
+    *out_need_exit = 0;
+    while (!eof) {
+        read_result = read(in_fd, data_buffer, buffer_size);
+        if (read_result > 0) {
+            parser_feed(parser_instance, data_buffer, read_result);
+        } else {
+            eof = 1;
+            if (!flush_tail)
+                break;
+            /* A lone newline on an empty parser yields no line. */
+            parser_feed(parser_instance, "\n", 1);
+        }
         struct command_line *parsed_line = NULL;
         while (1) {
             enum parser_error parsing_error = parser_pop_next(parser_instance, &parsed_line);
@@ -418,7 +1225,7 @@ main(void)
 
             if (execution_result.bg_pids) {
                 for (size_t process_index = 0; process_index < execution_result.bg_count; ++process_index) {
-                    if (register_process(&background_processes, execution_result.bg_pids[process_index]) != 0) {
+                    if (pid_table_insert(background_processes, execution_result.bg_pids[process_index]) != 0) {
                         dprintf(STDERR_FILENO, "Background process tracking failed\n");
                         break;
                     }
@@ -427,19 +1234,132 @@ main(void)
                 free(execution_result.bg_pids);
             }
 
-            if (check_completed_processes(&background_processes) != 0) {
+            if (pid_table_reap_batch(background_processes) != 0) {
                 dprintf(STDERR_FILENO, "Background process cleanup failed\n");
             }
 
             if (execution_result.need_exit) {
-                release_process_registry(&background_processes);
-                parser_delete(parser_instance);
+                *out_need_exit = 1;
                 return execution_result.return_code;
             }
         }
     }
+    return final_return_code;
+}
 
-    release_process_registry(&background_processes);
+static void
+shell_cleanup(struct parser *parser_instance,
+    struct pid_table *background_processes)
+{
+    pid_table_free(background_processes);
     parser_delete(parser_instance);
+    exec_argv_scratch_free();
+    glob_string_scratch_free();
+    glob_cache_free();
+    profile_dump();
+}
+
+enum {
+    /*
+     * Parse cache of the server's parser. An orchestrator replays
+     * the same few hundred one-liners over and over - cached they
+     * skip tokenization entirely, see parser_set_cache_limit().
+     */
+    SHELL_SERVER_PARSE_CACHE = 512,
+};
+
+/*
+ * The daemon mode: accept scripts over a Unix socket instead of
+ * exec-ing a fresh shell per script. One connection carries one
+ * script; the server reads it to EOF, runs it through the one
+ * long-lived parser and the warm PATH and glob caches, and answers
+ * with a single status byte - the exit code of the last line. The
+ * commands' stdout and stderr stay the server's own; a caller
+ * wanting the output redirects it inside the script. The exit
+ * builtin ends its script, not the daemon - kill the process to
+ * stop serving.
+ */
+static int
+run_server(const char *path)
+{
+    signal(SIGPIPE, SIG_IGN);
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1) {
+        dprintf(STDERR_FILENO, "Socket creation failed\n");
+        return 1;
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        dprintf(STDERR_FILENO, "Socket path is too long\n");
+        close(listen_fd);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+    /* A leftover of a previous run - the bind would fail on it. */
+    unlink(path);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(listen_fd, 128) != 0) {
+        dprintf(STDERR_FILENO, "Socket bind failed\n");
+        close(listen_fd);
+        return 1;
+    }
+
+    shell_profile_enabled = getenv("SHELL_PROFILE") != NULL;
+    struct parser *parser_instance = parser_new();
+    parser_set_cache_limit(parser_instance, SHELL_SERVER_PARSE_CACHE);
+    struct pid_table background_processes;
+    if (pid_table_init(&background_processes) != 0) {
+        dprintf(STDERR_FILENO, "Initialization failure\n");
+        parser_delete(parser_instance);
+        close(listen_fd);
+        return 1;
+    }
+
+    int rc = 0;
+    while (1) {
+        int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (conn == -1) {
+            if (errno == EINTR)
+                continue;
+            dprintf(STDERR_FILENO, "Accept failed\n");
+            rc = 1;
+            break;
+        }
+        int need_exit = 0;
+        int status = run_input(parser_instance, conn,
+            &background_processes, 1, &need_exit);
+        unsigned char status_byte = (unsigned char)status;
+        /* A gone client just doesn't learn its status. */
+        (void)!write(conn, &status_byte, 1);
+        close(conn);
+    }
+    close(listen_fd);
+    unlink(path);
+    shell_cleanup(parser_instance, &background_processes);
+    return rc;
+}
+
+int
+main(int argc, char **argv)
+{
+    if (argc >= 3 && strcmp(argv[1], "--server") == 0)
+        return run_server(argv[2]);
+
+    shell_profile_enabled = getenv("SHELL_PROFILE") != NULL;
+    struct parser *parser_instance = parser_new();
+
+    struct pid_table background_processes;
+    if (pid_table_init(&background_processes) != 0) {
+        dprintf(STDERR_FILENO, "Initialization failure\n");
+        parser_delete(parser_instance);
+        return 1;
+    }
+
+    int need_exit = 0;
+    int final_return_code = run_input(parser_instance, STDIN_FILENO,
+        &background_processes, 0, &need_exit);
+    shell_cleanup(parser_instance, &background_processes);
     return final_return_code;
 }
@@ -469,6 +469,976 @@ test_resize(void)
 #endif
 }
 
+static void
+test_vectored_io(void)
+{
+#if NEED_VECTORED_IO
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	char part1[100], part2[5000], part3[1];
+	memset(part1, 'a', sizeof(part1));
+	memset(part2, 'b', sizeof(part2));
+	memset(part3, 'c', sizeof(part3));
+	struct ufs_iovec iov[3] = {
+		{part1, sizeof(part1)},
+		{part2, sizeof(part2)},
+		{part3, sizeof(part3)},
+	};
+	ssize_t total = sizeof(part1) + sizeof(part2) + sizeof(part3);
+	ssize_t rc = ufs_writev(fd, iov, 3);
+	unit_check(rc == total, "writev wrote all the pieces");
+
+	int fd2 = ufs_open("file", 0);
+	unit_fail_if(fd2 == -1);
+	char rpart1[100], rpart2[5000], rpart3[1];
+	struct ufs_iovec riov[3] = {
+		{rpart1, sizeof(rpart1)},
+		{rpart2, sizeof(rpart2)},
+		{rpart3, sizeof(rpart3)},
+	};
+	rc = ufs_readv(fd2, riov, 3);
+	unit_check(rc == total, "readv read all the pieces");
+	unit_check(memcmp(rpart1, part1, sizeof(part1)) == 0 &&
+		   memcmp(rpart2, part2, sizeof(part2)) == 0 &&
+		   memcmp(rpart3, part3, sizeof(part3)) == 0,
+		   "data is split across the pieces in order");
+	rc = ufs_readv(fd2, riov, 3);
+	unit_check(rc == 0, "readv at the end of file is EOF");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+#endif
+}
+
+static void
+test_positional_io(void)
+{
+#if NEED_POSITIONAL_IO
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	ssize_t rc = ufs_write(fd, "abcdef", 6);
+	unit_fail_if(rc != 6);
+
+	rc = ufs_pwrite(fd, "XY", 2, 2);
+	unit_check(rc == 2, "pwrite at an offset");
+	char buf[16];
+	rc = ufs_pread(fd, buf, sizeof(buf), 0);
+	unit_check(rc == 6 && memcmp(buf, "abXYef", 6) == 0,
+		   "pread sees the patched data");
+
+	/* Neither call moved the descriptor's own position. */
+	rc = ufs_write(fd, "g", 1);
+	unit_fail_if(rc != 1);
+	rc = ufs_pread(fd, buf, sizeof(buf), 0);
+	unit_check(rc == 7 && memcmp(buf, "abXYefg", 7) == 0,
+		   "the cursor was not moved");
+
+	rc = ufs_pread(fd, buf, sizeof(buf), 100);
+	unit_check(rc == 0, "pread beyond the end is EOF");
+	rc = ufs_pwrite(fd, "tail", 4, 4096 * 2);
+	unit_check(rc == 4, "pwrite beyond the end extends the file");
+	rc = ufs_pread(fd, buf, 4, 4096 * 2);
+	unit_check(rc == 4 && memcmp(buf, "tail", 4) == 0,
+		   "the extension is readable");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+#endif
+}
+
+static void
+test_clone(void)
+{
+#if NEED_FILE_CLONE
+	unit_test_start();
+
+	unit_check(ufs_clone("no_such_file", "copy") == -1 &&
+		   ufs_errno() == UFS_ERR_NO_FILE, "clone of a missing file");
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	char buffer[4096 * 2 + 100];
+	memset(buffer, 'a', sizeof(buffer));
+	ssize_t rc = ufs_write(fd, buffer, sizeof(buffer));
+	unit_fail_if(rc != sizeof(buffer));
+
+	unit_check(ufs_clone("file", "copy") == 0, "clone succeeded");
+	int fd2 = ufs_open("copy", 0);
+	unit_fail_if(fd2 == -1);
+	char buffer2[sizeof(buffer)];
+	rc = ufs_read(fd2, buffer2, sizeof(buffer2));
+	unit_check(rc == sizeof(buffer) &&
+		   memcmp(buffer, buffer2, sizeof(buffer)) == 0,
+		   "clone sees the same content");
+
+	/* Writing into the clone does not touch the original. */
+	int fd3 = ufs_open("copy", 0);
+	unit_fail_if(fd3 == -1);
+	rc = ufs_write(fd3, "bcd", 3);
+	unit_fail_if(rc != 3);
+	unit_fail_if(ufs_close(fd3) != 0);
+	char check[3];
+	rc = ufs_read(fd, check, sizeof(check));
+	unit_fail_if(rc != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("file", 0);
+	unit_fail_if(fd == -1);
+	rc = ufs_read(fd, check, sizeof(check));
+	unit_check(rc == 3 && memcmp(check, "aaa", 3) == 0,
+		   "write into the clone is not visible in the original");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_close(fd2) != 0);
+
+	unit_fail_if(ufs_delete("file") != 0);
+	fd2 = ufs_open("copy", 0);
+	unit_fail_if(fd2 == -1);
+	rc = ufs_read(fd2, check, sizeof(check));
+	unit_check(rc == 3 && memcmp(check, "bcd", 3) == 0,
+		   "clone lives after the original is deleted");
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_delete("copy") != 0);
+
+	unit_test_finish();
+#endif
+}
+
+static void
+test_sparse(void)
+{
+#if NEED_RESIZE
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	ssize_t rc = ufs_write(fd, "abc", 3);
+	unit_fail_if(rc != 3);
+	/* Growth is O(1) - the new range is a hole, not zero blocks. */
+	size_t new_size = 1024 * 1024 * 50;
+	unit_check(ufs_resize(fd, new_size) == 0, "grow far beyond the data");
+
+	int fd2 = ufs_open("file", 0);
+	unit_fail_if(fd2 == -1);
+	char buffer[4096 * 3];
+	char zeros[sizeof(buffer)];
+	memset(zeros, 0, sizeof(zeros));
+	rc = ufs_read(fd2, buffer, sizeof(buffer));
+	unit_check(rc == sizeof(buffer), "read crosses into the hole");
+	unit_check(memcmp(buffer, "abc", 3) == 0, "data before the hole");
+	unit_check(memcmp(buffer + 3, zeros, sizeof(buffer) - 3) == 0,
+		   "the hole reads as zeros");
+
+	/* A write inside the hole materializes only the touched block. */
+	rc = ufs_write(fd2, "xyz", 3);
+	unit_fail_if(rc != 3);
+	unit_fail_if(ufs_close(fd2) != 0);
+	fd2 = ufs_open("file", 0);
+	unit_fail_if(fd2 == -1);
+	rc = ufs_read(fd2, buffer, sizeof(buffer));
+	unit_fail_if(rc != (ssize_t)sizeof(buffer));
+	unit_check(memcmp(buffer + sizeof(buffer) - 4096, zeros, 4096) == 0,
+		   "the hole after the write is still zeros");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+#endif
+}
+
+static void
+test_snapshot(void)
+{
+#if NEED_SNAPSHOT
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	char buffer[4096 + 100];
+	for (size_t i = 0; i < sizeof(buffer); ++i)
+		buffer[i] = 'a' + i % 26;
+	ssize_t rc = ufs_write(fd, buffer, sizeof(buffer));
+	unit_fail_if(rc != sizeof(buffer));
+	int fd2 = ufs_open("sparse", UFS_CREATE);
+	unit_fail_if(fd2 == -1);
+	unit_fail_if(ufs_resize(fd2, 4096 * 10) != 0);
+	unit_fail_if(ufs_close(fd2) != 0);
+
+	unit_check(ufs_snapshot_save("snapshot.img") == 0, "save");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	unit_fail_if(ufs_delete("sparse") != 0);
+
+	unit_check(ufs_snapshot_load("snapshot.img") == 0, "load");
+	fd = ufs_open("file", 0);
+	unit_fail_if(fd == -1);
+	char buffer2[sizeof(buffer)];
+	rc = ufs_read(fd, buffer2, sizeof(buffer2));
+	unit_check(rc == sizeof(buffer) &&
+		   memcmp(buffer, buffer2, sizeof(buffer)) == 0,
+		   "loaded file content matches");
+	fd2 = ufs_open("sparse", 0);
+	unit_fail_if(fd2 == -1);
+	char zeros[4096];
+	memset(zeros, 0, sizeof(zeros));
+	rc = ufs_read(fd2, buffer2, sizeof(zeros));
+	unit_check(rc == sizeof(zeros) &&
+		   memcmp(buffer2, zeros, sizeof(zeros)) == 0,
+		   "holes survive the snapshot");
+	unit_fail_if(ufs_close(fd2) != 0);
+
+	/* A write into a loaded file copies the block out of the map. */
+	int fd3 = ufs_open("file", 0);
+	unit_fail_if(fd3 == -1);
+	rc = ufs_write(fd3, "XYZ", 3);
+	unit_fail_if(rc != 3);
+	unit_fail_if(ufs_close(fd3) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("file", 0);
+	unit_fail_if(fd == -1);
+	rc = ufs_read(fd, buffer2, sizeof(buffer2));
+	unit_check(rc == sizeof(buffer) && memcmp(buffer2, "XYZ", 3) == 0 &&
+		   memcmp(buffer2 + 3, buffer + 3, sizeof(buffer) - 3) == 0,
+		   "loaded file is writable");
+	unit_fail_if(ufs_close(fd) != 0);
+
+	unit_fail_if(ufs_delete("file") != 0);
+	unit_fail_if(ufs_delete("sparse") != 0);
+	remove("snapshot.img");
+
+	unit_check(ufs_snapshot_load("snapshot.img") == -1 &&
+		   ufs_errno() == UFS_ERR_NO_FILE, "load of a missing image");
+
+	unit_test_finish();
+#endif
+}
+
+static void
+test_append(void)
+{
+#if NEED_OPEN_FLAGS
+	unit_test_start();
+
+	int fd1 = ufs_open("file", UFS_CREATE | UFS_APPEND);
+	unit_fail_if(fd1 == -1);
+	int fd2 = ufs_open("file", UFS_APPEND | UFS_WRITE_ONLY);
+	unit_fail_if(fd2 == -1);
+
+	/* Two appenders interleave, neither clobbers the other. */
+	unit_fail_if(ufs_write(fd1, "aa", 2) != 2);
+	unit_fail_if(ufs_write(fd2, "bb", 2) != 2);
+	unit_fail_if(ufs_write(fd1, "cc", 2) != 2);
+
+	int fd3 = ufs_open("file", UFS_READ_ONLY);
+	unit_fail_if(fd3 == -1);
+	char buf[16];
+	ssize_t rc = ufs_read(fd3, buf, sizeof(buf));
+	unit_check(rc == 6 && memcmp(buf, "aabbcc", 6) == 0,
+		   "appends land at the tail in order");
+	unit_check(ufs_write(fd3, "x", 1) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_PERMISSION,
+		   "append does not grant write rights");
+	rc = ufs_read(fd1, buf, sizeof(buf));
+	unit_check(rc == 0, "appender's cursor is at the end");
+
+	unit_fail_if(ufs_close(fd1) != 0);
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_close(fd3) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+#endif
+}
+
+static void
+test_inline(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	char buffer[1234];
+	memset(buffer, 'i', sizeof(buffer));
+#if NEED_MEMORY_ACCOUNTING
+	struct ufs_stat before, stat;
+	ufs_stat_global(&before);
+#endif
+	ssize_t rc = ufs_write(fd, buffer, sizeof(buffer));
+	unit_fail_if(rc != sizeof(buffer));
+#if NEED_MEMORY_ACCOUNTING
+	ufs_stat_global(&stat);
+	unit_check(stat.block_count == before.block_count,
+		   "a small file takes no blocks");
+#endif
+	int fd2 = ufs_open("file", 0);
+	unit_fail_if(fd2 == -1);
+	char check[sizeof(buffer)];
+	rc = ufs_read(fd2, check, sizeof(check));
+	unit_check(rc == (ssize_t)sizeof(check) &&
+		   memcmp(check, buffer, sizeof(check)) == 0,
+		   "the inline content reads back");
+	unit_fail_if(ufs_close(fd2) != 0);
+
+	/* Growing past the inline limit converts to blocks in place. */
+	size_t total = sizeof(buffer);
+	while (total < 200 * 1024) {
+		rc = ufs_write(fd, buffer, sizeof(buffer));
+		unit_fail_if(rc != sizeof(buffer));
+		total += sizeof(buffer);
+	}
+#if NEED_MEMORY_ACCOUNTING
+	ufs_stat_global(&stat);
+	unit_check(stat.block_count > before.block_count,
+		   "a grown file moved onto blocks");
+#endif
+	fd2 = ufs_open("file", 0);
+	unit_fail_if(fd2 == -1);
+	size_t checked = 0;
+	bool intact = true;
+	while (checked < total) {
+		rc = ufs_read(fd2, check, sizeof(check));
+		unit_fail_if(rc != (ssize_t)sizeof(check));
+		intact = intact && memcmp(check, buffer, sizeof(check)) == 0;
+		checked += rc;
+	}
+	unit_check(intact, "the converted content is intact");
+	unit_fail_if(ufs_close(fd2) != 0);
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_accounting(void)
+{
+#if NEED_MEMORY_ACCOUNTING
+	unit_test_start();
+
+	struct ufs_stat before, stat;
+	ufs_stat_global(&before);
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	/* Push the file out of the inline layout to count real blocks. */
+	unit_fail_if(ufs_resize(fd, 256 * 1024) != 0);
+	unit_fail_if(ufs_resize(fd, 0) != 0);
+	char buffer[4096 * 2];
+	memset(buffer, 'a', sizeof(buffer));
+	ssize_t rc = ufs_write(fd, buffer, sizeof(buffer));
+	unit_fail_if(rc != sizeof(buffer));
+
+	ufs_stat_global(&stat);
+	unit_check(stat.file_count == before.file_count + 1,
+		   "file count went up");
+	unit_check(stat.block_count == before.block_count + 2,
+		   "two blocks materialized");
+	unit_check(stat.file_bytes == before.file_bytes + sizeof(buffer),
+		   "bytes follow the file size");
+
+	/* The quota cuts a write off before new blocks appear. */
+	ufs_set_quota(stat.block_count * 4096);
+	rc = ufs_write(fd, buffer, sizeof(buffer));
+	unit_check(rc == -1 && ufs_errno() == UFS_ERR_NO_MEM,
+		   "write beyond the quota fails");
+	rc = ufs_pwrite(fd, "x", 1, 0);
+	unit_check(rc == 1, "a write into existing blocks still works");
+	ufs_set_quota(0);
+	rc = ufs_write(fd, buffer, sizeof(buffer));
+	unit_check(rc == sizeof(buffer), "no quota - the write passes");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	ufs_stat_global(&stat);
+	unit_check(stat.file_count == before.file_count &&
+		   stat.file_bytes == before.file_bytes,
+		   "deletion returns the file counters");
+
+	unit_test_finish();
+#endif
+}
+
+static void
+test_dedup(void)
+{
+#if NEED_BLOCK_DEDUP && NEED_MEMORY_ACCOUNTING
+	unit_test_start();
+
+	unit_check(ufs_set_dedup(1) == 0, "dedup on");
+
+	char buffer[4096];
+	memset(buffer, 'd', sizeof(buffer));
+	struct ufs_stat before, stat;
+	ufs_stat_global(&before);
+
+	/* Two files with the same content share one block. */
+	int fd1 = ufs_open("one", UFS_CREATE);
+	int fd2 = ufs_open("two", UFS_CREATE);
+	unit_fail_if(fd1 == -1 || fd2 == -1);
+	/* Dedup works on blocks - leave the inline layout first. */
+	unit_fail_if(ufs_resize(fd1, 256 * 1024) != 0);
+	unit_fail_if(ufs_resize(fd1, 0) != 0);
+	unit_fail_if(ufs_resize(fd2, 256 * 1024) != 0);
+	unit_fail_if(ufs_resize(fd2, 0) != 0);
+	unit_fail_if(ufs_write(fd1, buffer, sizeof(buffer)) !=
+		     (ssize_t)sizeof(buffer));
+	unit_fail_if(ufs_write(fd2, buffer, sizeof(buffer)) !=
+		     (ssize_t)sizeof(buffer));
+	ufs_stat_global(&stat);
+	unit_check(stat.block_count == before.block_count + 1,
+		   "identical blocks are stored once");
+
+	char check[4096];
+	ssize_t rc = ufs_pread(fd2, check, sizeof(check), 0);
+	unit_check(rc == (ssize_t)sizeof(check) &&
+		   memcmp(check, buffer, sizeof(check)) == 0,
+		   "the shared block reads back fine");
+
+	/* A write into one of the sharers splits them. */
+	rc = ufs_pwrite(fd2, "x", 1, 0);
+	unit_fail_if(rc != 1);
+	ufs_stat_global(&stat);
+	unit_check(stat.block_count == before.block_count + 2,
+		   "a write materializes a private copy");
+	rc = ufs_pread(fd1, check, sizeof(check), 0);
+	unit_check(rc == (ssize_t)sizeof(check) && check[0] == 'd',
+		   "the other sharer kept its content");
+
+	unit_fail_if(ufs_close(fd1) != 0);
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_delete("one") != 0);
+	unit_fail_if(ufs_delete("two") != 0);
+	unit_check(ufs_set_dedup(0) == 0, "dedup off");
+
+	unit_test_finish();
+#endif
+}
+
+static void
+test_iteration(void)
+{
+#if NEED_FILE_ITERATION
+	unit_test_start();
+
+	const int count = 5;
+	char name[16];
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "file%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		unit_fail_if(fd == -1);
+		unit_fail_if(ufs_close(fd) != 0);
+	}
+
+	struct ufs_iterator it;
+	memset(&it, 0, sizeof(it));
+	const char *batch[2];
+	int seen[5] = {0};
+	int total = 0;
+	int rc;
+	bool first_batch = true;
+	while ((rc = ufs_iterate(&it, batch, 2)) > 0) {
+		for (int i = 0; i < rc; ++i) {
+			int idx = -1;
+			unit_fail_if(sscanf(batch[i], "file%d", &idx) != 1);
+			unit_fail_if(idx < 0 || idx >= count);
+			++seen[idx];
+		}
+		total += rc;
+		if (first_batch) {
+			/* The snapshot ignores the churn mid-iteration. */
+			unit_fail_if(ufs_delete("file0") != 0);
+			int fd = ufs_open("newcomer", UFS_CREATE);
+			unit_fail_if(fd == -1);
+			unit_fail_if(ufs_close(fd) != 0);
+			first_batch = false;
+		}
+	}
+	unit_check(rc == 0, "iteration ends with 0");
+	unit_check(total == count, "every snapshot name came back");
+	bool once = true;
+	for (int i = 0; i < count; ++i)
+		once = once && seen[i] == 1;
+	unit_check(once, "each name exactly once");
+
+	/* An abandoned iteration is released explicitly. */
+	rc = ufs_iterate(&it, batch, 1);
+	unit_check(rc == 1, "iterator is reusable after the end");
+	ufs_iterator_close(&it);
+
+	unit_fail_if(ufs_delete("newcomer") != 0);
+	for (int i = 1; i < count; ++i) {
+		sprintf(name, "file%d", i);
+		unit_fail_if(ufs_delete(name) != 0);
+	}
+
+	unit_test_finish();
+#endif
+}
+
+static void
+test_compression(void)
+{
+#if NEED_BLOCK_COMPRESSION
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	/* Only blocks compress - leave the inline layout first. */
+	unit_fail_if(ufs_resize(fd, 256 * 1024) != 0);
+	unit_fail_if(ufs_resize(fd, 0) != 0);
+	char buffer[4096 * 3];
+	for (size_t i = 0; i < sizeof(buffer); ++i)
+		buffer[i] = 'a' + i / 64 % 26;
+	ssize_t rc = ufs_write(fd, buffer, sizeof(buffer));
+	unit_fail_if(rc != sizeof(buffer));
+
+	/*
+	 * The write marked the blocks hot, so the first round only
+	 * clears the bits and the second one compresses.
+	 */
+	unit_check(ufs_compress_cold() == 0, "first round skips hot blocks");
+	unit_check(ufs_compress_cold() >= 3, "second round compresses");
+
+	int fd2 = ufs_open("file", 0);
+	unit_fail_if(fd2 == -1);
+	char buffer2[sizeof(buffer)];
+	rc = ufs_read(fd2, buffer2, sizeof(buffer2));
+	unit_check(rc == sizeof(buffer) &&
+		   memcmp(buffer, buffer2, sizeof(buffer)) == 0,
+		   "compressed data reads back intact");
+
+	/* A write decompresses the touched block transparently. */
+	unit_fail_if(ufs_compress_cold() < 0);
+	unit_fail_if(ufs_compress_cold() < 3);
+	int fd3 = ufs_open("file", 0);
+	unit_fail_if(fd3 == -1);
+	rc = ufs_write(fd3, "XYZ", 3);
+	unit_fail_if(rc != 3);
+	unit_fail_if(ufs_close(fd3) != 0);
+	fd3 = ufs_open("file", 0);
+	unit_fail_if(fd3 == -1);
+	rc = ufs_read(fd3, buffer2, sizeof(buffer2));
+	unit_check(rc == sizeof(buffer) && memcmp(buffer2, "XYZ", 3) == 0 &&
+		   memcmp(buffer2 + 3, buffer + 3, sizeof(buffer) - 3) == 0,
+		   "write into a compressed file works");
+	unit_fail_if(ufs_close(fd3) != 0);
+	unit_fail_if(ufs_close(fd2) != 0);
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+#endif
+}
+
+static void
+test_compact(void)
+{
+#if NEED_COMPACTION && NEED_MEMORY_ACCOUNTING
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	/* Leave the inline layout, then materialize 32 blocks. */
+	unit_fail_if(ufs_resize(fd, 256 * 1024) != 0);
+	char buffer[4096];
+	memset(buffer, 'c', sizeof(buffer));
+	for (int i = 0; i < 32; ++i) {
+		ssize_t rc = ufs_write(fd, buffer, sizeof(buffer));
+		unit_fail_if(rc != (ssize_t)sizeof(buffer));
+	}
+	struct ufs_stat before, stat;
+	ufs_stat_global(&before);
+
+	/* Zeroing the middle rewrites in place - the blocks stay. */
+	memset(buffer, 0, sizeof(buffer));
+	for (int i = 8; i < 24; ++i) {
+		ssize_t rc = ufs_pwrite(fd, buffer, sizeof(buffer), i * 4096);
+		unit_fail_if(rc != (ssize_t)sizeof(buffer));
+	}
+	ufs_stat_global(&stat);
+	unit_check(stat.block_count == before.block_count,
+		   "a zeroing write frees nothing by itself");
+
+	/* Small slices converge to the same result as one full pass. */
+	int freed = 0;
+	for (int i = 0; i < 20; ++i)
+		freed += ufs_compact(8);
+	unit_check(freed == 16, "the slices punched the zero windows");
+	ufs_stat_global(&stat);
+	unit_check(stat.block_count == before.block_count - 16,
+		   "the punched blocks went back to the pool");
+
+	char check[4096];
+	bool intact = true;
+	for (int i = 0; i < 64; ++i) {
+		ssize_t rc = ufs_pread(fd, check, sizeof(check), i * 4096);
+		unit_fail_if(rc != (ssize_t)sizeof(check));
+		char want = i < 8 || (i >= 24 && i < 32) ? 'c' : 0;
+		memset(buffer, want, sizeof(buffer));
+		intact = intact && memcmp(check, buffer, sizeof(check)) == 0;
+	}
+	unit_check(intact, "the content reads the same after the punch");
+
+	/* A punched window is a plain hole - it takes writes again. */
+	unit_fail_if(ufs_pwrite(fd, "x", 1, 10 * 4096) != 1);
+	unit_fail_if(ufs_pread(fd, check, 1, 10 * 4096) != 1);
+	unit_check(check[0] == 'x', "a punched window takes writes again");
+
+	/* A shrunk inline file gives its buffer slack back too. */
+	int fd2 = ufs_open("small", UFS_CREATE);
+	unit_fail_if(fd2 == -1);
+	memset(buffer, 's', sizeof(buffer));
+	for (int i = 0; i < 20; ++i) {
+		ssize_t rc = ufs_write(fd2, buffer, sizeof(buffer));
+		unit_fail_if(rc != (ssize_t)sizeof(buffer));
+	}
+	unit_fail_if(ufs_resize(fd2, 100) != 0);
+	unit_check(ufs_compact(-1) >= 1, "the inline buffer was trimmed");
+	unit_fail_if(ufs_pread(fd2, check, 100, 0) != 100);
+	unit_check(memcmp(check, buffer, 100) == 0,
+		   "the trimmed content is intact");
+
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_delete("small") != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+#endif
+}
+
+static void
+test_read_borrow(void)
+{
+#if NEED_READ_BORROW
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	/* Leave the inline layout - the borrow should lend blocks. */
+	unit_fail_if(ufs_resize(fd, 256 * 1024) != 0);
+	unit_fail_if(ufs_resize(fd, 0) != 0);
+	char buffer[4096 * 3];
+	for (size_t i = 0; i < sizeof(buffer); ++i)
+		buffer[i] = 'a' + i / 64 % 26;
+	unit_fail_if(ufs_write(fd, buffer, sizeof(buffer)) !=
+		     (ssize_t)sizeof(buffer));
+
+	struct ufs_borrow borrow;
+	ssize_t rc = ufs_read_borrow(fd, 100, 8000, &borrow);
+	unit_fail_if(rc != 8000);
+	unit_check(borrow.iov_count == 2, "the range spans two blocks");
+	char check[8000];
+	size_t got = 0;
+	for (int i = 0; i < borrow.iov_count; ++i) {
+		memcpy(check + got, borrow.iov[i].base, borrow.iov[i].size);
+		got += borrow.iov[i].size;
+	}
+	unit_check(got == 8000 && memcmp(check, buffer + 100, 8000) == 0,
+		   "the lent iovecs carry the file content");
+
+	/* A write while borrowed goes into its own copy of the block. */
+	unit_fail_if(ufs_pwrite(fd, "XXX", 3, 100) != 3);
+	unit_check(memcmp(borrow.iov[0].base, buffer + 100, 3) == 0,
+		   "the borrowed bytes survive a concurrent write");
+	char reread[3];
+	unit_fail_if(ufs_pread(fd, reread, 3, 100) != 3);
+	unit_check(memcmp(reread, "XXX", 3) == 0,
+		   "the file itself sees the write");
+
+	/* Even closing and deleting does not pull the bytes away. */
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	unit_check(memcmp(borrow.iov[1].base, buffer + 4096, 100) == 0,
+		   "the borrow outlives close and delete");
+	ufs_read_release(&borrow);
+	unit_check(ufs_open("file", 0) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_FILE,
+		   "the released file is fully gone");
+
+	/* Holes are lent as zeros, without materializing blocks. */
+	fd = ufs_open("sparse", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_resize(fd, 256 * 1024) != 0);
+	struct ufs_stat stat;
+	ufs_stat_global(&stat);
+	size_t block_count = stat.block_count;
+	rc = ufs_read_borrow(fd, 4096, 10000, &borrow);
+	unit_fail_if(rc != 10000);
+	int is_zero = 1;
+	for (int i = 0; i < borrow.iov_count; ++i) {
+		for (size_t j = 0; j < borrow.iov[i].size; ++j)
+			is_zero = is_zero && borrow.iov[i].base[j] == 0;
+	}
+	ufs_stat_global(&stat);
+	unit_check(is_zero && stat.block_count == block_count,
+		   "holes read as zeros and stay holes");
+	ufs_read_release(&borrow);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("sparse") != 0);
+
+	/* An inline file is lent too, from a private copy. */
+	fd = ufs_open("small", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, "hello", 5) != 5);
+	rc = ufs_read_borrow(fd, 0, 100, &borrow);
+	unit_check(rc == 5 && borrow.iov_count == 1 &&
+		   memcmp(borrow.iov[0].base, "hello", 5) == 0,
+		   "an inline file borrows fine");
+	ufs_read_release(&borrow);
+
+	unit_check(ufs_read_borrow(fd, 5, 100, &borrow) == 0,
+		   "a borrow past the end is EOF");
+	ufs_read_release(&borrow);
+
+	int fd2 = ufs_open("small", UFS_WRITE_ONLY);
+	unit_fail_if(fd2 == -1);
+	unit_check(ufs_read_borrow(fd2, 0, 100, &borrow) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_PERMISSION,
+		   "no borrowing through a write-only descriptor");
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("small") != 0);
+
+	unit_test_finish();
+#endif
+}
+
+#if NEED_EVICTION
+
+enum {
+	EVICT_STORE_CAPACITY = 8,
+	EVICT_FILE_SIZE = 64 * 1024,
+};
+
+/** The test's "cold storage" - spilled files land here. */
+struct evict_store {
+	char *names[EVICT_STORE_CAPACITY];
+	char *datas[EVICT_STORE_CAPACITY];
+	size_t sizes[EVICT_STORE_CAPACITY];
+	int count;
+	int spill_count;
+	int fetch_count;
+};
+
+static int
+evict_store_spill(const char *filename, const char *data, size_t size,
+		  void *arg)
+{
+	struct evict_store *store = arg;
+	unit_fail_if(store->count == EVICT_STORE_CAPACITY);
+	store->names[store->count] = strdup(filename);
+	store->datas[store->count] = malloc(size);
+	unit_fail_if(store->names[store->count] == NULL ||
+		     store->datas[store->count] == NULL);
+	memcpy(store->datas[store->count], data, size);
+	store->sizes[store->count] = size;
+	++store->count;
+	++store->spill_count;
+	return 0;
+}
+
+static ssize_t
+evict_store_fetch(const char *filename, char *data, size_t size, void *arg)
+{
+	struct evict_store *store = arg;
+	++store->fetch_count;
+	for (int i = 0; i < store->count; ++i) {
+		if (strcmp(store->names[i], filename) != 0)
+			continue;
+		unit_fail_if(store->sizes[i] != size);
+		memcpy(data, store->datas[i], size);
+		free(store->names[i]);
+		free(store->datas[i]);
+		--store->count;
+		store->names[i] = store->names[store->count];
+		store->datas[i] = store->datas[store->count];
+		store->sizes[i] = store->sizes[store->count];
+		return size;
+	}
+	return -1;
+}
+
+static int
+evict_store_has(const struct evict_store *store, const char *filename)
+{
+	for (int i = 0; i < store->count; ++i) {
+		if (strcmp(store->names[i], filename) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+#endif
+
+static void
+test_eviction(void)
+{
+#if NEED_EVICTION && NEED_MEMORY_ACCOUNTING
+	unit_test_start();
+
+	struct evict_store store;
+	memset(&store, 0, sizeof(store));
+	char *buffer = malloc(EVICT_FILE_SIZE);
+	char *check = malloc(EVICT_FILE_SIZE);
+	unit_fail_if(buffer == NULL || check == NULL);
+
+	struct ufs_stat before, stat;
+	ufs_stat_global(&before);
+
+	/* Three files; the access order makes "cold" the LRU one. */
+	const char *names[3] = {"cold", "warm", "hot"};
+	for (int i = 0; i < 3; ++i) {
+		int fd = ufs_open(names[i], UFS_CREATE);
+		unit_fail_if(fd == -1);
+		memset(buffer, 'a' + i, EVICT_FILE_SIZE);
+		unit_fail_if(ufs_write(fd, buffer, EVICT_FILE_SIZE) !=
+			     EVICT_FILE_SIZE);
+		unit_fail_if(ufs_close(fd) != 0);
+	}
+
+	/* A budget for two of the three pushes the LRU one out. */
+	struct ufs_evict_config config;
+	config.budget_bytes = before.file_bytes + 2 * EVICT_FILE_SIZE;
+	config.spill = evict_store_spill;
+	config.fetch = evict_store_fetch;
+	config.arg = &store;
+	ufs_set_eviction(&config);
+	ufs_stat_global(&stat);
+	unit_check(store.spill_count == 1 && evict_store_has(&store, "cold"),
+		   "the least recently used file was spilled");
+	unit_check(stat.file_bytes == before.file_bytes +
+		   2 * EVICT_FILE_SIZE, "the spilled bytes left the usage");
+	unit_check(stat.file_count == before.file_count + 3,
+		   "the spilled file is still listed");
+
+	/*
+	 * Opening the spilled file faults it back in - and the
+	 * re-admitted bytes push the next LRU file out.
+	 */
+	int fd = ufs_open("cold", 0);
+	unit_fail_if(fd == -1);
+	unit_check(store.fetch_count == 1, "the content was fetched back");
+	memset(buffer, 'a', EVICT_FILE_SIZE);
+	ssize_t rc = ufs_read(fd, check, EVICT_FILE_SIZE);
+	unit_check(rc == EVICT_FILE_SIZE &&
+		   memcmp(check, buffer, EVICT_FILE_SIZE) == 0,
+		   "the content survived the round trip");
+	unit_check(store.spill_count == 2 && evict_store_has(&store, "warm"),
+		   "the fault-in pushed the next cold file out");
+	unit_fail_if(ufs_close(fd) != 0);
+
+	/* An open descriptor pins its file through any budget. */
+	fd = ufs_open("hot", 0);
+	unit_fail_if(fd == -1);
+	config.budget_bytes = 0;
+	ufs_set_eviction(&config);
+	ufs_stat_global(&stat);
+	unit_check(!evict_store_has(&store, "hot") &&
+		   stat.file_bytes == before.file_bytes + EVICT_FILE_SIZE,
+		   "the open file stayed resident");
+	unit_fail_if(ufs_close(fd) != 0);
+
+	/* The remaining files come back fine even at a zero budget. */
+	fd = ufs_open("warm", 0);
+	unit_fail_if(fd == -1);
+	memset(buffer, 'b', EVICT_FILE_SIZE);
+	rc = ufs_read(fd, check, EVICT_FILE_SIZE);
+	unit_check(rc == EVICT_FILE_SIZE &&
+		   memcmp(check, buffer, EVICT_FILE_SIZE) == 0,
+		   "the second spilled file reads back fine");
+	unit_fail_if(ufs_close(fd) != 0);
+
+	/* Deletion drops a spilled file by name, like any other. */
+	for (int i = 0; i < 3; ++i)
+		unit_fail_if(ufs_delete(names[i]) != 0);
+	ufs_set_eviction(NULL);
+	ufs_stat_global(&stat);
+	unit_check(stat.file_count == before.file_count &&
+		   stat.file_bytes == before.file_bytes,
+		   "everything is cleaned up");
+
+	for (int i = 0; i < store.count; ++i) {
+		free(store.names[i]);
+		free(store.datas[i]);
+	}
+	free(buffer);
+	free(check);
+
+	unit_test_finish();
+#endif
+}
+
+static void
+test_notifications(void)
+{
+#if NEED_NOTIFICATIONS
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	int watcher = ufs_open("file", 0);
+	unit_fail_if(watcher == -1);
+	unit_check(ufs_subscribe(100500, UFS_EVENT_WRITE) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_FILE, "bad descriptor");
+	unit_fail_if(ufs_subscribe(watcher, UFS_EVENT_WRITE |
+		UFS_EVENT_RESIZE | UFS_EVENT_DELETE) != 0);
+
+	struct ufs_event events[8];
+	unit_check(ufs_poll_events(events, 8) == 0, "nothing happened yet");
+
+	/* Mutations between two polls coalesce into one entry. */
+	unit_fail_if(ufs_write(fd, "aaa", 3) != 3);
+	unit_fail_if(ufs_write(fd, "bbb", 3) != 3);
+	unit_fail_if(ufs_pwrite(fd, "c", 1, 1) != 1);
+	unit_check(ufs_poll_events(events, 8) == 1, "one batched entry");
+	unit_check(events[0].fd == watcher, "reported for the subscriber");
+	unit_check(events[0].events ==
+		   (UFS_EVENT_WRITE | UFS_EVENT_RESIZE),
+		   "an extending write reports both bits");
+	unit_check(ufs_poll_events(events, 8) == 0, "drained");
+
+	/* An in-place overwrite is a write, not a resize. */
+	unit_fail_if(ufs_pwrite(fd, "x", 1, 0) != 1);
+	unit_check(ufs_poll_events(events, 8) == 1 &&
+		   events[0].events == UFS_EVENT_WRITE,
+		   "an overwrite is just a write");
+
+	unit_fail_if(ufs_resize(fd, 100) != 0);
+	unit_check(ufs_poll_events(events, 8) == 1 &&
+		   events[0].events == UFS_EVENT_RESIZE, "resize reported");
+
+	/* A repeated subscribe replaces the mask. */
+	unit_fail_if(ufs_subscribe(watcher, UFS_EVENT_DELETE) != 0);
+	unit_fail_if(ufs_write(fd, "ddd", 3) != 3);
+	unit_check(ufs_poll_events(events, 8) == 0,
+		   "the writes are opted out now");
+	unit_fail_if(ufs_delete("file") != 0);
+	unit_check(ufs_poll_events(events, 8) == 1 &&
+		   events[0].events == UFS_EVENT_DELETE, "delete reported");
+
+	/* Closing the subscribed descriptor cancels the subscription. */
+	unit_fail_if(ufs_close(watcher) != 0);
+	unit_fail_if(ufs_write(fd, "e", 1) != 1);
+	unit_check(ufs_poll_events(events, 8) == 0,
+		   "no events after the close");
+	unit_fail_if(ufs_close(fd) != 0);
+
+	unit_test_finish();
+#endif
+}
+
 int
 main(int argc, char **argv)
 {
@@ -493,6 +1463,21 @@ main(int argc, char **argv)
 	test_max_file_size();
 	test_rights();
 	test_resize();
+	test_vectored_io();
+	test_positional_io();
+	test_clone();
+	test_sparse();
+	test_snapshot();
+	test_append();
+	test_inline();
+	test_accounting();
+	test_dedup();
+	test_iteration();
+	test_compression();
+	test_compact();
+	test_read_borrow();
+	test_eviction();
+	test_notifications();
 
 	/* Free the memory to make the memory leak detector happy. */
 	ufs_destroy();
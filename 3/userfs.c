@@ -1,7 +1,16 @@
 #include "userfs.h"
+#include "rhash.h"
 
 #include <string.h>
+#include <assert.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 #define CAPACITY_MULTIPLIER 2
 #define DESCRIPTOR_POOL_START_SIZE 10
@@ -10,32 +19,246 @@
 enum {
 	BLOCK_SIZE = 4096,
 	MAX_FILE_SIZE = 1024 * 1024 * 100,
+	/**
+	 * The block header and its payload live in one allocation;
+	 * the payload starts at this offset so it stays aligned to a
+	 * cache line.
+	 */
+	BLOCK_HEADER_SIZE = 64,
+	/**
+	 * Slabs the block cells are carved from. One slab is a single
+	 * 2 MB anonymous mapping aligned to its own size, so the
+	 * kernel can back it with one huge page - a sequential scan
+	 * over a big file then costs one dTLB entry per 2 MB instead
+	 * of one per 4 KB block.
+	 */
+	BLOCK_SLAB_SIZE = 2 * 1024 * 1024,
+	BLOCK_CELL_SIZE = BLOCK_HEADER_SIZE + BLOCK_SIZE,
+	/**
+	 * Files up to this size live in one contiguous realloc-grown
+	 * buffer instead of the block table - a small hot file is
+	 * then read with a single memcpy and no pointer chasing. Past
+	 * the threshold the file converts to blocks, once.
+	 */
+	INLINE_FILE_LIMIT = 128 * 1024,
 };
 
-/** Global error code. Set from any function on any error. */
-static enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
+/** Per-thread error code. Set from any function on any error. */
+static _Thread_local enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
+
+/**
+ * Lock of all the FS metadata: the file list, the name hash, the
+ * descriptor table, the file reference counters. The data itself is
+ * not under it - each file carries its own rwlock, so I/O on
+ * different files runs in parallel and readers of one file don't
+ * serialize each other. The metadata sections are short, open/close
+ * rates are nowhere near read/write rates.
+ *
+ * Lock order: the metadata lock, then a file rwlock. The I/O paths
+ * drop the metadata lock before taking the file lock - a descriptor
+ * can't disappear concurrently, because it is owned by the caller
+ * and keeps a reference on the file.
+ */
+static pthread_mutex_t ufs_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 struct block {
-	/** Block memory. */
+	/**
+	 * Block memory. Points right behind the header, into the
+	 * same allocation. While the block sits in the free pool the
+	 * field is reused as the next-in-pool link.
+	 */
 	char *memory;
-	/** How many bytes are occupied. */
-	int occupied;
-	/** Next block in the file. */
-	struct block *next;
-	/** Previous block in the file. */
-	struct block *prev;
-
-	/* PUT HERE OTHER MEMBERS */
+	/**
+	 * How many files reference the block. Above 1 the block is
+	 * shared copy-on-write and has to be materialized privately
+	 * before a write.
+	 */
+	int refs;
+	/**
+	 * The payload points into a loaded snapshot mapping instead
+	 * of behind the header. Such a block is read-only - a write
+	 * copies it out of the mapping first.
+	 */
+	int is_mapped;
+	/**
+	 * Access clock bit - set on every read and write touching the
+	 * block, cleared by the cold sweep. A block which kept the bit
+	 * clear for a whole sweep round is cold. Written under the
+	 * file's read lock by concurrent readers, which is fine - all
+	 * of them store the same value, and the sweep itself runs
+	 * under the write lock.
+	 */
+	int is_hot;
+	/**
+	 * The payload is LZ-compressed: memory points at comp_size
+	 * bytes in their own allocation, not behind the header. Reads
+	 * and writes materialize a full block back first.
+	 */
+	int is_compressed;
+	uint32_t comp_size;
+	/**
+	 * Dedup index linkage: the content hash, the bucket chain and
+	 * whether the block currently sits in the index. Only plain
+	 * private full blocks are indexed.
+	 */
+	uint32_t hash;
+	int in_index;
+	struct block *hash_next;
+};
+
+/**
+ * Pool of free block cells. The cells live inside the slabs and are
+ * never freed individually - a freed block returns here and the
+ * next write takes it back, so churny delete/resize workloads don't
+ * touch the allocator at all. The slab memory goes back to the OS
+ * in ufs_destroy().
+ */
+static struct block *block_pool = NULL;
+static int block_pool_count = 0;
+/** The pool is shared by writers of different files. */
+static pthread_mutex_t block_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * The slabs, linked through their first header-sized cell for the
+ * final unmap. Guarded by block_pool_mutex like the pool itself.
+ */
+struct block_slab {
+	struct block_slab *next;
 };
 
+static struct block_slab *block_slab_list = NULL;
+
+#if NEED_BLOCK_DEDUP
+
+/*
+ * Content-hash index over the block payloads. When enabled, a write
+ * which fills a whole block looks its content up here and shares an
+ * identical existing block copy-on-write instead of keeping its own
+ * copy - near-identical data sets then store every distinct block
+ * once. A block leaves the index when its content is about to
+ * change or when it dies; a lookup double-checks with memcmp, the
+ * hash only picks the bucket.
+ */
+enum { DEDUP_BUCKET_COUNT = 4096 };
+
+static struct block **dedup_index = NULL;
+static int dedup_enabled = 0;
+/**
+ * Guards the index and the sharing refs it hands out. Taken after
+ * a file rwlock, never together with the pool mutex.
+ */
+static pthread_mutex_t dedup_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** FNV-1a over the whole payload. */
+static uint32_t
+dedup_hash(const char *memory)
+{
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < BLOCK_SIZE; ++i) {
+        hash ^= (unsigned char)memory[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Unlink the block from the index, if it is there. */
+static void
+dedup_remove(struct block *block)
+{
+    if (!block->in_index)
+        return;
+    pthread_mutex_lock(&dedup_mutex);
+    struct block **link = &dedup_index[block->hash % DEDUP_BUCKET_COUNT];
+    while (*link != block)
+        link = &(*link)->hash_next;
+    *link = block->hash_next;
+    block->hash_next = NULL;
+    block->in_index = 0;
+    pthread_mutex_unlock(&dedup_mutex);
+}
+
+#else
+
+static void dedup_remove(struct block *block) { (void)block; }
+
+#endif
+
+#if NEED_MEMORY_ACCOUNTING
+
+/*
+ * Usage counters, each maintained in O(1) at the place where the
+ * resource changes hands. The updaters hold different locks (the
+ * pool mutex, a file rwlock, ufs_mutex), so the counters are plain
+ * relaxed atomics - a reader gets a consistent enough number for
+ * sizing decisions, not a transactional snapshot.
+ */
+/** Materialized blocks - plain, compressed and mapped. */
+static size_t ufs_block_count = 0;
+/** Sum of the live file sizes in bytes. */
+static size_t ufs_file_bytes = 0;
+/**
+ * Global data quota in bytes, 0 - unlimited. A write which needs
+ * to materialize a block beyond it fails with UFS_ERR_NO_MEM.
+ */
+static size_t ufs_quota_bytes = 0;
+
+static void
+ufs_count_blocks(long delta)
+{
+    __atomic_add_fetch(&ufs_block_count, delta, __ATOMIC_RELAXED);
+}
+
+static void
+ufs_count_file_bytes(long delta)
+{
+    __atomic_add_fetch(&ufs_file_bytes, delta, __ATOMIC_RELAXED);
+}
+
+/* Whether one more block would cross the quota. */
+static int
+ufs_quota_exceeded(void)
+{
+    size_t quota = __atomic_load_n(&ufs_quota_bytes, __ATOMIC_RELAXED);
+    if (quota == 0)
+        return 0;
+    size_t count = __atomic_load_n(&ufs_block_count, __ATOMIC_RELAXED);
+    return (count + 1) * (size_t)BLOCK_SIZE > quota;
+}
+
+#else
+
+static void ufs_count_blocks(long delta) { (void)delta; }
+static void ufs_count_file_bytes(long delta) { (void)delta; }
+static int ufs_quota_exceeded(void) { return 0; }
+
+#endif
+
 struct file {
-	/** Double-linked list of file blocks. */
-	struct block *block_list;
 	/**
-	 * Last block in the list above for fast access to the end
-	 * of file.
+	 * Table of file blocks, indexed by offset / BLOCK_SIZE. The
+	 * old per-block prev/next chain made an I/O at a 90 MB
+	 * offset walk ~23k nodes; the table resolves any offset in
+	 * one index operation and the pointers sit in one
+	 * cache-friendly span. A NULL slot is a hole - the range
+	 * reads as zeros and costs no memory until written.
+	 */
+	struct block **blocks;
+	/** How many leading table slots are filled. */
+	int block_count;
+	/**
+	 * The small-file layout: while set, the whole content is the
+	 * first size bytes of inline_data and the block table is
+	 * empty. Cleared - forever - when the file outgrows
+	 * INLINE_FILE_LIMIT. The capacity beyond size is kept zeroed
+	 * so sparse gaps read as zeros without extra bookkeeping.
 	 */
-	struct block *last_block;
+	int is_inline;
+	char *inline_data;
+	size_t inline_capacity;
+	/** Size of the table, in slots. */
+	int block_capacity;
+	/** File size in bytes. */
+	size_t size;
 	/** How many file descriptors are opened on the file. */
 	int refs;
 	/** File name. */
@@ -43,19 +266,112 @@ struct file {
 	/** Files are stored in a double-linked list. */
 	struct file *next;
 	struct file *prev;
+	/** Link in the name index. */
+	struct rhash_entry in_names;
+	/**
+	 * Guards the file content. Readers share it; writes, resize
+	 * and copy-on-write materialization take it exclusively.
+	 */
+	pthread_rwlock_t rwlock;
+
+	/**
+	 * The tick of the global access clock at the last open, read
+	 * or write of the file. The eviction sweep spills the file
+	 * with the smallest stamp first.
+	 */
+	uint64_t lru_stamp;
+	/**
+	 * The content was spilled out through the eviction callback.
+	 * The file keeps only its name and the spilled size; an open
+	 * fetches the bytes back in.
+	 */
+	int is_evicted;
+	size_t evicted_size;
 
 	int is_removed;
+
+#if NEED_NOTIFICATIONS
+	/** Subscriptions of this file's descriptors. */
+	struct ufs_sub *subs;
+	/**
+	 * Union of the subscriber masks. The mutation paths probe it
+	 * with one unlocked load to skip the whole notification
+	 * machinery when nobody listens - which is the common case.
+	 */
+	int sub_mask;
+#endif
 };
 
 /** List of all files. */
 static struct file *file_list = NULL;
 
+/**
+ * Hash index over the names of the live (not removed) files. The
+ * list above stays for iteration and for the removed-but-referenced
+ * files; the index only serves find(), so open cost doesn't grow
+ * with the file count.
+ */
+static struct rhash file_names = {0};
+
+static void
+file_hash_insert(struct file *file)
+{
+    /*
+     * A failure is not fatal - the file just won't be found by
+     * name until a later insert manages to grow the index.
+     */
+    rhash_insert(&file_names, &file->in_names,
+                 rhash_hash_str(file->name));
+}
+
+static void
+file_hash_remove(struct file *file)
+{
+    rhash_remove(&file_names, &file->in_names);
+}
+
+#if NEED_EVICTION
+
+/*
+ * Eviction turns the FS into a bounded cache: when the resident
+ * bytes overrun the budget, the least recently used closed files
+ * are handed to the spill callback and their memory is released; an
+ * open fetches them back. The config is written under ufs_mutex;
+ * the fast-path check reads the budget and the spill pointer with
+ * relaxed atomics, like the usage counters it compares against.
+ */
+static struct ufs_evict_config ufs_evict_config = {0, NULL, NULL, NULL};
+/** Global access clock, ticked by every stamped access. */
+static uint64_t ufs_evict_clock = 0;
+
+/*
+ * Stamp the file with the current access clock tick. One relaxed
+ * increment and a plain store - racing accesses differ by a tick
+ * and either of them keeps the file just as warm.
+ */
+static void
+file_touch(struct file *file)
+{
+    file->lru_stamp =
+        __atomic_add_fetch(&ufs_evict_clock, 1, __ATOMIC_RELAXED);
+}
+
+#else
+
+static void file_touch(struct file *file) { (void)file; }
+
+#endif
+
 struct filedesc {
 	struct file *file;
 
-	int curr_data_segment;
 	enum open_flags flags;
-	int byte_pos;
+	/** Current position in the file, in bytes. */
+	size_t pos;
+#if NEED_NOTIFICATIONS
+	/** The descriptor's change subscription, NULL when none. */
+	struct ufs_sub *sub;
+#endif
 };
 
 /**
@@ -68,6 +384,162 @@ static struct filedesc **file_descriptors = NULL;
 static int file_descriptor_count = 0;
 static int file_descriptor_capacity = 0;
 
+#if NEED_NOTIFICATIONS
+
+/**
+ * One descriptor's subscription to its file's changes, see
+ * ufs_subscribe(). Owned by the descriptor, linked into the file's
+ * subscriber list, and sitting in the global ready FIFO while it
+ * has accumulated events.
+ */
+struct ufs_sub {
+    /** The subscribed descriptor number, reported by the poll. */
+    int fd;
+    /** Events the subscriber asked for. */
+    int mask;
+    /** Events accumulated since the last poll. */
+    int pending;
+    /** The watched file. */
+    struct file *file;
+    /** Links in the file's subscriber list. */
+    struct ufs_sub *file_next;
+    struct ufs_sub *file_prev;
+    /** Links in the ready FIFO; valid while in_ready is set. */
+    struct ufs_sub *ready_next;
+    struct ufs_sub *ready_prev;
+    int in_ready;
+};
+
+/**
+ * Guards the subscriber lists and the ready queue. Separate from
+ * ufs_mutex so the I/O paths, which notify after dropping their
+ * locks, never queue behind an open or a close. Taken after
+ * ufs_mutex when both are needed.
+ */
+static pthread_mutex_t notify_mutex = PTHREAD_MUTEX_INITIALIZER;
+/** FIFO of subscriptions with accumulated events. */
+static struct ufs_sub *ready_first = NULL;
+static struct ufs_sub *ready_last = NULL;
+
+/** Needs notify_mutex. */
+static void
+ready_enqueue(struct ufs_sub *sub)
+{
+    sub->in_ready = 1;
+    sub->ready_next = NULL;
+    sub->ready_prev = ready_last;
+    if (ready_last != NULL)
+        ready_last->ready_next = sub;
+    else
+        ready_first = sub;
+    ready_last = sub;
+}
+
+/** Needs notify_mutex. */
+static void
+ready_dequeue(struct ufs_sub *sub)
+{
+    if (sub->ready_prev != NULL)
+        sub->ready_prev->ready_next = sub->ready_next;
+    else
+        ready_first = sub->ready_next;
+    if (sub->ready_next != NULL)
+        sub->ready_next->ready_prev = sub->ready_prev;
+    else
+        ready_last = sub->ready_prev;
+    sub->in_ready = 0;
+}
+
+/**
+ * Record the events on the file for its subscribers: one mask OR
+ * and at most one queue push per subscriber, nothing proportional
+ * to the file size or the file count - which is the whole point
+ * compared to a periodic re-read-and-compare scan. The unlocked
+ * sub_mask probe keeps the nobody-listens case at a single branch;
+ * a subscription racing with a mutation may miss that one event,
+ * the same way it would have missed it by subscribing a moment
+ * later.
+ */
+static void
+ufs_notify(struct file *file, int events)
+{
+    if ((file->sub_mask & events) == 0)
+        return;
+    pthread_mutex_lock(&notify_mutex);
+    for (struct ufs_sub *sub = file->subs; sub != NULL;
+         sub = sub->file_next) {
+        int got = sub->mask & events;
+        if (got == 0)
+            continue;
+        sub->pending |= got;
+        if (!sub->in_ready)
+            ready_enqueue(sub);
+    }
+    pthread_mutex_unlock(&notify_mutex);
+}
+
+static void
+ufs_notify_write(struct file *file, int resized)
+{
+    ufs_notify(file, UFS_EVENT_WRITE |
+        (resized ? UFS_EVENT_RESIZE : 0));
+}
+
+static void
+ufs_notify_resize(struct file *file)
+{
+    ufs_notify(file, UFS_EVENT_RESIZE);
+}
+
+static void
+ufs_notify_delete(struct file *file)
+{
+    ufs_notify(file, UFS_EVENT_DELETE);
+}
+
+/** Recompute the union of the subscriber masks. Needs notify_mutex. */
+static void
+file_sub_mask_recalc(struct file *file)
+{
+    int mask = 0;
+    for (struct ufs_sub *sub = file->subs; sub != NULL;
+         sub = sub->file_next)
+        mask |= sub->mask;
+    file->sub_mask = mask;
+}
+
+/** Drop the descriptor's subscription, if any. */
+static void
+ufs_sub_close(struct filedesc *desc)
+{
+    struct ufs_sub *sub = desc->sub;
+    if (sub == NULL)
+        return;
+    pthread_mutex_lock(&notify_mutex);
+    if (sub->in_ready)
+        ready_dequeue(sub);
+    if (sub->file_prev != NULL)
+        sub->file_prev->file_next = sub->file_next;
+    else
+        sub->file->subs = sub->file_next;
+    if (sub->file_next != NULL)
+        sub->file_next->file_prev = sub->file_prev;
+    file_sub_mask_recalc(sub->file);
+    pthread_mutex_unlock(&notify_mutex);
+    free(sub);
+    desc->sub = NULL;
+}
+
+#else
+
+static void ufs_notify_write(struct file *file, int resized)
+{ (void)file; (void)resized; }
+static void ufs_notify_resize(struct file *file) { (void)file; }
+static void ufs_notify_delete(struct file *file) { (void)file; }
+static void ufs_sub_close(struct filedesc *desc) { (void)desc; }
+
+#endif
+
 enum ufs_error_code
 ufs_errno()
 {
@@ -126,134 +598,595 @@ adjust_container_capacity()
     return UFS_ERR_NO_ERR;
 }
 
-static enum ufs_error_code
-expand_storage_unit(struct file *storage_entity) 
+/*
+ * Carve a fresh slab into block cells and push them onto the pool.
+ * The mapping is made oversized and trimmed so the slab lands on a
+ * 2 MB boundary - an unaligned extent would never get a huge page.
+ * Needs block_pool_mutex held. Returns -1 when the mapping fails.
+ */
+static int
+block_slab_carve(void)
 {
-    struct block *new_data_cell = (struct block*)malloc(sizeof(struct block));
-    if (new_data_cell == NULL) return UFS_ERR_NO_MEM;
-
-    new_data_cell->memory = (char*)calloc(BLOCK_SIZE, sizeof(char));
-    if (new_data_cell->memory == NULL) {
-        free(new_data_cell);
-        return UFS_ERR_NO_MEM;
+    size_t map_size = BLOCK_SLAB_SIZE * 2;
+    char *raw = (char *)mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) return -1;
+    char *base = (char *)(((uintptr_t)raw + BLOCK_SLAB_SIZE - 1) &
+        ~((uintptr_t)BLOCK_SLAB_SIZE - 1));
+    size_t head = base - raw;
+    if (head != 0) munmap(raw, head);
+    size_t tail = map_size - head - BLOCK_SLAB_SIZE;
+    if (tail != 0) munmap(base + BLOCK_SLAB_SIZE, tail);
+#ifdef MADV_HUGEPAGE
+    /* Best-effort - the slab works the same without THP. */
+    madvise(base, BLOCK_SLAB_SIZE, MADV_HUGEPAGE);
+#endif
+    _Static_assert(sizeof(struct block_slab) <= BLOCK_HEADER_SIZE,
+                   "the slab link must fit into one header");
+    struct block_slab *slab = (struct block_slab *)base;
+    slab->next = block_slab_list;
+    block_slab_list = slab;
+    /* The first header-sized piece is taken by the slab link. */
+    int cell_count = (BLOCK_SLAB_SIZE - BLOCK_HEADER_SIZE) /
+        BLOCK_CELL_SIZE;
+    char *cells = base + BLOCK_HEADER_SIZE;
+    for (int i = 0; i < cell_count; ++i) {
+        struct block *block = (struct block *)(cells +
+            (size_t)i * BLOCK_CELL_SIZE);
+        block->memory = (char *)block_pool;
+        block_pool = block;
     }
+    block_pool_count += cell_count;
+    return 0;
+}
 
-    new_data_cell->occupied = 0;
-    new_data_cell->next = NULL;
-    new_data_cell->prev = NULL;
-
-    if (storage_entity->block_list == NULL) {
-        storage_entity->block_list = new_data_cell;
-        storage_entity->last_block = new_data_cell;
-    } else {
-        new_data_cell->prev = storage_entity->last_block;
-        storage_entity->last_block->next = new_data_cell;
-        storage_entity->last_block = new_data_cell;
+static struct block *
+block_new(void)
+{
+    if (ufs_quota_exceeded()) {
+        ufs_error_code = UFS_ERR_NO_MEM;
+        return NULL;
+    }
+    struct block *new_data_cell = NULL;
+    pthread_mutex_lock(&block_pool_mutex);
+    if (block_pool == NULL && block_slab_carve() != 0) {
+        pthread_mutex_unlock(&block_pool_mutex);
+        return NULL;
     }
+    _Static_assert(sizeof(struct block) <= BLOCK_HEADER_SIZE,
+                   "the header must fit before the payload");
+    new_data_cell = block_pool;
+    block_pool = (struct block *)new_data_cell->memory;
+    --block_pool_count;
+    pthread_mutex_unlock(&block_pool_mutex);
+
+    new_data_cell->memory = (char *)new_data_cell + BLOCK_HEADER_SIZE;
+    memset(new_data_cell->memory, 0, BLOCK_SIZE);
+    new_data_cell->refs = 1;
+    new_data_cell->is_mapped = 0;
+    new_data_cell->is_hot = 1;
+    new_data_cell->is_compressed = 0;
+    new_data_cell->comp_size = 0;
+    new_data_cell->hash = 0;
+    new_data_cell->in_index = 0;
+    new_data_cell->hash_next = NULL;
+    ufs_count_blocks(1);
+    return new_data_cell;
+}
 
-    return UFS_ERR_NO_ERR;
+/* A block whose payload lives in a snapshot mapping. */
+static struct block *
+block_new_mapped(char *memory)
+{
+    struct block *block = (struct block *)malloc(sizeof(*block));
+    if (block == NULL) return NULL;
+    block->memory = memory;
+    block->refs = 1;
+    block->is_mapped = 1;
+    block->is_hot = 1;
+    block->is_compressed = 0;
+    block->comp_size = 0;
+    block->hash = 0;
+    block->in_index = 0;
+    block->hash_next = NULL;
+    ufs_count_blocks(1);
+    return block;
 }
 
 static void
-release_memory_chain(struct block *memory_chain_head)
+block_unref(struct block *block)
 {
-    struct block *current_segment = memory_chain_head;
-    
-    while (current_segment != NULL) {
-        struct block *next_segment = current_segment->next;
-        
-        if (current_segment->memory != NULL) {
-            free(current_segment->memory);
-            current_segment->memory = NULL;
-        }
-        
-        free(current_segment);
-        current_segment = next_segment;
+    if (block == NULL) return;
+    if (--block->refs > 0) return;
+    dedup_remove(block);
+    ufs_count_blocks(-1);
+    if (block->is_compressed) {
+        /* The payload is a separate allocation, not poolable. */
+        free(block->memory);
+        free(block);
+        return;
+    }
+    if (block->is_mapped) {
+        /* The mapping itself is unmapped in ufs_destroy(). */
+        free(block);
+        return;
     }
+    /* A slab cell - back onto the pool, never to the allocator. */
+    pthread_mutex_lock(&block_pool_mutex);
+    block->memory = (char *)block_pool;
+    block_pool = block;
+    ++block_pool_count;
+    pthread_mutex_unlock(&block_pool_mutex);
 }
 
-static struct file *
-mkfile(const char *fname)
+static void
+block_pool_drain(void)
 {
-    struct file *new_entry = (struct file*)malloc(sizeof(struct file));
-    if (!new_entry) {
-        return NULL;
+    block_pool = NULL;
+    block_pool_count = 0;
+    while (block_slab_list != NULL) {
+        struct block_slab *next = block_slab_list->next;
+        munmap(block_slab_list, BLOCK_SLAB_SIZE);
+        block_slab_list = next;
     }
-    
-    memset(new_entry, 0, sizeof(struct file));
+}
 
-    new_entry->name = strdup(fname);
-    if (!new_entry->name) {
-        free(new_entry);
-        return NULL;
-    }
+/*
+ * Tiny LZ codec for the cold-block compression. The format is a
+ * stream of tokens: a byte with the high bit clear opens a literal
+ * run - the low 7 bits are the run length minus one and the bytes
+ * follow; a byte with the high bit set is a back-reference - the
+ * low 7 bits are the match length minus UFS_LZ_MIN_MATCH, then two
+ * bytes of little-endian distance. Greedy parsing over a positional
+ * hash of 4-byte sequences. Nothing clever, but the zero-filled and
+ * textual blocks making up the archival bulk shrink several times,
+ * and both directions run at memory speed on a 4 KB block.
+ */
 
-    if (expand_storage_unit(new_entry) != UFS_ERR_NO_ERR) {
-        free(new_entry->name);
-        free(new_entry);
-        return NULL;
-    }
+enum {
+	UFS_LZ_MIN_MATCH = 4,
+	UFS_LZ_MAX_MATCH = 127 + UFS_LZ_MIN_MATCH,
+	UFS_LZ_HASH_SIZE = 4096,
+};
 
-    new_entry->next = file_list;
-    if (file_list) {
-        file_list->prev = new_entry;
-    }
+static uint32_t
+ufs_lz_hash(const char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return (v * 2654435761u) >> 20;
+}
 
-    file_list = new_entry;
+static int
+ufs_lz_emit_literals(const char *src, size_t from, size_t to,
+		     char *dst, size_t *out, size_t dst_cap)
+{
+	while (from < to) {
+		size_t run = to - from;
+		if (run > 128)
+			run = 128;
+		if (*out + 1 + run > dst_cap)
+			return -1;
+		dst[(*out)++] = (char)(run - 1);
+		memcpy(dst + *out, src + from, run);
+		*out += run;
+		from += run;
+	}
+	return 0;
+}
 
-    return new_entry;
+/*
+ * Compress src into dst. Returns the compressed size, or 0 when the
+ * result would not fit into dst_cap - the block is then considered
+ * not worth compressing.
+ */
+static size_t
+ufs_lz_compress(const char *src, size_t src_size, char *dst, size_t dst_cap)
+{
+	uint16_t table[UFS_LZ_HASH_SIZE];
+	memset(table, 0, sizeof(table));
+	size_t in = 0;
+	size_t out = 0;
+	size_t literal_start = 0;
+	while (in + UFS_LZ_MIN_MATCH <= src_size) {
+		uint32_t h = ufs_lz_hash(src + in);
+		size_t cand = table[h];
+		table[h] = in;
+		/*
+		 * A stale or never-written entry is harmless: the byte
+		 * comparison below accepts only a real match, whatever
+		 * position the table named.
+		 */
+		if (cand >= in ||
+		    memcmp(src + cand, src + in, UFS_LZ_MIN_MATCH) != 0) {
+			++in;
+			continue;
+		}
+		size_t match_len = UFS_LZ_MIN_MATCH;
+		size_t max_len = src_size - in;
+		if (max_len > UFS_LZ_MAX_MATCH)
+			max_len = UFS_LZ_MAX_MATCH;
+		while (match_len < max_len &&
+		       src[cand + match_len] == src[in + match_len])
+			++match_len;
+		if (ufs_lz_emit_literals(src, literal_start, in, dst, &out,
+					 dst_cap) != 0)
+			return 0;
+		if (out + 3 > dst_cap)
+			return 0;
+		size_t dist = in - cand;
+		dst[out++] = (char)(0x80 | (match_len - UFS_LZ_MIN_MATCH));
+		dst[out++] = (char)(dist & 0xff);
+		dst[out++] = (char)(dist >> 8);
+		in += match_len;
+		literal_start = in;
+	}
+	if (ufs_lz_emit_literals(src, literal_start, src_size, dst, &out,
+				 dst_cap) != 0)
+		return 0;
+	return out;
 }
 
+/** Returns the decompressed size, 0 on a corrupted stream. */
+static size_t
+ufs_lz_decompress(const char *src, size_t src_size, char *dst, size_t dst_cap)
+{
+	size_t in = 0;
+	size_t out = 0;
+	while (in < src_size) {
+		unsigned char token = src[in++];
+		if ((token & 0x80) == 0) {
+			size_t run = (size_t)token + 1;
+			if (in + run > src_size || out + run > dst_cap)
+				return 0;
+			memcpy(dst + out, src + in, run);
+			in += run;
+			out += run;
+			continue;
+		}
+		size_t len = (size_t)(token & 0x7f) + UFS_LZ_MIN_MATCH;
+		if (in + 2 > src_size)
+			return 0;
+		size_t dist = (unsigned char)src[in] |
+			((size_t)(unsigned char)src[in + 1] << 8);
+		in += 2;
+		if (dist == 0 || dist > out || out + len > dst_cap)
+			return 0;
+		/* The ranges may overlap - copy byte by byte. */
+		for (size_t i = 0; i < len; ++i) {
+			dst[out] = dst[out - dist];
+			++out;
+		}
+	}
+	return out;
+}
 
-static void
-rm(struct file *file)
+/*
+ * Materialize a full block back from the compressed one in the
+ * slot. The fresh block is private to the file; the compressed one
+ * is unreferenced - a clone sharing it keeps its own compressed
+ * copy. Needs the file lock held exclusively. Returns NULL on
+ * allocation failure with the error code set.
+ */
+static struct block *
+file_block_decompress(struct file *file, int index)
 {
-    if (!file) return;
+	struct block *old = file->blocks[index];
+	assert(old != NULL && old->is_compressed);
+	struct block *fresh = block_new();
+	if (fresh == NULL) {
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return NULL;
+	}
+	size_t size = ufs_lz_decompress(old->memory, old->comp_size,
+					fresh->memory, BLOCK_SIZE);
+	assert(size == BLOCK_SIZE);
+	(void)size;
+	file->blocks[index] = fresh;
+	block_unref(old);
+	return fresh;
+}
 
-    struct file *prev_file = file->prev;
-    struct file *next_file = file->next;
+/*
+ * Whether reading [pos, pos + size) would touch a compressed block.
+ * Used by the read paths to decide if the shared file lock has to be
+ * traded for the exclusive one before the actual read.
+ */
+static int
+file_range_is_compressed(const struct file *file, size_t pos, size_t size)
+{
+	if (size == 0 || pos >= file->size || file->block_count == 0)
+		return 0;
+	size_t last_byte = pos + size - 1;
+	if (last_byte >= file->size)
+		last_byte = file->size - 1;
+	int first = pos / BLOCK_SIZE;
+	int last = last_byte / BLOCK_SIZE;
+	if (last >= file->block_count)
+		last = file->block_count - 1;
+	for (int i = first; i <= last; ++i) {
+		if (file->blocks[i] != NULL && file->blocks[i]->is_compressed)
+			return 1;
+	}
+	return 0;
+}
 
-    if (prev_file) {
-        prev_file->next = next_file;
+/*
+ * Get the block covering the given index, materializing it if the
+ * slot is a hole. The slots in between stay holes. Returns NULL on
+ * allocation failure, with the error code set.
+ */
+static struct block *
+file_block_at(struct file *file, int index)
+{
+    if (index >= file->block_capacity) {
+        int new_capacity = file->block_capacity == 0 ?
+            8 : file->block_capacity;
+        while (new_capacity <= index) {
+            new_capacity *= CAPACITY_MULTIPLIER;
+        }
+        struct block **new_table = (struct block **)realloc(file->blocks,
+            new_capacity * sizeof(struct block *));
+        if (new_table == NULL) {
+            ufs_error_code = UFS_ERR_NO_MEM;
+            return NULL;
+        }
+        file->blocks = new_table;
+        file->block_capacity = new_capacity;
     }
 
-    if (next_file) {
-        next_file->prev = prev_file;
+    while (file->block_count <= index) {
+        file->blocks[file->block_count++] = NULL;
     }
 
-    if (file_list == file) {
-        file_list = next_file;
+    if (file->blocks[index] == NULL) {
+        struct block *block = block_new();
+        if (block == NULL) {
+            ufs_error_code = UFS_ERR_NO_MEM;
+            return NULL;
+        }
+        file->blocks[index] = block;
     }
 
-    if (file->block_list) {
-        release_memory_chain(file->block_list);
-    }
+    return file->blocks[index];
+}
 
-    if (file->name) {
-        free(file->name);
+/* Drop the trailing blocks so only new_count leading ones remain. */
+static void
+file_truncate_blocks(struct file *file, int new_count)
+{
+    while (file->block_count > new_count) {
+        block_unref(file->blocks[--file->block_count]);
     }
-
-    free(file);
 }
 
-static struct file *
-find(const char *filename)
+/*
+ * Same as file_block_at(), but the returned block is guaranteed to
+ * be private to the file: a block shared with a clone is replaced
+ * with the caller's own copy first.
+ */
+static struct block *
+file_block_at_for_write(struct file *file, int index)
+{
+    struct block *block = file_block_at(file, index);
+    if (block == NULL)
+        return NULL;
+    if (block->refs == 1 && block->is_compressed) {
+        block = file_block_decompress(file, index);
+        if (block == NULL)
+            return NULL;
+    }
+    if (block->refs == 1 && !block->is_mapped) {
+        /* The content is about to change - the index entry dies. */
+        dedup_remove(block);
+        block->is_hot = 1;
+        return block;
+    }
+
+    struct block *copy = block_new();
+    if (copy == NULL) {
+        ufs_error_code = UFS_ERR_NO_MEM;
+        return NULL;
+    }
+    if (block->is_compressed) {
+        size_t size = ufs_lz_decompress(block->memory, block->comp_size,
+            copy->memory, BLOCK_SIZE);
+        assert(size == BLOCK_SIZE);
+        (void)size;
+    } else {
+        memcpy(copy->memory, block->memory, BLOCK_SIZE);
+    }
+    block_unref(block);
+    file->blocks[index] = copy;
+    return copy;
+}
+
+/*
+ * Deleted files' blocks are not freed inline - a 100 MB file is
+ * ~25k of them and dropping the lot stalls the deleting caller. The
+ * whole table moves here in O(1) instead, and every ufs call
+ * reclaims a bounded batch on its way out, so the work dissolves
+ * into the subsequent calls. Guarded by ufs_mutex like the rest of
+ * the metadata.
+ */
+struct lazy_free_table {
+    struct block **blocks;
+    int block_count;
+    struct lazy_free_table *next;
+};
+
+static struct lazy_free_table *lazy_free_list = NULL;
+/** How many deferred blocks one ufs call reclaims at most. */
+enum { LAZY_FREE_BUDGET = 256 };
+
+/* Take the file's block table for deferred reclamation. */
+#if NEED_BLOCK_DEDUP
+
+/*
+ * A write just filled the whole block at the index - look its
+ * content up and share an identical existing block instead, or
+ * publish this one for the future lookups. Needs the file lock
+ * held exclusively.
+ */
+static void
+file_block_dedup(struct file *file, int index)
+{
+    if (!dedup_enabled)
+        return;
+    struct block *block = file->blocks[index];
+    if (block->refs != 1 || block->is_mapped || block->is_compressed)
+        return;
+    uint32_t hash = dedup_hash(block->memory);
+    pthread_mutex_lock(&dedup_mutex);
+    struct block *dup = dedup_index[hash % DEDUP_BUCKET_COUNT];
+    while (dup != NULL &&
+           (dup->hash != hash ||
+            memcmp(dup->memory, block->memory, BLOCK_SIZE) != 0))
+        dup = dup->hash_next;
+    if (dup != NULL) {
+        ++dup->refs;
+        pthread_mutex_unlock(&dedup_mutex);
+        file->blocks[index] = dup;
+        block_unref(block);
+        return;
+    }
+    block->hash = hash;
+    block->in_index = 1;
+    block->hash_next = dedup_index[hash % DEDUP_BUCKET_COUNT];
+    dedup_index[hash % DEDUP_BUCKET_COUNT] = block;
+    pthread_mutex_unlock(&dedup_mutex);
+}
+
+#endif
+
+static void
+lazy_free_push(struct file *file)
+{
+    if (file->blocks != NULL) {
+        struct lazy_free_table *entry =
+            (struct lazy_free_table *)malloc(sizeof(*entry));
+        if (entry == NULL) {
+            /* No memory to defer with - reclaim inline. */
+            file_truncate_blocks(file, 0);
+            free(file->blocks);
+        } else {
+            entry->blocks = file->blocks;
+            entry->block_count = file->block_count;
+            entry->next = lazy_free_list;
+            lazy_free_list = entry;
+        }
+    }
+    file->blocks = NULL;
+    file->block_count = 0;
+    file->block_capacity = 0;
+    /* One small buffer - nothing worth deferring. */
+    free(file->inline_data);
+    file->inline_data = NULL;
+    file->inline_capacity = 0;
+    /* The content is gone - the file leaves the byte accounting. */
+    ufs_count_file_bytes(-(long)file->size);
+    file->size = 0;
+}
+
+/* Reclaim up to budget deferred blocks. Negative means all. */
+static void
+lazy_free_drain(int budget)
+{
+    while (lazy_free_list != NULL) {
+        struct lazy_free_table *entry = lazy_free_list;
+        while (entry->block_count > 0) {
+            if (budget-- == 0) {
+                return;
+            }
+            block_unref(entry->blocks[--entry->block_count]);
+        }
+        lazy_free_list = entry->next;
+        free(entry->blocks);
+        free(entry);
+    }
+}
+
+static struct file *
+mkfile(const char *fname)
 {
-    if (!filename || !file_list) {
+    struct file *new_entry = (struct file*)malloc(sizeof(struct file));
+    if (!new_entry) {
+        return NULL;
+    }
+    
+    memset(new_entry, 0, sizeof(struct file));
+    /* New files start small - the buffer itself is lazy. */
+    new_entry->is_inline = 1;
+
+    new_entry->name = strdup(fname);
+    if (!new_entry->name) {
+        free(new_entry);
         return NULL;
     }
 
-    struct file *current = file_list;
-    size_t name_length = strlen(filename);
+    pthread_rwlock_init(&new_entry->rwlock, NULL);
+
+    new_entry->next = file_list;
+    if (file_list) {
+        file_list->prev = new_entry;
+    }
+
+    file_list = new_entry;
+    file_hash_insert(new_entry);
+
+    return new_entry;
+}
+
+
+static void
+rm(struct file *file)
+{
+    if (!file) return;
+
+    if (!file->is_removed) {
+        file_hash_remove(file);
+    }
+
+    struct file *prev_file = file->prev;
+    struct file *next_file = file->next;
+
+    if (prev_file) {
+        prev_file->next = next_file;
+    }
+
+    if (next_file) {
+        next_file->prev = prev_file;
+    }
+
+    if (file_list == file) {
+        file_list = next_file;
+    }
+
+    lazy_free_push(file);
+    pthread_rwlock_destroy(&file->rwlock);
+
+    if (file->name) {
+        free(file->name);
+    }
+
+    free(file);
+}
+
+static struct file *
+find(const char *filename)
+{
+    if (!filename) {
+        return NULL;
+    }
 
-    while (current) {
-        if (current->is_removed == 0 &&
-            current->name &&
-            strncmp(current->name, filename, name_length) == 0 &&
-            current->name[name_length] == '\0') {
+    struct rhash_iterator it;
+    struct rhash_entry *entry;
+    rhash_foreach_same(entry, &file_names, rhash_hash_str(filename), &it) {
+        struct file *current = rhash_entry(entry, struct file, in_names);
+        assert(current->is_removed == 0);
+        if (strcmp(current->name, filename) == 0) {
             return current;
         }
-        current = current->next;
     }
 
     return NULL;
@@ -275,8 +1208,7 @@ create_descriptor(struct file *file, enum open_flags flags)
 
 	fd->file = file;
 	fd->flags = flags;
-	fd->curr_data_segment = 0;
-	fd->byte_pos = 0;
+	fd->pos = 0;
 
 	ufs_error_code = UFS_ERR_NO_ERR;
 	return fd;
@@ -320,7 +1252,7 @@ is_readable(struct filedesc *descriptor)
         return 0;
     }
 
-    int access_mode = descriptor->flags;
+    int access_mode = descriptor->flags & ~UFS_APPEND;
 
     switch (access_mode) {
         case 0:
@@ -340,7 +1272,7 @@ is_writable(struct filedesc *desc)
         return 0;
     }
 
-    int mode = desc->flags;
+    int mode = desc->flags & ~UFS_APPEND;
 
     if (mode == 0) {
         return 1;
@@ -356,8 +1288,314 @@ is_writable(struct filedesc *desc)
     }
 }
 
-int
-ufs_open(const char *filename, int flags)
+/*
+ * Grow the inline buffer so it covers at least end bytes. Fresh
+ * capacity is zeroed, so bytes past the current size always read as
+ * zeros. Returns 0, or -1 with the error code set.
+ */
+static int
+file_inline_reserve(struct file *file, size_t end)
+{
+	if (end <= file->inline_capacity)
+		return 0;
+	size_t new_capacity = file->inline_capacity == 0 ?
+		BLOCK_SIZE : file->inline_capacity;
+	while (new_capacity < end)
+		new_capacity *= CAPACITY_MULTIPLIER;
+	if (new_capacity > INLINE_FILE_LIMIT)
+		new_capacity = INLINE_FILE_LIMIT;
+	char *new_data = (char *)realloc(file->inline_data, new_capacity);
+	if (new_data == NULL) {
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	memset(new_data + file->inline_capacity, 0,
+		new_capacity - file->inline_capacity);
+	file->inline_data = new_data;
+	file->inline_capacity = new_capacity;
+	return 0;
+}
+
+/*
+ * Move an inline file onto the block table. A one-way door: the file
+ * has outgrown INLINE_FILE_LIMIT and will not come back even if
+ * truncated. Returns 0, or -1 with the error code set and the file
+ * left inline and intact.
+ */
+static int
+file_inline_to_blocks(struct file *file)
+{
+	size_t copied = 0;
+	while (copied < file->size) {
+		struct block *block = file_block_at(file, copied / BLOCK_SIZE);
+		if (block == NULL) {
+			file_truncate_blocks(file, 0);
+			return -1;
+		}
+		size_t chunk = file->size - copied;
+		if (chunk > BLOCK_SIZE)
+			chunk = BLOCK_SIZE;
+		memcpy(block->memory, file->inline_data + copied, chunk);
+		copied += chunk;
+	}
+	file->is_inline = 0;
+	free(file->inline_data);
+	file->inline_data = NULL;
+	file->inline_capacity = 0;
+	return 0;
+}
+
+/* The inline-layout fast path of file_write_at(). */
+static ssize_t
+file_write_inline(struct file *file, size_t *pos, const char *buf,
+		  size_t size)
+{
+	if (file_inline_reserve(file, *pos + size) != 0)
+		return -1;
+	memcpy(file->inline_data + *pos, buf, size);
+	*pos += size;
+	if (*pos > file->size) {
+		ufs_count_file_bytes(*pos - file->size);
+		file->size = *pos;
+	}
+	return size;
+}
+
+/*
+ * Copy the buffer into the file at *pos, advancing the position and
+ * extending the file when the write goes past its end. Returns how
+ * many bytes were written; on allocation failure the error code is
+ * set and the already-written prefix is reported.
+ */
+static ssize_t
+file_write_at(struct file *file, size_t *pos, const char *buf, size_t size)
+{
+	if (*pos + size > MAX_FILE_SIZE) {
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+
+	if (file->is_inline) {
+		if (*pos + size <= INLINE_FILE_LIMIT)
+			return file_write_inline(file, pos, buf, size);
+		if (file_inline_to_blocks(file) != 0)
+			return -1;
+	}
+
+	ssize_t total_written = 0;
+	while ((size_t) total_written < size) {
+		struct block *block = file_block_at_for_write(file,
+			*pos / BLOCK_SIZE);
+		if (block == NULL) {
+			/*
+			 * Nothing was written - surface the allocation
+			 * error. A partial write reports its byte count
+			 * instead, like a short write() would.
+			 */
+			if (total_written == 0)
+				return -1;
+			break;
+		}
+
+		size_t offset = *pos % BLOCK_SIZE;
+		size_t chunk = BLOCK_SIZE - offset;
+		if (size - total_written < chunk)
+			chunk = size - total_written;
+
+		memcpy(block->memory + offset, buf + total_written, chunk);
+#if NEED_BLOCK_DEDUP
+		if (offset == 0 && chunk == BLOCK_SIZE)
+			file_block_dedup(file, *pos / BLOCK_SIZE);
+#endif
+
+		*pos += chunk;
+		total_written += chunk;
+	}
+
+	if (*pos > file->size) {
+		ufs_count_file_bytes(*pos - file->size);
+		file->size = *pos;
+	}
+	return total_written;
+}
+
+/*
+ * Copy file data from *pos into the buffer, advancing the position.
+ * Returns how many bytes were read; stops at the end of the file.
+ */
+static ssize_t
+file_read_at(struct file *file, size_t *pos, char *buf, size_t size)
+{
+	if (file->is_inline) {
+		if (*pos >= file->size)
+			return 0;
+		size_t chunk = file->size - *pos;
+		if (chunk > size)
+			chunk = size;
+		memcpy(buf, file->inline_data + *pos, chunk);
+		*pos += chunk;
+		return chunk;
+	}
+
+	ssize_t total_read = 0;
+	while ((size_t) total_read < size && *pos < file->size) {
+		size_t offset = *pos % BLOCK_SIZE;
+		size_t chunk = BLOCK_SIZE - offset;
+		if (size - total_read < chunk)
+			chunk = size - total_read;
+		if (file->size - *pos < chunk)
+			chunk = file->size - *pos;
+
+		int index = *pos / BLOCK_SIZE;
+		struct block *block = index < file->block_count ?
+			file->blocks[index] : NULL;
+		if (block != NULL && block->is_compressed) {
+			block = file_block_decompress(file, index);
+			if (block == NULL)
+				break;
+		}
+		if (block != NULL) {
+			block->is_hot = 1;
+			memcpy(buf + total_read, block->memory + offset, chunk);
+		} else {
+			memset(buf + total_read, 0, chunk);
+		}
+
+		*pos += chunk;
+		total_read += chunk;
+	}
+	return total_read;
+}
+
+#if NEED_EVICTION
+
+/*
+ * Flatten one file's content and hand it to the spill callback,
+ * then release the memory. The name stays, so the file is still
+ * found, listed and deleted like any other. Needs ufs_mutex; the
+ * file must have no descriptors and no borrows.
+ */
+static int
+file_evict(struct file *file)
+{
+    size_t size = file->size;
+    char *data = (char *)malloc(size);
+    if (data == NULL)
+        return -1;
+    pthread_rwlock_wrlock(&file->rwlock);
+    size_t pos = 0;
+    ssize_t flat = file_read_at(file, &pos, data, size);
+    if (flat < 0 || (size_t)flat != size ||
+        ufs_evict_config.spill(file->name, data, size,
+                               ufs_evict_config.arg) != 0) {
+        pthread_rwlock_unlock(&file->rwlock);
+        free(data);
+        return -1;
+    }
+    free(data);
+    lazy_free_push(file);
+    file->is_inline = 1;
+    file->is_evicted = 1;
+    file->evicted_size = size;
+    pthread_rwlock_unlock(&file->rwlock);
+    return 0;
+}
+
+/*
+ * Spill the least recently used closed files until the resident
+ * bytes fit the budget again. The victim scan is linear in the file
+ * count - eviction is a slow-path memory emergency, the common
+ * calls pay only a load and a compare. Needs ufs_mutex held.
+ */
+static void
+ufs_evict_locked(void)
+{
+    if (ufs_evict_config.spill == NULL)
+        return;
+    while (__atomic_load_n(&ufs_file_bytes, __ATOMIC_RELAXED) >
+           ufs_evict_config.budget_bytes) {
+        struct file *victim = NULL;
+        for (struct file *f = file_list; f != NULL; f = f->next) {
+            if (f->refs != 0 || f->is_removed || f->is_evicted ||
+                f->size == 0)
+                continue;
+            if (victim == NULL || f->lru_stamp < victim->lru_stamp)
+                victim = f;
+        }
+        /* Nothing evictable, or the spill refused - stop. */
+        if (victim == NULL || file_evict(victim) != 0)
+            break;
+    }
+}
+
+/* The cheap overrun check at the end of the write paths. */
+static void
+ufs_evict_check(void)
+{
+    if (__atomic_load_n(&ufs_evict_config.spill, __ATOMIC_RELAXED) == NULL)
+        return;
+    if (__atomic_load_n(&ufs_file_bytes, __ATOMIC_RELAXED) <=
+        __atomic_load_n(&ufs_evict_config.budget_bytes, __ATOMIC_RELAXED))
+        return;
+    pthread_mutex_lock(&ufs_mutex);
+    ufs_evict_locked();
+    pthread_mutex_unlock(&ufs_mutex);
+}
+
+/*
+ * Fetch a spilled file's content back in through the callback.
+ * Needs ufs_mutex; runs before a descriptor is handed out, so
+ * nobody sees the file half-restored. The caller is responsible for
+ * running the eviction sweep afterwards - the re-admitted bytes may
+ * have to push other cold files out.
+ */
+static int
+file_fault_in(struct file *file)
+{
+    if (ufs_evict_config.fetch == NULL) {
+        ufs_error_code = UFS_ERR_NO_FILE;
+        return -1;
+    }
+    size_t size = file->evicted_size;
+    char *data = (char *)malloc(size);
+    if (data == NULL) {
+        ufs_error_code = UFS_ERR_NO_MEM;
+        return -1;
+    }
+    if (ufs_evict_config.fetch(file->name, data, size,
+                               ufs_evict_config.arg) != (ssize_t)size) {
+        free(data);
+        ufs_error_code = UFS_ERR_NO_FILE;
+        return -1;
+    }
+    pthread_rwlock_wrlock(&file->rwlock);
+    size_t pos = 0;
+    ssize_t written = file_write_at(file, &pos, data, size);
+    free(data);
+    if (written < 0 || (size_t)written != size) {
+        /* Half-restored is no good - drop it back to spilled. */
+        lazy_free_push(file);
+        file->is_inline = 1;
+        pthread_rwlock_unlock(&file->rwlock);
+        ufs_error_code = UFS_ERR_NO_MEM;
+        return -1;
+    }
+    file->is_evicted = 0;
+    file->evicted_size = 0;
+    pthread_rwlock_unlock(&file->rwlock);
+    return 0;
+}
+
+#else
+
+static void ufs_evict_locked(void) {}
+static void ufs_evict_check(void) {}
+static int file_fault_in(struct file *file) { (void)file; return 0; }
+
+#endif
+
+static int
+ufs_open_locked(const char *filename, int flags)
 {
     if (!file_descriptors) {
         if ((ufs_error_code = fd_setup()) != UFS_ERR_NO_ERR) {
@@ -380,6 +1618,11 @@ ufs_open(const char *filename, int flags)
         }
     }
 
+    file_touch(target_file);
+    if (target_file->is_evicted && file_fault_in(target_file) != 0) {
+        return -1;
+    }
+
     int free_fd = smallest_fd();
     for (int i = 0; i < file_descriptor_capacity; ++i) {
         if (!file_descriptors[i]) {
@@ -408,131 +1651,364 @@ ufs_open(const char *filename, int flags)
         ++file_descriptor_count;
     }
 
+    /*
+     * A fault-in may have pushed the usage over the budget. The
+     * target is pinned by its fresh descriptor, so the sweep can't
+     * take back what was just brought in.
+     */
+    ufs_evict_locked();
+
     ufs_error_code = UFS_ERR_NO_ERR;
     return free_fd;
 }
 
+int
+ufs_open(const char *filename, int flags)
+{
+    pthread_mutex_lock(&ufs_mutex);
+    int rc = ufs_open_locked(filename, flags);
+    lazy_free_drain(LAZY_FREE_BUDGET);
+    pthread_mutex_unlock(&ufs_mutex);
+    return rc;
+}
+
 ssize_t
 ufs_write(int fd, const char *buf, size_t size)
 {
+	pthread_mutex_lock(&ufs_mutex);
+	lazy_free_drain(LAZY_FREE_BUDGET);
 	struct filedesc *descriptor = locate_descriptor(fd);
 	if (!descriptor) {
+		pthread_mutex_unlock(&ufs_mutex);
 		ufs_error_code = UFS_ERR_NO_FILE;
 		return -1;
 	}
 
 	if (!is_writable(descriptor)) {
+		pthread_mutex_unlock(&ufs_mutex);
 		ufs_error_code = UFS_ERR_NO_PERMISSION;
 		return -1;
 	}
 
 	struct file *file = descriptor->file;
-	struct block *current_block = file->block_list;
-	int segment_index = 0;
-	while (segment_index < descriptor->curr_data_segment) {
-		current_block = current_block->next;
-		++segment_index;
+	file_touch(file);
+	pthread_mutex_unlock(&ufs_mutex);
+
+	pthread_rwlock_wrlock(&file->rwlock);
+	if (descriptor->flags & UFS_APPEND) {
+		/*
+		 * The tail is resolved under the same exclusive lock as
+		 * the write itself - concurrent appenders interleave
+		 * whole records, never clobbering each other.
+		 */
+		descriptor->pos = file->size;
 	}
+	size_t old_size = file->size;
+	ssize_t total_written = file_write_at(file, &descriptor->pos,
+		buf, size);
+	int resized = file->size != old_size;
+	pthread_rwlock_unlock(&file->rwlock);
+	ufs_evict_check();
+	if (total_written > 0)
+		ufs_notify_write(file, resized);
+	if (total_written >= 0)
+		ufs_error_code = UFS_ERR_NO_ERR;
+	return total_written;
+}
 
-	size_t total_size = current_block->occupied + descriptor->curr_data_segment * BLOCK_SIZE;
-	if (total_size + size > MAX_FILE_SIZE) {
-		ufs_error_code = UFS_ERR_NO_MEM;
+ssize_t
+ufs_read(int fd, char *buf, size_t size)
+{
+	pthread_mutex_lock(&ufs_mutex);
+	lazy_free_drain(LAZY_FREE_BUDGET);
+	struct filedesc *descriptor = locate_descriptor(fd);
+	if (!descriptor) {
+		pthread_mutex_unlock(&ufs_mutex);
+		ufs_error_code = UFS_ERR_NO_FILE;
 		return -1;
 	}
 
-	ssize_t total_written = 0;
-	while ((size_t) total_written < size) {
-		if (descriptor->byte_pos == BLOCK_SIZE) {
-			current_block = current_block->next;
-			if (!current_block) {
-				ufs_error_code = expand_storage_unit(file);
-				if (ufs_error_code != UFS_ERR_NO_ERR) {
-					return total_written;
-				}
-
-				current_block = file->last_block;
-			}
-
-			descriptor->byte_pos = 0;
-			++descriptor->curr_data_segment;
-		}
+	if (!is_readable(descriptor)) {
+		pthread_mutex_unlock(&ufs_mutex);
+		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		return -1;
+	}
 
-		size_t remaining_space = BLOCK_SIZE - descriptor->byte_pos;
-		if (size - total_written < remaining_space) {
-			remaining_space = size - total_written;
-		}
+	struct file *file = descriptor->file;
+	file_touch(file);
+	pthread_mutex_unlock(&ufs_mutex);
+
+	pthread_rwlock_rdlock(&file->rwlock);
+	if (file_range_is_compressed(file, descriptor->pos, size)) {
+		/*
+		 * Decompression swaps blocks in the table - trade the
+		 * shared lock for the exclusive one. The re-check under
+		 * it is implicit: file_read_at handles both states.
+		 */
+		pthread_rwlock_unlock(&file->rwlock);
+		pthread_rwlock_wrlock(&file->rwlock);
+	}
+	ssize_t total_read = file_read_at(file, &descriptor->pos, buf, size);
+	pthread_rwlock_unlock(&file->rwlock);
+	ufs_error_code = UFS_ERR_NO_ERR;
+	return total_read;
+}
 
-		memcpy(current_block->memory + descriptor->byte_pos, buf + total_written, remaining_space);
+#if NEED_POSITIONAL_IO
 
-		descriptor->byte_pos += remaining_space;
-		total_written += remaining_space;
+ssize_t
+ufs_pwrite(int fd, const char *buf, size_t size, size_t pos)
+{
+	pthread_mutex_lock(&ufs_mutex);
+	lazy_free_drain(LAZY_FREE_BUDGET);
+	struct filedesc *descriptor = locate_descriptor(fd);
+	if (!descriptor) {
+		pthread_mutex_unlock(&ufs_mutex);
+		ufs_error_code = UFS_ERR_NO_FILE;
+		return -1;
+	}
 
-		if (descriptor->byte_pos > current_block->occupied) {
-			current_block->occupied = descriptor->byte_pos;
-		}
+	if (!is_writable(descriptor)) {
+		pthread_mutex_unlock(&ufs_mutex);
+		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		return -1;
 	}
 
-	ufs_error_code = UFS_ERR_NO_ERR;
+	struct file *file = descriptor->file;
+	file_touch(file);
+	pthread_mutex_unlock(&ufs_mutex);
+
+	/* The caller's offset advances, the descriptor's does not. */
+	pthread_rwlock_wrlock(&file->rwlock);
+	size_t old_size = file->size;
+	ssize_t total_written = file_write_at(file, &pos, buf, size);
+	int resized = file->size != old_size;
+	pthread_rwlock_unlock(&file->rwlock);
+	ufs_evict_check();
+	if (total_written > 0)
+		ufs_notify_write(file, resized);
+	if (total_written >= 0)
+		ufs_error_code = UFS_ERR_NO_ERR;
 	return total_written;
 }
 
 ssize_t
-ufs_read(int fd, char *buf, size_t size)
+ufs_pread(int fd, char *buf, size_t size, size_t pos)
 {
+	pthread_mutex_lock(&ufs_mutex);
+	lazy_free_drain(LAZY_FREE_BUDGET);
 	struct filedesc *descriptor = locate_descriptor(fd);
 	if (!descriptor) {
+		pthread_mutex_unlock(&ufs_mutex);
 		ufs_error_code = UFS_ERR_NO_FILE;
 		return -1;
 	}
 
 	if (!is_readable(descriptor)) {
+		pthread_mutex_unlock(&ufs_mutex);
 		ufs_error_code = UFS_ERR_NO_PERMISSION;
 		return -1;
 	}
 
-	struct block *block = descriptor->file->block_list;
-	int block_iter = 0;
-
-	while (block_iter < descriptor->curr_data_segment) {
-		block = block->next;
-		++block_iter;
+	struct file *file = descriptor->file;
+	file_touch(file);
+	pthread_mutex_unlock(&ufs_mutex);
+
+	pthread_rwlock_rdlock(&file->rwlock);
+	if (file_range_is_compressed(file, pos, size)) {
+		/* Same upgrade dance as in ufs_read(). */
+		pthread_rwlock_unlock(&file->rwlock);
+		pthread_rwlock_wrlock(&file->rwlock);
 	}
+	ssize_t total_read = file_read_at(file, &pos, buf, size);
+	pthread_rwlock_unlock(&file->rwlock);
+	ufs_error_code = UFS_ERR_NO_ERR;
+	return total_read;
+}
 
-	ssize_t read_block = 0;
-	while ((size_t) read_block < size) {
-		if (descriptor->byte_pos == BLOCK_SIZE) {
-			block = block->next;
-			if (!block) {
-				ufs_error_code = UFS_ERR_NO_ERR;
-				return read_block;
-			}
-
-			descriptor->byte_pos = 0;
-			++descriptor->curr_data_segment;
-		}
+#endif
 
-		size_t bytes = block->occupied - descriptor->byte_pos;
-		if (size - read_block < bytes) {
-			bytes = size - read_block;
-		}
+#if NEED_READ_BORROW
 
-		if (bytes == 0) {
-			ufs_error_code = UFS_ERR_NO_ERR;
-			return read_block;
-		}
+/** Shared read-only zeros - the holes are lent from here. */
+static const char ufs_zero_block[BLOCK_SIZE];
 
-		memcpy(buf + read_block, block->memory + descriptor->byte_pos, bytes);
+/*
+ * Drop the file reference a borrow holds. The same last-reference
+ * teardown as in ufs_close_locked(). Needs ufs_mutex held.
+ */
+static void
+borrow_file_unref(struct file *file)
+{
+	if (--file->refs > 0 || !file->is_removed)
+		return;
+	struct file *previous = file->prev;
+	struct file *next = file->next;
+	if (previous)
+		previous->next = next;
+	if (next)
+		next->prev = previous;
+	if (file == file_list)
+		file_list = next;
+	lazy_free_push(file);
+	pthread_rwlock_destroy(&file->rwlock);
+	free(file->name);
+	free(file);
+}
 
-		descriptor->byte_pos += bytes;
-		read_block += bytes;
+ssize_t
+ufs_read_borrow(int fd, size_t pos, size_t size, struct ufs_borrow *borrow)
+{
+	memset(borrow, 0, sizeof(*borrow));
+	pthread_mutex_lock(&ufs_mutex);
+	lazy_free_drain(LAZY_FREE_BUDGET);
+	struct filedesc *descriptor = locate_descriptor(fd);
+	if (!descriptor) {
+		pthread_mutex_unlock(&ufs_mutex);
+		ufs_error_code = UFS_ERR_NO_FILE;
+		return -1;
+	}
+	if (!is_readable(descriptor)) {
+		pthread_mutex_unlock(&ufs_mutex);
+		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		return -1;
 	}
+	struct file *file = descriptor->file;
+	file_touch(file);
+	/*
+	 * The borrow outlives this call - it keeps the file alive like
+	 * an opened descriptor would, even if the caller closes its own
+	 * descriptor while the bytes are in flight.
+	 */
+	++file->refs;
+	pthread_mutex_unlock(&ufs_mutex);
 
+	/*
+	 * Exclusive, not shared: the pin bumps block refcounts and may
+	 * decompress in place. A borrow happens once per served range,
+	 * the sends through it are the hot path.
+	 */
+	pthread_rwlock_wrlock(&file->rwlock);
+	if (size == 0 || pos >= file->size) {
+		pthread_rwlock_unlock(&file->rwlock);
+		pthread_mutex_lock(&ufs_mutex);
+		borrow_file_unref(file);
+		pthread_mutex_unlock(&ufs_mutex);
+		ufs_error_code = UFS_ERR_NO_ERR;
+		return 0;
+	}
+	if (size > file->size - pos)
+		size = file->size - pos;
+
+	struct ufs_iovec *iov;
+	if (file->is_inline) {
+		/*
+		 * The inline buffer moves under a writer's realloc - a
+		 * small file is lent from a private copy instead. One
+		 * bounded memcpy; the zero-copy win is for the big
+		 * block files.
+		 */
+		borrow->copy = (char *)malloc(size);
+		iov = (struct ufs_iovec *)malloc(sizeof(*iov));
+		borrow->iov = iov;
+		if (borrow->copy == NULL || iov == NULL)
+			goto fail_no_mem;
+		memcpy(borrow->copy, file->inline_data + pos, size);
+		iov[0].base = borrow->copy;
+		iov[0].size = size;
+		borrow->iov_count = 1;
+	} else {
+		int first = pos / BLOCK_SIZE;
+		int last = (pos + size - 1) / BLOCK_SIZE;
+		int count = last - first + 1;
+		iov = (struct ufs_iovec *)malloc(count * sizeof(*iov));
+		borrow->iov = iov;
+		borrow->blocks = (void **)malloc(count * sizeof(void *));
+		if (iov == NULL || borrow->blocks == NULL)
+			goto fail_no_mem;
+		size_t left = size;
+		for (int i = first; i <= last; ++i) {
+			struct block *block = i < file->block_count ?
+				file->blocks[i] : NULL;
+			if (block != NULL && block->is_compressed) {
+				block = file_block_decompress(file, i);
+				if (block == NULL)
+					goto fail_no_mem;
+			}
+			char *base;
+			if (block != NULL) {
+				/*
+				 * The pin is the clone-sharing refcount:
+				 * a write into the block materializes a
+				 * private copy and leaves the borrowed
+				 * one untouched.
+				 */
+				++block->refs;
+				block->is_hot = 1;
+				borrow->blocks[borrow->block_count++] = block;
+				base = block->memory;
+			} else {
+				/* A hole - lend the common zeros. */
+				base = (char *)ufs_zero_block;
+			}
+			size_t offset = i == first ? pos % BLOCK_SIZE : 0;
+			size_t chunk = BLOCK_SIZE - offset;
+			if (chunk > left)
+				chunk = left;
+			iov[borrow->iov_count].base = base + offset;
+			iov[borrow->iov_count].size = chunk;
+			++borrow->iov_count;
+			left -= chunk;
+		}
+	}
+	pthread_rwlock_unlock(&file->rwlock);
+	borrow->file = file;
 	ufs_error_code = UFS_ERR_NO_ERR;
-	return read_block;
+	return size;
+
+fail_no_mem:
+	for (int i = 0; i < borrow->block_count; ++i)
+		block_unref((struct block *)borrow->blocks[i]);
+	pthread_rwlock_unlock(&file->rwlock);
+	pthread_mutex_lock(&ufs_mutex);
+	borrow_file_unref(file);
+	pthread_mutex_unlock(&ufs_mutex);
+	free((void *)borrow->iov);
+	free(borrow->blocks);
+	free(borrow->copy);
+	memset(borrow, 0, sizeof(*borrow));
+	ufs_error_code = UFS_ERR_NO_MEM;
+	return -1;
 }
 
-int
-ufs_close(int fd)
+void
+ufs_read_release(struct ufs_borrow *borrow)
+{
+	struct file *file = (struct file *)borrow->file;
+	if (file != NULL) {
+		if (borrow->block_count > 0) {
+			/* The refcounts change under the file lock. */
+			pthread_rwlock_wrlock(&file->rwlock);
+			for (int i = 0; i < borrow->block_count; ++i)
+				block_unref((struct block *)borrow->blocks[i]);
+			pthread_rwlock_unlock(&file->rwlock);
+		}
+		pthread_mutex_lock(&ufs_mutex);
+		borrow_file_unref(file);
+		lazy_free_drain(LAZY_FREE_BUDGET);
+		pthread_mutex_unlock(&ufs_mutex);
+	}
+	free((void *)borrow->iov);
+	free(borrow->blocks);
+	free(borrow->copy);
+	memset(borrow, 0, sizeof(*borrow));
+	ufs_error_code = UFS_ERR_NO_ERR;
+}
+
+#endif
+
+static int
+ufs_close_locked(int fd)
 {
     if (fd < 0 || fd >= file_descriptor_count || file_descriptors[fd] == NULL) {
         ufs_error_code = UFS_ERR_NO_FILE;
@@ -541,6 +2017,7 @@ ufs_close(int fd)
 
     struct filedesc *desc = file_descriptors[fd];
     struct file *file = desc->file;
+    ufs_sub_close(desc);
 
     if (--file->refs == 0 && file->is_removed) {
         struct file *previous = file->prev;
@@ -556,15 +2033,8 @@ ufs_close(int fd)
             file_list = next;
         }
 
-        if (file->block_list) {
-            struct block *current_block = file->block_list;
-            while (current_block != NULL) {
-                struct block *next_block = current_block->next;
-                free(current_block->memory);
-                free(current_block);
-                current_block = next_block;
-            }
-        }
+        lazy_free_push(file);
+        pthread_rwlock_destroy(&file->rwlock);
 
         free(file->name);
         free(file);
@@ -585,9 +2055,19 @@ ufs_close(int fd)
     return 0;
 }
 
-
 int
-ufs_delete(const char *filename)
+ufs_close(int fd)
+{
+    pthread_mutex_lock(&ufs_mutex);
+    int rc = ufs_close_locked(fd);
+    lazy_free_drain(LAZY_FREE_BUDGET);
+    pthread_mutex_unlock(&ufs_mutex);
+    return rc;
+}
+
+
+static int
+ufs_delete_locked(const char *filename)
 {
 	struct file *file_to_delete = find(filename);
 	if (!file_to_delete) {
@@ -596,20 +2076,551 @@ ufs_delete(const char *filename)
 	}
 
 	if (file_to_delete->refs == 0) {
+		/* No descriptors - nobody could be subscribed. */
 		rm(file_to_delete);
 	}
 	else {
+		file_hash_remove(file_to_delete);
 		file_to_delete->is_removed = 1;
+		ufs_notify_delete(file_to_delete);
 	}
 
 	ufs_error_code = UFS_ERR_NO_ERR;
 	return 0;
 }
 
-#if NEED_RESIZE
+int
+ufs_delete(const char *filename)
+{
+	pthread_mutex_lock(&ufs_mutex);
+	int rc = ufs_delete_locked(filename);
+	lazy_free_drain(LAZY_FREE_BUDGET);
+	pthread_mutex_unlock(&ufs_mutex);
+	return rc;
+}
+
+#if NEED_VECTORED_IO
+
+ssize_t
+ufs_writev(int fd, const struct ufs_iovec *iov, int iov_count)
+{
+	pthread_mutex_lock(&ufs_mutex);
+	lazy_free_drain(LAZY_FREE_BUDGET);
+	struct filedesc *descriptor = locate_descriptor(fd);
+	if (!descriptor) {
+		pthread_mutex_unlock(&ufs_mutex);
+		ufs_error_code = UFS_ERR_NO_FILE;
+		return -1;
+	}
+
+	if (!is_writable(descriptor)) {
+		pthread_mutex_unlock(&ufs_mutex);
+		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		return -1;
+	}
+
+	struct file *file = descriptor->file;
+	file_touch(file);
+	pthread_mutex_unlock(&ufs_mutex);
+	pthread_rwlock_wrlock(&file->rwlock);
+	if (descriptor->flags & UFS_APPEND) {
+		/* Same append contract as in ufs_write(). */
+		descriptor->pos = file->size;
+	}
+
+	size_t total_size = 0;
+	for (int i = 0; i < iov_count; ++i)
+		total_size += iov[i].size;
+	if (descriptor->pos + total_size > MAX_FILE_SIZE) {
+		pthread_rwlock_unlock(&file->rwlock);
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+
+	ssize_t total_written = 0;
+	size_t old_size = file->size;
+	for (int i = 0; i < iov_count; ++i) {
+		ssize_t written = file_write_at(file, &descriptor->pos,
+			iov[i].base, iov[i].size);
+		if (written < 0) {
+			int resized = file->size != old_size;
+			pthread_rwlock_unlock(&file->rwlock);
+			if (total_written > 0)
+				ufs_notify_write(file, resized);
+			return total_written > 0 ? total_written : -1;
+		}
+		total_written += written;
+		if ((size_t) written < iov[i].size)
+			break;
+	}
+
+	int resized = file->size != old_size;
+	pthread_rwlock_unlock(&file->rwlock);
+	ufs_evict_check();
+	if (total_written > 0)
+		ufs_notify_write(file, resized);
+	ufs_error_code = UFS_ERR_NO_ERR;
+	return total_written;
+}
+
+ssize_t
+ufs_readv(int fd, const struct ufs_iovec *iov, int iov_count)
+{
+	pthread_mutex_lock(&ufs_mutex);
+	lazy_free_drain(LAZY_FREE_BUDGET);
+	struct filedesc *descriptor = locate_descriptor(fd);
+	if (!descriptor) {
+		pthread_mutex_unlock(&ufs_mutex);
+		ufs_error_code = UFS_ERR_NO_FILE;
+		return -1;
+	}
+
+	if (!is_readable(descriptor)) {
+		pthread_mutex_unlock(&ufs_mutex);
+		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		return -1;
+	}
+
+	struct file *file = descriptor->file;
+	file_touch(file);
+	pthread_mutex_unlock(&ufs_mutex);
+
+	size_t total_size = 0;
+	for (int i = 0; i < iov_count; ++i)
+		total_size += iov[i].size;
+
+	pthread_rwlock_rdlock(&file->rwlock);
+	if (file_range_is_compressed(file, descriptor->pos, total_size)) {
+		pthread_rwlock_unlock(&file->rwlock);
+		pthread_rwlock_wrlock(&file->rwlock);
+	}
+	ssize_t total_read = 0;
+	for (int i = 0; i < iov_count; ++i) {
+		ssize_t done = file_read_at(file, &descriptor->pos,
+			iov[i].base, iov[i].size);
+		total_read += done;
+		if ((size_t) done < iov[i].size)
+			break;
+	}
+	pthread_rwlock_unlock(&file->rwlock);
+
+	ufs_error_code = UFS_ERR_NO_ERR;
+	return total_read;
+}
+
+#endif
+
+#if NEED_FILE_CLONE
+
+static int
+ufs_clone_locked(const char *src, const char *dst)
+{
+    struct file *src_file = find(src);
+    if (src_file == NULL) {
+        ufs_error_code = UFS_ERR_NO_FILE;
+        return -1;
+    }
+
+    file_touch(src_file);
+    if (src_file->is_evicted && file_fault_in(src_file) != 0) {
+        return -1;
+    }
+
+    /*
+     * Locate the file to displace before the clone is prepended to
+     * the list, or find() would return the clone itself.
+     */
+    struct file *old_dst = find(dst);
+
+    struct file *dst_file = mkfile(dst);
+    if (dst_file == NULL) {
+        ufs_error_code = UFS_ERR_NO_MEM;
+        return -1;
+    }
+
+    /* Block refcounts change under the source's exclusive lock. */
+    pthread_rwlock_wrlock(&src_file->rwlock);
+    dst_file->is_inline = src_file->is_inline;
+    if (src_file->is_inline) {
+        /* Nothing to share - small content is simply copied. */
+        if (src_file->size > 0) {
+            if (file_inline_reserve(dst_file, src_file->size) != 0) {
+                pthread_rwlock_unlock(&src_file->rwlock);
+                rm(dst_file);
+                ufs_error_code = UFS_ERR_NO_MEM;
+                return -1;
+            }
+            memcpy(dst_file->inline_data, src_file->inline_data,
+                src_file->size);
+        }
+    } else if (src_file->block_count > 0) {
+        dst_file->blocks = (struct block **)malloc(
+            src_file->block_count * sizeof(struct block *));
+        if (dst_file->blocks == NULL) {
+            pthread_rwlock_unlock(&src_file->rwlock);
+            rm(dst_file);
+            ufs_error_code = UFS_ERR_NO_MEM;
+            return -1;
+        }
+        dst_file->block_capacity = src_file->block_count;
+        dst_file->block_count = src_file->block_count;
+        for (int i = 0; i < src_file->block_count; ++i) {
+            struct block *block = src_file->blocks[i];
+            if (block != NULL) {
+                ++block->refs;
+            }
+            dst_file->blocks[i] = block;
+        }
+    }
+    dst_file->size = src_file->size;
+    ufs_count_file_bytes(dst_file->size);
+    pthread_rwlock_unlock(&src_file->rwlock);
+
+    /*
+     * The displaced file is dropped like ufs_delete() would drop
+     * it - the opened descriptors keep seeing the old content.
+     */
+    if (old_dst != NULL) {
+        if (old_dst->refs == 0) {
+            rm(old_dst);
+        } else {
+            file_hash_remove(old_dst);
+            old_dst->is_removed = 1;
+            ufs_notify_delete(old_dst);
+        }
+    }
+
+    ufs_error_code = UFS_ERR_NO_ERR;
+    return 0;
+}
 
 int
-ufs_resize(int fd, size_t new_size)
+ufs_clone(const char *src, const char *dst)
+{
+    pthread_mutex_lock(&ufs_mutex);
+    int rc = ufs_clone_locked(src, dst);
+    pthread_mutex_unlock(&ufs_mutex);
+    return rc;
+}
+
+#endif
+
+#if NEED_SNAPSHOT
+
+/**
+ * Snapshot image layout: this header, then the block data starting
+ * at the next page boundary (so the mmap-ed payloads are
+ * page-aligned), then the index at index_offset. The index holds one
+ * record per file: name size including the terminating zero, the
+ * name, the file size, the slot count, and one data offset per slot,
+ * 0 meaning a hole.
+ */
+struct snapshot_header {
+    char magic[8];
+    uint64_t file_count;
+    uint64_t index_offset;
+};
+
+static const char snapshot_magic[8] = "UFSSNAP1";
+
+/** Mappings of the loaded snapshots, released in ufs_destroy(). */
+static struct {
+    char *base;
+    size_t size;
+} *snapshot_maps = NULL;
+static int snapshot_map_count = 0;
+static int snapshot_map_capacity = 0;
+
+static int
+snapshot_write_u64(FILE *image, uint64_t value)
+{
+    return fwrite(&value, sizeof(value), 1, image) == 1 ? 0 : -1;
+}
+
+static int
+ufs_snapshot_save_locked(const char *path)
+{
+    /*
+     * The image must hold the data, not references to the spill
+     * callback's owner - bring the spilled files home first. The
+     * budget may be overrun until the next write or open sweeps.
+     */
+    for (struct file *f = file_list; f != NULL; f = f->next) {
+        if (!f->is_removed && f->is_evicted && file_fault_in(f) != 0)
+            return -1;
+    }
+
+    FILE *image = fopen(path, "wb");
+    if (image == NULL) {
+        ufs_error_code = UFS_ERR_NO_FILE;
+        return -1;
+    }
+
+    /*
+     * Freeze the content: writers don't hold the metadata lock
+     * while copying, so every live file is read-locked for the
+     * whole two-pass dump.
+     */
+    for (struct file *f = file_list; f != NULL; f = f->next) {
+        if (!f->is_removed) pthread_rwlock_rdlock(&f->rwlock);
+    }
+
+    struct snapshot_header header;
+    memcpy(header.magic, snapshot_magic, sizeof(header.magic));
+    header.file_count = 0;
+    header.index_offset = 0;
+    for (struct file *f = file_list; f != NULL; f = f->next) {
+        if (!f->is_removed) ++header.file_count;
+    }
+
+    /* The data begins at the first page boundary past the header. */
+    uint64_t data_offset = (sizeof(header) + BLOCK_SIZE - 1) /
+        BLOCK_SIZE * BLOCK_SIZE;
+    if (fseek(image, data_offset, SEEK_SET) != 0) goto fail;
+    for (struct file *f = file_list; f != NULL; f = f->next) {
+        if (f->is_removed) continue;
+        if (f->is_inline) {
+            /*
+             * The image knows only the block layout - the inline
+             * buffer is dumped as full blocks, the last one padded
+             * with zeros.
+             */
+            size_t copied = 0;
+            while (copied < f->size) {
+                char temp[BLOCK_SIZE];
+                size_t chunk = f->size - copied;
+                if (chunk > BLOCK_SIZE) chunk = BLOCK_SIZE;
+                memcpy(temp, f->inline_data + copied, chunk);
+                memset(temp + chunk, 0, BLOCK_SIZE - chunk);
+                if (fwrite(temp, BLOCK_SIZE, 1, image) != 1) goto fail;
+                copied += chunk;
+            }
+            continue;
+        }
+        for (int i = 0; i < f->block_count; ++i) {
+            struct block *b = f->blocks[i];
+            if (b == NULL) continue;
+            if (b->is_compressed) {
+                char temp[BLOCK_SIZE];
+                size_t size = ufs_lz_decompress(b->memory, b->comp_size,
+                    temp, sizeof(temp));
+                assert(size == BLOCK_SIZE);
+                (void)size;
+                if (fwrite(temp, BLOCK_SIZE, 1, image) != 1) goto fail;
+            } else if (fwrite(b->memory, BLOCK_SIZE, 1, image) != 1) {
+                goto fail;
+            }
+        }
+    }
+
+    header.index_offset = ftell(image);
+    uint64_t block_offset = data_offset;
+    for (struct file *f = file_list; f != NULL; f = f->next) {
+        if (f->is_removed) continue;
+        uint64_t name_size = strlen(f->name) + 1;
+        uint64_t slot_count = f->is_inline ?
+            (f->size + BLOCK_SIZE - 1) / BLOCK_SIZE :
+            (uint64_t)f->block_count;
+        if (snapshot_write_u64(image, name_size) != 0 ||
+            fwrite(f->name, name_size, 1, image) != 1 ||
+            snapshot_write_u64(image, f->size) != 0 ||
+            snapshot_write_u64(image, slot_count) != 0)
+            goto fail;
+        for (uint64_t i = 0; i < slot_count; ++i) {
+            uint64_t offset = 0;
+            if (f->is_inline || f->blocks[i] != NULL) {
+                offset = block_offset;
+                block_offset += BLOCK_SIZE;
+            }
+            if (snapshot_write_u64(image, offset) != 0) goto fail;
+        }
+    }
+
+    if (fseek(image, 0, SEEK_SET) != 0 ||
+        fwrite(&header, sizeof(header), 1, image) != 1 ||
+        fclose(image) != 0) {
+        image = NULL;
+        goto fail;
+    }
+
+    for (struct file *f = file_list; f != NULL; f = f->next) {
+        if (!f->is_removed) pthread_rwlock_unlock(&f->rwlock);
+    }
+    ufs_error_code = UFS_ERR_NO_ERR;
+    return 0;
+
+fail:
+    for (struct file *f = file_list; f != NULL; f = f->next) {
+        if (!f->is_removed) pthread_rwlock_unlock(&f->rwlock);
+    }
+    if (image != NULL) fclose(image);
+    remove(path);
+    ufs_error_code = UFS_ERR_NO_FILE;
+    return -1;
+}
+
+int
+ufs_snapshot_save(const char *path)
+{
+    pthread_mutex_lock(&ufs_mutex);
+    int rc = ufs_snapshot_save_locked(path);
+    pthread_mutex_unlock(&ufs_mutex);
+    return rc;
+}
+
+static int
+snapshot_read(const char *image, size_t image_size, uint64_t *cursor,
+              void *out, size_t size)
+{
+    if (*cursor + size > image_size) return -1;
+    memcpy(out, image + *cursor, size);
+    *cursor += size;
+    return 0;
+}
+
+static int
+ufs_snapshot_load_locked(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        ufs_error_code = UFS_ERR_NO_FILE;
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct snapshot_header)) {
+        close(fd);
+        ufs_error_code = UFS_ERR_NO_FILE;
+        return -1;
+    }
+    size_t image_size = st.st_size;
+    char *image = mmap(NULL, image_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        ufs_error_code = UFS_ERR_NO_MEM;
+        return -1;
+    }
+
+    struct snapshot_header header;
+    memcpy(&header, image, sizeof(header));
+    if (memcmp(header.magic, snapshot_magic, sizeof(header.magic)) != 0 ||
+        header.index_offset > image_size) {
+        munmap(image, image_size);
+        ufs_error_code = UFS_ERR_NO_FILE;
+        return -1;
+    }
+
+    if (snapshot_map_count == snapshot_map_capacity) {
+        int new_capacity = snapshot_map_capacity == 0 ?
+            4 : snapshot_map_capacity * CAPACITY_MULTIPLIER;
+        void *new_maps = realloc(snapshot_maps,
+            new_capacity * sizeof(*snapshot_maps));
+        if (new_maps == NULL) {
+            munmap(image, image_size);
+            ufs_error_code = UFS_ERR_NO_MEM;
+            return -1;
+        }
+        snapshot_maps = new_maps;
+        snapshot_map_capacity = new_capacity;
+    }
+    /*
+     * Register the mapping before parsing - a half-loaded image may
+     * already have files pointing into it, so on failure it is kept
+     * until ufs_destroy() rather than unmapped here.
+     */
+    snapshot_maps[snapshot_map_count].base = image;
+    snapshot_maps[snapshot_map_count].size = image_size;
+    ++snapshot_map_count;
+
+    uint64_t cursor = header.index_offset;
+    for (uint64_t i = 0; i < header.file_count; ++i) {
+        uint64_t name_size, size, slot_count;
+        if (snapshot_read(image, image_size, &cursor, &name_size,
+                          sizeof(name_size)) != 0 ||
+            name_size == 0 || cursor + name_size > image_size)
+            goto fail_format;
+        const char *name = image + cursor;
+        if (name[name_size - 1] != 0) goto fail_format;
+        cursor += name_size;
+        if (snapshot_read(image, image_size, &cursor, &size,
+                          sizeof(size)) != 0 ||
+            snapshot_read(image, image_size, &cursor, &slot_count,
+                          sizeof(slot_count)) != 0 ||
+            size > MAX_FILE_SIZE ||
+            slot_count > (MAX_FILE_SIZE + BLOCK_SIZE - 1) / BLOCK_SIZE)
+            goto fail_format;
+
+        struct file *old = find(name);
+        struct file *file = mkfile(name);
+        if (file == NULL) goto fail_mem;
+        /* Loaded files come back in the block layout. */
+        file->is_inline = 0;
+        if (slot_count > 0) {
+            file->blocks = (struct block **)calloc(slot_count,
+                sizeof(struct block *));
+            if (file->blocks == NULL) {
+                rm(file);
+                goto fail_mem;
+            }
+            file->block_capacity = slot_count;
+        }
+        for (uint64_t b = 0; b < slot_count; ++b) {
+            uint64_t offset;
+            if (snapshot_read(image, image_size, &cursor, &offset,
+                              sizeof(offset)) != 0 ||
+                (offset != 0 && offset + BLOCK_SIZE > image_size)) {
+                rm(file);
+                goto fail_format;
+            }
+            struct block *block = NULL;
+            if (offset != 0) {
+                block = block_new_mapped(image + offset);
+                if (block == NULL) {
+                    rm(file);
+                    goto fail_mem;
+                }
+            }
+            file->blocks[file->block_count++] = block;
+        }
+        file->size = size;
+        ufs_count_file_bytes(size);
+
+        if (old != NULL) {
+            if (old->refs == 0) {
+                rm(old);
+            } else {
+                file_hash_remove(old);
+                old->is_removed = 1;
+                ufs_notify_delete(old);
+            }
+        }
+    }
+
+    ufs_error_code = UFS_ERR_NO_ERR;
+    return 0;
+
+fail_format:
+    ufs_error_code = UFS_ERR_NO_FILE;
+    return -1;
+fail_mem:
+    ufs_error_code = UFS_ERR_NO_MEM;
+    return -1;
+}
+
+int
+ufs_snapshot_load(const char *path)
+{
+    pthread_mutex_lock(&ufs_mutex);
+    int rc = ufs_snapshot_load_locked(path);
+    pthread_mutex_unlock(&ufs_mutex);
+    return rc;
+}
+
+#endif
+
+#if NEED_RESIZE
+
+static int
+ufs_resize_locked(int fd, size_t new_size)
 {
     struct filedesc *fd_entry = locate_descriptor(fd);
     if (!fd_entry) {
@@ -628,66 +2639,513 @@ ufs_resize(int fd, size_t new_size)
     }
 
     struct file *target_file = fd_entry->file;
-    struct block *current_block = target_file->block_list;
 
-    size_t current_total_size = 0;
-    int block_counter = 0;
+    if (target_file->is_inline) {
+        if (new_size > INLINE_FILE_LIMIT) {
+            if (file_inline_to_blocks(target_file) != 0)
+                return -1;
+        } else if (new_size < target_file->size) {
+            /* The cut range must read back as zeros if regrown. */
+            memset(target_file->inline_data + new_size, 0,
+                target_file->size - new_size);
+        } else if (new_size > target_file->size) {
+            if (file_inline_reserve(target_file, new_size) != 0)
+                return -1;
+        }
+    }
 
-    while (current_block != NULL) {
-        current_total_size += current_block->occupied;
+    if (new_size < target_file->size) {
+        int new_block_count = (new_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        if (new_block_count < target_file->block_count) {
+            file_truncate_blocks(target_file, new_block_count);
+        }
+        /* Zero the cut tail of the last kept block, unless a hole. */
+        size_t tail = new_size % BLOCK_SIZE;
+        if (tail != 0 && new_block_count <= target_file->block_count &&
+            target_file->blocks[new_block_count - 1] != NULL) {
+            struct block *last = file_block_at_for_write(target_file,
+                new_block_count - 1);
+            if (last == NULL) {
+                return -1;
+            }
+            memset(last->memory + tail, 0, BLOCK_SIZE - tail);
+        }
+        ufs_count_file_bytes(-(long)(target_file->size - new_size));
+        target_file->size = new_size;
 
-        if (current_total_size >= new_size) {
-            break;
+        for (int i = 0; i < file_descriptor_count; ++i) {
+            struct filedesc *fd = file_descriptors[i];
+            if (fd && fd->file == target_file && fd->pos > new_size) {
+                fd->pos = new_size;
+            }
         }
+    } else if (new_size > target_file->size) {
+        /* Growth just declares the new size - the range is a hole. */
+        ufs_count_file_bytes(new_size - target_file->size);
+        target_file->size = new_size;
+    }
+
+    ufs_error_code = UFS_ERR_NO_ERR;
+    return 0;
+}
+
+int
+ufs_resize(int fd, size_t new_size)
+{
+    /*
+     * The metadata lock is held across the whole resize - the
+     * descriptor positions of the shrunk file live in the global
+     * table. The file lock keeps the I/O paths out.
+     */
+    pthread_mutex_lock(&ufs_mutex);
+    struct filedesc *fd_entry = locate_descriptor(fd);
+    struct file *file = fd_entry != NULL ? fd_entry->file : NULL;
+    if (file != NULL)
+        pthread_rwlock_wrlock(&file->rwlock);
+    if (file != NULL)
+        file_touch(file);
+    size_t old_size = file != NULL ? file->size : 0;
+    int rc = ufs_resize_locked(fd, new_size);
+    int resized = file != NULL && file->size != old_size;
+    if (file != NULL)
+        pthread_rwlock_unlock(&file->rwlock);
+    pthread_mutex_unlock(&ufs_mutex);
+    ufs_evict_check();
+    if (rc == 0 && resized)
+        ufs_notify_resize(file);
+    return rc;
+}
+
+
+#endif
+
+#if NEED_FILE_ITERATION
+
+/*
+ * Pack the names of all the live files into the iterator: one
+ * allocation for the bytes, one for the offsets. Needs ufs_mutex
+ * held.
+ */
+static int
+iterator_snapshot(struct ufs_iterator *it)
+{
+    int count = 0;
+    size_t byte_count = 0;
+    for (struct file *f = file_list; f != NULL; f = f->next) {
+        if (f->is_removed)
+            continue;
+        ++count;
+        byte_count += strlen(f->name) + 1;
+    }
+    it->file_count = count;
+    it->pos = 0;
+    if (count == 0)
+        return 0;
+    it->names = (char *)malloc(byte_count);
+    it->offsets = (uint32_t *)malloc(count * sizeof(*it->offsets));
+    if (it->names == NULL || it->offsets == NULL) {
+        free(it->names);
+        free(it->offsets);
+        it->names = NULL;
+        it->offsets = NULL;
+        it->file_count = 0;
+        ufs_error_code = UFS_ERR_NO_MEM;
+        return -1;
+    }
+    size_t offset = 0;
+    int i = 0;
+    for (struct file *f = file_list; f != NULL; f = f->next) {
+        if (f->is_removed)
+            continue;
+        size_t len = strlen(f->name) + 1;
+        memcpy(it->names + offset, f->name, len);
+        it->offsets[i++] = offset;
+        offset += len;
+    }
+    return 0;
+}
+
+void
+ufs_iterator_close(struct ufs_iterator *it)
+{
+    free(it->names);
+    free(it->offsets);
+    memset(it, 0, sizeof(*it));
+}
 
-        current_block = current_block->next;
-        ++block_counter;
+int
+ufs_iterate(struct ufs_iterator *it, const char **batch,
+	    int batch_capacity)
+{
+    if (it->names == NULL && it->pos == 0) {
+        pthread_mutex_lock(&ufs_mutex);
+        int rc = iterator_snapshot(it);
+        pthread_mutex_unlock(&ufs_mutex);
+        if (rc != 0)
+            return -1;
     }
+    int filled = 0;
+    while (filled < batch_capacity && it->pos < it->file_count)
+        batch[filled++] = it->names + it->offsets[it->pos++];
+    if (filled == 0)
+        ufs_iterator_close(it);
+    ufs_error_code = UFS_ERR_NO_ERR;
+    return filled;
+}
 
-    if (current_total_size > new_size) {
-        release_memory_chain(current_block->next);
-        target_file->last_block = current_block;
-        current_block->occupied = new_size - block_counter * BLOCK_SIZE;
+#endif
 
-        for (int i = 0; i < file_descriptor_count; ++i) {
-            struct filedesc *fd = file_descriptors[i];
-            if (fd && fd->file == target_file && fd->curr_data_segment >= block_counter) {
-                fd->curr_data_segment = block_counter;
+#if NEED_BLOCK_DEDUP
 
-                if (fd->byte_pos > current_block->occupied) {
-                    fd->byte_pos = current_block->occupied;
-                }
-            }
+int
+ufs_set_dedup(int enabled)
+{
+    pthread_mutex_lock(&dedup_mutex);
+    if (enabled && dedup_index == NULL) {
+        dedup_index = (struct block **)calloc(DEDUP_BUCKET_COUNT,
+            sizeof(*dedup_index));
+        if (dedup_index == NULL) {
+            pthread_mutex_unlock(&dedup_mutex);
+            ufs_error_code = UFS_ERR_NO_MEM;
+            return -1;
         }
-    } else {
-        current_total_size += BLOCK_SIZE - current_block->occupied;
-        current_block->occupied = BLOCK_SIZE;
+    }
+    /*
+     * Disabling only stops the new sharing - the existing entries
+     * stay and leave the index as their blocks change or die.
+     */
+    dedup_enabled = enabled != 0;
+    pthread_mutex_unlock(&dedup_mutex);
+    ufs_error_code = UFS_ERR_NO_ERR;
+    return 0;
+}
 
-        while (current_total_size < new_size) {
-            if (expand_storage_unit(target_file) != UFS_ERR_NO_ERR) {
-                return -1;
-            }
+#endif
+
+#if NEED_MEMORY_ACCOUNTING
+
+void
+ufs_stat_global(struct ufs_stat *stat)
+{
+    pthread_mutex_lock(&ufs_mutex);
+    stat->file_count = (int)rhash_count(&file_names);
+    pthread_mutex_unlock(&ufs_mutex);
+    stat->block_count = __atomic_load_n(&ufs_block_count,
+        __ATOMIC_RELAXED);
+    stat->file_bytes = __atomic_load_n(&ufs_file_bytes,
+        __ATOMIC_RELAXED);
+}
+
+void
+ufs_set_quota(size_t bytes)
+{
+    __atomic_store_n(&ufs_quota_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+#endif
+
+#if NEED_EVICTION
+
+void
+ufs_set_eviction(const struct ufs_evict_config *config)
+{
+    static const struct ufs_evict_config off = {0, NULL, NULL, NULL};
+    if (config == NULL)
+        config = &off;
+    pthread_mutex_lock(&ufs_mutex);
+    /*
+     * The budget and the spill pointer are read lock-free by the
+     * overrun check of the write paths - store them the same way.
+     */
+    ufs_evict_config.fetch = config->fetch;
+    ufs_evict_config.arg = config->arg;
+    __atomic_store_n(&ufs_evict_config.budget_bytes,
+        config->budget_bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&ufs_evict_config.spill, config->spill,
+        __ATOMIC_RELAXED);
+    /* The new budget may already be overrun. */
+    ufs_evict_locked();
+    pthread_mutex_unlock(&ufs_mutex);
+    ufs_error_code = UFS_ERR_NO_ERR;
+}
+
+#endif
+
+#if NEED_BLOCK_COMPRESSION
+
+/*
+ * One clock round over the blocks of the file. A block touched
+ * since the previous round loses its bit and gets another chance;
+ * an untouched one is compressed. Blocks shared with a clone are
+ * skipped - the block struct is the header of its own allocation
+ * and can't be swapped under the other file. Needs the file lock
+ * held exclusively.
+ */
+static int
+file_compress_cold(struct file *file)
+{
+    int done = 0;
+    char temp[BLOCK_SIZE / 2];
+    for (int i = 0; i < file->block_count; ++i) {
+        struct block *block = file->blocks[i];
+        if (block == NULL || block->is_mapped || block->is_compressed ||
+            block->refs > 1)
+            continue;
+        if (block->is_hot) {
+            block->is_hot = 0;
+            continue;
+        }
+        /*
+         * Only a 2x+ shrink is worth the swap - the temp size is
+         * the threshold.
+         */
+        size_t comp_size = ufs_lz_compress(block->memory, BLOCK_SIZE,
+            temp, sizeof(temp));
+        if (comp_size == 0) continue;
+        struct block *small = (struct block *)malloc(sizeof(*small));
+        if (small == NULL) return done;
+        char *payload = (char *)malloc(comp_size);
+        if (payload == NULL) {
+            free(small);
+            return done;
+        }
+        memcpy(payload, temp, comp_size);
+        small->memory = payload;
+        small->refs = 1;
+        small->is_mapped = 0;
+        small->is_hot = 0;
+        small->is_compressed = 1;
+        small->comp_size = comp_size;
+        small->hash = 0;
+        small->in_index = 0;
+        small->hash_next = NULL;
+        ufs_count_blocks(1);
+        file->blocks[i] = small;
+        block_unref(block);
+        ++done;
+    }
+    return done;
+}
+
+int
+ufs_compress_cold(void)
+{
+    pthread_mutex_lock(&ufs_mutex);
+    int done = 0;
+    for (struct file *f = file_list; f != NULL; f = f->next) {
+        pthread_rwlock_wrlock(&f->rwlock);
+        done += file_compress_cold(f);
+        pthread_rwlock_unlock(&f->rwlock);
+    }
+    pthread_mutex_unlock(&ufs_mutex);
+    ufs_error_code = UFS_ERR_NO_ERR;
+    return done;
+}
+
+#endif
 
-            target_file->last_block->occupied = BLOCK_SIZE;
-            current_total_size += BLOCK_SIZE;
-            ++block_counter;
+#if NEED_COMPACTION
+
+/*
+ * Where the previous compaction slice stopped. The file is kept by
+ * name because it may be deleted between the slices - a vanished
+ * name simply restarts the pass from the list head.
+ */
+static char *compact_pos_name = NULL;
+static int compact_pos_block = 0;
+
+/*
+ * One slice over a file, resuming at *pos and examining at most
+ * *budget blocks. A block window holding nothing but zeros reads
+ * exactly like a hole, so it is punched out of the table - that is
+ * where the slack of interleaved small writes and resizes ends up.
+ * Shared and mapped blocks are fine to punch - zeros read as zeros
+ * whoever owns the window; only compressed blocks are skipped,
+ * checking them would cost a decompression and the compressor has
+ * already shrunk them severalfold. Needs the file lock held
+ * exclusively.
+ */
+static int
+file_compact(struct file *file, int *pos, int *budget)
+{
+    int done = 0;
+    /*
+     * The inline layout: the doubling growth keeps the buffer at
+     * the high-water mark after a shrink - cut it back to what the
+     * reserve would pick for the current size.
+     */
+    if (*pos == 0 && file->is_inline && file->inline_capacity > 0 &&
+        *budget != 0) {
+        if (*budget > 0)
+            --*budget;
+        size_t want = 0;
+        if (file->size > 0) {
+            want = BLOCK_SIZE;
+            while (want < file->size)
+                want *= CAPACITY_MULTIPLIER;
+            if (want > INLINE_FILE_LIMIT)
+                want = INLINE_FILE_LIMIT;
+        }
+        if (want == 0 && want < file->inline_capacity) {
+            free(file->inline_data);
+            file->inline_data = NULL;
+            file->inline_capacity = 0;
+            ++done;
+        } else if (want < file->inline_capacity) {
+            /*
+             * The tail beyond the size is zeroed, and want covers
+             * the size, so the zero-tail invariant survives the
+             * shrink.
+             */
+            char *data = (char *)realloc(file->inline_data, want);
+            if (data != NULL) {
+                file->inline_data = data;
+                file->inline_capacity = want;
+                ++done;
+            }
         }
+    }
+    while (*pos < file->block_count && *budget != 0) {
+        struct block *block = file->blocks[(*pos)++];
+        if (*budget > 0)
+            --*budget;
+        if (block == NULL || block->is_compressed)
+            continue;
+        if (memcmp(block->memory, ufs_zero_block, BLOCK_SIZE) != 0)
+            continue;
+        file->blocks[*pos - 1] = NULL;
+        block_unref(block);
+        ++done;
+    }
+    return done;
+}
 
-        target_file->last_block->occupied = new_size - block_counter * BLOCK_SIZE;
+int
+ufs_compact(int block_budget)
+{
+    pthread_mutex_lock(&ufs_mutex);
+    struct file *file = file_list;
+    int pos = 0;
+    /* Resume where the previous slice stopped. */
+    if (compact_pos_name != NULL) {
+        struct file *resumed = find(compact_pos_name);
+        if (resumed != NULL) {
+            file = resumed;
+            pos = compact_pos_block;
+        }
+        free(compact_pos_name);
+        compact_pos_name = NULL;
+        compact_pos_block = 0;
+    }
+    int done = 0;
+    while (file != NULL && block_budget != 0) {
+        pthread_rwlock_wrlock(&file->rwlock);
+        done += file_compact(file, &pos, &block_budget);
+        pthread_rwlock_unlock(&file->rwlock);
+        if (pos < file->block_count)
+            break;
+        file = file->next;
+        pos = 0;
     }
+    /*
+     * Remember the stop for the next slice. A removed file has no
+     * name to look up again - the pass then simply restarts.
+     */
+    if (file != NULL && !file->is_removed) {
+        compact_pos_name = strdup(file->name);
+        compact_pos_block = pos;
+    }
+    pthread_mutex_unlock(&ufs_mutex);
+    ufs_error_code = UFS_ERR_NO_ERR;
+    return done;
+}
 
+#endif
+
+#if NEED_NOTIFICATIONS
+
+int
+ufs_subscribe(int fd, int event_mask)
+{
+    pthread_mutex_lock(&ufs_mutex);
+    struct filedesc *descriptor = locate_descriptor(fd);
+    if (descriptor == NULL) {
+        pthread_mutex_unlock(&ufs_mutex);
+        ufs_error_code = UFS_ERR_NO_FILE;
+        return -1;
+    }
+    if (event_mask == 0) {
+        ufs_sub_close(descriptor);
+        pthread_mutex_unlock(&ufs_mutex);
+        ufs_error_code = UFS_ERR_NO_ERR;
+        return 0;
+    }
+    struct file *file = descriptor->file;
+    struct ufs_sub *sub = descriptor->sub;
+    if (sub == NULL) {
+        sub = (struct ufs_sub *)calloc(1, sizeof(*sub));
+        if (sub == NULL) {
+            pthread_mutex_unlock(&ufs_mutex);
+            ufs_error_code = UFS_ERR_NO_MEM;
+            return -1;
+        }
+        sub->fd = fd;
+        sub->file = file;
+        sub->mask = event_mask;
+        pthread_mutex_lock(&notify_mutex);
+        sub->file_next = file->subs;
+        if (file->subs != NULL)
+            file->subs->file_prev = sub;
+        file->subs = sub;
+        file->sub_mask |= event_mask;
+        pthread_mutex_unlock(&notify_mutex);
+        descriptor->sub = sub;
+    } else {
+        pthread_mutex_lock(&notify_mutex);
+        sub->mask = event_mask;
+        /* Accumulated events the new mask opts out of are gone. */
+        sub->pending &= event_mask;
+        file_sub_mask_recalc(file);
+        pthread_mutex_unlock(&notify_mutex);
+    }
+    pthread_mutex_unlock(&ufs_mutex);
     ufs_error_code = UFS_ERR_NO_ERR;
     return 0;
 }
 
+int
+ufs_poll_events(struct ufs_event *events, int capacity)
+{
+    int count = 0;
+    pthread_mutex_lock(&notify_mutex);
+    while (count < capacity && ready_first != NULL) {
+        struct ufs_sub *sub = ready_first;
+        ready_dequeue(sub);
+        /* A mask change may have drained it - nothing to report. */
+        if (sub->pending == 0)
+            continue;
+        events[count].fd = sub->fd;
+        events[count].events = sub->pending;
+        sub->pending = 0;
+        ++count;
+    }
+    pthread_mutex_unlock(&notify_mutex);
+    ufs_error_code = UFS_ERR_NO_ERR;
+    return count;
+}
 
 #endif
 
 void
 ufs_destroy(void)
 {
+	pthread_mutex_lock(&ufs_mutex);
 	for (int i = 0; i < file_descriptor_count; ++i) {
-		free(file_descriptors[i]);
+		struct filedesc *desc = file_descriptors[i];
+		if (desc == NULL)
+			continue;
+		ufs_sub_close(desc);
+		free(desc);
 	}
 
 	free(file_descriptors);
@@ -696,4 +3154,37 @@ ufs_destroy(void)
 	while (file_list != NULL) {
 		rm(file_list);
 	}
+
+	lazy_free_drain(-1);
+	block_pool_drain();
+
+#if NEED_BLOCK_DEDUP
+	free(dedup_index);
+	dedup_index = NULL;
+	dedup_enabled = 0;
+#endif
+
+#if NEED_EVICTION
+	struct ufs_evict_config evict_off = {0, NULL, NULL, NULL};
+	ufs_evict_config = evict_off;
+	ufs_evict_clock = 0;
+#endif
+
+#if NEED_COMPACTION
+	free(compact_pos_name);
+	compact_pos_name = NULL;
+	compact_pos_block = 0;
+#endif
+
+#if NEED_SNAPSHOT
+	for (int i = 0; i < snapshot_map_count; ++i)
+		munmap(snapshot_maps[i].base, snapshot_maps[i].size);
+	free(snapshot_maps);
+	snapshot_maps = NULL;
+	snapshot_map_count = 0;
+	snapshot_map_capacity = 0;
+#endif
+
+	rhash_destroy(&file_names);
+	pthread_mutex_unlock(&ufs_mutex);
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <sys/types.h>
+#include <stdint.h>
 
 /**
  * User-defined in-memory filesystem. It is as simple as possible.
@@ -25,6 +26,18 @@
  */
 #define NEED_OPEN_FLAGS 1
 #define NEED_RESIZE 1
+#define NEED_VECTORED_IO 1
+#define NEED_FILE_CLONE 1
+#define NEED_SNAPSHOT 1
+#define NEED_BLOCK_COMPRESSION 1
+#define NEED_POSITIONAL_IO 1
+#define NEED_FILE_ITERATION 1
+#define NEED_MEMORY_ACCOUNTING 1
+#define NEED_BLOCK_DEDUP 1
+#define NEED_READ_BORROW 1
+#define NEED_EVICTION 1
+#define NEED_COMPACTION 1
+#define NEED_NOTIFICATIONS 1
 
 /**
  * Flags for ufs_open call.
@@ -53,6 +66,15 @@ enum open_flags {
 	 */
 	UFS_READ_WRITE = 8,
 
+	/**
+	 * Every write through the descriptor goes to the current end
+	 * of the file. The tail is resolved under the same lock as
+	 * the write itself, so concurrent appenders interleave whole
+	 * records and never clobber each other. Combinable with the
+	 * permission flags above; reads are unaffected.
+	 */
+	UFS_APPEND = 16,
+
 #endif
 };
 
@@ -139,6 +161,208 @@ ufs_close(int fd);
 int
 ufs_delete(const char *filename);
 
+#if NEED_POSITIONAL_IO
+
+/**
+ * Same as ufs_write(), but at an explicit file offset. The
+ * descriptor's own position is neither consulted nor advanced, so
+ * concurrent users of one descriptor don't contend on the shared
+ * cursor and need no seek+write sequences.
+ *
+ * @param fd File descriptor from ufs_open().
+ * @param buf Buffer to write.
+ * @param size Size of @a buf.
+ * @param pos File offset to write at.
+ *
+ * @retval > 0 How many bytes were written.
+ * @retval -1 Error occurred. Check ufs_errno() for a code. Same
+ *     codes as for ufs_write().
+ */
+ssize_t
+ufs_pwrite(int fd, const char *buf, size_t size, size_t pos);
+
+/**
+ * Same as ufs_read(), but at an explicit file offset, not touching
+ * the descriptor's position.
+ *
+ * @param fd File descriptor from ufs_open().
+ * @param buf Buffer to read into.
+ * @param size Maximum bytes to read.
+ * @param pos File offset to read from.
+ *
+ * @retval >= 0 How many bytes were read. 0 means EOF.
+ * @retval -1 Error occurred. Check ufs_errno() for a code. Same
+ *     codes as for ufs_read().
+ */
+ssize_t
+ufs_pread(int fd, char *buf, size_t size, size_t pos);
+
+#endif
+
+#if NEED_VECTORED_IO
+
+/** One piece of a scattered buffer for ufs_readv()/ufs_writev(). */
+struct ufs_iovec {
+	/** Start of the piece. */
+	char *base;
+	/** Byte size of the piece. */
+	size_t size;
+};
+
+/**
+ * Write a batch of scattered buffers as one contiguous range at the
+ * current descriptor position. Behaves like ufs_write() of the
+ * concatenation of the pieces, but resolves the file position once
+ * for the whole batch instead of once per piece.
+ *
+ * @param fd File descriptor from ufs_open().
+ * @param iov Array of buffer pieces.
+ * @param iov_count Number of the pieces.
+ *
+ * @retval >= 0 How many bytes were written in total.
+ * @retval -1 Error occurred. Check ufs_errno() for a code. Same
+ *     codes as for ufs_write().
+ */
+ssize_t
+ufs_writev(int fd, const struct ufs_iovec *iov, int iov_count);
+
+/**
+ * Read into a batch of scattered buffers. Behaves like ufs_read()
+ * into the concatenation of the pieces.
+ *
+ * @param fd File descriptor from ufs_open().
+ * @param iov Array of buffer pieces.
+ * @param iov_count Number of the pieces.
+ *
+ * @retval >= 0 How many bytes were read in total. 0 means EOF.
+ * @retval -1 Error occurred. Check ufs_errno() for a code. Same
+ *     codes as for ufs_read().
+ */
+ssize_t
+ufs_readv(int fd, const struct ufs_iovec *iov, int iov_count);
+
+#endif
+
+#if NEED_READ_BORROW
+
+/**
+ * One outstanding borrow from ufs_read_borrow(). The iov/iov_count
+ * pair is the result; the rest of the fields are internal.
+ */
+struct ufs_borrow {
+	/**
+	 * The lent pieces, covering the borrowed range back-to-back.
+	 * Read-only - a base may point into a block shared with
+	 * another file, or into the common zero page serving holes.
+	 */
+	const struct ufs_iovec *iov;
+	int iov_count;
+	/** Internal: the file and the pinned blocks. */
+	void *file;
+	void **blocks;
+	int block_count;
+	char *copy;
+};
+
+/**
+ * Lend the file content at [pos, pos + size) without copying it: the
+ * returned iovecs point straight at the file's blocks. The blocks
+ * are pinned with the same refcount that backs ufs_clone() sharing,
+ * so a concurrent write materializes its own copy and the borrowed
+ * bytes stay stable until ufs_read_release(). Serving a file to the
+ * network is then a writev() straight from the file memory - zero
+ * userfs-side copies. Closing the descriptor, or even deleting the
+ * file, does not invalidate an outstanding borrow. Holes are lent
+ * from a shared zero page; an inline (small) file is lent from a
+ * private copy - the zero-copy win is for the block files.
+ * Compressed blocks in the range are decompressed first.
+ *
+ * @param fd File descriptor from ufs_open().
+ * @param pos File offset to borrow from.
+ * @param size Maximum bytes to borrow.
+ * @param borrow Output, filled by the call.
+ *
+ * @retval > 0 How many bytes are lent.
+ * @retval 0 EOF. The borrow is empty, releasing it is a no-op.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_PERMISSION - the descriptor is not readable.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+ssize_t
+ufs_read_borrow(int fd, size_t pos, size_t size, struct ufs_borrow *borrow);
+
+/**
+ * Return the borrowed blocks. Every successful borrow has to be
+ * released, or its blocks and file stay pinned forever.
+ */
+void
+ufs_read_release(struct ufs_borrow *borrow);
+
+#endif
+
+#if NEED_FILE_CLONE
+
+/**
+ * Clone a file into a new name, sharing the data copy-on-write. The
+ * clone costs O(block-count) pointer copies and no data copying at
+ * all - the blocks get materialized privately only when one of the
+ * files is written into. If a file with the @a dst name already
+ * exists, it is dropped first, with the same semantics as
+ * ufs_delete().
+ *
+ * @param src Name of the file to clone.
+ * @param dst Name of the new file.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no file with the @a src name.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_clone(const char *src, const char *dst);
+
+#endif
+
+#if NEED_SNAPSHOT
+
+/**
+ * Serialize all the files into a single image on disk: a header, a
+ * per-file index and the page-aligned block data. The image is
+ * designed to be loaded back with mmap.
+ *
+ * @param path Where to write the image.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - the image file can not be written.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_snapshot_save(const char *path);
+
+/**
+ * Load an image saved by ufs_snapshot_save(). The image is mmap-ed
+ * and the file blocks point straight into the mapping, so loading is
+ * near-instant regardless of the data volume: the pages fault in
+ * lazily on first access and are shared between processes mapping
+ * the same image. A write into a loaded block copies it out of the
+ * mapping first. Files whose names already exist are displaced with
+ * ufs_delete() semantics.
+ *
+ * @param path Image to load.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - the image can not be opened or is not a
+ *       valid snapshot.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_snapshot_load(const char *path);
+
+#endif
+
 #if NEED_RESIZE
 
 /**
@@ -164,6 +388,268 @@ ufs_resize(int fd, size_t new_size);
 
 #endif
 
+#if NEED_BLOCK_DEDUP
+
+/**
+ * Switch block deduplication on or off. While it is on, a write
+ * filling a whole block consults a content-hash index and shares an
+ * identical existing block copy-on-write instead of storing its own
+ * copy - data sets of near-identical files then keep every distinct
+ * block once. Sharing reuses the copy-on-write refcounting of
+ * ufs_clone(), so a later write into a shared block silently
+ * materializes a private copy. Off by default; switching off stops
+ * new sharing, the existing shares stay until overwritten.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_MEM - not enough memory for the index.
+ */
+int
+ufs_set_dedup(int enabled);
+
+#endif
+
+#if NEED_MEMORY_ACCOUNTING
+
+/** Global usage numbers, see ufs_stat_global(). */
+struct ufs_stat {
+	/** Live (not deleted) files. */
+	size_t file_count;
+	/**
+	 * Materialized blocks - plain, compressed and mapped ones.
+	 * Holes cost nothing and are not counted. Blocks of deleted
+	 * files stay counted until their deferred reclamation runs.
+	 */
+	size_t block_count;
+	/** Sum of the live file sizes, in bytes. */
+	size_t file_bytes;
+};
+
+/**
+ * Read the usage counters. They are maintained in O(1) at the spots
+ * where the resources change hands, so the call itself is constant
+ * time at any file count.
+ */
+void
+ufs_stat_global(struct ufs_stat *stat);
+
+/**
+ * Limit the total materialized block memory. A write which would
+ * materialize a block beyond the quota fails with UFS_ERR_NO_MEM
+ * instead of inviting the OOM killer. Zero - no limit, the
+ * default. Lowering the quota below the current usage fails only
+ * new block materialization; the existing data stays readable.
+ */
+void
+ufs_set_quota(size_t bytes);
+
+#endif
+
+#if NEED_FILE_ITERATION
+
+/**
+ * Iterator over the file names. Zero-initialize it before the
+ * first ufs_iterate() call; the fields are internal.
+ */
+struct ufs_iterator {
+	/** All the names at the iteration start, packed back-to-back. */
+	char *names;
+	/** Offset of each name in the pack. */
+	uint32_t *offsets;
+	int file_count;
+	int pos;
+};
+
+/**
+ * List the files in batches. The first call takes a snapshot of all
+ * the names in one compact pack - files created or deleted later
+ * don't disturb a running iteration, every name from the snapshot
+ * is returned exactly once. Each call fills @a batch with up to
+ * @a batch_capacity pointers into the snapshot; the pointers stay
+ * valid until the iteration ends.
+ *
+ * @param it Iterator, zeroed before the first call.
+ * @param batch Output array for the name pointers.
+ * @param batch_capacity Size of @a batch, in entries.
+ *
+ * @retval > 0 How many names were put into @a batch.
+ * @retval 0 Iteration is over. The iterator is reset and can be
+ *     reused; its memory is already released.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_MEM - not enough memory for the snapshot.
+ */
+int
+ufs_iterate(struct ufs_iterator *it, const char **batch,
+	    int batch_capacity);
+
+/**
+ * Release an iteration abandoned before ufs_iterate() returned 0.
+ */
+void
+ufs_iterator_close(struct ufs_iterator *it);
+
+#endif
+
+#if NEED_EVICTION
+
+/**
+ * Take an evicted file's content for external storage. Returning 0
+ * accepts the spill, -1 refuses it and the file stays resident. The
+ * data pointer is valid only for the duration of the call.
+ */
+typedef int
+(*ufs_spill_f)(const char *filename, const char *data, size_t size,
+	       void *arg);
+
+/**
+ * Bring an evicted file's content back. The buffer is @a size bytes
+ * - exactly the size the file had when it was spilled - and has to
+ * be filled whole. Return @a size on success, -1 on failure, which
+ * fails the ufs_open() faulting the file in with UFS_ERR_NO_FILE.
+ */
+typedef ssize_t
+(*ufs_fetch_f)(const char *filename, char *data, size_t size, void *arg);
+
+/** Eviction setup, see ufs_set_eviction(). */
+struct ufs_evict_config {
+	/** Resident content budget, in bytes. */
+	size_t budget_bytes;
+	/** Takes the content of a file being evicted. */
+	ufs_spill_f spill;
+	/** Serves the content back on fault-in. */
+	ufs_fetch_f fetch;
+	/** Opaque pointer passed to both callbacks. */
+	void *arg;
+};
+
+/**
+ * Turn the FS into a bounded cache. Every file carries a cheap
+ * last-access stamp, updated at open/read/write granularity. When
+ * the resident bytes - the file_bytes counter of ufs_stat_global() -
+ * exceed the budget, the least recently used closed files are handed
+ * to the spill callback one by one until the usage fits, and their
+ * memory is released. Opening a spilled file faults its content back
+ * in through the fetch callback, transparently to the caller - and
+ * may in turn push other cold files out. Spilled files keep their
+ * name: they are found by ufs_open(), listed by ufs_iterate() and
+ * dropped by ufs_delete() like any other file, but leave the
+ * file_bytes accounting until faulted back.
+ *
+ * Files with open descriptors and files pinned by an outstanding
+ * borrow are never evicted. The callbacks run under the internal
+ * locks and must not call back into userfs. NULL @a config - or a
+ * NULL spill callback - switches eviction off completely, including
+ * the fault-in path, so disable only after the last spilled file
+ * was opened back or deleted.
+ */
+void
+ufs_set_eviction(const struct ufs_evict_config *config);
+
+#endif
+
+#if NEED_BLOCK_COMPRESSION
+
+/**
+ * One round of cold-block compression. Every block carries an
+ * access bit set by reads and writes; a round clears the bits and
+ * compresses the blocks whose bit was already clear - i.e. not
+ * touched since the previous round. Compressed blocks decompress
+ * transparently when read or written again, so the call is purely
+ * a memory/speed trade: archival data that is written once and
+ * rarely read shrinks severalfold, the hot set stays untouched.
+ * Meant to be called periodically, e.g. from a background
+ * maintenance thread of the application. Thread-safe.
+ *
+ * @retval >= 0 How many blocks were compressed this round.
+ */
+int
+ufs_compress_cold(void);
+
+#endif
+
+#if NEED_COMPACTION
+
+/**
+ * One bounded slice of incremental compaction. Workloads which
+ * interleave small writes and resizes leave files with many block
+ * windows holding nothing but zeros; such a window reads exactly
+ * like a hole, so the slice detects it, punches it out and returns
+ * the memory to the block pool. Over-grown buffers of shrunk
+ * inline files are trimmed back the same way. The scan position
+ * survives between the calls, so periodic calls with a small
+ * budget sweep the whole FS in the background without ever
+ * stalling the foreground for longer than one slice. Thread-safe.
+ *
+ * @param block_budget How many blocks to examine at most in this
+ *     slice. Negative - no limit, do one full pass.
+ *
+ * @retval >= 0 How many blocks and inline buffers were reclaimed.
+ */
+int
+ufs_compact(int block_budget);
+
+#endif
+
+#if NEED_NOTIFICATIONS
+
+/** What happened to a subscribed file, see ufs_subscribe(). */
+enum ufs_event_mask {
+	/** Bytes were written into the file. */
+	UFS_EVENT_WRITE = 1,
+	/** The file size changed - a resize or an extending write. */
+	UFS_EVENT_RESIZE = 2,
+	/** The file was deleted, or displaced by a clone or a snapshot. */
+	UFS_EVENT_DELETE = 4,
+};
+
+/** One drained subscription, see ufs_poll_events(). */
+struct ufs_event {
+	/** The subscribed descriptor. */
+	int fd;
+	/** Bitwise combination of the accumulated ufs_event_mask bits. */
+	int events;
+};
+
+/**
+ * Subscribe the descriptor to change events of its file. Without
+ * subscriptions a cache layer detects changes by periodically
+ * re-reading and comparing its hot files; a subscription replaces
+ * those scans with O(1) bookkeeping at each mutation site - a
+ * write, resize or deletion marks the subscription and queues it,
+ * and ufs_poll_events() drains the marks in batches. The events
+ * coalesce: however many writes land between two polls, the
+ * descriptor is reported once, with the mask of everything that
+ * happened. Mutations through any descriptor of the file are
+ * reported, not only through the subscribed one. A repeated call
+ * replaces the mask; zero cancels the subscription, as does closing
+ * the descriptor.
+ *
+ * @param fd File descriptor from ufs_open().
+ * @param event_mask Bitwise combination of ufs_event_mask values.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_subscribe(int fd, int event_mask);
+
+/**
+ * Drain up to @a capacity accumulated subscription events, the
+ * longest-waiting subscription first. Never blocks - an empty queue
+ * is simply a zero.
+ *
+ * @param events Output array.
+ * @param capacity Size of @a events, in entries.
+ *
+ * @retval >= 0 How many entries were filled.
+ */
+int
+ufs_poll_events(struct ufs_event *events, int capacity);
+
+#endif
+
 /**
  * Destroy all the global variables, free all the memory, close and delete all
  * the files. After the destruction neither of the ufs functions are supposed to
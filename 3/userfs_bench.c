@@ -0,0 +1,268 @@
+#include "userfs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * Benchmarks of the userfs I/O paths. Unlike test.c this measures
+ * speed, not correctness - a regression gate for the block layout,
+ * the descriptor table and the metadata paths. Sequential and random
+ * bandwidth is taken across file sizes from one block up to the
+ * maximum file size, plus the pure-metadata rates: open/close of an
+ * existing file and create/delete churn. Every case warms up once,
+ * then the median of the timed runs is reported. The output is
+ * machine-readable, one 'key value unit' triple per line, so the
+ * numbers can be tracked across releases.
+ *
+ * Build with 'make bench'.
+ */
+
+enum {
+	BENCH_RUN_COUNT = 5,
+	BENCH_IO_CHUNK = 4096,
+	BENCH_RANDOM_OP_LIMIT = 8192,
+	BENCH_META_OP_COUNT = 100000,
+};
+
+static double
+now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void
+report(const char *key, double value, const char *unit)
+{
+	printf("%s %.2f %s\n", key, value, unit);
+}
+
+static int
+double_cmp(const void *a, const void *b)
+{
+	double l = *(const double *)a;
+	double r = *(const double *)b;
+	return l < r ? -1 : l > r;
+}
+
+static double
+median_of(double *times, int count)
+{
+	qsort(times, count, sizeof(times[0]), double_cmp);
+	return times[count / 2];
+}
+
+static void
+die(const char *what)
+{
+	fprintf(stderr, "%s failed, errno %d\n", what, ufs_errno());
+	exit(1);
+}
+
+////////////////////////////////////////////////////////////////////
+
+/*
+ * Sequential write of a fresh file in 4 KB chunks, then sequential
+ * read of it back. The file is recreated every run so the write path
+ * includes the block allocations, like a real ingest would.
+ */
+static void
+bench_sequential(const char *name, size_t file_size)
+{
+	char chunk[BENCH_IO_CHUNK];
+	memset(chunk, 'b', sizeof(chunk));
+	double write_times[BENCH_RUN_COUNT + 1];
+	double read_times[BENCH_RUN_COUNT + 1];
+
+	/* Run 0 is the warmup and is not reported. */
+	for (int run = 0; run < BENCH_RUN_COUNT + 1; ++run) {
+		int fd = ufs_open("bench", UFS_CREATE);
+		if (fd == -1)
+			die("open for write");
+		double t = now_sec();
+		for (size_t done = 0; done < file_size; done += sizeof(chunk)) {
+			if (ufs_write(fd, chunk, sizeof(chunk)) !=
+			    (ssize_t)sizeof(chunk))
+				die("write");
+		}
+		write_times[run] = now_sec() - t;
+		if (ufs_close(fd) != 0)
+			die("close");
+
+		fd = ufs_open("bench", 0);
+		if (fd == -1)
+			die("open for read");
+		t = now_sec();
+		for (size_t done = 0; done < file_size; done += sizeof(chunk)) {
+			if (ufs_read(fd, chunk, sizeof(chunk)) !=
+			    (ssize_t)sizeof(chunk))
+				die("read");
+		}
+		read_times[run] = now_sec() - t;
+		if (ufs_close(fd) != 0)
+			die("close");
+		if (ufs_delete("bench") != 0)
+			die("delete");
+	}
+
+	char key[128];
+	snprintf(key, sizeof(key), "seq_write_%s", name);
+	report(key, file_size / median_of(write_times + 1,
+		BENCH_RUN_COUNT) / 1e6, "MB/sec");
+	snprintf(key, sizeof(key), "seq_read_%s", name);
+	report(key, file_size / median_of(read_times + 1,
+		BENCH_RUN_COUNT) / 1e6, "MB/sec");
+}
+
+#if NEED_POSITIONAL_IO
+
+/*
+ * Block-aligned reads and overwrites at uniformly random offsets of
+ * a prewritten file. This is the pattern which caught the old O(n)
+ * offset walk - a layout where the block lookup is not O(1) shows up
+ * here immediately.
+ */
+static void
+bench_random(const char *name, size_t file_size)
+{
+	char chunk[BENCH_IO_CHUNK];
+	memset(chunk, 'r', sizeof(chunk));
+	size_t block_count = file_size / sizeof(chunk);
+	size_t op_count = block_count < BENCH_RANDOM_OP_LIMIT ?
+		block_count : BENCH_RANDOM_OP_LIMIT;
+
+	int fd = ufs_open("bench", UFS_CREATE);
+	if (fd == -1)
+		die("open");
+	for (size_t done = 0; done < file_size; done += sizeof(chunk)) {
+		if (ufs_write(fd, chunk, sizeof(chunk)) !=
+		    (ssize_t)sizeof(chunk))
+			die("write");
+	}
+
+	srand(42);
+	double write_times[BENCH_RUN_COUNT + 1];
+	double read_times[BENCH_RUN_COUNT + 1];
+	for (int run = 0; run < BENCH_RUN_COUNT + 1; ++run) {
+		double t = now_sec();
+		for (size_t i = 0; i < op_count; ++i) {
+			size_t off = (size_t)(rand() % block_count) *
+				sizeof(chunk);
+			if (ufs_pwrite(fd, chunk, sizeof(chunk), off) !=
+			    (ssize_t)sizeof(chunk))
+				die("pwrite");
+		}
+		write_times[run] = now_sec() - t;
+		t = now_sec();
+		for (size_t i = 0; i < op_count; ++i) {
+			size_t off = (size_t)(rand() % block_count) *
+				sizeof(chunk);
+			if (ufs_pread(fd, chunk, sizeof(chunk), off) !=
+			    (ssize_t)sizeof(chunk))
+				die("pread");
+		}
+		read_times[run] = now_sec() - t;
+	}
+	if (ufs_close(fd) != 0)
+		die("close");
+	if (ufs_delete("bench") != 0)
+		die("delete");
+
+	double byte_count = (double)op_count * sizeof(chunk);
+	char key[128];
+	snprintf(key, sizeof(key), "rand_write_%s", name);
+	report(key, byte_count / median_of(write_times + 1,
+		BENCH_RUN_COUNT) / 1e6, "MB/sec");
+	snprintf(key, sizeof(key), "rand_read_%s", name);
+	report(key, byte_count / median_of(read_times + 1,
+		BENCH_RUN_COUNT) / 1e6, "MB/sec");
+}
+
+#endif
+
+/* Open/close rate on one existing file - the descriptor table path. */
+static void
+bench_open_close(void)
+{
+	int fd = ufs_open("bench", UFS_CREATE);
+	if (fd == -1)
+		die("open");
+	if (ufs_close(fd) != 0)
+		die("close");
+
+	double times[BENCH_RUN_COUNT + 1];
+	for (int run = 0; run < BENCH_RUN_COUNT + 1; ++run) {
+		double t = now_sec();
+		for (int i = 0; i < BENCH_META_OP_COUNT; ++i) {
+			fd = ufs_open("bench", 0);
+			if (fd == -1)
+				die("open");
+			if (ufs_close(fd) != 0)
+				die("close");
+		}
+		times[run] = now_sec() - t;
+	}
+	if (ufs_delete("bench") != 0)
+		die("delete");
+	report("open_close", BENCH_META_OP_COUNT /
+		median_of(times + 1, BENCH_RUN_COUNT) / 1e3, "Kops/sec");
+}
+
+/*
+ * Create/delete churn with one block of payload - the file list, the
+ * name hash and the block recycling together.
+ */
+static void
+bench_churn(void)
+{
+	char chunk[BENCH_IO_CHUNK];
+	memset(chunk, 'c', sizeof(chunk));
+	const int op_count = BENCH_META_OP_COUNT / 10;
+
+	double times[BENCH_RUN_COUNT + 1];
+	for (int run = 0; run < BENCH_RUN_COUNT + 1; ++run) {
+		double t = now_sec();
+		for (int i = 0; i < op_count; ++i) {
+			int fd = ufs_open("bench", UFS_CREATE);
+			if (fd == -1)
+				die("open");
+			if (ufs_write(fd, chunk, sizeof(chunk)) !=
+			    (ssize_t)sizeof(chunk))
+				die("write");
+			if (ufs_close(fd) != 0)
+				die("close");
+			if (ufs_delete("bench") != 0)
+				die("delete");
+		}
+		times[run] = now_sec() - t;
+	}
+	report("create_delete", op_count /
+		median_of(times + 1, BENCH_RUN_COUNT) / 1e3, "Kops/sec");
+}
+
+int
+main(void)
+{
+	static const struct {
+		const char *name;
+		size_t size;
+	} sizes[] = {
+		{"4k", 4 * 1024},
+		{"256k", 256 * 1024},
+		{"4m", 4 * 1024 * 1024},
+		{"100m", 100 * 1024 * 1024},
+	};
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+		bench_sequential(sizes[i].name, sizes[i].size);
+#if NEED_POSITIONAL_IO
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+		bench_random(sizes[i].name, sizes[i].size);
+#endif
+	bench_open_close();
+	bench_churn();
+	ufs_destroy();
+	return 0;
+}
@@ -0,0 +1,279 @@
+#define _GNU_SOURCE
+
+#include "process_pool.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+enum ppool_slot_state {
+    SLOT_FREE = 0,
+    SLOT_QUEUED,
+    SLOT_RUNNING,
+    SLOT_DONE,
+    SLOT_CRASHED,
+};
+
+enum {
+    /* How often a joiner wakes up to look for dead workers, ns. */
+    PPOOL_REAP_PERIOD_NS = 50 * 1000 * 1000,
+};
+
+struct ppool_slot {
+    int state;
+    process_pool_task_f func;
+    int arg_size;
+    /* Result size, or < 0 when the task function failed. */
+    int ret_size;
+    /* Which worker runs the slot - to fail it if that worker dies. */
+    pid_t worker;
+    char arg[PPOOL_ARG_MAX];
+    char ret[PPOOL_RET_MAX];
+};
+
+/* The mmap-ed part, visible to the parent and every worker. */
+struct ppool_shared {
+    pthread_mutex_t mutex;
+    /* The workers sleep here until a slot turns QUEUED. */
+    pthread_cond_t has_work;
+    /* The joiners sleep here until a slot turns DONE or CRASHED. */
+    pthread_cond_t has_done;
+    int stop;
+    struct ppool_slot slots[PPOOL_QUEUE_SIZE];
+};
+
+struct process_pool {
+    struct ppool_shared *shared;
+    pid_t workers[PPOOL_MAX_WORKERS];
+    int worker_count;
+};
+
+/*
+ * The mutex is robust: when a worker dies holding it, the next locker
+ * gets EOWNERDEAD and has to mark the state consistent. The slot the
+ * dead worker was touching is repaired by the reaper - it turns every
+ * slot of a dead pid into CRASHED.
+ */
+static void
+ppool_lock(struct ppool_shared *shared) {
+    if (pthread_mutex_lock(&shared->mutex) == EOWNERDEAD)
+        pthread_mutex_consistent(&shared->mutex);
+}
+
+static void *
+ppool_worker_f(struct ppool_shared *shared) {
+    while (1) {
+        ppool_lock(shared);
+        struct ppool_slot *slot = NULL;
+        while (!shared->stop) {
+            for (int i = 0; i < PPOOL_QUEUE_SIZE; ++i) {
+                if (shared->slots[i].state == SLOT_QUEUED) {
+                    slot = &shared->slots[i];
+                    break;
+                }
+            }
+            if (slot != NULL)
+                break;
+            pthread_cond_wait(&shared->has_work, &shared->mutex);
+        }
+        if (slot == NULL) {
+            pthread_mutex_unlock(&shared->mutex);
+            return NULL;
+        }
+        slot->state = SLOT_RUNNING;
+        slot->worker = getpid();
+        /* Run outside the lock - the task can take long, or die. */
+        process_pool_task_f func = slot->func;
+        int arg_size = slot->arg_size;
+        char arg[PPOOL_ARG_MAX];
+        memcpy(arg, slot->arg, arg_size);
+        pthread_mutex_unlock(&shared->mutex);
+
+        char ret[PPOOL_RET_MAX];
+        int ret_size = func(arg, arg_size, ret);
+
+        ppool_lock(shared);
+        slot->ret_size = ret_size;
+        if (ret_size >= 0 && ret_size <= PPOOL_RET_MAX) {
+            memcpy(slot->ret, ret, ret_size);
+            slot->state = SLOT_DONE;
+        } else {
+            slot->state = SLOT_CRASHED;
+        }
+        pthread_cond_broadcast(&shared->has_done);
+        pthread_mutex_unlock(&shared->mutex);
+    }
+}
+
+static pid_t
+ppool_spawn_worker(struct ppool_shared *shared) {
+    pid_t pid = fork();
+    if (pid != 0)
+        return pid;
+    ppool_worker_f(shared);
+    /* No atexit of the parent - this is a worker, not a copy of it. */
+    _exit(0);
+}
+
+/*
+ * Reap the dead workers, fail their tasks and fork replacements.
+ * Called under the mutex by a waiting joiner.
+ */
+static void
+ppool_reap_crashed(struct process_pool *pool) {
+    struct ppool_shared *shared = pool->shared;
+    for (int w = 0; w < pool->worker_count; ++w) {
+        pid_t pid = pool->workers[w];
+        if (waitpid(pid, NULL, WNOHANG) != pid)
+            continue;
+        for (int i = 0; i < PPOOL_QUEUE_SIZE; ++i) {
+            struct ppool_slot *slot = &shared->slots[i];
+            if (slot->state == SLOT_RUNNING && slot->worker == pid) {
+                slot->state = SLOT_CRASHED;
+                slot->ret_size = -1;
+            }
+        }
+        pool->workers[w] = ppool_spawn_worker(shared);
+        pthread_cond_broadcast(&shared->has_done);
+    }
+}
+
+int
+process_pool_new(int worker_count, struct process_pool **pool) {
+    if (worker_count <= 0 || worker_count > PPOOL_MAX_WORKERS ||
+        pool == NULL)
+        return PPOOL_ERR_INVALID_ARGUMENT;
+
+    struct process_pool *p = calloc(1, sizeof(*p));
+    if (p == NULL)
+        return -1;
+    p->shared = mmap(NULL, sizeof(*p->shared), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p->shared == MAP_FAILED) {
+        free(p);
+        return -1;
+    }
+    memset(p->shared, 0, sizeof(*p->shared));
+
+    pthread_mutexattr_t mutex_attr;
+    pthread_mutexattr_init(&mutex_attr);
+    pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&p->shared->mutex, &mutex_attr);
+    pthread_mutexattr_destroy(&mutex_attr);
+
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+    /* Timed waits pass CLOCK_MONOTONIC deadlines, like the thread
+     * pool's parking does. */
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&p->shared->has_work, &cond_attr);
+    pthread_cond_init(&p->shared->has_done, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
+    p->worker_count = worker_count;
+    for (int i = 0; i < worker_count; ++i)
+        p->workers[i] = ppool_spawn_worker(p->shared);
+    *pool = p;
+    return 0;
+}
+
+int
+process_pool_push(struct process_pool *pool, process_pool_task_f func,
+                  const void *arg, size_t arg_size, int *ticket) {
+    if (func == NULL || ticket == NULL || arg_size > PPOOL_ARG_MAX ||
+        (arg == NULL && arg_size > 0))
+        return PPOOL_ERR_INVALID_ARGUMENT;
+
+    struct ppool_shared *shared = pool->shared;
+    ppool_lock(shared);
+    struct ppool_slot *slot = NULL;
+    int i;
+    for (i = 0; i < PPOOL_QUEUE_SIZE; ++i) {
+        if (shared->slots[i].state == SLOT_FREE) {
+            slot = &shared->slots[i];
+            break;
+        }
+    }
+    if (slot == NULL) {
+        pthread_mutex_unlock(&shared->mutex);
+        return PPOOL_ERR_TOO_MANY_TASKS;
+    }
+    slot->func = func;
+    slot->arg_size = arg_size;
+    /* arg may legally be NULL when arg_size is 0 - don't hand a NULL
+     * to memcpy, that is UB even for zero bytes. */
+    if (arg_size > 0)
+        memcpy(slot->arg, arg, arg_size);
+    slot->state = SLOT_QUEUED;
+    pthread_cond_signal(&shared->has_work);
+    pthread_mutex_unlock(&shared->mutex);
+    *ticket = i;
+    return 0;
+}
+
+int
+process_pool_join(struct process_pool *pool, int ticket, void *ret,
+                  int *ret_size) {
+    if (ticket < 0 || ticket >= PPOOL_QUEUE_SIZE)
+        return PPOOL_ERR_INVALID_ARGUMENT;
+
+    struct ppool_shared *shared = pool->shared;
+    struct ppool_slot *slot = &shared->slots[ticket];
+    ppool_lock(shared);
+    if (slot->state == SLOT_FREE) {
+        pthread_mutex_unlock(&shared->mutex);
+        return PPOOL_ERR_INVALID_ARGUMENT;
+    }
+    while (slot->state == SLOT_QUEUED || slot->state == SLOT_RUNNING) {
+        /*
+         * The wait is chopped into short pieces - a worker which
+         * died mid-task signals nothing, so the joiner has to look
+         * for corpses itself once in a while.
+         */
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += PPOOL_REAP_PERIOD_NS;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_nsec -= 1000000000;
+            deadline.tv_sec++;
+        }
+        pthread_cond_timedwait(&shared->has_done, &shared->mutex,
+                               &deadline);
+        ppool_reap_crashed(pool);
+    }
+    int rc = 0;
+    if (slot->state == SLOT_CRASHED) {
+        rc = PPOOL_ERR_CRASHED;
+    } else {
+        if (ret != NULL)
+            memcpy(ret, slot->ret, slot->ret_size);
+        if (ret_size != NULL)
+            *ret_size = slot->ret_size;
+    }
+    slot->state = SLOT_FREE;
+    pthread_mutex_unlock(&shared->mutex);
+    return rc;
+}
+
+void
+process_pool_delete(struct process_pool *pool) {
+    struct ppool_shared *shared = pool->shared;
+    ppool_lock(shared);
+    shared->stop = 1;
+    pthread_cond_broadcast(&shared->has_work);
+    pthread_mutex_unlock(&shared->mutex);
+    for (int i = 0; i < pool->worker_count; ++i)
+        waitpid(pool->workers[i], NULL, 0);
+    pthread_mutex_destroy(&shared->mutex);
+    pthread_cond_destroy(&shared->has_work);
+    pthread_cond_destroy(&shared->has_done);
+    munmap(shared, sizeof(*shared));
+    free(pool);
+}
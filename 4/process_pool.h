@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * A multi-process variant of the thread pool, for tasks which need
+ * fault containment. The pool pre-forks worker processes once and
+ * feeds them through a shared-memory task ring (mmap plus robust
+ * process-shared synchronization), so isolated execution reuses warm
+ * workers at queue speeds instead of paying a fork per task.
+ *
+ * A task is a plain function plus a small serialized argument copied
+ * into the ring slot. The workers are forked from this process, so
+ * the function pointer is valid in each of them; the argument has to
+ * be self-contained - the workers do not see the parent's memory
+ * written after the fork. A crashing worker takes only its own task
+ * down: the parent reaps it, forks a replacement and fails the task
+ * with PPOOL_ERR_CRASHED instead of dying with it.
+ */
+
+struct process_pool;
+
+enum ppool_error {
+	PPOOL_ERR_INVALID_ARGUMENT = 1,
+	/** Every ring slot is taken by a not yet joined task. */
+	PPOOL_ERR_TOO_MANY_TASKS,
+	/** The worker died mid-task, or the task returned < 0. */
+	PPOOL_ERR_CRASHED,
+};
+
+enum {
+	/** Inline argument and result capacity of one ring slot. */
+	PPOOL_ARG_MAX = 256,
+	PPOOL_RET_MAX = 256,
+	/** How many pushed, not yet joined tasks fit at once. */
+	PPOOL_QUEUE_SIZE = 128,
+	PPOOL_MAX_WORKERS = 64,
+};
+
+/**
+ * The task body, run inside a worker process. 'ret' has room for
+ * PPOOL_RET_MAX bytes. Returns the used result size, or < 0 to fail
+ * the task.
+ */
+typedef int (*process_pool_task_f)(const void *arg, size_t arg_size,
+				   void *ret);
+
+/**
+ * Create a pool of 'worker_count' pre-forked worker processes.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - PPOOL_ERR_INVALID_ARGUMENT - bad worker count.
+ */
+int
+process_pool_new(int worker_count, struct process_pool **pool);
+
+/**
+ * Queue a task. The argument bytes are copied into the ring - the
+ * caller's buffer is free right away.
+ *
+ * @param ticket Out parameter, to join the task with.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - PPOOL_ERR_INVALID_ARGUMENT - no function, or the argument
+ *       does not fit into PPOOL_ARG_MAX.
+ *     - PPOOL_ERR_TOO_MANY_TASKS - the ring is full of unjoined
+ *       tasks.
+ */
+int
+process_pool_push(struct process_pool *pool, process_pool_task_f func,
+		  const void *arg, size_t arg_size, int *ticket);
+
+/**
+ * Wait for the task and free its slot. Every pushed task has to be
+ * joined exactly once.
+ *
+ * @param ret Buffer of at least PPOOL_RET_MAX bytes for the result;
+ *     NULL to discard it.
+ * @param ret_size Out parameter for the result size; NULL is fine.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - PPOOL_ERR_INVALID_ARGUMENT - not a pushed ticket.
+ *     - PPOOL_ERR_CRASHED - the worker died running the task, or
+ *       the task failed itself. The pool stays usable - a
+ *       replacement worker is already forked.
+ */
+int
+process_pool_join(struct process_pool *pool, int ticket, void *ret,
+		  int *ret_size);
+
+/** Stop the workers, wait for them and free everything. */
+void
+process_pool_delete(struct process_pool *pool);
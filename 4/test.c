@@ -1,8 +1,14 @@
+/* For sched_getcpu() and sched_getaffinity() in the affinity test. */
+#define _GNU_SOURCE
+
 #include "thread_pool.h"
+#include "process_pool.h"
 #include "unit.h"
 #include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <string.h>
 
 static void
 test_new(void)
@@ -253,6 +259,820 @@ test_thread_pool_max_tasks(void)
 	unit_test_finish();
 }
 
+static void *
+task_record_cpu_f(void *arg)
+{
+	__atomic_store_n((int *)arg, sched_getcpu(), __ATOMIC_RELAXED);
+	return arg;
+}
+
+static void
+test_affinity(void)
+{
+#if NEED_AFFINITY
+	unit_test_start();
+
+	struct thread_pool *p;
+	int cpus[1] = {0};
+	unit_check(thread_pool_new_pinned(3, NULL, 1, &p) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "no cpu list");
+	unit_check(thread_pool_new_pinned(3, cpus, 0, &p) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "an empty cpu list");
+	cpus[0] = 1 << 30;
+	unit_check(thread_pool_new_pinned(3, cpus, 1, &p) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "a cpu out of range");
+	/*
+	 * Pin all the workers to one allowed CPU and check the tasks
+	 * really run there.
+	 */
+	cpu_set_t allowed;
+	unit_fail_if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0);
+	cpus[0] = 0;
+	while (!CPU_ISSET(cpus[0], &allowed))
+		++cpus[0];
+	unit_check(thread_pool_new_pinned(3, cpus, 1, &p) == 0,
+		   "created a pinned pool");
+	struct thread_task *t;
+	void *result;
+	for (int i = 0; i < 10; ++i) {
+		int cpu = -1;
+		unit_fail_if(thread_task_new(&t, task_record_cpu_f,
+					     &cpu) != 0);
+		unit_fail_if(thread_pool_push_task(p, t) != 0);
+		unit_fail_if(thread_task_join(t, &result) != 0);
+		unit_fail_if(thread_task_delete(t) != 0);
+		unit_fail_if(cpu != cpus[0]);
+	}
+	unit_check(true, "every task ran on the pinned cpu");
+	unit_check(thread_pool_delete(p) == 0, "deleted the pinned pool");
+
+	unit_test_finish();
+#endif
+}
+
+static void *
+gate_open_later_f(void *arg)
+{
+	usleep(100 * 1000);
+	__atomic_store_n((int *)arg, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+static void
+test_overflow(void)
+{
+#if NEED_OVERFLOW_POLICY
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_task *t, *blocker;
+	struct thread_task **tasks = malloc(sizeof(*tasks) * TPOOL_MAX_TASKS);
+	void *result;
+	int arg = 0;
+	int gate = 0;
+	unit_check(thread_pool_new_overflow(3, -1, &p) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "bad policy");
+	/*
+	 * Caller-runs: a push into a full pool executes the task on the
+	 * pusher's own thread.
+	 */
+	unit_fail_if(thread_pool_new_overflow(1, TPOOL_OVERFLOW_CALLER_RUNS,
+					      &p) != 0);
+	unit_fail_if(thread_task_new(&blocker, task_wait_for_f, &gate) != 0);
+	unit_fail_if(thread_pool_push_task(p, blocker) != 0);
+	while (!thread_task_is_running(blocker))
+		usleep(100);
+	for (int i = 0; i < TPOOL_MAX_TASKS; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i], task_wait_for_f,
+					     &gate) != 0);
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+	}
+	unit_fail_if(thread_task_new(&t, task_incr_f, &arg) != 0);
+	unit_check(thread_pool_push_task(p, t) == 0,
+		   "a push into a full pool succeeded");
+	unit_check(thread_task_is_finished(t) &&
+		   __atomic_load_n(&arg, __ATOMIC_RELAXED) == 1,
+		   "the pusher ran it inline");
+	unit_check(thread_task_join(t, &result) == 0 && result == &arg,
+		   "joined like a worker-run task");
+	unit_fail_if(thread_task_delete(t) != 0);
+	__atomic_store_n(&gate, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < TPOOL_MAX_TASKS; ++i) {
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	unit_fail_if(thread_task_join(blocker, &result) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+	/*
+	 * Drop-oldest: the longest-waiting task is shed to make room.
+	 */
+	gate = 0;
+	unit_fail_if(thread_pool_new_overflow(1, TPOOL_OVERFLOW_DROP_OLDEST,
+					      &p) != 0);
+	unit_fail_if(thread_pool_push_task(p, blocker) != 0);
+	while (!thread_task_is_running(blocker))
+		usleep(100);
+	for (int i = 0; i < TPOOL_MAX_TASKS; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i], task_wait_for_f,
+					     &gate) != 0);
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+	}
+	arg = 0;
+	unit_fail_if(thread_task_new(&t, task_incr_f, &arg) != 0);
+	unit_check(thread_pool_push_task(p, t) == 0, "pushed by shedding");
+	unit_check(thread_task_is_finished(tasks[0]) &&
+		   thread_task_is_cancelled(tasks[0]),
+		   "the oldest filler was dropped, like a cancel");
+	unit_check(thread_task_join(tasks[0], &result) == 0 &&
+		   result == NULL, "the victim joined with a NULL result");
+	__atomic_store_n(&gate, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < TPOOL_MAX_TASKS; ++i) {
+		if (i != 0)
+			unit_fail_if(thread_task_join(tasks[i],
+						      &result) != 0);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	unit_fail_if(thread_task_join(t, &result) != 0);
+	unit_check(__atomic_load_n(&arg, __ATOMIC_RELAXED) == 1,
+		   "the pushed task ran in the pool");
+	unit_fail_if(thread_task_delete(t) != 0);
+	unit_fail_if(thread_task_join(blocker, &result) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+	/*
+	 * Block: the push waits out the overflow instead of failing.
+	 */
+	gate = 0;
+	unit_fail_if(thread_pool_new_overflow(1, TPOOL_OVERFLOW_BLOCK,
+					      &p) != 0);
+	unit_fail_if(thread_pool_push_task(p, blocker) != 0);
+	while (!thread_task_is_running(blocker))
+		usleep(100);
+	for (int i = 0; i < TPOOL_MAX_TASKS; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i], task_wait_for_f,
+					     &gate) != 0);
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+	}
+	pthread_t opener;
+	unit_fail_if(pthread_create(&opener, NULL, gate_open_later_f,
+				    &gate) != 0);
+	arg = 0;
+	unit_fail_if(thread_task_new(&t, task_incr_f, &arg) != 0);
+	unit_check(thread_pool_push_task(p, t) == 0,
+		   "the push waited out the overflow");
+	pthread_join(opener, NULL);
+	for (int i = 0; i < TPOOL_MAX_TASKS; ++i) {
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	unit_fail_if(thread_task_join(t, &result) != 0);
+	unit_check(__atomic_load_n(&arg, __ATOMIC_RELAXED) == 1,
+		   "the delayed push still ran its task");
+	unit_fail_if(thread_task_delete(t) != 0);
+	unit_fail_if(thread_task_join(blocker, &result) != 0);
+	unit_fail_if(thread_task_delete(blocker) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+	free(tasks);
+
+	unit_test_finish();
+#endif
+}
+
+static void
+test_delayed(void)
+{
+#if NEED_DELAYED_TASKS
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_task *t;
+	int arg = 0;
+	void *result;
+	unit_fail_if(thread_pool_new(3, &p) != 0);
+	/*
+	 * A delayed task does not start before its deadline.
+	 */
+	unit_fail_if(thread_task_new(&t, task_incr_f, &arg) != 0);
+	unit_check(thread_pool_push_task_delayed(p, t, 0.05) == 0,
+		   "pushed a delayed task");
+	unit_check(thread_pool_delete(p) == TPOOL_ERR_HAS_TASKS,
+		   "a scheduled task blocks pool deletion");
+	unit_check(__atomic_load_n(&arg, __ATOMIC_RELAXED) == 0,
+		   "not started right away");
+	unit_check(thread_task_join(t, &result) == 0, "joined it");
+	unit_check(arg == 1, "it ran after the delay");
+	/*
+	 * Cancel before the timer fires.
+	 */
+	unit_check(thread_pool_push_task_delayed(p, t, 1000) == 0,
+		   "pushed a far away task");
+	unit_check(thread_task_cancel(t) == 0, "cancelled it");
+	unit_check(thread_task_join(t, &result) == 0, "joined it");
+	unit_check(result == NULL, "it did not run");
+	unit_fail_if(thread_task_delete(t) != 0);
+	/*
+	 * A periodic task repeats until cancelled.
+	 */
+	arg = 0;
+	unit_fail_if(thread_task_new(&t, task_incr_f, &arg) != 0);
+	unit_check(thread_pool_push_task_periodic(p, t, 0.005) == 0,
+		   "pushed a periodic task");
+	unit_check(thread_task_delete(t) == TPOOL_ERR_TASK_IN_POOL,
+		   "periodic task is in the pool");
+	while (__atomic_load_n(&arg, __ATOMIC_RELAXED) < 3)
+		usleep(100);
+	unit_check(true, "it ran several times");
+	unit_check(thread_task_cancel(t) == 0, "cancelled it");
+	unit_check(thread_task_join(t, &result) == 0, "joined it");
+	unit_fail_if(thread_task_delete(t) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+#endif
+}
+
+static void
+test_spin_wait(void)
+{
+#if NEED_SPIN_WAIT
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_task *t;
+	int arg = 0;
+	void *result;
+	unit_check(thread_pool_new_ex(3, -1, &p) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "negative spin limit");
+	unit_check(thread_pool_new_ex(3, 0, &p) == 0,
+		   "spinning can be turned off");
+	unit_fail_if(thread_task_new(&t, task_incr_f, &arg) != 0);
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_fail_if(thread_task_join(t, &result) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+	unit_check(thread_pool_new_ex(3, 100000, &p) == 0,
+		   "a large spin limit works too");
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_fail_if(thread_task_join(t, &result) != 0);
+	unit_check(arg == 2, "tasks ran under both policies");
+	unit_fail_if(thread_task_delete(t) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+#endif
+}
+
+static void
+test_worker_scaling(void)
+{
+#if NEED_WORKER_SCALING
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_check(thread_pool_new_scaled(3, 2, 0.1, &p) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "min above max");
+	unit_check(thread_pool_new_scaled(1, 5, 0, &p) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "zero timeout");
+	unit_fail_if(thread_pool_new_scaled(1, 5, 0.05, &p) != 0);
+
+	/* A burst of blocked tasks fans out to several workers. */
+	const int count = 5;
+	struct thread_task *tasks[5];
+	int arg = 0;
+	void *result;
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i], task_wait_for_f,
+					     &arg) != 0);
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+		/* Occupy a worker before the next push so one more
+		 * is spawned for it. */
+		while (!thread_task_is_running(tasks[i]))
+			usleep(100);
+	}
+	unit_check(thread_pool_thread_count(p) == count,
+		   "the burst grew the pool to max");
+	__atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+
+	/* The surplus workers give up after the idle timeout. */
+	for (int i = 0; i < 100 && thread_pool_thread_count(p) > 1; ++i)
+		usleep(10000);
+	unit_check(thread_pool_thread_count(p) == 1,
+		   "idle surplus retired down to min");
+
+	/* The pool still works and regrows on demand. */
+	arg = 0;
+	unit_fail_if(thread_task_new(&tasks[0], task_incr_f, &arg) != 0);
+	unit_fail_if(thread_pool_push_task(p, tasks[0]) != 0);
+	unit_fail_if(thread_task_join(tasks[0], &result) != 0);
+	unit_check(arg == 1, "a task after the shrink runs fine");
+	unit_fail_if(thread_task_delete(tasks[0]) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+#endif
+}
+
+static void
+test_fast_spawn(void)
+{
+#if NEED_FAST_SPAWN
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_check(thread_pool_new_fast_spawn(3, 2, 0.1, &p) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "min above max");
+	unit_check(thread_pool_new_fast_spawn(1, 5, 0, &p) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "zero timeout");
+	unit_fail_if(thread_pool_new_fast_spawn(1, 5, 0.05, &p) != 0);
+
+	/* Several retire-respawn rounds, all on the pre-mapped stacks. */
+	const int count = 5;
+	struct thread_task *tasks[5];
+	void *result;
+	for (int round = 0; round < 3; ++round) {
+		int arg = 0;
+		for (int i = 0; i < count; ++i) {
+			unit_fail_if(thread_task_new(&tasks[i],
+						     task_wait_for_f,
+						     &arg) != 0);
+			unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+			while (!thread_task_is_running(tasks[i]))
+				usleep(100);
+		}
+		unit_fail_if(thread_pool_thread_count(p) != count);
+		__atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+		for (int i = 0; i < count; ++i) {
+			unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+			unit_fail_if(thread_task_delete(tasks[i]) != 0);
+		}
+		for (int i = 0; i < 100 && thread_pool_thread_count(p) > 1;
+		     ++i)
+			usleep(10000);
+		unit_fail_if(thread_pool_thread_count(p) != 1);
+	}
+	unit_check(true, "workers survive retire-respawn churn");
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+#endif
+}
+
+struct order_record {
+	int id;
+	int *log;
+	int *pos;
+};
+
+static void *
+task_order_f(void *arg)
+{
+	struct order_record *rec = arg;
+	rec->log[__atomic_fetch_add(rec->pos, 1, __ATOMIC_RELAXED)] = rec->id;
+	return arg;
+}
+
+static void
+test_priorities(void)
+{
+#if NEED_TASK_PRIORITY
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_task *t;
+	unit_check(thread_task_new_prio(&t, task_incr_f, NULL,
+		   TPOOL_PRIO_COUNT) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "unknown lane");
+
+	/*
+	 * One worker, blocked - everything pushed meanwhile queues up
+	 * behind it in a deterministic order.
+	 */
+	unit_fail_if(thread_pool_new(1, &p) != 0);
+	int gate = 0;
+	struct thread_task *blocker;
+	unit_fail_if(thread_task_new(&blocker, task_wait_for_f, &gate) != 0);
+	unit_fail_if(thread_pool_push_task(p, blocker) != 0);
+	while (!thread_task_is_running(blocker))
+		usleep(100);
+
+	enum { COUNT = 21 };
+	struct thread_task *tasks[COUNT];
+	struct order_record recs[COUNT];
+	int log[COUNT];
+	int pos = 0;
+	/* Bulk backlog first, the urgent task last, one low in the mix. */
+	for (int i = 0; i < COUNT; ++i) {
+		recs[i].id = i;
+		recs[i].log = log;
+		recs[i].pos = &pos;
+		int prio = TPOOL_PRIO_NORMAL;
+		if (i == COUNT - 1)
+			prio = TPOOL_PRIO_HIGH;
+		else if (i == 0)
+			prio = TPOOL_PRIO_LOW;
+		unit_fail_if(thread_task_new_prio(&tasks[i], task_order_f,
+						  &recs[i], prio) != 0);
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+	}
+	__atomic_store_n(&gate, 1, __ATOMIC_RELAXED);
+	void *result;
+	unit_fail_if(thread_task_join(blocker, &result) != 0);
+	unit_fail_if(thread_task_delete(blocker) != 0);
+	for (int i = 0; i < COUNT; ++i) {
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	unit_check(log[0] == COUNT - 1,
+		   "the high task overtook the whole backlog");
+	int low_at = -1;
+	for (int i = 0; i < COUNT; ++i) {
+		if (log[i] == 0)
+			low_at = i;
+	}
+	unit_check(low_at > 0 && low_at < COUNT - 1,
+		   "the low task was promoted past part of the backlog");
+	bool fifo = true;
+	int prev = 0;
+	for (int i = 1; i < COUNT; ++i) {
+		if (log[i] == 0 || log[i] == COUNT - 1)
+			continue;
+		fifo = fifo && log[i] > prev;
+		prev = log[i];
+	}
+	unit_check(fifo, "the normal lane stayed FIFO");
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+#endif
+}
+
+static void
+test_keyed(void)
+{
+#if NEED_KEYED_TASKS
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(5, &p) != 0);
+
+	/* Different keys are not serialized against each other. */
+	int gate = 0;
+	void *result;
+	struct thread_task *b1, *b2;
+	unit_fail_if(thread_task_new(&b1, task_wait_for_f, &gate) != 0);
+	unit_fail_if(thread_task_new(&b2, task_wait_for_f, &gate) != 0);
+	unit_fail_if(thread_pool_push_task_keyed(p, b1, 1) != 0);
+	/* Occupy a worker first so the next push spawns another. */
+	while (!thread_task_is_running(b1))
+		usleep(100);
+	unit_fail_if(thread_pool_push_task_keyed(p, b2, 2) != 0);
+	while (!thread_task_is_running(b2))
+		usleep(100);
+	unit_check(true, "two keys run concurrently");
+	__atomic_store_n(&gate, 1, __ATOMIC_RELAXED);
+	unit_fail_if(thread_task_join(b1, &result) != 0);
+	unit_fail_if(thread_task_join(b2, &result) != 0);
+	unit_fail_if(thread_task_delete(b2) != 0);
+
+	/*
+	 * One key stays strictly ordered across all the workers. The
+	 * blocker holds the stream so the deletion check is not racy.
+	 */
+	enum { COUNT = 200 };
+	struct thread_task *tasks[COUNT];
+	struct order_record recs[COUNT];
+	int log[COUNT];
+	int pos = 0;
+	__atomic_store_n(&gate, 0, __ATOMIC_RELAXED);
+	unit_fail_if(thread_pool_push_task_keyed(p, b1, 7) != 0);
+	for (int i = 0; i < COUNT; ++i) {
+		recs[i].id = i;
+		recs[i].log = log;
+		recs[i].pos = &pos;
+		unit_fail_if(thread_task_new(&tasks[i], task_order_f,
+					     &recs[i]) != 0);
+		unit_fail_if(thread_pool_push_task_keyed(p, tasks[i], 7) != 0);
+	}
+	unit_check(thread_pool_delete(p) == TPOOL_ERR_HAS_TASKS,
+		   "waiting keyed tasks block deletion");
+	__atomic_store_n(&gate, 1, __ATOMIC_RELAXED);
+	unit_fail_if(thread_task_join(b1, &result) != 0);
+	unit_fail_if(thread_task_delete(b1) != 0);
+	for (int i = 0; i < COUNT; ++i) {
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	bool ordered = true;
+	for (int i = 0; i < COUNT; ++i)
+		ordered = ordered && log[i] == i;
+	unit_check(ordered, "one key runs in push order");
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+#endif
+}
+
+static void
+range_incr_f(size_t begin, size_t end, void *ctx)
+{
+	unsigned char *data = ctx;
+	for (size_t i = begin; i < end; ++i)
+		__atomic_add_fetch(&data[i], 1, __ATOMIC_RELAXED);
+}
+
+static void
+test_parallel_for(void)
+{
+#if NEED_PARALLEL_FOR
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	unit_check(thread_pool_parallel_for(p, 0, 10, 0, range_incr_f,
+		   NULL) == TPOOL_ERR_INVALID_ARGUMENT, "zero grain");
+	unit_check(thread_pool_parallel_for(p, 10, 0, 1, range_incr_f,
+		   NULL) == TPOOL_ERR_INVALID_ARGUMENT, "begin past end");
+	unit_check(thread_pool_parallel_for(p, 5, 5, 1, range_incr_f,
+		   NULL) == 0, "an empty range is a no-op");
+
+	const size_t count = 1000 * 1000;
+	unsigned char *data = calloc(count, 1);
+	unit_fail_if(data == NULL);
+	unit_check(thread_pool_parallel_for(p, 0, count, 4096,
+		   range_incr_f, data) == 0, "a big range");
+	size_t touched_once = 0;
+	for (size_t i = 0; i < count; ++i)
+		touched_once += data[i] == 1;
+	unit_check(touched_once == count,
+		   "every item exactly once, no overlaps, no holes");
+
+	/* A range smaller than one grain runs on the caller alone. */
+	memset(data, 0, count);
+	unit_check(thread_pool_parallel_for(p, 100, 200, 4096,
+		   range_incr_f, data) == 0, "a tiny range");
+	touched_once = 0;
+	for (size_t i = 100; i < 200; ++i)
+		touched_once += data[i] == 1;
+	unit_check(touched_once == 100 && data[99] == 0 && data[200] == 0,
+		   "the tiny range stayed in its borders");
+	free(data);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+#endif
+}
+
+static void *
+task_run_until_cancelled_f(void *arg)
+{
+	struct thread_task **task = arg;
+	while (!thread_task_is_cancelled(*task))
+		usleep(100);
+	return arg;
+}
+
+static void
+test_cancel(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_task *t, *blocker;
+	void *result;
+	int arg = 0;
+	int gate = 0;
+	unit_fail_if(thread_pool_new(1, &p) != 0);
+	unit_fail_if(thread_task_new(&t, task_incr_f, &arg) != 0);
+	unit_check(thread_task_cancel(t) == TPOOL_ERR_TASK_NOT_PUSHED,
+		   "can't cancel a not pushed task");
+	/*
+	 * A queued task is unlinked without ever running.
+	 */
+	unit_fail_if(thread_task_new(&blocker, task_wait_for_f, &gate) != 0);
+	unit_fail_if(thread_pool_push_task(p, blocker) != 0);
+	while (!thread_task_is_running(blocker))
+		usleep(100);
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_check(thread_task_cancel(t) == 0, "cancelled a queued task");
+	unit_check(thread_task_is_finished(t), "it is finished right away");
+	unit_check(thread_task_join(t, &result) == 0 && result == NULL,
+		   "joined, with a NULL result");
+	unit_fail_if(thread_task_delete(t) != 0);
+	__atomic_store_n(&gate, 1, __ATOMIC_RELAXED);
+	unit_fail_if(thread_task_join(blocker, &result) != 0);
+	unit_check(__atomic_load_n(&arg, __ATOMIC_RELAXED) == 0,
+		   "the cancelled task never ran");
+	/*
+	 * A running task is only marked and returns on its own.
+	 */
+	struct thread_task *r;
+	unit_fail_if(thread_task_new(&r, task_run_until_cancelled_f,
+				     &r) != 0);
+	unit_fail_if(thread_pool_push_task(p, r) != 0);
+	while (!thread_task_is_running(r))
+		usleep(100);
+	unit_check(!thread_task_is_cancelled(r), "not marked before cancel");
+	unit_check(thread_task_cancel(r) == 0, "cancelled a running task");
+	unit_check(thread_task_join(r, &result) == 0 && result == &r,
+		   "it finished by itself, with its own result");
+	unit_fail_if(thread_task_delete(r) != 0);
+	/*
+	 * A cancelled keyed waiter is skipped, its successors still run.
+	 */
+	__atomic_store_n(&gate, 0, __ATOMIC_RELAXED);
+	unit_fail_if(thread_pool_push_task_keyed(p, blocker, 7) != 0);
+	while (!thread_task_is_running(blocker))
+		usleep(100);
+	struct thread_task *w1, *w2, *w3;
+	unit_fail_if(thread_task_new(&w1, task_incr_f, &arg) != 0);
+	unit_fail_if(thread_task_new(&w2, task_incr_f, &arg) != 0);
+	unit_fail_if(thread_task_new(&w3, task_incr_f, &arg) != 0);
+	unit_fail_if(thread_pool_push_task_keyed(p, w1, 7) != 0);
+	unit_fail_if(thread_pool_push_task_keyed(p, w2, 7) != 0);
+	unit_fail_if(thread_pool_push_task_keyed(p, w3, 7) != 0);
+	unit_check(thread_task_cancel(w2) == 0, "cancelled a keyed waiter");
+	unit_check(thread_task_is_finished(w2),
+		   "the waiter finished right away");
+	__atomic_store_n(&gate, 1, __ATOMIC_RELAXED);
+	unit_fail_if(thread_task_join(blocker, &result) != 0);
+	unit_fail_if(thread_task_join(w1, &result) != 0);
+	unit_fail_if(thread_task_join(w3, &result) != 0);
+	unit_check(thread_task_join(w2, &result) == 0 && result == NULL,
+		   "the waiter joined with a NULL result");
+	unit_check(__atomic_load_n(&arg, __ATOMIC_RELAXED) == 2,
+		   "the other waiters ran, the cancelled one did not");
+	unit_fail_if(thread_task_delete(blocker) != 0);
+	unit_fail_if(thread_task_delete(w1) != 0);
+	unit_fail_if(thread_task_delete(w2) != 0);
+	unit_fail_if(thread_task_delete(w3) != 0);
+	unit_check(thread_pool_delete(p) == 0, "nothing is left in the pool");
+
+	unit_test_finish();
+}
+
+static void
+test_stats(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_pool_stats st;
+	unit_fail_if(thread_pool_new(3, &p) != 0);
+	unit_check(thread_pool_stats_get(NULL, &st) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "no pool");
+	unit_check(thread_pool_stats_get(p, NULL) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "no stats");
+	unit_fail_if(thread_pool_stats_get(p, &st) != 0);
+	unit_check(st.submitted == 0 && st.completed == 0 &&
+		   st.queue_depth == 0 && st.thread_count == 0 &&
+		   st.busy_count == 0, "a fresh pool is all zeros");
+
+	const int count = 100;
+	int arg = 0;
+	void *result;
+	struct thread_task *tasks[100];
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i], task_incr_f,
+					     &arg) != 0);
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+	}
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	unit_fail_if(thread_pool_stats_get(p, &st) != 0);
+	unit_check(st.submitted == (uint64_t)count, "all pushes are counted");
+	unit_check(st.completed == (uint64_t)count,
+		   "all completions are counted");
+	unit_check(st.queue_depth == 0 && st.busy_count == 0,
+		   "nothing left in flight");
+	uint64_t waits = 0;
+	uint64_t execs = 0;
+	for (int i = 0; i < TPOOL_STAT_BUCKETS; ++i) {
+		waits += st.wait_hist[i];
+		execs += st.exec_hist[i];
+	}
+	unit_check(waits == (uint64_t)count && execs == (uint64_t)count,
+		   "each task landed in one bucket of each histogram");
+	/*
+	 * A blocked task shows up as a busy worker.
+	 */
+	struct thread_task *t;
+	int gate = 0;
+	unit_fail_if(thread_task_new(&t, task_wait_for_f, &gate) != 0);
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	while (!thread_task_is_running(t))
+		usleep(100);
+	unit_fail_if(thread_pool_stats_get(p, &st) != 0);
+	unit_check(st.submitted == (uint64_t)count + 1 && st.busy_count == 1,
+		   "one busy worker while its task runs");
+	__atomic_store_n(&gate, 1, __ATOMIC_RELAXED);
+	unit_fail_if(thread_task_join(t, &result) != 0);
+	unit_fail_if(thread_task_delete(t) != 0);
+	unit_fail_if(thread_pool_stats_get(p, &st) != 0);
+	unit_check(st.completed == (uint64_t)count + 1 && st.busy_ns > 0,
+		   "busy time got accounted");
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_push_many(void)
+{
+#if NEED_PUSH_MANY
+	unit_test_start();
+
+	const int count = 1000;
+	struct thread_pool *p;
+	struct thread_task **tasks = malloc(sizeof(*tasks) * count);
+	int arg = 0;
+	void *result;
+	unit_fail_if(thread_pool_new(5, &p) != 0);
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_new(&tasks[i], task_incr_f, &arg) != 0);
+	unit_check(thread_pool_push_task_many(p, tasks, count) == 0,
+		   "pushed a batch");
+	unit_check(thread_pool_push_task_many(p, tasks, count) ==
+		   TPOOL_ERR_TASK_IN_POOL, "can't push the batch twice");
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+		unit_fail_if(result != &arg);
+	}
+	unit_check(__atomic_load_n(&arg, __ATOMIC_RELAXED) == count,
+		   "all batch tasks ran");
+	/*
+	 * The batch either fits entirely or is rejected entirely.
+	 */
+	unit_check(thread_pool_push_task_many(p, tasks,
+		   TPOOL_MAX_TASKS + 1) == TPOOL_ERR_TOO_MANY_TASKS,
+		   "too big a batch");
+	unit_check(thread_task_delete(tasks[0]) == 0,
+		   "a rejected task is not in the pool");
+	for (int i = 1; i < count; ++i)
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	free(tasks);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+#endif
+}
+
+static void
+test_then(void)
+{
+#if NEED_TASK_THEN
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_task *t1, *t2;
+	int arg = 0;
+	void *result;
+	unit_fail_if(thread_pool_new(3, &p) != 0);
+	unit_fail_if(thread_task_new(&t1, task_incr_f, &arg) != 0);
+	unit_fail_if(thread_task_new(&t2, task_incr_f, &arg) != 0);
+	unit_check(thread_task_then(t1, t2) == TPOOL_ERR_TASK_NOT_PUSHED,
+		   "continuation needs a pushed task");
+	unit_check(thread_pool_push_task(p, t1) == 0, "pushed the first task");
+	unit_check(thread_task_then(t1, t2) == 0, "attached a continuation");
+	unit_check(thread_task_delete(t2) == TPOOL_ERR_TASK_IN_POOL,
+		   "continuation counts as in the pool");
+	unit_check(thread_task_join(t2, &result) == 0,
+		   "joined the continuation");
+	unit_check(arg == 2, "both tasks ran");
+	unit_fail_if(thread_task_join(t1, &result) != 0);
+	/*
+	 * Chaining onto an already finished task enqueues right away.
+	 */
+	unit_check(thread_task_then(t1, t2) == 0,
+		   "chained onto a finished task");
+	unit_check(thread_task_join(t2, &result) == 0, "joined it again");
+	unit_check(arg == 3, "it ran again");
+	unit_fail_if(thread_task_delete(t1) != 0);
+	unit_fail_if(thread_task_delete(t2) != 0);
+	/*
+	 * A chain of blocked tasks keeps the pool busy till the end.
+	 */
+	arg = 0;
+	unit_fail_if(thread_task_new(&t1, task_wait_for_f, &arg) != 0);
+	unit_fail_if(thread_task_new(&t2, task_incr_f, &arg) != 0);
+	unit_fail_if(thread_pool_push_task(p, t1) != 0);
+	unit_fail_if(thread_task_then(t1, t2) != 0);
+	unit_check(thread_pool_delete(p) == TPOOL_ERR_HAS_TASKS,
+		   "can't delete with a pending chain");
+	__atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+	unit_check(thread_task_join(t2, &result) == 0, "joined the chain");
+	unit_check(arg == 2, "the continuation ran after the unblock");
+	unit_fail_if(thread_task_join(t1, &result) != 0);
+	unit_fail_if(thread_task_delete(t1) != 0);
+	unit_fail_if(thread_task_delete(t2) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+#endif
+}
 
 static void
 test_timed_join(void)
@@ -363,6 +1183,80 @@ test_detach_long(void)
 #endif
 }
 
+static int
+ppool_task_square_f(const void *arg, size_t arg_size, void *ret)
+{
+	if (arg_size != sizeof(int))
+		return -1;
+	int value;
+	memcpy(&value, arg, sizeof(value));
+	value *= value;
+	memcpy(ret, &value, sizeof(value));
+	return sizeof(value);
+}
+
+static int
+ppool_task_crash_f(const void *arg, size_t arg_size, void *ret)
+{
+	(void)arg;
+	(void)arg_size;
+	(void)ret;
+	/* Dies inside an isolated worker - the pool must survive. */
+	*(volatile int *)NULL = 42;
+	return 0;
+}
+
+static void
+test_process_pool(void)
+{
+	unit_test_start();
+
+	struct process_pool *p;
+	unit_check(process_pool_new(0, &p) == PPOOL_ERR_INVALID_ARGUMENT,
+		   "bad worker count");
+	unit_check(process_pool_new(2, &p) == 0, "new");
+	char big[PPOOL_ARG_MAX + 1];
+	int ticket;
+	unit_check(process_pool_push(p, ppool_task_square_f, big,
+				     sizeof(big), &ticket) ==
+		   PPOOL_ERR_INVALID_ARGUMENT, "arg too big");
+
+	int tickets[16];
+	for (int i = 0; i < 16; ++i) {
+		int arg = i;
+		unit_fail_if(process_pool_push(p, ppool_task_square_f, &arg,
+					       sizeof(arg),
+					       &tickets[i]) != 0);
+	}
+	for (int i = 0; i < 16; ++i) {
+		int result = -1;
+		int result_size = 0;
+		unit_fail_if(process_pool_join(p, tickets[i], &result,
+					       &result_size) != 0);
+		unit_fail_if(result_size != sizeof(result));
+		unit_fail_if(result != i * i);
+	}
+	unit_check(true, "16 tasks did their math in the workers");
+	unit_check(process_pool_join(p, tickets[0], NULL, NULL) ==
+		   PPOOL_ERR_INVALID_ARGUMENT, "double join");
+
+	/* A crash takes down one task, not the pool. */
+	unit_fail_if(process_pool_push(p, ppool_task_crash_f, NULL, 0,
+				       &ticket) != 0);
+	unit_check(process_pool_join(p, ticket, NULL, NULL) ==
+		   PPOOL_ERR_CRASHED, "crashed task is reported");
+	int arg = 9;
+	int result = -1;
+	unit_fail_if(process_pool_push(p, ppool_task_square_f, &arg,
+				       sizeof(arg), &ticket) != 0);
+	unit_fail_if(process_pool_join(p, ticket, &result, NULL) != 0);
+	unit_check(result == 81, "the pool works after the crash");
+
+	process_pool_delete(p);
+
+	unit_test_finish();
+}
+
 int
 main(int argc, char **argv)
 {
@@ -383,9 +1277,23 @@ main(int argc, char **argv)
 	test_push();
 	test_thread_pool_delete();
 	test_thread_pool_max_tasks();
+	test_overflow();
+	test_affinity();
+	test_push_many();
+	test_priorities();
+	test_keyed();
+	test_parallel_for();
+	test_cancel();
+	test_stats();
+	test_then();
+	test_spin_wait();
+	test_worker_scaling();
+	test_fast_spawn();
+	test_delayed();
 	test_timed_join();
 	test_detach_stress();
 	test_detach_long();
+	test_process_pool();
 
 	unit_test_finish();
 	return 0;
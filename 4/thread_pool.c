@@ -1,11 +1,67 @@
+/* For pthread_setaffinity_np(), sched_getcpu() and CPU_SET(). */
+#define _GNU_SOURCE
+
 #include "thread_pool.h"
+#include "clock.h"
+#include "cputopo.h"
+#include "slab.h"
+#include "trace.h"
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <stdio.h>
+#include <sched.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 
 
 enum task_state { TASK_NEW, TASK_QUEUED, TASK_RUNNING, TASK_DONE };
 
+/*
+ * Layout of the task's state word: the low byte is the task_state,
+ * the flag above it marks parked joiners. The word doubles as the
+ * futex the joiners sleep on - one 4-byte atomic instead of a
+ * pthread mutex plus condvar per task, with no init/destroy pair.
+ */
+enum { TASK_STATE_MASK = 0xff, TASK_HAS_WAITERS = 0x100 };
+
+static inline enum task_state
+task_state_of(uint32_t word) {
+    return (enum task_state)(word & TASK_STATE_MASK);
+}
+
+static void
+futex_wait(_Atomic uint32_t *word, uint32_t expected,
+           const struct timespec *timeout) {
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected, timeout, NULL, 0);
+}
+
+static void
+futex_wake_all(_Atomic uint32_t *word) {
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, 0);
+}
+
+/*
+ * Change the state of an in-pool task, keeping the waiter flag - a
+ * plain store would erase it and the completion would then skip the
+ * wakeup of an already parked joiner.
+ */
+static void
+task_set_state(_Atomic uint32_t *word, enum task_state state) {
+    uint32_t old = atomic_load(word);
+    while (!atomic_compare_exchange_weak(word, &old,
+            (old & TASK_HAS_WAITERS) | state))
+        ;
+}
+
+struct task_queue;
 
 struct thread_task {
     thread_task_f function;
@@ -14,22 +70,203 @@ struct thread_task {
     void *result;
     struct thread_pool *owner;
     struct thread_task *next;
-    enum task_state state;
+    /** Previous task of its lane - makes a cancel unlink O(1). */
+    struct thread_task *prev;
+    /**
+     * Worker queue holding the task, NULL unless queued. Written
+     * under that queue's lock; cancel reads it optimistically and
+     * re-checks under the lock.
+     */
+    struct task_queue *_Atomic queue;
+    /** Set by thread_task_cancel(), polled by a cooperative task. */
+    atomic_bool cancelled;
+    /** The state word, see TASK_STATE_MASK. Joiners park on it. */
+    _Atomic uint32_t state;
+    /**
+     * True from push until join. The state alone can not answer "is
+     * it still in the pool" - an instant task can reach TASK_DONE
+     * before the pusher even returns, but it stays the pool's until
+     * someone joins it.
+     */
+    atomic_bool in_pool;
+    /**
+     * Task to enqueue when this one completes. Sealed (see
+     * TASK_CONT_SEALED) at completion; the exchange decides whether
+     * the completer or thread_task_then() does the enqueue, so it
+     * happens exactly once.
+     */
+    struct thread_task *_Atomic continuation;
+    /** Seconds between runs for a periodic task, 0 for one-shot. */
+    double period;
+    /** When the timer fires. Guarded by the pool's timer_lock. */
+    struct timespec deadline;
+    /** Position in the timer heap, -1 when not scheduled. */
+    int timer_index;
+    /** Set by thread_task_cancel(). Guarded by timer_lock. */
+    bool timer_cancelled;
+    /** Lane the task is queued into, TPOOL_PRIO_*. */
+    int prio;
+    /** Serial queue of a keyed task, NULL for the ordinary ones. */
+    struct serial_queue *_Atomic serial;
+    /** When the task entered the worker queues, for the stats. */
+    struct timespec queued_at;
+};
+
+/*
+ * Continuation slot value meaning the task stopped accepting one -
+ * it is completing right now. thread_task_then() then enqueues the
+ * new continuation itself.
+ */
+static struct thread_task *const TASK_CONT_SEALED =
+    &(struct thread_task){0};
+
+/*
+ * Tasks pushed with the same key run one after another in push
+ * order; only the head of each key is ever in the worker queues, the
+ * rest wait here. The worker which completes the head moves the next
+ * waiter into the queues, like a continuation - the ordering costs
+ * no application-level lock and no parked thread. Guarded by the
+ * pool's serial_lock.
+ */
+struct serial_queue {
+    uint64_t key;
+    /** Waiting tasks, excluding the one in the worker queues. */
+    struct thread_task *first;
+    struct thread_task *last;
+    /** Hash chain of the key map. */
+    struct serial_queue *next;
+};
+
+/*
+ * A per-worker-slot task queue. The single pool-wide list guarded by
+ * pool->sync was the top contention point with 20 threads; pushes
+ * now go round-robin into these queues and each push/pop touches one
+ * small lock, almost always uncontended. A worker drains its own
+ * queue first and steals from the other slots when it runs dry, so
+ * tasks pushed into a slot whose worker is busy (or not created yet)
+ * still get picked up.
+ *
+ * Each queue is a small set of FIFO lanes, one per priority. A pop
+ * takes from the highest non-empty lane, so an urgent task overtakes
+ * the whole bulk backlog of its slot; the priority is per slot, not
+ * pool-wide, which keeps the push and pop paths as cheap as the
+ * single-lane ones were.
+ */
+struct task_queue {
+    struct thread_task *first[TPOOL_PRIO_COUNT];
+    struct thread_task *last[TPOOL_PRIO_COUNT];
+    /** Atomic so an empty queue can be skipped without locking. */
+    atomic_int size;
+    /** Pops so far, drives the anti-starvation pass. */
+    unsigned pop_count;
     pthread_mutex_t lock;
-    pthread_cond_t cond;
 };
 
+/*
+ * Telemetry of one worker. Only its own thread writes these, with
+ * relaxed atomics, so the hot path pays a couple of uncontended
+ * increments; thread_pool_stats_get() aggregates over the slots.
+ */
+struct worker_stats {
+    _Atomic uint64_t completed;
+    _Atomic uint64_t busy_ns;
+    _Atomic uint64_t wait_hist[TPOOL_STAT_BUCKETS];
+    _Atomic uint64_t exec_hist[TPOOL_STAT_BUCKETS];
+};
+
+struct worker_ctx {
+    struct thread_pool *pool;
+    int index;
+    struct worker_stats stats;
+} __attribute__((aligned(64)));
+
+/**
+ * Life cycle of a worker slot, tracked under sync. A retired worker
+ * has exited (or is about to) and its thread is joined before the
+ * slot is reused or the pool is deleted.
+ */
+enum slot_state { SLOT_EMPTY, SLOT_RUNNING, SLOT_RETIRED };
+
 struct thread_pool {
     pthread_t *threads;
+    struct worker_ctx *worker_ctxs;
+    /** One queue per worker slot, created workers or not. */
+    struct task_queue *queues;
+    /** Per-slot life cycle, guarded by sync. */
+    enum slot_state *slot_states;
 
+    /** Workers below this count never retire. */
+    int min_threads;
     int max_threads;
-    int threads_created;
-    int threads_busy;
+    /**
+     * Seconds a surplus worker stays parked before it exits. 0 means
+     * workers are kept forever, the pre-scaling behavior.
+     */
+    double idle_timeout;
+    /** Iterations to spin before parking on a condvar. */
+    int spin_limit;
+    /** What a push into a full pool does, TPOOL_OVERFLOW_*. */
+    enum thread_pool_overflow_policy overflow_policy;
+
+    /** True for a thread_pool_new_fast_spawn() pool. */
+    bool fast_spawn;
+    /**
+     * Pre-mapped worker stacks, one per slot, guard page below.
+     * Mapped on the slot's first spawn, reused by every following
+     * worker generation of the slot. Guarded by sync, like the slot
+     * states.
+     */
+    void **slot_stacks;
+
+    /** True for a thread_pool_new_pinned() pool. */
+    bool pinned;
+    /** Pinned CPU of each worker slot. */
+    int *slot_cpus;
+    /** NUMA node of each slot's CPU, -1 unknown. */
+    int *slot_nodes;
+    /** Node of every CPU a submitter may run on, -1 unknown. */
+    int *cpu_nodes;
+    int cpu_node_count;
+    atomic_int threads_created;
+    atomic_int threads_busy;
+
+    /** Queued, not yet claimed tasks. */
+    atomic_int task_total;
+    /** Round-robin cursor of the push target slot. */
+    atomic_uint push_cursor;
+
+    /**
+     * Workers parked on task_available. Modified under sync; read
+     * without it on the push path to skip the lock when nobody
+     * sleeps.
+     */
+    atomic_int sleeping_workers;
+
+    /**
+     * Min-heap of scheduled tasks ordered by deadline, serviced by
+     * whichever worker is awake or wakes up on the nearest one.
+     */
+    struct thread_task **timer_heap;
+    int timer_heap_size;
+    int timer_heap_capacity;
+    pthread_mutex_t timer_lock;
+    /** Mirrors timer_heap_size, readable without timer_lock. */
+    atomic_int timer_count;
 
-    struct thread_task *task_first;
-    struct thread_task *task_last;
-    int task_total;
+    /**
+     * Key map of the serial queues, created on the first keyed push.
+     * A queue exists exactly while a task of its key is queued or
+     * running. Guarded by serial_lock.
+     */
+    struct serial_queue **serial_map;
+    pthread_mutex_t serial_lock;
+    /** Keyed tasks waiting behind their key's head. */
+    atomic_int keyed_count;
 
+    /** Tasks ever pushed, all push flavors together. */
+    _Atomic uint64_t submitted;
+
+    /** Guards sleeping, thread creation and shutdown only. */
     pthread_mutex_t sync;
     pthread_cond_t task_available;
     pthread_cond_t all_tasks_done;
@@ -38,88 +275,1006 @@ struct thread_pool {
 };
 
 
-static void *worker_loop(void *data) {
-    struct thread_pool *pool = (struct thread_pool *)data;
+/** Default spin budget of thread_pool_new(). */
+enum { TPOOL_DEFAULT_SPIN = 256 };
+
+/** Every this many pops a queue serves its lanes bottom-up. */
+enum { TPOOL_PROMOTE_PERIOD = 16 };
+
+/** Bucket count of the serial key map, a power of two. */
+enum { TPOOL_SERIAL_BUCKETS = 256 };
+
+/** Size of a pre-mapped worker stack, excluding the guard page. */
+enum { TPOOL_WORKER_STACK_SIZE = 512 * 1024 };
+
+static inline void
+cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile("yield");
+#else
+    __asm__ volatile("" ::: "memory");
+#endif
+}
+
+/*
+ * Spin with exponential backoff for up to @a limit iterations,
+ * waiting for @a flag to become non-zero. Returns true if it did -
+ * the caller then skips the kernel sleep entirely.
+ */
+static bool
+spin_wait(const atomic_int *flag, int limit) {
+    int spun = 0;
+    int backoff = 1;
+    while (spun < limit) {
+        if (atomic_load(flag) != 0)
+            return true;
+        for (int i = 0; i < backoff; ++i)
+            cpu_relax();
+        spun += backoff;
+        if (backoff < 64)
+            backoff *= 2;
+    }
+    return atomic_load(flag) != 0;
+}
+
+static uint64_t
+timespec_diff_ns(const struct timespec *from, const struct timespec *to) {
+    int64_t ns = (int64_t)(to->tv_sec - from->tv_sec) * 1000000000 +
+        (to->tv_nsec - from->tv_nsec);
+    return ns > 0 ? (uint64_t)ns : 0;
+}
+
+/** Histogram bucket of a duration: log2 of the microseconds. */
+static int
+stat_bucket_of(uint64_t ns) {
+    uint64_t us = ns / 1000;
+    int bucket = 0;
+    while (us > 0 && bucket < TPOOL_STAT_BUCKETS - 1) {
+        us >>= 1;
+        ++bucket;
+    }
+    return bucket;
+}
+
+static void
+worker_stats_account(struct worker_stats *stats,
+                     const struct timespec *queued,
+                     const struct timespec *started,
+                     const struct timespec *done) {
+    uint64_t wait_ns = timespec_diff_ns(queued, started);
+    uint64_t exec_ns = timespec_diff_ns(started, done);
+    atomic_fetch_add_explicit(&stats->completed, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->busy_ns, exec_ns,
+        memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->wait_hist[stat_bucket_of(wait_ns)],
+        1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->exec_hist[stat_bucket_of(exec_ns)],
+        1, memory_order_relaxed);
+}
+
+static bool
+timespec_le(const struct timespec *a, const struct timespec *b) {
+    if (a->tv_sec != b->tv_sec)
+        return a->tv_sec < b->tv_sec;
+    return a->tv_nsec <= b->tv_nsec;
+}
+
+static struct timespec
+deadline_in(double seconds) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    time_t sec = (time_t)seconds;
+    ts.tv_sec += sec;
+    ts.tv_nsec += (long)((seconds - (double)sec) * 1e9);
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_nsec -= 1000000000;
+        ts.tv_sec++;
+    }
+    return ts;
+}
 
+/** Timer heap helpers, all called under timer_lock. */
+
+static void
+timer_heap_swap(struct thread_pool *pool, int a, int b) {
+    struct thread_task *tmp = pool->timer_heap[a];
+    pool->timer_heap[a] = pool->timer_heap[b];
+    pool->timer_heap[b] = tmp;
+    pool->timer_heap[a]->timer_index = a;
+    pool->timer_heap[b]->timer_index = b;
+}
+
+static void
+timer_heap_sift_up(struct thread_pool *pool, int i) {
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (timespec_le(&pool->timer_heap[parent]->deadline,
+                        &pool->timer_heap[i]->deadline))
+            break;
+        timer_heap_swap(pool, i, parent);
+        i = parent;
+    }
+}
+
+static void
+timer_heap_sift_down(struct thread_pool *pool, int i) {
     while (1) {
-        pthread_mutex_lock(&pool->sync);
+        int min = i;
+        for (int child = i * 2 + 1; child <= i * 2 + 2; ++child) {
+            if (child < pool->timer_heap_size &&
+                !timespec_le(&pool->timer_heap[min]->deadline,
+                             &pool->timer_heap[child]->deadline))
+                min = child;
+        }
+        if (min == i)
+            break;
+        timer_heap_swap(pool, i, min);
+        i = min;
+    }
+}
+
+static int
+timer_heap_push(struct thread_pool *pool, struct thread_task *task) {
+    if (pool->timer_heap_size == pool->timer_heap_capacity) {
+        int new_capacity = pool->timer_heap_capacity == 0 ?
+            8 : pool->timer_heap_capacity * 2;
+        struct thread_task **heap = realloc(pool->timer_heap,
+            new_capacity * sizeof(*heap));
+        if (heap == NULL)
+            return -1;
+        pool->timer_heap = heap;
+        pool->timer_heap_capacity = new_capacity;
+    }
+    int i = pool->timer_heap_size++;
+    pool->timer_heap[i] = task;
+    task->timer_index = i;
+    timer_heap_sift_up(pool, i);
+    atomic_fetch_add(&pool->timer_count, 1);
+    return 0;
+}
+
+static void
+timer_heap_remove(struct thread_pool *pool, struct thread_task *task) {
+    int i = task->timer_index;
+    task->timer_index = -1;
+    pool->timer_heap_size--;
+    atomic_fetch_sub(&pool->timer_count, 1);
+    if (i == pool->timer_heap_size)
+        return;
+    pool->timer_heap[i] = pool->timer_heap[pool->timer_heap_size];
+    pool->timer_heap[i]->timer_index = i;
+    timer_heap_sift_down(pool, i);
+    timer_heap_sift_up(pool, i);
+}
+
+/* Unlink the head of one lane, under the queue lock. */
+static struct thread_task *
+task_queue_take(struct task_queue *queue, int lane) {
+    struct thread_task *task = queue->first[lane];
+    if (task == NULL)
+        return NULL;
+    queue->first[lane] = task->next;
+    if (task->next == NULL)
+        queue->last[lane] = NULL;
+    else
+        task->next->prev = NULL;
+    task->next = NULL;
+    task->queue = NULL;
+    atomic_fetch_sub_explicit(&queue->size, 1, memory_order_relaxed);
+    return task;
+}
+
+static struct thread_task *
+task_queue_pop(struct task_queue *queue) {
+    if (atomic_load_explicit(&queue->size, memory_order_relaxed) == 0)
+        return NULL;
+    pthread_mutex_lock(&queue->lock);
+    /*
+     * High lanes first, but every TPOOL_PROMOTE_PERIOD-th pop walks
+     * them bottom-up - a flooded high lane then delays a low task by
+     * a bounded number of pops instead of starving it forever.
+     */
+    bool promote = ++queue->pop_count % TPOOL_PROMOTE_PERIOD == 0;
+    struct thread_task *task = NULL;
+    for (int i = 0; i < TPOOL_PRIO_COUNT && task == NULL; ++i) {
+        int lane = promote ? TPOOL_PRIO_COUNT - 1 - i : i;
+        task = task_queue_take(queue, lane);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return task;
+}
+
+/*
+ * Unlink a still-queued task from its worker queue, O(1) thanks to
+ * the prev links. Fails when the task is not queued anymore - the
+ * race with a pop is settled by whoever takes the queue lock first.
+ * The caller owns the task_total accounting.
+ */
+static bool
+task_queue_remove(struct thread_task *task) {
+    struct task_queue *queue = task->queue;
+    if (queue == NULL)
+        return false;
+    pthread_mutex_lock(&queue->lock);
+    if (task->queue != queue) {
+        pthread_mutex_unlock(&queue->lock);
+        return false;
+    }
+    int lane = task->prio;
+    if (task->prev != NULL)
+        task->prev->next = task->next;
+    else
+        queue->first[lane] = task->next;
+    if (task->next != NULL)
+        task->next->prev = task->prev;
+    else
+        queue->last[lane] = task->prev;
+    task->prev = NULL;
+    task->next = NULL;
+    task->queue = NULL;
+    atomic_fetch_sub_explicit(&queue->size, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&queue->lock);
+    return true;
+}
+
+/* Own queue first, then steal from the other slots. */
+static struct thread_task *
+pool_pop_task(struct thread_pool *pool, int self) {
+    for (int i = 0; i < pool->max_threads; ++i) {
+        struct thread_task *task =
+            task_queue_pop(&pool->queues[(self + i) % pool->max_threads]);
+        if (task != NULL)
+            return task;
+    }
+    return NULL;
+}
 
-        while (!pool->shutting_down && pool->task_first == NULL) {
-            pthread_cond_wait(&pool->task_available, &pool->sync);
+static void *worker_loop(void *data);
+
+/*
+ * Find a slot for a new worker, under sync. A retired slot is joined
+ * first - its thread has already left the loop, so the join is
+ * instant - and then reused.
+ */
+static int
+pool_claim_slot(struct thread_pool *pool) {
+    for (int i = 0; i < pool->max_threads; ++i) {
+        if (pool->slot_states[i] == SLOT_RETIRED) {
+            pthread_join(pool->threads[i], NULL);
+            pool->slot_states[i] = SLOT_EMPTY;
         }
+        if (pool->slot_states[i] == SLOT_EMPTY)
+            return i;
+    }
+    return -1;
+}
 
-        if (pool->shutting_down) {
-            pool->threads_created--;
-            pthread_mutex_unlock(&pool->sync);
-            break;
+#if NEED_FAST_SPAWN
+
+/*
+ * Map one worker stack with an inaccessible guard page below it.
+ * Returns the usable base, above the guard. The mapping is the bulk
+ * of what a thread spawn costs; a fast-spawn pool pays it once per
+ * slot and hands the same stack to every worker generation of the
+ * slot - the previous owner is always joined before the reuse.
+ */
+static void *
+worker_stack_map(void) {
+    long page = sysconf(_SC_PAGESIZE);
+    char *map = mmap(NULL, TPOOL_WORKER_STACK_SIZE + page,
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+    mprotect(map, page, PROT_NONE);
+    return map + page;
+}
+
+static void
+worker_stack_unmap(void *stack) {
+    long page = sysconf(_SC_PAGESIZE);
+    munmap((char *)stack - page, TPOOL_WORKER_STACK_SIZE + page);
+}
+
+#endif
+
+/* Start the slot's worker thread, under sync. */
+static int
+pool_spawn_thread(struct thread_pool *pool, int slot) {
+#if NEED_FAST_SPAWN
+    if (pool->fast_spawn) {
+        if (pool->slot_stacks[slot] == NULL)
+            pool->slot_stacks[slot] = worker_stack_map();
+        if (pool->slot_stacks[slot] != NULL) {
+            pthread_attr_t attr;
+            pthread_attr_init(&attr);
+            pthread_attr_setstack(&attr, pool->slot_stacks[slot],
+                                  TPOOL_WORKER_STACK_SIZE);
+            int rc = pthread_create(&pool->threads[slot], &attr,
+                                    worker_loop,
+                                    &pool->worker_ctxs[slot]);
+            pthread_attr_destroy(&attr);
+            if (rc == 0)
+                return 0;
         }
+        /* Out of mappings - the default spawn path still works. */
+    }
+#endif
+    return pthread_create(&pool->threads[slot], NULL, worker_loop,
+                          &pool->worker_ctxs[slot]);
+}
 
-        struct thread_task *task = pool->task_first;
-        if (task) {
-            pool->task_first = task->next;
-            if (pool->task_first == NULL)
-                pool->task_last = NULL;
-            pool->task_total--;
-            pool->threads_busy++;
+/*
+ * Keep one idle-or-spawning worker per unserved task, up to
+ * @a demand of them, until the pool is at max size. For a single
+ * push this degrades to the old "all created ones are busy" check.
+ */
+static void
+pool_maybe_spawn(struct thread_pool *pool, int demand) {
+    int created = atomic_load(&pool->threads_created);
+    if (created >= pool->max_threads ||
+        created >= atomic_load(&pool->threads_busy) + demand)
+        return;
+    pthread_mutex_lock(&pool->sync);
+    created = atomic_load(&pool->threads_created);
+    while (!pool->shutting_down && created < pool->max_threads &&
+           created < atomic_load(&pool->threads_busy) + demand) {
+        int slot = pool_claim_slot(pool);
+        if (slot < 0)
+            break;
+        if (pool_spawn_thread(pool, slot) != 0)
+            break;
+#if NEED_AFFINITY
+        if (pool->pinned) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(pool->slot_cpus[slot], &set);
+            /* Best effort - a shrunk cpuset just loses the pinning. */
+            pthread_setaffinity_np(pool->threads[slot], sizeof(set), &set);
         }
+#endif
+        pool->slot_states[slot] = SLOT_RUNNING;
+        created = atomic_fetch_add(&pool->threads_created, 1) + 1;
+    }
+    pthread_mutex_unlock(&pool->sync);
+}
+
+/*
+ * The worker queue a push goes into. Round-robin over all the slots;
+ * a pinned pool instead takes the next slot on the submitter's own
+ * node, so the task's data is read back through the local LLC and
+ * not over the socket interconnect. Cross-node slots still get the
+ * task via stealing when the local ones are behind.
+ */
+static unsigned
+pool_pick_slot(struct thread_pool *pool) {
+    unsigned slot = atomic_fetch_add(&pool->push_cursor, 1) %
+        pool->max_threads;
+#if NEED_AFFINITY
+    if (!pool->pinned)
+        return slot;
+    int cpu = sched_getcpu();
+    if (cpu < 0 || cpu >= pool->cpu_node_count)
+        return slot;
+    int node = pool->cpu_nodes[cpu];
+    if (node < 0)
+        return slot;
+    for (int i = 0; i < pool->max_threads; ++i) {
+        unsigned s = (slot + i) % pool->max_threads;
+        if (pool->slot_nodes[s] == node)
+            return s;
+    }
+#endif
+    return slot;
+}
 
+/*
+ * Append an already validated and counted chain of @a count tasks,
+ * linked from @a first on, to the next slot in the round-robin order
+ * and make sure they will be run. Each task lands in the lane of its
+ * own priority, still under one lock acquisition and with one worker
+ * wakeup for the whole chain. Shared by the push, the batch push and
+ * the continuation paths; the caller bumps task_total before
+ * calling.
+ */
+static void
+pool_enqueue_chain(struct thread_pool *pool, struct thread_task *first,
+                   int count) {
+    unsigned slot = pool_pick_slot(pool);
+    struct task_queue *queue = &pool->queues[slot];
+    /*
+     * One timestamp for the whole chain - the wait clock. The wait
+     * histogram buckets are log2-wide, so the coarse tick-resolution
+     * clock is enough and skips a full clock_gettime() per push.
+     */
+    struct timespec now;
+    fclock_coarse_ts(&now);
+    pthread_mutex_lock(&queue->lock);
+    struct thread_task *task = first;
+    while (task != NULL) {
+        struct thread_task *next = task->next;
+        task->queued_at = now;
+        int lane = task->prio;
+        TRACE_PROBE3(tpool, task_push, task, slot, lane);
+        task->next = NULL;
+        task->prev = queue->last[lane];
+        task->queue = queue;
+        if (queue->first[lane] == NULL)
+            queue->first[lane] = task;
+        else
+            queue->last[lane]->next = task;
+        queue->last[lane] = task;
+        task = next;
+    }
+    atomic_fetch_add_explicit(&queue->size, count, memory_order_relaxed);
+    pthread_mutex_unlock(&queue->lock);
+
+    pool_maybe_spawn(pool, count);
+
+    /*
+     * The total was bumped before this call, so a worker which is
+     * about to park will re-check it under sync and stay awake even
+     * if the sleeper count still reads zero here.
+     */
+    if (atomic_load(&pool->sleeping_workers) > 0) {
+        pthread_mutex_lock(&pool->sync);
+        if (count > 1)
+            pthread_cond_broadcast(&pool->task_available);
+        else
+            pthread_cond_signal(&pool->task_available);
         pthread_mutex_unlock(&pool->sync);
+    }
+}
+
+static void
+pool_enqueue(struct thread_pool *pool, struct thread_task *task) {
+    pool_enqueue_chain(pool, task, 1);
+}
+
+/*
+ * Complete a task: seal the continuation slot, publish the result,
+ * wake the parked joiners, enqueue the continuation if one was
+ * attached in time. The seal comes first because after the DONE
+ * store the task belongs to the joiner - it may be deleted or
+ * re-pushed the next instant and must not be touched anymore.
+ */
+static void
+task_finish(struct thread_pool *pool, struct thread_task *task,
+            void *result) {
+    TRACE_PROBE2(tpool, task_done, task, result);
+    struct thread_task *cont =
+        atomic_exchange(&task->continuation, TASK_CONT_SEALED);
+    task->result = result;
+    uint32_t old = atomic_exchange(&task->state, TASK_DONE);
+    if (old & TASK_HAS_WAITERS)
+        futex_wake_all(&task->state);
+    if (cont != NULL && cont != TASK_CONT_SEALED)
+        pool_enqueue(pool, cont);
+}
+
+/** Mix the key into a bucket index - an identity would cluster. */
+static inline uint32_t
+serial_key_hash(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return (uint32_t)key & (TPOOL_SERIAL_BUCKETS - 1);
+}
+
+/*
+ * Called by the worker which completed a keyed task. Hands the next
+ * waiter of the key over to the worker queues, or drops the empty
+ * serial queue - its key is then no longer active.
+ */
+static void
+pool_serial_handoff(struct thread_pool *pool, struct serial_queue *queue) {
+    pthread_mutex_lock(&pool->serial_lock);
+    struct thread_task *follow = queue->first;
+    if (follow != NULL) {
+        queue->first = follow->next;
+        if (queue->first == NULL)
+            queue->last = NULL;
+        /* Unlinked from the waiters - it goes alone. */
+        follow->next = NULL;
+    } else {
+        struct serial_queue **link =
+            &pool->serial_map[serial_key_hash(queue->key)];
+        while (*link != queue)
+            link = &(*link)->next;
+        *link = queue->next;
+        free(queue);
+    }
+    pthread_mutex_unlock(&pool->serial_lock);
+    if (follow != NULL) {
+        /*
+         * Counted as queued before leaving the waiter count, so
+         * thread_pool_delete() can not slip into the gap.
+         */
+        atomic_fetch_add(&pool->task_total, 1);
+        atomic_fetch_sub(&pool->keyed_count, 1);
+        pool_enqueue(pool, follow);
+    }
+}
+
+/*
+ * Drop a cancelled waiter out of its key's line. Walks that one key's
+ * waiters - exactly the tasks whose turn did not come yet, which is
+ * what cancellation under overload is after.
+ */
+static bool
+pool_serial_waiter_remove(struct thread_pool *pool, struct thread_task *task) {
+    bool found = false;
+    pthread_mutex_lock(&pool->serial_lock);
+    struct serial_queue *queue = task->serial;
+    if (queue != NULL) {
+        struct thread_task *prev = NULL;
+        struct thread_task *it = queue->first;
+        while (it != NULL && it != task) {
+            prev = it;
+            it = it->next;
+        }
+        if (it == task) {
+            if (prev == NULL)
+                queue->first = task->next;
+            else
+                prev->next = task->next;
+            if (queue->last == task)
+                queue->last = prev;
+            task->next = NULL;
+            task->serial = NULL;
+            found = true;
+        }
+    }
+    pthread_mutex_unlock(&pool->serial_lock);
+    if (found)
+        atomic_fetch_sub(&pool->keyed_count, 1);
+    return found;
+}
+
+#if NEED_OVERFLOW_POLICY
+
+/*
+ * The caller-runs policy: the pusher executes the task inline, right
+ * now, on its own thread. A saturated pool then turns its rejection
+ * storm into useful work, and the pusher is throttled for exactly as
+ * long as one task takes. The task completes like a worker-run one -
+ * join, continuation and delete all behave as usual.
+ */
+static int
+pool_caller_run(struct thread_pool *pool, struct thread_task *task) {
+    task->in_pool = true;
+    task->owner = pool;
+    task->next = NULL;
+    task->cancelled = false;
+    task->continuation = NULL;
+    task->state = TASK_RUNNING;
+    atomic_fetch_add_explicit(&pool->submitted, 1, memory_order_relaxed);
+    /* Slot -1 - run inline on the pusher, not on a worker. */
+    TRACE_PROBE2(tpool, task_start, task, -1);
+    void *res = task->function(task->arg);
+    task_finish(pool, task, res);
+    return 0;
+}
+
+/* Backpressure: stall the pusher until the queues have room. */
+static void
+pool_overflow_wait(struct thread_pool *pool) {
+    struct timespec pause = {0, 100000};
+    while (!pool->shutting_down &&
+           atomic_load(&pool->task_total) >= TPOOL_MAX_TASKS)
+        nanosleep(&pause, NULL);
+}
+
+/*
+ * Complete one waiting task with a NULL result to make room - the
+ * head of the lowest non-empty lane, so the least important and
+ * longest-waiting work is shed first. The victim looks exactly like
+ * a cancelled task: finished, NULL result, the cancelled mark set.
+ */
+static void
+pool_overflow_drop(struct thread_pool *pool) {
+    struct thread_task *old = NULL;
+    for (int i = 0; i < pool->max_threads && old == NULL; ++i) {
+        struct task_queue *queue = &pool->queues[i];
+        if (atomic_load_explicit(&queue->size, memory_order_relaxed) == 0)
+            continue;
+        pthread_mutex_lock(&queue->lock);
+        for (int lane = TPOOL_PRIO_COUNT; lane-- > 0 && old == NULL;)
+            old = task_queue_take(queue, lane);
+        pthread_mutex_unlock(&queue->lock);
+    }
+    if (old == NULL)
+        return;
+    atomic_fetch_sub(&pool->task_total, 1);
+    atomic_store(&old->cancelled, true);
+    struct serial_queue *serial = old->serial;
+    old->serial = NULL;
+    task_finish(pool, old, NULL);
+    if (serial != NULL)
+        pool_serial_handoff(pool, serial);
+}
+
+#endif
+
+/* Move every expired timer into the run queues. */
+static void
+pool_service_timers(struct thread_pool *pool) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    while (1) {
+        pthread_mutex_lock(&pool->timer_lock);
+        struct thread_task *task = NULL;
+        if (pool->timer_heap_size > 0 &&
+            timespec_le(&pool->timer_heap[0]->deadline, &now)) {
+            task = pool->timer_heap[0];
+            timer_heap_remove(pool, task);
+        }
+        pthread_mutex_unlock(&pool->timer_lock);
+        if (task == NULL)
+            break;
+        /*
+         * A re-armed task carries TASK_DONE and a sealed
+         * continuation slot - unseal it for the next run.
+         */
+        struct thread_task *sealed = TASK_CONT_SEALED;
+        atomic_compare_exchange_strong(&task->continuation, &sealed,
+                                       (struct thread_task *)NULL);
+        task_set_state(&task->state, TASK_QUEUED);
+        atomic_fetch_add(&pool->task_total, 1);
+        pool_enqueue(pool, task);
+    }
+}
+
+/*
+ * Earliest scheduled deadline, if any. Bounds the park of an idle
+ * worker so one of them always wakes up in time to fire it.
+ */
+static bool
+pool_next_deadline(struct thread_pool *pool, struct timespec *deadline) {
+    pthread_mutex_lock(&pool->timer_lock);
+    bool has = pool->timer_heap_size > 0;
+    if (has)
+        *deadline = pool->timer_heap[0]->deadline;
+    pthread_mutex_unlock(&pool->timer_lock);
+    return has;
+}
 
-        if (task) {
-            task->state = TASK_RUNNING;
-            void *res = task->function(task->arg);
+static void *worker_loop(void *data) {
+    struct worker_ctx *ctx = (struct worker_ctx *)data;
+    struct thread_pool *pool = ctx->pool;
 
-            pthread_mutex_lock(&task->lock);
-            task->result = res;
-            task->state = TASK_DONE;
-            pthread_cond_signal(&task->cond);
-            pthread_mutex_unlock(&task->lock);
+    while (1) {
+        if (atomic_load(&pool->timer_count) > 0)
+            pool_service_timers(pool);
 
+        struct thread_task *task = pool_pop_task(pool, ctx->index);
+        if (task == NULL) {
+            /* A task pushed while spinning skips the kernel wakeup. */
+            if (spin_wait(&pool->task_total, pool->spin_limit))
+                continue;
             pthread_mutex_lock(&pool->sync);
-            pool->threads_busy--;
-            if (pool->task_total == 0 && pool->threads_busy == 0) {
-                pthread_cond_signal(&pool->all_tasks_done);
+            atomic_fetch_add(&pool->sleeping_workers, 1);
+            /* The idle clock starts anew with every park. */
+            bool can_retire = pool->idle_timeout > 0;
+            struct timespec idle_at;
+            if (can_retire)
+                idle_at = deadline_in(pool->idle_timeout);
+            bool retire = false;
+            while (!pool->shutting_down &&
+                   atomic_load(&pool->task_total) == 0) {
+                struct timespec deadline;
+                bool idle_first = false;
+                bool timed = pool_next_deadline(pool, &deadline);
+                if (can_retire &&
+                    (!timed || timespec_le(&idle_at, &deadline))) {
+                    deadline = idle_at;
+                    idle_first = true;
+                    timed = true;
+                }
+                if (!timed) {
+                    pthread_cond_wait(&pool->task_available, &pool->sync);
+                    continue;
+                }
+                if (pthread_cond_timedwait(&pool->task_available,
+                        &pool->sync, &deadline) != ETIMEDOUT)
+                    continue;
+                /*
+                 * Sat out the whole timeout without work - a surplus
+                 * worker leaves. A timer wakeup instead goes back to
+                 * the loop top to service the heap.
+                 */
+                retire = idle_first && !pool->shutting_down &&
+                    atomic_load(&pool->task_total) == 0 &&
+                    atomic_load(&pool->threads_created) >
+                        pool->min_threads;
+                break;
             }
+            atomic_fetch_sub(&pool->sleeping_workers, 1);
+            bool stop = pool->shutting_down;
+            if (stop || retire)
+                atomic_fetch_sub(&pool->threads_created, 1);
+            if (retire && !stop)
+                pool->slot_states[ctx->index] = SLOT_RETIRED;
+            pthread_mutex_unlock(&pool->sync);
+            if (stop || retire)
+                break;
+            continue;
+        }
+
+        /*
+         * Become busy before the task leaves the queued count, so
+         * thread_pool_delete() reading total and then busy can
+         * never miss the task in both.
+         */
+        atomic_fetch_add(&pool->threads_busy, 1);
+        atomic_fetch_sub(&pool->task_total, 1);
+
+        struct timespec run_at;
+        clock_gettime(CLOCK_MONOTONIC, &run_at);
+        task_set_state(&task->state, TASK_RUNNING);
+        TRACE_PROBE2(tpool, task_start, task, ctx->index);
+        void *res = task->function(task->arg);
+        struct timespec done_at;
+        clock_gettime(CLOCK_MONOTONIC, &done_at);
+        worker_stats_account(&ctx->stats, &task->queued_at, &run_at,
+                             &done_at);
+
+        /*
+         * Stop being busy before the task becomes joinable - a
+         * re-push right after join must not mistake this worker
+         * for a busy one and spawn an extra thread.
+         */
+        /*
+         * Re-arm a periodic task before publishing its completion -
+         * one instant later a cancel plus join could free the task.
+         */
+        bool rearmed = false;
+        if (task->period > 0) {
+            pthread_mutex_lock(&pool->timer_lock);
+            if (!task->timer_cancelled) {
+                task->deadline = deadline_in(task->period);
+                rearmed = timer_heap_push(pool, task) == 0;
+            }
+            pthread_mutex_unlock(&pool->timer_lock);
+        }
+
+        atomic_fetch_sub(&pool->threads_busy, 1);
+
+        /* Taken before the task becomes joinable and reusable. */
+        struct serial_queue *serial = task->serial;
+        task->serial = NULL;
+
+        task_finish(pool, task, res);
+
+        /* A parked worker must recompute its wakeup deadline. */
+        if (rearmed && atomic_load(&pool->sleeping_workers) > 0) {
+            pthread_mutex_lock(&pool->sync);
+            pthread_cond_signal(&pool->task_available);
             pthread_mutex_unlock(&pool->sync);
         }
+
+        /* The key's next waiter, if any, follows right behind. */
+        if (serial != NULL)
+            pool_serial_handoff(pool, serial);
+
+        if (atomic_load(&pool->task_total) == 0 &&
+            atomic_load(&pool->threads_busy) == 0) {
+            pthread_cond_signal(&pool->all_tasks_done);
+        }
     }
 
     return NULL;
 }
 
-int thread_pool_new(int max_thread_count, struct thread_pool **pool) {
-    if (!pool || max_thread_count <= 0 || max_thread_count > TPOOL_MAX_THREADS)
+int thread_pool_new_ex(int max_thread_count, int spin_limit,
+                       struct thread_pool **pool) {
+    if (!pool || max_thread_count <= 0 ||
+        max_thread_count > TPOOL_MAX_THREADS || spin_limit < 0)
         return TPOOL_ERR_INVALID_ARGUMENT;
 
     struct thread_pool *p = calloc(1, sizeof(*p));
     if (!p) return -1;
 
     p->threads = calloc(max_thread_count, sizeof(pthread_t));
-    if (!p->threads) {
+    p->worker_ctxs = calloc(max_thread_count, sizeof(*p->worker_ctxs));
+    p->queues = calloc(max_thread_count, sizeof(*p->queues));
+    p->slot_states = calloc(max_thread_count, sizeof(*p->slot_states));
+    if (!p->threads || !p->worker_ctxs || !p->queues || !p->slot_states) {
+        free(p->threads);
+        free(p->worker_ctxs);
+        free(p->queues);
+        free(p->slot_states);
         free(p);
         return -1;
     }
 
+    /* Without a timeout nobody retires - min is then irrelevant. */
+    p->min_threads = max_thread_count;
+    p->idle_timeout = 0;
     p->max_threads = max_thread_count;
+    p->spin_limit = spin_limit;
+    for (int i = 0; i < max_thread_count; ++i) {
+        p->worker_ctxs[i].pool = p;
+        p->worker_ctxs[i].index = i;
+        pthread_mutex_init(&p->queues[i].lock, NULL);
+    }
 
     pthread_mutex_init(&p->sync, NULL);
-    pthread_cond_init(&p->task_available, NULL);
+    pthread_mutex_init(&p->timer_lock, NULL);
+    pthread_mutex_init(&p->serial_lock, NULL);
+    /* Timed parks pass CLOCK_MONOTONIC deadlines. */
+    pthread_condattr_t condattr;
+    pthread_condattr_init(&condattr);
+    pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&p->task_available, &condattr);
+    pthread_condattr_destroy(&condattr);
     pthread_cond_init(&p->all_tasks_done, NULL);
 
     *pool = p;
     return 0;
 }
 
+int thread_pool_new(int max_thread_count, struct thread_pool **pool) {
+    return thread_pool_new_ex(max_thread_count, TPOOL_DEFAULT_SPIN, pool);
+}
+
+#if NEED_WORKER_SCALING
+
+int thread_pool_new_scaled(int min_thread_count, int max_thread_count,
+                           double idle_timeout, struct thread_pool **pool) {
+    if (min_thread_count < 0 || min_thread_count > max_thread_count ||
+        idle_timeout <= 0)
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    int rc = thread_pool_new_ex(max_thread_count, TPOOL_DEFAULT_SPIN, pool);
+    if (rc != 0)
+        return rc;
+    (*pool)->min_threads = min_thread_count;
+    (*pool)->idle_timeout = idle_timeout;
+    return 0;
+}
+
+#endif
+
+#if NEED_FAST_SPAWN
+
+int thread_pool_new_fast_spawn(int min_thread_count, int max_thread_count,
+                               double idle_timeout,
+                               struct thread_pool **pool) {
+    if (min_thread_count < 0 || min_thread_count > max_thread_count ||
+        idle_timeout <= 0)
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    int rc = thread_pool_new_ex(max_thread_count, TPOOL_DEFAULT_SPIN, pool);
+    if (rc != 0)
+        return rc;
+    struct thread_pool *p = *pool;
+    p->slot_stacks = calloc(max_thread_count, sizeof(*p->slot_stacks));
+    if (p->slot_stacks == NULL) {
+        thread_pool_delete(p);
+        *pool = NULL;
+        return -1;
+    }
+    p->min_threads = min_thread_count;
+    p->idle_timeout = idle_timeout;
+    p->fast_spawn = true;
+    return 0;
+}
+
+#endif
+
+#if NEED_AFFINITY
+
+int thread_pool_new_pinned(int max_thread_count, const int *cpus,
+                           int cpu_count, struct thread_pool **pool) {
+    if (!cpus || cpu_count <= 0)
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    long cpu_total = sysconf(_SC_NPROCESSORS_CONF);
+    if (cpu_total <= 0)
+        cpu_total = 1;
+    for (int i = 0; i < cpu_count; ++i) {
+        if (cpus[i] < 0 || cpus[i] >= cpu_total)
+            return TPOOL_ERR_INVALID_ARGUMENT;
+    }
+    int rc = thread_pool_new_ex(max_thread_count, TPOOL_DEFAULT_SPIN, pool);
+    if (rc != 0)
+        return rc;
+    struct thread_pool *p = *pool;
+    p->slot_cpus = malloc(max_thread_count * sizeof(*p->slot_cpus));
+    p->slot_nodes = malloc(max_thread_count * sizeof(*p->slot_nodes));
+    p->cpu_nodes = malloc(cpu_total * sizeof(*p->cpu_nodes));
+    if (!p->slot_cpus || !p->slot_nodes || !p->cpu_nodes) {
+        thread_pool_delete(p);
+        *pool = NULL;
+        return -1;
+    }
+    /*
+     * The node of a CPU is approximated by its socket id - on the
+     * usual one-memory-controller-per-socket box they coincide, and
+     * it needs no libnuma. The cputopo table reads sysfs once for
+     * the whole map instead of a file per CPU, and degrades to a
+     * flat layout when the topology files are absent; the placement
+     * then just follows the flat ids.
+     */
+    struct cputopo topo;
+    if (cputopo_discover(&topo) != 0) {
+        thread_pool_delete(p);
+        *pool = NULL;
+        return -1;
+    }
+    p->cpu_node_count = (int)cpu_total;
+    for (int i = 0; i < (int)cpu_total; ++i) {
+        p->cpu_nodes[i] = i < topo.cpu_count ?
+            topo.cpus[i].package : -1;
+    }
+    cputopo_destroy(&topo);
+    /* More slots than CPUs just wraps around the list. */
+    for (int i = 0; i < max_thread_count; ++i) {
+        p->slot_cpus[i] = cpus[i % cpu_count];
+        p->slot_nodes[i] = p->cpu_nodes[p->slot_cpus[i]];
+    }
+    p->pinned = true;
+    return 0;
+}
+
+#endif
+
+#if NEED_OVERFLOW_POLICY
+
+int thread_pool_new_overflow(int max_thread_count,
+                             enum thread_pool_overflow_policy policy,
+                             struct thread_pool **pool) {
+    if ((int)policy < 0 || (int)policy > TPOOL_OVERFLOW_DROP_OLDEST)
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    int rc = thread_pool_new_ex(max_thread_count, TPOOL_DEFAULT_SPIN, pool);
+    if (rc != 0)
+        return rc;
+    (*pool)->overflow_policy = policy;
+    return 0;
+}
+
+#endif
+
 int thread_pool_thread_count(const struct thread_pool *pool) {
     if (!pool) return 0;
-    return pool->threads_created;
+    return atomic_load(&pool->threads_created);
+}
+
+int thread_pool_stats_get(const struct thread_pool *pool,
+                          struct thread_pool_stats *stats) {
+    if (!pool || !stats)
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    memset(stats, 0, sizeof(*stats));
+    stats->submitted = atomic_load_explicit(&pool->submitted,
+        memory_order_relaxed);
+    stats->queue_depth = atomic_load(&pool->task_total);
+    stats->thread_count = atomic_load(&pool->threads_created);
+    stats->busy_count = atomic_load(&pool->threads_busy);
+    for (int i = 0; i < pool->max_threads; ++i) {
+        const struct worker_stats *ws = &pool->worker_ctxs[i].stats;
+        stats->completed += atomic_load_explicit(&ws->completed,
+            memory_order_relaxed);
+        stats->busy_ns += atomic_load_explicit(&ws->busy_ns,
+            memory_order_relaxed);
+        for (int b = 0; b < TPOOL_STAT_BUCKETS; ++b) {
+            stats->wait_hist[b] += atomic_load_explicit(
+                &ws->wait_hist[b], memory_order_relaxed);
+            stats->exec_hist[b] += atomic_load_explicit(
+                &ws->exec_hist[b], memory_order_relaxed);
+        }
+    }
+    return 0;
 }
 
 int thread_pool_delete(struct thread_pool *pool) {
     if (!pool) return TPOOL_ERR_INVALID_ARGUMENT;
 
     pthread_mutex_lock(&pool->sync);
-    if (pool->task_total > 0 || pool->threads_busy > 0) {
+    /* Total before busy - the claim path goes busy++, total--. */
+    if (atomic_load(&pool->task_total) > 0 ||
+        atomic_load(&pool->timer_count) > 0 ||
+        atomic_load(&pool->keyed_count) > 0 ||
+        atomic_load(&pool->threads_busy) > 0) {
         pthread_mutex_unlock(&pool->sync);
         return TPOOL_ERR_HAS_TASKS;
     }
@@ -128,13 +1283,37 @@ int thread_pool_delete(struct thread_pool *pool) {
     pthread_cond_broadcast(&pool->task_available);
     pthread_mutex_unlock(&pool->sync);
 
-    for (int i = 0; i < pool->threads_created; ++i) {
-        pthread_join(pool->threads[i], NULL);
+    /* Running slots exit on the broadcast, retired ones already did. */
+    for (int i = 0; i < pool->max_threads; ++i) {
+        if (pool->slot_states[i] != SLOT_EMPTY)
+            pthread_join(pool->threads[i], NULL);
     }
 
+    for (int i = 0; i < pool->max_threads; ++i) {
+        pthread_mutex_destroy(&pool->queues[i].lock);
+    }
     pthread_mutex_destroy(&pool->sync);
+    pthread_mutex_destroy(&pool->timer_lock);
+    pthread_mutex_destroy(&pool->serial_lock);
     pthread_cond_destroy(&pool->task_available);
     pthread_cond_destroy(&pool->all_tasks_done);
+#if NEED_FAST_SPAWN
+    if (pool->slot_stacks != NULL) {
+        for (int i = 0; i < pool->max_threads; ++i) {
+            if (pool->slot_stacks[i] != NULL)
+                worker_stack_unmap(pool->slot_stacks[i]);
+        }
+        free(pool->slot_stacks);
+    }
+#endif
+    free(pool->timer_heap);
+    free(pool->serial_map);
+    free(pool->slot_cpus);
+    free(pool->slot_nodes);
+    free(pool->cpu_nodes);
+    free(pool->slot_states);
+    free(pool->queues);
+    free(pool->worker_ctxs);
     free(pool->threads);
     free(pool);
 
@@ -145,97 +1324,583 @@ int thread_pool_push_task(struct thread_pool *pool, struct thread_task *task) {
     if (!pool || !task || pool->shutting_down)
         return TPOOL_ERR_INVALID_ARGUMENT;
 
-    if (pool->task_total >= TPOOL_MAX_TASKS)
+    if (task->in_pool)
+        return TPOOL_ERR_TASK_IN_POOL;
+
+    if (atomic_load(&pool->task_total) >= TPOOL_MAX_TASKS) {
+#if NEED_OVERFLOW_POLICY
+        switch (pool->overflow_policy) {
+        case TPOOL_OVERFLOW_CALLER_RUNS:
+            return pool_caller_run(pool, task);
+        case TPOOL_OVERFLOW_BLOCK:
+            pool_overflow_wait(pool);
+            if (pool->shutting_down)
+                return TPOOL_ERR_INVALID_ARGUMENT;
+            break;
+        case TPOOL_OVERFLOW_DROP_OLDEST:
+            pool_overflow_drop(pool);
+            break;
+        default:
+            return TPOOL_ERR_TOO_MANY_TASKS;
+        }
+#else
         return TPOOL_ERR_TOO_MANY_TASKS;
+#endif
+    }
 
-    if (task->state != TASK_NEW && task->state != TASK_DONE)
-        return TPOOL_ERR_TASK_IN_POOL;
+    task->in_pool = true;
+    task->state = TASK_QUEUED;
+    task->owner = pool;
+    task->next = NULL;
+    task->cancelled = false;
+    /* A re-pushed task carries the seal of its last completion. */
+    task->continuation = NULL;
 
-    pthread_mutex_lock(&pool->sync);
+    atomic_fetch_add_explicit(&pool->submitted, 1, memory_order_relaxed);
+    atomic_fetch_add(&pool->task_total, 1);
+    pool_enqueue(pool, task);
+    return 0;
+}
+
+#if NEED_KEYED_TASKS
 
+int thread_pool_push_task_keyed(struct thread_pool *pool,
+                                struct thread_task *task, uint64_t key) {
+    if (!pool || !task || pool->shutting_down)
+        return TPOOL_ERR_INVALID_ARGUMENT;
+
+    if (atomic_load(&pool->task_total) +
+        atomic_load(&pool->keyed_count) >= TPOOL_MAX_TASKS)
+        return TPOOL_ERR_TOO_MANY_TASKS;
+
+    if (atomic_load(&task->in_pool))
+        return TPOOL_ERR_TASK_IN_POOL;
+
+    pthread_mutex_lock(&pool->serial_lock);
+    if (pool->serial_map == NULL) {
+        pool->serial_map = calloc(TPOOL_SERIAL_BUCKETS,
+                                  sizeof(*pool->serial_map));
+        if (pool->serial_map == NULL) {
+            pthread_mutex_unlock(&pool->serial_lock);
+            return -1;
+        }
+    }
+    struct serial_queue **bucket = &pool->serial_map[serial_key_hash(key)];
+    struct serial_queue *queue = *bucket;
+    while (queue != NULL && queue->key != key)
+        queue = queue->next;
+    /* No queue - the key is not active, the task becomes its head. */
+    bool is_head = queue == NULL;
+    if (is_head) {
+        queue = malloc(sizeof(*queue));
+        if (queue == NULL) {
+            pthread_mutex_unlock(&pool->serial_lock);
+            return -1;
+        }
+        queue->key = key;
+        queue->first = NULL;
+        queue->last = NULL;
+        queue->next = *bucket;
+        *bucket = queue;
+    }
+    task->in_pool = true;
     task->state = TASK_QUEUED;
     task->owner = pool;
     task->next = NULL;
+    task->cancelled = false;
+    task->continuation = NULL;
+    task->serial = queue;
+    if (!is_head) {
+        if (queue->first == NULL)
+            queue->first = task;
+        else
+            queue->last->next = task;
+        queue->last = task;
+        atomic_fetch_add(&pool->keyed_count, 1);
+    }
+    pthread_mutex_unlock(&pool->serial_lock);
 
-    if (!pool->task_first) {
-        pool->task_first = task;
-        pool->task_last = task;
-    } else {
-        pool->task_last->next = task;
-        pool->task_last = task;
+    atomic_fetch_add_explicit(&pool->submitted, 1, memory_order_relaxed);
+    if (is_head) {
+        atomic_fetch_add(&pool->task_total, 1);
+        pool_enqueue(pool, task);
+    }
+    return 0;
+}
+
+#endif
+
+#if NEED_PUSH_MANY
+
+int thread_pool_push_task_many(struct thread_pool *pool,
+                               struct thread_task **tasks, int count) {
+    if (!pool || !tasks || count <= 0 || pool->shutting_down)
+        return TPOOL_ERR_INVALID_ARGUMENT;
+
+    if (atomic_load(&pool->task_total) + count > TPOOL_MAX_TASKS)
+        return TPOOL_ERR_TOO_MANY_TASKS;
+
+    /* All or nothing - validate the whole batch up front. */
+    for (int i = 0; i < count; ++i) {
+        if (!tasks[i])
+            return TPOOL_ERR_INVALID_ARGUMENT;
+        if (atomic_load(&tasks[i]->in_pool))
+            return TPOOL_ERR_TASK_IN_POOL;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        struct thread_task *task = tasks[i];
+        task->in_pool = true;
+        task->state = TASK_QUEUED;
+        task->owner = pool;
+        task->next = i + 1 < count ? tasks[i + 1] : NULL;
+        task->cancelled = false;
+        task->continuation = NULL;
     }
 
-    pool->task_total++;
+    atomic_fetch_add_explicit(&pool->submitted, count,
+        memory_order_relaxed);
+    atomic_fetch_add(&pool->task_total, count);
+    pool_enqueue_chain(pool, tasks[0], count);
+    return 0;
+}
+
+#endif
+
+#if NEED_PARALLEL_FOR
+
+/*
+ * The shared loop descriptor. There are no per-chunk objects at all:
+ * every participant - the helper tasks and the calling thread - just
+ * bumps the cursor to claim the next grain-sized subrange, so an
+ * unfinished range is stealable by whoever runs out of work first
+ * and the fastest thread simply claims more chunks.
+ */
+struct parallel_for_range {
+    atomic_size_t cursor;
+    size_t end;
+    size_t grain;
+    thread_pool_range_f fn;
+    void *ctx;
+};
 
-    if (pool->threads_created < pool->max_threads &&
-        pool->threads_busy == pool->threads_created) {
-        if (pthread_create(&pool->threads[pool->threads_created], NULL, worker_loop, pool) == 0) {
-            pool->threads_created++;
+static void *
+parallel_for_run(void *arg) {
+    struct parallel_for_range *range = arg;
+    while (1) {
+        size_t begin = atomic_fetch_add(&range->cursor, range->grain);
+        if (begin >= range->end)
+            break;
+        size_t end = range->end - begin > range->grain ?
+            begin + range->grain : range->end;
+        range->fn(begin, end, range->ctx);
+    }
+    return NULL;
+}
+
+int thread_pool_parallel_for(struct thread_pool *pool, size_t begin,
+                             size_t end, size_t grain,
+                             thread_pool_range_f fn, void *ctx) {
+    if (!pool || !fn || grain == 0 || begin > end || pool->shutting_down)
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    if (begin == end)
+        return 0;
+
+    struct parallel_for_range range;
+    atomic_init(&range.cursor, begin);
+    range.end = end;
+    range.grain = grain;
+    range.fn = fn;
+    range.ctx = ctx;
+
+    /*
+     * One helper per worker at most, and none beyond what the chunk
+     * count can feed - the caller takes one share itself. A failed
+     * helper allocation is not an error, the range completes anyway,
+     * just on fewer threads.
+     */
+    size_t chunk_count = (end - begin + grain - 1) / grain;
+    int helper_count = pool->max_threads;
+    if ((size_t)helper_count > chunk_count - 1)
+        helper_count = chunk_count - 1;
+    struct thread_task *helpers[TPOOL_MAX_THREADS];
+    int created = 0;
+    for (; created < helper_count; ++created) {
+        if (thread_task_new(&helpers[created], parallel_for_run,
+                            &range) != 0)
+            break;
+        if (thread_pool_push_task(pool, helpers[created]) != 0) {
+            thread_task_delete(helpers[created]);
+            break;
         }
     }
 
-    pthread_cond_signal(&pool->task_available);
-    pthread_mutex_unlock(&pool->sync);
+    /* Work-sharing: the caller is a participant, not a waiter. */
+    parallel_for_run(&range);
+
+    for (int i = 0; i < created; ++i) {
+        void *result;
+        thread_task_join(helpers[i], &result);
+        thread_task_delete(helpers[i]);
+    }
+    return 0;
+}
+
+#endif
+
+#if NEED_DELAYED_TASKS
+
+static int
+pool_push_task_timed(struct thread_pool *pool, struct thread_task *task,
+                     double delay, double period) {
+    if (!pool || !task || delay < 0 || pool->shutting_down)
+        return TPOOL_ERR_INVALID_ARGUMENT;
+
+    if (atomic_load(&pool->task_total) +
+        atomic_load(&pool->timer_count) >= TPOOL_MAX_TASKS)
+        return TPOOL_ERR_TOO_MANY_TASKS;
+
+    if (atomic_load(&task->in_pool))
+        return TPOOL_ERR_TASK_IN_POOL;
+
+    task->in_pool = true;
+    task->state = TASK_QUEUED;
+    task->owner = pool;
+    task->next = NULL;
+    task->cancelled = false;
+    task->continuation = NULL;
+    /* So a cancel before the first run leaves a NULL result. */
+    task->result = NULL;
+    task->period = period;
+    task->timer_cancelled = false;
+
+    pthread_mutex_lock(&pool->timer_lock);
+    task->deadline = deadline_in(delay);
+    int rc = timer_heap_push(pool, task);
+    pthread_mutex_unlock(&pool->timer_lock);
+    if (rc != 0) {
+        task->in_pool = false;
+        task->state = TASK_NEW;
+        task->owner = NULL;
+        return -1;
+    }
+    atomic_fetch_add_explicit(&pool->submitted, 1, memory_order_relaxed);
+
+    /*
+     * Somebody has to be there to fire the timer: spawn the first
+     * worker if there is none, wake a parked one to recompute its
+     * deadline otherwise.
+     */
+    pool_maybe_spawn(pool, 1);
+    if (atomic_load(&pool->sleeping_workers) > 0) {
+        pthread_mutex_lock(&pool->sync);
+        pthread_cond_signal(&pool->task_available);
+        pthread_mutex_unlock(&pool->sync);
+    }
     return 0;
 }
 
+int thread_pool_push_task_delayed(struct thread_pool *pool,
+                                  struct thread_task *task, double delay) {
+    return pool_push_task_timed(pool, task, delay, 0);
+}
+
+int thread_pool_push_task_periodic(struct thread_pool *pool,
+                                   struct thread_task *task, double period) {
+    if (period <= 0)
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    return pool_push_task_timed(pool, task, period, period);
+}
+
+#endif
+
+#if NEED_TASK_THEN
+
+int thread_task_then(struct thread_task *task, struct thread_task *next) {
+    if (!task || !next || task == next)
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    if (!task->owner)
+        return TPOOL_ERR_TASK_NOT_PUSHED;
+    if (atomic_load(&next->in_pool))
+        return TPOOL_ERR_TASK_IN_POOL;
+
+    struct thread_pool *pool = task->owner;
+    if (atomic_load(&pool->task_total) >= TPOOL_MAX_TASKS)
+        return TPOOL_ERR_TOO_MANY_TASKS;
+
+    next->in_pool = true;
+    next->state = TASK_QUEUED;
+    next->owner = pool;
+    next->next = NULL;
+    next->cancelled = false;
+    next->continuation = NULL;
+    /* Counted right away so the pool can not die under the chain. */
+    atomic_fetch_add(&pool->task_total, 1);
+
+    /*
+     * Attach with a CAS. The completer seals the slot before it
+     * publishes DONE, so a successful attach is always picked up; a
+     * sealed slot means the task is finished (or completing right
+     * now) and the enqueue is ours to do; anything else in the slot
+     * is somebody's earlier continuation.
+     */
+    struct thread_task *expected = NULL;
+    if (!atomic_compare_exchange_strong(&task->continuation, &expected,
+                                        next)) {
+        if (expected == TASK_CONT_SEALED) {
+            pool_enqueue(pool, next);
+            return 0;
+        }
+        atomic_fetch_sub(&pool->task_total, 1);
+        next->in_pool = false;
+        next->state = TASK_NEW;
+        next->owner = NULL;
+        return TPOOL_ERR_TASK_IN_POOL;
+    }
+    return 0;
+}
+
+#endif
+
+/*
+ * Cache of free task structs. Task churn is the hottest allocation
+ * path - workloads create and delete one task per work item - and
+ * the slab cache keeps it off malloc and mostly off shared locks:
+ * each thread serves its own churn from its magazine.
+ */
+static struct slab_cache task_cache;
+
+__attribute__((constructor))
+static void
+task_cache_create(void) {
+    slab_cache_create(&task_cache, "thread_task",
+                      sizeof(struct thread_task), NULL, NULL, NULL);
+}
+
+/* So the cached slabs are not reported as leaked on exit. */
+__attribute__((destructor))
+static void
+task_cache_drain(void) {
+    slab_cache_destroy(&task_cache);
+}
+
 int thread_task_new(struct thread_task **task, thread_task_f function, void *arg) {
     if (!task || !function) return TPOOL_ERR_INVALID_ARGUMENT;
 
-    struct thread_task *t = calloc(1, sizeof(*t));
+    struct thread_task *t = slab_alloc(&task_cache);
     if (!t) return -1;
-
+    /*
+     * The cell is recycled, not zeroed - reset every field a fresh
+     * task is supposed to have clean. 'deadline' and 'queued_at' are
+     * always written before they are read.
+     */
+    t->result = NULL;
+    t->owner = NULL;
+    t->next = NULL;
+    t->prev = NULL;
+    t->queue = NULL;
+    t->continuation = NULL;
+    t->in_pool = false;
     t->function = function;
     t->arg = arg;
     t->state = TASK_NEW;
-
-    pthread_mutex_init(&t->lock, NULL);
-    pthread_cond_init(&t->cond, NULL);
+    t->period = 0;
+    t->timer_index = -1;
+    t->timer_cancelled = false;
+    t->prio = TPOOL_PRIO_NORMAL;
+    t->serial = NULL;
+    t->cancelled = false;
 
     *task = t;
     return 0;
 }
 
+#if NEED_TASK_PRIORITY
+
+int thread_task_new_prio(struct thread_task **task, thread_task_f function,
+                         void *arg, int prio) {
+    if (prio < 0 || prio >= TPOOL_PRIO_COUNT)
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    int rc = thread_task_new(task, function, arg);
+    if (rc != 0)
+        return rc;
+    (*task)->prio = prio;
+    return 0;
+}
+
+#endif
+
 bool thread_task_is_finished(const struct thread_task *task) {
-    return task && task->state == TASK_DONE;
+    return task && task_state_of(task->state) == TASK_DONE;
 }
 
 bool thread_task_is_running(const struct thread_task *task) {
-    return task && task->state == TASK_RUNNING;
+    return task && task_state_of(task->state) == TASK_RUNNING;
+}
+
+bool thread_task_is_cancelled(const struct thread_task *task) {
+    return task && atomic_load(&task->cancelled);
+}
+
+int thread_task_cancel(struct thread_task *task) {
+    if (!task)
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    struct thread_pool *pool = task->owner;
+    if (!pool || !atomic_load(&task->in_pool))
+        return TPOOL_ERR_TASK_NOT_PUSHED;
+
+    /* The mark a running task polls via thread_task_is_cancelled(). */
+    atomic_store(&task->cancelled, true);
+
+    pthread_mutex_lock(&pool->timer_lock);
+    task->timer_cancelled = true;
+    bool was_scheduled = task->timer_index >= 0;
+    if (was_scheduled)
+        timer_heap_remove(pool, task);
+    pthread_mutex_unlock(&pool->timer_lock);
+
+    /*
+     * Plucked off the heap before firing - complete it here so it
+     * can be joined and deleted the usual way. A one-shot keeps a
+     * NULL result, a periodic keeps the result of its last run.
+     */
+    if (was_scheduled) {
+        task_finish(pool, task, task->result);
+        return 0;
+    }
+
+    /*
+     * Still sitting in a worker queue - unlink it, nobody will ever
+     * run it. Under overload most completed work is already dead, so
+     * the reclaimed worker time is the whole point.
+     */
+    if (task_queue_remove(task)) {
+        atomic_fetch_sub(&pool->task_total, 1);
+        /* A cancelled key head must still release its successors. */
+        struct serial_queue *serial = task->serial;
+        task->serial = NULL;
+        task_finish(pool, task, NULL);
+        if (serial != NULL)
+            pool_serial_handoff(pool, serial);
+        return 0;
+    }
+
+    /* A keyed waiter is not in the queues yet - drop it from its key. */
+    if (task->serial != NULL && pool_serial_waiter_remove(pool, task)) {
+        task_finish(pool, task, NULL);
+        return 0;
+    }
+
+    /*
+     * Running, or about to be - it is not interrupted, the mark
+     * above stays for the function to poll.
+     */
+    return 0;
+}
+
+/*
+ * Park on the state word until the task is DONE, or until the
+ * optional deadline. The waiter flag tells the completer whether the
+ * wake syscall is needed at all - an unjoined-yet task completes
+ * without entering the kernel.
+ */
+static bool
+task_wait_done(struct thread_task *task, const struct timespec *deadline) {
+    uint32_t word = atomic_fetch_or(&task->state, TASK_HAS_WAITERS) |
+        TASK_HAS_WAITERS;
+    while (task_state_of(word) != TASK_DONE) {
+        struct timespec rel;
+        struct timespec *relp = NULL;
+        if (deadline != NULL) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (timespec_le(deadline, &now))
+                return false;
+            rel.tv_sec = deadline->tv_sec - now.tv_sec;
+            rel.tv_nsec = deadline->tv_nsec - now.tv_nsec;
+            if (rel.tv_nsec < 0) {
+                rel.tv_nsec += 1000000000;
+                rel.tv_sec--;
+            }
+            relp = &rel;
+        }
+        futex_wait(&task->state, word, relp);
+        /* Any state change clears the flag - raise it again. */
+        word = atomic_fetch_or(&task->state, TASK_HAS_WAITERS) |
+            TASK_HAS_WAITERS;
+    }
+    return true;
+}
+
+static void
+task_join_finalize(struct thread_task *task, void **result) {
+    *result = task->result;
+    /* A periodic task stays in the pool until cancelled. */
+    bool armed = false;
+    if (task->period > 0) {
+        pthread_mutex_lock(&task->owner->timer_lock);
+        armed = !task->timer_cancelled;
+        pthread_mutex_unlock(&task->owner->timer_lock);
+    }
+    if (!armed)
+        task->in_pool = false;
 }
 
 int thread_task_join(struct thread_task *task, void **result) {
     if (!task || !result) return TPOOL_ERR_INVALID_ARGUMENT;
-    if (task->state == TASK_NEW || !task->owner) return TPOOL_ERR_TASK_NOT_PUSHED;
+    if (task_state_of(task->state) == TASK_NEW || !task->owner)
+        return TPOOL_ERR_TASK_NOT_PUSHED;
 
-    pthread_mutex_lock(&task->lock);
-    while (task->state != TASK_DONE)
-        pthread_cond_wait(&task->cond, &task->lock);
-    *result = task->result;
-    pthread_mutex_unlock(&task->lock);
+    /*
+     * A sub-microsecond task likely finishes while the joiner
+     * spins - then neither side pays for a kernel sleep/wakeup.
+     */
+    int spun = 0;
+    int backoff = 1;
+    while (spun < task->owner->spin_limit &&
+           task_state_of(task->state) != TASK_DONE) {
+        for (int i = 0; i < backoff; ++i)
+            cpu_relax();
+        spun += backoff;
+        if (backoff < 64)
+            backoff *= 2;
+    }
 
+    task_wait_done(task, NULL);
+    task_join_finalize(task, result);
     return 0;
 }
 
 #if NEED_TIMED_JOIN
 
 int thread_task_timed_join(struct thread_task *task, double timeout, void **result) {
-    (void)task;
-    (void)timeout;
-    (void)result;
-    return TPOOL_ERR_NOT_IMPLEMENTED;
+    if (!task || !result) return TPOOL_ERR_INVALID_ARGUMENT;
+    if (task_state_of(task->state) == TASK_NEW || !task->owner)
+        return TPOOL_ERR_TASK_NOT_PUSHED;
+
+    if (timeout <= 0) {
+        if (task_state_of(task->state) != TASK_DONE)
+            return TPOOL_ERR_TIMEOUT;
+    } else if (timeout >= 1e9) {
+        /* Anything past ~30 years is an infinity. */
+        task_wait_done(task, NULL);
+    } else {
+        struct timespec deadline = deadline_in(timeout);
+        if (!task_wait_done(task, &deadline))
+            return TPOOL_ERR_TIMEOUT;
+    }
+    task_join_finalize(task, result);
+    return 0;
 }
 
 #endif
 
 int thread_task_delete(struct thread_task *task) {
     if (!task) return TPOOL_ERR_INVALID_ARGUMENT;
-    if (task->state == TASK_QUEUED || task->state == TASK_RUNNING)
+    if (task->in_pool)
         return TPOOL_ERR_TASK_IN_POOL;
 
-    pthread_mutex_destroy(&task->lock);
-    pthread_cond_destroy(&task->cond);
-    free(task);
+    slab_free(&task_cache, task);
     return 0;
 }
 
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 /**
  * Here you should specify which features do you want to implement via macros:
@@ -16,7 +18,18 @@
  * used by tests.
  */
 #define NEED_DETACH 0
-#define NEED_TIMED_JOIN 0
+#define NEED_TIMED_JOIN 1
+#define NEED_TASK_THEN 1
+#define NEED_PUSH_MANY 1
+#define NEED_SPIN_WAIT 1
+#define NEED_DELAYED_TASKS 1
+#define NEED_WORKER_SCALING 1
+#define NEED_TASK_PRIORITY 1
+#define NEED_KEYED_TASKS 1
+#define NEED_PARALLEL_FOR 1
+#define NEED_OVERFLOW_POLICY 1
+#define NEED_AFFINITY 1
+#define NEED_FAST_SPAWN 1
 
 struct thread_pool;
 struct thread_task;
@@ -28,6 +41,41 @@ enum {
 	TPOOL_MAX_TASKS = 100000,
 };
 
+/** Priority lanes of a task queue, highest first. */
+enum {
+	TPOOL_PRIO_HIGH = 0,
+	TPOOL_PRIO_NORMAL,
+	TPOOL_PRIO_LOW,
+	TPOOL_PRIO_COUNT,
+};
+
+/** Buckets of the telemetry histograms, log2 of microseconds. */
+enum {
+	TPOOL_STAT_BUCKETS = 16,
+};
+
+/** A snapshot of the pool's telemetry, see thread_pool_stats_get(). */
+struct thread_pool_stats {
+	/** Tasks ever pushed into the pool, by any push function. */
+	uint64_t submitted;
+	/** Tasks whose function has finished running. */
+	uint64_t completed;
+	/** Tasks sitting in the worker queues right now. */
+	int queue_depth;
+	/** Workers alive right now. */
+	int thread_count;
+	/** Workers executing a task right now. */
+	int busy_count;
+	/** Total time the workers spent executing tasks, in ns. Divide
+	 * by wall time * thread_count for the pool's utilization. */
+	uint64_t busy_ns;
+	/** Queue-wait times, bucket i counts waits of [2^i, 2^(i+1)) us,
+	 * the first and last buckets absorb the tails. */
+	uint64_t wait_hist[TPOOL_STAT_BUCKETS];
+	/** Execution times, bucketed the same way. */
+	uint64_t exec_hist[TPOOL_STAT_BUCKETS];
+};
+
 enum thread_poool_errcode {
 	TPOOL_ERR_INVALID_ARGUMENT = 1,
 	TPOOL_ERR_TOO_MANY_TASKS,
@@ -54,6 +102,158 @@ enum thread_poool_errcode {
 int
 thread_pool_new(int max_thread_count, struct thread_pool **pool);
 
+#if NEED_SPIN_WAIT
+
+/**
+ * Like thread_pool_new(), but with a configurable wait policy. An
+ * idle worker, and a joiner of an unfinished task, first spin for
+ * up to @a spin_limit iterations with exponential backoff before
+ * parking on the condvar - a task pushed (or finished) within that
+ * window is picked up without paying the several-microsecond kernel
+ * wakeup, which dwarfs a sub-microsecond task. Pass 0 to always
+ * park right away; thread_pool_new() uses a small default.
+ * @param max_thread_count Maximum pool size.
+ * @param spin_limit Iterations to spin before sleeping.
+ * @param[out] Pointer to store result pool object.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - max_thread_count is too big,
+ *       or 0, or spin_limit is negative.
+ */
+int
+thread_pool_new_ex(int max_thread_count, int spin_limit,
+		   struct thread_pool **pool);
+
+#endif
+
+#if NEED_WORKER_SCALING
+
+/**
+ * Like thread_pool_new(), but the pool shrinks after a burst. A
+ * worker which stays idle for @a idle_timeout seconds exits, as long
+ * as more than @a min_thread_count workers remain - a bursty
+ * workload then does not carry the stacks and wakeup costs of 20
+ * idle threads forever. Workers are recreated on demand by the next
+ * pushes, up to @a max_thread_count, exactly like the lazy creation
+ * of thread_pool_new(); thread_pool_thread_count() reflects the
+ * retirements.
+ * @param min_thread_count Workers kept alive even when idle, >= 0.
+ * @param max_thread_count Maximum pool size.
+ * @param idle_timeout Seconds of idleness before a surplus worker
+ *        exits, > 0.
+ * @param[out] Pointer to store result pool object.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - a bound is out of range, or
+ *       min exceeds max, or the timeout is not positive.
+ */
+int
+thread_pool_new_scaled(int min_thread_count, int max_thread_count,
+		       double idle_timeout, struct thread_pool **pool);
+
+#endif
+
+#if NEED_FAST_SPAWN
+
+/**
+ * Like thread_pool_new_scaled(), but the workers are spawned on
+ * stacks pre-mapped by the pool, one per slot, reused across worker
+ * generations. Most of a spawn's cost is the stack mapping and its
+ * guard page; with the scaling mode churning workers on every burst
+ * that cost is paid per burst, with this pool it is paid once per
+ * slot for the pool's lifetime. The arguments and the scaling
+ * behavior are those of thread_pool_new_scaled().
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - a bound is out of range, or
+ *       min exceeds max, or the timeout is not positive.
+ */
+int
+thread_pool_new_fast_spawn(int min_thread_count, int max_thread_count,
+			   double idle_timeout, struct thread_pool **pool);
+
+#endif
+
+#if NEED_OVERFLOW_POLICY
+
+/** What a push into a pool with TPOOL_MAX_TASKS queued tasks does. */
+enum thread_pool_overflow_policy {
+	/** Fail with TPOOL_ERR_TOO_MANY_TASKS. The default. */
+	TPOOL_OVERFLOW_REJECT = 0,
+	/**
+	 * The pusher runs the task inline and the push returns 0 with
+	 * the task finished. Overload then converts the would-be
+	 * rejection (and the retry loop it breeds) into useful work,
+	 * and throttles the submitters by exactly one task each.
+	 */
+	TPOOL_OVERFLOW_CALLER_RUNS,
+	/**
+	 * The push blocks until the queues have room - plain
+	 * backpressure, the submitters run at the pool's pace.
+	 */
+	TPOOL_OVERFLOW_BLOCK,
+	/**
+	 * One waiting task - the head of the lowest non-empty lane -
+	 * is completed with a NULL result to make room, as if it was
+	 * cancelled. For workloads where the oldest queued work is
+	 * the most likely to be already useless.
+	 */
+	TPOOL_OVERFLOW_DROP_OLDEST,
+};
+
+/**
+ * Like thread_pool_new(), but with the given overflow policy instead
+ * of the default rejection. The policy applies to
+ * thread_pool_push_task() only; the batch, keyed and timed pushes
+ * keep rejecting, their counting does not compose with shedding.
+ * @param max_thread_count Maximum pool size.
+ * @param policy One of the TPOOL_OVERFLOW_* policies.
+ * @param[out] Pointer to store result pool object.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - max_thread_count is too big,
+ *       or 0, or the policy is not a known one.
+ */
+int
+thread_pool_new_overflow(int max_thread_count,
+			 enum thread_pool_overflow_policy policy,
+			 struct thread_pool **pool);
+
+#endif
+
+#if NEED_AFFINITY
+
+/**
+ * Like thread_pool_new(), but worker slot i is pinned to CPU
+ * cpus[i % cpu_count], and a push is steered to a worker on the
+ * submitter's own NUMA node - the implicit affinity hint of every
+ * task is where it was pushed from. On a multi-socket box that keeps
+ * the task's data in the local LLC instead of dragging it over the
+ * interconnect; a worker which runs dry still steals cross-node, so
+ * no node idles while another one is backlogged. Node detection is
+ * best effort (sysfs); where it fails the pool behaves like a plain
+ * round-robin one.
+ * @param max_thread_count Maximum pool size.
+ * @param cpus CPUs to pin the workers to.
+ * @param cpu_count Count of @a cpus, > 0.
+ * @param[out] Pointer to store result pool object.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - max_thread_count is too big,
+ *       or 0, or the CPU list is empty or names a CPU the machine
+ *       does not have.
+ */
+int
+thread_pool_new_pinned(int max_thread_count, const int *cpus, int cpu_count,
+		       struct thread_pool **pool);
+
+#endif
+
 /**
  * How many threads are created by this pool. Can be less than
  * max.
@@ -63,6 +263,25 @@ thread_pool_new(int max_thread_count, struct thread_pool **pool);
 int
 thread_pool_thread_count(const struct thread_pool *pool);
 
+/**
+ * Fill @a stats with a snapshot of the pool's counters. The counters
+ * are always on: each worker keeps its own cache-line-private ones,
+ * updated with relaxed atomics, and this call aggregates them - the
+ * hot paths pay a clock read and a few uncontended increments per
+ * task, cheap enough to leave enabled in production. Concurrent with
+ * running tasks the snapshot is not an atomic cut: submitted can be
+ * momentarily ahead of queue_depth + completed.
+ * @param pool Pool to read the counters of.
+ * @param[out] stats Snapshot to fill.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - pool or stats is NULL.
+ */
+int
+thread_pool_stats_get(const struct thread_pool *pool,
+		      struct thread_pool_stats *stats);
+
 /**
  * Delete @a pool, free its memory.
  * @param pool Pool to delete.
@@ -86,6 +305,131 @@ thread_pool_delete(struct thread_pool *pool);
 int
 thread_pool_push_task(struct thread_pool *pool, struct thread_task *task);
 
+#if NEED_PARALLEL_FOR
+
+/** Body of a parallel loop, called with disjoint subranges. */
+typedef void (*thread_pool_range_f)(size_t begin, size_t end, void *ctx);
+
+/**
+ * Run @a fn over [@a begin, @a end) on all the pool's workers at
+ * once, without creating per-item tasks: the participants claim
+ * grain-sized subranges from a shared cursor until the range is
+ * exhausted, so a thread which finishes early steals what is left.
+ * The calling thread participates too instead of blocking, and the
+ * call returns when the whole range is done. Pick @a grain so a
+ * chunk is worth more than a few atomic operations - too fine a
+ * grain turns the cursor into the bottleneck.
+ * @param pool Pool to run on.
+ * @param begin First index of the range.
+ * @param end One past the last index.
+ * @param grain Indexes claimed at a time, > 0.
+ * @param fn Loop body, gets each claimed subrange exactly once.
+ * @param ctx Opaque pointer passed through to @a fn.
+ *
+ * @retval 0 Success, the whole range was executed.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - no function, a zero grain, or
+ *       begin past end.
+ */
+int
+thread_pool_parallel_for(struct thread_pool *pool, size_t begin, size_t end,
+			 size_t grain, thread_pool_range_f fn, void *ctx);
+
+#endif
+
+#if NEED_KEYED_TASKS
+
+/**
+ * Push @a task into a serial stream: tasks pushed with the same
+ * @a key execute one after another in push order, tasks with
+ * different keys run concurrently as usual. Only the first task of a
+ * key occupies the worker queues; the rest wait in a per-key list
+ * and are handed over by the worker which completes their
+ * predecessor. Replaces the external-mutex pattern for
+ * per-connection ordering - nothing blocks, so there is no lock
+ * convoy. The task counts as being in the pool from this call on;
+ * join and delete it like an ordinary pushed task.
+ * @param pool Pool to push into.
+ * @param task Task to push.
+ * @param key Stream to order the task into.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_TOO_MANY_TASKS - pool has too many tasks
+ *       already.
+ */
+int
+thread_pool_push_task_keyed(struct thread_pool *pool,
+			    struct thread_task *task, uint64_t key);
+
+#endif
+
+#if NEED_DELAYED_TASKS
+
+/**
+ * Push @a task so it starts after @a delay seconds. The timer is
+ * serviced by the pool's own workers - whichever worker is awake
+ * (or wakes up on the deadline) enqueues the expired task, there is
+ * no separate timer thread and no cross-thread handoff. The task
+ * counts as being in the pool from this call on.
+ * @param pool Pool to push into.
+ * @param task Task to push.
+ * @param delay Delay in seconds before the task is enqueued.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_TOO_MANY_TASKS - pool has too many tasks
+ *       already.
+ */
+int
+thread_pool_push_task_delayed(struct thread_pool *pool,
+			      struct thread_task *task, double delay);
+
+/**
+ * Push @a task so it runs every @a period seconds, first time after
+ * one period. After each completion the task is re-armed by the
+ * worker which ran it, until thread_task_cancel(). A join waits for
+ * the next completion; the task stays in the pool until cancelled
+ * and joined.
+ * @param pool Pool to push into.
+ * @param task Task to push.
+ * @param period Period in seconds, > 0.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_TOO_MANY_TASKS - pool has too many tasks
+ *       already.
+ */
+int
+thread_pool_push_task_periodic(struct thread_pool *pool,
+			       struct thread_task *task, double period);
+
+#endif
+
+#if NEED_PUSH_MANY
+
+/**
+ * Push @a count tasks at once. The batch is linked up privately and
+ * spliced into a queue as one chain - one lock acquisition and one
+ * worker wakeup for the whole call, instead of one per task. Either
+ * the whole batch is pushed or, on error, none of it.
+ * @param pool Pool to push into.
+ * @param tasks Array of @a count tasks to push.
+ * @param count Task count, > 0.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_TOO_MANY_TASKS - the batch would not fit into
+ *       the pool.
+ *     - TPOOL_ERR_TASK_IN_POOL - a task in the batch is already in
+ *       a pool.
+ */
+int
+thread_pool_push_task_many(struct thread_pool *pool,
+			   struct thread_task **tasks, int count);
+
+#endif
+
 /** Thread pool task API. */
 
 /**
@@ -99,6 +443,29 @@ thread_pool_push_task(struct thread_pool *pool, struct thread_task *task);
 int
 thread_task_new(struct thread_task **task, thread_task_f function, void *arg);
 
+#if NEED_TASK_PRIORITY
+
+/**
+ * Like thread_task_new(), but the task goes into the given priority
+ * lane of its queue. Workers drain the higher lanes first, so an
+ * urgent task overtakes a bulk backlog; periodically a queue serves
+ * its lanes bottom-up, so a permanently full high lane still can not
+ * starve the low ones. thread_task_new() uses TPOOL_PRIO_NORMAL.
+ * @param[out] task Pointer to store result task object.
+ * @param function Function to run by this task.
+ * @param arg Argument for @a function.
+ * @param prio One of the TPOOL_PRIO_* lanes.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - prio is not a known lane.
+ */
+int
+thread_task_new_prio(struct thread_task **task, thread_task_f function,
+		     void *arg, int prio);
+
+#endif
+
 /**
  * Check if @a task is finished and its result can be obtained.
  * @param task Task to check.
@@ -113,6 +480,35 @@ thread_task_is_finished(const struct thread_task *task);
 bool
 thread_task_is_running(const struct thread_task *task);
 
+/**
+ * Best-effort cancellation of @a task. A task which did not start
+ * yet is removed from wherever it waits - its worker queue (in O(1)),
+ * the timer heap, or its serial key's line - and completed right away
+ * with a NULL result, so it can be joined and deleted as usual; the
+ * worker time it would have burned is reclaimed, which under overload
+ * is most of the pool's throughput. A task already running is not
+ * interrupted, it is only marked - a long function can poll
+ * thread_task_is_cancelled() and bail out early. A periodic task
+ * additionally stops being re-armed; if it is running right now, the
+ * current run finishes.
+ * @param task Task to cancel.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_TASK_NOT_PUSHED - task is not in a pool.
+ */
+int
+thread_task_cancel(struct thread_task *task);
+
+/**
+ * Check if thread_task_cancel() was called on @a task after its last
+ * push. For polling from inside the task function - the cooperative
+ * half of cancellation.
+ * @param task Task to check.
+ */
+bool
+thread_task_is_cancelled(const struct thread_task *task);
+
 /**
  * Join the task. If it is not finished, then wait until it is.
  * Note, this function does not delete task object. It can be
@@ -127,6 +523,33 @@ thread_task_is_running(const struct thread_task *task);
 int
 thread_task_join(struct thread_task *task, void **result);
 
+#if NEED_TASK_THEN
+
+/**
+ * Enqueue @a next into the pool of @a task right when @a task
+ * completes, done by the worker which ran it. Replaces the
+ * join-then-push pattern for task chains - no thread has to block
+ * on a join just to submit the dependent task. A task can have one
+ * continuation at a time. If @a task is already finished, @a next
+ * is enqueued right away.
+ * @param task Task to continue after. Must be pushed to a pool.
+ * @param next Task to enqueue on its completion. Counts as being
+ *        in the pool from this call on, join it like a pushed one.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_TASK_NOT_PUSHED - @a task is not pushed to a
+ *       pool.
+ *     - TPOOL_ERR_TASK_IN_POOL - @a next is already in a pool, or
+ *       @a task has a continuation.
+ *     - TPOOL_ERR_TOO_MANY_TASKS - pool has too many tasks
+ *       already.
+ */
+int
+thread_task_then(struct thread_task *task, struct thread_task *next);
+
+#endif
+
 #if NEED_TIMED_JOIN
 
 /**
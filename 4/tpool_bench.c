@@ -0,0 +1,337 @@
+#include "thread_pool.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Benchmarks of the thread pool fast paths. Unlike test.c this
+ * measures speed, not correctness - a regression gate for the queue,
+ * the work stealing and the task synchronization. Covered are the
+ * submission throughput with one and with several producers, the
+ * round-trip of one empty task through push and join, the wakeup
+ * latency of a parked joiner, and the throughput scaling with the
+ * worker count. Every case warms up once, then the median of the
+ * timed runs is reported. The output is CSV, one row per number, so
+ * the rates can be tracked across releases.
+ *
+ * Build with 'make bench'.
+ */
+
+enum {
+	BENCH_RUN_COUNT = 5,
+	BENCH_POOL_SIZE = 4,
+	/* Half of TPOOL_MAX_TASKS so a push burst can not overflow. */
+	BENCH_PUSH_COUNT = TPOOL_MAX_TASKS / 2,
+	BENCH_PRODUCER_COUNT = 4,
+	BENCH_RTT_OP_COUNT = 10000,
+	BENCH_WAKEUP_OP_COUNT = 200,
+	BENCH_SCALE_TASK_COUNT = 20000,
+	BENCH_SCALE_SPIN_COUNT = 2000,
+};
+
+static double
+now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void
+report(const char *key, int threads, double value, const char *unit)
+{
+	printf("%s,%d,%.3f,%s\n", key, threads, value, unit);
+}
+
+static int
+double_cmp(const void *a, const void *b)
+{
+	double l = *(const double *)a;
+	double r = *(const double *)b;
+	return l < r ? -1 : l > r;
+}
+
+static double
+median_of(double *times, int count)
+{
+	qsort(times, count, sizeof(times[0]), double_cmp);
+	return times[count / 2];
+}
+
+static void
+die(const char *what, int rc)
+{
+	fprintf(stderr, "%s failed, error %d\n", what, rc);
+	exit(1);
+}
+
+static void *
+task_empty_f(void *arg)
+{
+	(void)arg;
+	return NULL;
+}
+
+/* A few microseconds of CPU work, so the scaling runs are compute
+ * bound and not queue bound. */
+static void *
+task_spin_f(void *arg)
+{
+	(void)arg;
+	for (volatile int i = 0; i < BENCH_SCALE_SPIN_COUNT; ++i)
+		;
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////////////
+
+struct producer_ctx {
+	struct thread_pool *pool;
+	struct thread_task **tasks;
+	int count;
+};
+
+static void *
+producer_f(void *arg)
+{
+	struct producer_ctx *ctx = arg;
+	for (int i = 0; i < ctx->count; ++i) {
+		int rc = thread_pool_push_task(ctx->pool, ctx->tasks[i]);
+		if (rc != 0)
+			die("push", rc);
+	}
+	return NULL;
+}
+
+/*
+ * Push a burst of empty tasks from the given number of producer
+ * threads while the workers drain it. Only the pushes are timed -
+ * the joins happen after the clock stops. With one producer this is
+ * the raw push cost, with several it is the contention on the
+ * submission side.
+ */
+static void
+bench_submission(int producer_count)
+{
+	struct thread_pool *pool;
+	int rc = thread_pool_new(BENCH_POOL_SIZE, &pool);
+	if (rc != 0)
+		die("pool new", rc);
+	struct thread_task **tasks =
+		malloc(BENCH_PUSH_COUNT * sizeof(tasks[0]));
+	for (int i = 0; i < BENCH_PUSH_COUNT; ++i) {
+		rc = thread_task_new(&tasks[i], task_empty_f, NULL);
+		if (rc != 0)
+			die("task new", rc);
+	}
+
+	void *result;
+	double times[BENCH_RUN_COUNT + 1];
+	/* Run 0 is the warmup and is not reported. */
+	for (int run = 0; run < BENCH_RUN_COUNT + 1; ++run) {
+		struct producer_ctx ctxs[BENCH_PRODUCER_COUNT];
+		pthread_t threads[BENCH_PRODUCER_COUNT];
+		int per_producer = BENCH_PUSH_COUNT / producer_count;
+		for (int i = 0; i < producer_count; ++i) {
+			ctxs[i].pool = pool;
+			ctxs[i].tasks = tasks + i * per_producer;
+			ctxs[i].count = per_producer;
+		}
+		double t = now_sec();
+		if (producer_count == 1) {
+			producer_f(&ctxs[0]);
+		} else {
+			for (int i = 0; i < producer_count; ++i)
+				pthread_create(&threads[i], NULL, producer_f,
+					       &ctxs[i]);
+			for (int i = 0; i < producer_count; ++i)
+				pthread_join(threads[i], NULL);
+		}
+		times[run] = now_sec() - t;
+		for (int i = 0; i < per_producer * producer_count; ++i) {
+			rc = thread_task_join(tasks[i], &result);
+			if (rc != 0)
+				die("join", rc);
+		}
+	}
+
+	for (int i = 0; i < BENCH_PUSH_COUNT; ++i)
+		thread_task_delete(tasks[i]);
+	free(tasks);
+	rc = thread_pool_delete(pool);
+	if (rc != 0)
+		die("pool delete", rc);
+
+	char key[128];
+	snprintf(key, sizeof(key), "push_%dp", producer_count);
+	report(key, BENCH_POOL_SIZE, BENCH_PUSH_COUNT /
+		median_of(times + 1, BENCH_RUN_COUNT) / 1e3, "Kops/sec");
+}
+
+/*
+ * One empty task pushed and joined in a tight loop - the full
+ * round-trip through the queue, a worker and the task state word.
+ * The join usually catches the task already done, so this is the
+ * fast path of both sides.
+ */
+static void
+bench_round_trip(void)
+{
+	struct thread_pool *pool;
+	int rc = thread_pool_new(BENCH_POOL_SIZE, &pool);
+	if (rc != 0)
+		die("pool new", rc);
+	struct thread_task *task;
+	rc = thread_task_new(&task, task_empty_f, NULL);
+	if (rc != 0)
+		die("task new", rc);
+
+	void *result;
+	double times[BENCH_RUN_COUNT + 1];
+	for (int run = 0; run < BENCH_RUN_COUNT + 1; ++run) {
+		double t = now_sec();
+		for (int i = 0; i < BENCH_RTT_OP_COUNT; ++i) {
+			rc = thread_pool_push_task(pool, task);
+			if (rc != 0)
+				die("push", rc);
+			rc = thread_task_join(task, &result);
+			if (rc != 0)
+				die("join", rc);
+		}
+		times[run] = now_sec() - t;
+	}
+
+	thread_task_delete(task);
+	rc = thread_pool_delete(pool);
+	if (rc != 0)
+		die("pool delete", rc);
+	report("round_trip", BENCH_POOL_SIZE, median_of(times + 1,
+		BENCH_RUN_COUNT) / BENCH_RTT_OP_COUNT * 1e6, "usec");
+}
+
+static _Atomic uint64_t wakeup_done_ns;
+
+static void *
+task_wakeup_f(void *arg)
+{
+	(void)arg;
+	/* Give the joiner time to burn its spin budget and park. */
+	usleep(1000);
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	atomic_store(&wakeup_done_ns,
+		     (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+	return NULL;
+}
+
+/*
+ * Time from a task finishing to its parked joiner returning. The
+ * task sleeps long enough for the joiner to park, stamps the clock
+ * right before completing, and the joiner reads the clock again
+ * after the join - the difference is the pure wakeup.
+ */
+static void
+bench_join_wakeup(void)
+{
+	struct thread_pool *pool;
+	int rc = thread_pool_new(BENCH_POOL_SIZE, &pool);
+	if (rc != 0)
+		die("pool new", rc);
+	struct thread_task *task;
+	rc = thread_task_new(&task, task_wakeup_f, NULL);
+	if (rc != 0)
+		die("task new", rc);
+
+	void *result;
+	double times[BENCH_RUN_COUNT + 1];
+	for (int run = 0; run < BENCH_RUN_COUNT + 1; ++run) {
+		double total = 0;
+		for (int i = 0; i < BENCH_WAKEUP_OP_COUNT; ++i) {
+			rc = thread_pool_push_task(pool, task);
+			if (rc != 0)
+				die("push", rc);
+			rc = thread_task_join(task, &result);
+			if (rc != 0)
+				die("join", rc);
+			struct timespec ts;
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			uint64_t end = (uint64_t)ts.tv_sec * 1000000000 +
+				ts.tv_nsec;
+			total += (end - atomic_load(&wakeup_done_ns)) * 1e-9;
+		}
+		times[run] = total / BENCH_WAKEUP_OP_COUNT;
+	}
+
+	thread_task_delete(task);
+	rc = thread_pool_delete(pool);
+	if (rc != 0)
+		die("pool delete", rc);
+	report("join_wakeup", BENCH_POOL_SIZE,
+		median_of(times + 1, BENCH_RUN_COUNT) * 1e6, "usec");
+}
+
+/*
+ * A fixed batch of small compute tasks on pools of growing size -
+ * the scaling curve. A flat spot below the CPU count points at
+ * contention in the queues or in the stealing.
+ */
+static void
+bench_scaling(int thread_count)
+{
+	struct thread_pool *pool;
+	int rc = thread_pool_new(thread_count, &pool);
+	if (rc != 0)
+		die("pool new", rc);
+	struct thread_task **tasks =
+		malloc(BENCH_SCALE_TASK_COUNT * sizeof(tasks[0]));
+	for (int i = 0; i < BENCH_SCALE_TASK_COUNT; ++i) {
+		rc = thread_task_new(&tasks[i], task_spin_f, NULL);
+		if (rc != 0)
+			die("task new", rc);
+	}
+
+	void *result;
+	double times[BENCH_RUN_COUNT + 1];
+	for (int run = 0; run < BENCH_RUN_COUNT + 1; ++run) {
+		double t = now_sec();
+		for (int i = 0; i < BENCH_SCALE_TASK_COUNT; ++i) {
+			rc = thread_pool_push_task(pool, tasks[i]);
+			if (rc != 0)
+				die("push", rc);
+		}
+		for (int i = 0; i < BENCH_SCALE_TASK_COUNT; ++i) {
+			rc = thread_task_join(tasks[i], &result);
+			if (rc != 0)
+				die("join", rc);
+		}
+		times[run] = now_sec() - t;
+	}
+
+	for (int i = 0; i < BENCH_SCALE_TASK_COUNT; ++i)
+		thread_task_delete(tasks[i]);
+	free(tasks);
+	rc = thread_pool_delete(pool);
+	if (rc != 0)
+		die("pool delete", rc);
+	report("scaling", thread_count, BENCH_SCALE_TASK_COUNT /
+		median_of(times + 1, BENCH_RUN_COUNT) / 1e3, "Kops/sec");
+}
+
+int
+main(void)
+{
+	printf("benchmark,threads,value,unit\n");
+	bench_submission(1);
+	bench_submission(BENCH_PRODUCER_COUNT);
+	bench_round_trip();
+	bench_join_wakeup();
+	static const int scale_steps[] = {1, 2, 4, 8, 16, TPOOL_MAX_THREADS};
+	for (size_t i = 0; i < sizeof(scale_steps) / sizeof(scale_steps[0]);
+	     ++i)
+		bench_scaling(scale_steps[i]);
+	return 0;
+}
@@ -1,12 +1,21 @@
 #include "chat.h"
 
 #include <poll.h>
+#include <stdatomic.h>
 #include <stdlib.h>
+#include <string.h>
 
 void
 chat_message_delete(struct chat_message *msg)
 {
-	free(msg->data);
+#if NEED_AUTHOR
+	if (msg->author != NULL)
+		chat_author_unref(msg->author);
+#endif
+	/* The data can be allocated inline, right after the struct -
+	 * then it is freed together with it. */
+	if (msg->data != (char *)(msg + 1))
+		free(msg->data);
 	free(msg);
 }
 
@@ -20,3 +29,348 @@ chat_events_to_poll_events(int mask)
 		res |= POLLOUT;
 	return res;
 }
+
+#if NEED_AUTHOR
+
+enum {
+	AUTHORS_FIRST_BUCKET_COUNT = 64,
+};
+
+/** One canonical name; the messages alias 'name' directly. */
+struct chat_author {
+	_Atomic int refs;
+	uint32_t hash;
+	uint32_t len;
+	/** Next in the bucket's chain. */
+	struct chat_author *next;
+	char name[];
+};
+
+struct chat_authors {
+	struct chat_author **buckets;
+	size_t bucket_count;
+	size_t count;
+	/**
+	 * The table is hit once per connection, not per message - a
+	 * spinlock is plenty and keeps the clients free of libpthread.
+	 */
+	atomic_flag lock;
+};
+
+/** Get the header of an interned name back from the name pointer. */
+static struct chat_author *
+author_of(const char *name)
+{
+	return (struct chat_author *)((char *)name -
+		offsetof(struct chat_author, name));
+}
+
+static uint32_t
+author_hash(const char *name, size_t len)
+{
+	/* FNV-1a. */
+	uint32_t res = 2166136261u;
+	for (size_t i = 0; i < len; ++i) {
+		res ^= (uint8_t)name[i];
+		res *= 16777619;
+	}
+	return res;
+}
+
+struct chat_authors *
+chat_authors_new(void)
+{
+	struct chat_authors *authors = calloc(1, sizeof(*authors));
+	if (authors == NULL)
+		abort();
+	authors->bucket_count = AUTHORS_FIRST_BUCKET_COUNT;
+	authors->buckets = calloc(authors->bucket_count,
+				  sizeof(authors->buckets[0]));
+	if (authors->buckets == NULL)
+		abort();
+	return authors;
+}
+
+void
+chat_authors_delete(struct chat_authors *authors)
+{
+	for (size_t i = 0; i < authors->bucket_count; ++i) {
+		struct chat_author *author = authors->buckets[i];
+		while (author != NULL) {
+			struct chat_author *next = author->next;
+			chat_author_unref(author->name);
+			author = next;
+		}
+	}
+	free(authors->buckets);
+	free(authors);
+}
+
+static void
+authors_grow(struct chat_authors *authors)
+{
+	size_t new_count = authors->bucket_count * 2;
+	struct chat_author **new_buckets =
+		calloc(new_count, sizeof(new_buckets[0]));
+	if (new_buckets == NULL)
+		abort();
+	for (size_t i = 0; i < authors->bucket_count; ++i) {
+		struct chat_author *author = authors->buckets[i];
+		while (author != NULL) {
+			struct chat_author *next = author->next;
+			size_t idx = author->hash & (new_count - 1);
+			author->next = new_buckets[idx];
+			new_buckets[idx] = author;
+			author = next;
+		}
+	}
+	free(authors->buckets);
+	authors->buckets = new_buckets;
+	authors->bucket_count = new_count;
+}
+
+const char *
+chat_authors_intern(struct chat_authors *authors, const char *name,
+		    size_t name_len)
+{
+	uint32_t hash = author_hash(name, name_len);
+	while (atomic_flag_test_and_set(&authors->lock))
+		{};
+	size_t idx = hash & (authors->bucket_count - 1);
+	struct chat_author *author = authors->buckets[idx];
+	while (author != NULL && (author->hash != hash ||
+	       author->len != name_len ||
+	       memcmp(author->name, name, name_len) != 0))
+		author = author->next;
+	if (author != NULL) {
+		atomic_fetch_add(&author->refs, 1);
+		atomic_flag_clear(&authors->lock);
+		return author->name;
+	}
+	author = malloc(sizeof(*author) + name_len + 1);
+	if (author == NULL)
+		abort();
+	/* One ref is the table's, one is the caller's. */
+	author->refs = 2;
+	author->hash = hash;
+	author->len = name_len;
+	memcpy(author->name, name, name_len);
+	author->name[name_len] = 0;
+	author->next = authors->buckets[idx];
+	authors->buckets[idx] = author;
+	if (++authors->count > authors->bucket_count * 2)
+		authors_grow(authors);
+	atomic_flag_clear(&authors->lock);
+	return author->name;
+}
+
+const char *
+chat_author_ref(const char *author)
+{
+	atomic_fetch_add(&author_of(author)->refs, 1);
+	return author;
+}
+
+void
+chat_author_unref(const char *author)
+{
+	struct chat_author *obj = author_of(author);
+	if (atomic_fetch_sub(&obj->refs, 1) == 1)
+		free(obj);
+}
+
+#endif
+
+#if NEED_BINARY_FRAMING
+
+int
+chat_varint_encode(uint32_t value, char *buf)
+{
+	int size = 0;
+	do {
+		uint8_t byte = value & 0x7f;
+		value >>= 7;
+		if (value != 0)
+			byte |= 0x80;
+		buf[size++] = byte;
+	} while (value != 0);
+	return size;
+}
+
+int
+chat_varint_decode(const char *data, size_t size, uint32_t *value)
+{
+	if (size > CHAT_VARINT_MAX)
+		size = CHAT_VARINT_MAX;
+	uint32_t res = 0;
+	for (size_t i = 0; i < size; ++i) {
+		uint8_t byte = data[i];
+		res |= (uint32_t)(byte & 0x7f) << (i * 7);
+		if ((byte & 0x80) == 0) {
+			*value = res;
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
+#endif
+
+#if NEED_COMPRESSION
+
+enum {
+	LZ4_HASH_LOG = 12,
+	LZ4_MIN_MATCH = 4,
+	/** A match may not cover the last 5 bytes of the input. */
+	LZ4_LAST_LITERALS = 5,
+	/** The last match may not start closer than this to the end. */
+	LZ4_MATCH_LIMIT = 12,
+	LZ4_MAX_OFFSET = 65535,
+};
+
+static uint32_t
+lz4_read32(const char *data)
+{
+	uint32_t res;
+	memcpy(&res, data, sizeof(res));
+	return res;
+}
+
+static uint32_t
+lz4_hash(uint32_t seq)
+{
+	/* Fibonacci hashing of the next 4 bytes. */
+	return (seq * 2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+/** Emit a length the LZ4 way: 255-bytes, then the remainder. */
+static uint32_t
+lz4_put_len(char *dst, uint32_t pos, uint32_t len)
+{
+	while (len >= 255) {
+		dst[pos++] = (char)255;
+		len -= 255;
+	}
+	dst[pos++] = (char)len;
+	return pos;
+}
+
+uint32_t
+chat_lz4_compress(const char *src, uint32_t src_size, char *dst,
+		  uint32_t dst_cap)
+{
+	/*
+	 * Greedy parsing with a single-slot hash table of 4-byte
+	 * sequences - the reference fast path. Positions are stored
+	 * +1 so zero means an empty slot.
+	 */
+	uint32_t table[1 << LZ4_HASH_LOG];
+	memset(table, 0, sizeof(table));
+	uint32_t in = 0;
+	uint32_t out = 0;
+	uint32_t anchor = 0;
+	uint32_t in_limit = src_size > LZ4_MATCH_LIMIT ?
+		src_size - LZ4_MATCH_LIMIT : 0;
+	uint32_t match_limit = src_size > LZ4_LAST_LITERALS ?
+		src_size - LZ4_LAST_LITERALS : 0;
+	while (in < in_limit) {
+		uint32_t seq = lz4_read32(src + in);
+		uint32_t h = lz4_hash(seq);
+		uint32_t match = table[h];
+		table[h] = in + 1;
+		if (match == 0 || in - (match - 1) > LZ4_MAX_OFFSET ||
+		    lz4_read32(src + match - 1) != seq) {
+			++in;
+			continue;
+		}
+		--match;
+		uint32_t len = LZ4_MIN_MATCH;
+		while (in + len < match_limit &&
+		       src[match + len] == src[in + len])
+			++len;
+		uint32_t lit = in - anchor;
+		/* Token, both length extensions, literals, offset. */
+		uint32_t need = 1 + lit / 255 + 1 + lit + 2 + len / 255 + 1;
+		if (out + need > dst_cap)
+			return 0;
+		uint32_t len_code = len - LZ4_MIN_MATCH;
+		dst[out++] = (char)(((lit < 15 ? lit : 15) << 4) |
+				    (len_code < 15 ? len_code : 15));
+		if (lit >= 15)
+			out = lz4_put_len(dst, out, lit - 15);
+		memcpy(dst + out, src + anchor, lit);
+		out += lit;
+		uint32_t offset = in - match;
+		dst[out++] = (char)(offset & 0xff);
+		dst[out++] = (char)(offset >> 8);
+		if (len_code >= 15)
+			out = lz4_put_len(dst, out, len_code - 15);
+		in += len;
+		anchor = in;
+	}
+	uint32_t lit = src_size - anchor;
+	if (out + 1 + lit / 255 + 1 + lit > dst_cap)
+		return 0;
+	dst[out++] = (char)((lit < 15 ? lit : 15) << 4);
+	if (lit >= 15)
+		out = lz4_put_len(dst, out, lit - 15);
+	memcpy(dst + out, src + anchor, lit);
+	return out + lit;
+}
+
+int
+chat_lz4_decompress(const char *src, uint32_t src_size, char *dst,
+		    uint32_t dst_size)
+{
+	uint32_t in = 0;
+	uint32_t out = 0;
+	while (in < src_size) {
+		uint8_t token = src[in++];
+		uint32_t lit = token >> 4;
+		if (lit == 15) {
+			uint8_t byte;
+			do {
+				if (in >= src_size)
+					return -1;
+				byte = src[in++];
+				lit += byte;
+			} while (byte == 255);
+		}
+		if (lit > src_size - in || lit > dst_size - out)
+			return -1;
+		memcpy(dst + out, src + in, lit);
+		in += lit;
+		out += lit;
+		/* The last sequence is literals only. */
+		if (in == src_size)
+			break;
+		if (src_size - in < 2)
+			return -1;
+		uint32_t offset = (uint8_t)src[in] |
+			((uint32_t)(uint8_t)src[in + 1] << 8);
+		in += 2;
+		if (offset == 0 || offset > out)
+			return -1;
+		uint32_t len = token & 15;
+		if (len == 15) {
+			uint8_t byte;
+			do {
+				if (in >= src_size)
+					return -1;
+				byte = src[in++];
+				len += byte;
+			} while (byte == 255);
+		}
+		len += LZ4_MIN_MATCH;
+		if (len > dst_size - out)
+			return -1;
+		/* The ranges overlap when offset < len - copy bytewise. */
+		const char *from = dst + out - offset;
+		for (uint32_t i = 0; i < len; ++i)
+			dst[out + i] = from[i];
+		out += len;
+	}
+	return out == dst_size ? 0 : -1;
+}
+
+#endif
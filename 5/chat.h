@@ -1,5 +1,8 @@
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+
 /**
  * Here you should specify which features do you want to implement via macros:
  * If you want to enable author name support, do:
@@ -13,8 +16,51 @@
  * It is important to define these macros here, in the header, because it is
  * used by tests.
  */
-#define NEED_AUTHOR 0
+#define NEED_AUTHOR 1
 #define NEED_SERVER_FEED 0
+/** Multi-threaded server mode - see chat_server_listen_sharded(). */
+#define NEED_SHARDED_SERVER 1
+/** Server output limits - see chat_server_set_output_limit(). */
+#define NEED_OUTPUT_LIMIT 1
+/** Binary wire framing - see chat_client_set_binary(). */
+#define NEED_BINARY_FRAMING 1
+/** Compressed downstream frames - see chat_client_set_compressed(). */
+#define NEED_COMPRESSION 1
+
+/** Many clients in one event loop - see chat_client_group_new(). */
+#define NEED_CLIENT_GROUP 1
+
+/** Listener and peer handoff to a successor process - see
+ * chat_server_handoff_send(). */
+#define NEED_SERVER_HANDOFF 1
+
+/** Message history replay to late joiners - see
+ * chat_server_set_history(). */
+#define NEED_HISTORY 1
+
+/** Unreliable datagram ingest for telemetry - see
+ * chat_server_set_datagram(). */
+#define NEED_DATAGRAM 1
+
+/** Protocol work offload onto a thread pool - see
+ * chat_server_set_offload(). */
+#define NEED_OFFLOAD 1
+
+/** Disk spill of a client's outgoing overflow when the server
+ * stalls - the in-memory queue stays bounded, see chat_client.c. */
+#define NEED_OUTPUT_SPILL 1
+
+/** Per-peer token buckets metering the server's intake - see
+ * chat_server_set_rate_limit(). */
+#define NEED_RATE_LIMIT 1
+
+/** Server-side capture of the inbound traffic into a replayable
+ * log - see chat_server_set_capture() and chat_replay.c. */
+#define NEED_CAPTURE 1
+
+#if NEED_COMPRESSION && !NEED_BINARY_FRAMING
+#error "The compressed frames build on the binary framing"
+#endif
 
 enum chat_errcode {
 	CHAT_ERR_INVALID_ARGUMENT = 1,
@@ -34,13 +80,18 @@ enum chat_events {
 
 struct chat_message {
 #if NEED_AUTHOR
-	/** Author's name. */
+	/**
+	 * Author's name. Interned - the pointer aliases one canonical
+	 * refcounted copy per distinct name, released together with
+	 * the message. See chat_authors_intern().
+	 */
 	const char *author;
 #endif
 	/** 0-terminate text. */
 	char *data;
 
-	/* PUT HERE OTHER MEMBERS */
+	/** Next message in the owner's received-message queue. */
+	struct chat_message *next;
 };
 
 /** Free message's memory. */
@@ -50,3 +101,154 @@ chat_message_delete(struct chat_message *msg);
 /** Convert chat_events mask to events suitable for poll(). */
 int
 chat_events_to_poll_events(int mask);
+
+#if NEED_AUTHOR
+
+/**
+ * Interning table of author names. A chat sees a bounded set of
+ * distinct authors but an unbounded stream of their messages, so
+ * every name is stored once, refcounted, and each message holds just
+ * a pointer into the table - no per-message name allocation. The
+ * table is safe to share between threads.
+ */
+struct chat_authors;
+
+/** Create an empty interning table. */
+struct chat_authors *
+chat_authors_new(void);
+
+/**
+ * Delete the table. Names still referenced by live messages survive
+ * until their last ref is gone.
+ */
+void
+chat_authors_delete(struct chat_authors *authors);
+
+/**
+ * Get the canonical copy of the name, taking a ref on it. The ref
+ * has to be released with chat_author_unref().
+ */
+const char *
+chat_authors_intern(struct chat_authors *authors, const char *name,
+		    size_t name_len);
+
+/** Take one more ref on an interned name. */
+const char *
+chat_author_ref(const char *author);
+
+/** Release a ref on an interned name. */
+void
+chat_author_unref(const char *author);
+
+#endif
+
+#if NEED_BINARY_FRAMING
+
+enum {
+	/**
+	 * First byte a client sends after connect to switch the
+	 * connection to the binary framing. The chat payload is
+	 * human-readable text, so the byte never legitimately opens a
+	 * text-mode connection.
+	 */
+	CHAT_BINARY_MAGIC = 0x01,
+	/** A 32-bit varint takes at most 5 bytes, 7 bits per byte. */
+	CHAT_VARINT_MAX = 5,
+#if NEED_COMPRESSION
+	/**
+	 * Like CHAT_BINARY_MAGIC, but also switches the server->client
+	 * frames to the compressed format: varint raw size, varint
+	 * compressed size, then the body - LZ4 when the compressed
+	 * size is non-zero, stored raw otherwise. The client->server
+	 * direction stays plain binary - it is the fan-out multiplied
+	 * downstream that eats the bandwidth.
+	 */
+	CHAT_COMPRESSED_MAGIC = 0x02,
+	/** Bodies shorter than this are always stored raw. */
+	CHAT_COMPRESS_MIN = 128,
+#endif
+};
+
+/**
+ * Encode the value as an LEB128 varint into 'buf', which has to fit
+ * CHAT_VARINT_MAX bytes. Returns the encoded size.
+ */
+int
+chat_varint_encode(uint32_t value, char *buf);
+
+/**
+ * Decode an LEB128 varint from [data, data + size).
+ *
+ * @retval >0 The decoded byte count; 'value' is set.
+ * @retval 0 The varint is not complete yet.
+ */
+int
+chat_varint_decode(const char *data, size_t size, uint32_t *value);
+
+#endif
+
+#if NEED_CAPTURE
+
+/**
+ * The capture log format: a CHAT_CAPTURE_MAGIC u32, then records.
+ * Each record is one chat_capture_rec followed by rec.size payload
+ * bytes. The payload is the raw inbound byte stream, below any
+ * framing - a replay reproduces exactly what the recorded clients
+ * sent, whichever protocol they spoke.
+ */
+
+enum {
+	/** "CHC1" - the first four bytes of a capture log. */
+	CHAT_CAPTURE_MAGIC = 0x31434843,
+};
+
+enum chat_capture_type {
+	/** A client connected. No payload. */
+	CHAT_CAPTURE_CONNECT = 1,
+	/** One recv() worth of inbound bytes from the client. */
+	CHAT_CAPTURE_DATA = 2,
+	/** The client disconnected. No payload. */
+	CHAT_CAPTURE_DISCONNECT = 3,
+};
+
+/** One record of a capture log, see chat_server_set_capture(). */
+struct chat_capture_rec {
+	/** chat_capture_type of the record. */
+	uint8_t type;
+	uint8_t pad[3];
+	/** Which connection; stable for the connection's lifetime. */
+	uint32_t peer;
+	/** Microseconds since the capture start. */
+	uint64_t time_us;
+	/** Payload byte count; zero for connect/disconnect. */
+	uint32_t size;
+};
+
+#endif
+
+#if NEED_COMPRESSION
+
+/**
+ * Compress [src, src + src_size) into 'dst' in the LZ4 block format.
+ * Self-contained - the tree links nothing but libpthread, and the
+ * block format is small enough to not be worth a dependency.
+ *
+ * @retval >0 The compressed size.
+ * @retval 0 The result would not fit into 'dst_cap' - with a cap
+ *     below src_size that doubles as "not compressible enough".
+ */
+uint32_t
+chat_lz4_compress(const char *src, uint32_t src_size, char *dst,
+		  uint32_t dst_cap);
+
+/**
+ * Decompress an LZ4 block into exactly 'dst_size' bytes.
+ *
+ * @retval 0 Success.
+ * @retval -1 The input is corrupt or does not add up to 'dst_size'.
+ */
+int
+chat_lz4_decompress(const char *src, uint32_t src_size, char *dst,
+		    uint32_t dst_size);
+
+#endif
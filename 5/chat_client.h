@@ -15,6 +15,45 @@ chat_client_new(const char *name);
 void
 chat_client_delete(struct chat_client *client);
 
+#if NEED_BINARY_FRAMING
+/**
+ * Switch the client to the binary wire framing before connecting.
+ * Each message then travels as a varint length prefix followed by the
+ * body instead of a '\n'-terminated line, so the receiver jumps from
+ * boundary to boundary instead of scanning every byte. The mode is
+ * negotiated: the client opens the connection with CHAT_BINARY_MAGIC
+ * and the server switches that one peer; text clients on the same
+ * server are not affected.
+ *
+ * @param client Chat client.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the client is already connected.
+ */
+int
+chat_client_set_binary(struct chat_client *client);
+#endif
+
+#if NEED_COMPRESSION
+/**
+ * Switch the client to the compressed mode before connecting. The
+ * connection opens with CHAT_COMPRESSED_MAGIC and uses the binary
+ * framing, but the server->client frames additionally carry the body
+ * LZ4-compressed when that pays off - the server compresses each
+ * broadcast once and fans the same frame out to every compressed
+ * peer. The client->server direction stays plain binary.
+ *
+ * @param client Chat client.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the client is already connected.
+ */
+int
+chat_client_set_compressed(struct chat_client *client);
+#endif
+
 /**
  * Try to connect to the given address.
  *
@@ -43,6 +82,21 @@ chat_client_connect(struct chat_client *client, const char *addr);
 struct chat_message *
 chat_client_pop_next(struct chat_client *client);
 
+/**
+ * Pop up to 'capacity' pending chat messages at once. Each returned
+ * message has to be freed using chat_message_delete().
+ *
+ * @param client Chat client.
+ * @param msgs Array of at least 'capacity' cells to fill.
+ * @param capacity How many messages fit into 'msgs'.
+ *
+ * @retval >0 Number of popped messages.
+ * @retval 0 No more messages yet.
+ */
+int
+chat_client_pop_many(struct chat_client *client, struct chat_message **msgs,
+		     int capacity);
+
 /**
  * Wait for any update for the given timeout and do this update.
  *
@@ -93,3 +147,76 @@ chat_client_get_events(const struct chat_client *client);
 int
 chat_client_feed(struct chat_client *client, const char *msg,
 		 uint32_t msg_size);
+
+#if NEED_CLIENT_GROUP
+
+/**
+ * A set of clients multiplexed into one epoll loop. A process that
+ * relays between many servers then pays one wait syscall per tick
+ * instead of one poll() per client. The group does not own its
+ * clients - they are created, connected and deleted as usual, just
+ * updated together.
+ */
+struct chat_client_group;
+
+/** Create an empty client group. */
+struct chat_client_group *
+chat_client_group_new(void);
+
+/** Delete the group. The clients themselves are left alone. */
+void
+chat_client_group_delete(struct chat_client_group *group);
+
+/**
+ * Add a connected client to the group. While a client is in a group
+ * its updates are driven by chat_client_group_update().
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_NOT_STARTED - the client is not connected yet.
+ */
+int
+chat_client_group_add(struct chat_client_group *group,
+		      struct chat_client *client);
+
+/**
+ * Remove a client from the group.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_INVALID_ARGUMENT - the client is not in the group.
+ */
+int
+chat_client_group_remove(struct chat_client_group *group,
+			 struct chat_client *client);
+
+/**
+ * Wait for an update on any of the group's clients for the given
+ * timeout and do the updates. A client whose server disconnects is
+ * handled like in chat_client_update(): its socket is closed and it
+ * goes silent, staying in the group.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_TIMEOUT - no updates, timed out.
+ *     - CHAT_ERR_SYS - a system error, check errno.
+ */
+int
+chat_client_group_update(struct chat_client_group *group, double timeout);
+
+/**
+ * Pop a next pending message from any of the group's clients, round
+ * robin across them. The message has to be freed using
+ * chat_message_delete().
+ *
+ * @param group Client group.
+ * @param[out] origin The client the message came from.
+ *
+ * @retval not-NULL A message.
+ * @retval NULL No more messages yet.
+ */
+struct chat_message *
+chat_client_group_pop_next(struct chat_client_group *group,
+			   struct chat_client **origin);
+
+#endif
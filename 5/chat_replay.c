@@ -0,0 +1,227 @@
+#include "chat.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Replay a traffic capture recorded with chat_server_set_capture()
+ * against a live server:
+ *
+ *     ./replay <log> <host:port> [speed]
+ *
+ * The replayer reconnects the recorded client population - one TCP
+ * connection per recorded peer - and resends the captured byte
+ * chunks on the recorded timeline. 'speed' scales the timeline: 2
+ * replays twice as fast, 0 drops the pacing entirely and pushes the
+ * frames as fast as the server takes them. The payload is the raw
+ * recorded byte stream, below any framing, so the target just has to
+ * speak the protocol the recorded clients spoke - the C server of
+ * this directory and the boost one both qualify.
+ */
+
+struct replay_conn {
+	/** -1 before the connect record and after the disconnect. */
+	int fd;
+};
+
+static uint64_t
+now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/** Read the whole log into memory. Returns NULL on failure. */
+static char *
+read_log(const char *path, size_t *size)
+{
+	FILE *file = fopen(path, "rb");
+	if (file == NULL) {
+		printf("Couldn't open the log: %s\n", strerror(errno));
+		return NULL;
+	}
+	fseek(file, 0, SEEK_END);
+	long file_size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	char *data = malloc(file_size);
+	if (data == NULL || fread(data, 1, file_size, file) !=
+	    (size_t)file_size) {
+		printf("Couldn't read the log\n");
+		free(data);
+		fclose(file);
+		return NULL;
+	}
+	fclose(file);
+	*size = file_size;
+	return data;
+}
+
+static int
+conn_open(struct replay_conn *conn, const struct addrinfo *addr)
+{
+	conn->fd = socket(addr->ai_family, addr->ai_socktype,
+			  addr->ai_protocol);
+	if (conn->fd < 0)
+		return -1;
+	if (connect(conn->fd, addr->ai_addr, addr->ai_addrlen) != 0) {
+		close(conn->fd);
+		conn->fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+static int
+conn_send(struct replay_conn *conn, const char *data, size_t size)
+{
+	while (size > 0) {
+		ssize_t rc = send(conn->fd, data, size, 0);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		data += rc;
+		size -= rc;
+	}
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 3) {
+		printf("Usage: %s <log> <host:port> [speed]\n", argv[0]);
+		return -1;
+	}
+	double speed = argc >= 4 ? atof(argv[3]) : 1;
+	if (speed < 0) {
+		printf("Invalid speed\n");
+		return -1;
+	}
+	char *addr_str = strdup(argv[2]);
+	char *colon = strrchr(addr_str, ':');
+	if (colon == NULL) {
+		printf("Expected <host:port>\n");
+		return -1;
+	}
+	*colon = 0;
+	struct addrinfo hint;
+	memset(&hint, 0, sizeof(hint));
+	hint.ai_family = AF_INET;
+	hint.ai_socktype = SOCK_STREAM;
+	struct addrinfo *addr = NULL;
+	if (getaddrinfo(addr_str, colon + 1, &hint, &addr) != 0) {
+		printf("Couldn't resolve %s\n", argv[2]);
+		return -1;
+	}
+	size_t log_size = 0;
+	char *log = read_log(argv[1], &log_size);
+	if (log == NULL)
+		return -1;
+	if (log_size < sizeof(uint32_t) ||
+	    *(uint32_t *)log != CHAT_CAPTURE_MAGIC) {
+		printf("Not a capture log\n");
+		return -1;
+	}
+
+	struct replay_conn *conns = NULL;
+	uint32_t conn_capacity = 0;
+	uint64_t start_us = now_us();
+	uint64_t frame_count = 0;
+	uint64_t byte_count = 0;
+	uint32_t conn_count = 0;
+	uint64_t last_time_us = 0;
+	size_t pos = sizeof(uint32_t);
+	while (pos + sizeof(struct chat_capture_rec) <= log_size) {
+		struct chat_capture_rec rec;
+		memcpy(&rec, log + pos, sizeof(rec));
+		pos += sizeof(rec);
+		if (pos + rec.size > log_size) {
+			printf("Truncated record, stopping\n");
+			break;
+		}
+		last_time_us = rec.time_us;
+		/* Sleep up to the record's spot on the timeline. */
+		if (speed > 0) {
+			uint64_t target = rec.time_us / speed;
+			uint64_t elapsed = now_us() - start_us;
+			if (target > elapsed)
+				usleep(target - elapsed);
+		}
+		if (rec.peer >= conn_capacity) {
+			uint32_t new_capacity = (rec.peer + 1) * 2;
+			conns = realloc(conns,
+					new_capacity * sizeof(*conns));
+			if (conns == NULL)
+				abort();
+			for (uint32_t i = conn_capacity; i < new_capacity;
+			     ++i)
+				conns[i].fd = -1;
+			conn_capacity = new_capacity;
+		}
+		struct replay_conn *conn = &conns[rec.peer];
+		switch (rec.type) {
+		case CHAT_CAPTURE_CONNECT:
+			if (conn_open(conn, addr) != 0) {
+				printf("Couldn't connect peer %u: %s\n",
+				       rec.peer, strerror(errno));
+				goto done;
+			}
+			++conn_count;
+			break;
+		case CHAT_CAPTURE_DATA:
+			if (conn->fd < 0)
+				break;
+			if (conn_send(conn, log + pos, rec.size) != 0) {
+				/*
+				 * The server dropped this client - its
+				 * own policy (disconnect on overflow,
+				 * say). The rest of the population
+				 * plays on.
+				 */
+				close(conn->fd);
+				conn->fd = -1;
+				break;
+			}
+			++frame_count;
+			byte_count += rec.size;
+			break;
+		case CHAT_CAPTURE_DISCONNECT:
+			if (conn->fd >= 0) {
+				close(conn->fd);
+				conn->fd = -1;
+			}
+			break;
+		default:
+			printf("Unknown record type %u, stopping\n",
+			       rec.type);
+			goto done;
+		}
+		pos += rec.size;
+	}
+done:
+	for (uint32_t i = 0; i < conn_capacity; ++i) {
+		if (conns[i].fd >= 0)
+			close(conns[i].fd);
+	}
+	uint64_t spent_us = now_us() - start_us;
+	printf("Replayed %llu frames, %llu bytes, %u connections\n",
+	       (unsigned long long)frame_count,
+	       (unsigned long long)byte_count, conn_count);
+	printf("Recorded span %.3f sec, replayed in %.3f sec\n",
+	       last_time_us / 1e6, spent_us / 1e6);
+	free(conns);
+	free(log);
+	free(addr_str);
+	freeaddrinfo(addr);
+	return 0;
+}
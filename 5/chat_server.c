@@ -1,135 +1,2926 @@
 #include "chat.h"
 #include "chat_server.h"
+#include "trace.h"
+#if NEED_OFFLOAD
+#include "../4/thread_pool.h"
+#include "numa_arena.h"
+#endif
 
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+enum {
+	/**
+	 * Initial and idle-time size of a peer's receive buffer. It
+	 * doubles under load and falls back here once drained, so the
+	 * idle connections do not hold their peak burst size.
+	 */
+	PEER_RECV_MIN = 512,
+	/** How many output chunks a single writev() takes at most. */
+	SERVER_FLUSH_BATCH = 64,
+	/**
+	 * Messages shorter than this are glued into the previous chunk
+	 * instead of getting an own one, so a burst of tiny messages
+	 * still leaves in one syscall.
+	 */
+	SERVER_COALESCE_LIMIT = 512,
+#if NEED_DATAGRAM
+	/** A UDP payload can not exceed 64KB - one buffer fits any. */
+	DGRAM_RECV_MAX = 64 * 1024,
+#endif
+#if NEED_RATE_LIMIT
+	/**
+	 * A throttled peer raises no epoll event - its socket is
+	 * readable all along. While any peer waits for tokens the
+	 * loop wakes up on this tick to refill and retry it.
+	 */
+	RATE_LIMIT_TICK_MS = 10,
+#endif
+};
+
+/**
+ * The operational counters, mirrored atomically - the sharded mode
+ * bumps them from several threads. Relaxed order keeps an increment
+ * one uncontended locked add, invisible next to the syscalls around
+ * every update point.
+ */
+struct server_stats {
+	_Atomic uint64_t peer_count;
+	_Atomic uint64_t msg_in_count;
+	_Atomic uint64_t msg_out_count;
+	_Atomic uint64_t byte_in_count;
+	_Atomic uint64_t byte_out_count;
+	_Atomic uint64_t partial_write_count;
+	_Atomic uint64_t out_bytes_max;
+	_Atomic uint64_t wakeup_count;
+};
+
+static inline void
+stat_add(_Atomic uint64_t *stat, uint64_t value)
+{
+	atomic_fetch_add_explicit(stat, value, memory_order_relaxed);
+}
+
+static inline void
+stat_sub(_Atomic uint64_t *stat, uint64_t value)
+{
+	atomic_fetch_sub_explicit(stat, value, memory_order_relaxed);
+}
+
+static inline void
+stat_max(_Atomic uint64_t *stat, uint64_t value)
+{
+	uint64_t old = atomic_load_explicit(stat, memory_order_relaxed);
+	while (old < value && !atomic_compare_exchange_weak_explicit(
+			stat, &old, value, memory_order_relaxed,
+			memory_order_relaxed))
+		;
+}
+
+static inline uint64_t
+stat_load(const _Atomic uint64_t *stat)
+{
+	return atomic_load_explicit(stat, memory_order_relaxed);
+}
+
+/**
+ * An immutable message body shared by the output queues of every
+ * broadcast recipient. The bytes are stored once no matter how many
+ * peers still have to send them; each queue keeps its own send
+ * position, so even a partial write needs no copy.
+ */
+struct out_blob {
+	_Atomic int refs;
+	size_t size;
+#if NEED_COMPRESSION
+	/**
+	 * LZ4 copy of the payload (the trailing '\n' excluded), built
+	 * once at creation when compressed peers are connected - one
+	 * pass no matter how many of them receive the message. NULL
+	 * when absent, too small, or not compressible enough; those
+	 * are framed as stored.
+	 */
+	char *comp;
+	size_t comp_size;
+#endif
+	char data[];
+};
+
+/** One pending piece of output; [pos, size) is not sent yet. */
+struct out_chunk {
+	/**
+	 * Shared message body, or NULL when the chunk privately owns
+	 * 'data' - the coalescing buffer for small messages does.
+	 */
+	struct out_blob *blob;
+	char *data;
+	size_t size;
+	size_t pos;
+	size_t cap;
+	/**
+	 * The next chunk continues the same message - a varint header
+	 * glued to its blob body. The oldest-drop has to take or leave
+	 * them together, or the binary framing desyncs.
+	 */
+	bool glued;
+	struct out_chunk *next;
+};
+
+/**
+ * A node of a shard's lock-free broadcast inbox, and of a peer's
+ * held-broadcast list.
+ */
+struct blob_ref {
+	struct out_blob *blob;
+	struct blob_ref *next;
+};
+
 struct chat_peer {
 	/** Client's socket. To read/write messages. */
 	int socket;
-	/** Output buffer. */
-	/* ... */
-	/* PUT HERE OTHER MEMBERS */
+	/** Partially accumulated input, up to the last '\n'. */
+	char *in_buf;
+	size_t in_size;
+	size_t in_cap;
+	/** Queue of output chunks, sent oldest first. */
+	struct out_chunk *out_first;
+	struct out_chunk *out_last;
+	/** Not yet sent bytes in the output queue. */
+	size_t out_bytes;
+	/** The queue crossed the high watermark and did not drain yet. */
+	bool is_over;
+	/** Got readable while the intake was paused. */
+	bool read_pending;
+	/** First byte seen - the framing negotiation is settled. */
+	bool saw_first;
+	/** The peer negotiated the binary varint framing. */
+	bool is_binary;
+#if NEED_COMPRESSION
+	/** The peer receives the compressed frame format. */
+	bool is_compressed;
+#endif
+	/** Interned name of the peer; NULL until its first message. */
+	const char *author;
+	size_t author_len;
+#if NEED_BINARY_FRAMING
+	/**
+	 * Broadcasts held back until the first byte settles which
+	 * framing this peer speaks - queueing them earlier would pick
+	 * the text framing for a client whose magic byte is still in
+	 * flight. The first byte arrives right at connect (the magic,
+	 * or the author name), so the hold is momentary.
+	 */
+	struct blob_ref *held_first;
+	struct blob_ref *held_last;
+#endif
+#if NEED_CAPTURE
+	/** The connection's id in the capture log. */
+	uint32_t cap_id;
+#endif
+#if NEED_RATE_LIMIT
+	/** Token bucket paying for the received bytes. */
+	uint64_t rl_tokens;
+	/** Batch timestamp of the last refill which added tokens. */
+	uint64_t rl_last_ms;
+	/** Out of tokens - the reads wait for a refill. */
+	bool is_throttled;
+#endif
+	/** Scheduled for disconnect at the end of the event batch. */
+	bool doomed;
+#if NEED_OFFLOAD
+	/** A parse task of this peer is in the pool or done-stack. */
+	bool job_pending;
+#endif
+#if NEED_HISTORY
+	/**
+	 * The shard's history sequence at the accept. Only the
+	 * messages recorded before it are replayed - the later ones
+	 * reach the peer live.
+	 */
+	uint64_t history_seq;
+#endif
+	struct chat_peer *next;
+	struct chat_peer *prev;
 };
 
-struct chat_server {
-	/** Listening socket. To accept new clients. */
+/**
+ * One event loop owning a subset of the peers. The plain mode runs a
+ * single shard inline from chat_server_update(). The sharded mode
+ * runs several, each on an own thread with an own SO_REUSEPORT
+ * listening socket, so the kernel spreads accepted clients and their
+ * traffic across cores.
+ */
+struct chat_shard {
+	struct chat_server *server;
+	/** Listening socket of this shard. To accept new clients. */
 	int socket;
-	/** Array of peers. */
-	/* ... */
-	/* PUT HERE OTHER MEMBERS */
+	/**
+	 * Epoll instance with the listening socket and every peer
+	 * registered once, edge-triggered. The wakeup cost is then
+	 * O(ready sockets), not O(connected clients) - no interest
+	 * array is rebuilt per update like a poll() one would be.
+	 */
+	int epoll_fd;
+	/**
+	 * Wakes a threaded shard up for cross-shard broadcasts and for
+	 * shutdown. -1 for the inline shard.
+	 */
+	int event_fd;
+#if NEED_DATAGRAM
+	/**
+	 * UDP socket on the listening port, -1 when the datagram mode
+	 * is off. Telemetry arrives here as single self-contained
+	 * datagrams and never touches the stream buffers.
+	 */
+	int dgram_socket;
+#endif
+	/** List of peers owned by this shard. */
+	struct chat_peer *peers;
+	/**
+	 * Treiber stack of message bodies broadcast by other shards.
+	 * Producers only CAS the head and the owner swaps the whole
+	 * list out, so the cross-shard path takes no locks.
+	 */
+	struct blob_ref *_Atomic inbox;
+	/** How many own peers are above the high watermark. */
+	int over_count;
+#if NEED_OFFLOAD
+	/**
+	 * Treiber stack of parse jobs finished by the pool workers,
+	 * drained by the owner like 'inbox' is.
+	 */
+	struct offload_job *_Atomic offload_done;
+	/** Jobs handed to the pool and not yet applied. */
+	int offload_count;
+	/** Tearing down - apply the results, do not restart reads. */
+	bool offload_draining;
+#endif
+	/** The paused peer reads have to be retried. */
+	bool resume_pending;
+#if NEED_RATE_LIMIT
+	/**
+	 * Timestamp cached once per event batch - every bucket refill
+	 * in the batch reads it instead of the clock.
+	 */
+	uint64_t now_ms;
+	/** How many own peers sit out of tokens. */
+	int throttled_count;
+#endif
+#if NEED_HISTORY
+	/**
+	 * Ring of refs on the last broadcast message bodies, slot
+	 * 'history_seq % limit' is written next. Owned by this shard's
+	 * thread like the peers are, so the replay takes no locks.
+	 */
+	struct out_blob **history;
+	/** How many messages were recorded ever, not just kept. */
+	uint64_t history_seq;
+#endif
+	pthread_t thread;
 };
 
-struct chat_server *
-chat_server_new(void)
+struct chat_server {
+	/** The event loops; one inline, or several threaded. */
+	struct chat_shard *shards;
+	/** 0 until listen. */
+	int shard_count;
+	/** True when the shards run on own threads. */
+	bool is_sharded;
+	/** Tells the shard threads to terminate. */
+	atomic_bool stop;
+	/** Becomes readable when the shards received messages. */
+	int notify_fd;
+	/** Treiber stack the shard threads push messages onto. */
+	struct chat_message *_Atomic inbox;
+	/** Queue of received, not yet popped messages. */
+	struct chat_message *msg_first;
+	struct chat_message *msg_last;
+	/** Output limit config; immutable once listening. */
+	size_t out_high;
+	size_t out_low;
+	enum chat_server_overflow out_policy;
+	chat_server_watermark_f watermark_cb;
+	void *watermark_arg;
+#if NEED_RATE_LIMIT
+	/** Read rate limit config; immutable once listening. */
+	uint64_t rl_rate;
+	uint64_t rl_burst;
+#endif
+#if NEED_CAPTURE
+	/** Capture log, NULL while the tap is off; set before listen. */
+	FILE *cap_file;
+	/** Serializes the records - the shards write concurrently. */
+	pthread_mutex_t cap_mutex;
+	/** Timestamp origin of the log. */
+	uint64_t cap_start_us;
+	/** Connection id source, shared by the shards. */
+	_Atomic uint32_t cap_next_id;
+#endif
+#if NEED_HISTORY
+	/** History ring size config; immutable once listening. */
+	int history_limit;
+#endif
+#if NEED_DATAGRAM
+	/** Datagram ingest config; immutable once listening. */
+	bool use_datagram;
+#endif
+#if NEED_AUTHOR
+	/** Interned names of all the peers, shared by the shards. */
+	struct chat_authors *authors;
+#endif
+#if NEED_OFFLOAD
+	/** Borrowed parse pool; NULL keeps the work inline. */
+	struct thread_pool *offload_pool;
+	/**
+	 * Arena of the per-message offload results. The pool workers
+	 * allocate them from their own node's freelist, so on a
+	 * multi-socket box the event thread's handoff doesn't serve
+	 * everyone memory of whichever node refilled a shared pool
+	 * first. On one node it is a plain block pool.
+	 */
+	struct numa_arena offload_out_arena;
+#endif
+#if NEED_COMPRESSION
+	/**
+	 * How many connected peers negotiated compression. Atomic -
+	 * each shard accepts and drops its own peers, but any shard's
+	 * broadcast reads it to decide whether a blob is worth
+	 * compressing at all.
+	 */
+	_Atomic int comp_peer_count;
+#endif
+	/** Always-on operational counters, see chat_server_stats. */
+	struct server_stats stats;
+};
+
+/** Strip the spaces from both sides of [*data, *data + *size). */
+static void
+trim_spaces(const char **data, size_t *size)
 {
-	struct chat_server *server = calloc(1, sizeof(*server));
-	server->socket = -1;
+	while (*size > 0 && isspace((unsigned char)(*data)[0])) {
+		++*data;
+		--*size;
+	}
+	while (*size > 0 && isspace((unsigned char)(*data)[*size - 1]))
+		--*size;
+}
 
-	/* IMPLEMENT THIS FUNCTION */
+static void
+server_push_msg(struct chat_server *server, const char *author,
+		const char *data, size_t size)
+{
+	/* The data is inline - see chat_message_delete(). */
+	struct chat_message *msg = malloc(sizeof(*msg) + size + 1);
+	if (msg == NULL)
+		abort();
+	stat_add(&server->stats.msg_in_count, 1);
+#if NEED_AUTHOR
+	msg->author = author != NULL ? chat_author_ref(author) : NULL;
+#else
+	(void)author;
+#endif
+	msg->data = (char *)(msg + 1);
+	msg->next = NULL;
+	memcpy(msg->data, data, size);
+	msg->data[size] = 0;
+	if (!server->is_sharded) {
+		if (server->msg_last != NULL)
+			server->msg_last->next = msg;
+		else
+			server->msg_first = msg;
+		server->msg_last = msg;
+		return;
+	}
+	struct chat_message *head = atomic_load(&server->inbox);
+	do {
+		msg->next = head;
+	} while (!atomic_compare_exchange_weak(&server->inbox, &head, msg));
+	uint64_t one = 1;
+	ssize_t rc = write(server->notify_fd, &one, sizeof(one));
+	(void)rc;
+}
 
-	return server;
+/** Move the messages pushed by the shards into the pop queue. */
+static void
+server_drain_inbox(struct chat_server *server)
+{
+	struct chat_message *msg = atomic_exchange(&server->inbox, NULL);
+	/* The stack is LIFO - reverse it to restore arrival order. */
+	struct chat_message *prev = NULL;
+	while (msg != NULL) {
+		struct chat_message *next = msg->next;
+		msg->next = prev;
+		prev = msg;
+		msg = next;
+	}
+	while (prev != NULL) {
+		msg = prev;
+		prev = msg->next;
+		msg->next = NULL;
+		if (server->msg_last != NULL)
+			server->msg_last->next = msg;
+		else
+			server->msg_first = msg;
+		server->msg_last = msg;
+	}
 }
 
-void
-chat_server_delete(struct chat_server *server)
+/** Make a blob of the wire payload plus the trailing '\n', one ref. */
+static struct out_blob *
+out_blob_build(struct chat_server *server, const char *author,
+	       size_t author_len, const char *data, size_t size)
 {
-	if (server->socket >= 0)
-		close(server->socket);
+	size_t total = size;
+#if NEED_AUTHOR
+	total += author_len + 1;
+#endif
+	struct out_blob *blob = malloc(sizeof(*blob) + total + 1);
+	if (blob == NULL)
+		abort();
+	blob->refs = 1;
+	blob->size = total + 1;
+	char *pos = blob->data;
+#if NEED_AUTHOR
+	memcpy(pos, author, author_len);
+	pos += author_len;
+	*pos++ = 0;
+#else
+	(void)author;
+	(void)author_len;
+#endif
+	memcpy(pos, data, size);
+	pos[size] = '\n';
+#if NEED_COMPRESSION
+	blob->comp = NULL;
+	blob->comp_size = 0;
+	if (total >= CHAT_COMPRESS_MIN &&
+	    atomic_load(&server->comp_peer_count) > 0) {
+		/*
+		 * The cap below the raw size makes the compressor bail
+		 * out on incompressible payloads - those ship stored.
+		 */
+		char *comp = malloc(total - 1);
+		if (comp == NULL)
+			abort();
+		uint32_t comp_size = chat_lz4_compress(blob->data, total,
+						       comp, total - 1);
+		if (comp_size == 0) {
+			free(comp);
+		} else {
+			blob->comp = comp;
+			blob->comp_size = comp_size;
+		}
+	}
+#else
+	(void)server;
+#endif
+	return blob;
+}
 
-	/* IMPLEMENT THIS FUNCTION */
+static struct out_blob *
+out_blob_new(struct chat_server *server, const struct chat_peer *author,
+	     const char *data, size_t size)
+{
+#if NEED_AUTHOR
+	return out_blob_build(server, author->author, author->author_len,
+			      data, size);
+#else
+	(void)author;
+	return out_blob_build(server, NULL, 0, data, size);
+#endif
+}
 
-	free(server);
+static void
+out_blob_unref(struct out_blob *blob)
+{
+	if (atomic_fetch_sub(&blob->refs, 1) == 1) {
+#if NEED_COMPRESSION
+		free(blob->comp);
+#endif
+		free(blob);
+	}
 }
 
-int
-chat_server_listen(struct chat_server *server, uint16_t port)
+static void
+out_chunk_free(struct out_chunk *chunk)
+{
+	if (chunk->blob != NULL)
+		out_blob_unref(chunk->blob);
+	else
+		free(chunk->data);
+	free(chunk);
+}
+
+#if NEED_BINARY_FRAMING
+/** Append raw bytes to the peer's coalescing chunk, no terminator. */
+static void
+peer_queue_raw(struct chat_peer *peer, const char *data, size_t size)
+{
+	struct out_chunk *chunk = peer->out_last;
+	if (chunk == NULL || chunk->blob != NULL || chunk->pos != 0 ||
+	    (chunk->size + size > chunk->cap &&
+	     size > SERVER_COALESCE_LIMIT)) {
+		chunk = calloc(1, sizeof(*chunk));
+		if (chunk == NULL)
+			abort();
+		chunk->cap = size > SERVER_COALESCE_LIMIT ?
+			size : SERVER_COALESCE_LIMIT;
+		chunk->data = malloc(chunk->cap);
+		if (chunk->data == NULL)
+			abort();
+		if (peer->out_last != NULL)
+			peer->out_last->next = chunk;
+		else
+			peer->out_first = chunk;
+		peer->out_last = chunk;
+	} else if (chunk->size + size > chunk->cap) {
+		while (chunk->cap < chunk->size + size)
+			chunk->cap *= 2;
+		chunk->data = realloc(chunk->data, chunk->cap);
+		if (chunk->data == NULL)
+			abort();
+	}
+	memcpy(chunk->data + chunk->size, data, size);
+	chunk->size += size;
+	peer->out_bytes += size;
+}
+
+/** Queue one message for a binary peer: varint length, then body. */
+static void
+peer_queue_binary(struct chat_peer *peer, const char *data, size_t size)
+{
+	char hdr[CHAT_VARINT_MAX];
+	int hdr_size = chat_varint_encode(size, hdr);
+	peer_queue_raw(peer, hdr, hdr_size);
+	peer_queue_raw(peer, data, size);
+}
+#endif
+
+#if NEED_COMPRESSION
+/**
+ * Queue one small message for a compressed peer as a stored frame -
+ * below CHAT_COMPRESS_MIN the LZ4 pass is not worth its own header.
+ */
+static void
+peer_queue_stored(struct chat_peer *peer, const char *data, size_t size)
+{
+	char hdr[CHAT_VARINT_MAX + 1];
+	int hdr_size = chat_varint_encode(size, hdr);
+	hdr_size += chat_varint_encode(0, hdr + hdr_size);
+	peer_queue_raw(peer, hdr, hdr_size);
+	peer_queue_raw(peer, data, size);
+}
+#endif
+
+/** Queue a ref on the shared message body for the peer. */
+static void
+peer_queue_blob(struct chat_peer *peer, struct out_blob *blob)
+{
+	char *data = blob->data;
+	size_t size = blob->size;
+#if NEED_COMPRESSION
+	if (peer->is_compressed) {
+		/*
+		 * The compressed frame: raw size, compressed size or 0
+		 * for stored, then the body. The body bytes are shared
+		 * either way - the compressed copy lives in the blob.
+		 */
+		char hdr[CHAT_VARINT_MAX * 2];
+		int hdr_size = chat_varint_encode(blob->size - 1, hdr);
+		hdr_size += chat_varint_encode(blob->comp_size,
+					       hdr + hdr_size);
+		peer_queue_raw(peer, hdr, hdr_size);
+		peer->out_last->glued = true;
+		if (blob->comp != NULL) {
+			data = blob->comp;
+			size = blob->comp_size;
+		} else {
+			size = blob->size - 1;
+		}
+	} else
+#endif
+#if NEED_BINARY_FRAMING
+	if (peer->is_binary) {
+		/*
+		 * The blob ends with '\n' for the text peers. A binary
+		 * peer gets a varint header queued in front and the
+		 * body without the terminator - the blob bytes are
+		 * still shared, only the last one is cut off.
+		 */
+		char hdr[CHAT_VARINT_MAX];
+		int hdr_size = chat_varint_encode(blob->size - 1, hdr);
+		peer_queue_raw(peer, hdr, hdr_size);
+		peer->out_last->glued = true;
+		size = blob->size - 1;
+	}
+#endif
+	struct out_chunk *chunk = calloc(1, sizeof(*chunk));
+	if (chunk == NULL)
+		abort();
+	atomic_fetch_add(&blob->refs, 1);
+	chunk->blob = blob;
+	chunk->data = data;
+	chunk->size = size;
+	peer->out_bytes += size;
+	if (peer->out_last != NULL)
+		peer->out_last->next = chunk;
+	else
+		peer->out_first = chunk;
+	peer->out_last = chunk;
+}
+
+#if NEED_BINARY_FRAMING
+/** Park a broadcast until the peer's framing is known. */
+static void
+peer_hold_blob(struct chat_peer *peer, struct out_blob *blob)
+{
+	struct blob_ref *ref = malloc(sizeof(*ref));
+	if (ref == NULL)
+		abort();
+	atomic_fetch_add(&blob->refs, 1);
+	ref->blob = blob;
+	ref->next = NULL;
+	if (peer->held_last != NULL)
+		peer->held_last->next = ref;
+	else
+		peer->held_first = ref;
+	peer->held_last = ref;
+}
+#endif
+
+/** Queue one message for the peer, coalescing the small ones. */
+static void
+peer_queue_output(struct chat_peer *peer, const char *data, size_t size)
+{
+	struct out_chunk *chunk = peer->out_last;
+	/*
+	 * A fully queued chunk can still take more data as long as it
+	 * was not touched by a partial send yet - the flush does not
+	 * care where the chunk boundaries are.
+	 */
+	if (chunk == NULL || chunk->blob != NULL || chunk->pos != 0 ||
+	    (chunk->size + size + 1 > chunk->cap &&
+	     size + 1 > SERVER_COALESCE_LIMIT)) {
+		chunk = calloc(1, sizeof(*chunk));
+		if (chunk == NULL)
+			abort();
+		chunk->cap = size + 1 > SERVER_COALESCE_LIMIT ?
+			size + 1 : SERVER_COALESCE_LIMIT;
+		chunk->data = malloc(chunk->cap);
+		if (chunk->data == NULL)
+			abort();
+		if (peer->out_last != NULL)
+			peer->out_last->next = chunk;
+		else
+			peer->out_first = chunk;
+		peer->out_last = chunk;
+	} else if (chunk->size + size + 1 > chunk->cap) {
+		while (chunk->cap < chunk->size + size + 1)
+			chunk->cap *= 2;
+		chunk->data = realloc(chunk->data, chunk->cap);
+		if (chunk->data == NULL)
+			abort();
+	}
+	memcpy(chunk->data + chunk->size, data, size);
+	chunk->data[chunk->size + size] = '\n';
+	chunk->size += size + 1;
+	peer->out_bytes += size + 1;
+	TRACE_PROBE3(chat, enqueue, peer->socket, size + 1, peer->out_bytes);
+}
+
+/**
+ * Send as much of the peer's output queue as the socket takes. The
+ * chunks are batched into iovecs so fan-out of many queued messages
+ * costs one writev(), not one send() each.
+ */
+static int
+peer_flush(struct chat_shard *shard, struct chat_peer *peer)
+{
+	struct server_stats *stats = &shard->server->stats;
+	while (peer->out_first != NULL) {
+		struct iovec vecs[SERVER_FLUSH_BATCH];
+		int vec_count = 0;
+		size_t batch_bytes = 0;
+		for (struct out_chunk *chunk = peer->out_first;
+		     chunk != NULL && vec_count < SERVER_FLUSH_BATCH;
+		     chunk = chunk->next) {
+			vecs[vec_count].iov_base = chunk->data + chunk->pos;
+			vecs[vec_count].iov_len = chunk->size - chunk->pos;
+			batch_bytes += vecs[vec_count].iov_len;
+			++vec_count;
+		}
+		/* sendmsg() is vectored like writev(), but can take
+		 * MSG_NOSIGNAL for peers that died mid-flush. */
+		struct msghdr hdr;
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.msg_iov = vecs;
+		hdr.msg_iovlen = vec_count;
+		ssize_t rc = sendmsg(peer->socket, &hdr, MSG_NOSIGNAL);
+		if (rc < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+		stat_add(&stats->byte_out_count, rc);
+		if ((size_t)rc < batch_bytes)
+			stat_add(&stats->partial_write_count, 1);
+		peer->out_bytes -= rc;
+		TRACE_PROBE3(chat, flush, peer->socket, rc, peer->out_bytes);
+		size_t sent = rc;
+		while (sent > 0) {
+			struct out_chunk *chunk = peer->out_first;
+			size_t left = chunk->size - chunk->pos;
+			if (sent < left) {
+				chunk->pos += sent;
+				break;
+			}
+			sent -= left;
+			peer->out_first = chunk->next;
+			if (peer->out_first == NULL)
+				peer->out_last = NULL;
+			out_chunk_free(chunk);
+		}
+	}
+	return 0;
+}
+
+/**
+ * Drop the oldest queued chunks until at most 'target' bytes remain.
+ * A partially sent head chunk is kept - cutting it would break the
+ * message framing for the receiver.
+ */
+static void
+peer_drop_oldest(struct chat_peer *peer, size_t target)
+{
+	struct out_chunk *prev = NULL;
+	struct out_chunk *chunk = peer->out_first;
+	if (chunk != NULL && chunk->pos != 0) {
+		prev = chunk;
+		chunk = chunk->next;
+		/* A kept header keeps its glued message body. */
+		if (prev->glued && chunk != NULL) {
+			prev = chunk;
+			chunk = chunk->next;
+		}
+	}
+	bool drop_next = false;
+	while (chunk != NULL && (peer->out_bytes > target || drop_next)) {
+		drop_next = chunk->glued;
+		struct out_chunk *next = chunk->next;
+		peer->out_bytes -= chunk->size - chunk->pos;
+		out_chunk_free(chunk);
+		chunk = next;
+		if (prev != NULL)
+			prev->next = chunk;
+		else
+			peer->out_first = chunk;
+	}
+	if (peer->out_first == NULL)
+		peer->out_last = NULL;
+	else if (chunk == NULL)
+		peer->out_last = prev;
+}
+
+/** Apply the output limit policy after the peer's queue changed. */
+static void
+shard_peer_sync(struct chat_shard *shard, struct chat_peer *peer)
+{
+	struct chat_server *server = shard->server;
+	if (server->out_high == 0 || peer->doomed)
+		return;
+	if (!peer->is_over && peer->out_bytes > server->out_high) {
+		peer->is_over = true;
+		++shard->over_count;
+		if (server->watermark_cb != NULL)
+			server->watermark_cb(server, peer->socket, true,
+					     server->watermark_arg);
+		switch (server->out_policy) {
+		case CHAT_OVERFLOW_DROP_OLDEST:
+			peer_drop_oldest(peer, server->out_low);
+			break;
+		case CHAT_OVERFLOW_DISCONNECT:
+			/*
+			 * The drop is deferred to the end of the event
+			 * batch - later events of this batch can still
+			 * reference the peer.
+			 */
+			peer->doomed = true;
+			return;
+		case CHAT_OVERFLOW_PAUSE_INTAKE:
+			break;
+		}
+	}
+	if (peer->is_over && peer->out_bytes <= server->out_low) {
+		peer->is_over = false;
+		--shard->over_count;
+		if (server->watermark_cb != NULL)
+			server->watermark_cb(server, peer->socket, false,
+					     server->watermark_arg);
+		if (server->out_policy == CHAT_OVERFLOW_PAUSE_INTAKE &&
+		    shard->over_count == 0)
+			shard->resume_pending = true;
+	}
+}
+
+/** Hand a ref on the message body over to another shard. */
+static void
+shard_inbox_push(struct chat_shard *shard, struct out_blob *blob)
+{
+	struct blob_ref *ref = malloc(sizeof(*ref));
+	if (ref == NULL)
+		abort();
+	atomic_fetch_add(&blob->refs, 1);
+	ref->blob = blob;
+	struct blob_ref *head = atomic_load(&shard->inbox);
+	do {
+		ref->next = head;
+	} while (!atomic_compare_exchange_weak(&shard->inbox, &head, ref));
+	uint64_t one = 1;
+	ssize_t rc = write(shard->event_fd, &one, sizeof(one));
+	(void)rc;
+}
+
+#if NEED_HISTORY
+/** Record one more broadcast body into the shard's history ring. */
+static void
+shard_history_push(struct chat_shard *shard, struct out_blob *blob)
+{
+	int limit = shard->server->history_limit;
+	if (limit == 0)
+		return;
+	if (shard->history == NULL) {
+		shard->history = calloc(limit, sizeof(*shard->history));
+		if (shard->history == NULL)
+			abort();
+	}
+	struct out_blob **slot = &shard->history[shard->history_seq % limit];
+	if (*slot != NULL)
+		out_blob_unref(*slot);
+	atomic_fetch_add(&blob->refs, 1);
+	*slot = blob;
+	++shard->history_seq;
+}
+
+/**
+ * Queue the recorded backlog onto a just-settled peer, oldest first.
+ * The enqueued chunks share the stored bodies - the replay costs a
+ * ref and a chunk header per message, not a copy.
+ */
+static void
+peer_replay_history(struct chat_shard *shard, struct chat_peer *peer)
+{
+	int limit = shard->server->history_limit;
+	if (limit == 0 || shard->history == NULL)
+		return;
+	uint64_t seq = shard->history_seq;
+	uint64_t stored = seq < (uint64_t)limit ? seq : (uint64_t)limit;
+	/*
+	 * Messages recorded after the accept were queued (or held)
+	 * live - replay only what came before, and of that only what
+	 * the ring still holds.
+	 */
+	uint64_t end = peer->history_seq < seq ? peer->history_seq : seq;
+	for (uint64_t i = seq - stored; i < end; ++i) {
+		peer_queue_blob(peer, shard->history[i % limit]);
+		stat_add(&shard->server->stats.msg_out_count, 1);
+	}
+	stat_max(&shard->server->stats.out_bytes_max, peer->out_bytes);
+	peer_flush(shard, peer);
+	shard_peer_sync(shard, peer);
+}
+#endif
+
+#if NEED_BINARY_FRAMING
+/** Queue the held broadcasts now that the framing is settled. */
+static void
+peer_drain_held(struct chat_shard *shard, struct chat_peer *peer)
+{
+	struct blob_ref *ref = peer->held_first;
+	peer->held_first = NULL;
+	peer->held_last = NULL;
+	while (ref != NULL) {
+		struct blob_ref *next = ref->next;
+		peer_queue_blob(peer, ref->blob);
+		stat_add(&shard->server->stats.msg_out_count, 1);
+		out_blob_unref(ref->blob);
+		free(ref);
+		ref = next;
+	}
+	stat_max(&shard->server->stats.out_bytes_max, peer->out_bytes);
+	peer_flush(shard, peer);
+	shard_peer_sync(shard, peer);
+}
+#endif
+
+/*
+ * Queue a complete message to every peer except the author. The
+ * flush is attempted right away - with edge-triggered epoll an
+ * EPOLLOUT comes only after a full kernel buffer drains, so data
+ * appended for an idle writable socket has to be pushed here.
+ */
+static void
+shard_broadcast(struct chat_shard *shard, struct chat_peer *author,
+		const char *data, size_t size)
+{
+	struct chat_server *server = shard->server;
+	/*
+	 * A big message is stored once and every queue takes a ref;
+	 * only the small ones are worth copying into the per-peer
+	 * coalescing buffers. The cross-shard hand-off always needs
+	 * the shared body.
+	 */
+	size_t total = size;
+#if NEED_BINARY_FRAMING
+	const char *body = data;
+	size_t body_size = size;
+#endif
+#if NEED_AUTHOR
+	/* The wire payload is 'name \0 body', composed once here. */
+	total += author->author_len + 1;
+	char payload[SERVER_COALESCE_LIMIT];
+#endif
+	struct out_blob *blob = NULL;
+	bool need_blob = server->is_sharded ||
+		total + 1 > SERVER_COALESCE_LIMIT;
+#if NEED_HISTORY
+	/* The history stores the shared body - a message small enough
+	 * to coalesce still gets one when the history is on. */
+	need_blob = need_blob || server->history_limit > 0;
+#endif
+	if (need_blob) {
+		blob = out_blob_new(server, author, data, size);
+	}
+#if NEED_AUTHOR
+	else {
+		memcpy(payload, author->author, author->author_len);
+		payload[author->author_len] = 0;
+		memcpy(payload + author->author_len + 1, data, size);
+		data = payload;
+		size = total;
+	}
+#endif
+#if NEED_HISTORY
+	if (blob != NULL)
+		shard_history_push(shard, blob);
+#endif
+	for (struct chat_peer *peer = shard->peers; peer != NULL;
+	     peer = peer->next) {
+		if (peer == author || peer->doomed)
+			continue;
+#if NEED_BINARY_FRAMING
+		if (!peer->saw_first) {
+			if (blob == NULL)
+				blob = out_blob_new(server, author, body,
+						    body_size);
+			peer_hold_blob(peer, blob);
+			continue;
+		}
+#endif
+		if (blob != NULL)
+			peer_queue_blob(peer, blob);
+#if NEED_COMPRESSION
+		else if (peer->is_compressed)
+			peer_queue_stored(peer, data, size);
+#endif
+#if NEED_BINARY_FRAMING
+		else if (peer->is_binary)
+			peer_queue_binary(peer, data, size);
+#endif
+		else
+			peer_queue_output(peer, data, size);
+		stat_add(&server->stats.msg_out_count, 1);
+		stat_max(&server->stats.out_bytes_max, peer->out_bytes);
+		peer_flush(shard, peer);
+		shard_peer_sync(shard, peer);
+	}
+	if (server->is_sharded) {
+		for (int i = 0; i < server->shard_count; ++i) {
+			struct chat_shard *other = &server->shards[i];
+			if (other != shard)
+				shard_inbox_push(other, blob);
+		}
+	}
+	if (blob != NULL)
+		out_blob_unref(blob);
+}
+
+/** Deliver the messages broadcast by other shards to own peers. */
+static void
+shard_drain_inbox(struct chat_shard *shard)
+{
+	struct blob_ref *ref = atomic_exchange(&shard->inbox, NULL);
+	/* The stack is LIFO - reverse it to restore arrival order. */
+	struct blob_ref *prev = NULL;
+	while (ref != NULL) {
+		struct blob_ref *next = ref->next;
+		ref->next = prev;
+		prev = ref;
+		ref = next;
+	}
+	while (prev != NULL) {
+		ref = prev;
+		prev = ref->next;
+#if NEED_HISTORY
+		shard_history_push(shard, ref->blob);
+#endif
+		for (struct chat_peer *peer = shard->peers; peer != NULL;
+		     peer = peer->next) {
+			if (peer->doomed)
+				continue;
+#if NEED_BINARY_FRAMING
+			if (!peer->saw_first) {
+				peer_hold_blob(peer, ref->blob);
+				continue;
+			}
+#endif
+			peer_queue_blob(peer, ref->blob);
+			stat_add(&shard->server->stats.msg_out_count, 1);
+			stat_max(&shard->server->stats.out_bytes_max,
+				 peer->out_bytes);
+			peer_flush(shard, peer);
+			shard_peer_sync(shard, peer);
+		}
+		out_blob_unref(ref->blob);
+		free(ref);
+	}
+}
+
+#if NEED_DATAGRAM
+/**
+ * Pop the pending telemetry datagrams. One datagram is one complete
+ * message - there is no stream to buffer and no order to restore, so
+ * the payload goes straight into the pop queue. The telemetry is not
+ * broadcast to the stream peers - it would drown the chat.
+ */
+static void
+shard_drain_dgram(struct chat_shard *shard)
+{
+	char buf[DGRAM_RECV_MAX];
+	while (1) {
+		ssize_t rc = recv(shard->dgram_socket, buf, sizeof(buf), 0);
+		if (rc < 0)
+			break;
+		stat_add(&shard->server->stats.byte_in_count, rc);
+		const char *body = buf;
+		size_t body_size = rc;
+		const char *author = NULL;
+#if NEED_AUTHOR
+		/* An optional 'name \0' prefix attributes the message. */
+		const char *sep = memchr(buf, 0, rc);
+		if (sep != NULL) {
+			const char *name = buf;
+			size_t name_len = sep - buf;
+			trim_spaces(&name, &name_len);
+			author = chat_authors_intern(shard->server->authors,
+						     name, name_len);
+			body = sep + 1;
+			body_size = rc - (sep + 1 - buf);
+		}
+#endif
+		trim_spaces(&body, &body_size);
+		if (body_size > 0)
+			server_push_msg(shard->server, author, body, body_size);
+#if NEED_AUTHOR
+		if (author != NULL)
+			chat_author_unref(author);
+#endif
+	}
+}
+#endif
+
+/** Split the peer's accumulated input into messages. */
+static void
+peer_consume_input(struct chat_shard *shard, struct chat_peer *peer)
+{
+	size_t start = 0;
+#if NEED_BINARY_FRAMING
+	if (!peer->saw_first && peer->in_size > 0) {
+		peer->saw_first = true;
+		char first = peer->in_buf[0];
+		if (first == CHAT_BINARY_MAGIC) {
+			peer->is_binary = true;
+		}
+#if NEED_COMPRESSION
+		else if (first == CHAT_COMPRESSED_MAGIC) {
+			peer->is_binary = true;
+			peer->is_compressed = true;
+			atomic_fetch_add(&shard->server->comp_peer_count, 1);
+		}
+#endif
+		if (peer->is_binary) {
+			--peer->in_size;
+			memmove(peer->in_buf, peer->in_buf + 1, peer->in_size);
+		}
+#if NEED_HISTORY
+		peer_replay_history(shard, peer);
+#endif
+	}
+	if (peer->saw_first && peer->held_first != NULL)
+		peer_drain_held(shard, peer);
+	if (peer->is_binary) {
+		/*
+		 * A header read jumps straight to the next message
+		 * boundary - the body bytes are never scanned. The
+		 * client trims its messages before framing them, so
+		 * no trimming is repeated here.
+		 */
+		while (start < peer->in_size) {
+			uint32_t len;
+			int hdr = chat_varint_decode(peer->in_buf + start,
+						     peer->in_size - start,
+						     &len);
+			if (hdr == 0 || peer->in_size - start - hdr < len)
+				break;
+			const char *body = peer->in_buf + start + hdr;
+			start += hdr + len;
+#if NEED_AUTHOR
+			if (peer->author == NULL) {
+				peer->author = chat_authors_intern(
+					shard->server->authors, body, len);
+				peer->author_len = len;
+				continue;
+			}
+#endif
+			if (len == 0)
+				continue;
+			server_push_msg(shard->server, peer->author, body, len);
+			shard_broadcast(shard, peer, body, len);
+		}
+		if (start > 0) {
+			peer->in_size -= start;
+			memmove(peer->in_buf, peer->in_buf + start,
+				peer->in_size);
+		}
+		return;
+	}
+#endif
+	for (size_t i = 0; i < peer->in_size; ++i) {
+		if (peer->in_buf[i] != '\n')
+			continue;
+		const char *line = peer->in_buf + start;
+		size_t line_size = i - start;
+		start = i + 1;
+		trim_spaces(&line, &line_size);
+#if NEED_AUTHOR
+		if (peer->author == NULL) {
+			peer->author = chat_authors_intern(
+				shard->server->authors, line, line_size);
+			peer->author_len = line_size;
+			continue;
+		}
+#endif
+		if (line_size == 0)
+			continue;
+		server_push_msg(shard->server, peer->author, line, line_size);
+		shard_broadcast(shard, peer, line, line_size);
+	}
+	if (start > 0) {
+		peer->in_size -= start;
+		memmove(peer->in_buf, peer->in_buf + start, peer->in_size);
+	}
+}
+
+#if NEED_CAPTURE
+
+static uint64_t
+capture_time_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Append one record to the capture log. The clock is read only here,
+ * on the tapped path - with the tap off the whole feature is the
+ * NULL check. The shards share the log, so the two fwrite()s go
+ * under a mutex; they land in the stdio buffer, not in a syscall,
+ * and the contention is the disk's problem, not the event loops'.
+ */
+static void
+server_capture(struct chat_server *server, int type, uint32_t peer,
+	       const char *data, uint32_t size)
+{
+	if (server->cap_file == NULL)
+		return;
+	struct chat_capture_rec rec;
+	memset(&rec, 0, sizeof(rec));
+	rec.type = type;
+	rec.peer = peer;
+	rec.time_us = capture_time_us() - server->cap_start_us;
+	rec.size = size;
+	pthread_mutex_lock(&server->cap_mutex);
+	fwrite(&rec, sizeof(rec), 1, server->cap_file);
+	if (size > 0)
+		fwrite(data, 1, size, server->cap_file);
+	pthread_mutex_unlock(&server->cap_mutex);
+}
+
+#endif
+
+static void
+shard_drop_peer(struct chat_shard *shard, struct chat_peer *peer)
+{
+#if NEED_OFFLOAD
+	/*
+	 * A worker still parses this peer's input - let the results
+	 * land first. The job completion re-checks the mark and the
+	 * doomed sweep finishes the drop.
+	 */
+	if (peer->job_pending) {
+		peer->doomed = true;
+		return;
+	}
+#endif
+	if (peer->is_over) {
+		--shard->over_count;
+		if (shard->server->out_policy == CHAT_OVERFLOW_PAUSE_INTAKE &&
+		    shard->over_count == 0)
+			shard->resume_pending = true;
+	}
+#if NEED_RATE_LIMIT
+	if (peer->is_throttled)
+		--shard->throttled_count;
+#endif
+#if NEED_CAPTURE
+	server_capture(shard->server, CHAT_CAPTURE_DISCONNECT, peer->cap_id,
+		       NULL, 0);
+#endif
+	stat_sub(&shard->server->stats.peer_count, 1);
+	epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL, peer->socket, NULL);
+	close(peer->socket);
+	if (peer->prev != NULL)
+		peer->prev->next = peer->next;
+	else
+		shard->peers = peer->next;
+	if (peer->next != NULL)
+		peer->next->prev = peer->prev;
+#if NEED_AUTHOR
+	if (peer->author != NULL)
+		chat_author_unref(peer->author);
+#endif
+#if NEED_COMPRESSION
+	if (peer->is_compressed)
+		atomic_fetch_sub(&shard->server->comp_peer_count, 1);
+#endif
+	free(peer->in_buf);
+	while (peer->out_first != NULL) {
+		struct out_chunk *chunk = peer->out_first;
+		peer->out_first = chunk->next;
+		out_chunk_free(chunk);
+	}
+#if NEED_BINARY_FRAMING
+	while (peer->held_first != NULL) {
+		struct blob_ref *ref = peer->held_first;
+		peer->held_first = ref->next;
+		out_blob_unref(ref->blob);
+		free(ref);
+	}
+#endif
+	free(peer);
+}
+
+#if NEED_OFFLOAD
+
+/** One message parsed by a worker, ready for the event thread. */
+struct offload_out {
+	/** Goes into the pop queue; built like server_push_msg() does. */
+	struct chat_message *msg;
+	/** Serialized broadcast body; the entry owns one ref. */
+	struct out_blob *blob;
+	struct offload_out *next;
+};
+
+/**
+ * One burst of a peer's raw input handed to the pool. The worker
+ * gets the stolen buffer and a snapshot of the peer's parse state,
+ * never the peer itself - every peer field stays owned by the event
+ * thread, which applies the updated snapshot and the results on
+ * completion.
+ */
+struct offload_job {
+	struct chat_shard *shard;
+	struct chat_peer *peer;
+	/** Stolen input; owned by the job until the completion. */
+	char *in_buf;
+	size_t in_size;
+	size_t in_cap;
+	/** Parse state snapshot, advanced by the worker. */
+	bool saw_first;
+	bool is_binary;
+#if NEED_COMPRESSION
+	bool is_compressed;
+#endif
+	const char *author;
+	size_t author_len;
+	/** How much of the input turned into complete messages. */
+	size_t consumed;
+	struct offload_out *out_first;
+	struct offload_out *out_last;
+	struct thread_task *task;
+	struct offload_job *next;
+};
+
+/** Record one parsed message and its serialized broadcast body. */
+static void
+offload_out_push(struct offload_job *job, const char *data, size_t size)
+{
+	struct offload_out *out =
+		numa_arena_alloc(&job->shard->server->offload_out_arena);
+	if (out == NULL)
+		abort();
+	/* The data is inline - see chat_message_delete(). */
+	struct chat_message *msg = malloc(sizeof(*msg) + size + 1);
+	if (msg == NULL)
+		abort();
+#if NEED_AUTHOR
+	msg->author = job->author != NULL ? chat_author_ref(job->author) : NULL;
+#endif
+	msg->data = (char *)(msg + 1);
+	msg->next = NULL;
+	memcpy(msg->data, data, size);
+	msg->data[size] = 0;
+	out->msg = msg;
+	out->blob = out_blob_build(job->shard->server, job->author,
+				   job->author_len, data, size);
+	out->next = NULL;
+	if (job->out_last != NULL)
+		job->out_last->next = out;
+	else
+		job->out_first = out;
+	job->out_last = out;
+}
+
+/** Hand a finished job back to the event thread. */
+static void
+offload_job_done(struct offload_job *job)
+{
+	struct chat_shard *shard = job->shard;
+	struct offload_job *head = atomic_load(&shard->offload_done);
+	do {
+		job->next = head;
+	} while (!atomic_compare_exchange_weak(&shard->offload_done, &head,
+					       job));
+	uint64_t one = 1;
+	ssize_t rc = write(shard->event_fd, &one, sizeof(one));
+	(void)rc;
+}
+
+/**
+ * The pool side of the offload: the parse of peer_consume_input()
+ * run on a worker against the snapshot. The author interning table
+ * is safe to share between threads, so even the first-message
+ * interning and the LZ4 pass of the body stay off the event thread.
+ */
+static void *
+offload_job_f(void *arg)
+{
+	struct offload_job *job = arg;
+	struct chat_server *server = job->shard->server;
+	size_t start = 0;
+#if NEED_BINARY_FRAMING
+	if (!job->saw_first && job->in_size > 0) {
+		job->saw_first = true;
+		char first = job->in_buf[0];
+		if (first == CHAT_BINARY_MAGIC) {
+			job->is_binary = true;
+		}
+#if NEED_COMPRESSION
+		else if (first == CHAT_COMPRESSED_MAGIC) {
+			job->is_binary = true;
+			job->is_compressed = true;
+		}
+#endif
+		if (job->is_binary) {
+			--job->in_size;
+			memmove(job->in_buf, job->in_buf + 1, job->in_size);
+		}
+	}
+	if (job->is_binary) {
+		while (start < job->in_size) {
+			uint32_t len;
+			int hdr = chat_varint_decode(job->in_buf + start,
+						     job->in_size - start,
+						     &len);
+			if (hdr == 0 || job->in_size - start - hdr < len)
+				break;
+			const char *body = job->in_buf + start + hdr;
+			start += hdr + len;
+#if NEED_AUTHOR
+			if (job->author == NULL) {
+				job->author = chat_authors_intern(
+					server->authors, body, len);
+				job->author_len = len;
+				continue;
+			}
+#endif
+			if (len == 0)
+				continue;
+			offload_out_push(job, body, len);
+		}
+		job->consumed = start;
+		offload_job_done(job);
+		return NULL;
+	}
+#endif
+	for (size_t i = 0; i < job->in_size; ++i) {
+		if (job->in_buf[i] != '\n')
+			continue;
+		const char *line = job->in_buf + start;
+		size_t line_size = i - start;
+		start = i + 1;
+		trim_spaces(&line, &line_size);
+#if NEED_AUTHOR
+		if (job->author == NULL) {
+			job->author = chat_authors_intern(server->authors,
+							  line, line_size);
+			job->author_len = line_size;
+			continue;
+		}
+#endif
+		if (line_size == 0)
+			continue;
+		offload_out_push(job, line, line_size);
+	}
+	(void)server;
+	job->consumed = start;
+	offload_job_done(job);
+	return NULL;
+}
+
+/**
+ * Hand the peer's accumulated input to the pool. The buffer is
+ * stolen, not copied - the peer starts a fresh one while the worker
+ * parses this one.
+ */
+static void
+offload_submit(struct chat_shard *shard, struct chat_peer *peer)
+{
+	struct offload_job *job = calloc(1, sizeof(*job));
+	if (job == NULL)
+		abort();
+	job->shard = shard;
+	job->peer = peer;
+	job->in_buf = peer->in_buf;
+	job->in_size = peer->in_size;
+	job->in_cap = peer->in_cap;
+	peer->in_buf = NULL;
+	peer->in_size = 0;
+	peer->in_cap = 0;
+	job->saw_first = peer->saw_first;
+	job->is_binary = peer->is_binary;
+#if NEED_COMPRESSION
+	job->is_compressed = peer->is_compressed;
+#endif
+#if NEED_AUTHOR
+	/* Borrowed - the peer outlives the job, see shard_drop_peer(). */
+	job->author = peer->author;
+	job->author_len = peer->author_len;
+#endif
+	peer->job_pending = true;
+	++shard->offload_count;
+	if (thread_task_new(&job->task, offload_job_f, job) != 0)
+		abort();
+	if (thread_pool_push_task(shard->server->offload_pool, job->task) != 0)
+		abort();
+}
+
+#endif
+
+#if NEED_RATE_LIMIT
+
+static uint64_t
+time_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Refill the peer's bucket from the batch timestamp. The stamp only
+ * advances when whole tokens accrue, so a trickle rate is not
+ * rounded away tick by tick.
+ */
+static void
+peer_bucket_refill(struct chat_shard *shard, struct chat_peer *peer)
+{
+	struct chat_server *server = shard->server;
+	uint64_t add = (shard->now_ms - peer->rl_last_ms) *
+		server->rl_rate / 1000;
+	if (add == 0)
+		return;
+	peer->rl_last_ms = shard->now_ms;
+	peer->rl_tokens += add;
+	if (peer->rl_tokens > server->rl_burst)
+		peer->rl_tokens = server->rl_burst;
+}
+
+/** Park the peer until its bucket refills, see shard_finalize(). */
+static void
+peer_throttle(struct chat_shard *shard, struct chat_peer *peer)
+{
+	peer->read_pending = true;
+	if (!peer->is_throttled) {
+		peer->is_throttled = true;
+		++shard->throttled_count;
+	}
+}
+
+#endif
+
+/** Read a peer until EAGAIN. Returns -1 when the peer is gone. */
+static int
+peer_read(struct chat_shard *shard, struct chat_peer *peer)
+{
+	int result = 0;
+#if NEED_OFFLOAD
+	bool do_offload = shard->server->offload_pool != NULL;
+	/*
+	 * One job per peer at a time keeps the per-peer order - a new
+	 * burst while the previous one is on a worker just marks the
+	 * read pending and the job completion retries it.
+	 */
+	if (peer->job_pending) {
+		peer->read_pending = true;
+		return 0;
+	}
+#endif
+#if NEED_RATE_LIMIT
+	bool is_limited = shard->server->rl_rate != 0;
+	if (is_limited) {
+		peer_bucket_refill(shard, peer);
+		if (peer->rl_tokens == 0) {
+			peer_throttle(shard, peer);
+			return 0;
+		}
+	}
+#endif
+	/*
+	 * The buffer is adaptive: it starts at PEER_RECV_MIN, doubles
+	 * every time a recv() fills it to the brim or a partial
+	 * message needs the room, and drops back to the minimum once
+	 * drained. A mostly-idle connection then costs a few hundred
+	 * bytes instead of staying at its peak burst size forever.
+	 */
+	while (1) {
+		if (peer->in_size == peer->in_cap) {
+			size_t new_cap = peer->in_cap == 0 ?
+				PEER_RECV_MIN : peer->in_cap * 2;
+			peer->in_buf = realloc(peer->in_buf, new_cap);
+			if (peer->in_buf == NULL)
+				abort();
+			peer->in_cap = new_cap;
+		}
+		size_t space = peer->in_cap - peer->in_size;
+		size_t take = space;
+#if NEED_RATE_LIMIT
+		/*
+		 * Capped at the tokens in hand - the meter has to stay
+		 * exact, or a flooder whose writes keep raising fresh
+		 * edge events would ride every trickle refill into a
+		 * full-buffer recv().
+		 */
+		if (is_limited && take > peer->rl_tokens)
+			take = peer->rl_tokens;
+#endif
+		ssize_t rc = recv(peer->socket, peer->in_buf + peer->in_size,
+				  take, 0);
+		if (rc < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				result = -1;
+				break;
+			}
+			if (peer->in_size == 0 &&
+			    peer->in_cap > PEER_RECV_MIN) {
+				peer->in_buf = realloc(peer->in_buf,
+						       PEER_RECV_MIN);
+				if (peer->in_buf == NULL)
+					abort();
+				peer->in_cap = PEER_RECV_MIN;
+			}
+			break;
+		}
+		if (rc == 0) {
+			result = -1;
+			break;
+		}
+		stat_add(&shard->server->stats.byte_in_count, rc);
+		peer->in_size += rc;
+#if NEED_CAPTURE
+		server_capture(shard->server, CHAT_CAPTURE_DATA, peer->cap_id,
+			       peer->in_buf + peer->in_size - rc, rc);
+#endif
+#if NEED_RATE_LIMIT
+		/* Never overdraws - the recv() was capped above. */
+		if (is_limited)
+			peer->rl_tokens -= rc;
+#endif
+#if NEED_OFFLOAD
+		if (!do_offload)
+			peer_consume_input(shard, peer);
+#else
+		peer_consume_input(shard, peer);
+#endif
+		/*
+		 * A full read means the kernel most likely has more -
+		 * take it in bigger pieces instead of spinning on tiny
+		 * recv() calls.
+		 */
+		if ((size_t)rc == space && peer->in_size < peer->in_cap) {
+			size_t new_cap = peer->in_cap * 2;
+			peer->in_buf = realloc(peer->in_buf, new_cap);
+			if (peer->in_buf == NULL)
+				abort();
+			peer->in_cap = new_cap;
+		}
+#if NEED_RATE_LIMIT
+		if (is_limited && peer->rl_tokens == 0) {
+			peer_throttle(shard, peer);
+			break;
+		}
+#endif
+	}
+#if NEED_OFFLOAD
+	/*
+	 * The whole burst goes to the pool in one piece. Even when the
+	 * peer died just now the complete messages it managed to send
+	 * still come out, same as the inline parse delivers them - the
+	 * drop is deferred until the job lands.
+	 */
+	if (do_offload && peer->in_size > 0)
+		offload_submit(shard, peer);
+#endif
+	return result;
+}
+
+#if NEED_OFFLOAD
+
+/**
+ * Fan one worker-serialized body out to the shard's peers. The
+ * shared-body path of shard_broadcast() - the offload always pays
+ * for a blob, losing the small-message coalescing, but in exchange
+ * the body (and its LZ4 copy) was composed off the event thread.
+ */
+static void
+offload_broadcast(struct chat_shard *shard, struct chat_peer *author,
+		  struct out_blob *blob)
+{
+	struct chat_server *server = shard->server;
+#if NEED_HISTORY
+	shard_history_push(shard, blob);
+#endif
+	for (struct chat_peer *peer = shard->peers; peer != NULL;
+	     peer = peer->next) {
+		if (peer == author || peer->doomed)
+			continue;
+#if NEED_BINARY_FRAMING
+		if (!peer->saw_first) {
+			peer_hold_blob(peer, blob);
+			continue;
+		}
+#endif
+		peer_queue_blob(peer, blob);
+		stat_add(&server->stats.msg_out_count, 1);
+		stat_max(&server->stats.out_bytes_max, peer->out_bytes);
+		peer_flush(shard, peer);
+		shard_peer_sync(shard, peer);
+	}
+	out_blob_unref(blob);
+}
+
+/**
+ * Apply one finished parse job on the event thread: settle the
+ * framing the worker saw, deliver the parsed messages, fan the
+ * serialized bodies out and give the leftover bytes back to the
+ * peer.
+ */
+static void
+offload_apply(struct chat_shard *shard, struct offload_job *job)
+{
+	struct chat_server *server = shard->server;
+	struct chat_peer *peer = job->peer;
+	/* The worker published the job only when done with it - the
+	 * join returns right away. */
+	void *result;
+	thread_task_join(job->task, &result);
+	thread_task_delete(job->task);
+	peer->job_pending = false;
+	--shard->offload_count;
+#if NEED_BINARY_FRAMING
+	if (job->saw_first && !peer->saw_first) {
+		peer->saw_first = true;
+		peer->is_binary = job->is_binary;
+#if NEED_COMPRESSION
+		if (job->is_compressed) {
+			peer->is_compressed = true;
+			atomic_fetch_add(&server->comp_peer_count, 1);
+		}
+#endif
+#if NEED_HISTORY
+		peer_replay_history(shard, peer);
+#endif
+	}
+	if (peer->saw_first && peer->held_first != NULL)
+		peer_drain_held(shard, peer);
+#endif
+#if NEED_AUTHOR
+	if (peer->author == NULL && job->author != NULL) {
+		/* Interned by the worker - the ref moves to the peer. */
+		peer->author = job->author;
+		peer->author_len = job->author_len;
+	}
+#endif
+	/*
+	 * A partial message at the end goes back as the peer's input.
+	 * The reads were blocked while the job was in flight, so
+	 * nothing got in between.
+	 */
+	size_t left = job->in_size - job->consumed;
+	if (left > 0) {
+		memmove(job->in_buf, job->in_buf + job->consumed, left);
+		peer->in_buf = job->in_buf;
+		peer->in_size = left;
+		peer->in_cap = job->in_cap;
+	} else {
+		free(job->in_buf);
+	}
+	while (job->out_first != NULL) {
+		struct offload_out *out = job->out_first;
+		job->out_first = out->next;
+		/* The offload runs in the plain mode only - the pop
+		 * queue is appended directly, like server_push_msg(). */
+		stat_add(&server->stats.msg_in_count, 1);
+		if (server->msg_last != NULL)
+			server->msg_last->next = out->msg;
+		else
+			server->msg_first = out->msg;
+		server->msg_last = out->msg;
+		offload_broadcast(shard, peer, out->blob);
+		numa_arena_free(&server->offload_out_arena, out);
+	}
+	free(job);
+	/*
+	 * The socket could turn readable while the job was in flight.
+	 * A doomed peer is left for the sweep, a paused intake for the
+	 * resume - same as the deferrals in shard_process().
+	 */
+	if (peer->read_pending && !peer->doomed && !shard->offload_draining &&
+	    !(server->out_high != 0 && shard->over_count > 0 &&
+	      server->out_policy == CHAT_OVERFLOW_PAUSE_INTAKE)) {
+		peer->read_pending = false;
+		if (peer_read(shard, peer) != 0)
+			peer->doomed = true;
+	}
+}
+
+/** Apply the parse jobs the workers finished. */
+static void
+offload_drain(struct chat_shard *shard)
+{
+	struct offload_job *job = atomic_exchange(&shard->offload_done, NULL);
+	/* The stack is LIFO - reverse it to restore completion order. */
+	struct offload_job *prev = NULL;
+	while (job != NULL) {
+		struct offload_job *next = job->next;
+		job->next = prev;
+		prev = job;
+		job = next;
+	}
+	while (prev != NULL) {
+		job = prev;
+		prev = job->next;
+		offload_apply(shard, job);
+	}
+}
+
+#endif
+
+static void
+shard_accept(struct chat_shard *shard)
+{
+	while (1) {
+		int fd = accept(shard->socket, NULL, NULL);
+		if (fd < 0)
+			break;
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+		struct chat_peer *peer = calloc(1, sizeof(*peer));
+		if (peer == NULL)
+			abort();
+		peer->socket = fd;
+		peer->next = shard->peers;
+		if (shard->peers != NULL)
+			shard->peers->prev = peer;
+		shard->peers = peer;
+		stat_add(&shard->server->stats.peer_count, 1);
+#if NEED_CAPTURE
+		peer->cap_id = atomic_fetch_add(&shard->server->cap_next_id,
+						1) + 1;
+		server_capture(shard->server, CHAT_CAPTURE_CONNECT,
+			       peer->cap_id, NULL, 0);
+#endif
+#if NEED_RATE_LIMIT
+		peer->rl_tokens = shard->server->rl_burst;
+		peer->rl_last_ms = shard->now_ms;
+#endif
+#if NEED_HISTORY
+		peer->history_seq = shard->history_seq;
+#if !NEED_BINARY_FRAMING
+		/* The wire format is text-only - replay right away. */
+		peer_replay_history(shard, peer);
+#endif
+#endif
+		/*
+		 * Registered once for both directions - with the
+		 * edge-triggered mode there is nothing to re-arm, so
+		 * no EPOLL_CTL_MOD on any path.
+		 */
+		struct epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		event.data.ptr = peer;
+		if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, fd,
+			      &event) != 0)
+			abort();
+	}
+}
+
+/**
+ * Deferred peer work which is not safe inside an event batch: drop
+ * the peers doomed by the disconnect policy and retry the reads
+ * skipped while the intake was paused.
+ */
+static void
+shard_finalize(struct chat_shard *shard)
+{
+	struct chat_peer *peer = shard->peers;
+	while (peer != NULL) {
+		struct chat_peer *next = peer->next;
+		if (peer->doomed)
+			shard_drop_peer(shard, peer);
+		peer = next;
+	}
+#if NEED_RATE_LIMIT
+	/*
+	 * Retry the throttled reads whose buckets refilled. Not while
+	 * the intake is paused - the pause outranks the tokens, and
+	 * its own resume below retries the pending reads anyway.
+	 */
+	if (shard->throttled_count > 0 &&
+	    !(shard->server->out_high != 0 && shard->over_count > 0 &&
+	      shard->server->out_policy == CHAT_OVERFLOW_PAUSE_INTAKE)) {
+		peer = shard->peers;
+		while (peer != NULL) {
+			struct chat_peer *next = peer->next;
+			if (peer->is_throttled) {
+				peer_bucket_refill(shard, peer);
+				if (peer->rl_tokens > 0) {
+					peer->is_throttled = false;
+					--shard->throttled_count;
+					peer->read_pending = false;
+					if (peer_read(shard, peer) != 0)
+						shard_drop_peer(shard, peer);
+				}
+			}
+			peer = next;
+		}
+	}
+#endif
+	if (!shard->resume_pending)
+		return;
+	shard->resume_pending = false;
+	peer = shard->peers;
+	/*
+	 * A retried read can push a queue over the high watermark
+	 * again - then the rest of the peers stay pending until the
+	 * next drain below the low one.
+	 */
+	while (peer != NULL && shard->over_count == 0) {
+		struct chat_peer *next = peer->next;
+		if (peer->read_pending) {
+			peer->read_pending = false;
+			if (peer_read(shard, peer) != 0)
+				shard_drop_peer(shard, peer);
+		}
+		peer = next;
+	}
+}
+
+/** Handle one batch of epoll events of the given shard. */
+static int
+shard_process(struct chat_shard *shard, int timeout_ms)
+{
+	struct chat_server *server = shard->server;
+	struct epoll_event events[128];
+#if NEED_RATE_LIMIT
+	/*
+	 * The edge-triggered epoll raises no event for a throttled
+	 * peer - its socket stayed readable the whole time. Wake up
+	 * on a short tick instead, so the refill in shard_finalize()
+	 * resumes the peer once tokens accrued.
+	 */
+	if (shard->throttled_count > 0 &&
+	    (timeout_ms < 0 || timeout_ms > RATE_LIMIT_TICK_MS))
+		timeout_ms = RATE_LIMIT_TICK_MS;
+#endif
+	int count = epoll_wait(shard->epoll_fd, events, 128, timeout_ms);
+	if (count < 0)
+		return count;
+#if NEED_RATE_LIMIT
+	if (server->rl_rate != 0)
+		shard->now_ms = time_ms();
+#endif
+	if (count > 0)
+		stat_add(&server->stats.wakeup_count, 1);
+	for (int i = 0; i < count; ++i) {
+		void *ptr = events[i].data.ptr;
+		if (ptr == shard) {
+			shard_accept(shard);
+			continue;
+		}
+		if (ptr == &shard->event_fd) {
+			uint64_t value;
+			ssize_t rc = read(shard->event_fd, &value,
+					  sizeof(value));
+			(void)rc;
+			shard_drain_inbox(shard);
+#if NEED_OFFLOAD
+			offload_drain(shard);
+#endif
+			continue;
+		}
+#if NEED_DATAGRAM
+		if (ptr == &shard->dgram_socket) {
+			shard_drain_dgram(shard);
+			continue;
+		}
+#endif
+		struct chat_peer *peer = ptr;
+		if (peer->doomed)
+			continue;
+		if ((events[i].events & EPOLLIN) != 0) {
+			if (server->out_high != 0 && shard->over_count > 0 &&
+			    server->out_policy == CHAT_OVERFLOW_PAUSE_INTAKE) {
+				peer->read_pending = true;
+			} else if (peer_read(shard, peer) != 0) {
+				shard_drop_peer(shard, peer);
+				continue;
+			}
+		}
+		if ((events[i].events & (EPOLLHUP | EPOLLERR)) != 0) {
+			shard_drop_peer(shard, peer);
+			continue;
+		}
+		if ((events[i].events & EPOLLOUT) != 0) {
+			peer_flush(shard, peer);
+			shard_peer_sync(shard, peer);
+		}
+	}
+	shard_finalize(shard);
+	return count;
+}
+
+static void *
+shard_thread_f(void *arg)
+{
+	struct chat_shard *shard = arg;
+	while (!atomic_load(&shard->server->stop)) {
+		if (shard_process(shard, -1) < 0 && errno != EINTR)
+			abort();
+	}
+	return NULL;
+}
+
+/** Create the shard's listening socket and epoll instance. */
+static int
+shard_listen(struct chat_shard *shard, uint16_t port, bool reuse_port)
 {
 	struct sockaddr_in addr;
 	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
 	addr.sin_port = htons(port);
 	/* Listen on all IPs of this machine. */
 	addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (fd < 0)
+		return CHAT_ERR_SYS;
+	int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (reuse_port)
+		setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		close(fd);
+		if (errno == EADDRINUSE)
+			return CHAT_ERR_PORT_BUSY;
+		return CHAT_ERR_SYS;
+	}
+	if (listen(fd, SOMAXCONN) != 0) {
+		close(fd);
+		return CHAT_ERR_SYS;
+	}
+	shard->epoll_fd = epoll_create1(0);
+	if (shard->epoll_fd < 0)
+		abort();
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN | EPOLLET;
+	event.data.ptr = shard;
+	if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0)
+		abort();
+#if NEED_DATAGRAM
+	if (shard->server->use_datagram) {
+		/*
+		 * An ephemeral port was assigned by listen() - learn it
+		 * so the UDP socket binds to the same one.
+		 */
+		socklen_t len = sizeof(addr);
+		if (getsockname(fd, (struct sockaddr *)&addr, &len) != 0)
+			abort();
+		int dfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+		if (dfd < 0)
+			goto dgram_fail;
+		setsockopt(dfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (reuse_port)
+			setsockopt(dfd, SOL_SOCKET, SO_REUSEPORT, &one,
+				   sizeof(one));
+		if (bind(dfd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+			close(dfd);
+			goto dgram_fail;
+		}
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN | EPOLLET;
+		event.data.ptr = &shard->dgram_socket;
+		if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, dfd,
+			      &event) != 0)
+			abort();
+		shard->dgram_socket = dfd;
+	}
+#endif
+	shard->socket = fd;
+	return 0;
+#if NEED_DATAGRAM
+dgram_fail:
+	close(shard->epoll_fd);
+	shard->epoll_fd = -1;
+	close(fd);
+	if (errno == EADDRINUSE)
+		return CHAT_ERR_PORT_BUSY;
+	return CHAT_ERR_SYS;
+#endif
+}
+
+static void
+shard_destroy(struct chat_shard *shard)
+{
+#if NEED_OFFLOAD
 	/*
-	 * 1) Create a server socket (function socket()).
-	 * 2) Bind the server socket to addr (function bind()).
-	 * 3) Listen the server socket (function listen()).
-	 * 4) Create epoll/kqueue if needed.
+	 * The in-flight parse jobs reference the peers - let them all
+	 * land before the peers go. The draining flag keeps the
+	 * completions from restarting reads and submitting more.
 	 */
-	/* IMPLEMENT THIS FUNCTION */
-	(void)server;
+	shard->offload_draining = true;
+	while (shard->offload_count > 0) {
+		struct pollfd pfd;
+		pfd.fd = shard->event_fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		poll(&pfd, 1, -1);
+		uint64_t value;
+		ssize_t rc = read(shard->event_fd, &value, sizeof(value));
+		(void)rc;
+		offload_drain(shard);
+	}
+#endif
+	while (shard->peers != NULL)
+		shard_drop_peer(shard, shard->peers);
+	struct blob_ref *ref = atomic_exchange(&shard->inbox, NULL);
+	while (ref != NULL) {
+		struct blob_ref *next = ref->next;
+		out_blob_unref(ref->blob);
+		free(ref);
+		ref = next;
+	}
+#if NEED_HISTORY
+	if (shard->history != NULL) {
+		for (int i = 0; i < shard->server->history_limit; ++i) {
+			if (shard->history[i] != NULL)
+				out_blob_unref(shard->history[i]);
+		}
+		free(shard->history);
+	}
+#endif
+#if NEED_DATAGRAM
+	if (shard->dgram_socket >= 0)
+		close(shard->dgram_socket);
+#endif
+	if (shard->epoll_fd >= 0)
+		close(shard->epoll_fd);
+	if (shard->event_fd >= 0)
+		close(shard->event_fd);
+	if (shard->socket >= 0)
+		close(shard->socket);
+}
 
-	return CHAT_ERR_NOT_IMPLEMENTED;
+struct chat_server *
+chat_server_new(void)
+{
+	struct chat_server *server = calloc(1, sizeof(*server));
+	if (server == NULL)
+		abort();
+	server->notify_fd = -1;
+#if NEED_AUTHOR
+	server->authors = chat_authors_new();
+#endif
+#if NEED_OFFLOAD
+	if (numa_arena_create(&server->offload_out_arena,
+			      sizeof(struct offload_out)) != 0)
+		abort();
+#endif
+#if NEED_CAPTURE
+	pthread_mutex_init(&server->cap_mutex, NULL);
+#endif
+	return server;
+}
+
+void
+chat_server_delete(struct chat_server *server)
+{
+	if (server->is_sharded) {
+		atomic_store(&server->stop, true);
+		uint64_t one = 1;
+		for (int i = 0; i < server->shard_count; ++i) {
+			ssize_t rc = write(server->shards[i].event_fd, &one,
+					   sizeof(one));
+			(void)rc;
+		}
+		for (int i = 0; i < server->shard_count; ++i)
+			pthread_join(server->shards[i].thread, NULL);
+		server_drain_inbox(server);
+	}
+	for (int i = 0; i < server->shard_count; ++i)
+		shard_destroy(&server->shards[i]);
+	free(server->shards);
+	while (server->msg_first != NULL) {
+		struct chat_message *msg = server->msg_first;
+		server->msg_first = msg->next;
+		chat_message_delete(msg);
+	}
+	if (server->notify_fd >= 0)
+		close(server->notify_fd);
+#if NEED_AUTHOR
+	chat_authors_delete(server->authors);
+#endif
+#if NEED_OFFLOAD
+	numa_arena_destroy(&server->offload_out_arena);
+#endif
+#if NEED_CAPTURE
+	if (server->cap_file != NULL)
+		fclose(server->cap_file);
+	pthread_mutex_destroy(&server->cap_mutex);
+#endif
+	free(server);
 }
 
+int
+chat_server_listen(struct chat_server *server, uint16_t port)
+{
+	if (server->shard_count > 0)
+		return CHAT_ERR_ALREADY_STARTED;
+
+	struct chat_shard *shard = calloc(1, sizeof(*shard));
+	if (shard == NULL)
+		abort();
+	shard->server = server;
+	shard->socket = -1;
+	shard->epoll_fd = -1;
+	shard->event_fd = -1;
+#if NEED_DATAGRAM
+	shard->dgram_socket = -1;
+#endif
+	int rc = shard_listen(shard, port, false);
+	if (rc != 0) {
+		free(shard);
+		return rc;
+	}
+#if NEED_OFFLOAD
+	if (server->offload_pool != NULL) {
+		/* The pool workers complete through it, like the
+		 * cross-shard broadcasts do in the sharded mode. */
+		shard->event_fd = eventfd(0, EFD_NONBLOCK);
+		if (shard->event_fd < 0)
+			abort();
+		struct epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.ptr = &shard->event_fd;
+		if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->event_fd,
+			      &event) != 0)
+			abort();
+	}
+#endif
+	server->shards = shard;
+	server->shard_count = 1;
+	return 0;
+}
+
+int
+chat_server_listen_sharded(struct chat_server *server, uint16_t port,
+			   int shard_count)
+{
+	if (shard_count <= 0)
+		return CHAT_ERR_INVALID_ARGUMENT;
+#if NEED_OFFLOAD
+	/* The shard threads spread the protocol work already. */
+	if (server->offload_pool != NULL)
+		return CHAT_ERR_INVALID_ARGUMENT;
+#endif
+	if (server->shard_count > 0)
+		return CHAT_ERR_ALREADY_STARTED;
+
+	struct chat_shard *shards = calloc(shard_count, sizeof(*shards));
+	if (shards == NULL)
+		abort();
+	for (int i = 0; i < shard_count; ++i) {
+		shards[i].server = server;
+		shards[i].socket = -1;
+		shards[i].epoll_fd = -1;
+		shards[i].event_fd = -1;
+#if NEED_DATAGRAM
+		shards[i].dgram_socket = -1;
+#endif
+	}
+	int rc = 0;
+	for (int i = 0; i < shard_count && rc == 0; ++i) {
+		rc = shard_listen(&shards[i], port, true);
+		if (rc != 0)
+			break;
+		if (port == 0) {
+			/*
+			 * An ephemeral port is assigned to the first
+			 * shard - the rest have to share it, not get
+			 * own ones.
+			 */
+			struct sockaddr_in addr;
+			socklen_t len = sizeof(addr);
+			if (getsockname(shards[i].socket,
+					(struct sockaddr *)&addr, &len) != 0)
+				abort();
+			port = ntohs(addr.sin_port);
+		}
+		shards[i].event_fd = eventfd(0, EFD_NONBLOCK);
+		if (shards[i].event_fd < 0)
+			abort();
+		struct epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.ptr = &shards[i].event_fd;
+		if (epoll_ctl(shards[i].epoll_fd, EPOLL_CTL_ADD,
+			      shards[i].event_fd, &event) != 0)
+			abort();
+	}
+	if (rc != 0) {
+		for (int i = 0; i < shard_count; ++i)
+			shard_destroy(&shards[i]);
+		free(shards);
+		return rc;
+	}
+	server->notify_fd = eventfd(0, EFD_NONBLOCK);
+	if (server->notify_fd < 0)
+		abort();
+	server->shards = shards;
+	server->shard_count = shard_count;
+	server->is_sharded = true;
+	for (int i = 0; i < shard_count; ++i) {
+		if (pthread_create(&shards[i].thread, NULL, shard_thread_f,
+				   &shards[i]) != 0)
+			abort();
+	}
+	return 0;
+}
+
+int
+chat_server_set_output_limit(struct chat_server *server,
+			     size_t high_watermark, size_t low_watermark,
+			     enum chat_server_overflow policy)
+{
+	if (high_watermark == 0 || low_watermark > high_watermark ||
+	    (policy != CHAT_OVERFLOW_DROP_OLDEST &&
+	     policy != CHAT_OVERFLOW_DISCONNECT &&
+	     policy != CHAT_OVERFLOW_PAUSE_INTAKE))
+		return CHAT_ERR_INVALID_ARGUMENT;
+	if (server->shard_count > 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	server->out_high = high_watermark;
+	server->out_low = low_watermark;
+	server->out_policy = policy;
+	return 0;
+}
+
+#if NEED_HISTORY
+int
+chat_server_set_history(struct chat_server *server, int message_count)
+{
+	if (message_count < 0)
+		return CHAT_ERR_INVALID_ARGUMENT;
+	if (server->shard_count > 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	server->history_limit = message_count;
+	return 0;
+}
+#endif
+
+#if NEED_DATAGRAM
+int
+chat_server_set_datagram(struct chat_server *server, bool enable)
+{
+	if (server->shard_count > 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	server->use_datagram = enable;
+	return 0;
+}
+#endif
+
+#if NEED_OFFLOAD
+int
+chat_server_set_offload(struct chat_server *server, struct thread_pool *pool)
+{
+	if (server->shard_count > 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	server->offload_pool = pool;
+	return 0;
+}
+#endif
+
+int
+chat_server_set_watermark_callback(struct chat_server *server,
+				   chat_server_watermark_f cb, void *arg)
+{
+	if (server->shard_count > 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	server->watermark_cb = cb;
+	server->watermark_arg = arg;
+	return 0;
+}
+
+#if NEED_RATE_LIMIT
+int
+chat_server_set_rate_limit(struct chat_server *server,
+			   uint64_t bytes_per_second, uint64_t burst_bytes)
+{
+	if (bytes_per_second != 0 && burst_bytes == 0)
+		return CHAT_ERR_INVALID_ARGUMENT;
+	if (server->shard_count > 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	server->rl_rate = bytes_per_second;
+	server->rl_burst = burst_bytes;
+	return 0;
+}
+#endif
+
+#if NEED_CAPTURE
+int
+chat_server_set_capture(struct chat_server *server, const char *path)
+{
+	if (server->shard_count > 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	if (server->cap_file != NULL) {
+		fclose(server->cap_file);
+		server->cap_file = NULL;
+	}
+	if (path == NULL)
+		return 0;
+	FILE *file = fopen(path, "wb");
+	if (file == NULL)
+		return CHAT_ERR_SYS;
+	uint32_t magic = CHAT_CAPTURE_MAGIC;
+	fwrite(&magic, sizeof(magic), 1, file);
+	server->cap_file = file;
+	server->cap_start_us = capture_time_us();
+	atomic_store(&server->cap_next_id, 0);
+	return 0;
+}
+#endif
+
 struct chat_message *
 chat_server_pop_next(struct chat_server *server)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)server;
-	return NULL;
+	if (server->is_sharded && server->msg_first == NULL)
+		server_drain_inbox(server);
+	struct chat_message *msg = server->msg_first;
+	if (msg == NULL)
+		return NULL;
+	server->msg_first = msg->next;
+	if (server->msg_first == NULL)
+		server->msg_last = NULL;
+	msg->next = NULL;
+	return msg;
+}
+
+int
+chat_server_pop_many(struct chat_server *server, struct chat_message **msgs,
+		     int capacity)
+{
+	if (server->is_sharded && server->msg_first == NULL)
+		server_drain_inbox(server);
+	int count = 0;
+	while (count < capacity && server->msg_first != NULL) {
+		struct chat_message *msg = server->msg_first;
+		server->msg_first = msg->next;
+		msg->next = NULL;
+		msgs[count++] = msg;
+	}
+	if (server->msg_first == NULL)
+		server->msg_last = NULL;
+	return count;
 }
 
 int
 chat_server_update(struct chat_server *server, double timeout)
 {
-	/*
-	 * 1) Wait on epoll/kqueue/poll for update on any socket.
-	 * 2) Handle the update.
-	 * 2.1) If the update was on listen-socket, then you probably need to
-	 *     call accept() on it - a new client wants to join.
-	 * 2.2) If the update was on a client-socket, then you might want to
-	 *     read/write on it.
-	 */
-	(void)server;
-	(void)timeout;
-	return CHAT_ERR_NOT_IMPLEMENTED;
+	if (server->shard_count == 0)
+		return CHAT_ERR_NOT_STARTED;
+
+	int timeout_ms = timeout < 0 ? -1 : (int)(timeout * 1000);
+	if (server->is_sharded) {
+		/*
+		 * The IO is done by the shard threads - here only wait
+		 * until any of them hands a message over.
+		 */
+		struct pollfd pfd;
+		pfd.fd = server->notify_fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		int rc = poll(&pfd, 1, timeout_ms);
+		if (rc < 0)
+			return CHAT_ERR_SYS;
+		if (rc == 0)
+			return CHAT_ERR_TIMEOUT;
+		stat_add(&server->stats.wakeup_count, 1);
+		uint64_t value;
+		ssize_t len = read(server->notify_fd, &value, sizeof(value));
+		(void)len;
+		return 0;
+	}
+	int count = shard_process(&server->shards[0], timeout_ms);
+	if (count < 0)
+		return CHAT_ERR_SYS;
+	if (count == 0)
+		return CHAT_ERR_TIMEOUT;
+	return 0;
 }
 
 int
 chat_server_get_descriptor(const struct chat_server *server)
 {
-#if NEED_SERVER_FEED
-	/* IMPLEMENT THIS FUNCTION if want +5 points. */
-
 	/*
-	 * Server has multiple sockets - own and from connected clients. Hence
-	 * you can't return a socket here. But if you are using epoll/kqueue,
-	 * then you can return their descriptor. These descriptors can be polled
-	 * just like sockets and will return an event when any of their owned
-	 * descriptors has any events.
-	 *
-	 * For example, assume you created an epoll descriptor and added to
-	 * there a listen-socket and a few client-sockets. Now if you will call
-	 * poll() on the epoll's descriptor, then on return from poll() you can
-	 * be sure epoll_wait() can return something useful for some of those
-	 * sockets.
+	 * The epoll descriptor polls as readable when any of the
+	 * owned sockets has events, so it can represent the whole
+	 * server in an external event loop. In the sharded mode the
+	 * externally visible event is a received message, signalled
+	 * on the notification descriptor.
 	 */
-#endif
-	(void)server;
-	return -1;
+	if (server->shard_count == 0)
+		return -1;
+	if (server->is_sharded)
+		return server->notify_fd;
+	return server->shards[0].epoll_fd;
 }
 
 int
 chat_server_get_socket(const struct chat_server *server)
 {
-	return server->socket;
+	if (server->shard_count == 0)
+		return -1;
+	return server->shards[0].socket;
 }
 
 int
 chat_server_get_events(const struct chat_server *server)
 {
-	/*
-	 * IMPLEMENT THIS FUNCTION - add OUTPUT event if has non-empty output
-	 * buffer in any of the client-sockets.
-	 */
-	(void)server;
-	return CHAT_EVENT_INPUT;
+	if (server->shard_count == 0)
+		return 0;
+	int events = CHAT_EVENT_INPUT;
+	if (server->is_sharded) {
+		/* The shard threads flush their own output. */
+		return events;
+	}
+	for (const struct chat_peer *peer = server->shards[0].peers;
+	     peer != NULL; peer = peer->next) {
+		if (peer->out_first != NULL) {
+			events |= CHAT_EVENT_OUTPUT;
+			break;
+		}
+	}
+	return events;
+}
+
+void
+chat_server_stats_get(const struct chat_server *server,
+		      struct chat_server_stats *stats)
+{
+	const struct server_stats *src = &server->stats;
+	stats->peer_count = stat_load(&src->peer_count);
+	stats->msg_in_count = stat_load(&src->msg_in_count);
+	stats->msg_out_count = stat_load(&src->msg_out_count);
+	stats->byte_in_count = stat_load(&src->byte_in_count);
+	stats->byte_out_count = stat_load(&src->byte_out_count);
+	stats->partial_write_count = stat_load(&src->partial_write_count);
+	stats->out_bytes_max = stat_load(&src->out_bytes_max);
+	stats->wakeup_count = stat_load(&src->wakeup_count);
+}
+
+#if NEED_SERVER_HANDOFF
+
+enum {
+	/** First bytes of a handoff stream - "CH1" and a version. */
+	HANDOFF_MAGIC = 0x31484301,
+};
+
+struct handoff_header {
+	uint32_t magic;
+	uint32_t peer_count;
+};
+
+/**
+ * Per-peer fixed part; the variable parts (input bytes, output
+ * chunks, held broadcasts, author name) follow it on the stream.
+ */
+struct handoff_peer {
+	uint64_t in_size;
+	uint32_t chunk_count;
+	uint32_t held_count;
+	/** UINT32_MAX when the author did not introduce itself yet. */
+	uint32_t author_len;
+	uint8_t saw_first;
+	uint8_t is_binary;
+	uint8_t is_compressed;
+};
+
+struct handoff_chunk {
+	uint64_t size;
+	uint64_t pos;
+	uint8_t glued;
+};
+
+static int
+handoff_write(int sock, const void *data, size_t size)
+{
+	const char *pos = data;
+	while (size > 0) {
+		ssize_t rc = send(sock, pos, size, MSG_NOSIGNAL);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		pos += rc;
+		size -= rc;
+	}
+	return 0;
 }
 
+static int
+handoff_read(int sock, void *data, size_t size)
+{
+	char *pos = data;
+	while (size > 0) {
+		ssize_t rc = recv(sock, pos, size, 0);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (rc == 0)
+			return -1;
+		pos += rc;
+		size -= rc;
+	}
+	return 0;
+}
+
+/** Send the payload with 'fd' attached to its first byte. */
+static int
+handoff_send_fd(int sock, const void *data, size_t size, int fd)
+{
+	struct iovec vec;
+	vec.iov_base = (void *)data;
+	vec.iov_len = size;
+	char cmsg_buf[CMSG_SPACE(sizeof(int))];
+	struct msghdr hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.msg_iov = &vec;
+	hdr.msg_iovlen = 1;
+	hdr.msg_control = cmsg_buf;
+	hdr.msg_controllen = sizeof(cmsg_buf);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	ssize_t rc;
+	do {
+		rc = sendmsg(sock, &hdr, MSG_NOSIGNAL);
+	} while (rc < 0 && errno == EINTR);
+	if (rc < 0)
+		return -1;
+	/* The descriptor went with the first byte, the rest is plain. */
+	return handoff_write(sock, (const char *)data + rc, size - rc);
+}
+
+static int
+handoff_recv_fd(int sock, void *data, size_t size, int *fd)
+{
+	struct iovec vec;
+	vec.iov_base = data;
+	vec.iov_len = size;
+	char cmsg_buf[CMSG_SPACE(sizeof(int))];
+	struct msghdr hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.msg_iov = &vec;
+	hdr.msg_iovlen = 1;
+	hdr.msg_control = cmsg_buf;
+	hdr.msg_controllen = sizeof(cmsg_buf);
+	ssize_t rc;
+	do {
+		rc = recvmsg(sock, &hdr, 0);
+	} while (rc < 0 && errno == EINTR);
+	if (rc <= 0)
+		return -1;
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+	if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+	    cmsg->cmsg_type != SCM_RIGHTS)
+		return -1;
+	memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+	return handoff_read(sock, (char *)data + rc, size - rc);
+}
+
+int
+chat_server_handoff_send(struct chat_server *server, int unix_sock)
+{
+	if (server->shard_count == 0)
+		return CHAT_ERR_NOT_STARTED;
+	if (server->is_sharded)
+		return CHAT_ERR_INVALID_ARGUMENT;
+	struct chat_shard *shard = &server->shards[0];
+
+	struct handoff_header header;
+	header.magic = HANDOFF_MAGIC;
+	header.peer_count = 0;
+	for (struct chat_peer *peer = shard->peers; peer != NULL;
+	     peer = peer->next)
+		++header.peer_count;
+	if (handoff_send_fd(unix_sock, &header, sizeof(header),
+			    shard->socket) != 0)
+		return CHAT_ERR_SYS;
+
+	for (struct chat_peer *peer = shard->peers; peer != NULL;
+	     peer = peer->next) {
+		struct handoff_peer ph;
+		memset(&ph, 0, sizeof(ph));
+		ph.in_size = peer->in_size;
+		for (const struct out_chunk *chunk = peer->out_first;
+		     chunk != NULL; chunk = chunk->next)
+			++ph.chunk_count;
+		ph.author_len = UINT32_MAX;
+		if (peer->author != NULL)
+			ph.author_len = peer->author_len;
+		ph.saw_first = peer->saw_first;
+#if NEED_BINARY_FRAMING
+		for (const struct blob_ref *ref = peer->held_first;
+		     ref != NULL; ref = ref->next)
+			++ph.held_count;
+		ph.is_binary = peer->is_binary;
+#endif
+#if NEED_COMPRESSION
+		ph.is_compressed = peer->is_compressed;
+#endif
+		if (handoff_send_fd(unix_sock, &ph, sizeof(ph),
+				    peer->socket) != 0)
+			return CHAT_ERR_SYS;
+		if (handoff_write(unix_sock, peer->in_buf, peer->in_size) != 0)
+			return CHAT_ERR_SYS;
+		/*
+		 * The chunks go with their exact boundaries, send
+		 * positions and glue marks - the successor's queue then
+		 * behaves byte for byte like this one would, including
+		 * a partially sent head mid-message.
+		 */
+		for (const struct out_chunk *chunk = peer->out_first;
+		     chunk != NULL; chunk = chunk->next) {
+			struct handoff_chunk ch;
+			memset(&ch, 0, sizeof(ch));
+			ch.size = chunk->size;
+			ch.pos = chunk->pos;
+			ch.glued = chunk->glued;
+			if (handoff_write(unix_sock, &ch, sizeof(ch)) != 0 ||
+			    handoff_write(unix_sock, chunk->data,
+					  chunk->size) != 0)
+				return CHAT_ERR_SYS;
+		}
+#if NEED_BINARY_FRAMING
+		for (const struct blob_ref *ref = peer->held_first;
+		     ref != NULL; ref = ref->next) {
+			uint64_t size = ref->blob->size;
+			if (handoff_write(unix_sock, &size,
+					  sizeof(size)) != 0 ||
+			    handoff_write(unix_sock, ref->blob->data,
+					  size) != 0)
+				return CHAT_ERR_SYS;
+		}
+#endif
+		if (peer->author != NULL &&
+		    handoff_write(unix_sock, peer->author,
+				  peer->author_len) != 0)
+			return CHAT_ERR_SYS;
+	}
+	return 0;
+}
+
+int
+chat_server_handoff_recv(struct chat_server *server, int unix_sock)
+{
+	if (server->shard_count > 0)
+		return CHAT_ERR_ALREADY_STARTED;
+
+	struct handoff_header header;
+	int listen_sock = -1;
+	if (handoff_recv_fd(unix_sock, &header, sizeof(header),
+			    &listen_sock) != 0)
+		return CHAT_ERR_SYS;
+	if (header.magic != HANDOFF_MAGIC) {
+		close(listen_sock);
+		return CHAT_ERR_INVALID_ARGUMENT;
+	}
+
+	struct chat_shard *shard = calloc(1, sizeof(*shard));
+	if (shard == NULL)
+		abort();
+	shard->server = server;
+	shard->socket = listen_sock;
+	shard->event_fd = -1;
+	shard->dgram_socket = -1;
+	shard->epoll_fd = epoll_create1(0);
+	if (shard->epoll_fd < 0)
+		abort();
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN | EPOLLET;
+	event.data.ptr = shard;
+	if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->socket,
+		      &event) != 0)
+		abort();
+	/* From here the partial state tears down like a live shard. */
+	server->shards = shard;
+	server->shard_count = 1;
+
+	for (uint32_t i = 0; i < header.peer_count; ++i) {
+		struct handoff_peer ph;
+		int fd = -1;
+		if (handoff_recv_fd(unix_sock, &ph, sizeof(ph), &fd) != 0)
+			goto error;
+		struct chat_peer *peer = calloc(1, sizeof(*peer));
+		if (peer == NULL)
+			abort();
+		peer->socket = fd;
+		peer->next = shard->peers;
+		if (shard->peers != NULL)
+			shard->peers->prev = peer;
+		shard->peers = peer;
+		stat_add(&server->stats.peer_count, 1);
+#if NEED_CAPTURE
+		peer->cap_id = atomic_fetch_add(&server->cap_next_id, 1) + 1;
+		server_capture(server, CHAT_CAPTURE_CONNECT, peer->cap_id,
+			       NULL, 0);
+#endif
+#if NEED_RATE_LIMIT
+		/* The buckets do not survive the wire - a full one on
+		 * arrival errs on the side of the honest peers. */
+		peer->rl_tokens = server->rl_burst;
+#endif
+		if (ph.in_size > 0) {
+			peer->in_cap = ph.in_size > PEER_RECV_MIN ?
+				ph.in_size : PEER_RECV_MIN;
+			peer->in_buf = malloc(peer->in_cap);
+			if (peer->in_buf == NULL)
+				abort();
+			peer->in_size = ph.in_size;
+			if (handoff_read(unix_sock, peer->in_buf,
+					 ph.in_size) != 0)
+				goto error;
+		}
+		for (uint32_t c = 0; c < ph.chunk_count; ++c) {
+			struct handoff_chunk ch;
+			if (handoff_read(unix_sock, &ch, sizeof(ch)) != 0)
+				goto error;
+			struct out_chunk *chunk = calloc(1, sizeof(*chunk));
+			if (chunk == NULL)
+				abort();
+			/* Private copies - the blob sharing of the
+			 * predecessor does not survive the wire. */
+			chunk->cap = ch.size;
+			chunk->data = malloc(ch.size);
+			if (chunk->data == NULL)
+				abort();
+			chunk->size = ch.size;
+			chunk->pos = ch.pos;
+			chunk->glued = ch.glued;
+			if (peer->out_last != NULL)
+				peer->out_last->next = chunk;
+			else
+				peer->out_first = chunk;
+			peer->out_last = chunk;
+			peer->out_bytes += ch.size - ch.pos;
+			if (handoff_read(unix_sock, chunk->data,
+					 ch.size) != 0)
+				goto error;
+		}
+#if NEED_BINARY_FRAMING
+		for (uint32_t h = 0; h < ph.held_count; ++h) {
+			uint64_t size;
+			if (handoff_read(unix_sock, &size, sizeof(size)) != 0)
+				goto error;
+			struct out_blob *blob =
+				malloc(sizeof(*blob) + size);
+			if (blob == NULL)
+				abort();
+			blob->refs = 1;
+			blob->size = size;
+#if NEED_COMPRESSION
+			/* Recompressing an in-flight broadcast is not
+			 * worth it - it ships stored if needed. */
+			blob->comp = NULL;
+			blob->comp_size = 0;
+#endif
+			if (handoff_read(unix_sock, blob->data, size) != 0) {
+				free(blob);
+				goto error;
+			}
+			peer_hold_blob(peer, blob);
+			out_blob_unref(blob);
+		}
+		peer->is_binary = ph.is_binary;
+#endif
+		peer->saw_first = ph.saw_first;
+#if NEED_COMPRESSION
+		peer->is_compressed = ph.is_compressed;
+		if (peer->is_compressed)
+			atomic_fetch_add(&server->comp_peer_count, 1);
+#endif
+		if (ph.author_len != UINT32_MAX) {
+			char *name = malloc(ph.author_len + 1);
+			if (name == NULL)
+				abort();
+			if (handoff_read(unix_sock, name,
+					 ph.author_len) != 0) {
+				free(name);
+				goto error;
+			}
+#if NEED_AUTHOR
+			peer->author = chat_authors_intern(server->authors,
+							   name,
+							   ph.author_len);
+			peer->author_len = ph.author_len;
+#endif
+			free(name);
+		}
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		event.data.ptr = peer;
+		if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, peer->socket,
+			      &event) != 0)
+			abort();
+		/* The new server's own watermark config applies. */
+		shard_peer_sync(shard, peer);
+	}
+	shard_finalize(shard);
+	return 0;
+
+error:
+	shard_destroy(shard);
+	free(shard);
+	server->shards = NULL;
+	server->shard_count = 0;
+	return CHAT_ERR_SYS;
+}
+
+#endif
+
 int
 chat_server_feed(struct chat_server *server, const char *msg, uint32_t msg_size)
 {
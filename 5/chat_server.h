@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 struct chat_server;
@@ -30,6 +32,207 @@ chat_server_delete(struct chat_server *server);
 int
 chat_server_listen(struct chat_server *server, uint16_t port);
 
+#if NEED_SHARDED_SERVER
+/**
+ * Like chat_server_listen(), but run 'shard_count' event loops, each
+ * on an own thread with an own SO_REUSEPORT listening socket and an
+ * own subset of the accepted clients. The IO is then done entirely by
+ * the shard threads and chat_server_update() only waits for received
+ * messages.
+ *
+ * @param server Chat server.
+ * @param port Port to listen on.
+ * @param shard_count How many event loops to run.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_INVALID_ARGUMENT - bad shard count.
+ *     - CHAT_ERR_PORT_BUSY - the port is already busy.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ *     - CHAT_ERR_SYS - a system error, check errno.
+ */
+int
+chat_server_listen_sharded(struct chat_server *server, uint16_t port,
+			   int shard_count);
+#endif
+
+#if NEED_OUTPUT_LIMIT
+enum chat_server_overflow {
+	/** Drop the oldest queued messages down to the low watermark. */
+	CHAT_OVERFLOW_DROP_OLDEST,
+	/** Disconnect the client which can't keep up. */
+	CHAT_OVERFLOW_DISCONNECT,
+	/**
+	 * Stop reading new messages from all clients until the slow
+	 * one drains below the low watermark. Nothing is lost, the
+	 * senders are simply slowed down.
+	 */
+	CHAT_OVERFLOW_PAUSE_INTAKE,
+};
+
+/**
+ * Called when a client's output queue crosses a watermark. 'is_above'
+ * is true for crossing the high one upwards, false for draining below
+ * the low one. The client is identified by its socket. In the sharded
+ * mode the callback runs on a shard thread.
+ */
+typedef void (*chat_server_watermark_f)(struct chat_server *server,
+					int peer_socket, bool is_above,
+					void *arg);
+
+/**
+ * Limit how many not yet sent bytes a single client's output queue
+ * may hold. Has to be called before listening.
+ *
+ * @param server Chat server.
+ * @param high_watermark Queue size triggering the policy, in bytes.
+ * @param low_watermark Queue size considered drained, in bytes.
+ * @param policy What to do when the high watermark is crossed.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_INVALID_ARGUMENT - bad watermarks or policy.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ */
+int
+chat_server_set_output_limit(struct chat_server *server,
+			     size_t high_watermark, size_t low_watermark,
+			     enum chat_server_overflow policy);
+
+/**
+ * Install a watermark crossing callback. Has to be called before
+ * listening.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ */
+int
+chat_server_set_watermark_callback(struct chat_server *server,
+				   chat_server_watermark_f cb, void *arg);
+#endif
+
+#if NEED_RATE_LIMIT
+/**
+ * Limit how fast a single client may feed the server. Every peer
+ * carries a token bucket of 'burst_bytes' capacity refilled at
+ * 'bytes_per_second', and each received byte pays one token. A peer
+ * whose bucket ran dry is simply not read until tokens accrue - the
+ * backpressure reaches it through TCP while the rest of the loop
+ * keeps its latency. The refill uses the event batch timestamp, so
+ * containing a flooder costs a subtraction per recv(), not a thread.
+ * Zero rate disables the limit - the default. Has to be called
+ * before listening.
+ *
+ * @param server Chat server.
+ * @param bytes_per_second Sustained per-client intake rate.
+ * @param burst_bytes Bucket capacity - the tolerated burst.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_INVALID_ARGUMENT - a rate with a zero burst.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ */
+int
+chat_server_set_rate_limit(struct chat_server *server,
+			   uint64_t bytes_per_second, uint64_t burst_bytes);
+#endif
+
+#if NEED_CAPTURE
+/**
+ * Tap the inbound traffic into a capture log at 'path', in the
+ * format described in chat.h: every connect, disconnect and recv()ed
+ * byte chunk, timestamped in microseconds. The tap records below any
+ * framing, so the log replays byte-exactly against any server
+ * speaking the protocol the recorded clients spoke - see
+ * chat_replay.c for the replayer. Costs one branch per recv() while
+ * off; datagram traffic is not captured. NULL path switches the
+ * capture off. Has to be called before listening.
+ *
+ * @param server Chat server.
+ * @param path Where to write the log, truncated if it exists.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_SYS - the log file can not be created.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ */
+int
+chat_server_set_capture(struct chat_server *server, const char *path);
+#endif
+
+#if NEED_HISTORY
+/**
+ * Keep the last 'message_count' broadcast messages per event loop and
+ * replay them to every newly connected client, oldest first, right
+ * when its framing settles. The history holds refs on the same
+ * message bodies the live output queues share, and the replay
+ * enqueues refs too - a mass reconnect re-sends the backlog without
+ * copying a single payload byte per joiner. Messages broadcast after
+ * the connect are never replayed - the client receives those live.
+ * Zero disables the history - the default. Has to be called before
+ * listening.
+ *
+ * @param server Chat server.
+ * @param message_count How many last messages to keep.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_INVALID_ARGUMENT - a negative count.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ */
+int
+chat_server_set_history(struct chat_server *server, int message_count);
+#endif
+
+#if NEED_DATAGRAM
+/**
+ * Also bind a UDP socket on the listening port and take messages as
+ * single datagrams on it. Loss-tolerant telemetry then bypasses the
+ * TCP streams entirely: no connection, no stream buffers, no
+ * head-of-line blocking of the real messages - and a lost datagram is
+ * simply lost, never retransmitted. A datagram is one complete
+ * message, optionally prefixed with the author name and a zero byte.
+ * It comes out of chat_server_pop_next() like a stream message, but
+ * is not broadcast to the connected clients. Has to be called before
+ * listening.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ */
+int
+chat_server_set_datagram(struct chat_server *server, bool enable);
+#endif
+
+#if NEED_OFFLOAD
+struct thread_pool;
+
+/**
+ * Offload the protocol work - framing, author handling and broadcast
+ * body serialization - onto the given thread pool (the one from
+ * ../4). Each burst of a peer's raw input becomes one pool task and
+ * the finished results come back through an eventfd, so the
+ * per-message CPU work pipelines across the workers while the event
+ * thread stays the only owner of the sockets. At most one task per
+ * peer is in flight at a time, which keeps the per-peer message
+ * order.
+ *
+ * The pool is borrowed, not owned - delete it after the server. Only
+ * the plain mode takes the offload; the sharded mode spreads the
+ * protocol work across its own threads already, and
+ * chat_server_listen_sharded() refuses to start with a pool set.
+ * NULL turns the offload back off. Has to be called before
+ * listening.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ */
+int
+chat_server_set_offload(struct chat_server *server, struct thread_pool *pool);
+#endif
+
 /**
  * Pop a next pending chat message. The returned message has to be
  * freed using chat_message_delete().
@@ -42,6 +245,21 @@ chat_server_listen(struct chat_server *server, uint16_t port);
 struct chat_message *
 chat_server_pop_next(struct chat_server *server);
 
+/**
+ * Pop up to 'capacity' pending chat messages at once. Each returned
+ * message has to be freed using chat_message_delete().
+ *
+ * @param server Chat server.
+ * @param msgs Array of at least 'capacity' cells to fill.
+ * @param capacity How many messages fit into 'msgs'.
+ *
+ * @retval >0 Number of popped messages.
+ * @retval 0 No more messages yet.
+ */
+int
+chat_server_pop_many(struct chat_server *server, struct chat_message **msgs,
+		     int capacity);
+
 /**
  * Wait for any update on any of the sockets for the given timeout
  * and do this update.
@@ -89,6 +307,44 @@ chat_server_get_socket(const struct chat_server *server);
 int
 chat_server_get_events(const struct chat_server *server);
 
+/**
+ * Operational counters of the server. All of them are maintained
+ * inline in the normal event paths - reading them costs the server
+ * nothing and they are always on.
+ */
+struct chat_server_stats {
+	/** Currently connected peers. */
+	uint64_t peer_count;
+	/** Complete messages received from the peers. */
+	uint64_t msg_in_count;
+	/** Messages queued to the peers - a broadcast counts once per
+	 * recipient. */
+	uint64_t msg_out_count;
+	/** Bytes received from the sockets. */
+	uint64_t byte_in_count;
+	/** Bytes written into the sockets. */
+	uint64_t byte_out_count;
+	/** Sends which the kernel took only partially. */
+	uint64_t partial_write_count;
+	/** The most not yet sent bytes a single peer's output queue
+	 * ever held. */
+	uint64_t out_bytes_max;
+	/** poll/epoll returns with at least one event. */
+	uint64_t wakeup_count;
+};
+
+/**
+ * Read the operational counters. In the sharded mode they are updated
+ * by the shard threads - each counter is an exact momentary value,
+ * but the counters are not a consistent snapshot of each other.
+ *
+ * @param server Chat server.
+ * @param stats Statistics to fill.
+ */
+void
+chat_server_stats_get(const struct chat_server *server,
+		      struct chat_server_stats *stats);
+
 /**
  * Feed a message to the server to broadcast to all clients.
  *
@@ -104,3 +360,47 @@ chat_server_get_events(const struct chat_server *server);
 int
 chat_server_feed(struct chat_server *server, const char *msg,
 		 uint32_t msg_size);
+
+#if NEED_SERVER_HANDOFF
+
+/**
+ * Serialize the whole serving state into 'unix_sock' for a successor
+ * process: the listening socket and every peer's socket go as
+ * SCM_RIGHTS ancillary data, each peer's partial input, unsent
+ * output queue, negotiated framing and author name go as payload. A
+ * redeploy then replaces the process without dropping a single
+ * connection or losing a queued byte - the successor picks up
+ * mid-message where this process stopped.
+ *
+ * The server itself is left untouched - the descriptors are
+ * duplicated into the successor by the kernel. The caller must not
+ * call chat_server_update() afterwards (both processes would consume
+ * the same sockets) and is expected to delete the server and exit.
+ * Only the plain mode is supported; 'unix_sock' has to be a blocking
+ * SOCK_STREAM one.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_NOT_STARTED - the server is not listening yet.
+ *     - CHAT_ERR_INVALID_ARGUMENT - the server is sharded.
+ *     - CHAT_ERR_SYS - a system error, check errno.
+ */
+int
+chat_server_handoff_send(struct chat_server *server, int unix_sock);
+
+/**
+ * Restore the state sent by chat_server_handoff_send() into this
+ * server, which must not be listening yet. On success the server is
+ * serving the inherited listening socket and peers as if it accepted
+ * them itself.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ *     - CHAT_ERR_INVALID_ARGUMENT - the stream is not a handoff.
+ *     - CHAT_ERR_SYS - a system error, check errno.
+ */
+int
+chat_server_handoff_recv(struct chat_server *server, int unix_sock);
+
+#endif
@@ -1,10 +1,22 @@
 #include "chat.h"
 #include "chat_server.h"
+#include "prof.h"
 
 #include <errno.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+static volatile sig_atomic_t prof_toggle_requested = 0;
+
+static void
+on_sigusr1(int signum)
+{
+	(void)signum;
+	prof_toggle_requested = 1;
+}
 
 static int
 port_from_str(const char *str, uint16_t *port)
@@ -49,16 +61,42 @@ main(int argc, char **argv)
 	 * chat_server_get_descriptor(), process events, etc.
 	 */
 #else
+	/*
+	 * SIGUSR1 toggles the in-place profiler - one signal starts the
+	 * sampling, the next one stops it and writes chat_server.folded
+	 * into the working directory. No SA_RESTART - the signal has to
+	 * kick the server out of its wait to handle the toggle at once.
+	 */
+	struct sigaction profile_action;
+	memset(&profile_action, 0, sizeof(profile_action));
+	profile_action.sa_handler = on_sigusr1;
+	sigemptyset(&profile_action.sa_mask);
+	sigaction(SIGUSR1, &profile_action, NULL);
 	/*
 	 * The basic implementation without server messages. Just serving
 	 * clients.
 	 */
 	while (true) {
 		int rc = chat_server_update(serv, -1);
-		if (rc != 0) {
+		if (rc != 0 && !(rc == CHAT_ERR_SYS && errno == EINTR)) {
 			printf("Update error: %d\n", rc);
 			break;
 		}
+		if (prof_toggle_requested) {
+			prof_toggle_requested = 0;
+			if (prof_start(0) == 0) {
+				printf("Profiling started\n");
+			} else {
+				prof_stop();
+				FILE *file = fopen("chat_server.folded", "w");
+				if (file != NULL) {
+					prof_dump_folded(file);
+					fclose(file);
+				}
+				printf("Profiling stopped, %zu samples\n",
+				       prof_sample_count());
+			}
+		}
 		/* Flush all the pending messages to the standard output. */
 		struct chat_message *msg;
 		while ((msg = chat_server_pop_next(serv)) != NULL) {
@@ -2,11 +2,17 @@
 #include "chat.h"
 #include "chat_client.h"
 #include "chat_server.h"
+#if NEED_OFFLOAD
+#include "../4/thread_pool.h"
+#include "numa_arena.h"
+#endif
 
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <unistd.h>
 
 enum {
 	TEST_MSG_ID_LEN = 64,
@@ -333,6 +339,326 @@ test_multi_feed(void)
 	unit_test_finish();
 }
 
+static void
+test_pop_many(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+	struct chat_client *c1 = chat_client_new("c1");
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	struct chat_client *c2 = chat_client_new("c2");
+	unit_fail_if(chat_client_connect(c2, make_addr_str(port)) != 0);
+	struct chat_message *msgs[10];
+	unit_check(chat_client_pop_many(c2, msgs, 10) == 0, "nothing yet");
+
+	unit_check(chat_client_feed(c1, "m1\nm2\nm3\n", 9) == 0, "feed 3");
+	client_consume_events(c1);
+	server_consume_events(s);
+	struct chat_message *msg = client_pop_next_blocking(c2, s);
+	unit_check(strcmp(msg->data, "m1") == 0, "msg1 single pop");
+	chat_message_delete(msg);
+	int count = 0;
+	while (count < 2) {
+		count += chat_client_pop_many(c2, msgs + count, 10 - count);
+		if (count < 2) {
+			chat_client_update(c2, 0);
+			chat_server_update(s, 0);
+		}
+	}
+	unit_check(count == 2, "popped exactly 2");
+	unit_check(strcmp(msgs[0]->data, "m2") == 0, "msg2 in batch");
+	unit_check(strcmp(msgs[1]->data, "m3") == 0, "msg3 in batch");
+	chat_message_delete(msgs[0]);
+	chat_message_delete(msgs[1]);
+
+	unit_check(chat_client_feed(c1, "m4\nm5\n", 6) == 0, "feed 2");
+	client_consume_events(c1);
+	server_consume_events(s);
+	while (chat_client_pop_many(c2, msgs, 1) < 1) {
+		chat_client_update(c2, 0);
+		chat_server_update(s, 0);
+	}
+	unit_check(strcmp(msgs[0]->data, "m4") == 0, "batch is bounded");
+	chat_message_delete(msgs[0]);
+	msg = client_pop_next_blocking(c2, s);
+	unit_check(strcmp(msg->data, "m5") == 0, "the rest is kept");
+	chat_message_delete(msg);
+
+	/* The server kept its own copy of all 5 messages - batch-pop it. */
+	count = chat_server_pop_many(s, msgs, 10);
+	unit_check(count == 5, "server pops the backlog in one batch");
+	unit_check(strcmp(msgs[0]->data, "m1") == 0, "server msg1 in batch");
+	unit_check(strcmp(msgs[4]->data, "m5") == 0, "server msg5 in batch");
+	for (int i = 0; i < count; ++i)
+		chat_message_delete(msgs[i]);
+	unit_check(chat_server_pop_many(s, msgs, 10) == 0,
+		   "server has nothing more");
+
+	chat_client_delete(c2);
+	chat_client_delete(c1);
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+
+#if NEED_BINARY_FRAMING
+static void
+test_binary(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+	struct chat_client *cb = chat_client_new("cb");
+	unit_check(chat_client_set_binary(cb) == 0, "set binary");
+	unit_fail_if(chat_client_connect(cb, make_addr_str(port)) != 0);
+	unit_check(chat_client_set_binary(cb) == CHAT_ERR_ALREADY_STARTED,
+		   "no mode switch after connect");
+	//
+	// A framed message reaches the server.
+	//
+	unit_check(chat_client_feed(cb, "bin msg\n", 8) == 0, "feed");
+	struct chat_message *msg = server_pop_next_blocking_from(s, cb);
+	unit_check(strcmp(msg->data, "bin msg") == 0, "msg data");
+	chat_message_delete(msg);
+	//
+	// A text and a binary client hear each other - each over the
+	// framing it negotiated.
+	//
+	struct chat_client *ct = chat_client_new("ct");
+	unit_fail_if(chat_client_connect(ct, make_addr_str(port)) != 0);
+	unit_check(chat_client_feed(ct, "from text\n", 10) == 0, "text feed");
+	msg = server_pop_next_blocking_from(s, ct);
+	chat_message_delete(msg);
+	msg = client_pop_next_blocking(cb, s);
+	unit_check(strcmp(msg->data, "from text") == 0, "binary got text msg");
+	chat_message_delete(msg);
+	unit_check(chat_client_feed(cb, "from binary\n", 12) == 0,
+		   "binary feed");
+	msg = server_pop_next_blocking_from(s, cb);
+	chat_message_delete(msg);
+	msg = client_pop_next_blocking(ct, s);
+	unit_check(strcmp(msg->data, "from binary") == 0,
+		   "text got binary msg");
+	chat_message_delete(msg);
+	//
+	// Big messages take the shared-blob path and have to keep the
+	// framing in both directions, across partial reads.
+	//
+	uint32_t len = 1024 * 1024;
+	struct test_msg *test_msg = test_msg_new(len);
+	unit_check(chat_client_feed(cb, test_msg->data, test_msg->size) == 0,
+		   "big binary feed");
+	msg = server_pop_next_blocking_from(s, cb);
+	test_msg_check_data(test_msg, msg->data);
+	chat_message_delete(msg);
+	msg = client_pop_next_blocking(ct, s);
+	test_msg_check_data(test_msg, msg->data);
+	chat_message_delete(msg);
+	unit_check(chat_client_feed(ct, test_msg->data, test_msg->size) == 0,
+		   "big text feed");
+	msg = server_pop_next_blocking_from(s, ct);
+	test_msg_check_data(test_msg, msg->data);
+	chat_message_delete(msg);
+	msg = client_pop_next_blocking(cb, s);
+	test_msg_check_data(test_msg, msg->data);
+	unit_check(strlen(msg->data) == test_msg->len, "binary got big msg");
+	chat_message_delete(msg);
+	test_msg_delete(test_msg);
+
+	unit_check(chat_client_pop_next(cb) == NULL, "binary has no msgs");
+	unit_check(chat_client_pop_next(ct) == NULL, "text has no msgs");
+	chat_client_delete(ct);
+	chat_client_delete(cb);
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+#endif
+
+#if NEED_COMPRESSION
+static void
+test_compressed(void)
+{
+	unit_test_start();
+	//
+	// The codec itself, on a compressible and an incompressible
+	// buffer.
+	//
+	uint32_t len = 8192;
+	char *buf = malloc(len);
+	char *comp = malloc(len);
+	char *plain = malloc(len);
+	for (uint32_t i = 0; i < len; ++i)
+		buf[i] = 'a' + i % ('z' - 'a' + 1);
+	uint32_t comp_size = chat_lz4_compress(buf, len, comp, len - 1);
+	unit_check(comp_size > 0 && comp_size < len / 2,
+		   "pattern shrinks well");
+	unit_check(chat_lz4_decompress(comp, comp_size, plain, len) == 0,
+		   "decompress ok");
+	unit_check(memcmp(buf, plain, len) == 0, "roundtrip is exact");
+	// Every 4-gram of a rolling counter is unique - no matches.
+	for (uint32_t i = 0; i < 256; ++i)
+		buf[i] = (char)i;
+	unit_check(chat_lz4_compress(buf, 256, comp, 255) == 0,
+		   "incompressible does not fit");
+	free(plain);
+	free(comp);
+	free(buf);
+	//
+	// A compressed and a text client hear each other; the small
+	// messages go as stored frames.
+	//
+	struct chat_server *s = chat_server_new();
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+	struct chat_client *cc = chat_client_new("cc");
+	unit_check(chat_client_set_compressed(cc) == 0, "set compressed");
+	unit_fail_if(chat_client_connect(cc, make_addr_str(port)) != 0);
+	unit_check(chat_client_set_compressed(cc) == CHAT_ERR_ALREADY_STARTED,
+		   "no mode switch after connect");
+	struct chat_client *ct = chat_client_new("ct");
+	unit_fail_if(chat_client_connect(ct, make_addr_str(port)) != 0);
+	unit_check(chat_client_feed(ct, "from text\n", 10) == 0, "text feed");
+	struct chat_message *msg = server_pop_next_blocking_from(s, ct);
+	chat_message_delete(msg);
+	msg = client_pop_next_blocking(cc, s);
+	unit_check(strcmp(msg->data, "from text") == 0,
+		   "compressed got text msg");
+	chat_message_delete(msg);
+	unit_check(chat_client_feed(cc, "from compressed\n", 16) == 0,
+		   "compressed feed");
+	msg = server_pop_next_blocking_from(s, cc);
+	chat_message_delete(msg);
+	msg = client_pop_next_blocking(ct, s);
+	unit_check(strcmp(msg->data, "from compressed") == 0,
+		   "text got compressed msg");
+	chat_message_delete(msg);
+	//
+	// A big message takes the shared-blob path - compressed once
+	// on the server and inflated back by the client.
+	//
+	struct test_msg *test_msg = test_msg_new(1024 * 1024);
+	unit_check(chat_client_feed(ct, test_msg->data, test_msg->size) == 0,
+		   "big text feed");
+	msg = server_pop_next_blocking_from(s, ct);
+	chat_message_delete(msg);
+	msg = client_pop_next_blocking(cc, s);
+	test_msg_check_data(test_msg, msg->data);
+	unit_check(strlen(msg->data) == test_msg->len,
+		   "compressed got big msg");
+	chat_message_delete(msg);
+	unit_check(chat_client_feed(cc, test_msg->data, test_msg->size) == 0,
+		   "big compressed feed");
+	msg = server_pop_next_blocking_from(s, cc);
+	test_msg_check_data(test_msg, msg->data);
+	chat_message_delete(msg);
+	msg = client_pop_next_blocking(ct, s);
+	test_msg_check_data(test_msg, msg->data);
+	chat_message_delete(msg);
+	test_msg_delete(test_msg);
+
+	unit_check(chat_client_pop_next(cc) == NULL,
+		   "compressed has no msgs");
+	unit_check(chat_client_pop_next(ct) == NULL, "text has no msgs");
+	chat_client_delete(ct);
+	chat_client_delete(cc);
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+#endif
+
+#if NEED_CLIENT_GROUP
+static void
+test_client_group(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+	struct chat_client_group *g = chat_client_group_new();
+	struct chat_client *c1 = chat_client_new("c1");
+	unit_check(chat_client_group_add(g, c1) == CHAT_ERR_NOT_STARTED,
+		   "no adding before connect");
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	struct chat_client *c2 = chat_client_new("c2");
+	unit_fail_if(chat_client_connect(c2, make_addr_str(port)) != 0);
+	struct chat_client *c3 = chat_client_new("c3");
+	unit_fail_if(chat_client_connect(c3, make_addr_str(port)) != 0);
+	unit_check(chat_client_group_add(g, c1) == 0, "add 3 clients");
+	unit_fail_if(chat_client_group_add(g, c2) != 0);
+	unit_fail_if(chat_client_group_add(g, c3) != 0);
+	struct chat_client *origin = NULL;
+	unit_check(chat_client_group_pop_next(g, &origin) == NULL,
+		   "nothing yet");
+	//
+	// One feed fans out to the other two members; the pops carry
+	// the origin.
+	//
+	unit_check(chat_client_feed(c1, "from c1\n", 8) == 0, "feed");
+	int got = 0;
+	bool got_c2 = false;
+	bool got_c3 = false;
+	while (got < 2) {
+		struct chat_message *msg =
+			chat_client_group_pop_next(g, &origin);
+		if (msg == NULL) {
+			chat_client_group_update(g, 0);
+			chat_server_update(s, 0);
+			continue;
+		}
+		unit_fail_if(strcmp(msg->data, "from c1") != 0);
+		unit_fail_if(!author_is_eq(msg, "c1"));
+		if (origin == c2)
+			got_c2 = true;
+		else if (origin == c3)
+			got_c3 = true;
+		chat_message_delete(msg);
+		++got;
+	}
+	unit_check(got_c2 && got_c3, "both members got it, tagged");
+	//
+	// A removed member is no longer updated by the group.
+	//
+	unit_check(chat_client_group_remove(g, c2) == 0, "remove c2");
+	unit_check(chat_client_group_remove(g, c2) ==
+		   CHAT_ERR_INVALID_ARGUMENT, "double remove fails");
+	unit_check(chat_client_feed(c3, "from c3\n", 8) == 0, "feed again");
+	got = 0;
+	while (got < 1) {
+		struct chat_message *msg =
+			chat_client_group_pop_next(g, &origin);
+		if (msg == NULL) {
+			chat_client_group_update(g, 0);
+			chat_server_update(s, 0);
+			continue;
+		}
+		unit_check(origin == c1, "only c1 is still grouped");
+		unit_check(strcmp(msg->data, "from c3") == 0, "msg data");
+		chat_message_delete(msg);
+		++got;
+	}
+	// c2 still gets it through its own updates.
+	struct chat_message *msg = client_pop_next_blocking(c2, s);
+	unit_check(strcmp(msg->data, "from c3") == 0, "removed c2 on its own");
+	chat_message_delete(msg);
+
+	chat_client_group_delete(g);
+	chat_client_delete(c3);
+	chat_client_delete(c2);
+	chat_client_delete(c1);
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+#endif
+
 static void
 test_multi_client(void)
 {
@@ -449,6 +775,417 @@ test_multi_client(void)
 	unit_test_finish();
 }
 
+#if NEED_SHARDED_SERVER
+static void
+test_sharded(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	unit_check(chat_server_listen_sharded(s, 0, 0) ==
+		   CHAT_ERR_INVALID_ARGUMENT, "bad shard count");
+	unit_check(chat_server_listen_sharded(s, 0, 3) == 0, "sharded listen");
+	unit_check(chat_server_listen_sharded(s, 0, 3) ==
+		   CHAT_ERR_ALREADY_STARTED, "can't listen twice");
+	uint16_t port = server_get_port(s);
+	unit_check(port > 0, "has port");
+
+	const int client_count = 8;
+	struct chat_client *clis[8];
+	for (int i = 0; i < client_count; ++i) {
+		char name[128];
+		sprintf(name, "cli_%d", i);
+		clis[i] = chat_client_new(name);
+		unit_fail_if(chat_client_connect(
+			clis[i], make_addr_str(port)) != 0);
+	}
+	char data[128];
+	for (int i = 0; i < client_count; ++i) {
+		int rc = sprintf(data, "message_%d\n", i);
+		unit_fail_if(chat_client_feed(clis[i], data, rc) != 0);
+		client_consume_events(clis[i]);
+	}
+	//
+	// The server sees every message. The shards work in parallel,
+	// so the order across clients is not defined.
+	//
+	bool seen[8] = {false};
+	for (int i = 0; i < client_count; ++i) {
+		struct chat_message *msg =
+			server_pop_next_blocking_from(s, clis[0]);
+		int id = -1;
+		unit_fail_if(sscanf(msg->data, "message_%d", &id) != 1);
+		unit_fail_if(id < 0 || id >= client_count || seen[id]);
+		seen[id] = true;
+		chat_message_delete(msg);
+	}
+	unit_msg("server got all messages");
+	//
+	// Every client sees every message of the others, also across
+	// the shards, but not its own one.
+	//
+	for (int i = 0; i < client_count; ++i) {
+		bool got[8] = {false};
+		for (int j = 0; j < client_count - 1; ++j) {
+			struct chat_message *msg =
+				client_pop_next_blocking(clis[i], s);
+			int id = -1;
+			unit_fail_if(sscanf(msg->data, "message_%d",
+					    &id) != 1);
+			unit_fail_if(id < 0 || id >= client_count ||
+				     id == i || got[id]);
+			got[id] = true;
+			chat_message_delete(msg);
+		}
+	}
+	unit_msg("clients got all foreign messages");
+
+	for (int i = 0; i < client_count; ++i)
+		chat_client_delete(clis[i]);
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+#endif
+
+#if NEED_OUTPUT_LIMIT
+struct test_wm_ctx {
+	int above_count;
+	int below_count;
+};
+
+static void
+test_wm_cb(struct chat_server *s, int peer_socket, bool is_above, void *arg)
+{
+	(void)s;
+	unit_fail_if(peer_socket < 0);
+	struct test_wm_ctx *ctx = arg;
+	if (is_above)
+		++ctx->above_count;
+	else
+		++ctx->below_count;
+}
+
+/**
+ * Pump the client and the server until both have nothing to do. One
+ * idle iteration is not enough to call it quiet - after a slow reader
+ * drains a multi-MB backlog the tail can still sit in the kernel's
+ * TCP buffers waiting for a window update, which takes the delayed-ACK
+ * and persist timers, i.e. hundreds of ms. Demand a sustained silence.
+ */
+static void
+pump_until_quiet(struct chat_server *s, struct chat_client *c)
+{
+	int quiet_count = 0;
+	while (quiet_count < 100) {
+		int rc1 = chat_client_update(c, 0);
+		int rc2 = chat_server_update(s, 0);
+		if (rc1 != CHAT_ERR_TIMEOUT || rc2 != CHAT_ERR_TIMEOUT) {
+			quiet_count = 0;
+			continue;
+		}
+		++quiet_count;
+		usleep(10000);
+	}
+}
+
+static void
+test_output_limit_feed(struct chat_client *c, int msg_count, uint32_t msg_len)
+{
+	char *data = malloc(msg_len + 1);
+	for (int i = 0; i < msg_count; ++i) {
+		memset(data, 'x', msg_len);
+		int rc = sprintf(data, "msg_%07d", i);
+		data[rc] = 'x';
+		data[msg_len] = '\n';
+		unit_fail_if(chat_client_feed(c, data, msg_len + 1) != 0);
+	}
+	free(data);
+}
+
+static void
+test_output_limit(void)
+{
+	unit_test_start();
+
+	const int msg_count = 8000;
+	const uint32_t msg_len = 1000;
+	//
+	// Bad configs.
+	//
+	struct chat_server *s = chat_server_new();
+	unit_check(chat_server_set_output_limit(
+		s, 0, 0, CHAT_OVERFLOW_DROP_OLDEST) ==
+		CHAT_ERR_INVALID_ARGUMENT, "zero high watermark");
+	unit_check(chat_server_set_output_limit(
+		s, 1024, 2048, CHAT_OVERFLOW_DROP_OLDEST) ==
+		CHAT_ERR_INVALID_ARGUMENT, "low above high");
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	unit_check(chat_server_set_output_limit(
+		s, 2048, 1024, CHAT_OVERFLOW_DROP_OLDEST) ==
+		CHAT_ERR_ALREADY_STARTED, "config after listen");
+	unit_check(chat_server_set_watermark_callback(s, NULL, NULL) ==
+		CHAT_ERR_ALREADY_STARTED, "callback after listen");
+	chat_server_delete(s);
+	//
+	// Drop-oldest - a slow reader loses old messages, but the
+	// stream stays framed and ordered, and the memory is bounded.
+	//
+	struct test_wm_ctx ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	s = chat_server_new();
+	unit_fail_if(chat_server_set_output_limit(
+		s, 256 * 1024, 64 * 1024, CHAT_OVERFLOW_DROP_OLDEST) != 0);
+	unit_fail_if(chat_server_set_watermark_callback(
+		s, test_wm_cb, &ctx) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+	struct chat_client *c1 = chat_client_new("c1");
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	struct chat_client *c2 = chat_client_new("c2");
+	unit_fail_if(chat_client_connect(c2, make_addr_str(port)) != 0);
+	// Let the server see both clients before the flood.
+	server_consume_events(s);
+	test_output_limit_feed(c1, msg_count, msg_len);
+	// c2 does not read anything during the flood.
+	pump_until_quiet(s, c1);
+	unit_check(ctx.above_count > 0, "went above the high watermark");
+	unit_check(ctx.below_count > 0, "dropped below the low watermark");
+	// The server still holds the tail of the queue - keep it
+	// flushing while c2 finally reads.
+	pump_until_quiet(s, c2);
+	int received = 0;
+	int prev_id = -1;
+	struct chat_message *msg;
+	while ((msg = chat_client_pop_next(c2)) != NULL) {
+		int id = -1;
+		unit_fail_if(sscanf(msg->data, "msg_%07d", &id) != 1);
+		unit_fail_if(id <= prev_id || id >= msg_count);
+		prev_id = id;
+		++received;
+		chat_message_delete(msg);
+	}
+	unit_check(received > 0 && received < msg_count,
+		   "the oldest messages got dropped");
+	unit_check(prev_id == msg_count - 1, "the newest ones survived");
+	chat_client_delete(c2);
+	chat_client_delete(c1);
+	chat_server_delete(s);
+	//
+	// Disconnect - the slow reader is simply kicked out.
+	//
+	memset(&ctx, 0, sizeof(ctx));
+	s = chat_server_new();
+	unit_fail_if(chat_server_set_output_limit(
+		s, 256 * 1024, 64 * 1024, CHAT_OVERFLOW_DISCONNECT) != 0);
+	unit_fail_if(chat_server_set_watermark_callback(
+		s, test_wm_cb, &ctx) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	port = server_get_port(s);
+	c1 = chat_client_new("c1");
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	c2 = chat_client_new("c2");
+	unit_fail_if(chat_client_connect(c2, make_addr_str(port)) != 0);
+	server_consume_events(s);
+	test_output_limit_feed(c1, msg_count, msg_len);
+	pump_until_quiet(s, c1);
+	unit_check(ctx.above_count > 0, "watermark crossed before the kick");
+	while (chat_client_get_descriptor(c2) >= 0)
+		chat_client_update(c2, 0);
+	unit_msg("the slow client got disconnected");
+	while ((msg = chat_client_pop_next(c2)) != NULL)
+		chat_message_delete(msg);
+	chat_client_delete(c2);
+	chat_client_delete(c1);
+	chat_server_delete(s);
+	//
+	// Pause-intake - nothing is lost, the sender is slowed down
+	// while the reader catches up.
+	//
+	memset(&ctx, 0, sizeof(ctx));
+	s = chat_server_new();
+	unit_fail_if(chat_server_set_output_limit(
+		s, 128 * 1024, 32 * 1024, CHAT_OVERFLOW_PAUSE_INTAKE) != 0);
+	unit_fail_if(chat_server_set_watermark_callback(
+		s, test_wm_cb, &ctx) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	port = server_get_port(s);
+	c1 = chat_client_new("c1");
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	c2 = chat_client_new("c2");
+	unit_fail_if(chat_client_connect(c2, make_addr_str(port)) != 0);
+	server_consume_events(s);
+	test_output_limit_feed(c1, msg_count, msg_len);
+	received = 0;
+	prev_id = -1;
+	while (received < msg_count) {
+		chat_client_update(c1, 0);
+		chat_server_update(s, 0);
+		chat_client_update(c2, 0);
+		while ((msg = chat_client_pop_next(c2)) != NULL) {
+			int id = -1;
+			unit_fail_if(sscanf(msg->data, "msg_%07d", &id) != 1);
+			unit_fail_if(id != prev_id + 1);
+			prev_id = id;
+			++received;
+			chat_message_delete(msg);
+		}
+	}
+	unit_check(received == msg_count, "nothing was lost");
+	unit_check(ctx.above_count == ctx.below_count,
+		   "every pause was followed by a resume");
+	chat_client_delete(c2);
+	chat_client_delete(c1);
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+#endif
+
+static void
+test_rate_limit(void)
+{
+#if NEED_RATE_LIMIT
+	unit_test_start();
+
+	const int msg_count = 64;
+	const uint32_t msg_len = 1000;
+	struct chat_server *s = chat_server_new();
+	unit_check(chat_server_set_rate_limit(s, 1024, 0) ==
+		   CHAT_ERR_INVALID_ARGUMENT, "a rate needs a burst");
+	unit_fail_if(chat_server_set_rate_limit(
+		s, 256 * 1024, 16 * 1024) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	unit_check(chat_server_set_rate_limit(s, 1024, 1024) ==
+		   CHAT_ERR_ALREADY_STARTED, "config after listen");
+	uint16_t port = server_get_port(s);
+	struct chat_client *c1 = chat_client_new("c1");
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	server_consume_events(s);
+	// A ~64KB burst against a 16KB bucket - the tail has to wait
+	// for the refill ticks while TCP holds it back.
+	char *data = malloc(msg_len + 1);
+	for (int i = 0; i < msg_count; ++i) {
+		memset(data, 'x', msg_len);
+		int rc = sprintf(data, "msg_%07d", i);
+		data[rc] = 'x';
+		data[msg_len] = '\n';
+		unit_fail_if(chat_client_feed(c1, data, msg_len + 1) != 0);
+	}
+	free(data);
+	uint64_t start_ns = unit_bench_time_ns();
+	int received = 0;
+	int prev_id = -1;
+	int first_pass = -1;
+	while (received < msg_count) {
+		chat_client_update(c1, 0);
+		int rc = chat_server_update(s, 0.02);
+		unit_fail_if(rc != 0 && rc != CHAT_ERR_TIMEOUT);
+		struct chat_message *msg;
+		while ((msg = chat_server_pop_next(s)) != NULL) {
+			int id = -1;
+			unit_fail_if(sscanf(msg->data, "msg_%07d", &id) != 1);
+			unit_fail_if(id != prev_id + 1);
+			prev_id = id;
+			++received;
+			chat_message_delete(msg);
+		}
+		if (first_pass < 0 && received > 0)
+			first_pass = received;
+	}
+	uint64_t spent_ms = (unit_bench_time_ns() - start_ns) / 1000000;
+	unit_check(received == msg_count && prev_id == msg_count - 1,
+		   "the whole burst arrived in order");
+	unit_check(first_pass < msg_count,
+		   "the first bucket did not cover the burst");
+	// 48KB past the initial bucket had to wait for tokens - at
+	// 256KB/s that is 187ms even with a perfectly timed refill.
+	unit_check(spent_ms >= 100, "the intake was metered");
+	chat_client_delete(c1);
+	chat_server_delete(s);
+
+	unit_test_finish();
+#endif
+}
+
+static void
+test_capture(void)
+{
+#if NEED_CAPTURE
+	unit_test_start();
+
+	char path[] = "/tmp/chat_capture_XXXXXX";
+	int tmp_fd = mkstemp(path);
+	unit_fail_if(tmp_fd < 0);
+	close(tmp_fd);
+
+	struct chat_server *s = chat_server_new();
+	unit_fail_if(chat_server_set_capture(s, path) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	unit_check(chat_server_set_capture(s, path) ==
+		   CHAT_ERR_ALREADY_STARTED, "config after listen");
+	uint16_t port = server_get_port(s);
+	struct chat_client *c1 = chat_client_new("c1");
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	struct chat_client *c2 = chat_client_new("c2");
+	unit_fail_if(chat_client_connect(c2, make_addr_str(port)) != 0);
+	unit_fail_if(chat_client_feed(c1, "hello\n", 6) != 0);
+	unit_fail_if(chat_client_feed(c2, "world\n", 6) != 0);
+	client_consume_events(c1);
+	client_consume_events(c2);
+	server_consume_events(s);
+	int got = 0;
+	struct chat_message *msg;
+	while ((msg = chat_server_pop_next(s)) != NULL) {
+		++got;
+		chat_message_delete(msg);
+	}
+	unit_check(got == 2, "both messages landed");
+	chat_client_delete(c1);
+	chat_client_delete(c2);
+	/* The delete drops the peers and flushes the log. */
+	chat_server_delete(s);
+
+	FILE *log = fopen(path, "rb");
+	unit_fail_if(log == NULL);
+	uint32_t magic = 0;
+	unit_fail_if(fread(&magic, sizeof(magic), 1, log) != 1);
+	unit_check(magic == CHAT_CAPTURE_MAGIC, "the magic is there");
+	int connects = 0;
+	int disconnects = 0;
+	uint64_t data_bytes = 0;
+	uint64_t prev_us = 0;
+	bool in_order = true;
+	char payload[64];
+	struct chat_capture_rec rec;
+	while (fread(&rec, sizeof(rec), 1, log) == 1) {
+		in_order = in_order && rec.time_us >= prev_us &&
+			rec.peer >= 1 && rec.peer <= 2;
+		prev_us = rec.time_us;
+		if (rec.type == CHAT_CAPTURE_CONNECT)
+			++connects;
+		else if (rec.type == CHAT_CAPTURE_DISCONNECT)
+			++disconnects;
+		else if (rec.type == CHAT_CAPTURE_DATA)
+			data_bytes += rec.size;
+		if (rec.size > 0) {
+			unit_fail_if(rec.size > sizeof(payload));
+			unit_fail_if(fread(payload, 1, rec.size, log) !=
+				     rec.size);
+		}
+	}
+	fclose(log);
+	unit_check(connects == 2 && disconnects == 2,
+		   "the population is recorded");
+	// The author lines plus one message from each client.
+	unit_check(data_bytes == 18, "every inbound byte is recorded");
+	unit_check(in_order, "the timeline is monotonic");
+	unlink(path);
+
+	unit_test_finish();
+#endif
+}
+
 struct test_stress_ctx {
 	int msg_count;
 	uint32_t msg_len;
@@ -599,6 +1336,427 @@ test_big_author(void)
 #endif
 }
 
+static void
+test_handoff(void)
+{
+#if NEED_SERVER_HANDOFF
+	unit_test_start();
+
+	struct chat_server *s1 = chat_server_new();
+	unit_fail_if(chat_server_listen(s1, 0) != 0);
+	uint16_t port = server_get_port(s1);
+
+	struct chat_client *c1 = chat_client_new("c1");
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	struct chat_client *c2 = chat_client_new("c2");
+	unit_fail_if(chat_client_connect(c2, make_addr_str(port)) != 0);
+
+	/* Settle the authors and one full exchange before the switch. */
+	unit_fail_if(chat_client_feed(c1, "before\n", 7) != 0);
+	client_consume_events(c1);
+	struct chat_message *msg = server_pop_next_blocking_from(s1, c1);
+	unit_check(strcmp(msg->data, "before") == 0, "msg before handoff");
+	chat_message_delete(msg);
+	msg = client_pop_next_blocking(c2, s1);
+	unit_check(strcmp(msg->data, "before") == 0, "c2 got it");
+	unit_check(author_is_eq(msg, "c1"), "c1 is author");
+	chat_message_delete(msg);
+
+	/* A message half-received by the old server. */
+	unit_fail_if(chat_client_feed(c1, "par", 3) != 0);
+	client_consume_events(c1);
+	server_consume_events(s1);
+	unit_check(chat_server_pop_next(s1) == NULL, "no full msg yet");
+
+	int fds[2];
+	unit_fail_if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0);
+	struct chat_server *s2 = chat_server_new();
+	unit_check(chat_server_handoff_send(s2, fds[0]) ==
+		   CHAT_ERR_NOT_STARTED, "can not send a not started one");
+	unit_check(chat_server_handoff_send(s1, fds[0]) == 0, "handoff sent");
+	unit_check(chat_server_handoff_recv(s1, fds[1]) ==
+		   CHAT_ERR_ALREADY_STARTED, "can not recv into a started one");
+	unit_check(chat_server_handoff_recv(s2, fds[1]) == 0,
+		   "handoff received");
+	close(fds[0]);
+	close(fds[1]);
+	chat_server_delete(s1);
+	unit_check(server_get_port(s2) == port, "same port");
+
+	/* The half message completes on the new server - the clients
+	 * never noticed the swap. */
+	unit_fail_if(chat_client_feed(c1, "tial\n", 5) != 0);
+	client_consume_events(c1);
+	msg = server_pop_next_blocking_from(s2, c1);
+	unit_check(strcmp(msg->data, "partial") == 0, "msg over the handoff");
+	unit_check(author_is_eq(msg, "c1"), "author survived");
+	chat_message_delete(msg);
+	msg = client_pop_next_blocking(c2, s2);
+	unit_check(strcmp(msg->data, "partial") == 0, "c2 got it");
+	unit_check(author_is_eq(msg, "c1"), "c1 still author");
+	chat_message_delete(msg);
+
+	/* And the other direction. */
+	unit_fail_if(chat_client_feed(c2, "back\n", 5) != 0);
+	client_consume_events(c2);
+	msg = server_pop_next_blocking_from(s2, c2);
+	unit_check(strcmp(msg->data, "back") == 0, "msg from c2");
+	unit_check(author_is_eq(msg, "c2"), "c2 is author");
+	chat_message_delete(msg);
+	msg = client_pop_next_blocking(c1, s2);
+	unit_check(strcmp(msg->data, "back") == 0, "c1 got it");
+	chat_message_delete(msg);
+
+	chat_client_delete(c1);
+	chat_client_delete(c2);
+	chat_server_delete(s2);
+	/* A handoff-received shard once left its datagram socket as 0
+	 * instead of -1 and its teardown closed stdin. */
+	unit_check(fcntl(0, F_GETFD) >= 0, "stdin survived the teardown");
+
+	unit_test_finish();
+#endif
+}
+
+static void
+test_history(void)
+{
+#if NEED_HISTORY
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	unit_check(chat_server_set_history(s, -1) ==
+		   CHAT_ERR_INVALID_ARGUMENT, "negative count");
+	unit_check(chat_server_set_history(s, 3) == 0, "keep 3 messages");
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	unit_check(chat_server_set_history(s, 5) ==
+		   CHAT_ERR_ALREADY_STARTED, "too late to config");
+	uint16_t port = server_get_port(s);
+
+	/* A joiner before any messages gets nothing replayed. */
+	struct chat_client *c1 = chat_client_new("c1");
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	client_consume_events(c1);
+	server_consume_events(s);
+	unit_check(chat_client_pop_next(c1) == NULL, "empty history");
+
+	struct chat_client *c2 = chat_client_new("c2");
+	unit_fail_if(chat_client_connect(c2, make_addr_str(port)) != 0);
+	const char *msgs = "msg1\nmsg2\nmsg3\nmsg4\nmsg5\n";
+	unit_fail_if(chat_client_feed(c2, msgs, strlen(msgs)) != 0);
+	client_consume_events(c2);
+	struct chat_message *msg;
+	for (int i = 0; i < 5; ++i) {
+		msg = server_pop_next_blocking_from(s, c2);
+		chat_message_delete(msg);
+	}
+	/* c1 was connected the whole time - it gets all 5 live. */
+	char check[16];
+	for (int i = 1; i <= 5; ++i) {
+		msg = client_pop_next_blocking(c1, s);
+		sprintf(check, "msg%d", i);
+		unit_fail_if(strcmp(msg->data, check) != 0);
+		chat_message_delete(msg);
+	}
+	/*
+	 * A late joiner gets the last 3 replayed, oldest first, and
+	 * then the live traffic - no duplicates, no stale tail.
+	 */
+	struct chat_client *c3 = chat_client_new("c3");
+	unit_fail_if(chat_client_connect(c3, make_addr_str(port)) != 0);
+	client_consume_events(c3);
+	server_consume_events(s);
+	unit_fail_if(chat_client_feed(c2, "msg6\n", 5) != 0);
+	client_consume_events(c2);
+	msg = server_pop_next_blocking_from(s, c2);
+	chat_message_delete(msg);
+	for (int i = 3; i <= 6; ++i) {
+		msg = client_pop_next_blocking(c3, s);
+		sprintf(check, "msg%d", i);
+		unit_check(strcmp(msg->data, check) == 0, check);
+		unit_check(author_is_eq(msg, "c2"), "author replayed");
+		chat_message_delete(msg);
+	}
+	unit_check(chat_client_update(c3, 0) == CHAT_ERR_TIMEOUT,
+		   "nothing extra for c3");
+
+	chat_client_delete(c1);
+	chat_client_delete(c2);
+	chat_client_delete(c3);
+	chat_server_delete(s);
+
+	unit_test_finish();
+#endif
+}
+
+static void
+test_datagram(void)
+{
+#if NEED_DATAGRAM
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	unit_check(chat_server_set_datagram(s, true) == 0, "enable datagrams");
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	unit_check(chat_server_set_datagram(s, true) ==
+		   CHAT_ERR_ALREADY_STARTED, "too late to config");
+	uint16_t port = server_get_port(s);
+
+	int udp = socket(AF_INET, SOCK_DGRAM, 0);
+	unit_fail_if(udp < 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	unit_fail_if(connect(udp, (struct sockaddr *)&addr,
+			     sizeof(addr)) != 0);
+	/* An anonymous datagram, trimmed like a stream message. */
+	const char *data = "  temp=36.6  ";
+	unit_fail_if(send(udp, data, strlen(data), 0) < 0);
+	struct chat_message *msg;
+	while ((msg = chat_server_pop_next(s)) == NULL)
+		chat_server_update(s, 0);
+	unit_check(strcmp(msg->data, "temp=36.6") == 0, "datagram data");
+#if NEED_AUTHOR
+	unit_check(msg->author == NULL, "anonymous");
+#endif
+	chat_message_delete(msg);
+	/* A 'name \0 body' datagram attributes the message. */
+	const char named[] = "sensor-1\0rpm=900";
+	unit_fail_if(send(udp, named, sizeof(named) - 1, 0) < 0);
+	while ((msg = chat_server_pop_next(s)) == NULL)
+		chat_server_update(s, 0);
+	unit_check(strcmp(msg->data, "rpm=900") == 0, "named data");
+	unit_check(author_is_eq(msg, "sensor-1"), "datagram author");
+	chat_message_delete(msg);
+	/* The telemetry is not broadcast to the stream clients. */
+	struct chat_client *c1 = chat_client_new("c1");
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	client_consume_events(c1);
+	server_consume_events(s);
+	unit_fail_if(send(udp, data, strlen(data), 0) < 0);
+	while ((msg = chat_server_pop_next(s)) == NULL)
+		chat_server_update(s, 0);
+	chat_message_delete(msg);
+	unit_check(chat_client_update(c1, 0) == CHAT_ERR_TIMEOUT,
+		   "no telemetry for streams");
+	unit_check(chat_client_pop_next(c1) == NULL, "c1 empty");
+
+	close(udp);
+	chat_client_delete(c1);
+	chat_server_delete(s);
+
+	unit_test_finish();
+#endif
+}
+
+/*
+ * The arena behind the offload result pool. Exercised here on
+ * whatever box the suite runs on - most of them single-node, which
+ * is exactly the degradation path: everything must collapse into
+ * one plain freelist and behave like an ordinary block pool.
+ */
+static void
+test_numa_arena(void)
+{
+#if NEED_OFFLOAD
+	unit_test_start();
+
+	struct numa_arena arena;
+	unit_check(numa_arena_create(&arena, 0) != 0, "zero block size");
+	unit_fail_if(numa_arena_create(&arena, 48) != 0);
+	unit_check(arena.node_count >= 1, "at least one node");
+
+	void *first = numa_arena_alloc_on(&arena, 0);
+	unit_check(first != NULL, "alloc");
+	memset(first, '#', 48);
+	void *second = numa_arena_alloc_on(&arena, 0);
+	unit_check(second != NULL && second != first, "second block");
+	numa_arena_free(&arena, first);
+	numa_arena_free(&arena, second);
+	unit_check(numa_arena_alloc_on(&arena, 0) == second &&
+		   numa_arena_alloc_on(&arena, 0) == first,
+		   "freed blocks are recycled");
+
+	unit_check(numa_arena_alloc_on(&arena, arena.node_count) == NULL,
+		   "node out of range");
+	unit_check(numa_arena_alloc_on(&arena, -1) == NULL, "negative node");
+	void *on_node = numa_arena_alloc_on(&arena, 0);
+	unit_check(on_node != NULL, "explicit node alloc");
+	numa_arena_free(&arena, on_node);
+
+	/* Outlive one refill chunk - the arena has to map more. */
+	enum { BLOCK_COUNT = 200 };
+	void *blocks[BLOCK_COUNT];
+	for (int i = 0; i < BLOCK_COUNT; ++i) {
+		blocks[i] = numa_arena_alloc(&arena);
+		unit_fail_if(blocks[i] == NULL);
+		memset(blocks[i], i & 0xff, 48);
+	}
+	for (int i = 0; i < BLOCK_COUNT; ++i)
+		numa_arena_free(&arena, blocks[i]);
+	unit_check(true, "grows past one chunk");
+	numa_arena_destroy(&arena);
+
+	unit_test_finish();
+#endif
+}
+
+static void
+test_offload(void)
+{
+#if NEED_OFFLOAD
+	unit_test_start();
+
+	struct thread_pool *pool;
+	unit_fail_if(thread_pool_new(4, &pool) != 0);
+	struct chat_server *s = chat_server_new();
+	unit_check(chat_server_set_offload(s, pool) == 0, "offload set");
+#if NEED_SHARDED_SERVER
+	unit_check(chat_server_listen_sharded(s, 0, 2) ==
+		   CHAT_ERR_INVALID_ARGUMENT, "no offload when sharded");
+#endif
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	unit_check(chat_server_set_offload(s, NULL) ==
+		   CHAT_ERR_ALREADY_STARTED, "too late to change");
+	uint16_t port = server_get_port(s);
+
+	struct chat_client *c1 = chat_client_new("c1");
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	struct chat_client *c2 = chat_client_new("c2");
+	unit_fail_if(chat_client_connect(c2, make_addr_str(port)) != 0);
+
+	/* A burst parsed on the workers comes out in the sent order. */
+	const int count = 100;
+	struct test_msg *msg_out = test_msg_new(1024);
+	for (int i = 0; i < count; ++i) {
+		test_msg_set_id(msg_out, 1, i);
+		unit_fail_if(chat_client_feed(c1, msg_out->data,
+					      msg_out->size) != 0);
+	}
+	client_consume_events(c1);
+	for (int i = 0; i < count; ++i) {
+		struct chat_message *msg =
+			server_pop_next_blocking_from(s, c1);
+		int cli_id = -1;
+		int msg_id = -1;
+		chat_message_extract_id(msg, &cli_id, &msg_id);
+		unit_fail_if(cli_id != 1 || msg_id != i);
+		unit_fail_if(!author_is_eq(msg, "c1"));
+		chat_message_delete(msg);
+	}
+	unit_check(true, "burst popped in order");
+	for (int i = 0; i < count; ++i) {
+		struct chat_message *msg = client_pop_next_blocking(c2, s);
+		int cli_id = -1;
+		int msg_id = -1;
+		chat_message_extract_id(msg, &cli_id, &msg_id);
+		unit_fail_if(cli_id != 1 || msg_id != i);
+		unit_fail_if(!author_is_eq(msg, "c1"));
+		chat_message_delete(msg);
+	}
+	unit_check(true, "burst broadcast in order");
+
+	/* A partial message survives the buffer steal. */
+	unit_fail_if(chat_client_feed(c1, "par", 3) != 0);
+	client_consume_events(c1);
+	server_consume_events(s);
+	unit_check(chat_server_pop_next(s) == NULL, "no full msg yet");
+	unit_fail_if(chat_client_feed(c1, "tial\n", 5) != 0);
+	client_consume_events(c1);
+	struct chat_message *msg = server_pop_next_blocking_from(s, c1);
+	unit_check(strcmp(msg->data, "partial") == 0, "partial completed");
+	chat_message_delete(msg);
+	msg = client_pop_next_blocking(c2, s);
+	unit_check(strcmp(msg->data, "partial") == 0, "and broadcast");
+	chat_message_delete(msg);
+
+	/* And the other direction. */
+	unit_fail_if(chat_client_feed(c2, "back\n", 5) != 0);
+	client_consume_events(c2);
+	msg = server_pop_next_blocking_from(s, c2);
+	unit_check(strcmp(msg->data, "back") == 0, "msg from c2");
+	unit_check(author_is_eq(msg, "c2"), "c2 is author");
+	chat_message_delete(msg);
+	msg = client_pop_next_blocking(c1, s);
+	unit_check(strcmp(msg->data, "back") == 0, "c1 got it");
+	chat_message_delete(msg);
+
+	test_msg_delete(msg_out);
+	chat_client_delete(c1);
+	chat_client_delete(c2);
+	chat_server_delete(s);
+	unit_fail_if(thread_pool_delete(pool) != 0);
+
+	unit_test_finish();
+#endif
+}
+
+static void
+test_output_spill(void)
+{
+#if NEED_OUTPUT_SPILL
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+	struct chat_client *c1 = chat_client_new("c1");
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	/* Let the server accept the peer, then stall it. */
+	unit_fail_if(chat_server_update(s, 0) != 0);
+
+	/*
+	 * Feed far past the in-memory bound while the server doesn't
+	 * read a byte - the kernel buffers clog and the overflow has
+	 * to ride the spill file.
+	 */
+	uint32_t len = 128 * 1024;
+	struct test_msg *msg_out = test_msg_new(len);
+	int count = 64;
+	for (int i = 0; i < count; ++i) {
+		test_msg_set_id(msg_out, 1, i);
+		unit_fail_if(chat_client_feed(c1, msg_out->data,
+					      msg_out->size) != 0);
+		int rc = chat_client_update(c1, 0);
+		unit_fail_if(rc != 0 && rc != CHAT_ERR_TIMEOUT);
+	}
+
+	/* Wake the server back up and drain everything. */
+	int got = 0;
+	bool in_order = true;
+	while (true) {
+		int rc1 = chat_client_update(c1, 0);
+		unit_fail_if(rc1 != 0 && rc1 != CHAT_ERR_TIMEOUT);
+		int rc2 = chat_server_update(s, 0);
+		unit_fail_if(rc2 != 0 && rc2 != CHAT_ERR_TIMEOUT);
+		struct chat_message *msg;
+		while ((msg = chat_server_pop_next(s)) != NULL) {
+			int cli_id = -1;
+			int msg_id = -1;
+			chat_message_extract_id(msg, &cli_id, &msg_id);
+			in_order = in_order && cli_id == 1 && msg_id == got;
+			unit_fail_if(!author_is_eq(msg, "c1"));
+			++got;
+			chat_message_delete(msg);
+		}
+		if (got == count && rc1 == CHAT_ERR_TIMEOUT &&
+		    rc2 == CHAT_ERR_TIMEOUT)
+			break;
+	}
+	unit_check(got == count, "server got all spilled msgs");
+	unit_check(in_order, "the spilled stream kept its order");
+	unit_check(chat_client_pop_next(c1) == NULL, "client has no msgs");
+
+	test_msg_delete(msg_out);
+	chat_client_delete(c1);
+	chat_server_delete(s);
+
+	unit_test_finish();
+#endif
+}
+
 static void
 test_server_feed(void)
 {
@@ -677,6 +1835,62 @@ test_server_feed(void)
 #endif
 }
 
+static void
+test_server_stats(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	struct chat_server_stats stats;
+	chat_server_stats_get(s, &stats);
+	unit_check(stats.peer_count == 0 && stats.msg_in_count == 0 &&
+		   stats.byte_in_count == 0, "all zero before listen");
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+
+	struct chat_client *c1 = chat_client_new("c1");
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	unit_fail_if(chat_client_feed(c1, "hello\n", 6) != 0);
+	client_consume_events(c1);
+	server_consume_events(s);
+	struct chat_message *msg = chat_server_pop_next(s);
+	unit_fail_if(msg == NULL);
+	chat_message_delete(msg);
+
+	chat_server_stats_get(s, &stats);
+	unit_check(stats.peer_count == 1, "one peer");
+	unit_check(stats.msg_in_count == 1, "one message in");
+	unit_check(stats.byte_in_count > 0, "input bytes counted");
+	unit_check(stats.wakeup_count > 0, "wakeups counted");
+	uint64_t wakeups = stats.wakeup_count;
+
+	struct chat_client *c2 = chat_client_new("c2");
+	unit_fail_if(chat_client_connect(c2, make_addr_str(port)) != 0);
+	unit_fail_if(chat_client_feed(c2, "reply\n", 6) != 0);
+	client_consume_events(c2);
+	server_consume_events(s);
+	msg = client_pop_next_blocking(c1, s);
+	unit_fail_if(msg == NULL);
+	chat_message_delete(msg);
+
+	chat_server_stats_get(s, &stats);
+	unit_check(stats.peer_count == 2, "two peers");
+	unit_check(stats.msg_in_count == 2, "two messages in");
+	unit_check(stats.msg_out_count >= 1, "broadcast counted out");
+	unit_check(stats.byte_out_count > 0, "output bytes counted");
+	unit_check(stats.out_bytes_max > 0, "queue depth high-water");
+	unit_check(stats.wakeup_count > wakeups, "wakeups keep counting");
+
+	chat_client_delete(c1);
+	chat_client_delete(c2);
+	server_consume_events(s);
+	chat_server_stats_get(s, &stats);
+	unit_check(stats.peer_count == 0, "peers gone");
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+
 int
 main(int argc, char **argv)
 {
@@ -696,10 +1910,37 @@ main(int argc, char **argv)
 	test_basic();
 	test_big_messages();
 	test_multi_feed();
+	test_pop_many();
+#if NEED_BINARY_FRAMING
+	test_binary();
+#endif
+#if NEED_COMPRESSION
+	test_compressed();
+#endif
+#if NEED_CLIENT_GROUP
+	test_client_group();
+#endif
+#if NEED_SHARDED_SERVER
+	test_sharded();
+#endif
+#if NEED_OUTPUT_LIMIT
+	test_output_limit();
+#endif
+	test_rate_limit();
+	test_capture();
+	test_handoff();
+	test_history();
+	test_datagram();
+	test_numa_arena();
+#if NEED_OFFLOAD
+	test_offload();
+#endif
+	test_output_spill();
 	test_multi_client();
 	test_stress();
 	test_big_author();
 	test_server_feed();
+	test_server_stats();
 
 	unit_test_finish();
 	return 0;
@@ -0,0 +1,386 @@
+//
+// Load generator for the chat servers. Drives N concurrent clients over raw
+// non-blocking sockets and reports what the correctness tests cannot:
+// latency percentiles, throughput, and syscalls per message.
+//
+// It speaks both wire dialects, so the same binary runs against either
+// server:
+//
+// - 'plain' - the '\n'-separated text protocol of the 5/ server;
+// - 'framed' - the length-prefixed protocol of this directory (chat_proto.h).
+//
+// Every message carries the sender's send timestamp; a receiver subtracts it
+// from its own clock to get one end-to-end latency sample. Everything runs in
+// one process, so the clock is shared and the samples are exact.
+//
+// Usage:
+//   ./bench host:port [-p plain|framed] [-c clients] [-m messages]
+//           [-s size] [-r rate]
+//
+// -c - concurrent clients (default 10);
+// -m - messages each client sends (default 1000);
+// -s - message size in bytes (default 128);
+// -r - messages per second per client, 0 = unthrottled (default 0).
+//
+
+#include "chat_proto.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+enum bench_proto
+{
+	BENCH_PROTO_PLAIN,
+	BENCH_PROTO_FRAMED,
+};
+
+struct bench_opts
+{
+	std::string host;
+	std::string port;
+	bench_proto proto = BENCH_PROTO_PLAIN;
+	uint32_t client_count = 10;
+	uint32_t msg_count = 1000;
+	uint32_t msg_size = 128;
+	uint32_t rate = 0;
+};
+
+// The syscalls issued by the generator itself, to report per delivered
+// message. Server-side counts need perf/strace on the server process.
+static uint64_t bench_syscall_count = 0;
+
+struct bench_client
+{
+	int fd = -1;
+	uint32_t id = 0;
+	// How many messages this client has sent and still has to send.
+	uint32_t sent = 0;
+	// How many it received from the others.
+	uint64_t received = 0;
+	uint64_t next_send_ns = 0;
+	std::string in_buf;
+	size_t in_size = 0;
+	std::string out_buf;
+	size_t out_pos = 0;
+};
+
+static uint64_t
+time_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+bench_msg_make(
+	std::string& body,
+	uint32_t size)
+{
+	// "<send_time_ns> padding". The timestamp is patched right before the
+	// send; here only the layout is built.
+	body.assign("00000000000000000000 ");
+	if (body.length() < size)
+		body.append(size - body.length(), 'x');
+}
+
+static void
+bench_msg_stamp(
+	char* body)
+{
+	int rc = snprintf(body, 21, "%020llu", (unsigned long long)time_ns());
+	assert(rc == 20);
+	(void)rc;
+	// snprintf() terminates - restore the padding byte.
+	body[20] = ' ';
+}
+
+static bool
+bench_msg_parse_ns(
+	std::string_view body,
+	uint64_t* ns)
+{
+	if (body.length() < 20)
+		return false;
+	char buf[21];
+	memcpy(buf, body.data(), 20);
+	buf[20] = 0;
+	char* end = NULL;
+	*ns = strtoull(buf, &end, 10);
+	return end == buf + 20;
+}
+
+static int
+bench_connect(
+	const bench_opts& opts,
+	bench_client& cli)
+{
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	struct addrinfo* addr = NULL;
+	if (getaddrinfo(opts.host.c_str(), opts.port.c_str(), &hints, &addr) != 0)
+		return -1;
+	cli.fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (cli.fd < 0 or connect(cli.fd, addr->ai_addr, addr->ai_addrlen) != 0) {
+		freeaddrinfo(addr);
+		return -1;
+	}
+	freeaddrinfo(addr);
+	int one = 1;
+	setsockopt(cli.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	fcntl(cli.fd, F_SETFL, O_NONBLOCK);
+	if (opts.proto == BENCH_PROTO_FRAMED) {
+		// The framed protocol starts with a name handshake.
+		std::string name = "bench_" + std::to_string(cli.id);
+		chat_proto_append_u32(cli.out_buf, name.length());
+		cli.out_buf.append(name);
+	}
+	return 0;
+}
+
+// Append one stamped message to the client's output buffer.
+static void
+bench_push_msg(
+	const bench_opts& opts,
+	bench_client& cli,
+	std::string& body)
+{
+	bench_msg_stamp(body.data());
+	if (opts.proto == BENCH_PROTO_FRAMED) {
+		chat_proto_append_u32(cli.out_buf, body.length());
+		cli.out_buf.append(body);
+	} else {
+		cli.out_buf.append(body);
+		cli.out_buf.append(1, '\n');
+	}
+	++cli.sent;
+}
+
+static void
+bench_record_latency(
+	std::vector<uint64_t>& latencies,
+	std::string_view body)
+{
+	uint64_t sent_ns;
+	if (bench_msg_parse_ns(body, &sent_ns))
+		latencies.push_back(time_ns() - sent_ns);
+}
+
+// Extract the complete messages from the input buffer and turn each into a
+// latency sample.
+static void
+bench_consume(
+	const bench_opts& opts,
+	bench_client& cli,
+	std::vector<uint64_t>& latencies)
+{
+	std::string_view buf(cli.in_buf.data(), cli.in_size);
+	size_t pos = 0;
+	if (opts.proto == BENCH_PROTO_FRAMED) {
+		uint32_t author_len;
+		uint32_t body_len;
+		while (chat_proto_read_u32(buf, pos, &author_len) and
+			chat_proto_read_u32(buf, pos + 4, &body_len) and
+			buf.length() >= pos + 8 + author_len + body_len) {
+			pos += 8 + author_len;
+			bench_record_latency(latencies, buf.substr(pos, body_len));
+			pos += body_len;
+			++cli.received;
+		}
+	} else {
+		size_t line_end;
+		while ((line_end = buf.find('\n', pos)) != std::string_view::npos) {
+			bench_record_latency(latencies, buf.substr(pos, line_end - pos));
+			pos = line_end + 1;
+			++cli.received;
+		}
+	}
+	if (pos > 0) {
+		cli.in_size -= pos;
+		memmove(cli.in_buf.data(), cli.in_buf.data() + pos, cli.in_size);
+	}
+}
+
+static bool
+bench_parse_opts(
+	int argc,
+	char** argv,
+	bench_opts* opts)
+{
+	if (argc < 2)
+		return false;
+	std::string addr = argv[1];
+	size_t sep = addr.rfind(':');
+	if (sep == std::string::npos)
+		return false;
+	opts->host = addr.substr(0, sep);
+	opts->port = addr.substr(sep + 1);
+	for (int i = 2; i + 1 < argc; i += 2) {
+		std::string key = argv[i];
+		const char* val = argv[i + 1];
+		if (key == "-p") {
+			if (strcmp(val, "plain") == 0)
+				opts->proto = BENCH_PROTO_PLAIN;
+			else if (strcmp(val, "framed") == 0)
+				opts->proto = BENCH_PROTO_FRAMED;
+			else
+				return false;
+		} else if (key == "-c") {
+			opts->client_count = atoi(val);
+		} else if (key == "-m") {
+			opts->msg_count = atoi(val);
+		} else if (key == "-s") {
+			opts->msg_size = atoi(val);
+		} else if (key == "-r") {
+			opts->rate = atoi(val);
+		} else {
+			return false;
+		}
+	}
+	return opts->client_count > 0 and opts->msg_count > 0 and
+		opts->msg_size >= 21;
+}
+
+int
+main(int argc, char** argv)
+{
+	bench_opts opts;
+	if (not bench_parse_opts(argc, argv, &opts)) {
+		printf("Usage: %s host:port [-p plain|framed] [-c clients] "
+			"[-m messages] [-s size >= 21] [-r rate]\n", argv[0]);
+		return -1;
+	}
+	std::string body;
+	bench_msg_make(body, opts.msg_size);
+
+	std::vector<bench_client> clis(opts.client_count);
+	for (uint32_t i = 0; i < opts.client_count; ++i) {
+		clis[i].id = i;
+		if (bench_connect(opts, clis[i]) != 0) {
+			printf("Failed to connect client %u\n", i);
+			return -1;
+		}
+	}
+	// Every message goes to every other client.
+	uint64_t expected = (uint64_t)opts.msg_count * (opts.client_count - 1);
+	uint64_t interval_ns = opts.rate > 0 ? 1000000000 / opts.rate : 0;
+	std::vector<uint64_t> latencies;
+	latencies.reserve(expected * opts.client_count);
+	std::vector<struct pollfd> fds(opts.client_count);
+
+	uint64_t start_ns = time_ns();
+	uint64_t active_ns = start_ns;
+	for (bench_client& cli : clis)
+		cli.next_send_ns = start_ns;
+	while (true) {
+		bool is_done = true;
+		uint64_t now = time_ns();
+		// A message sent while another client's accept is still in flight
+		// is not delivered to it - a load generator has to tolerate that.
+		// All sent and 2 sec of silence means nothing more is coming.
+		if (now - active_ns > 2000000000)
+			break;
+		for (uint32_t i = 0; i < opts.client_count; ++i) {
+			bench_client& cli = clis[i];
+			// Throttled clients stamp and queue their due messages;
+			// unthrottled ones keep one message in flight to not
+			// overwhelm a reader that is the same thread.
+			while (cli.sent < opts.msg_count and now >= cli.next_send_ns and
+				(interval_ns != 0 or cli.out_buf.length() == cli.out_pos)) {
+				bench_push_msg(opts, cli, body);
+				cli.next_send_ns += interval_ns;
+			}
+			fds[i].fd = cli.fd;
+			fds[i].events = POLLIN;
+			if (cli.out_pos < cli.out_buf.length())
+				fds[i].events |= POLLOUT;
+			if (cli.sent < opts.msg_count or cli.received < expected)
+				is_done = false;
+		}
+		if (is_done)
+			break;
+		++bench_syscall_count;
+		int rc = poll(fds.data(), fds.size(), interval_ns != 0 ? 1 : 100);
+		if (rc < 0) {
+			printf("poll() failed\n");
+			return -1;
+		}
+		for (uint32_t i = 0; i < opts.client_count; ++i) {
+			bench_client& cli = clis[i];
+			if (fds[i].revents & POLLOUT) {
+				++bench_syscall_count;
+				ssize_t sz = send(cli.fd, cli.out_buf.data() + cli.out_pos,
+					cli.out_buf.length() - cli.out_pos, MSG_NOSIGNAL);
+				if (sz > 0) {
+					cli.out_pos += sz;
+					active_ns = time_ns();
+					if (cli.out_pos == cli.out_buf.length()) {
+						cli.out_buf.clear();
+						cli.out_pos = 0;
+					}
+				}
+			}
+			if (fds[i].revents & POLLIN) {
+				if (cli.in_buf.length() - cli.in_size < 16384) {
+					cli.in_buf.resize(std::max(cli.in_buf.length() * 2,
+						cli.in_size + (size_t)16384));
+				}
+				++bench_syscall_count;
+				ssize_t sz = recv(cli.fd, cli.in_buf.data() + cli.in_size,
+					cli.in_buf.length() - cli.in_size, 0);
+				if (sz == 0) {
+					printf("Server closed the connection\n");
+					return -1;
+				}
+				if (sz > 0) {
+					cli.in_size += sz;
+					active_ns = time_ns();
+					bench_consume(opts, cli, latencies);
+				}
+			}
+		}
+	}
+	double duration_sec = (time_ns() - start_ns) / 1e9;
+
+	uint64_t total_received = 0;
+	for (bench_client& cli : clis)
+		total_received += cli.received;
+	std::sort(latencies.begin(), latencies.end());
+	printf("clients: %u, messages per client: %u, size: %u, rate: %u\n",
+		opts.client_count, opts.msg_count, opts.msg_size, opts.rate);
+	printf("duration: %.3f sec\n", duration_sec);
+	printf("delivered: %llu of %llu msgs (%.1f%%), %.1f MB\n",
+		(unsigned long long)total_received,
+		(unsigned long long)(expected * opts.client_count),
+		total_received * 100.0 / (expected * opts.client_count),
+		total_received * (double)opts.msg_size / (1024 * 1024));
+	printf("throughput: %.0f msg/sec, %.1f MB/sec\n",
+		total_received / duration_sec,
+		total_received * (double)opts.msg_size / (1024 * 1024) / duration_sec);
+	if (not latencies.empty()) {
+		printf("latency p50: %.3f ms, p99: %.3f ms, max: %.3f ms\n",
+			latencies[latencies.size() / 2] / 1e6,
+			latencies[latencies.size() * 99 / 100] / 1e6,
+			latencies.back() / 1e6);
+	}
+	printf("client-side syscalls per delivered msg: %.2f\n",
+		(double)bench_syscall_count / total_received);
+	for (bench_client& cli : clis)
+		close(cli.fd);
+	return 0;
+}
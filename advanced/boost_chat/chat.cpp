@@ -7,6 +7,7 @@ event::send()
 {
 	std::unique_lock lock(m_mutex);
 	m_is_set = true;
+	m_cond.notify_all();
 }
 
 void
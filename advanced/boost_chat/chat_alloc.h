@@ -0,0 +1,142 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+//
+// Recycling memory for asio completion handlers. An async operation allocates its
+// state through the handler's associated allocator, and the default one takes the
+// global heap on every hop. The arena instead keeps a few fixed-size blocks on a
+// lock-free slot array - the same scheme as the broadcast frame pool in
+// chat_server.cpp - so the steady-state message flow re-uses the same memory over
+// and over and the per-message overhead stays predictable.
+//
+
+class chat_op_arena final
+{
+public:
+	// Covers the handler states of this code base with room to spare; an
+	// oversized request falls through to the heap.
+	static constexpr size_t BLOCK_SIZE = 512;
+
+	~chat_op_arena()
+	{
+		for (std::atomic<void*>& slot : m_slots)
+			::operator delete(slot.exchange(nullptr));
+	}
+
+	void*
+	get(
+		size_t size)
+	{
+		if (size > BLOCK_SIZE)
+			return ::operator new(size);
+		for (std::atomic<void*>& slot : m_slots) {
+			void* mem = slot.exchange(nullptr);
+			if (mem != nullptr)
+				return mem;
+		}
+		return ::operator new(BLOCK_SIZE);
+	}
+
+	void
+	put(
+		void* mem,
+		size_t size)
+	{
+		if (size > BLOCK_SIZE) {
+			::operator delete(mem);
+			return;
+		}
+		for (std::atomic<void*>& slot : m_slots) {
+			void* expected = nullptr;
+			if (slot.compare_exchange_strong(expected, mem))
+				return;
+		}
+		::operator delete(mem);
+	}
+
+private:
+	std::array<std::atomic<void*>, 16> m_slots{};
+};
+
+template<typename T>
+class chat_op_allocator final
+{
+public:
+	using value_type = T;
+
+	explicit chat_op_allocator(
+		chat_op_arena& arena) noexcept : m_arena(&arena) {}
+
+	template<typename U>
+	chat_op_allocator(
+		const chat_op_allocator<U>& other) noexcept : m_arena(other.m_arena) {}
+
+	T*
+	allocate(
+		size_t count)
+	{
+		return static_cast<T*>(m_arena->get(count * sizeof(T)));
+	}
+
+	void
+	deallocate(
+		T* mem,
+		size_t count)
+	{
+		m_arena->put(mem, count * sizeof(T));
+	}
+
+	template<typename U>
+	bool
+	operator==(
+		const chat_op_allocator<U>& other) const noexcept
+	{ return m_arena == other.m_arena; }
+
+	template<typename U>
+	bool
+	operator!=(
+		const chat_op_allocator<U>& other) const noexcept
+	{ return m_arena != other.m_arena; }
+
+	chat_op_arena* m_arena;
+};
+
+// Attach an arena to a callback as its associated allocator - asio then takes the
+// operation memory from the arena instead of the heap.
+template<typename F>
+class chat_op_bound final
+{
+public:
+	using allocator_type = chat_op_allocator<void>;
+
+	chat_op_bound(
+		chat_op_arena& arena,
+		F f) : m_arena(&arena), m_f(std::move(f)) {}
+
+	allocator_type
+	get_allocator() const noexcept { return allocator_type(*m_arena); }
+
+	template<typename... Args>
+	void
+	operator()(
+		Args&&... args) { m_f(std::forward<Args>(args)...); }
+
+private:
+	chat_op_arena* m_arena;
+	F m_f;
+};
+
+template<typename F>
+chat_op_bound<std::decay_t<F>>
+chat_op_bind(
+	chat_op_arena& arena,
+	F&& f)
+{
+	return chat_op_bound<std::decay_t<F>>(arena, std::forward<F>(f));
+}
@@ -1,11 +1,37 @@
 #include "chat.h"
+#include "chat_alloc.h"
 #include "chat_client.h"
+#include "chat_proto.h"
 
+// Boost 1.74's awaitable.hpp uses std::exchange without including <utility> - pull it
+// in before the asio headers.
+#include <utility>
+
+#include <boost/asio/awaitable.hpp>
 #include <boost/asio/bind_executor.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
 #include <boost/asio/io_context.hpp>
-#include <boost/asio/io_context_strand.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <boost/asio/write.hpp>
+#include <deque>
 #include <list>
+#include <vector>
+
+enum
+{
+	// How many queued output chunks one gathered send takes at most.
+	CHAT_CLIENT_SEND_BATCH = 64,
+};
+
+// The session loops below are C++20 coroutines spawned onto the strand, and asio's
+// awaitable machinery only takes the new-style executors - hence this strand type
+// instead of the legacy io_context::strand.
+using chat_strand = boost::asio::strand<boost::asio::io_context::executor_type>;
 
 struct chat_client_request final
 {
@@ -54,46 +80,59 @@ private:
 	priv_in_strand_on_new_request(
 		std::unique_ptr<chat_client_request> req);
 
-	void
-	priv_in_strand_recv();
+	// The whole receive side of the connection. A single coroutine frame replaces
+	// the recv/on_recv callback pair rebound and allocated on every hop. Runs
+	// exactly while the request list is not empty.
+	boost::asio::awaitable<void>
+	priv_recv_loop();
 
 	void
-	priv_in_strand_on_recv(
-		const boost::system::error_code& err,
-		std::size_t size);
+	priv_in_strand_parse();
 
 	void
 	priv_in_strand_on_new_feed(
 		std::string_view text);
 
 	void
-	priv_in_strand_send();
+	priv_in_strand_send_start();
+
+	// Drains the output chain and quits; the chunks fed while a write is in flight
+	// make up the next gathered batch.
+	boost::asio::awaitable<void>
+	priv_send_loop();
 
 	void
-	priv_in_strand_on_send(
-		const boost::system::error_code& err,
-		std::size_t size);
+	priv_in_strand_close(
+		chat_errcode err);
 
 	// Strand "serializes" all callbacks associated with it. It means the strand will
 	// invoke them one by one, never in more than one thread at a time. That in turn
 	// means, that inside strand callbacks you don't need to protect its data with any
 	// mutexes.
-	boost::asio::io_context::strand m_strand;
+	chat_strand m_strand;
 	boost::asio::ip::tcp::socket m_sock;
 
 	// Requests which are waiting for data.
 	std::list<std::unique_ptr<chat_client_request>> m_reqs;
 	// Full messages waiting to be delivered to requests.
 	std::list<std::unique_ptr<chat_message>> m_in_msgs;
-	// Input buffer for reading the next incoming messages.
+	// Input buffer for reading the next incoming messages. Only the first m_in_size
+	// bytes are valid.
 	std::string m_in_buf;
-	// Output buffer for prearing the next outgoing messages.
+	size_t m_in_size;
+	// Fed text without a trailing '\n' yet.
 	std::string m_out_buf;
+	// Chain of framed chunks waiting to be sent. The chunks fed while a send is in
+	// flight accumulate here and leave in one gathered write on the next turn, so
+	// the coalescing happens in userspace and Nagle can stay off.
+	std::deque<std::string> m_out_chain;
+	bool m_is_sending;
+
+	// Recycled memory of the posted per-message handlers.
+	chat_op_arena m_op_arena;
 
 	boost::asio::ip::tcp::resolver m_resolver;
 	const std::string m_name;
-
-	// <YOUR CODE IF NEEDED>
 };
 
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -103,12 +142,10 @@ chat_client::chat_client(
 	std::string_view name)
 	: m_conn(std::make_shared<chat_client_peer>(ioCtx, name))
 {
-	// <YOUR CODE IF NEEDED>
 }
 
 chat_client::~chat_client()
 {
-	// <YOUR CODE IF NEEDED>
 }
 
 void
@@ -138,12 +175,13 @@ chat_client::feed_async(
 chat_client_peer::chat_client_peer(
 	boost::asio::io_context& ioCtx,
 	std::string_view name)
-	: m_strand(ioCtx)
+	: m_strand(boost::asio::make_strand(ioCtx))
 	, m_sock(ioCtx)
+	, m_in_size(0)
+	, m_is_sending(false)
 	, m_resolver(ioCtx)
 	, m_name(name)
 {
-	// <YOUR CODE IF NEEDED>
 }
 
 chat_client_peer::~chat_client_peer()
@@ -151,27 +189,26 @@ chat_client_peer::~chat_client_peer()
 	for (std::unique_ptr<chat_client_request>& r : m_reqs)
 		r->m_cb(CHAT_ERR_CANCELED, {});
 	m_reqs.clear();
-
-	// <YOUR CODE IF NEEDED>
 }
 
 void
 chat_client_peer::connect_async(
-	std::string_view /* endpoint */,
-	chat_client_on_connect_f&& /* cb */)
+	std::string_view endpoint,
+	chat_client_on_connect_f&& cb)
 {
-	// <YOUR CODE IF NEEDED>
-	abort();
-
-	// 1) Extract host and port from the endpoint string.
-	//
-	// 2) Start resolving them to an IP:
-	// m_resolver.async_resolve(host, port, boost::asio::bind_executor(m_strand,
-	//	[ref = shared_from_this(), this, cb = std::move(cb)](
-	//		const boost::system::error_code& err,
-	//		boost::asio::ip::tcp::resolver::results_type results) {
-	//	priv_in_strand_on_resolve(err, std::move(cb), results);
-	// }));
+	size_t sep = endpoint.rfind(':');
+	if (sep == std::string_view::npos) {
+		cb(CHAT_ERR_NO_ADDR);
+		return;
+	}
+	std::string host(endpoint.substr(0, sep));
+	std::string port(endpoint.substr(sep + 1));
+	m_resolver.async_resolve(host, port, boost::asio::bind_executor(m_strand,
+		[ref = shared_from_this(), this, cb = std::move(cb)](
+			const boost::system::error_code& err,
+			boost::asio::ip::tcp::resolver::results_type results) mutable {
+		priv_in_strand_on_resolve(err, std::move(cb), results);
+	}));
 }
 
 void
@@ -180,50 +217,60 @@ chat_client_peer::recv_async(
 {
 	std::unique_ptr<chat_client_request> req =
 		std::make_unique<chat_client_request>(std::move(cb));
-	boost::asio::post(m_strand,
+	boost::asio::post(m_strand, chat_op_bind(m_op_arena,
 		[ref = shared_from_this(), req = std::move(req), this]() mutable {
 		priv_in_strand_on_new_request(std::move(req));
-	});
+	}));
 }
 
 void
 chat_client_peer::feed_async(
 	std::string_view text)
 {
-	boost::asio::post(m_strand, std::bind(
+	boost::asio::post(m_strand, chat_op_bind(m_op_arena, std::bind(
 		&chat_client_peer::priv_in_strand_on_new_feed, shared_from_this(),
-		std::string(text)));
+		std::string(text))));
 }
 
 void
 chat_client_peer::priv_in_strand_on_resolve(
-	const boost::system::error_code& /* err */,
-	chat_client_on_connect_f&& /* cb */,
-	boost::asio::ip::tcp::resolver::results_type /* results */)
+	const boost::system::error_code& err,
+	chat_client_on_connect_f&& cb,
+	boost::asio::ip::tcp::resolver::results_type results)
 {
 	assert(m_strand.running_in_this_thread());
-
-	// <YOUR CODE IF NEEDED>
-	abort();
-
-	// 1) Choose one of the results (it is an array).
-	// 2) Do
-	// m_sock.async_connect(endpoint, boost::asio::bind_executor(m_strand,
-	//	[ref = shared_from_this(), this, cb = std::move(cb)](
-	//		const boost::system::error_code& err) {
-	//	priv_in_strand_on_connect(err, std::move(cb));
-	// }));
+	if (err or results.empty()) {
+		cb(CHAT_ERR_NO_ADDR);
+		return;
+	}
+	m_sock.async_connect(results.begin()->endpoint(), boost::asio::bind_executor(
+		m_strand, [ref = shared_from_this(), this, cb = std::move(cb)](
+			const boost::system::error_code& err) mutable {
+		priv_in_strand_on_connect(err, std::move(cb));
+	}));
 }
 
 void
 chat_client_peer::priv_in_strand_on_connect(
-	const boost::system::error_code& /* err */,
-	chat_client_on_connect_f&& /* cb */)
+	const boost::system::error_code& err,
+	chat_client_on_connect_f&& cb)
 {
 	assert(m_strand.running_in_this_thread());
-
-	// <YOUR CODE IF NEEDED>
-	abort();
+	if (err) {
+		cb(CHAT_ERR_SYS);
+		return;
+	}
+	// Nagle would add its delays on top of the userspace batching, while the
+	// batching already prevents the packet-per-message worst case. Turn it off.
+	boost::system::error_code opt_err;
+	m_sock.set_option(boost::asio::ip::tcp::no_delay(true), opt_err);
+
+	std::string handshake;
+	chat_proto_append_u32(handshake, m_name.length());
+	handshake.append(m_name);
+	m_out_chain.emplace_back(std::move(handshake));
+	priv_in_strand_send_start();
+	cb(CHAT_ERR_NONE);
 }
 
 void
@@ -243,109 +290,164 @@ chat_client_peer::priv_in_strand_on_new_request(
 		m_in_msgs.pop_front();
 		return;
 	}
+	// No ready messages - receive some new ones. The receive loop runs exactly
+	// while the request list is not empty, so this is the only place to spawn it.
+	m_reqs.emplace_back(std::move(req));
+	boost::asio::co_spawn(m_strand,
+		[self = shared_from_this()]() { return self->priv_recv_loop(); },
+		boost::asio::detached);
+}
 
-	// <YOUR CODE IF NEEDED>
-	abort();
-
-	// No ready messages. It means you need to receive some new ones.
-	//
-	// 1) Save the request for serving it later.
-	// m_reqs.emplace_back(std::move(req));
-	//
-	// 2) priv_in_strand_recv();
+boost::asio::awaitable<void>
+chat_client_peer::priv_recv_loop()
+{
+	// The coroutine resumes on m_strand after every co_await - the loop body is
+	// serialized with the posted handlers exactly like the old callbacks were.
+	while (not m_reqs.empty() and m_sock.is_open()) {
+		if (m_in_buf.length() - m_in_size < CHAT_RECV_BUF_SIZE) {
+			m_in_buf.resize(std::max(m_in_buf.length() * 2,
+				m_in_size + CHAT_RECV_BUF_SIZE));
+		}
+		boost::system::error_code err;
+		std::size_t size = co_await m_sock.async_receive(boost::asio::buffer(
+			m_in_buf.data() + m_in_size, m_in_buf.length() - m_in_size),
+			boost::asio::redirect_error(boost::asio::use_awaitable, err));
+		assert(m_strand.running_in_this_thread());
+		if (err) {
+			priv_in_strand_close(CHAT_ERR_SYS);
+			co_return;
+		}
+		m_in_size += size;
+		priv_in_strand_parse();
+		while (not m_reqs.empty() and not m_in_msgs.empty()) {
+			m_reqs.front()->m_cb(CHAT_ERR_NONE,
+				std::move(m_in_msgs.front()));
+			m_reqs.pop_front();
+			m_in_msgs.pop_front();
+		}
+	}
 }
 
 void
-chat_client_peer::priv_in_strand_recv()
+chat_client_peer::priv_in_strand_parse()
 {
 	assert(m_strand.running_in_this_thread());
-
-	// <YOUR CODE IF NEEDED>
-	abort();
-
-	// 1) Ensure you have enough space in m_in_buf. Reserve at least CHAT_RECV_BUF_SIZE.
-	// Grow it x2 when need more.
 	//
-	// 2) Receive more data.
-	// uint8_t* buf = m_in_buf.data() + m_in_buf.length();
-	// size_t size = m_in_buf.capacity() - m_in_buf.length();
-	// m_sock.async_receive(boost::asio::buffer(buf, size),
-	//	boost::asio::bind_executor(strand_,
-	//		std::bind(&chat_client_peer::priv_in_strand_on_recv, shared_from_this(),
-	//		std::placeholder::_1, std::placeholders::_2)));
+	// Extract the complete messages: [author_len][body_len][author][body].
+	//
+	std::string_view buf(m_in_buf.data(), m_in_size);
+	size_t pos = 0;
+	uint32_t author_len;
+	uint32_t body_len;
+	while (chat_proto_read_u32(buf, pos, &author_len) and
+		chat_proto_read_u32(buf, pos + sizeof(author_len), &body_len) and
+		buf.length() >= pos + 2 * sizeof(uint32_t) + author_len + body_len) {
+		pos += 2 * sizeof(uint32_t);
+		std::unique_ptr<chat_message> msg = std::make_unique<chat_message>();
+		msg->m_author = buf.substr(pos, author_len);
+		pos += author_len;
+		msg->m_data = buf.substr(pos, body_len);
+		pos += body_len;
+		m_in_msgs.emplace_back(std::move(msg));
+	}
+	if (pos > 0) {
+		m_in_size -= pos;
+		memmove(m_in_buf.data(), m_in_buf.data() + pos, m_in_size);
+	}
 }
 
 void
-chat_client_peer::priv_in_strand_on_recv(
-	const boost::system::error_code& /* err */,
-	std::size_t /* size */)
+chat_client_peer::priv_in_strand_on_new_feed(
+	std::string_view text)
 {
 	assert(m_strand.running_in_this_thread());
-
-	// <YOUR CODE IF NEEDED>
-	abort();
-
-	// 1) Start considering the newly received bytes.
-	// m_in_buf.resize(m_in_buf.length() + size);
-	//
-	// 2) Parse the buffer trying to extract complete messages. Put each extracted one
-	// into m_in_msgs.
+	m_out_buf.append(text);
 	//
-	// 3) Hand the received messages from m_in_msgs to pending requests in m_reqs.
+	// Frame all the complete lines of this feed into one chunk of the output
+	// chain: [body_len][body] each, so the server never scans the payload.
 	//
-	// 4) Keep receiving until you get at least one full message.
-	//
-	// In your code you might make m_in_buf more efficient.
+	std::string chunk;
+	size_t line_begin = 0;
+	size_t line_end;
+	while ((line_end = m_out_buf.find('\n', line_begin)) != std::string::npos) {
+		std::string_view line = chat_proto_trim(std::string_view(
+			m_out_buf.data() + line_begin, line_end - line_begin));
+		line_begin = line_end + 1;
+		if (line.empty())
+			continue;
+		chat_proto_append_u32(chunk, line.length());
+		chunk.append(line);
+	}
+	m_out_buf.erase(0, line_begin);
+	if (chunk.empty())
+		return;
+	m_out_chain.emplace_back(std::move(chunk));
+	priv_in_strand_send_start();
 }
 
 void
-chat_client_peer::priv_in_strand_on_new_feed(
-	std::string_view /* text */)
+chat_client_peer::priv_in_strand_send_start()
 {
 	assert(m_strand.running_in_this_thread());
-
-	// <YOUR CODE IF NEEDED>
-	abort();
-
-	// 1) Append the data to the pending output buffer m_out_buf.
-	// 2) priv_in_strand_send();
+	if (m_is_sending or m_out_chain.empty() or not m_sock.is_open())
+		return;
+	m_is_sending = true;
+	boost::asio::co_spawn(m_strand,
+		[self = shared_from_this()]() { return self->priv_send_loop(); },
+		boost::asio::detached);
 }
 
-void
-chat_client_peer::priv_in_strand_send()
+boost::asio::awaitable<void>
+chat_client_peer::priv_send_loop()
 {
 	assert(m_strand.running_in_this_thread());
-
-	// <YOUR CODE IF NEEDED>
-	abort();
-
-	// If the buffer m_out_buf contains a complete message, then send it using
-	// m_sock.async_send(boost::asio::buffer(m_out_buf.data(), m_out_buf.length()),
-	//	boost::asio::bind_executor(m_strand,
-	//		std::bind(&chat_client_peer::priv_in_strand_on_send, shared_from_this(),
-	//			std::placeholders::_1, std::placeholders::_2)));
-	//
-	// You don't have to send whole messages. Could send the parts right away if your
-	// protocol is fine with that. But you might need to send full ones if you encode them
-	// anyhow. For example, prefix each message with its total size to make receipt on the
-	// other end more optimal.
-	//
-	// When m_out_buf is needed (only if you are sending full messages), you should keep
-	// it valid and unchanged until the sending is complete. Which means you might need a
-	// second buffer where you would store newer messages while the older ones are being
-	// sent.
+	assert(m_is_sending);
+	// The m_is_sending flag keeps the drainer single - a chunk spawns one only when
+	// none is running, and a busy feed then re-uses this frame for the whole burst.
+	// The gather vector keeps its capacity across the iterations too.
+	std::vector<boost::asio::const_buffer> bufs;
+	while (not m_out_chain.empty() and m_sock.is_open()) {
+		//
+		// One gathered write per turn - everything queued so far leaves in a
+		// single call, and the chunks fed meanwhile make up the next batch.
+		//
+		size_t count = std::min(m_out_chain.size(),
+			(size_t)CHAT_CLIENT_SEND_BATCH);
+		bufs.clear();
+		bufs.reserve(count);
+		for (size_t i = 0; i < count; ++i)
+			bufs.emplace_back(m_out_chain[i].data(),
+				m_out_chain[i].length());
+		// async_write() retries the partial writes internally until the whole
+		// sequence is out.
+		boost::system::error_code err;
+		co_await boost::asio::async_write(m_sock, bufs,
+			boost::asio::redirect_error(boost::asio::use_awaitable, err));
+		assert(m_strand.running_in_this_thread());
+		if (err) {
+			m_is_sending = false;
+			priv_in_strand_close(CHAT_ERR_SYS);
+			co_return;
+		}
+		// The close path clears the chain even under an in-flight write -
+		// don't pop past it.
+		while (count-- > 0 and not m_out_chain.empty())
+			m_out_chain.pop_front();
+	}
+	m_is_sending = false;
 }
 
 void
-chat_client_peer::priv_in_strand_on_send(
-	const boost::system::error_code& /* err */,
-	std::size_t /* size */)
+chat_client_peer::priv_in_strand_close(
+	chat_errcode err)
 {
 	assert(m_strand.running_in_this_thread());
-
-	// <YOUR CODE IF NEEDED>
-	abort();
-
-	// Be careful about partial writes. The sent size might be < m_out_buf.length(). Then
-	// you must send the rest again. Keep sending as long as you have something to send.
+	if (not m_sock.is_open())
+		return;
+	boost::system::error_code sock_err;
+	m_sock.close(sock_err);
+	m_out_chain.clear();
+	for (std::unique_ptr<chat_client_request>& r : m_reqs)
+		r->m_cb(err, {});
+	m_reqs.clear();
 }
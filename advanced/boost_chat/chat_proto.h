@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+//
+// Wire format, shared by the server and the client. All frames are
+// length-prefixed, so the receiver never scans the payload:
+//
+// - client -> server, the first frame: [u32 name_len][name];
+// - client -> server, then: [u32 body_len][body];
+// - server -> client: [u32 author_len][u32 body_len][author][body].
+//
+// The '\n'-separated user text is split, trimmed, and filtered on the
+// feeding side, before it is framed.
+//
+// The u32 values are in the host byte order - both ends are expected
+// to be started on compatible machines.
+//
+
+static inline void
+chat_proto_append_u32(
+	std::string& buf,
+	uint32_t value)
+{
+	char raw[sizeof(value)];
+	memcpy(raw, &value, sizeof(value));
+	buf.append(raw, sizeof(raw));
+}
+
+// Read a u32 at the position, if the buffer already has it whole.
+static inline bool
+chat_proto_read_u32(
+	std::string_view buf,
+	size_t pos,
+	uint32_t* out)
+{
+	if (buf.length() < pos + sizeof(*out))
+		return false;
+	memcpy(out, buf.data() + pos, sizeof(*out));
+	return true;
+}
+
+// Strip the spaces from both sides of the text.
+static inline std::string_view
+chat_proto_trim(
+	std::string_view text)
+{
+	size_t begin = 0;
+	size_t end = text.length();
+	while (begin < end && isspace((unsigned char)text[begin]))
+		++begin;
+	while (end > begin && isspace((unsigned char)text[end - 1]))
+		--end;
+	return text.substr(begin, end - begin);
+}
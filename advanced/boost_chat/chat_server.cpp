@@ -1,12 +1,46 @@
 #include "chat.h"
+#include "chat_alloc.h"
+#include "chat_proto.h"
 #include "chat_server.h"
 
+// Boost 1.74's awaitable.hpp uses std::exchange without including <utility> - pull it
+// in before the asio headers.
+#include <utility>
+
+#include <boost/asio/awaitable.hpp>
 #include <boost/asio/bind_executor.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
 #include <boost/asio/io_context.hpp>
-#include <boost/asio/io_context_strand.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <deque>
 #include <iostream>
 #include <list>
+#include <vector>
+
+enum
+{
+	// How many queued buffers one gathered send takes at most.
+	CHAT_SERVER_SEND_BATCH = 64,
+};
+
+// Boost wraps SO_REUSEADDR as acceptor::reuse_address but has no portable wrapper for
+// SO_REUSEPORT - spell the raw option out, like examples/reuse_port_addr does in C.
+using chat_reuse_port =
+	boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+
+// The session loops below are C++20 coroutines spawned onto the strands, and asio's
+// awaitable machinery only takes the new-style executors - hence this strand type
+// instead of the legacy io_context::strand.
+using chat_strand = boost::asio::strand<boost::asio::io_context::executor_type>;
 
 enum chat_server_state
 {
@@ -17,10 +51,65 @@ enum chat_server_state
 
 enum chat_server_peer_state
 {
+	CHAT_SERVER_PEER_STATE_HANDSHAKE,
 	CHAT_SERVER_PEER_STATE_CONNECTED,
 	CHAT_SERVER_PEER_STATE_STOPPED,
 };
 
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// A broadcast frame, produced once per message and referenced by the output queue of
+// every recipient. The refcount tells when it can go back to the pool.
+struct chat_buf final
+{
+	std::string m_data;
+	std::atomic<uint32_t> m_refs{0};
+};
+
+// A lock-free pool of broadcast frames. A fixed array of slots instead of a freelist
+// stack - exchanging a whole slot cannot suffer from ABA, unlike a CAS on a list head.
+// Steady-state broadcast then does one pool get() per message and zero allocations,
+// since a recycled buffer keeps its capacity.
+class chat_buf_pool final
+{
+public:
+	~chat_buf_pool()
+	{
+		for (std::atomic<chat_buf*>& slot : m_slots)
+			delete slot.exchange(nullptr);
+	}
+
+	chat_buf*
+	get()
+	{
+		for (std::atomic<chat_buf*>& slot : m_slots) {
+			chat_buf* buf = slot.exchange(nullptr);
+			if (buf != nullptr) {
+				buf->m_data.clear();
+				return buf;
+			}
+		}
+		return new chat_buf();
+	}
+
+	void
+	put(
+		chat_buf* buf)
+	{
+		for (std::atomic<chat_buf*>& slot : m_slots) {
+			chat_buf* expected = nullptr;
+			if (slot.compare_exchange_strong(expected, buf))
+				return;
+		}
+		delete buf;
+	}
+
+private:
+	std::array<std::atomic<chat_buf*>, 64> m_slots{};
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
 class chat_server_peer final : public std::enable_shared_from_this<chat_server_peer>
 {
 public:
@@ -35,44 +124,77 @@ public:
 	void
 	stop();
 
+	// Queue the shared frame for sending. One ref of the frame belongs to this peer
+	// from now on.
 	void
-	feed_async(
-		std::string_view text);
+	send_buf_async(
+		chat_buf* buf);
 
 private:
 	void
-	priv_in_strand_on_new_feed(
-		std::string&& text);
+	priv_in_strand_send_buf(
+		chat_buf* buf);
 
+	// Drop one ref of the frame. Returns it to the server's pool, or frees it
+	// directly when the server is already gone.
 	void
-	priv_in_strand_recv();
+	priv_buf_release(
+		chat_buf* buf);
+
+	// The whole receive side of the connection. A single coroutine frame replaces
+	// the recv/on_recv callback pair rebound and allocated on every hop.
+	boost::asio::awaitable<void>
+	priv_recv_loop();
 
 	void
-	priv_in_strand_on_recv(
-		const boost::system::error_code& err,
-		std::size_t size);
+	priv_in_strand_consume();
 
 	void
-	priv_in_strand_send();
+	priv_in_strand_agg_append(
+		std::string_view body);
 
 	void
-	priv_in_strand_on_send(
-		const boost::system::error_code& err,
-		std::size_t size);
+	priv_in_strand_on_agg_tick(
+		const boost::system::error_code& err);
+
+	// Drains the output queue and quits; the frames queued while a write is in
+	// flight join the next gathered batch.
+	boost::asio::awaitable<void>
+	priv_send_loop();
 
 	void
 	priv_in_strand_stop();
 
 	chat_server_peer_state m_state;
 
-	boost::asio::io_context::strand m_strand;
+	chat_strand m_strand;
 	boost::asio::ip::tcp::socket m_sock;
-	std::shared_ptr<chat_server_ctx> m_server;
-
+	// Weak on purpose - the server holds the peers via m_peers and the snapshot,
+	// so an owning back-reference would be a cycle, and the cycle would leak every
+	// peer when the io_context is stopped before the posted teardown can run.
+	std::weak_ptr<chat_server_ctx> m_server;
+
+	// The frame collecting this peer's messages of the current flush tick, nullptr
+	// when the tick is not open. Per sender, not per room - the sender must not get
+	// its own messages back, so its batch cannot be shared with other senders'.
+	chat_buf* m_agg_buf;
+	// Closes the tick; armed together with m_agg_buf.
+	boost::asio::steady_timer m_agg_timer;
+
+	// Received bytes; only the first m_in_size ones are valid.
 	std::string m_in_buf;
-	std::string m_out_buf;
+	size_t m_in_size;
+	// The name received in the handshake frame.
+	std::string m_name;
 
-	// <YOUR CODE IF NEEDED>
+	// Queue of shared frames to send, oldest first. m_out_pos is the send progress
+	// inside the head frame.
+	std::deque<chat_buf*> m_out_q;
+	size_t m_out_pos;
+	bool m_is_sending;
+
+	// Recycled memory of the posted per-frame handlers.
+	chat_op_arena m_op_arena;
 
 	friend chat_server_ctx;
 };
@@ -89,11 +211,13 @@ struct chat_server_request final
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
+using chat_server_peer_list = std::vector<std::shared_ptr<chat_server_peer>>;
+
 class chat_server_ctx final : public std::enable_shared_from_this<chat_server_ctx>
 {
 public:
 	chat_server_ctx(
-		boost::asio::io_context& ioCtx);
+		const std::vector<boost::asio::io_context*>& reactors);
 	~chat_server_ctx();
 
 	chat_errcode
@@ -114,12 +238,34 @@ public:
 	feed_async(
 		std::string_view text);
 
+	// The current subscriber set. Immutable - join and leave swap in a whole new
+	// version, so a broadcasting peer iterates its copy without any lock, RCU-style.
+	std::shared_ptr<const chat_server_peer_list>
+	snapshot() const;
+
+	void
+	set_flush_period(
+		uint32_t usec);
+
+	const std::chrono::microseconds&
+	flush_period() const { return m_flush_period; }
+
+	chat_buf*
+	buf_get();
+
+	// Drop one ref of the frame; the last one returns it to the pool.
+	void
+	buf_release(
+		chat_buf* buf);
+
 private:
 	void
-	priv_in_strand_accept();
+	priv_in_strand_accept(
+		size_t idx);
 
 	void
 	priv_in_strand_on_accept(
+		size_t idx,
 		const boost::system::error_code& err,
 		boost::asio::ip::tcp::socket sock);
 
@@ -150,18 +296,35 @@ private:
 	priv_in_strand_on_new_feed(
 		std::string_view text);
 
+	void
+	priv_in_strand_update_snapshot();
+
 	chat_server_state m_state;
 
-	boost::asio::io_context::strand m_strand;
-	boost::asio::ip::tcp::acceptor m_sock;
+	chat_strand m_strand;
+	// One acceptor per reactor, all on the same SO_REUSEPORT port. The accepted
+	// socket inherits its acceptor's io_context, and the peer builds its strand from
+	// the socket - so the kernel's accept balancing is also the peer IO balancing.
+	std::vector<std::unique_ptr<boost::asio::ip::tcp::acceptor>> m_socks;
 	uint16_t m_port;
 
 	std::list<std::shared_ptr<chat_server_peer>> m_peers;
+	std::shared_ptr<const chat_server_peer_list> m_snapshot;
 
 	std::list<std::unique_ptr<chat_server_request>> m_reqs;
 	std::list<std::unique_ptr<chat_message>> m_in_msgs;
 
-	// <YOUR CODE IF NEEDED>
+	// Admin-feed text without a trailing '\n' yet.
+	std::string m_feed_buf;
+
+	// Broadcast aggregation window; immutable once started. Zero means the
+	// per-message fan-out.
+	std::chrono::microseconds m_flush_period;
+
+	chat_buf_pool m_buf_pool;
+
+	// Recycled memory of the posted per-message handlers.
+	chat_op_arena m_op_arena;
 
 	friend chat_server_peer;
 };
@@ -170,16 +333,20 @@ private:
 
 chat_server::chat_server(
 	boost::asio::io_context& ioCtx)
-	: m_ctx(std::make_shared<chat_server_ctx>(ioCtx))
+	: m_ctx(std::make_shared<chat_server_ctx>(
+		std::vector<boost::asio::io_context*>{&ioCtx}))
+{
+}
+
+chat_server::chat_server(
+	const std::vector<boost::asio::io_context*>& reactors)
+	: m_ctx(std::make_shared<chat_server_ctx>(reactors))
 {
-	// <YOUR CODE IF NEEDED>
 }
 
 chat_server::~chat_server()
 {
 	m_ctx->stop();
-
-	// <YOUR CODE IF NEEDED>
 }
 
 chat_errcode
@@ -209,28 +376,50 @@ chat_server::feed_async(
 	m_ctx->feed_async(text);
 }
 
+void
+chat_server::set_flush_period(
+	uint32_t usec)
+{
+	m_ctx->set_flush_period(usec);
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////
 
 chat_server_peer::chat_server_peer(
 	boost::asio::ip::tcp::socket&& sock,
 	std::shared_ptr<chat_server_ctx> server)
-	: m_state(CHAT_SERVER_PEER_STATE_CONNECTED)
-	, m_strand(sock.get_executor().context())
+	: m_state(CHAT_SERVER_PEER_STATE_HANDSHAKE)
+	, m_strand(boost::asio::make_strand(
+		static_cast<boost::asio::io_context&>(sock.get_executor().context())))
 	, m_sock(std::move(sock))
 	, m_server(std::move(server))
+	, m_agg_buf(nullptr)
+	, m_agg_timer(m_sock.get_executor())
+	, m_in_size(0)
+	, m_out_pos(0)
+	, m_is_sending(false)
 {
 }
 
 chat_server_peer::~chat_server_peer()
 {
-	// <YOUR CODE IF NEEDED>
+	// Normally the queue is drained by stop(). But when the io_context is stopped
+	// abruptly, the peer dies with its handlers - don't leak the frames then.
+	for (chat_buf* buf : m_out_q)
+		priv_buf_release(buf);
+	m_out_q.clear();
+	if (m_agg_buf != nullptr) {
+		m_agg_buf->m_refs.store(1, std::memory_order_relaxed);
+		priv_buf_release(m_agg_buf);
+	}
 }
 
 void
 chat_server_peer::start()
 {
-	boost::asio::post(m_strand, std::bind(&chat_server_peer::priv_in_strand_recv,
-		shared_from_this()));
+	boost::asio::co_spawn(m_strand,
+		[self = shared_from_this()]() { return self->priv_recv_loop(); },
+		boost::asio::detached);
 }
 
 void
@@ -241,138 +430,295 @@ chat_server_peer::stop()
 }
 
 void
-chat_server_peer::feed_async(
-	std::string_view text)
+chat_server_peer::send_buf_async(
+	chat_buf* buf)
 {
-	boost::asio::post(m_strand, [ref = shared_from_this(), this,
-		text = std::string(text)]() mutable {
-		priv_in_strand_on_new_feed(std::move(text));
-	});
+	// The post is the one per-recipient hop of the fan-out - the arena keeps its
+	// handler memory off the heap.
+	boost::asio::post(m_strand, chat_op_bind(m_op_arena,
+		[ref = shared_from_this(), this, buf]() {
+		priv_in_strand_send_buf(buf);
+	}));
 }
 
 void
-chat_server_peer::priv_in_strand_on_new_feed(
-	std::string&& /* text */)
+chat_server_peer::priv_in_strand_send_buf(
+	chat_buf* buf)
 {
 	assert(m_strand.running_in_this_thread());
-
-	// <YOUR CODE IF NEEDED>
-	abort();
-
-	// 1) Append the data to the pending output buffer m_out_buf.
-	// 2) priv_in_strand_send();
+	if (m_state == CHAT_SERVER_PEER_STATE_STOPPED) {
+		priv_buf_release(buf);
+		return;
+	}
+	m_out_q.push_back(buf);
+	if (not m_is_sending) {
+		m_is_sending = true;
+		boost::asio::co_spawn(m_strand,
+			[self = shared_from_this()]() { return self->priv_send_loop(); },
+			boost::asio::detached);
+	}
 }
 
 void
-chat_server_peer::priv_in_strand_recv()
+chat_server_peer::priv_buf_release(
+	chat_buf* buf)
 {
-	assert(m_strand.running_in_this_thread());
-	if (m_state == CHAT_SERVER_PEER_STATE_STOPPED)
+	std::shared_ptr<chat_server_ctx> server = m_server.lock();
+	if (server != nullptr) {
+		server->buf_release(buf);
 		return;
+	}
+	// The server died with its pool - free the frame directly.
+	if (buf->m_refs.fetch_sub(1) == 1)
+		delete buf;
+}
 
-	// <YOUR CODE IF NEEDED>
-	abort();
+boost::asio::awaitable<void>
+chat_server_peer::priv_recv_loop()
+{
+	// The coroutine resumes on m_strand after every co_await - the loop body is
+	// serialized with the posted handlers exactly like the old callbacks were.
+	while (m_state != CHAT_SERVER_PEER_STATE_STOPPED) {
+		if (m_in_buf.length() - m_in_size < CHAT_RECV_BUF_SIZE) {
+			m_in_buf.resize(std::max(m_in_buf.length() * 2,
+				m_in_size + CHAT_RECV_BUF_SIZE));
+		}
+		boost::system::error_code err;
+		std::size_t size = co_await m_sock.async_receive(boost::asio::buffer(
+			m_in_buf.data() + m_in_size, m_in_buf.length() - m_in_size),
+			boost::asio::redirect_error(boost::asio::use_awaitable, err));
+		assert(m_strand.running_in_this_thread());
+		if (m_state == CHAT_SERVER_PEER_STATE_STOPPED)
+			co_return;
+		if (err) {
+			priv_in_strand_stop();
+			co_return;
+		}
+		m_in_size += size;
+		priv_in_strand_consume();
+	}
+}
 
-	// 1) Ensure you have enough space in m_in_buf. Reserve at least CHAT_RECV_BUF_SIZE.
-	// Grow it x2 when need more.
-	//
-	// 2) Receive more data.
-	// uint8_t* buf = m_in_buf.data() + m_in_buf.length();
-	// size_t size = m_in_buf.capacity() - m_in_buf.length();
-	// m_sock.async_receive(boost::asio::buffer(buf, size),
-	//	boost::asio::bind_executor(strand_,
-	//		std::bind(&chat_server_peer::priv_in_strand_on_recv, shared_from_this(),
-	//		std::placeholder::_1, std::placeholders::_2)));
+void
+chat_server_peer::priv_in_strand_consume()
+{
+	std::shared_ptr<chat_server_ctx> server = m_server.lock();
+	if (server == nullptr) {
+		// The server is being torn down - no one to deliver to.
+		priv_in_strand_stop();
+		return;
+	}
+	std::string_view buf(m_in_buf.data(), m_in_size);
+	size_t pos = 0;
+	uint32_t len;
+	if (m_state == CHAT_SERVER_PEER_STATE_HANDSHAKE) {
+		if (not chat_proto_read_u32(buf, pos, &len) or
+			buf.length() < pos + sizeof(len) + len)
+			return;
+		pos += sizeof(len);
+		m_name.assign(buf.data() + pos, len);
+		pos += len;
+		m_state = CHAT_SERVER_PEER_STATE_CONNECTED;
+	}
+	while (chat_proto_read_u32(buf, pos, &len) and
+		buf.length() >= pos + sizeof(len) + len) {
+		pos += sizeof(len);
+		std::string_view body = buf.substr(pos, len);
+		pos += len;
+
+		std::unique_ptr<chat_message> msg = std::make_unique<chat_message>();
+		msg->m_author = m_name;
+		msg->m_data = body;
+		server->priv_peer_on_recv(std::move(msg));
+		//
+		// Within a flush window the message only joins this peer's pending
+		// frame - the fan-out happens once per tick, when the timer closes
+		// the window.
+		//
+		if (server->flush_period().count() > 0) {
+			priv_in_strand_agg_append(body);
+			continue;
+		}
+		//
+		// Fan the message out over the current subscriber snapshot. No lock
+		// and no subscriber-count-proportional work besides the queueing
+		// itself - the bytes live in one shared frame.
+		//
+		std::shared_ptr<const chat_server_peer_list> subs = server->snapshot();
+		uint32_t recv_count = 0;
+		for (const std::shared_ptr<chat_server_peer>& p : *subs) {
+			if (p.get() != this)
+				++recv_count;
+		}
+		if (recv_count == 0)
+			continue;
+		chat_buf* out = server->buf_get();
+		chat_proto_append_u32(out->m_data, m_name.length());
+		chat_proto_append_u32(out->m_data, len);
+		out->m_data.append(m_name);
+		out->m_data.append(body);
+		out->m_refs.store(recv_count, std::memory_order_relaxed);
+		for (const std::shared_ptr<chat_server_peer>& p : *subs) {
+			if (p.get() != this)
+				p->send_buf_async(out);
+		}
+	}
+	if (pos > 0) {
+		m_in_size -= pos;
+		memmove(m_in_buf.data(), m_in_buf.data() + pos, m_in_size);
+	}
 }
 
 void
-chat_server_peer::priv_in_strand_on_recv(
-	const boost::system::error_code& /* err */,
-	std::size_t /* size */)
+chat_server_peer::priv_in_strand_agg_append(
+	std::string_view body)
 {
 	assert(m_strand.running_in_this_thread());
-
-	// <YOUR CODE IF NEEDED>
-	abort();
-
-	// 1) Start considering the newly received bytes.
-	// m_in_buf.resize(m_in_buf.length() + size);
-	//
-	// 2) Parse the buffer trying to extract complete messages. Send each extracted one
-	// to the server: m_server->priv_peer_on_recv(msg).
-	//
-	// 3) Keep receiving infinitely.
-	//
-	// In your code you might make m_in_buf more efficient.
+	std::shared_ptr<chat_server_ctx> server = m_server.lock();
+	if (server == nullptr)
+		return;
+	if (m_agg_buf == nullptr) {
+		m_agg_buf = server->buf_get();
+		m_agg_timer.expires_after(server->flush_period());
+		m_agg_timer.async_wait(boost::asio::bind_executor(m_strand,
+			std::bind(&chat_server_peer::priv_in_strand_on_agg_tick,
+			shared_from_this(), std::placeholders::_1)));
+	}
+	chat_proto_append_u32(m_agg_buf->m_data, m_name.length());
+	chat_proto_append_u32(m_agg_buf->m_data, body.length());
+	m_agg_buf->m_data.append(m_name);
+	m_agg_buf->m_data.append(body);
 }
 
 void
-chat_server_peer::priv_in_strand_send()
+chat_server_peer::priv_in_strand_on_agg_tick(
+	const boost::system::error_code& err)
 {
 	assert(m_strand.running_in_this_thread());
-	if (m_state == CHAT_SERVER_PEER_STATE_STOPPED)
+	// A cancelled tick has nothing to do - stop releases the frame itself.
+	chat_buf* out = m_agg_buf;
+	m_agg_buf = nullptr;
+	if (out == nullptr)
 		return;
-
-	// <YOUR CODE IF NEEDED>
-	abort();
-
-	// If the buffer m_out_buf contains a complete message, then send it using
-	// m_sock.async_send(boost::asio::buffer(m_out_buf.data(), m_out_buf.length()),
-	//	boost::asio::bind_executor(m_strand,
-	//		std::bind(&chat_server_peer::priv_in_strand_on_send, shared_from_this(),
-	//			std::placeholders::_1, std::placeholders::_2)));
+	std::shared_ptr<chat_server_ctx> server = m_server.lock();
+	if (err or server == nullptr or m_state == CHAT_SERVER_PEER_STATE_STOPPED) {
+		out->m_refs.store(1, std::memory_order_relaxed);
+		priv_buf_release(out);
+		return;
+	}
 	//
-	// You don't have to send whole messages. Could send the parts right away if your
-	// protocol is fine with that. But you might need to send full ones if you encode them
-	// anyhow. For example, prefix each message with its total size to make receipt on the
-	// other end more optimal.
+	// One fan-out pass delivers the whole window: every recipient gets all the
+	// frames collected since the tick opened in one shared buffer, so one queued
+	// send covers them all.
 	//
-	// When m_out_buf is needed (only if you are sending full messages), you should keep
-	// it valid and unchanged until the sending is complete. Which means you might need a
-	// second buffer where you would store newer messages while the older ones are being
-	// sent.
+	std::shared_ptr<const chat_server_peer_list> subs = server->snapshot();
+	uint32_t recv_count = 0;
+	for (const std::shared_ptr<chat_server_peer>& p : *subs) {
+		if (p.get() != this)
+			++recv_count;
+	}
+	if (recv_count == 0) {
+		out->m_refs.store(1, std::memory_order_relaxed);
+		server->buf_release(out);
+		return;
+	}
+	out->m_refs.store(recv_count, std::memory_order_relaxed);
+	for (const std::shared_ptr<chat_server_peer>& p : *subs) {
+		if (p.get() != this)
+			p->send_buf_async(out);
+	}
 }
 
-void
-chat_server_peer::priv_in_strand_on_send(
-	const boost::system::error_code& /* err */,
-	std::size_t /* size */)
+boost::asio::awaitable<void>
+chat_server_peer::priv_send_loop()
 {
 	assert(m_strand.running_in_this_thread());
-
-	// <YOUR CODE IF NEEDED>
-	abort();
-
-	// Be careful about partial writes. The sent size might be < m_out_buf.length(). Then
-	// you must send the rest again. Keep sending as long as you have something to send.
+	assert(m_is_sending);
+	// The m_is_sending flag keeps the drainer single - a new frame spawns one only
+	// when none is running, and a busy peer then re-uses this frame for the whole
+	// burst. The gather vector keeps its capacity across the iterations too.
+	std::vector<boost::asio::const_buffer> bufs;
+	while (m_state != CHAT_SERVER_PEER_STATE_STOPPED and not m_out_q.empty()) {
+		//
+		// Gather a batch of queued frames into one vectored send instead of a
+		// syscall per frame.
+		//
+		size_t count = std::min(m_out_q.size(), (size_t)CHAT_SERVER_SEND_BATCH);
+		bufs.clear();
+		bufs.reserve(count);
+		size_t pos = m_out_pos;
+		for (size_t i = 0; i < count; ++i) {
+			const std::string& data = m_out_q[i]->m_data;
+			bufs.emplace_back(data.data() + pos, data.length() - pos);
+			pos = 0;
+		}
+		boost::system::error_code err;
+		std::size_t size = co_await m_sock.async_write_some(bufs,
+			boost::asio::redirect_error(boost::asio::use_awaitable, err));
+		assert(m_strand.running_in_this_thread());
+		if (m_state == CHAT_SERVER_PEER_STATE_STOPPED)
+			break;
+		if (err) {
+			m_is_sending = false;
+			priv_in_strand_stop();
+			co_return;
+		}
+		// The write can be partial - drop the fully sent frames and remember
+		// the progress inside the first unfinished one.
+		m_out_pos += size;
+		while (not m_out_q.empty()) {
+			chat_buf* buf = m_out_q.front();
+			if (m_out_pos < buf->m_data.length())
+				break;
+			m_out_pos -= buf->m_data.length();
+			m_out_q.pop_front();
+			priv_buf_release(buf);
+		}
+	}
+	m_is_sending = false;
 }
 
 void
 chat_server_peer::priv_in_strand_stop()
 {
 	assert(m_strand.running_in_this_thread());
-	if (m_state != CHAT_SERVER_PEER_STATE_CONNECTED)
+	if (m_state == CHAT_SERVER_PEER_STATE_STOPPED)
 		return;
-	m_state = CHAT_SERVER_PEER_STATE_CONNECTED;
-	m_sock.close();
-	m_server->priv_peer_on_close(shared_from_this());
+	m_state = CHAT_SERVER_PEER_STATE_STOPPED;
+	boost::system::error_code err;
+	m_sock.close(err);
+	m_agg_timer.cancel();
+	if (m_agg_buf != nullptr) {
+		m_agg_buf->m_refs.store(1, std::memory_order_relaxed);
+		priv_buf_release(m_agg_buf);
+		m_agg_buf = nullptr;
+	}
+	for (chat_buf* buf : m_out_q)
+		priv_buf_release(buf);
+	m_out_q.clear();
+	std::shared_ptr<chat_server_ctx> server = m_server.lock();
+	if (server != nullptr)
+		server->priv_peer_on_close(shared_from_this());
 	m_server.reset();
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
 chat_server_ctx::chat_server_ctx(
-	boost::asio::io_context& ioCtx)
+	const std::vector<boost::asio::io_context*>& reactors)
 	: m_state(CHAT_SERVER_STATE_NEW)
-	, m_strand(ioCtx)
-	, m_sock(ioCtx)
+	, m_strand(boost::asio::make_strand(*reactors.front()))
+	, m_port(0)
+	, m_snapshot(std::make_shared<const chat_server_peer_list>())
+	, m_flush_period(0)
 {
-	// <YOUR CODE IF NEEDED>
+	m_socks.reserve(reactors.size());
+	for (boost::asio::io_context* ioCtx : reactors)
+		m_socks.emplace_back(std::make_unique<boost::asio::ip::tcp::acceptor>(*ioCtx));
 }
 
 chat_server_ctx::~chat_server_ctx()
 {
-	// <YOUR CODE IF NEEDED>
 }
 
 chat_errcode
@@ -380,20 +726,41 @@ chat_server_ctx::start(
 	uint16_t port)
 {
 	assert(m_state == CHAT_SERVER_STATE_NEW);
-	// <YOUR CODE IF NEEDED>
-	//
-	// You need to handle errors without throwing exceptions and return them
-	// gracefully.
-	//
-	boost::asio::ip::tcp::endpoint endpoint;
-	endpoint.port(port);
-	m_sock.bind(endpoint);
-	m_port = m_sock.local_endpoint().port();
-	m_sock.listen();
+	boost::system::error_code err;
+	boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::tcp::v4(), port);
+	for (std::unique_ptr<boost::asio::ip::tcp::acceptor>& sock : m_socks) {
+		sock->open(endpoint.protocol(), err);
+		if (err)
+			goto error;
+		sock->set_option(boost::asio::ip::tcp::acceptor::reuse_address(true), err);
+		if (m_socks.size() > 1)
+			sock->set_option(chat_reuse_port(true), err);
+		sock->bind(endpoint, err);
+		if (err)
+			goto error;
+		sock->listen(boost::asio::socket_base::max_listen_connections, err);
+		if (err)
+			goto error;
+		// With an ephemeral port the kernel picks it on the first bind; the
+		// other acceptors then have to join that exact port.
+		if (endpoint.port() == 0)
+			endpoint.port(sock->local_endpoint().port());
+	}
+	m_port = m_socks.front()->local_endpoint().port();
 	m_state = CHAT_SERVER_STATE_LISTEN;
-	boost::asio::post(m_strand, std::bind(
-		&chat_server_ctx::priv_in_strand_accept, shared_from_this()));
+	for (size_t i = 0; i < m_socks.size(); ++i) {
+		boost::asio::post(m_strand, std::bind(
+			&chat_server_ctx::priv_in_strand_accept, shared_from_this(), i));
+	}
 	return CHAT_ERR_NONE;
+error:
+	for (std::unique_ptr<boost::asio::ip::tcp::acceptor>& sock : m_socks) {
+		if (sock->is_open())
+			sock->close();
+	}
+	if (err == boost::asio::error::address_in_use)
+		return CHAT_ERR_PORT_BUSY;
+	return CHAT_ERR_SYS;
 }
 
 uint16_t
@@ -416,32 +783,69 @@ chat_server_ctx::recv_async(
 {
 	std::unique_ptr<chat_server_request> req =
 		std::make_unique<chat_server_request>(std::move(cb));
-	boost::asio::post(m_strand,
+	boost::asio::post(m_strand, chat_op_bind(m_op_arena,
 		[ref = shared_from_this(), req = std::move(req), this]() mutable {
 		priv_in_strand_on_new_request(std::move(req));
-	});
+	}));
 }
 
 void
 chat_server_ctx::feed_async(
 	std::string_view text)
 {
-	boost::asio::post(m_strand, std::bind(&chat_server_ctx::priv_in_strand_on_new_feed,
-		shared_from_this(), std::string(text)));
+	boost::asio::post(m_strand, chat_op_bind(m_op_arena,
+		std::bind(&chat_server_ctx::priv_in_strand_on_new_feed,
+		shared_from_this(), std::string(text))));
+}
+
+std::shared_ptr<const chat_server_peer_list>
+chat_server_ctx::snapshot() const
+{
+	return std::atomic_load(&m_snapshot);
 }
 
 void
-chat_server_ctx::priv_in_strand_accept()
+chat_server_ctx::set_flush_period(
+	uint32_t usec)
+{
+	// The peers read the period without any lock - it has to be frozen before the
+	// first one can connect.
+	assert(m_state == CHAT_SERVER_STATE_NEW);
+	m_flush_period = std::chrono::microseconds(usec);
+}
+
+chat_buf*
+chat_server_ctx::buf_get()
+{
+	return m_buf_pool.get();
+}
+
+void
+chat_server_ctx::buf_release(
+	chat_buf* buf)
+{
+	if (buf->m_refs.fetch_sub(1) == 1)
+		m_buf_pool.put(buf);
+}
+
+void
+chat_server_ctx::priv_in_strand_accept(
+	size_t idx)
 {
 	assert(m_strand.running_in_this_thread());
-	assert(m_state == CHAT_SERVER_STATE_LISTEN);
-	m_sock.async_accept(boost::asio::bind_executor(m_strand, std::bind(
-		&chat_server_ctx::priv_in_strand_on_accept, shared_from_this(),
+	if (m_state != CHAT_SERVER_STATE_LISTEN)
+		return;
+	// The accepted socket is created on the acceptor's io_context - that is what
+	// pins the future peer to this acceptor's reactor. The handler itself still
+	// hops to the control strand to touch the membership.
+	m_socks[idx]->async_accept(boost::asio::bind_executor(m_strand, std::bind(
+		&chat_server_ctx::priv_in_strand_on_accept, shared_from_this(), idx,
 		std::placeholders::_1, std::placeholders::_2)));
 }
 
 void
 chat_server_ctx::priv_in_strand_on_accept(
+	size_t idx,
 	const boost::system::error_code& err,
 	boost::asio::ip::tcp::socket sock)
 {
@@ -459,7 +863,8 @@ chat_server_ctx::priv_in_strand_on_accept(
 		std::move(sock), shared_from_this());
 	peer->start();
 	m_peers.emplace_back(std::move(peer));
-	priv_in_strand_accept();
+	priv_in_strand_update_snapshot();
+	priv_in_strand_accept(idx);
 }
 
 void
@@ -469,10 +874,15 @@ chat_server_ctx::priv_in_strand_stop()
 	if (m_state != CHAT_SERVER_STATE_LISTEN)
 		return;
 	m_state = CHAT_SERVER_STATE_STOPPED;
-	m_sock.close();
+	for (std::unique_ptr<boost::asio::ip::tcp::acceptor>& sock : m_socks)
+		sock->close();
 	for (std::shared_ptr<chat_server_peer>& p : m_peers)
 		p->stop();
 	m_peers.clear();
+	priv_in_strand_update_snapshot();
+	// Drop the pending requests without calling them - the waiters' stack frames
+	// can be gone already when the owner is being destroyed.
+	m_reqs.clear();
 }
 
 void
@@ -493,10 +903,11 @@ void
 chat_server_ctx::priv_peer_on_recv(
 	std::unique_ptr<chat_message> msg)
 {
-	boost::asio::post(m_strand, [ref = shared_from_this(), this,
-		msg = std::move(msg)]() mutable {
+	// A hop per received message - recycle its handler memory.
+	boost::asio::post(m_strand, chat_op_bind(m_op_arena,
+		[ref = shared_from_this(), this, msg = std::move(msg)]() mutable {
 		priv_in_strand_peer_on_recv(std::move(msg));
-	});
+	}));
 }
 
 void
@@ -505,10 +916,11 @@ chat_server_ctx::priv_in_strand_peer_on_recv(
 {
 	assert(m_strand.running_in_this_thread());
 	m_in_msgs.emplace_back(std::move(msg));
-
-	// <YOUR CODE IF NEEDED>
-	//
-	// Serve the pending receive-requests if there are any.
+	while (not m_reqs.empty() and not m_in_msgs.empty()) {
+		m_reqs.front()->m_cb(CHAT_ERR_NONE, std::move(m_in_msgs.front()));
+		m_reqs.pop_front();
+		m_in_msgs.pop_front();
+	}
 }
 
 void
@@ -529,6 +941,7 @@ chat_server_ctx::priv_in_strand_peer_on_close(
 	for (auto it = m_peers.begin(); it != m_peers.end(); ++it) {
 		if (*it == peer) {
 			m_peers.erase(it);
+			priv_in_strand_update_snapshot();
 			return;
 		}
 	}
@@ -543,8 +956,41 @@ chat_server_ctx::priv_in_strand_on_new_feed(
 	std::string_view text)
 {
 	assert(m_strand.running_in_this_thread());
-	for (std::shared_ptr<chat_server_peer>& p : m_peers)
-		p->feed_async(text);
+	m_feed_buf.append(text);
+	size_t line_begin = 0;
+	size_t line_end;
+	while ((line_end = m_feed_buf.find('\n', line_begin)) != std::string::npos) {
+		std::string_view line = chat_proto_trim(std::string_view(
+			m_feed_buf.data() + line_begin, line_end - line_begin));
+		line_begin = line_end + 1;
+		if (line.empty())
+			continue;
+		std::shared_ptr<const chat_server_peer_list> subs = snapshot();
+		if (subs->empty())
+			continue;
+		chat_buf* out = buf_get();
+		// The server has no name - an empty author.
+		chat_proto_append_u32(out->m_data, 0);
+		chat_proto_append_u32(out->m_data, line.length());
+		out->m_data.append(line);
+		out->m_refs.store(subs->size(), std::memory_order_relaxed);
+		for (const std::shared_ptr<chat_server_peer>& p : *subs)
+			p->send_buf_async(out);
+	}
+	m_feed_buf.erase(0, line_begin);
+}
+
+void
+chat_server_ctx::priv_in_strand_update_snapshot()
+{
+	assert(m_strand.running_in_this_thread());
+	std::shared_ptr<chat_server_peer_list> next =
+		std::make_shared<chat_server_peer_list>();
+	next->reserve(m_peers.size());
+	for (const std::shared_ptr<chat_server_peer>& p : m_peers)
+		next->push_back(p);
+	std::atomic_store(&m_snapshot,
+		std::shared_ptr<const chat_server_peer_list>(std::move(next)));
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////
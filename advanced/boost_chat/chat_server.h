@@ -3,6 +3,7 @@
 #include "chat.h"
 
 #include <functional>
+#include <vector>
 
 namespace boost { namespace asio { class io_context; } }
 
@@ -15,12 +16,29 @@ class chat_server final
 public:
 	chat_server(
 		boost::asio::io_context& ioCtx);
+
+	// One reactor per given io_context. Each gets its own SO_REUSEPORT acceptor, so
+	// the kernel spreads the connections and each peer's IO stays on the reactor it
+	// was accepted on. The control state (membership, recv, feed) lives on the first
+	// one.
+	chat_server(
+		const std::vector<boost::asio::io_context*>& reactors);
+
 	~chat_server();
 
 	chat_errcode
 	start(
 		uint16_t port);
 
+	// Aggregate the messages arriving from one peer within the given window into a
+	// single broadcast frame, flushed with one write per subscriber when the window
+	// closes. High publish rates then cost one fan-out pass per peer per tick instead
+	// of one per message, at the price of up to 'usec' of added latency. Zero keeps
+	// the immediate per-message fan-out - the default. Call before start().
+	void
+	set_flush_period(
+		uint32_t usec);
+
 	uint16_t
 	port() const;
 
@@ -7,17 +7,23 @@
 #include <boost/asio/posix/stream_descriptor.hpp>
 #include <boost/asio/read.hpp>
 #include <iostream>
+#include <thread>
 
 class chat_server_app final
 {
 public:
 	chat_server_app(
-		uint16_t port);
+		uint16_t port,
+		uint32_t reactor_count);
 
 	int
 	run();
 
 private:
+	std::vector<boost::asio::io_context*>
+	priv_make_reactors(
+		uint32_t reactor_count);
+
 	void
 	priv_recv_next();
 
@@ -35,6 +41,10 @@ private:
 		size_t size);
 
 	boost::asio::io_context m_ioctx;
+	// The extra reactors beyond m_ioctx, each run by its own thread. The app's own
+	// strand, stdin and recv loop stay on m_ioctx, which the main thread runs.
+	std::vector<std::unique_ptr<boost::asio::io_context>> m_extra_ioctx;
+	std::vector<std::thread> m_workers;
 	boost::asio::io_context::strand m_strand;
 	chat_server m_server;
 
@@ -61,9 +71,10 @@ port_from_str(const char *str, uint16_t *port)
 }
 
 chat_server_app::chat_server_app(
-	uint16_t port)
+	uint16_t port,
+	uint32_t reactor_count)
 	: m_strand(m_ioctx)
-	, m_server(m_ioctx)
+	, m_server(priv_make_reactors(reactor_count))
 	, m_input(m_ioctx, dup(STDIN_FILENO))
 	, m_res(0)
 {
@@ -72,11 +83,37 @@ chat_server_app::chat_server_app(
 	boost::asio::post(m_strand, std::bind(&chat_server_app::priv_read_next, this));
 }
 
+std::vector<boost::asio::io_context*>
+chat_server_app::priv_make_reactors(
+	uint32_t reactor_count)
+{
+	assert(reactor_count > 0);
+	std::vector<boost::asio::io_context*> reactors;
+	reactors.push_back(&m_ioctx);
+	for (uint32_t i = 1; i < reactor_count; ++i) {
+		m_extra_ioctx.push_back(std::make_unique<boost::asio::io_context>());
+		reactors.push_back(m_extra_ioctx.back().get());
+	}
+	return reactors;
+}
+
 int
 chat_server_app::run()
 {
 	boost::asio::executor_work_guard<boost::asio::io_context::executor_type> work(m_ioctx.get_executor());
+	for (std::unique_ptr<boost::asio::io_context>& ioctx : m_extra_ioctx) {
+		m_workers.emplace_back([ioctxp = ioctx.get()]() {
+			boost::asio::executor_work_guard<
+				boost::asio::io_context::executor_type> work(
+					ioctxp->get_executor());
+			ioctxp->run();
+		});
+	}
 	m_ioctx.run();
+	for (std::unique_ptr<boost::asio::io_context>& ioctx : m_extra_ioctx)
+		ioctx->stop();
+	for (std::thread& w : m_workers)
+		w.join();
 	return m_res;
 }
 
@@ -84,9 +121,14 @@ void
 chat_server_app::priv_recv_next()
 {
 	assert(m_strand.running_in_this_thread());
-	m_server.recv_async(boost::asio::bind_executor(m_strand,
-		std::bind(&chat_server_app::priv_on_recv, this, std::placeholders::_1,
-			std::placeholders::_2)));
+	// bind_executor() would not survive the type erasure into std::function
+	// inside recv_async() - hop back to the strand explicitly.
+	m_server.recv_async([this](chat_errcode err, std::unique_ptr<chat_message> msg) {
+		boost::asio::post(m_strand,
+			[this, err, msg = std::move(msg)]() mutable {
+			priv_on_recv(err, std::move(msg));
+		});
+	});
 }
 
 void
@@ -140,7 +182,7 @@ int
 main(int argc, char **argv)
 {
 	if (argc < 2) {
-		std::cout << "Expected a port to listen on\n";
+		std::cout << "Expected a port to listen on and an optional reactor count\n";
 		return -1;
 	}
 	uint16_t port = 0;
@@ -149,6 +191,15 @@ main(int argc, char **argv)
 		std::cout << "Invalid port\n";
 		return -1;
 	}
-	chat_server_app app(port);
+	long reactor_count = 1;
+	if (argc >= 3) {
+		char *end = NULL;
+		reactor_count = strtol(argv[2], &end, 10);
+		if (*end != 0 || reactor_count < 1 || reactor_count > 1024) {
+			std::cout << "Invalid reactor count\n";
+			return -1;
+		}
+	}
+	chat_server_app app(port, reactor_count);
 	return app.run();
 }
@@ -67,7 +67,7 @@ struct test_msg final
 		memset(m_data.data(), '0', TEST_MSG_ID_LEN);
 		for (size_t i = TEST_MSG_ID_LEN; i < len; ++i)
 			m_data[i] = 'a' + i % ('z' - 'a' + 1);
-		m_data[len] = '\n';
+		m_data[len - 1] = '\n';
 	}
 
 	void
@@ -373,7 +373,7 @@ test_multi_client(void)
 
 	unit_msg("Connect clients");
 	std::vector<std::unique_ptr<chat_client>> clis;
-	clis.resize(client_count);
+	clis.reserve(client_count);
 	for (uint32_t i = 0; i < client_count; ++i) {
 		clis.emplace_back(std::make_unique<chat_client>(
 			core.backend(), "cli_" + std::to_string(i)));
@@ -438,6 +438,55 @@ test_multi_client(void)
 	}
 }
 
+static void
+test_flush_ticks()
+{
+	unit_test_start();
+
+	io_core core;
+	core.start(3);
+
+	chat_server server(core.backend());
+	server.set_flush_period(1000);
+	unit_assert(server.start(0) == CHAT_ERR_NONE);
+	std::string endpoint = make_addr_str(server.port());
+
+	chat_client c1(core.backend(), "c1");
+	unit_assert(client_connect_blocking(c1, endpoint) == CHAT_ERR_NONE);
+	chat_client c2(core.backend(), "c2");
+	unit_assert(client_connect_blocking(c2, endpoint) == CHAT_ERR_NONE);
+
+	const uint32_t msg_count = 100;
+	unit_msg("Send a burst into one window");
+	for (uint32_t i = 0; i < msg_count; ++i)
+		c1.feed_async("msg" + std::to_string(i) + "\n");
+	//
+	// The server-side recv is not delayed by the window - only the fan-out is.
+	//
+	for (uint32_t i = 0; i < msg_count; ++i) {
+		std::unique_ptr<chat_message> msg = server_recv_blocking(server);
+		unit_assert(msg->m_data == "msg" + std::to_string(i));
+		unit_assert(msg->m_author == "c1");
+	}
+	unit_check(true, "the server got the burst untouched");
+	//
+	// The subscriber gets the whole burst too, in order, through the aggregated
+	// tick flushes.
+	//
+	for (uint32_t i = 0; i < msg_count; ++i) {
+		std::unique_ptr<chat_message> msg = client_recv_blocking(c2);
+		unit_assert(msg->m_data == "msg" + std::to_string(i));
+		unit_assert(msg->m_author == "c1");
+	}
+	unit_check(true, "the subscriber got the burst in order");
+	//
+	// A lone message also leaves when its window closes, not never.
+	//
+	c1.feed_async("tail\n");
+	std::unique_ptr<chat_message> msg = client_recv_blocking(c2);
+	unit_check(msg->m_data == "tail", "a lone message is flushed");
+}
+
 struct test_stress_ctx final
 {
 	uint32_t msg_count;
@@ -523,6 +572,68 @@ test_stress()
 		threads[i]->join();
 }
 
+static void
+test_multi_reactor()
+{
+	unit_test_start();
+
+	const uint32_t reactor_count = 3;
+	const uint32_t cli_count = 9;
+	const uint32_t msg_count = 100;
+	// Separate io_contexts, not just threads on one - each reactor owns its peers'
+	// IO, and the kernel's SO_REUSEPORT balancing decides which one gets whom.
+	io_core cores[reactor_count];
+	std::vector<boost::asio::io_context*> reactors;
+	for (io_core& core : cores) {
+		core.start(2);
+		reactors.push_back(&core.backend());
+	}
+	chat_server server(reactors);
+	unit_assert(server.start(0) == CHAT_ERR_NONE);
+
+	unit_msg("Connect the clients");
+	std::vector<std::unique_ptr<chat_client>> clis;
+	for (uint32_t i = 0; i < cli_count; ++i) {
+		clis.push_back(std::make_unique<chat_client>(
+			cores[i % reactor_count].backend(), "cli_" + std::to_string(i)));
+		unit_assert(client_connect_blocking(
+			*clis[i], make_addr_str(server.port())) == CHAT_ERR_NONE);
+	}
+	unit_msg("Send from all clients");
+	test_msg req;
+	req.create(128);
+	for (uint32_t i = 0; i < cli_count; ++i) {
+		for (uint32_t j = 0; j < msg_count; ++j) {
+			req.set_id(i, j);
+			clis[i]->feed_async(req.m_data);
+		}
+	}
+	unit_msg("Receive all on the server");
+	std::vector<uint32_t> msg_counts;
+	msg_counts.resize(cli_count, 0);
+	for (uint32_t i = 0; i < cli_count * msg_count; ++i) {
+		std::unique_ptr<chat_message> rsp = server_recv_blocking(server);
+		uint32_t cli_id = 0;
+		uint32_t msg_id = 0;
+		chat_message_extract_id(*rsp, &cli_id, &msg_id);
+		unit_assert(cli_id < cli_count);
+		// Cross-client order is arbitrary, but each client's own
+		// messages keep their order regardless of its reactor.
+		unit_assert(msg_counts[cli_id] == msg_id);
+		++msg_counts[cli_id];
+	}
+	unit_msg("Broadcast across the reactors");
+	server.feed_async("ping\n");
+	for (uint32_t i = 0; i < cli_count; ++i) {
+		std::unique_ptr<chat_message> rsp;
+		// Skip the fan-out of the clients' own messages.
+		do {
+			rsp = client_recv_blocking(*clis[i]);
+		} while (rsp->m_data != "ping");
+		unit_check(rsp->m_author.empty(), "server feed has no author");
+	}
+}
+
 static void
 test_big_author()
 {
@@ -561,7 +672,8 @@ test_big_author()
 
 	cli1.feed_async(body);
 	std::unique_ptr<chat_message> rsp = server_recv_blocking(server);
-	body[body_len] = 0;
+	// Drop the '\n' - it is a separator, not a part of the message.
+	body.resize(body_len);
 	unit_check(rsp->m_data == body, "msg data");
 	unit_check(rsp->m_author == author1, "msg author");
 
@@ -580,7 +692,9 @@ main(void)
 	test_big_messages();
 	test_multi_feed();
 	test_multi_client();
+	test_flush_ticks();
 	test_stress();
+	test_multi_reactor();
 	test_big_author();
 	return 0;
 }
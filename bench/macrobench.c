@@ -0,0 +1,298 @@
+#include "libcoro.h"
+#include "corobus.h"
+#include "parser.h"
+#include "userfs.h"
+#include "thread_pool.h"
+#include "clock.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * End-to-end macro benchmark composing the assignments' libraries the
+ * way a real service would: a command stream is parsed (2/), each
+ * command is executed as a thread pool task (4/), the results are
+ * written through userfs (3/) and published over corobus (1/) to a
+ * consumer coroutine. The per-module benchmarks can all stay green
+ * while a scheduler or allocator change hurts exactly this
+ * composition - this one measures the whole path.
+ *
+ * The compute runs on the pool; parsing, the userfs writes and the
+ * bus traffic run on the main thread's coroutines, mirroring the
+ * event-loop-plus-workers split of the servers. Reported are the
+ * end-to-end throughput and the per-line latency percentiles, from
+ * right before a line is parsed until its result arrives at the
+ * consumer. The output is CSV like the module benches.
+ *
+ * Build with 'make bench'.
+ */
+
+enum {
+	MACRO_LINE_COUNT = 10000,
+	/* Lines in flight at once - the pipeline depth. */
+	MACRO_WINDOW = 256,
+	MACRO_POOL_SIZE = 4,
+	/* Smaller than the window, so sends exercise backpressure. */
+	MACRO_CHANNEL_LIMIT = 128,
+	MACRO_SPIN_MIN = 200,
+	MACRO_SPIN_MAX = 800,
+	MACRO_RECORD_SIZE = 16,
+};
+
+static const char *macro_file_name = "macrobench_results";
+
+struct macro_req {
+	struct thread_task *task;
+	uint32_t id;
+	uint32_t spin;
+	uint64_t start_ns;
+	uint64_t result;
+};
+
+struct macro_ctx {
+	struct parser *parser;
+	struct thread_pool *pool;
+	struct coro_bus *bus;
+	int channel;
+	int fd;
+	char *script;
+	struct macro_req *reqs;
+	/* Producer, completer and consumer positions in the stream. */
+	int pushed;
+	int completed;
+	int received;
+	uint64_t *latency_ns;
+};
+
+static void
+die(const char *what, int rc)
+{
+	fprintf(stderr, "%s failed, error %d\n", what, rc);
+	exit(1);
+}
+
+static void
+report(const char *key, int threads, double value, const char *unit)
+{
+	printf("%s,%d,%.3f,%s\n", key, threads, value, unit);
+}
+
+static int
+u64_cmp(const void *a, const void *b)
+{
+	uint64_t l = *(const uint64_t *)a;
+	uint64_t r = *(const uint64_t *)b;
+	return l < r ? -1 : l > r;
+}
+
+/* The task body - a few microseconds of pure compute. */
+static void *
+macro_task_f(void *arg)
+{
+	struct macro_req *req = arg;
+	uint64_t x = req->id + 0x9e3779b97f4a7c15ull;
+	for (uint32_t i = 0; i < req->spin; ++i) {
+		x ^= x >> 30;
+		x *= 0xbf58476d1ce4e5b9ull;
+		x ^= x >> 27;
+	}
+	req->result = x;
+	return NULL;
+}
+
+/* A script of 'work <id> <spin>' lines, some piped into a filter
+ * stage so the parser sees multi-expression lines too. */
+static char *
+macro_script_new(void)
+{
+	size_t capacity = MACRO_LINE_COUNT * 48;
+	char *script = malloc(capacity);
+	if (script == NULL)
+		die("script alloc", 0);
+	size_t size = 0;
+	uint32_t spin = MACRO_SPIN_MIN;
+	for (int i = 0; i < MACRO_LINE_COUNT; ++i) {
+		size += snprintf(script + size, capacity - size,
+				 i % 4 == 0 ? "work %u %u | filter\n" :
+				 "work %u %u\n", (unsigned)i,
+				 (unsigned)spin);
+		spin = spin * 13 % (MACRO_SPIN_MAX - MACRO_SPIN_MIN) +
+			MACRO_SPIN_MIN;
+	}
+	return script;
+}
+
+/* Parse the next line and push its work onto the pool. */
+static void *
+macro_producer_f(void *arg)
+{
+	struct macro_ctx *ctx = arg;
+	while (ctx->pushed < MACRO_LINE_COUNT) {
+		if (ctx->pushed - ctx->completed >= MACRO_WINDOW) {
+			coro_sleep(0.0002);
+			continue;
+		}
+		struct macro_req *req = &ctx->reqs[ctx->pushed];
+		req->start_ns = fclock_now_ns();
+		struct command_line *line;
+		enum parser_error err = parser_pop_next(ctx->parser, &line);
+		if (err != PARSER_ERR_NONE || line == NULL)
+			die("parser_pop_next", err);
+		struct command *cmd = &line->head->cmd;
+		if (cmd->arg_count < 2)
+			die("bad line", 0);
+		req->id = strtoul(cmd->args[0], NULL, 10);
+		req->spin = strtoul(cmd->args[1], NULL, 10);
+		parser_recycle(ctx->parser, line);
+		int rc = thread_task_new(&req->task, macro_task_f, req);
+		if (rc != 0)
+			die("thread_task_new", rc);
+		rc = thread_pool_push_task(ctx->pool, req->task);
+		if (rc != 0)
+			die("thread_pool_push_task", rc);
+		++ctx->pushed;
+	}
+	return NULL;
+}
+
+/* Join finished tasks in order, persist each result through userfs
+ * and publish the id on the bus. */
+static void *
+macro_completer_f(void *arg)
+{
+	struct macro_ctx *ctx = arg;
+	while (ctx->completed < MACRO_LINE_COUNT) {
+		if (ctx->completed == ctx->pushed) {
+			coro_yield();
+			continue;
+		}
+		struct macro_req *req = &ctx->reqs[ctx->completed];
+		if (!thread_task_is_finished(req->task)) {
+			/* Let the workers actually run. */
+			coro_sleep(0.0002);
+			continue;
+		}
+		void *result;
+		int rc = thread_task_join(req->task, &result);
+		if (rc != 0)
+			die("thread_task_join", rc);
+		rc = thread_task_delete(req->task);
+		if (rc != 0)
+			die("thread_task_delete", rc);
+		char record[MACRO_RECORD_SIZE];
+		memcpy(record, &req->id, sizeof(req->id));
+		memcpy(record + 8, &req->result, sizeof(req->result));
+		ssize_t wrc = ufs_pwrite(ctx->fd, record, sizeof(record),
+					 (size_t)req->id * MACRO_RECORD_SIZE);
+		if (wrc != MACRO_RECORD_SIZE)
+			die("ufs_pwrite", ufs_errno());
+		if (coro_bus_send(ctx->bus, ctx->channel, req->id) != 0)
+			die("coro_bus_send", coro_bus_errno());
+		++ctx->completed;
+	}
+	return NULL;
+}
+
+/* The end of the pipeline - the latency clock stops here. */
+static void *
+macro_consumer_f(void *arg)
+{
+	struct macro_ctx *ctx = arg;
+	while (ctx->received < MACRO_LINE_COUNT) {
+		unsigned id;
+		if (coro_bus_recv(ctx->bus, ctx->channel, &id) != 0)
+			die("coro_bus_recv", coro_bus_errno());
+		if (id >= MACRO_LINE_COUNT)
+			die("bad id", id);
+		ctx->latency_ns[id] = fclock_now_ns() -
+			ctx->reqs[id].start_ns;
+		++ctx->received;
+	}
+	return NULL;
+}
+
+/* Read every record back and check nothing got lost on the way. */
+static void
+macro_verify(struct macro_ctx *ctx)
+{
+	char record[MACRO_RECORD_SIZE];
+	for (int i = 0; i < MACRO_LINE_COUNT; ++i) {
+		ssize_t rc = ufs_pread(ctx->fd, record, sizeof(record),
+				       (size_t)i * MACRO_RECORD_SIZE);
+		if (rc != MACRO_RECORD_SIZE)
+			die("ufs_pread", ufs_errno());
+		uint32_t id;
+		memcpy(&id, record, sizeof(id));
+		if (id != (uint32_t)i)
+			die("record mismatch", i);
+		struct macro_req check = {.id = i,
+			.spin = ctx->reqs[i].spin};
+		macro_task_f(&check);
+		if (memcmp(record + 8, &check.result,
+			   sizeof(check.result)) != 0)
+			die("result mismatch", i);
+	}
+}
+
+int
+main(void)
+{
+	struct macro_ctx ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.script = macro_script_new();
+	ctx.reqs = calloc(MACRO_LINE_COUNT, sizeof(*ctx.reqs));
+	ctx.latency_ns = calloc(MACRO_LINE_COUNT, sizeof(*ctx.latency_ns));
+	if (ctx.reqs == NULL || ctx.latency_ns == NULL)
+		die("alloc", 0);
+	ctx.parser = parser_new();
+	parser_feed_borrowed(ctx.parser, ctx.script,
+			     (uint32_t)strlen(ctx.script));
+	int rc = thread_pool_new(MACRO_POOL_SIZE, &ctx.pool);
+	if (rc != 0)
+		die("thread_pool_new", rc);
+	ctx.bus = coro_bus_new();
+	ctx.channel = coro_bus_channel_open(ctx.bus, MACRO_CHANNEL_LIMIT);
+	if (ctx.channel < 0)
+		die("coro_bus_channel_open", coro_bus_errno());
+	ctx.fd = ufs_open(macro_file_name, UFS_CREATE);
+	if (ctx.fd < 0)
+		die("ufs_open", ufs_errno());
+
+	coro_sched_init();
+	uint64_t start_ns = fclock_now_ns();
+	struct coro *producer = coro_new(macro_producer_f, &ctx);
+	struct coro *completer = coro_new(macro_completer_f, &ctx);
+	struct coro *consumer = coro_new(macro_consumer_f, &ctx);
+	coro_sched_run();
+	uint64_t total_ns = fclock_now_ns() - start_ns;
+	coro_join(producer);
+	coro_join(completer);
+	coro_join(consumer);
+	coro_sched_destroy();
+
+	macro_verify(&ctx);
+	qsort(ctx.latency_ns, MACRO_LINE_COUNT, sizeof(ctx.latency_ns[0]),
+	      u64_cmp);
+	double rate = MACRO_LINE_COUNT / (total_ns * 1e-9);
+	report("pipeline_throughput", MACRO_POOL_SIZE, rate, "lines/sec");
+	report("pipeline_latency_p50", MACRO_POOL_SIZE,
+	       ctx.latency_ns[MACRO_LINE_COUNT / 2] * 1e-3, "us");
+	report("pipeline_latency_p90", MACRO_POOL_SIZE,
+	       ctx.latency_ns[MACRO_LINE_COUNT * 9 / 10] * 1e-3, "us");
+	report("pipeline_latency_p99", MACRO_POOL_SIZE,
+	       ctx.latency_ns[MACRO_LINE_COUNT * 99 / 100] * 1e-3, "us");
+	report("pipeline_latency_max", MACRO_POOL_SIZE,
+	       ctx.latency_ns[MACRO_LINE_COUNT - 1] * 1e-3, "us");
+
+	if (ufs_close(ctx.fd) != 0 || ufs_delete(macro_file_name) != 0)
+		die("ufs cleanup", ufs_errno());
+	coro_bus_channel_close(ctx.bus, ctx.channel);
+	coro_bus_delete(ctx.bus);
+	thread_pool_delete(ctx.pool);
+	parser_delete(ctx.parser);
+	free(ctx.latency_ns);
+	free(ctx.reqs);
+	free(ctx.script);
+	return 0;
+}
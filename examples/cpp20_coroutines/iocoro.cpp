@@ -2,16 +2,176 @@
 
 #include <cassert>
 #include <cstring>
-#include <sys/epoll.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#if IOCORE_USE_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#else
+#include <sys/epoll.h>
+#endif
 
+#if !IOCORE_USE_URING
 static constexpr int theEpollBatchSize = 128;
+#endif
 
 std::atomic_int IOCoroutinePromise::theCount{0};
 std::atomic_int IOTask::theCount{0};
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
+// The coroutine frame arena. Frames of one size class are linked through their first
+// bytes when free, and new ones are bumped off the current slab. The slabs are never
+// returned to the heap - a frame freed on a foreign thread simply lands in that thread's
+// free list, and the memory stays valid because no slab ever dies. By the process exit
+// the arena holds at most a few warm slabs per thread.
+
+// Each class is twice the previous one, starting at the minimal class size.
+static constexpr size_t thePromiseMinClassSize = 64;
+static constexpr size_t thePromiseMaxClassSize = 4096;
+static constexpr uint32_t thePromiseClassCount = 7;
+static constexpr size_t thePromiseSlabSize = 64 * 1024;
+
+namespace
+{
+
+struct PromiseArena
+{
+	void *
+	alloc(
+		size_t size);
+
+	void
+	free(
+		void *ptr,
+		size_t size);
+
+private:
+	char *mySlabPos = nullptr;
+	size_t mySlabLeft = 0;
+	void *myFreeLists[thePromiseClassCount] = {};
+};
+
+}
+
+static thread_local PromiseArena thePromiseArena;
+
+static uint32_t
+promiseClassOf(
+	size_t size,
+	size_t *classSize)
+{
+	uint32_t cls = 0;
+	size_t bytes = thePromiseMinClassSize;
+	while (bytes < size)
+	{
+		bytes <<= 1;
+		++cls;
+	}
+	*classSize = bytes;
+	return cls;
+}
+
+void *
+PromiseArena::alloc(
+	size_t size)
+{
+	if (size > thePromiseMaxClassSize)
+	{
+		// An abnormally big frame. Not worth a slab.
+		return ::operator new(size);
+	}
+	size_t bytes;
+	uint32_t cls = promiseClassOf(size, &bytes);
+	void *&list = myFreeLists[cls];
+	if (list != nullptr)
+	{
+		void *res = list;
+		list = *(void **)res;
+		return res;
+	}
+	if (mySlabLeft < bytes)
+	{
+		// The old slab's tail is wasted. At most one minimal-class-short-of-max per
+		// slab, which is noise compared to the slab size.
+		mySlabPos = (char *)::operator new(thePromiseSlabSize);
+		mySlabLeft = thePromiseSlabSize;
+	}
+	void *res = mySlabPos;
+	mySlabPos += bytes;
+	mySlabLeft -= bytes;
+	return res;
+}
+
+void
+PromiseArena::free(
+	void *ptr,
+	size_t size)
+{
+	if (size > thePromiseMaxClassSize)
+	{
+		::operator delete(ptr);
+		return;
+	}
+	size_t bytes;
+	uint32_t cls = promiseClassOf(size, &bytes);
+	*(void **)ptr = myFreeLists[cls];
+	myFreeLists[cls] = ptr;
+}
+
+void *
+IOCoroutinePromise::operator new(
+	size_t size)
+{
+	return thePromiseArena.alloc(size);
+}
+
+void
+IOCoroutinePromise::operator delete(
+	void *ptr,
+	size_t size)
+{
+	thePromiseArena.free(ptr, size);
+}
+
+#if IOCORE_USE_URING
+
+// Distilled liburing. The ring syscalls have no glibc wrappers.
+static int
+ioUringSetup(
+	uint32_t entries,
+	io_uring_params *params)
+{
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int
+ioUringEnter(
+	int fd,
+	uint32_t toSubmit,
+	uint32_t minComplete,
+	uint32_t flags)
+{
+	return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0);
+}
+
+// The CQE user_data values which are not AsyncOperation pointers.
+static constexpr uint64_t theEventFdUserData = 0;
+static constexpr uint64_t theCancelUserData = 1;
+static constexpr uint64_t theTimerFdUserData = 2;
+
+static constexpr uint32_t theSqEntryCount = 512;
+
+#endif
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
 AsyncOperation::AsyncOperation(IOTask *sub)
 	: myTask(sub)
 {
@@ -38,9 +198,33 @@ AsyncRecv::AsyncRecv(
 	, mySize(size)
 	, myRes(-1)
 {
+#if IOCORE_USE_URING
+	myTask->myCore.prepSqe(IORING_OP_RECV, myTask->myFd, myData, mySize, 0, this);
+#else
 	execute();
+#endif
+}
+
+#if IOCORE_USE_URING
+
+void
+AsyncRecv::onCQE(
+	int res)
+{
+	if (myTask->myState == IO_TASK_STATE_DELETING || res < 0)
+	{
+		// Cancellation or a socket error.
+		myRes = -1;
+	}
+	else
+	{
+		myRes = res;
+	}
+	myCoro.resume();
 }
 
+#else
+
 void
 AsyncRecv::execute()
 {
@@ -54,6 +238,13 @@ AsyncRecv::execute()
 	myTask->myEventsReady &= ~IO_EVENT_READ;
 }
 
+void
+AsyncRecv::cancel()
+{
+	myRes = -1;
+	myCoro.resume();
+}
+
 bool
 AsyncRecv::onIOEvent()
 {
@@ -61,9 +252,7 @@ AsyncRecv::onIOEvent()
 	{
 		if (myTask->myState == IO_TASK_STATE_DELETING)
 		{
-			// Cancellation.
-			myRes = -1;
-			myCoro.resume();
+			cancel();
 			return true;
 		}
 		return false;
@@ -76,6 +265,8 @@ AsyncRecv::onIOEvent()
 	return true;
 }
 
+#endif
+
 //////////////////////////////////////////////////////////////////////////////////////////
 
 AsyncSend::AsyncSend(
@@ -87,9 +278,28 @@ AsyncSend::AsyncSend(
 	, mySize(size)
 	, myRes(-1)
 {
+#if IOCORE_USE_URING
+	myTask->myCore.prepSqe(IORING_OP_SEND, myTask->myFd, myData, mySize, 0, this);
+#else
 	execute();
+#endif
+}
+
+#if IOCORE_USE_URING
+
+void
+AsyncSend::onCQE(
+	int res)
+{
+	if (myTask->myState == IO_TASK_STATE_DELETING || res < 0)
+		myRes = -1;
+	else
+		myRes = res;
+	myCoro.resume();
 }
 
+#else
+
 void
 AsyncSend::execute()
 {
@@ -103,6 +313,13 @@ AsyncSend::execute()
 	myTask->myEventsReady &= ~IO_EVENT_WRITE;
 }
 
+void
+AsyncSend::cancel()
+{
+	myRes = -1;
+	myCoro.resume();
+}
+
 bool
 AsyncSend::onIOEvent()
 {
@@ -110,9 +327,115 @@ AsyncSend::onIOEvent()
 	{
 		if (myTask->myState == IO_TASK_STATE_DELETING)
 		{
-			// Cancellation.
-			myRes = -1;
-			myCoro.resume();
+			cancel();
+			return true;
+		}
+		return false;
+	}
+	execute();
+	// Could be a spurious wakeup.
+	if (myRes < 0)
+		return false;
+	myCoro.resume();
+	return true;
+}
+
+#endif
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+AsyncSendMsg::AsyncSendMsg(
+	IOTask *sub,
+	const iovec *iov,
+	int iovCount,
+	bool isZeroCopy)
+	: AsyncOperation(sub)
+	, myIsZeroCopy(isZeroCopy)
+	, myIsSent(false)
+	, myRes(-1)
+{
+	memset(&myMsg, 0, sizeof(myMsg));
+	// sendmsg() takes the iovec array non-const although it never writes it.
+	myMsg.msg_iov = const_cast<iovec *>(iov);
+	myMsg.msg_iovlen = iovCount;
+#if IOCORE_USE_URING
+	myTask->myCore.prepSqe(myIsZeroCopy ? IORING_OP_SENDMSG_ZC : IORING_OP_SENDMSG,
+		myTask->myFd, &myMsg, 1, 0, this);
+#else
+	execute();
+#endif
+}
+
+#if IOCORE_USE_URING
+
+void
+AsyncSendMsg::onCQE(
+	int res)
+{
+	if (myIsSent)
+	{
+		// The buffer-release notification of a zerocopy send. The result was
+		// already recorded by the send completion itself - only the resume was
+		// held back until the kernel let the buffers go.
+	}
+	else if (myTask->myState == IO_TASK_STATE_DELETING || res < 0)
+	{
+		myRes = -1;
+	}
+	else
+	{
+		myRes = res;
+	}
+	myCoro.resume();
+}
+
+void
+AsyncSendMsg::onCQEMore(
+	int res)
+{
+	// The zerocopy send result. The kernel still reads the buffers - the resume
+	// waits for the release notification.
+	assert(myIsZeroCopy);
+	assert(!myIsSent);
+	myIsSent = true;
+	if (myTask->myState == IO_TASK_STATE_DELETING || res < 0)
+		myRes = -1;
+	else
+		myRes = res;
+}
+
+#else
+
+void
+AsyncSendMsg::execute()
+{
+	if ((myTask->myEventsReady & IO_EVENT_WRITE) == 0)
+		return;
+	// The zerocopy flag is an io_uring-only optimization - without the ring there
+	// is no completion channel for the buffer-release notifications.
+	myRes = sendmsg(myTask->myFd, &myMsg, 0);
+	if (myRes >= 0)
+		return;
+	assert(errno == EWOULDBLOCK);
+	// Can't write anymore. Need to wait for a new write-event.
+	myTask->myEventsReady &= ~IO_EVENT_WRITE;
+}
+
+void
+AsyncSendMsg::cancel()
+{
+	myRes = -1;
+	myCoro.resume();
+}
+
+bool
+AsyncSendMsg::onIOEvent()
+{
+	if ((myTask->myEventsReady & IO_EVENT_WRITE) == 0)
+	{
+		if (myTask->myState == IO_TASK_STATE_DELETING)
+		{
+			cancel();
 			return true;
 		}
 		return false;
@@ -125,6 +448,8 @@ AsyncSend::onIOEvent()
 	return true;
 }
 
+#endif
+
 //////////////////////////////////////////////////////////////////////////////////////////
 
 AsyncAccept::AsyncAccept(
@@ -136,9 +461,29 @@ AsyncAccept::AsyncAccept(
 	, mySize(size)
 	, myRes(-1)
 {
+#if IOCORE_USE_URING
+	myTask->myCore.prepSqe(IORING_OP_ACCEPT, myTask->myFd, myAddr, 0,
+		(uint64_t)(uintptr_t)mySize, this);
+#else
 	execute();
+#endif
+}
+
+#if IOCORE_USE_URING
+
+void
+AsyncAccept::onCQE(
+	int res)
+{
+	if (myTask->myState == IO_TASK_STATE_DELETING || res < 0)
+		myRes = -1;
+	else
+		myRes = res;
+	myCoro.resume();
 }
 
+#else
+
 void
 AsyncAccept::execute()
 {
@@ -152,6 +497,13 @@ AsyncAccept::execute()
 	myTask->myEventsReady &= ~IO_EVENT_READ;
 }
 
+void
+AsyncAccept::cancel()
+{
+	myRes = -1;
+	myCoro.resume();
+}
+
 bool
 AsyncAccept::onIOEvent()
 {
@@ -159,9 +511,130 @@ AsyncAccept::onIOEvent()
 	{
 		if (myTask->myState == IO_TASK_STATE_DELETING)
 		{
-			// Cancellation.
-			myRes = -1;
-			myCoro.resume();
+			cancel();
+			return true;
+		}
+		return false;
+	}
+	execute();
+	// Could be a spurious wakeup.
+	if (myRes < 0)
+		return false;
+	myCoro.resume();
+	return true;
+}
+
+#endif
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+AsyncAcceptMany::AsyncAcceptMany(
+	IOTask *sub,
+	int *fds,
+	int capacity)
+	: AsyncOperation(sub)
+	, myFds(fds)
+	, myCapacity(capacity)
+	, myRes(-1)
+{
+	assert(capacity > 0);
+#if IOCORE_USE_URING
+	// The ring has no batched accept in this design - one op per task. The first
+	// connection arrives through the ring, the rest of the backlog is collected
+	// synchronously in onCQE() before the single resume.
+	myTask->myCore.prepSqe(IORING_OP_ACCEPT, myTask->myFd, nullptr, 0, 0, this);
+#else
+	execute();
+#endif
+}
+
+void
+AsyncAcceptMany::drain()
+{
+#if IOCORE_USE_URING
+	// With io_uring the subscribed fds are kept blocking - readiness is the ring's
+	// job. The drain is the one place doing direct accepts, so flip the flag just
+	// for its duration.
+	int flags = fcntl(myTask->myFd, F_GETFL, 0);
+	assert(flags >= 0);
+	int rc = fcntl(myTask->myFd, F_SETFL, flags | O_NONBLOCK);
+	assert(rc == 0);
+	MAYBE_UNUSED(rc);
+#endif
+	while (myRes < myCapacity)
+	{
+		int sock = accept4(myTask->myFd, nullptr, nullptr, 0);
+		if (sock < 0)
+		{
+			assert(errno == EWOULDBLOCK);
+#if !IOCORE_USE_URING
+			// The backlog is dry - the next batch needs a new read-event.
+			myTask->myEventsReady &= ~IO_EVENT_READ;
+#endif
+			break;
+		}
+		myFds[myRes++] = sock;
+	}
+#if IOCORE_USE_URING
+	rc = fcntl(myTask->myFd, F_SETFL, flags);
+	assert(rc == 0);
+#endif
+}
+
+#if IOCORE_USE_URING
+
+void
+AsyncAcceptMany::onCQE(
+	int res)
+{
+	if (myTask->myState == IO_TASK_STATE_DELETING || res < 0)
+	{
+		myRes = -1;
+	}
+	else
+	{
+		myFds[0] = res;
+		myRes = 1;
+		drain();
+	}
+	myCoro.resume();
+}
+
+#else
+
+void
+AsyncAcceptMany::execute()
+{
+	if ((myTask->myEventsReady & IO_EVENT_READ) == 0)
+		return;
+	int sock = accept4(myTask->myFd, nullptr, nullptr, 0);
+	if (sock < 0)
+	{
+		assert(errno == EWOULDBLOCK);
+		// Can't accept anymore. Need to wait for a new read-event.
+		myTask->myEventsReady &= ~IO_EVENT_READ;
+		return;
+	}
+	myFds[0] = sock;
+	myRes = 1;
+	drain();
+}
+
+void
+AsyncAcceptMany::cancel()
+{
+	myRes = -1;
+	myCoro.resume();
+}
+
+bool
+AsyncAcceptMany::onIOEvent()
+{
+	if ((myTask->myEventsReady & IO_EVENT_READ) == 0)
+	{
+		if (myTask->myState == IO_TASK_STATE_DELETING)
+		{
+			cancel();
 			return true;
 		}
 		return false;
@@ -174,8 +647,39 @@ AsyncAccept::onIOEvent()
 	return true;
 }
 
+#endif
+
 //////////////////////////////////////////////////////////////////////////////////////////
 
+#if IOCORE_USE_URING
+
+AsyncConnect::AsyncConnect(
+	IOTask *sub,
+	const sockaddr *addr,
+	socklen_t size)
+	: AsyncOperation(sub)
+	, myAddr(addr)
+	, myAddrSize(size)
+	, myIsDone(false)
+	, myRes(-1)
+{
+	myTask->myCore.prepSqe(IORING_OP_CONNECT, myTask->myFd, myAddr, 0, myAddrSize, this);
+}
+
+void
+AsyncConnect::onCQE(
+	int res)
+{
+	myIsDone = true;
+	if (myTask->myState == IO_TASK_STATE_DELETING || res < 0)
+		myRes = -1;
+	else
+		myRes = 0;
+	myCoro.resume();
+}
+
+#else
+
 AsyncConnect::AsyncConnect(
 	IOTask *sub,
 	const sockaddr *addr,
@@ -198,6 +702,14 @@ AsyncConnect::AsyncConnect(
 	myTask->myEventsReady &= ~IO_EVENT_WRITE;
 }
 
+void
+AsyncConnect::cancel()
+{
+	myIsDone = true;
+	myRes = -1;
+	myCoro.resume();
+}
+
 bool
 AsyncConnect::onIOEvent()
 {
@@ -205,10 +717,7 @@ AsyncConnect::onIOEvent()
 	{
 		if (myTask->myState == IO_TASK_STATE_DELETING)
 		{
-			// Cancellation.
-			myIsDone = true;
-			myRes = -1;
-			myCoro.resume();
+			cancel();
 			return true;
 		}
 		return false;
@@ -219,11 +728,392 @@ AsyncConnect::onIOEvent()
 	return true;
 }
 
+#endif
+
 //////////////////////////////////////////////////////////////////////////////////////////
 
-IOTask::IOTask(
-	IOCore &core,
-	int fd)
+AsyncReadUntil::AsyncReadUntil(
+	BufferedStream *stream,
+	char delim)
+	: AsyncOperation(stream->myTask)
+	, myStream(stream)
+	, myDelim(delim)
+	, mySearchPos(0)
+	, myIsDone(false)
+{
+#if IOCORE_USE_URING
+	// When the record is already buffered, the await completes without even touching the
+	// ring.
+	if (findLine())
+		return;
+	armRecv();
+#else
+	execute();
+#endif
+}
+
+bool
+AsyncReadUntil::findLine()
+{
+	std::string_view data = myStream->data();
+	const char *pos = (const char *)memchr(data.data() + mySearchPos, myDelim,
+		data.size() - mySearchPos);
+	if (pos == nullptr)
+	{
+		mySearchPos = data.size();
+		return false;
+	}
+	myLine = myStream->consume(pos - data.data() + 1);
+	myIsDone = true;
+	return true;
+}
+
+#if IOCORE_USE_URING
+
+void
+AsyncReadUntil::armRecv()
+{
+	myStream->ensureSpace();
+	myTask->myCore.prepSqe(IORING_OP_RECV, myTask->myFd, myStream->spaceBegin(),
+		myStream->spaceSize(), 0, this);
+}
+
+void
+AsyncReadUntil::onCQE(
+	int res)
+{
+	if (myTask->myState == IO_TASK_STATE_DELETING || res <= 0)
+	{
+		// Cancellation, a socket error, or EOF before the delimiter.
+		myIsDone = true;
+		myLine = {};
+		myCoro.resume();
+		return;
+	}
+	myStream->produce(res);
+	if (findLine())
+	{
+		myCoro.resume();
+		return;
+	}
+	// No delimiter yet - keep refilling without waking the coroutine up.
+	myTask->myAsyncOp = this;
+	armRecv();
+}
+
+#else
+
+bool
+AsyncReadUntil::execute()
+{
+	while (!findLine())
+	{
+		if ((myTask->myEventsReady & IO_EVENT_READ) == 0)
+			return false;
+		myStream->ensureSpace();
+		ssize_t rc = recv(myTask->myFd, myStream->spaceBegin(), myStream->spaceSize(), 0);
+		if (rc < 0)
+		{
+			assert(errno == EWOULDBLOCK);
+			// The event is consumed, no more data to read. Wait for a new event.
+			myTask->myEventsReady &= ~IO_EVENT_READ;
+			return false;
+		}
+		if (rc == 0)
+		{
+			// EOF before the delimiter.
+			myLine = {};
+			myIsDone = true;
+			return true;
+		}
+		myStream->produce(rc);
+	}
+	return true;
+}
+
+void
+AsyncReadUntil::cancel()
+{
+	myIsDone = true;
+	myLine = {};
+	myCoro.resume();
+}
+
+bool
+AsyncReadUntil::onIOEvent()
+{
+	if ((myTask->myEventsReady & IO_EVENT_READ) == 0)
+	{
+		if (myTask->myState == IO_TASK_STATE_DELETING)
+		{
+			cancel();
+			return true;
+		}
+		return false;
+	}
+	if (!execute())
+		return false;
+	myCoro.resume();
+	return true;
+}
+
+#endif
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+AsyncReadExact::AsyncReadExact(
+	BufferedStream *stream,
+	void *data,
+	size_t size)
+	: AsyncOperation(stream->myTask)
+	, myStream(stream)
+	, myData(data)
+	, mySize(size)
+	, myGot(0)
+	, myIsDone(false)
+	, myRes(-1)
+{
+	// Take what is already buffered. The rest is received straight into the caller's
+	// buffer - no point in copying it through the stream.
+	std::string_view avail = myStream->data();
+	myGot = std::min(avail.size(), mySize);
+	memcpy(myData, avail.data(), myGot);
+	myStream->consume(myGot);
+	if (myGot == mySize)
+	{
+		myIsDone = true;
+		myRes = mySize;
+		return;
+	}
+#if IOCORE_USE_URING
+	armRecv();
+#else
+	execute();
+#endif
+}
+
+#if IOCORE_USE_URING
+
+void
+AsyncReadExact::armRecv()
+{
+	myTask->myCore.prepSqe(IORING_OP_RECV, myTask->myFd, (char *)myData + myGot,
+		mySize - myGot, 0, this);
+}
+
+void
+AsyncReadExact::onCQE(
+	int res)
+{
+	if (myTask->myState == IO_TASK_STATE_DELETING || res <= 0)
+	{
+		// Cancellation, a socket error, or EOF mid-read.
+		myIsDone = true;
+		myCoro.resume();
+		return;
+	}
+	myGot += res;
+	if (myGot == mySize)
+	{
+		myIsDone = true;
+		myRes = mySize;
+		myCoro.resume();
+		return;
+	}
+	// A partial read - keep receiving without waking the coroutine up.
+	myTask->myAsyncOp = this;
+	armRecv();
+}
+
+#else
+
+bool
+AsyncReadExact::execute()
+{
+	while (myGot < mySize)
+	{
+		if ((myTask->myEventsReady & IO_EVENT_READ) == 0)
+			return false;
+		ssize_t rc = recv(myTask->myFd, (char *)myData + myGot, mySize - myGot, 0);
+		if (rc < 0)
+		{
+			assert(errno == EWOULDBLOCK);
+			// The event is consumed, no more data to read. Wait for a new event.
+			myTask->myEventsReady &= ~IO_EVENT_READ;
+			return false;
+		}
+		if (rc == 0)
+		{
+			// EOF mid-read, myRes stays -1.
+			myIsDone = true;
+			return true;
+		}
+		myGot += rc;
+	}
+	myIsDone = true;
+	myRes = mySize;
+	return true;
+}
+
+void
+AsyncReadExact::cancel()
+{
+	myIsDone = true;
+	myCoro.resume();
+}
+
+bool
+AsyncReadExact::onIOEvent()
+{
+	if ((myTask->myEventsReady & IO_EVENT_READ) == 0)
+	{
+		if (myTask->myState == IO_TASK_STATE_DELETING)
+		{
+			cancel();
+			return true;
+		}
+		return false;
+	}
+	if (!execute())
+		return false;
+	myCoro.resume();
+	return true;
+}
+
+#endif
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+AsyncFileOperation::AsyncFileOperation(
+	IOCore &core,
+	int fd,
+	uint64_t offset)
+	: AsyncOperation(nullptr)
+	, myCore(core)
+	, myFd(fd)
+	, myOffset(offset)
+	, myRes(-1)
+{
+}
+
+bool
+AsyncFileOperation::await_suspend(
+	std::coroutine_handle<> coro)
+{
+	myCoro = coro;
+#if !IOCORE_USE_URING
+	// Only hand the operation to the worker after the handle is stored - it could
+	// finish and try the resume before the suspension otherwise.
+	myCore.fileOffload(this);
+#endif
+	return true;
+}
+
+#if IOCORE_USE_URING
+
+void
+AsyncFileOperation::onCQE(
+	int res)
+{
+	if (res < 0)
+		myRes = -1;
+	else
+		myRes = res;
+	myCoro.resume();
+}
+
+#endif
+
+AsyncFileRead::AsyncFileRead(
+	IOCore &core,
+	int fd,
+	void *data,
+	size_t size,
+	uint64_t offset)
+	: AsyncFileOperation(core, fd, offset)
+	, myData(data)
+	, mySize(size)
+{
+#if IOCORE_USE_URING
+	myCore.prepSqe(IORING_OP_READ, myFd, myData, mySize, myOffset, this);
+#endif
+}
+
+#if !IOCORE_USE_URING
+
+void
+AsyncFileRead::fileExecute()
+{
+	myRes = pread(myFd, myData, mySize, myOffset);
+}
+
+#endif
+
+AsyncFileWrite::AsyncFileWrite(
+	IOCore &core,
+	int fd,
+	const void *data,
+	size_t size,
+	uint64_t offset)
+	: AsyncFileOperation(core, fd, offset)
+	, myData(data)
+	, mySize(size)
+{
+#if IOCORE_USE_URING
+	myCore.prepSqe(IORING_OP_WRITE, myFd, myData, mySize, myOffset, this);
+#endif
+}
+
+#if !IOCORE_USE_URING
+
+void
+AsyncFileWrite::fileExecute()
+{
+	myRes = pwrite(myFd, myData, mySize, myOffset);
+}
+
+#endif
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+BufferedStream::BufferedStream(
+	IOTask *task,
+	size_t capacity)
+	: myTask(task)
+	, myBuf(capacity)
+	, myPos(0)
+	, myUsed(0)
+{
+	assert(capacity > 0);
+}
+
+void
+BufferedStream::ensureSpace()
+{
+	if (myPos == myUsed)
+	{
+		myPos = 0;
+		myUsed = 0;
+	}
+	if (spaceSize() > 0)
+		return;
+	if (myPos > 0)
+	{
+		// Slide the unconsumed tail to the front to make room.
+		memmove(myBuf.data(), myBuf.data() + myPos, myUsed - myPos);
+		myUsed -= myPos;
+		myPos = 0;
+		return;
+	}
+	// The whole buffer is one unfinished record - grow.
+	myBuf.resize(myBuf.size() * 2);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+IOTask::IOTask(
+	IOCore &core,
+	int fd)
 	: myState(IO_TASK_STATE_NEW)
 	, myFd(fd)
 	, myIdx(-1)
@@ -232,6 +1122,9 @@ IOTask::IOTask(
 	, myCore(core)
 {
 	LOG_DEBUG("IOTask create");
+#if IOCORE_USE_URING
+	myIsCancelSent = false;
+#endif
 	theCount.fetch_add(1, std::memory_order_relaxed);
 }
 
@@ -244,6 +1137,7 @@ IOTask::~IOTask()
 	assert(myAsyncOp == nullptr);
 	int rc = ::close(myFd);
 	assert(rc == 0);
+	MAYBE_UNUSED(rc);
 }
 
 void
@@ -252,7 +1146,342 @@ IOTask::close()
 	myCore.unsubscribe(this);
 }
 
-//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+
+static uint64_t
+timerNowTick()
+{
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return ((uint64_t)t.tv_sec * 1000 + (uint64_t)t.tv_nsec / 1'000'000) /
+		IOCore::theTimerTickMs;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+#if IOCORE_USE_URING
+
+IOCore::IOCore()
+{
+	LOG_DEBUG("IOCore create");
+	myIsStopped = false;
+
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	myFd = ioUringSetup(theSqEntryCount, &params);
+	assert(myFd >= 0);
+
+	mySqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+	myCqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		// Modern kernels expose both rings via one mapping.
+		mySqRingSize = std::max(mySqRingSize, myCqRingSize);
+		myCqRingSize = mySqRingSize;
+	}
+	mySqRingMem = mmap(nullptr, mySqRingSize, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, myFd, IORING_OFF_SQ_RING);
+	assert(mySqRingMem != MAP_FAILED);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		myCqRingMem = mySqRingMem;
+	}
+	else
+	{
+		myCqRingMem = mmap(nullptr, myCqRingSize, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, myFd, IORING_OFF_CQ_RING);
+		assert(myCqRingMem != MAP_FAILED);
+	}
+	mySqesSize = params.sq_entries * sizeof(io_uring_sqe);
+	mySqes = (io_uring_sqe *)mmap(nullptr, mySqesSize, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, myFd, IORING_OFF_SQES);
+	assert(mySqes != MAP_FAILED);
+
+	char *sqRing = (char *)mySqRingMem;
+	mySqHead = (uint32_t *)(sqRing + params.sq_off.head);
+	mySqTail = (uint32_t *)(sqRing + params.sq_off.tail);
+	mySqMask = *(uint32_t *)(sqRing + params.sq_off.ring_mask);
+	mySqEntryCount = *(uint32_t *)(sqRing + params.sq_off.ring_entries);
+	mySqArray = (uint32_t *)(sqRing + params.sq_off.array);
+	char *cqRing = (char *)myCqRingMem;
+	myCqHead = (uint32_t *)(cqRing + params.cq_off.head);
+	myCqTail = (uint32_t *)(cqRing + params.cq_off.tail);
+	myCqMask = *(uint32_t *)(cqRing + params.cq_off.ring_mask);
+	myCqes = (io_uring_cqe *)(cqRing + params.cq_off.cqes);
+	myLocalSqTail = *mySqTail;
+	mySubmittedSqTail = myLocalSqTail;
+
+	// Eventfd is used to wakeup from the completion waiting for handling non-kernel
+	// events. For example, to let IOCore know, that there are new or deleting tasks to
+	// process. Unlike with epoll it has to be blocking - io_uring completes operations
+	// on O_NONBLOCK files with EAGAIN instead of arming its internal poll.
+	myEventFd = eventfd(0, 0);
+	myEventSub = subscribe(myEventFd);
+	rearmEventRead();
+
+	// The timer wheel's single timerfd. Disarmed for now - its permanent read simply
+	// never completes until the first timer is armed.
+	myTimerLastTick = timerNowTick();
+	myTimerCount = 0;
+	myIsTimerFdArmed = false;
+	myTimerFd = timerfd_create(CLOCK_MONOTONIC, 0);
+	assert(myTimerFd >= 0);
+	myTimerSub = subscribe(myTimerFd);
+	rearmTimerRead();
+}
+
+IOCore::~IOCore()
+{
+	LOG_DEBUG("IOCore destroy");
+	// The timer task goes first - unsubscribing still needs the eventfd for the wakeup.
+	unsubscribe(myTimerSub);
+	myTimerSub = nullptr;
+	myTimerFd = -1;
+	unsubscribe(myEventSub);
+	myEventSub = nullptr;
+	myEventFd = -1;
+	processQueues();
+	dropCallbacks();
+	assert(myTasks.empty());
+	assert(myQueue.empty());
+	assert(myFd >= 0);
+	for (std::vector<IOCoreTimer *>& bucket : myTimerWheel)
+	{
+		for (IOCoreTimer *timer : bucket)
+		{
+			// A live timer here would mean a coroutine still awaiting on the loop.
+			assert(timer->myIsCanceled);
+			delete timer;
+		}
+		bucket.clear();
+	}
+	// Closing the ring aborts the operations still in flight, like the eventfd read.
+	munmap(mySqes, mySqesSize);
+	if (myCqRingMem != mySqRingMem)
+		munmap(myCqRingMem, myCqRingSize);
+	munmap(mySqRingMem, mySqRingSize);
+	int rc = close(myFd);
+	assert(rc == 0);
+	MAYBE_UNUSED(rc);
+}
+
+io_uring_sqe *
+IOCore::prepSqe(
+	uint8_t opcode,
+	int fd,
+	const void *addr,
+	uint32_t len,
+	uint64_t off,
+	void *userData)
+{
+	std::atomic_ref<uint32_t> sharedHead(*mySqHead);
+	if (myLocalSqTail - sharedHead.load(std::memory_order_acquire) == mySqEntryCount)
+	{
+		// The ring is full. Flush it to the kernel to free the entries. Shouldn't
+		// happen normally - each task has at most one operation in flight.
+		int rc = ioUringEnter(myFd, myLocalSqTail - mySubmittedSqTail, 0, 0);
+		assert(rc >= 0);
+		MAYBE_UNUSED(rc);
+		mySubmittedSqTail = myLocalSqTail;
+	}
+	uint32_t idx = myLocalSqTail & mySqMask;
+	io_uring_sqe *sqe = &mySqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)addr;
+	sqe->len = len;
+	sqe->off = off;
+	sqe->user_data = (uint64_t)(uintptr_t)userData;
+	mySqArray[idx] = idx;
+	++myLocalSqTail;
+	std::atomic_ref<uint32_t> sharedTail(*mySqTail);
+	sharedTail.store(myLocalSqTail, std::memory_order_release);
+	return sqe;
+}
+
+void
+IOCore::rearmEventRead()
+{
+	prepSqe(IORING_OP_READ, myEventFd, &myEventBuf, sizeof(myEventBuf), 0,
+		(void *)theEventFdUserData);
+}
+
+void
+IOCore::rearmTimerRead()
+{
+	prepSqe(IORING_OP_READ, myTimerFd, &myTimerBuf, sizeof(myTimerBuf), 0,
+		(void *)theTimerFdUserData);
+}
+
+void
+IOCore::fireTimer(
+	IOCoreTimer *timer)
+{
+	AsyncOperation *op = timer->myTask->myAsyncOp;
+	assert(op != nullptr);
+	// The operation itself completes with an error - its CQE is what resumes the
+	// coroutine, same as with a task-closure cancellation.
+	prepSqe(IORING_OP_ASYNC_CANCEL, -1, op, 0, 0, (void *)theCancelUserData);
+}
+
+void
+IOCore::dropTask(
+	IOTask *s)
+{
+	std::unique_lock lock(myMutex);
+	assert(myTasks[s->myIdx] == s);
+	// Cyclic deletion, for O(1).
+	myTasks.back()->myIdx = s->myIdx;
+	myTasks[s->myIdx] = myTasks.back();
+	myTasks.resize(myTasks.size() - 1);
+	myStat.myDeletingTaskCount.fetch_sub(1, std::memory_order_relaxed);
+	delete s;
+}
+
+void
+IOCore::roll()
+{
+	uint64_t turnStartUs = statNowUs();
+	processQueues();
+	processCallbacks();
+	processTimers();
+	// The kernel wait is cut out of the turn duration - an idle loop sleeping in it
+	// is not latency.
+	uint64_t waitStartUs = statNowUs();
+	// The single syscall of the turn - submits every SQE prepared since the last one
+	// and waits for at least one completion.
+	int rc = ioUringEnter(myFd, myLocalSqTail - mySubmittedSqTail, 1,
+		IORING_ENTER_GETEVENTS);
+	uint64_t waitEndUs = statNowUs();
+	if (rc < 0 && errno == EINTR)
+		return;
+	assert(rc >= 0);
+	mySubmittedSqTail = myLocalSqTail;
+
+	std::atomic_ref<uint32_t> sharedTail(*myCqTail);
+	std::atomic_ref<uint32_t> sharedHead(*myCqHead);
+	uint32_t tail = sharedTail.load(std::memory_order_acquire);
+	uint32_t head = *myCqHead;
+	LOG_THIS_DEBUG(IOCore, roll, tail - head << " completions");
+	statHistAdd(myStat.myEventsPerTurnLog, tail - head);
+	while (head != tail)
+	{
+		io_uring_cqe *cqe = &myCqes[head & myCqMask];
+		++head;
+		if (cqe->user_data == theEventFdUserData)
+		{
+			rearmEventRead();
+			continue;
+		}
+		if (cqe->user_data == theTimerFdUserData)
+		{
+			// A tick. The wheel itself is advanced by processTimers() on the next turn.
+			rearmTimerRead();
+			continue;
+		}
+		if (cqe->user_data == theCancelUserData)
+		{
+			// The cancellation's own completion. The canceled operation gets a
+			// separate CQE.
+			continue;
+		}
+		AsyncOperation *op = (AsyncOperation *)(uintptr_t)cqe->user_data;
+		IOTask *s = op->myTask;
+		if (s == nullptr)
+		{
+			// A file operation - it has no task, nothing to unregister.
+			uint64_t resumeStartUs = statNowUs();
+			op->onCQE(cqe->res);
+			statHistAdd(myStat.myResumeDurationLog, statNowUs() - resumeStartUs);
+			myStat.myResumeCount.fetch_add(1, std::memory_order_relaxed);
+			continue;
+		}
+		if ((cqe->flags & IORING_CQE_F_MORE) != 0)
+		{
+			// The operation will get more completions - a zerocopy send posts
+			// its result now and the buffer-release notification later. It
+			// stays registered and doesn't resume yet.
+			op->onCQEMore(cqe->res);
+			continue;
+		}
+		// Nullify before the resume in case the coroutine would start a new async
+		// operation. The resume can also free the operation with its frame - don't
+		// touch it afterwards.
+		s->myAsyncOp = nullptr;
+		bool wasCanceled = s->myIsCancelSent;
+		uint64_t resumeStartUs = statNowUs();
+		op->onCQE(cqe->res);
+		statHistAdd(myStat.myResumeDurationLog, statNowUs() - resumeStartUs);
+		myStat.myResumeCount.fetch_add(1, std::memory_order_relaxed);
+		if (wasCanceled)
+			dropTask(s);
+	}
+	sharedHead.store(head, std::memory_order_release);
+	statHistAdd(myStat.myTurnDurationLog,
+		(waitStartUs - turnStartUs) + (statNowUs() - waitEndUs));
+	myStat.myTurnCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+void
+IOCore::processQueues()
+{
+	if (mySize.load(std::memory_order_relaxed) == 0)
+		return;
+	std::unique_lock lock(myMutex);
+	if (myQueue.empty())
+		return;
+	for (IOTask *s : myQueue)
+	{
+		if (s->myState == IO_TASK_STATE_NEW)
+		{
+			LOG_THIS_DEBUG(IOCore, processQueues, "add " << s);
+			s->myState = IO_TASK_STATE_WORKING;
+			myStat.myNewTaskCount.fetch_sub(1, std::memory_order_relaxed);
+			myStat.myWorkingTaskCount.fetch_add(1, std::memory_order_relaxed);
+			// See the eventfd comment in the constructor - the fds have to be
+			// blocking, waiting for readiness is io_uring's job now.
+			int flags = fcntl(s->myFd, F_GETFL, 0);
+			assert(flags >= 0);
+			int rc = fcntl(s->myFd, F_SETFL, flags & ~O_NONBLOCK);
+			assert(rc == 0);
+			MAYBE_UNUSED(rc);
+			s->myIdx = myTasks.size();
+			myTasks.push_back(s);
+		}
+		else if (s->myState == IO_TASK_STATE_DELETING)
+		{
+			assert(myTasks.size() > (size_t)s->myIdx);
+			assert(myTasks[s->myIdx] == s);
+			assert(s->myFd >= 0);
+			LOG_THIS_DEBUG(IOCore, processQueues, "drop " << s);
+			if (s->myAsyncOp != nullptr)
+			{
+				// The kernel still owns the operation and its buffers. Cancel it and
+				// delete the task when the operation's completion arrives in roll().
+				LOG_THIS_DEBUG(IOCore, processQueues, "cancel " << s);
+				s->myIsCancelSent = true;
+				prepSqe(IORING_OP_ASYNC_CANCEL, -1, s->myAsyncOp, 0, 0,
+					(void *)theCancelUserData);
+				continue;
+			}
+			// Cyclic deletion, for O(1).
+			myTasks.back()->myIdx = s->myIdx;
+			myTasks[s->myIdx] = myTasks.back();
+			myTasks.resize(myTasks.size() - 1);
+			myStat.myDeletingTaskCount.fetch_sub(1, std::memory_order_relaxed);
+			delete s;
+		}
+		else
+		{
+			assert(false);
+		}
+	}
+	myQueue.clear();
+	mySize.store(myTasks.size(), std::memory_order_relaxed);
+}
+
+#else // !IOCORE_USE_URING
 
 IOCore::IOCore()
 	: myFd(epoll_create1(0))
@@ -263,71 +1492,90 @@ IOCore::IOCore()
 	// example, to let IOCore know, that there are new or deleting tasks to process.
 	myEventFd = eventfd(0, EFD_NONBLOCK);
 	myEventSub = subscribe(myEventFd);
+
+	// The timer wheel's single timerfd. Disarmed for now - it starts ticking with the
+	// first armed timer.
+	myTimerLastTick = timerNowTick();
+	myTimerCount = 0;
+	myIsTimerFdArmed = false;
+	myTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	assert(myTimerFd >= 0);
+	myTimerSub = subscribe(myTimerFd);
 }
 
 IOCore::~IOCore()
 {
 	LOG_DEBUG("IOCore destroy");
+	// The file worker goes before everything - a pending file operation here would
+	// mean a coroutine still awaiting on the loop anyway, but the thread itself has
+	// to be joined even when it only ever sat idle.
+	if (myFileWorker.joinable())
+	{
+		{
+			std::unique_lock lock(myFileMutex);
+			assert(myFileQueue.empty());
+			myIsFileWorkerStopped = true;
+			myFileCond.notify_one();
+		}
+		myFileWorker.join();
+	}
+	// The timer task goes first - unsubscribing still needs the eventfd for the wakeup.
+	unsubscribe(myTimerSub);
+	myTimerSub = nullptr;
+	myTimerFd = -1;
 	unsubscribe(myEventSub);
 	myEventSub = nullptr;
 	myEventFd = -1;
 	processQueues();
+	dropCallbacks();
 	assert(myTasks.empty());
 	assert(myQueue.empty());
 	assert(myFd >= 0);
+	for (std::vector<IOCoreTimer *>& bucket : myTimerWheel)
+	{
+		for (IOCoreTimer *timer : bucket)
+		{
+			// A live timer here would mean a coroutine still awaiting on the loop.
+			assert(timer->myIsCanceled);
+			delete timer;
+		}
+		bucket.clear();
+	}
 	int rc = close(myFd);
 	assert(rc == 0);
+	MAYBE_UNUSED(rc);
 }
 
 void
-IOCore::wakeup()
-{
-	uint64_t val = 1;
-	ssize_t rc = write(myEventFd, &val, sizeof(val));
-	assert(rc == sizeof(val));
-}
-
-IOTask *
-IOCore::subscribe(
-	int fd)
-{
-	std::unique_lock lock(myMutex);
-	for (IOTask *s : myTasks)
-		assert(s->myFd != fd);
-	for (IOTask *s : myQueue)
-		assert(s->myFd != fd);
-	IOTask *s = new IOTask(*this, fd);
-	myQueue.push_back(s);
-	mySize.fetch_add(1, std::memory_order_relaxed);
-	wakeup();
-	return s;
-}
-
-void
-IOCore::unsubscribe(
-	IOTask *s)
+IOCore::fireTimer(
+	IOCoreTimer *timer)
 {
-	std::unique_lock lock(myMutex);
-	for (IOTask *is : myQueue)
-		assert(is != s);
-	assert(myTasks[s->myIdx] == s);
-	assert(s->myState == IO_TASK_STATE_WORKING);
-	s->myState = IO_TASK_STATE_DELETING;
-	myQueue.push_back(s);
-	mySize.fetch_add(1, std::memory_order_relaxed);
-	wakeup();
+	IOTask *s = timer->myTask;
+	AsyncOperation *op = s->myAsyncOp;
+	assert(op != nullptr);
+	// Nullify first - the resumed coroutine can start a new operation right away.
+	s->myAsyncOp = nullptr;
+	op->cancel();
 }
 
 void
 IOCore::roll()
 {
+	uint64_t turnStartUs = statNowUs();
 	processQueues();
+	processCallbacks();
+	processTimers();
 	epoll_event evs[theEpollBatchSize];
+	// The kernel wait is cut out of the turn duration - an idle loop sleeping in it
+	// is not latency.
+	uint64_t waitStartUs = statNowUs();
 	int rc = epoll_wait(myFd, evs, theEpollBatchSize, -1);
+	uint64_t waitEndUs = statNowUs();
 	if (rc < 0 && errno == EINTR)
 		return;
 	assert(rc >= 0);
 	LOG_THIS_DEBUG(IOCore, roll, rc << " events");
+	statHistAdd(myStat.myEventsPerTurnLog, rc);
 	for (int i = 0; i < rc; ++i)
 	{
 		epoll_event& ev = evs[i];
@@ -359,12 +1607,24 @@ IOCore::roll()
 		{
 			// Nullify in case the coroutine would try to start a new async operation.
 			s->myAsyncOp = nullptr;
+			uint64_t resumeStartUs = statNowUs();
 			// Restore it back in case the handling didn't work. For example, due to a
 			// spurious wakeup.
 			if (!op->onIOEvent())
+			{
 				s->myAsyncOp = op;
+			}
+			else
+			{
+				statHistAdd(myStat.myResumeDurationLog,
+					statNowUs() - resumeStartUs);
+				myStat.myResumeCount.fetch_add(1, std::memory_order_relaxed);
+			}
 		}
 	}
+	statHistAdd(myStat.myTurnDurationLog,
+		(waitStartUs - turnStartUs) + (statNowUs() - waitEndUs));
+	myStat.myTurnCount.fetch_add(1, std::memory_order_relaxed);
 }
 
 void
@@ -381,6 +1641,8 @@ IOCore::processQueues()
 		{
 			LOG_THIS_DEBUG(IOCore, processQueues, "add " << s);
 			s->myState = IO_TASK_STATE_WORKING;
+			myStat.myNewTaskCount.fetch_sub(1, std::memory_order_relaxed);
+			myStat.myWorkingTaskCount.fetch_add(1, std::memory_order_relaxed);
 			// Assume that in a new socket all the events are there. The task will clear
 			// those which are not really available yet.
 			s->myEventsReady = IO_EVENT_READ | IO_EVENT_WRITE;
@@ -411,6 +1673,7 @@ IOCore::processQueues()
 				s->myAsyncOp->onIOEvent();
 				s->myAsyncOp = nullptr;
 			}
+			myStat.myDeletingTaskCount.fetch_sub(1, std::memory_order_relaxed);
 			delete s;
 			myTasks.resize(myTasks.size() - 1);
 		}
@@ -422,3 +1685,496 @@ IOCore::processQueues()
 	myQueue.clear();
 	mySize.store(myTasks.size(), std::memory_order_relaxed);
 }
+
+void
+IOCore::fileOffload(
+	AsyncFileOperation *op)
+{
+	std::unique_lock lock(myFileMutex);
+	assert(!myIsFileWorkerStopped);
+	if (!myFileWorker.joinable())
+		myFileWorker = std::thread(&IOCore::fileWorkerF, this);
+	myFileQueue.push_back(op);
+	myFileCond.notify_one();
+}
+
+void
+IOCore::fileWorkerF()
+{
+	std::unique_lock lock(myFileMutex);
+	while (true)
+	{
+		if (myFileQueue.empty())
+		{
+			if (myIsFileWorkerStopped)
+				return;
+			myFileCond.wait(lock);
+			continue;
+		}
+		std::vector<AsyncFileOperation *> ops;
+		ops.swap(myFileQueue);
+		lock.unlock();
+		for (AsyncFileOperation *op : ops)
+		{
+			// The blocking syscall runs here; the resume happens back on the
+			// loop's thread, like every resume does.
+			op->fileExecute();
+			post(op->myCoro);
+		}
+		lock.lock();
+	}
+}
+
+#endif // IOCORE_USE_URING
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+uint64_t
+IOCore::statNowUs()
+{
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1'000'000 + t.tv_nsec / 1000;
+}
+
+void
+IOCore::statHistAdd(
+	std::atomic_uint64_t *buckets,
+	uint64_t value)
+{
+	// floor(log2(value)); zero and one both land in bucket 0.
+	uint32_t idx = value <= 1 ? 0 : 63 - __builtin_clzll(value);
+	if (idx >= IOCoreStat::theBucketCount)
+		idx = IOCoreStat::theBucketCount - 1;
+	buckets[idx].fetch_add(1, std::memory_order_relaxed);
+}
+
+void
+IOCore::statGet(
+	IOCoreStat& out) const
+{
+	for (uint32_t i = 0; i < IOCoreStat::theBucketCount; ++i)
+	{
+		out.myTurnDurationLog[i] =
+			myStat.myTurnDurationLog[i].load(std::memory_order_relaxed);
+		out.myEventsPerTurnLog[i] =
+			myStat.myEventsPerTurnLog[i].load(std::memory_order_relaxed);
+		out.myResumeDurationLog[i] =
+			myStat.myResumeDurationLog[i].load(std::memory_order_relaxed);
+	}
+	out.myTurnCount = myStat.myTurnCount.load(std::memory_order_relaxed);
+	out.myResumeCount = myStat.myResumeCount.load(std::memory_order_relaxed);
+	out.myNewTaskCount = myStat.myNewTaskCount.load(std::memory_order_relaxed);
+	out.myWorkingTaskCount = myStat.myWorkingTaskCount.load(std::memory_order_relaxed);
+	out.myDeletingTaskCount = myStat.myDeletingTaskCount.load(std::memory_order_relaxed);
+}
+
+void
+IOCore::post(
+	std::function<void()>&& f)
+{
+	IOCoreCallback *cb = new IOCoreCallback();
+	cb->myFunc = std::move(f);
+	postCallback(cb);
+}
+
+void
+IOCore::post(
+	std::coroutine_handle<> coro)
+{
+	IOCoreCallback *cb = new IOCoreCallback();
+	cb->myCoro = coro;
+	postCallback(cb);
+}
+
+void
+IOCore::postCallback(
+	IOCoreCallback *cb)
+{
+	// Lock-free push. No ABA trouble - a producer only ever installs its own fresh
+	// node on top of whatever head it saw.
+	cb->myNext = myCallbacks.load(std::memory_order_relaxed);
+	while (!myCallbacks.compare_exchange_weak(cb->myNext, cb,
+		std::memory_order_release, std::memory_order_relaxed))
+	{
+	}
+	// Only the push onto an empty stack rings the doorbell. The loop consumes the
+	// whole stack at once, so everybody pushing behind the first node piggybacks on
+	// its wakeup - one amortized eventfd write per burst.
+	if (cb->myNext == nullptr)
+		wakeup();
+}
+
+void
+IOCore::processCallbacks()
+{
+	IOCoreCallback *head = myCallbacks.exchange(nullptr, std::memory_order_acquire);
+	if (head == nullptr)
+		return;
+	// The stack pops newest-first - reverse it so the calls run in the order they
+	// were posted.
+	IOCoreCallback *prev = nullptr;
+	while (head != nullptr)
+	{
+		IOCoreCallback *next = head->myNext;
+		head->myNext = prev;
+		prev = head;
+		head = next;
+	}
+	// The callbacks can start coroutines which subscribe new tasks or post further
+	// calls - those land on the already emptied stack and get the next turn.
+	while (prev != nullptr)
+	{
+		IOCoreCallback *cb = prev;
+		prev = prev->myNext;
+		uint64_t startUs = statNowUs();
+		if (cb->myCoro)
+			cb->myCoro.resume();
+		else
+			cb->myFunc();
+		statHistAdd(myStat.myResumeDurationLog, statNowUs() - startUs);
+		myStat.myResumeCount.fetch_add(1, std::memory_order_relaxed);
+		delete cb;
+	}
+}
+
+void
+IOCore::dropCallbacks()
+{
+	// The calls which never got their loop turn. Running them during the destruction
+	// would be unsafe - just free them, like the old never-called pending requests.
+	IOCoreCallback *head = myCallbacks.exchange(nullptr, std::memory_order_acquire);
+	while (head != nullptr)
+	{
+		IOCoreCallback *next = head->myNext;
+		delete head;
+		head = next;
+	}
+}
+
+IOCoreTimer *
+IOCore::armTimer(
+	IOTask *task,
+	uint64_t timeoutMs)
+{
+	uint64_t ticks = (timeoutMs + theTimerTickMs - 1) / theTimerTickMs;
+	if (ticks == 0)
+		ticks = 1;
+	IOCoreTimer *timer = new IOCoreTimer();
+	timer->myTask = task;
+	timer->myDeadlineTick = timerNowTick() + ticks;
+	timer->myIsCanceled = false;
+	timer->myIsFired = false;
+	myTimerWheel[timer->myDeadlineTick % theTimerWheelSize].push_back(timer);
+	if (myTimerCount++ == 0 && !myIsTimerFdArmed)
+	{
+		// The first timer - start the periodic tick.
+		myIsTimerFdArmed = true;
+		itimerspec spec;
+		memset(&spec, 0, sizeof(spec));
+		spec.it_value.tv_nsec = theTimerTickMs * 1'000'000;
+		spec.it_interval.tv_nsec = theTimerTickMs * 1'000'000;
+		int rc = timerfd_settime(myTimerFd, 0, &spec, nullptr);
+		assert(rc == 0);
+		MAYBE_UNUSED(rc);
+	}
+	return timer;
+}
+
+void
+IOCore::disarmTimer(
+	IOCoreTimer *timer)
+{
+	if (timer->myIsFired)
+	{
+		// Already left the wheel - nobody else references it.
+		delete timer;
+		return;
+	}
+	timer->myIsCanceled = true;
+	assert(myTimerCount > 0);
+	--myTimerCount;
+}
+
+void
+IOCore::processTimers()
+{
+	if (myTimerCount == 0 && !myIsTimerFdArmed)
+	{
+		// Idle. The canceled leftovers in the buckets are swept when timers get armed
+		// again, or by the destructor.
+		return;
+	}
+#if !IOCORE_USE_URING
+	// Consume the expiration counter - the wheel itself runs off the clock.
+	uint64_t expired;
+	ssize_t bytes = read(myTimerFd, &expired, sizeof(expired));
+	MAYBE_UNUSED(bytes);
+#endif
+	uint64_t now = timerNowTick();
+	uint64_t last = myTimerLastTick;
+	myTimerLastTick = now;
+	// After a long sleep every bucket is due for at most one look.
+	if (now - last > theTimerWheelSize)
+		last = now - theTimerWheelSize;
+	for (uint64_t tick = last + 1; tick <= now; ++tick)
+	{
+		std::vector<IOCoreTimer *>& wheelBucket = myTimerWheel[tick % theTimerWheelSize];
+		if (wheelBucket.empty())
+			continue;
+		// Take the bucket out - the firing can resume coroutines which arm new timers
+		// into this very bucket.
+		std::vector<IOCoreTimer *> bucket;
+		bucket.swap(wheelBucket);
+		for (IOCoreTimer *timer : bucket)
+		{
+			if (timer->myIsCanceled)
+			{
+				delete timer;
+				continue;
+			}
+			if (timer->myDeadlineTick > now)
+			{
+				// Due in a later lap.
+				myTimerWheel[timer->myDeadlineTick % theTimerWheelSize].push_back(timer);
+				continue;
+			}
+			timer->myIsFired = true;
+			assert(myTimerCount > 0);
+			--myTimerCount;
+			fireTimer(timer);
+		}
+	}
+	if (myTimerCount == 0 && myIsTimerFdArmed)
+	{
+		// The last timer is gone - stop the ticks, don't wake an idle loop.
+		myIsTimerFdArmed = false;
+		itimerspec spec;
+		memset(&spec, 0, sizeof(spec));
+		int rc = timerfd_settime(myTimerFd, 0, &spec, nullptr);
+		assert(rc == 0);
+		MAYBE_UNUSED(rc);
+	}
+}
+
+void
+IOCore::wakeup()
+{
+	uint64_t val = 1;
+	ssize_t rc = write(myEventFd, &val, sizeof(val));
+	assert(rc == sizeof(val));
+	MAYBE_UNUSED(rc);
+}
+
+IOTask *
+IOCore::subscribe(
+	int fd)
+{
+	std::unique_lock lock(myMutex);
+	for (IOTask *s : myTasks)
+		assert(s->myFd != fd);
+	for (IOTask *s : myQueue)
+		assert(s->myFd != fd);
+	IOTask *s = new IOTask(*this, fd);
+	myQueue.push_back(s);
+	mySize.fetch_add(1, std::memory_order_relaxed);
+	myStat.myNewTaskCount.fetch_add(1, std::memory_order_relaxed);
+	wakeup();
+	return s;
+}
+
+void
+IOCore::unsubscribe(
+	IOTask *s)
+{
+	std::unique_lock lock(myMutex);
+	for (IOTask *is : myQueue)
+		assert(is != s);
+	assert(myTasks[s->myIdx] == s);
+	assert(s->myState == IO_TASK_STATE_WORKING);
+	s->myState = IO_TASK_STATE_DELETING;
+	myQueue.push_back(s);
+	mySize.fetch_add(1, std::memory_order_relaxed);
+	myStat.myWorkingTaskCount.fetch_sub(1, std::memory_order_relaxed);
+	myStat.myDeletingTaskCount.fetch_add(1, std::memory_order_relaxed);
+	wakeup();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+AsyncPoolAcquire::AsyncPoolAcquire(
+	IOTaskPool *pool,
+	const sockaddr_in &addr)
+	: myPool(pool)
+	, myAddr(addr)
+	, myTask(nullptr)
+{
+}
+
+bool
+AsyncPoolAcquire::await_ready() noexcept
+{
+	// The hot path: a healthy cached connection is handed out right away and the
+	// coroutine is not even suspended.
+	myTask = myPool->popHealthy(IOTaskPool::keyOf(myAddr));
+	return myTask != nullptr;
+}
+
+bool
+AsyncPoolAcquire::await_suspend(
+	std::coroutine_handle<> coro)
+{
+	// Nothing cached - grow the pool with a fresh connection.
+	int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (sock < 0)
+		return false;
+	myTask = myPool->myCore.subscribe(sock);
+	myConnect.emplace(myTask, (const sockaddr *)&myAddr, sizeof(myAddr));
+	// The epoll backend can finish a loopback connect right in the constructor.
+	if (myConnect->await_ready())
+		return false;
+	return myConnect->await_suspend(coro);
+}
+
+IOTask *
+AsyncPoolAcquire::await_resume()
+{
+	// A pooled hit, or a failed socket() - myTask says which.
+	if (!myConnect.has_value())
+		return myTask;
+	if (myConnect->await_resume() != 0)
+	{
+		myTask->close();
+		myTask = nullptr;
+	}
+	return myTask;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+IOTaskPool::IOTaskPool(
+	IOCore &core,
+	uint32_t idleLimitPerEndpoint)
+	: myCore(core)
+	, myIdleLimit(idleLimitPerEndpoint)
+	, myIdleCount(0)
+{
+	assert(myIdleLimit > 0);
+}
+
+IOTaskPool::~IOTaskPool()
+{
+	for (auto& [key, list] : myIdle)
+	{
+		MAYBE_UNUSED(key);
+		for (IOTask *task : list)
+			task->close();
+	}
+}
+
+void
+IOTaskPool::release(
+	const sockaddr_in &addr,
+	IOTask *task)
+{
+	std::vector<IOTask *> &list = myIdle[keyOf(addr)];
+	// The bounded growth: beyond the cap the connection is closed, not cached.
+	if (list.size() >= myIdleLimit)
+	{
+		task->close();
+		return;
+	}
+	list.push_back(task);
+	++myIdleCount;
+}
+
+uint64_t
+IOTaskPool::keyOf(
+	const sockaddr_in &addr)
+{
+	return ((uint64_t)addr.sin_addr.s_addr << 16) | addr.sin_port;
+}
+
+IOTask *
+IOTaskPool::popHealthy(
+	uint64_t key)
+{
+	auto it = myIdle.find(key);
+	if (it == myIdle.end())
+		return nullptr;
+	std::vector<IOTask *> &list = it->second;
+	while (!list.empty())
+	{
+		IOTask *task = list.back();
+		list.pop_back();
+		--myIdleCount;
+		// An idle upstream connection has nothing to say. EOF means the upstream
+		// closed it while it sat here, readable bytes mean a desynced protocol -
+		// either way the connection is dropped, not handed out.
+		char byte;
+		ssize_t rc = recv(task->myFd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+		if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return task;
+		task->close();
+	}
+	return nullptr;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+IOCoreGroup::IOCoreGroup(
+	uint32_t loopCount)
+	: myNextLoop(0)
+{
+	assert(loopCount > 0);
+	myLoops.reserve(loopCount);
+	for (uint32_t i = 0; i < loopCount; ++i)
+		myLoops.push_back(std::make_unique<IOCore>());
+}
+
+IOCoreGroup::~IOCoreGroup()
+{
+	stop();
+}
+
+void
+IOCoreGroup::start()
+{
+	assert(myThreads.empty());
+	myThreads.reserve(myLoops.size());
+	for (uint32_t i = 0; i < myLoops.size(); ++i)
+		myThreads.emplace_back(&IOCoreGroup::runLoop, this, i);
+}
+
+void
+IOCoreGroup::stop()
+{
+	for (std::unique_ptr<IOCore>& core : myLoops)
+		core->stop();
+	for (std::thread& t : myThreads)
+		t.join();
+	myThreads.clear();
+}
+
+IOCore&
+IOCoreGroup::nextLoop()
+{
+	return *myLoops[myNextLoop.fetch_add(1, std::memory_order_relaxed) %
+		myLoops.size()];
+}
+
+void
+IOCoreGroup::runLoop(
+	uint32_t idx)
+{
+	// Pin the thread to one core so its loop's tasks keep their cache locality. Best
+	// effort - the process might be restricted to a subset of the cores.
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(idx % std::thread::hardware_concurrency(), &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+	IOCore& core = *myLoops[idx];
+	while (!core.isStopped())
+		core.roll();
+}
@@ -1,14 +1,31 @@
 #pragma once
 
 #include <atomic>
+#include <condition_variable>
 #include <coroutine>
+#include <functional>
 #include <iostream>
+#include <memory>
 #include <mutex>
+#include <netinet/in.h>
+#include <optional>
 #include <sstream>
+#include <string_view>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
+// IO backend selection. With io_uring the async operations don't make any syscalls
+// themselves - they only fill submission entries in the shared SQ ring, and one
+// io_uring_enter() per loop turn both flushes all of them and waits for completions on
+// the CQ ring. The epoll backend instead does at least one recv/send syscall per
+// operation plus the epoll_wait(). Set to 0 to get the old epoll behaviour.
+#ifndef IOCORE_USE_URING
+#define IOCORE_USE_URING 1
+#endif
+
 #define MAYBE_UNUSED(...) ((void)sizeof(1, ##__VA_ARGS__))
 
 #define LOG_IMPL(...)                                                                     \
@@ -28,8 +45,13 @@
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
+class BufferedStream;
 class IOCore;
+struct IOCoreTimer;
 class IOTask;
+class IOTaskPool;
+struct io_uring_sqe;
+struct io_uring_cqe;
 
 enum IOEventBit
 {
@@ -105,6 +127,19 @@ struct IOCoroutinePromise
 	void
 	unhandled_exception() { abort(); }
 
+	// The coroutine frames are carved from a size-classed free-list arena instead of the
+	// global heap. A coroutine is spawned per request, and the frame sizes are uniform
+	// per call site, so after a warm-up every allocation is a free-list pop. The arena
+	// is thread-local - spawning on multiple loops doesn't contend on the allocator.
+	static void *
+	operator new(
+		size_t size);
+
+	static void
+	operator delete(
+		void *ptr,
+		size_t size);
+
 	// Keep track of the promise count to ensure there are no memory leaks.
 	static std::atomic_int theCount;
 };
@@ -127,10 +162,33 @@ struct AsyncOperation
 	await_suspend(
 		std::coroutine_handle<> coro);
 
+	IOTask *
+	task() { return myTask; }
+
 private:
+#if IOCORE_USE_URING
+	// Invoked by IOCore when the operation's completion entry is consumed from the CQ
+	// ring. Resumes the coroutine.
+	virtual void
+	onCQE(
+		int res) = 0;
+
+	// Invoked instead of onCQE() for a completion carrying IORING_CQE_F_MORE - the
+	// operation will get more entries and must not resume yet. Only the zerocopy
+	// send produces those; any other operation getting one is a bug.
+	virtual void
+	onCQEMore(
+		int res) { MAYBE_UNUSED(res); abort(); }
+#else
 	virtual bool
 	onIOEvent() = 0;
 
+	// Complete the operation with an error right now, without waiting for readiness.
+	// Used for task closure and for the timed out operations.
+	virtual void
+	cancel() = 0;
+#endif
+
 protected:
 	IOTask *const myTask;
 	std::coroutine_handle<> myCoro;
@@ -160,12 +218,21 @@ struct AsyncRecv final : public AsyncOperation
 	await_resume() { return myRes; }
 
 private:
+#if IOCORE_USE_URING
+	void
+	onCQE(
+		int res) final;
+#else
 	void
 	execute();
 
 	bool
 	onIOEvent() final;
 
+	void
+	cancel() final;
+#endif
+
 	void *const myData;
 	const size_t mySize;
 	ssize_t myRes;
@@ -191,12 +258,21 @@ struct AsyncSend final : public AsyncOperation
 	await_resume() { return myRes; }
 
 private:
+#if IOCORE_USE_URING
+	void
+	onCQE(
+		int res) final;
+#else
 	void
 	execute();
 
 	bool
 	onIOEvent() final;
 
+	void
+	cancel() final;
+#endif
+
 	const void *const myData;
 	const size_t mySize;
 	ssize_t myRes;
@@ -204,6 +280,67 @@ private:
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
+// Gathered send - one awaited operation for an iovec array, so a response assembled
+// from header + body needs neither a joining memcpy nor a syscall per part. The iovec
+// array and the buffers it points at have to stay alive until the co_await resumes;
+// locals of the awaiting coroutine's frame do.
+//
+// With isZeroCopy the io_uring backend sends with IORING_OP_SENDMSG_ZC - the kernel
+// pins the pages instead of copying them into socket buffers, and the resume is
+// deferred until its buffer-release notification, so the resume is still the signal
+// that the buffers are reusable. Worth it for big payloads only - the pinning has its
+// own cost. The epoll backend ignores the flag and does a plain copying sendmsg().
+//
+struct AsyncSendMsg final : public AsyncOperation
+{
+	AsyncSendMsg(
+		IOTask *sub,
+		const iovec *iov,
+		int iovCount,
+		bool isZeroCopy);
+	AsyncSendMsg(
+		const AsyncSendMsg&) = delete;
+	AsyncSendMsg& operator=(
+		const AsyncSendMsg&) = delete;
+
+	bool
+	await_ready() const noexcept { return myRes >= 0; }
+
+	ssize_t
+	await_resume() { return myRes; }
+
+private:
+#if IOCORE_USE_URING
+	void
+	onCQE(
+		int res) final;
+
+	void
+	onCQEMore(
+		int res) final;
+#else
+	void
+	execute();
+
+	bool
+	onIOEvent() final;
+
+	void
+	cancel() final;
+#endif
+
+	// The kernel reads the iovec array through this asynchronously - it lives here,
+	// next to the awaitable, until the completion.
+	msghdr myMsg;
+	const bool myIsZeroCopy;
+	// The zerocopy send result arrived and the buffer-release notification is now
+	// awaited.
+	bool myIsSent;
+	ssize_t myRes;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
 struct AsyncAccept final : public AsyncOperation
 {
 	AsyncAccept(
@@ -222,12 +359,21 @@ struct AsyncAccept final : public AsyncOperation
 	await_resume() { return myRes; }
 
 private:
+#if IOCORE_USE_URING
+	void
+	onCQE(
+		int res) final;
+#else
 	void
 	execute();
 
 	bool
 	onIOEvent() final;
 
+	void
+	cancel() final;
+#endif
+
 	sockaddr *const myAddr;
 	socklen_t *const mySize;
 	int myRes;
@@ -235,6 +381,58 @@ private:
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
+// Accept a batch of connections with a single coroutine resume. The plain AsyncAccept
+// pays a resume per connection; this one drains accept4() until EAGAIN or until the
+// given array is full, so a reconnect storm costs one resume per wakeup, not per peer.
+// The peer addresses are not reported - a server that wants them can getpeername() the
+// few fds it actually cares about.
+//
+struct AsyncAcceptMany final : public AsyncOperation
+{
+	AsyncAcceptMany(
+		IOTask *sub,
+		int *fds,
+		int capacity);
+	AsyncAcceptMany(
+		const AsyncAcceptMany&) = delete;
+	AsyncAcceptMany& operator=(
+		const AsyncAcceptMany&) = delete;
+
+	bool
+	await_ready() const noexcept { return myRes >= 0; }
+
+	// How many fds were stored, > 0. Or -1 on a socket error or cancellation.
+	int
+	await_resume() { return myRes; }
+
+private:
+#if IOCORE_USE_URING
+	void
+	onCQE(
+		int res) final;
+#else
+	void
+	execute();
+
+	bool
+	onIOEvent() final;
+
+	void
+	cancel() final;
+#endif
+
+	// Drain the backlog into the remaining array space. The listening socket is
+	// non-blocking, so this just collects what the kernel has already queued.
+	void
+	drain();
+
+	int *const myFds;
+	const int myCapacity;
+	int myRes;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
 struct AsyncConnect final : public AsyncOperation
 {
 	AsyncConnect(
@@ -253,15 +451,302 @@ struct AsyncConnect final : public AsyncOperation
 	await_resume() { return myRes; }
 
 private:
+#if IOCORE_USE_URING
+	void
+	onCQE(
+		int res) final;
+
+	// The kernel reads the address asynchronously - it has to stay alive until the
+	// completion. It does - it is a local in the awaiting coroutine's frame.
+	const sockaddr *const myAddr;
+	const socklen_t myAddrSize;
+#else
 	bool
 	onIOEvent() final;
 
+	void
+	cancel() final;
+#endif
+
 	bool myIsDone;
 	int myRes;
 };
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
+struct AsyncReadUntil final : public AsyncOperation
+{
+	AsyncReadUntil(
+		BufferedStream *stream,
+		char delim);
+	AsyncReadUntil(
+		const AsyncReadUntil&) = delete;
+	AsyncReadUntil& operator=(
+		const AsyncReadUntil&) = delete;
+
+	bool
+	await_ready() const noexcept { return myIsDone; }
+
+	// The record including the delimiter, as a view into the stream's buffer. Valid until
+	// the next read on the stream. Empty on EOF before the delimiter, a socket error, or
+	// cancellation.
+	std::string_view
+	await_resume() { return myLine; }
+
+private:
+#if IOCORE_USE_URING
+	void
+	onCQE(
+		int res) final;
+
+	void
+	armRecv();
+#else
+	bool
+	execute();
+
+	bool
+	onIOEvent() final;
+
+	void
+	cancel() final;
+#endif
+
+	bool
+	findLine();
+
+	BufferedStream *const myStream;
+	const char myDelim;
+	// Where the previous delimiter search stopped. The already scanned bytes are not
+	// rescanned on the next refill.
+	size_t mySearchPos;
+	bool myIsDone;
+	std::string_view myLine;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+struct AsyncReadExact final : public AsyncOperation
+{
+	AsyncReadExact(
+		BufferedStream *stream,
+		void *data,
+		size_t size);
+	AsyncReadExact(
+		const AsyncReadExact&) = delete;
+	AsyncReadExact& operator=(
+		const AsyncReadExact&) = delete;
+
+	bool
+	await_ready() const noexcept { return myIsDone; }
+
+	// The requested size on success, -1 on EOF mid-read, a socket error, or cancellation.
+	ssize_t
+	await_resume() { return myRes; }
+
+private:
+#if IOCORE_USE_URING
+	void
+	onCQE(
+		int res) final;
+
+	void
+	armRecv();
+#else
+	bool
+	execute();
+
+	bool
+	onIOEvent() final;
+
+	void
+	cancel() final;
+#endif
+
+	BufferedStream *const myStream;
+	void *const myData;
+	const size_t mySize;
+	size_t myGot;
+	bool myIsDone;
+	ssize_t myRes;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Base of the file awaitables. Regular files don't fit the task machinery: epoll
+// can't watch them at all, and they never return EAGAIN - they just block. With
+// io_uring the operation goes into the ring like any other, with an explicit offset;
+// the epoll backend offloads the blocking syscall to the loop's file worker thread
+// and resumes the coroutine back on the loop. Either way the loop keeps serving
+// sockets while the disk seeks.
+//
+// No IOTask means no close()-cancellation and no WithTimeout() on these.
+//
+struct AsyncFileOperation : public AsyncOperation
+{
+	AsyncFileOperation(
+		IOCore &core,
+		int fd,
+		uint64_t offset);
+
+	bool
+	await_ready() const noexcept { return false; }
+
+	// The transferred byte count, or -1 on an IO error.
+	ssize_t
+	await_resume() { return myRes; }
+
+	bool
+	await_suspend(
+		std::coroutine_handle<> coro);
+
+protected:
+#if IOCORE_USE_URING
+	void
+	onCQE(
+		int res) final;
+#else
+	// The blocking syscall itself, invoked on the file worker thread.
+	virtual void
+	fileExecute() = 0;
+
+	// Never on a task - never reached.
+	bool
+	onIOEvent() final { abort(); }
+
+	void
+	cancel() final { abort(); }
+#endif
+
+	IOCore &myCore;
+	const int myFd;
+	const uint64_t myOffset;
+	ssize_t myRes;
+
+	friend IOCore;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+struct AsyncFileRead final : public AsyncFileOperation
+{
+	AsyncFileRead(
+		IOCore &core,
+		int fd,
+		void *data,
+		size_t size,
+		uint64_t offset);
+	AsyncFileRead(
+		const AsyncFileRead&) = delete;
+	AsyncFileRead& operator=(
+		const AsyncFileRead&) = delete;
+
+private:
+#if !IOCORE_USE_URING
+	void
+	fileExecute() final;
+#endif
+
+	void *const myData;
+	const size_t mySize;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+struct AsyncFileWrite final : public AsyncFileOperation
+{
+	AsyncFileWrite(
+		IOCore &core,
+		int fd,
+		const void *data,
+		size_t size,
+		uint64_t offset);
+	AsyncFileWrite(
+		const AsyncFileWrite&) = delete;
+	AsyncFileWrite& operator=(
+		const AsyncFileWrite&) = delete;
+
+private:
+#if !IOCORE_USE_URING
+	void
+	fileExecute() final;
+#endif
+
+	const void *const myData;
+	const size_t mySize;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Buffered reads on top of a task's socket. The stream keeps an internal buffer which the
+// read operations refill in big chunks, so a line-oriented protocol costs one recv per
+// buffer-full instead of one awaited syscall per line. Only the receive side is buffered -
+// sends go through the task as usual. Same as with the raw operations, only one read may
+// be awaited on the stream at a time.
+//
+class BufferedStream
+{
+public:
+	// The refill chunk target.
+	static constexpr size_t theDefaultCapacity = 64 * 1024;
+
+	BufferedStream(
+		IOTask *task,
+		size_t capacity = theDefaultCapacity);
+
+	//////////////////////////////////////////////
+	// Those all are arguments for co_await.
+	//
+	AsyncReadUntil
+	readUntil(char delim) { return AsyncReadUntil(this, delim); }
+
+	AsyncReadExact
+	readExact(void *data, size_t size) { return AsyncReadExact(this, data, size); }
+	//
+	//////////////////////////////////////////////
+
+	IOTask *
+	task() { return myTask; }
+
+private:
+	// The received but not yet consumed bytes.
+	std::string_view
+	data() const { return {myBuf.data() + myPos, myUsed - myPos}; }
+
+	char *
+	spaceBegin() { return myBuf.data() + myUsed; }
+
+	size_t
+	spaceSize() const { return myBuf.size() - myUsed; }
+
+	// Make room for the next refill - compact or grow the buffer.
+	void
+	ensureSpace();
+
+	void
+	produce(size_t size) { myUsed += size; }
+
+	std::string_view
+	consume(
+		size_t size)
+	{
+		std::string_view res(myBuf.data() + myPos, size);
+		myPos += size;
+		return res;
+	}
+
+	IOTask *const myTask;
+	std::vector<char> myBuf;
+	// First unconsumed byte and the end of the received data.
+	size_t myPos;
+	size_t myUsed;
+
+	friend AsyncReadExact;
+	friend AsyncReadUntil;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
 class IOTask
 {
 public:
@@ -286,9 +771,16 @@ public:
 	AsyncSend
 	asyncSend(const void *data, size_t size) { return AsyncSend(this, data, size); }
 
+	AsyncSendMsg
+	asyncSendMsg(const iovec *iov, int iovCount, bool isZeroCopy = false)
+	{ return AsyncSendMsg(this, iov, iovCount, isZeroCopy); }
+
 	AsyncAccept
 	asyncAccept(sockaddr *addr, socklen_t *size) { return AsyncAccept(this, addr, size); }
 
+	AsyncAcceptMany
+	asyncAcceptMany(int *fds, int capacity) { return AsyncAcceptMany(this, fds, capacity); }
+
 	AsyncConnect
 	asyncConnect(const sockaddr *addr, socklen_t size) { return AsyncConnect(this, addr, size); }
 	//
@@ -305,14 +797,83 @@ private:
 	// Currently waiting async operation blocked by a co_await. Coroutine can't be blocked
 	// more than once at a time, which means the current operation can only be one.
 	AsyncOperation* myAsyncOp;
+#if IOCORE_USE_URING
+	// The task had an operation in flight when it got unsubscribed, and a cancellation
+	// was submitted for it. The task is deleted when the operation's completion arrives.
+	bool myIsCancelSent;
+#endif
 	IOCore &myCore;
 
 	friend AsyncAccept;
+	friend AsyncAcceptMany;
 	friend AsyncConnect;
 	friend AsyncOperation;
+	friend AsyncReadExact;
+	friend AsyncReadUntil;
 	friend AsyncRecv;
 	friend AsyncSend;
+	friend AsyncSendMsg;
 	friend IOCore;
+	friend IOTaskPool;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// One armed deadline in the loop's timer wheel. The wheel owns it - the awaitable which
+// armed it only keeps a pointer and hands it back via disarmTimer().
+//
+struct IOCoreTimer
+{
+private:
+	IOTask *myTask;
+	uint64_t myDeadlineTick;
+	// Disarmed before firing. The wheel drops it when its bucket comes around.
+	bool myIsCanceled;
+	// Fired and left the wheel. The owner frees it on disarm.
+	bool myIsFired;
+
+	friend IOCore;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// One cross-thread call posted to a loop - a node of its lock-free MPSC submission
+// stack.
+//
+struct IOCoreCallback
+{
+	std::function<void()> myFunc;
+	// Set instead of the function when a ready coroutine is handed over for a resume.
+	std::coroutine_handle<> myCoro;
+	IOCoreCallback *myNext;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// A snapshot of one loop's counters, filled by IOCore::statGet(). The histograms are
+// log2-bucketed: bucket i counts the samples with a value in [2^i, 2^(i+1)), bucket 0
+// additionally takes zero. Cheap enough on both ends to sample every second - the
+// snapshot is a few relaxed loads, and the loop itself only bumps plain per-thread
+// counters as it goes.
+//
+struct IOCoreStat
+{
+	static constexpr uint32_t theBucketCount = 32;
+
+	// Busy part of a roll() turn, microseconds. The kernel wait is excluded - an
+	// idle loop sleeping in it is not latency.
+	uint64_t myTurnDurationLog[theBucketCount];
+	// Completions (or epoll events) handled by one turn.
+	uint64_t myEventsPerTurnLog[theBucketCount];
+	// One continuation run - a coroutine resume or a posted callback - microseconds.
+	// A fat high bucket here is a continuation hogging the loop.
+	uint64_t myResumeDurationLog[theBucketCount];
+	uint64_t myTurnCount;
+	uint64_t myResumeCount;
+	// Tasks by state at the moment of the snapshot.
+	uint64_t myNewTaskCount;
+	uint64_t myWorkingTaskCount;
+	uint64_t myDeletingTaskCount;
 };
 
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -321,6 +882,11 @@ private:
 //
 struct IOCore
 {
+	// The timer wheel granularity and its bucket ring size. Deadlines further than one
+	// lap away just stay in their bucket for more laps.
+	static constexpr uint64_t theTimerTickMs = 10;
+	static constexpr uint32_t theTimerWheelSize = 256;
+
 	IOCore();
 	~IOCore();
 
@@ -344,24 +910,412 @@ struct IOCore
 	unsubscribe(
 		IOTask *s);
 
+	// Execute the function on this loop's thread on its next turn. This is the channel
+	// for starting coroutines on a foreign loop - the async operations write into the
+	// loop's submission ring and may only be created on its own thread. Callable from
+	// any thread: the call is one atomic push onto the loop's MPSC stack, and only
+	// the push onto an empty stack rings the eventfd doorbell - a burst of handoffs
+	// pays for one wakeup.
+	void
+	post(
+		std::function<void()>&& f);
+
+	// Same, but resumes a suspended coroutine on the loop's thread instead of calling
+	// a function. For foreign threads handing a computed result back to the awaiting
+	// coroutine without a function wrapper.
+	void
+	post(
+		std::coroutine_handle<> coro);
+
+	// Put a deadline for the task's pending operation onto the timer wheel. When it
+	// fires, the operation is canceled and completes with an error. Arming is just a
+	// list push - the single timerfd ticks for the whole wheel. Only on the loop's
+	// thread, like the operations themselves.
+	IOCoreTimer *
+	armTimer(
+		IOTask *task,
+		uint64_t timeoutMs);
+
+	// Give the timer back to the wheel. Must be called exactly once for each armed
+	// timer, fired or not.
+	void
+	disarmTimer(
+		IOCoreTimer *timer);
+
+	//////////////////////////////////////////////
+	// Those are arguments for co_await, like the task operations, but on a regular
+	// file. Only on the loop's own thread, like the task operations too.
+	//
+	AsyncFileRead
+	fileRead(int fd, void *data, size_t size, uint64_t offset)
+	{ return AsyncFileRead(*this, fd, data, size, offset); }
+
+	AsyncFileWrite
+	fileWrite(int fd, const void *data, size_t size, uint64_t offset)
+	{ return AsyncFileWrite(*this, fd, data, size, offset); }
+	//
+	//////////////////////////////////////////////
+
 	// Get all pending events from the kernel and handle them. Can only be done in one
 	// thread at a time.
 	void
 	roll();
 
+	// Copy the loop's counters out. Callable from any thread, any time.
+	void
+	statGet(
+		IOCoreStat& out) const;
+
 private:
+	static uint64_t
+	statNowUs();
+
+	static void
+	statHistAdd(
+		std::atomic_uint64_t *buckets,
+		uint64_t value);
+
+	void
+	postCallback(
+		IOCoreCallback *cb);
+
 	void
 	processQueues();
 
+	void
+	processCallbacks();
+
+	void
+	dropCallbacks();
+
+	void
+	processTimers();
+
+	// Cancel the pending operation of the fired timer's task.
+	void
+	fireTimer(
+		IOCoreTimer *timer);
+
+#if IOCORE_USE_URING
+	// Reserve the next SQE and fill it. No syscall here - the entry is only written
+	// into the shared ring, the next roll() flushes all of them at once.
+	io_uring_sqe *
+	prepSqe(
+		uint8_t opcode,
+		int fd,
+		const void *addr,
+		uint32_t len,
+		uint64_t off,
+		void *userData);
+
+	void
+	rearmEventRead();
+
+	void
+	rearmTimerRead();
+
+	void
+	dropTask(
+		IOTask *s);
+
+	// SQ and CQ ring mappings and their kernel-shared indexes.
+	void *mySqRingMem;
+	size_t mySqRingSize;
+	void *myCqRingMem;
+	size_t myCqRingSize;
+	io_uring_sqe *mySqes;
+	size_t mySqesSize;
+	uint32_t *mySqHead;
+	uint32_t *mySqTail;
+	uint32_t mySqMask;
+	uint32_t mySqEntryCount;
+	uint32_t *mySqArray;
+	uint32_t *myCqHead;
+	uint32_t *myCqTail;
+	uint32_t myCqMask;
+	io_uring_cqe *myCqes;
+	// The SQ tail known locally and the one already handed to the kernel. Their
+	// difference is what the next io_uring_enter() submits.
+	uint32_t myLocalSqTail;
+	uint32_t mySubmittedSqTail;
+	// Targets of the permanently rearmed eventfd and timerfd reads.
+	uint64_t myEventBuf;
+	uint64_t myTimerBuf;
+
+	friend AsyncAccept;
+	friend AsyncAcceptMany;
+	friend AsyncConnect;
+	friend AsyncFileRead;
+	friend AsyncFileWrite;
+	friend AsyncReadExact;
+	friend AsyncReadUntil;
+	friend AsyncRecv;
+	friend AsyncSend;
+	friend AsyncSendMsg;
+#else
+	// The file worker - see AsyncFileOperation. Started lazily by the first file
+	// operation, so purely network loops don't carry an idle thread around.
+	void
+	fileOffload(
+		AsyncFileOperation *op);
+
+	void
+	fileWorkerF();
+
+	std::thread myFileWorker;
+	std::mutex myFileMutex;
+	std::condition_variable myFileCond;
+	std::vector<AsyncFileOperation *> myFileQueue;
+	bool myIsFileWorkerStopped = false;
+
+	friend AsyncFileOperation;
+#endif
+
 	int myEventFd;
 	IOTask *myEventSub;
+	// The timer wheel and its single timerfd, armed periodic only while there are live
+	// timers, so idle loops are not woken by the ticks.
+	int myTimerFd;
+	IOTask *myTimerSub;
+	uint64_t myTimerLastTick;
+	uint32_t myTimerCount;
+	bool myIsTimerFdArmed;
+	std::vector<IOCoreTimer *> myTimerWheel[theTimerWheelSize];
+	// The epoll instance, or the io_uring fd.
 	int myFd;
 	std::atomic_bool myIsStopped;
 
+	// The live counters behind statGet(). Relaxed atomics - the loop thread is the
+	// only writer, the samplers just read. A snapshot doesn't have to be consistent
+	// across the counters, only cheap.
+	struct
+	{
+		std::atomic_uint64_t myTurnDurationLog[IOCoreStat::theBucketCount];
+		std::atomic_uint64_t myEventsPerTurnLog[IOCoreStat::theBucketCount];
+		std::atomic_uint64_t myResumeDurationLog[IOCoreStat::theBucketCount];
+		std::atomic_uint64_t myTurnCount;
+		std::atomic_uint64_t myResumeCount;
+		std::atomic_uint64_t myNewTaskCount;
+		std::atomic_uint64_t myWorkingTaskCount;
+		std::atomic_uint64_t myDeletingTaskCount;
+	} myStat{};
+
 	std::mutex myMutex;
 	// Tasks currently in work.
 	std::vector<IOTask *> myTasks;
 	// Incoming tasks. New and deleting ones.
 	std::vector<IOTask *> myQueue;
+	// Posted cross-loop calls waiting for the loop's thread. A Treiber stack - the
+	// producers push with a CAS, the loop consumes the whole stack with one exchange,
+	// so there is no ABA and no lock on this path.
+	std::atomic<IOCoreCallback *> myCallbacks{nullptr};
 	std::atomic_uint64_t mySize;
 };
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Bounds a co_await on any async operation:
+//
+//     ssize_t rc = co_await WithTimeout(task->asyncRecv(buf, size), 100);
+//
+// If the operation doesn't complete within the timeout, it is canceled and completes
+// with an error, exactly like on task closure. The deadlines go onto the loop's timer
+// wheel, so wrapping every socket operation costs a couple of list pushes, not a timerfd
+// per operation.
+//
+template<typename Operation>
+struct WithTimeout
+{
+	WithTimeout(
+		Operation&& op,
+		uint64_t timeoutMs)
+		: myOp(op)
+		, myTimeoutMs(timeoutMs)
+		, myTimer(nullptr)
+	{
+	}
+	WithTimeout(
+		const WithTimeout&) = delete;
+	WithTimeout& operator=(
+		const WithTimeout&) = delete;
+
+	bool
+	await_ready() const noexcept { return myOp.await_ready(); }
+
+	bool
+	await_suspend(
+		std::coroutine_handle<> coro)
+	{
+		// The wrapped operation is the one registered on the task - its completion,
+		// including the canceled-by-timeout one, is what resumes the coroutine.
+		bool res = myOp.await_suspend(coro);
+		IOTask *task = myOp.task();
+		myTimer = task->core().armTimer(task, myTimeoutMs);
+		return res;
+	}
+
+	auto
+	await_resume()
+	{
+		// Null when the operation completed without suspending at all.
+		if (myTimer != nullptr)
+			myOp.task()->core().disarmTimer(myTimer);
+		return myOp.await_resume();
+	}
+
+private:
+	// The operation object lives in the awaiting coroutine's frame, like the awaitables
+	// themselves do.
+	Operation& myOp;
+	const uint64_t myTimeoutMs;
+	IOCoreTimer *myTimer;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// The awaitable returned by IOTaskPool::acquire(). On a pooled hit it completes without
+// even suspending the coroutine; only a miss pays the connect.
+//
+struct AsyncPoolAcquire
+{
+	AsyncPoolAcquire(
+		IOTaskPool *pool,
+		const sockaddr_in &addr);
+	AsyncPoolAcquire(
+		const AsyncPoolAcquire&) = delete;
+	AsyncPoolAcquire& operator=(
+		const AsyncPoolAcquire&) = delete;
+
+	bool
+	await_ready() noexcept;
+
+	bool
+	await_suspend(
+		std::coroutine_handle<> coro);
+
+	// A connected task, or nullptr when the connect failed.
+	IOTask *
+	await_resume();
+
+private:
+	IOTaskPool *const myPool;
+	const sockaddr_in myAddr;
+	IOTask *myTask;
+	// The fresh-connection path; stays empty on a pooled hit.
+	std::optional<AsyncConnect> myConnect;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Reuses upstream connections across client coroutines:
+//
+//     IOTask *conn = co_await pool.acquire(addr);
+//     ... the request/response exchange ...
+//     pool.release(addr, conn);
+//
+// For small requests the TCP handshake dominates the latency, so a hot upstream is
+// reached with zero handshake on the common path - acquire() hands out an idle pooled
+// connection when one is cached for the endpoint and only connects anew otherwise.
+// Every handed out connection is liveness-checked first: one MSG_PEEK tells apart an
+// idle healthy connection (nothing to read) from one the upstream closed or desynced
+// while it sat in the pool - those are dropped, not handed out.
+//
+// release() gives the connection back for reuse; the caller must have consumed its
+// whole response, leftover bytes would corrupt the next user's protocol. A connection
+// in an unknown state should be close()-d instead of released. The growth is bounded:
+// beyond the per-endpoint idle cap a released connection is closed, not cached.
+//
+// The pool lives on one loop, like the tasks themselves - acquire() and release() may
+// only be called on the loop's own thread.
+//
+class IOTaskPool
+{
+public:
+	static constexpr uint32_t theDefaultIdleLimit = 8;
+
+	IOTaskPool(
+		IOCore &core,
+		uint32_t idleLimitPerEndpoint = theDefaultIdleLimit);
+
+	~IOTaskPool();
+
+	// An argument for co_await.
+	AsyncPoolAcquire
+	acquire(const sockaddr_in &addr) { return AsyncPoolAcquire(this, addr); }
+
+	void
+	release(
+		const sockaddr_in &addr,
+		IOTask *task);
+
+	IOCore&
+	core() { return myCore; }
+
+	// Idle connections currently cached, over all the endpoints.
+	uint32_t
+	idleCount() const { return myIdleCount; }
+
+private:
+	static uint64_t
+	keyOf(
+		const sockaddr_in &addr);
+
+	// Pop a cached connection for the key which is still alive, if any.
+	IOTask *
+	popHealthy(
+		uint64_t key);
+
+	IOCore &myCore;
+	const uint32_t myIdleLimit;
+	uint32_t myIdleCount;
+	std::unordered_map<uint64_t, std::vector<IOTask *>> myIdle;
+
+	friend AsyncPoolAcquire;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// N event loops, each rolled by its own thread pinned to a CPU core. A task is placed
+// onto one loop and stays there for its whole life - all its IO completions and
+// coroutine resumes happen on that loop's thread, so the task's data needs no locks.
+// Cross-loop communication reuses the eventfd wakeup channel every IOCore already has:
+// subscribing or closing a task from any thread queues it and kicks the owning loop out
+// of its kernel wait.
+//
+class IOCoreGroup
+{
+public:
+	IOCoreGroup(
+		uint32_t loopCount);
+
+	~IOCoreGroup();
+
+	// Spawn the loop threads. The loops can be subscribed to even before the start.
+	void
+	start();
+
+	// Stop all the loops and join their threads.
+	void
+	stop();
+
+	uint32_t
+	loopCount() const { return myLoops.size(); }
+
+	IOCore&
+	loop(
+		uint32_t idx) { return *myLoops[idx]; }
+
+	// The next loop to put a task onto, round-robin. Can be called from any thread.
+	IOCore&
+	nextLoop();
+
+private:
+	void
+	runLoop(
+		uint32_t idx);
+
+	// IOCore is neither movable nor copyable - keep the loops on the heap.
+	std::vector<std::unique_ptr<IOCore>> myLoops;
+	std::vector<std::thread> myThreads;
+	std::atomic_uint32_t myNextLoop;
+};
@@ -12,17 +12,30 @@
 
 static constexpr uint64_t theRequestTargetCount = 50;
 static constexpr int theClientCount = 100;
+// The echoed message. Delimiter-terminated, so the replies can be read through a
+// buffered stream.
+static constexpr char theMessage[] = "ping\n";
+static constexpr size_t theMessageLen = sizeof(theMessage) - 1;
+// Every await on a socket is bounded. Generous - only a hung peer would ever hit it.
+static constexpr uint64_t theIOTimeoutMs = 10'000;
+// Event loops (= threads, pinned to cores) on each side.
+static constexpr uint32_t theServerLoopCount = 3;
+static constexpr uint32_t theClientLoopCount = 2;
 
 static uint64_t
 getUsec();
 
 static void
-ioCoreRunF(
+makeFdNonblock(
+	int fd);
+
+static void
+fileIOCheck(
 	IOCore &core);
 
 static void
-makeFdNonblock(
-	int fd);
+poolCheck(
+	IOCore &core);
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
@@ -92,7 +105,7 @@ struct Server
 
 	uint16_t
 	bindAndListenAndRun(
-		IOCore &core);
+		IOCoreGroup &group);
 
 	void
 	stop();
@@ -102,6 +115,8 @@ private:
 	coroRun();
 
 	IOTask *myTask;
+	// The accepted peers are spread over the group's loops round-robin.
+	IOCoreGroup *myGroup;
 	const std::shared_ptr<Context> myContext;
 };
 
@@ -112,31 +127,45 @@ run()
 {
 	std::shared_ptr<Context> context = std::make_shared<Context>();
 
-	IOCore serverCore;
+	IOCoreGroup serverGroup(theServerLoopCount);
 	std::cout << "start server" << std::endl;
 	Server server(context);
-	uint16_t port = server.bindAndListenAndRun(serverCore);
-	std::thread serverThread(ioCoreRunF, std::ref(serverCore));
+	uint16_t port = server.bindAndListenAndRun(serverGroup);
+	serverGroup.start();
 
 	std::cout << "start clients" << std::endl;
-	IOCore clientCore;
+	IOCoreGroup clientGroup(theClientLoopCount);
 	for (int i = 0; i < theClientCount; ++i)
-		(new Client(context))->connectAndRun(clientCore, port);
+		(new Client(context))->connectAndRun(clientGroup.nextLoop(), port);
 
 	std::cout << "wait for the load to pass" << std::endl;
 	uint64_t t1 = getUsec();
-	std::thread clientThread(ioCoreRunF, std::ref(clientCore));
+	clientGroup.start();
 	context->waitClientsFinish();
-	clientCore.stop();
-	clientThread.join();
+	clientGroup.stop();
 	uint64_t t2 = getUsec();
 	std::cout << "Took " << (t2 - t1) / 1000.0 << " ms" << std::endl;
 
+	// The loop telemetry is sampled from this foreign thread, like a production
+	// monitor would every second.
+	IOCoreStat stat;
+	serverGroup.loop(0).statGet(stat);
+	std::cout << "server loop 0: " << stat.myTurnCount << " turns, "
+		<< stat.myResumeCount << " resumes, " << stat.myWorkingTaskCount
+		<< " live tasks" << std::endl;
+	assert(stat.myTurnCount > 0);
+	assert(stat.myResumeCount > 0);
+
+	std::cout << "check file IO" << std::endl;
+	fileIOCheck(serverGroup.loop(0));
+
+	std::cout << "check connection pool" << std::endl;
+	poolCheck(serverGroup.loop(0));
+
 	std::cout << "wait for the server to stop" << std::endl;
 	server.stop();
 	context->waitServerFinish();
-	serverCore.stop();
-	serverThread.join();
+	serverGroup.stop();
 	return 0;
 }
 
@@ -159,13 +188,6 @@ getUsec()
 	return t.tv_sec * 1'000'000 + t.tv_nsec / 1000;
 }
 
-static void
-ioCoreRunF(IOCore &core)
-{
-	while (!core.isStopped())
-		core.roll();
-}
-
 static void
 makeFdNonblock(
 	int fd)
@@ -176,6 +198,139 @@ makeFdNonblock(
 	assert(rc == 0);
 }
 
+static void
+fileIOCheck(
+	IOCore &core)
+{
+	char path[] = "/tmp/iocoro_test_XXXXXX";
+	int fd = mkstemp(path);
+	assert(fd >= 0);
+	unlink(path);
+	std::atomic_bool isDone{false};
+	// The coroutine has to run on the loop's own thread, like the socket ones.
+	core.post([&core, fd, &isDone]() {
+		[](IOCore *core, int fd, std::atomic_bool *isDone) -> IOCoroutine {
+			ssize_t rc = co_await core->fileWrite(fd, "hello", 5, 0);
+			assert(rc == 5);
+			rc = co_await core->fileWrite(fd, "world", 5, 5);
+			assert(rc == 5);
+			char buf[10];
+			rc = co_await core->fileRead(fd, buf, 10, 0);
+			assert(rc == 10);
+			assert(memcmp(buf, "helloworld", 10) == 0);
+			isDone->store(true, std::memory_order_release);
+			co_return;
+		}(&core, fd, &isDone);
+	});
+	while (!isDone.load(std::memory_order_acquire))
+		usleep(1000);
+	close(fd);
+}
+
+static void
+poolCheck(
+	IOCore &core)
+{
+	// A tiny line-echo upstream. It closes each connection after two echoed lines, so
+	// the pool's liveness check gets a dead cached connection to reject.
+	int lsn = socket(AF_INET, SOCK_STREAM, 0);
+	assert(lsn >= 0);
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	int rc = bind(lsn, (sockaddr *)&addr, sizeof(addr));
+	assert(rc == 0);
+	rc = listen(lsn, SOMAXCONN);
+	assert(rc == 0);
+	socklen_t len = sizeof(addr);
+	rc = getsockname(lsn, (sockaddr *)&addr, &len);
+	assert(rc == 0);
+	makeFdNonblock(lsn);
+	IOTask *lsnTask = core.subscribe(lsn);
+
+	std::atomic_bool isClientDone{false};
+	// The client, the acceptor, and the two served upstream connections.
+	std::atomic_int doneCount{0};
+	core.post([&core, lsnTask, addr, &isClientDone, &doneCount]() {
+		// The upstream acceptor.
+		[](IOCore *core, IOTask *lsnTask, std::atomic_int *doneCount) -> IOCoroutine {
+			while (true)
+			{
+				int sock = co_await lsnTask->asyncAccept(nullptr, nullptr);
+				if (sock < 0)
+					break;
+				makeFdNonblock(sock);
+				[](IOCore *core, int sock, std::atomic_int *doneCount) -> IOCoroutine {
+					IOTask *peer = core->subscribe(sock);
+					BufferedStream stream(peer);
+					for (int i = 0; i < 2; ++i)
+					{
+						std::string_view line = co_await stream.readUntil('\n');
+						if (line.empty())
+							break;
+						ssize_t rc = co_await peer->asyncSend(line.data(), line.size());
+						assert(rc == (ssize_t)line.size());
+						MAYBE_UNUSED(rc);
+					}
+					peer->close();
+					doneCount->fetch_add(1, std::memory_order_release);
+					co_return;
+				}(core, sock, doneCount);
+			}
+			doneCount->fetch_add(1, std::memory_order_release);
+			co_return;
+		}(&core, lsnTask, &doneCount);
+		// The aggregator side, reaching the upstream through the pool.
+		[](IOCore *core, sockaddr_in addr, std::atomic_bool *isClientDone,
+			std::atomic_int *doneCount) -> IOCoroutine {
+			IOTaskPool pool(*core, 4);
+			// A cold acquire pays the connect...
+			IOTask *conn = co_await pool.acquire(addr);
+			assert(conn != nullptr);
+			char buf[5];
+			ssize_t rc = co_await conn->asyncSend(theMessage, theMessageLen);
+			assert(rc == (ssize_t)theMessageLen);
+			rc = co_await conn->asyncRecv(buf, theMessageLen);
+			assert(rc == (ssize_t)theMessageLen);
+			pool.release(addr, conn);
+			assert(pool.idleCount() == 1);
+			// ...a hot one does not - the same connection comes back, no handshake.
+			conn = co_await pool.acquire(addr);
+			assert(conn != nullptr);
+			// Reused, not reconnected - the cache is empty again.
+			assert(pool.idleCount() == 0);
+			rc = co_await conn->asyncSend(theMessage, theMessageLen);
+			assert(rc == (ssize_t)theMessageLen);
+			rc = co_await conn->asyncRecv(buf, theMessageLen);
+			assert(rc == (ssize_t)theMessageLen);
+			// The upstream closes after the second line. Consume the EOF so the
+			// cached connection is verifiably dead, then watch the pool reject
+			// it instead of handing it out - the next exchange must still work.
+			rc = co_await conn->asyncRecv(buf, 1);
+			assert(rc <= 0);
+			pool.release(addr, conn);
+			conn = co_await pool.acquire(addr);
+			assert(conn != nullptr);
+			rc = co_await conn->asyncSend(theMessage, theMessageLen);
+			assert(rc == (ssize_t)theMessageLen);
+			rc = co_await conn->asyncRecv(buf, theMessageLen);
+			assert(rc == (ssize_t)theMessageLen);
+			pool.release(addr, conn);
+			// The pool destructor closes the cached connection.
+			isClientDone->store(true, std::memory_order_release);
+			doneCount->fetch_add(1, std::memory_order_release);
+			co_return;
+		}(&core, addr, &isClientDone, &doneCount);
+	});
+	while (!isClientDone.load(std::memory_order_acquire))
+		usleep(1000);
+	// Stops the acceptor; the second upstream connection ends with the pool.
+	lsnTask->close();
+	while (doneCount.load(std::memory_order_acquire) < 4)
+		usleep(1000);
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////
 
 void
@@ -282,17 +437,51 @@ IOCoroutine
 Client::coroRun()
 {
 	LOG_THIS_DEBUG(Client, coroRun, "");
+	// The replies are read through the buffered stream - it serves them from its
+	// internal buffer and refills it in big chunks when it runs dry.
+	BufferedStream stream(myTask);
 	for (uint32_t i = 0; i < theRequestTargetCount; ++i)
 	{
-		uint8_t data;
 		LOG_THIS_DEBUG(Client, coroRun, "send");
-		ssize_t rc = co_await myTask->asyncSend(&data, 1);
+		ssize_t rc;
+		if (i % 2 == 0)
+		{
+			rc = co_await WithTimeout(myTask->asyncSend(theMessage, theMessageLen),
+				theIOTimeoutMs);
+		}
+		else
+		{
+			// The gathered flavor - the message split into two parts, sent with
+			// one awaited sendmsg. Every other time also as zerocopy, to cover
+			// the deferred buffer-release resume. The iovecs and the message are
+			// fine to reference from the kernel - they outlive the co_await.
+			iovec iov[2];
+			iov[0].iov_base = (void *)theMessage;
+			iov[0].iov_len = 2;
+			iov[1].iov_base = (void *)(theMessage + 2);
+			iov[1].iov_len = theMessageLen - 2;
+			rc = co_await WithTimeout(myTask->asyncSendMsg(iov, 2, i % 4 == 1),
+				theIOTimeoutMs);
+		}
 		LOG_THIS_DEBUG(Client, coroRun, "sent " << rc);
-		assert(rc == 1);
+		assert(rc == (ssize_t)theMessageLen);
 		LOG_THIS_DEBUG(Client, coroRun, "receive");
-		rc = co_await myTask->asyncRecv(&data, 1);
-		LOG_THIS_DEBUG(Client, coroRun, "received " << rc);
-		assert(rc == 1);
+		if (i % 2 == 0)
+		{
+			std::string_view line = co_await WithTimeout(stream.readUntil('\n'),
+				theIOTimeoutMs);
+			LOG_THIS_DEBUG(Client, coroRun, "received " << line.size());
+			assert(line == theMessage);
+		}
+		else
+		{
+			char buf[theMessageLen];
+			rc = co_await WithTimeout(stream.readExact(buf, theMessageLen),
+				theIOTimeoutMs);
+			LOG_THIS_DEBUG(Client, coroRun, "received " << rc);
+			assert(rc == (ssize_t)theMessageLen);
+			assert(memcmp(buf, theMessage, theMessageLen) == 0);
+		}
 	}
 	LOG_THIS_DEBUG(Client, coroRun, "finish");
 	myContext->onClientFinish();
@@ -305,6 +494,7 @@ Client::coroRun()
 Server::Server(
 	const std::shared_ptr<Context>& ctx)
 	: myTask(nullptr)
+	, myGroup(nullptr)
 	, myContext(ctx)
 {
 }
@@ -316,8 +506,9 @@ Server::~Server()
 
 uint16_t
 Server::bindAndListenAndRun(
-	IOCore &core)
+	IOCoreGroup &group)
 {
+	myGroup = &group;
 	sockaddr_in addr;
 	memset(&addr, 0, sizeof(addr));
 	addr.sin_family = AF_INET;
@@ -334,7 +525,9 @@ Server::bindAndListenAndRun(
 	rc = listen(sock, SOMAXCONN);
 	assert(rc == 0);
 	makeFdNonblock(sock);
-	myTask = core.subscribe(sock);
+	// The listening socket has affinity to the first loop; the accepted peers go
+	// round-robin over all of them.
+	myTask = group.loop(0).subscribe(sock);
 	LOG_THIS_DEBUG(Server, bindAndListen, myTask);
 
 	rc = getsockname(sock, (sockaddr *)&addr, &len);
@@ -359,14 +552,25 @@ Server::coroRun()
 	while (true)
 	{
 		LOG_THIS_DEBUG(Server, coroRun, "accept start");
-		sockaddr_in addr;
-		socklen_t len = sizeof(addr);
-		int sock = co_await task->asyncAccept((sockaddr *)&addr, &len);
+		// A whole batch of connections per resume - a reconnect storm then costs
+		// one coroutine wakeup per loop turn, not per peer.
+		int socks[16];
+		int count = co_await task->asyncAcceptMany(socks, 16);
 		// Could be cancel.
-		if (sock < 0)
+		if (count < 0)
 			break;
-		LOG_THIS_DEBUG(Server, coroRun, "new client, " << sock);
-		(new Client(myContext))->wrapAndRun(task->core(), sock);
+		for (int i = 0; i < count; ++i)
+		{
+			int sock = socks[i];
+			LOG_THIS_DEBUG(Server, coroRun, "new client, " << sock);
+			// The peer's coroutine has to start on its own loop's thread - hand
+			// it over through the cross-loop channel.
+			IOCore& peerLoop = myGroup->nextLoop();
+			Client* peer = new Client(myContext);
+			peerLoop.post([peer, &peerLoop, sock]() {
+				peer->wrapAndRun(peerLoop, sock);
+			});
+		}
 	}
 	myContext->onServerFinish();
 	co_return;
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdint.h>
+
 /**
  * ---------------------------------------------------------------
  * Mersenne Twister
@@ -52,3 +54,43 @@ mersenne_twister_create(struct mersenne_twister *twister, unsigned int seed)
 	for (int i = 0; i < MT_LEN * 100; i++)
 		mersenne_twister_generate(twister);
 }
+
+/**
+ * ---------------------------------------------------------------
+ * Counter-based batch generator
+ * Unlike the twister above, each output is a pure function of a
+ * counter value - the lanes have no data dependency on each
+ * other, so the loop auto-vectorizes and a whole batch is filled
+ * per call. Meant for bulk load generation where random bytes
+ * must not cost noticeable CPU. One instance per thread, no
+ * locks; the mix is the splitmix64 finalizer.
+ * ---------------------------------------------------------------
+ */
+#define BATCH_RANDOM_SIZE 64
+
+struct batch_random
+{
+	uint64_t counter;
+	uint64_t key;
+};
+
+static void
+batch_random_create(struct batch_random *gen, uint64_t seed)
+{
+	/* An odd per-seed key keeps per-thread streams disjoint. */
+	gen->key = (seed * 0x9E3779B97F4A7C15ULL) | 1;
+	gen->counter = 0;
+}
+
+static void
+batch_random_generate(struct batch_random *gen, uint64_t *out)
+{
+	uint64_t base = gen->counter;
+	gen->counter += BATCH_RANDOM_SIZE;
+	for (int i = 0; i < BATCH_RANDOM_SIZE; i++) {
+		uint64_t z = (base + i) * gen->key + 0x9E3779B97F4A7C15ULL;
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+		out[i] = z ^ (z >> 31);
+	}
+}
@@ -1,3 +1,6 @@
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -14,6 +17,10 @@
 #define IS_READABLE 0
 #define IS_WRITABLE 1
 #define MEM_META_SIZE 2
+/* How far ahead of the merge cursor each run is prefetched, in elements. */
+#define MERGE_PREFETCH_DIST 16
+/* How many elements each run contributes to the splitter sample. */
+#define MERGE_SAMPLE_PER_RUN 32
 
 struct worker {
 	char *mem;
@@ -84,6 +91,173 @@ read_from_shared_mem(char *mem, char *dst, int size)
 	}
 }
 
+struct merge_run {
+	const int *pos;
+	const int *end;
+};
+
+/* One value range of the final array, merged by one thread. */
+struct merge_task {
+	pthread_t thread;
+	struct merge_run *runs;
+	int nruns;
+	int *dst;
+	int size;
+};
+
+/*
+ * Tournament (loser) tree over the run heads. nodes[1..count-1] keep the
+ * losers of the internal matches, nodes[0] keeps the overall winner, the
+ * leaves are the runs themselves. Popping the minimum then replays only
+ * the matches on the winner's leaf-to-root path - log2(k) comparisons
+ * instead of k-1 for rescanning all heads.
+ */
+struct loser_tree {
+	struct merge_run *runs;
+	int count;
+	int *nodes;
+};
+
+int
+run_head(const struct merge_run *run)
+{
+	return run->pos == run->end ? INT_MAX : *run->pos;
+}
+
+void
+loser_tree_build(struct loser_tree *tree)
+{
+	for (int i = 0; i < tree->count; ++i)
+		tree->nodes[i] = -1;
+	for (int run = 0; run < tree->count; ++run) {
+		int node = (run + tree->count) / 2;
+		int contender = run;
+		while (node > 0) {
+			if (tree->nodes[node] == -1) {
+				/*
+				 * The other subtree has no winner yet. Park here, the
+				 * match is played when it arrives.
+				 */
+				tree->nodes[node] = contender;
+				contender = -1;
+				break;
+			}
+			if (run_head(&tree->runs[tree->nodes[node]]) <
+			    run_head(&tree->runs[contender])) {
+				int tmp = tree->nodes[node];
+				tree->nodes[node] = contender;
+				contender = tmp;
+			}
+			node /= 2;
+		}
+		if (contender != -1)
+			tree->nodes[0] = contender;
+	}
+}
+
+int
+loser_tree_pop(struct loser_tree *tree)
+{
+	int winner = tree->nodes[0];
+	struct merge_run *run = &tree->runs[winner];
+	int res = *run->pos++;
+	/*
+	 * The next heads of the loser runs sit idle in the tree for a while -
+	 * pull the winner's upcoming elements towards the cache before the
+	 * cursor gets there.
+	 */
+	if (run->end - run->pos > MERGE_PREFETCH_DIST)
+		__builtin_prefetch(run->pos + MERGE_PREFETCH_DIST);
+	int node = (winner + tree->count) / 2;
+	while (node > 0) {
+		if (run_head(&tree->runs[tree->nodes[node]]) <
+		    run_head(&tree->runs[winner])) {
+			int tmp = tree->nodes[node];
+			tree->nodes[node] = winner;
+			winner = tmp;
+		}
+		node /= 2;
+	}
+	tree->nodes[0] = winner;
+	return res;
+}
+
+void *
+merger(void *arg)
+{
+	struct merge_task *task = arg;
+	struct loser_tree tree;
+	tree.runs = task->runs;
+	tree.count = task->nruns;
+	tree.nodes = malloc(task->nruns * sizeof(int));
+	loser_tree_build(&tree);
+	for (int i = 0; i < task->size; ++i)
+		task->dst[i] = loser_tree_pop(&tree);
+	free(tree.nodes);
+	return NULL;
+}
+
+/* First position in the sorted array whose element is >= value. */
+int
+lower_bound(const int *array, int size, int value)
+{
+	int begin = 0;
+	while (size > 0) {
+		int half = size / 2;
+		if (array[begin + half] < value) {
+			begin += half + 1;
+			size -= half + 1;
+		} else {
+			size = half;
+		}
+	}
+	return begin;
+}
+
+/*
+ * Cut the runs into nthreads disjoint value ranges so the threads can merge
+ * them independently. The splitters come from a sorted sample of the runs -
+ * exact output sizes don't matter, only that each range lands in one thread.
+ */
+void
+merge_partition(struct worker *workers, int nfiles, int *total_array,
+		struct merge_task *tasks, int nthreads)
+{
+	int sample_size = 0;
+	int *sample = malloc(nfiles * MERGE_SAMPLE_PER_RUN * sizeof(int));
+	struct worker *w = workers;
+	for (int i = 0; i < nfiles; ++i, ++w) {
+		int count = w->size < MERGE_SAMPLE_PER_RUN ? w->size :
+			MERGE_SAMPLE_PER_RUN;
+		for (int j = 0; j < count; ++j)
+			sample[sample_size++] = w->array[j * (w->size / count)];
+	}
+	qsort(sample, sample_size, sizeof(int), cmp);
+	int *pos = total_array;
+	int prev_bound = INT_MIN;
+	for (int t = 0; t < nthreads; ++t) {
+		struct merge_task *task = &tasks[t];
+		int bound = t + 1 == nthreads ? INT_MAX :
+			sample[(t + 1) * sample_size / nthreads];
+		task->runs = malloc(nfiles * sizeof(struct merge_run));
+		task->nruns = nfiles;
+		task->dst = pos;
+		task->size = 0;
+		w = workers;
+		for (int i = 0; i < nfiles; ++i, ++w) {
+			int begin = lower_bound(w->array, w->size, prev_bound);
+			int end = t + 1 == nthreads ? w->size :
+				lower_bound(w->array, w->size, bound);
+			task->runs[i].pos = w->array + begin;
+			task->runs[i].end = w->array + end;
+			task->size += end - begin;
+		}
+		pos += task->size;
+		prev_bound = bound;
+	}
+	free(sample);
+}
+
 void
 sorter(struct worker *worker, const char *filename)
 {
@@ -139,16 +313,35 @@ main(int argc, const char **argv)
 		wait(NULL);
 		total_size += w->size;
 	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	uint64_t presort_ns = ts.tv_sec * 1000000000 + ts.tv_nsec;
+	double sec = (presort_ns - start_ns) / 1000000000.0;
+	printf("presort time = %lfs\n", sec);
+
 	int *total_array = malloc(total_size * sizeof(int));
-	int *pos = total_array;
-	w = workers;
-	for (int i = 0; i < nfiles; ++i, ++w) {
-		memcpy(pos, w->array, w->size * sizeof(int));
-		pos += w->size;
+	int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads < 1)
+		nthreads = 1;
+	struct merge_task *tasks = malloc(nthreads * sizeof(struct merge_task));
+	merge_partition(workers, nfiles, total_array, tasks, nthreads);
+	for (int t = 0; t < nthreads; ++t)
+		pthread_create(&tasks[t].thread, NULL, merger, &tasks[t]);
+	for (int t = 0; t < nthreads; ++t) {
+		pthread_join(tasks[t].thread, NULL);
+		free(tasks[t].runs);
 	}
+	for (int i = 1; i < total_size; ++i)
+		assert(total_array[i - 1] <= total_array[i]);
 	clock_gettime(CLOCK_MONOTONIC, &ts);
 	uint64_t end_ns = ts.tv_sec * 1000000000 + ts.tv_nsec;
-	double sec = (end_ns - start_ns) / 1000000000.0;
-	printf("presort time = %lfs\n", sec);
+	sec = (end_ns - presort_ns) / 1000000000.0;
+	printf("merge time = %lfs on %d threads\n", sec, nthreads);
+	printf("merged %d numbers\n", total_size);
+	free(tasks);
+	free(total_array);
+	w = workers;
+	for (int i = 0; i < nfiles; ++i, ++w)
+		free(w->array);
+	free(workers);
 	return 0;
 }
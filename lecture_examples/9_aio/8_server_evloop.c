@@ -0,0 +1,121 @@
+#include "evloop.h"
+
+#include <sys/socket.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+
+/*
+ * The same +1 echo server as 4_server_select.c .. 7_server_epoll.c, but on
+ * the evloop library - the backend is whatever is best on this platform.
+ * The sockets are watched edge-triggered, so each callback has to drain its
+ * fd until EWOULDBLOCK instead of taking one message per loop turn.
+ */
+
+static struct evloop *loop;
+
+static void
+make_nonblock(int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void
+on_peer(int fd, int mask, void *udata)
+{
+	(void) mask;
+	(void) udata;
+	while (1) {
+		int buffer = 0;
+		ssize_t size = recv(fd, &buffer, sizeof(buffer), 0);
+		if (size == 0) {
+			printf("Client disconnected\n");
+			evloop_del(loop, fd);
+			close(fd);
+			return;
+		}
+		if (size == -1) {
+			if (errno == EWOULDBLOCK || errno == EAGAIN)
+				return;
+			printf("error = %s\n", strerror(errno));
+			evloop_del(loop, fd);
+			close(fd);
+			return;
+		}
+		printf("Received %d\n", buffer);
+		buffer++;
+		size = send(fd, &buffer, sizeof(buffer), 0);
+		if (size > 0)
+			printf("Sent %d\n", buffer);
+	}
+}
+
+static void
+on_accept(int fd, int mask, void *udata)
+{
+	(void) mask;
+	(void) udata;
+	while (1) {
+		int peer_sock = accept(fd, NULL, NULL);
+		if (peer_sock == -1) {
+			if (errno != EWOULDBLOCK && errno != EAGAIN)
+				printf("error = %s\n", strerror(errno));
+			return;
+		}
+		printf("New client\n");
+		make_nonblock(peer_sock);
+		evloop_add(loop, peer_sock, EVLOOP_READ | EVLOOP_EDGE,
+			   on_peer, NULL);
+	}
+}
+
+static void
+on_heartbeat(void *udata)
+{
+	(void) udata;
+	printf("Timeout\n");
+	evloop_timer(loop, 2000, on_heartbeat, NULL);
+}
+
+int
+main(int argc, const char **argv)
+{
+	int server = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (server == -1) {
+		printf("error = %s\n", strerror(errno));
+		return -1;
+	}
+	struct sockaddr_in addr;
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(12345);
+	inet_aton("127.0.0.1", &addr.sin_addr);
+
+	if (bind(server, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+		printf("bind error = %s\n", strerror(errno));
+		return -1;
+	}
+	if (listen(server, 128) == -1) {
+		printf("listen error = %s\n", strerror(errno));
+		return -1;
+	}
+	make_nonblock(server);
+	loop = evloop_new();
+	if (loop == NULL) {
+		printf("error = %s\n", strerror(errno));
+		close(server);
+		return -1;
+	}
+	evloop_add(loop, server, EVLOOP_READ | EVLOOP_EDGE, on_accept, NULL);
+	evloop_timer(loop, 2000, on_heartbeat, NULL);
+	evloop_run(loop);
+	evloop_delete(loop);
+	close(server);
+	return 0;
+}
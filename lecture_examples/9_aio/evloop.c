@@ -0,0 +1,353 @@
+#include "evloop.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#define EVLOOP_BACKEND_EPOLL 1
+#include <sys/epoll.h>
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || \
+	defined(__OpenBSD__)
+#define EVLOOP_BACKEND_KQUEUE 1
+#include <sys/event.h>
+#else
+#define EVLOOP_BACKEND_POLL 1
+#include <poll.h>
+#endif
+
+#define EVLOOP_BATCH_SIZE 64
+
+struct evloop_fd {
+	int mask;
+	evloop_fd_f cb;
+	void *udata;
+};
+
+struct evloop_timer {
+	uint64_t deadline_ms;
+	evloop_timer_f cb;
+	void *udata;
+	struct evloop_timer *next;
+};
+
+struct evloop {
+	/* Indexed by fd, like the kernel's own fd table. cb == NULL = free. */
+	struct evloop_fd *fds;
+	int fd_capacity;
+	/* One-shot timers, sorted by deadline. */
+	struct evloop_timer *timers;
+	int is_stopped;
+#if EVLOOP_BACKEND_EPOLL
+	int ep;
+#elif EVLOOP_BACKEND_KQUEUE
+	int kq;
+#endif
+};
+
+static uint64_t
+now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+struct evloop *
+evloop_new(void)
+{
+	struct evloop *loop = calloc(1, sizeof(*loop));
+	if (loop == NULL)
+		return NULL;
+#if EVLOOP_BACKEND_EPOLL
+	loop->ep = epoll_create(1);
+	if (loop->ep == -1) {
+		free(loop);
+		return NULL;
+	}
+#elif EVLOOP_BACKEND_KQUEUE
+	loop->kq = kqueue();
+	if (loop->kq == -1) {
+		free(loop);
+		return NULL;
+	}
+#endif
+	return loop;
+}
+
+void
+evloop_delete(struct evloop *loop)
+{
+#if EVLOOP_BACKEND_EPOLL
+	close(loop->ep);
+#elif EVLOOP_BACKEND_KQUEUE
+	close(loop->kq);
+#endif
+	while (loop->timers != NULL) {
+		struct evloop_timer *next = loop->timers->next;
+		free(loop->timers);
+		loop->timers = next;
+	}
+	free(loop->fds);
+	free(loop);
+}
+
+#if EVLOOP_BACKEND_EPOLL
+
+static int
+backend_apply(struct evloop *loop, int fd, int old_mask, int new_mask)
+{
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.data.fd = fd;
+	if (new_mask & EVLOOP_READ)
+		ev.events |= EPOLLIN;
+	if (new_mask & EVLOOP_WRITE)
+		ev.events |= EPOLLOUT;
+	if (new_mask & EVLOOP_EDGE)
+		ev.events |= EPOLLET;
+	int op;
+	if (old_mask == 0)
+		op = EPOLL_CTL_ADD;
+	else if (new_mask == 0)
+		op = EPOLL_CTL_DEL;
+	else
+		op = EPOLL_CTL_MOD;
+	return epoll_ctl(loop->ep, op, fd, &ev);
+}
+
+#elif EVLOOP_BACKEND_KQUEUE
+
+static int
+backend_apply(struct evloop *loop, int fd, int old_mask, int new_mask)
+{
+	/* Read and write are separate kernel filters - diff them one by one. */
+	struct kevent kevs[2];
+	int count = 0;
+	uint16_t add = EV_ADD | ((new_mask & EVLOOP_EDGE) != 0 ? EV_CLEAR : 0);
+	if ((new_mask & EVLOOP_READ) != 0)
+		EV_SET(&kevs[count++], fd, EVFILT_READ, add, 0, 0, NULL);
+	else if ((old_mask & EVLOOP_READ) != 0)
+		EV_SET(&kevs[count++], fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+	if ((new_mask & EVLOOP_WRITE) != 0)
+		EV_SET(&kevs[count++], fd, EVFILT_WRITE, add, 0, 0, NULL);
+	else if ((old_mask & EVLOOP_WRITE) != 0)
+		EV_SET(&kevs[count++], fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+	if (count == 0)
+		return 0;
+	return kevent(loop->kq, kevs, count, NULL, 0, NULL);
+}
+
+#else
+
+static int
+backend_apply(struct evloop *loop, int fd, int old_mask, int new_mask)
+{
+	/* poll() takes the full fd set on every wait - nothing to register. */
+	(void) loop;
+	(void) fd;
+	(void) old_mask;
+	(void) new_mask;
+	return 0;
+}
+
+#endif
+
+int
+evloop_add(struct evloop *loop, int fd, int mask, evloop_fd_f cb, void *udata)
+{
+	if (fd < 0 || cb == NULL || (mask & (EVLOOP_READ | EVLOOP_WRITE)) == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (fd >= loop->fd_capacity) {
+		int new_capacity = loop->fd_capacity == 0 ? 64 :
+			loop->fd_capacity;
+		while (fd >= new_capacity)
+			new_capacity *= 2;
+		struct evloop_fd *fds = realloc(loop->fds,
+			new_capacity * sizeof(*fds));
+		if (fds == NULL)
+			return -1;
+		memset(&fds[loop->fd_capacity], 0, (new_capacity -
+			loop->fd_capacity) * sizeof(*fds));
+		loop->fds = fds;
+		loop->fd_capacity = new_capacity;
+	}
+	struct evloop_fd *efd = &loop->fds[fd];
+	if (efd->cb != NULL) {
+		errno = EEXIST;
+		return -1;
+	}
+	if (backend_apply(loop, fd, 0, mask) != 0)
+		return -1;
+	efd->mask = mask;
+	efd->cb = cb;
+	efd->udata = udata;
+	return 0;
+}
+
+int
+evloop_mod(struct evloop *loop, int fd, int mask)
+{
+	if (fd < 0 || fd >= loop->fd_capacity || loop->fds[fd].cb == NULL ||
+	    (mask & (EVLOOP_READ | EVLOOP_WRITE)) == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	struct evloop_fd *efd = &loop->fds[fd];
+	if (backend_apply(loop, fd, efd->mask, mask) != 0)
+		return -1;
+	efd->mask = mask;
+	return 0;
+}
+
+int
+evloop_del(struct evloop *loop, int fd)
+{
+	if (fd < 0 || fd >= loop->fd_capacity || loop->fds[fd].cb == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	struct evloop_fd *efd = &loop->fds[fd];
+	if (backend_apply(loop, fd, efd->mask, 0) != 0)
+		return -1;
+	efd->mask = 0;
+	efd->cb = NULL;
+	efd->udata = NULL;
+	return 0;
+}
+
+int
+evloop_timer(struct evloop *loop, uint64_t delay_ms, evloop_timer_f cb,
+	     void *udata)
+{
+	struct evloop_timer *timer = malloc(sizeof(*timer));
+	if (timer == NULL)
+		return -1;
+	timer->deadline_ms = now_ms() + delay_ms;
+	timer->cb = cb;
+	timer->udata = udata;
+	struct evloop_timer **pos = &loop->timers;
+	while (*pos != NULL && (*pos)->deadline_ms <= timer->deadline_ms)
+		pos = &(*pos)->next;
+	timer->next = *pos;
+	*pos = timer;
+	return 0;
+}
+
+/* How long the next wait may sleep before a timer becomes due, -1 = forever. */
+static int
+next_timeout(struct evloop *loop)
+{
+	if (loop->timers == NULL)
+		return -1;
+	uint64_t now = now_ms();
+	if (loop->timers->deadline_ms <= now)
+		return 0;
+	return (int) (loop->timers->deadline_ms - now);
+}
+
+static void
+run_timers(struct evloop *loop)
+{
+	uint64_t now = now_ms();
+	while (loop->timers != NULL && loop->timers->deadline_ms <= now) {
+		struct evloop_timer *timer = loop->timers;
+		loop->timers = timer->next;
+		timer->cb(timer->udata);
+		free(timer);
+	}
+}
+
+static void
+dispatch_fd(struct evloop *loop, int fd, int mask)
+{
+	/* A callback earlier in the batch could have deleted this fd. */
+	if (fd >= loop->fd_capacity || loop->fds[fd].cb == NULL)
+		return;
+	mask &= loop->fds[fd].mask;
+	if (mask != 0)
+		loop->fds[fd].cb(fd, mask, loop->fds[fd].udata);
+}
+
+void
+evloop_run(struct evloop *loop)
+{
+	loop->is_stopped = 0;
+	while (!loop->is_stopped) {
+		int timeout = next_timeout(loop);
+#if EVLOOP_BACKEND_EPOLL
+		struct epoll_event evs[EVLOOP_BATCH_SIZE];
+		int count = epoll_wait(loop->ep, evs, EVLOOP_BATCH_SIZE,
+				       timeout);
+		if (count == -1 && errno != EINTR)
+			break;
+		for (int i = 0; i < count && !loop->is_stopped; ++i) {
+			int mask = 0;
+			if ((evs[i].events & (EPOLLIN | EPOLLHUP |
+					      EPOLLERR)) != 0)
+				mask |= EVLOOP_READ;
+			if ((evs[i].events & EPOLLOUT) != 0)
+				mask |= EVLOOP_WRITE;
+			dispatch_fd(loop, evs[i].data.fd, mask);
+		}
+#elif EVLOOP_BACKEND_KQUEUE
+		struct kevent evs[EVLOOP_BATCH_SIZE];
+		struct timespec ts, *tsp = NULL;
+		if (timeout >= 0) {
+			ts.tv_sec = timeout / 1000;
+			ts.tv_nsec = (timeout % 1000) * 1000000;
+			tsp = &ts;
+		}
+		int count = kevent(loop->kq, NULL, 0, evs, EVLOOP_BATCH_SIZE,
+				   tsp);
+		if (count == -1 && errno != EINTR)
+			break;
+		for (int i = 0; i < count && !loop->is_stopped; ++i) {
+			int mask = evs[i].filter == EVFILT_WRITE ?
+				EVLOOP_WRITE : EVLOOP_READ;
+			dispatch_fd(loop, (int) evs[i].ident, mask);
+		}
+#else
+		struct pollfd *pfds = malloc(loop->fd_capacity * sizeof(*pfds));
+		int count = 0;
+		for (int fd = 0; fd < loop->fd_capacity; ++fd) {
+			if (loop->fds[fd].cb == NULL)
+				continue;
+			pfds[count].fd = fd;
+			pfds[count].events = 0;
+			if ((loop->fds[fd].mask & EVLOOP_READ) != 0)
+				pfds[count].events |= POLLIN;
+			if ((loop->fds[fd].mask & EVLOOP_WRITE) != 0)
+				pfds[count].events |= POLLOUT;
+			++count;
+		}
+		int rc = poll(pfds, count, timeout);
+		if (rc == -1 && errno != EINTR) {
+			free(pfds);
+			break;
+		}
+		for (int i = 0; i < count && !loop->is_stopped; ++i) {
+			int mask = 0;
+			if ((pfds[i].revents & (POLLIN | POLLHUP |
+						POLLERR)) != 0)
+				mask |= EVLOOP_READ;
+			if ((pfds[i].revents & POLLOUT) != 0)
+				mask |= EVLOOP_WRITE;
+			if (mask != 0)
+				dispatch_fd(loop, pfds[i].fd, mask);
+		}
+		free(pfds);
+#endif
+		run_timers(loop);
+	}
+}
+
+void
+evloop_stop(struct evloop *loop)
+{
+	loop->is_stopped = 1;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * A tiny event loop over the platform's best readiness API. The backend is
+ * picked at compile time - epoll on Linux, kqueue on the BSDs and macOS,
+ * poll() everywhere else. The previous server examples (4_server_select.c
+ * and friends) each hand-roll this loop; this is the same loop once, behind
+ * one interface.
+ */
+
+enum evloop_mask {
+	EVLOOP_READ = 1,
+	EVLOOP_WRITE = 2,
+	/*
+	 * Edge-triggered delivery - the callback fires once per readiness
+	 * change, not on every loop turn while data sits in the buffer. The
+	 * fd must be non-blocking and the callback must drain it until
+	 * EWOULDBLOCK. Only epoll and kqueue support it; the poll backend
+	 * ignores the flag and stays level-triggered.
+	 */
+	EVLOOP_EDGE = 4,
+};
+
+struct evloop;
+
+typedef void (*evloop_fd_f)(int fd, int mask, void *udata);
+typedef void (*evloop_timer_f)(void *udata);
+
+struct evloop *
+evloop_new(void);
+
+void
+evloop_delete(struct evloop *loop);
+
+/* Watch the fd for the events in mask. Returns -1 and sets errno on error. */
+int
+evloop_add(struct evloop *loop, int fd, int mask, evloop_fd_f cb, void *udata);
+
+/* Change the watched event mask of an already added fd. */
+int
+evloop_mod(struct evloop *loop, int fd, int mask);
+
+/* Stop watching the fd. The fd itself is not closed. */
+int
+evloop_del(struct evloop *loop, int fd);
+
+/* Schedule a one-shot callback after delay_ms milliseconds. */
+int
+evloop_timer(struct evloop *loop, uint64_t delay_ms, evloop_timer_f cb,
+	     void *udata);
+
+/* Dispatch events until evloop_stop() is called. */
+void
+evloop_run(struct evloop *loop);
+
+void
+evloop_stop(struct evloop *loop);
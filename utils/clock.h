@@ -0,0 +1,142 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/**
+ * Fast time sources for timeout bookkeeping. Timed hot paths - wait
+ * clocks, deadline checks, stats timestamps - do not need nanosecond
+ * precision, yet each of them pays for a full clock_gettime() per
+ * operation. Two cheaper options live here:
+ *
+ * - the coarse clock: CLOCK_MONOTONIC_COARSE, a plain read of a value
+ *   the kernel updates every tick (1-4 ms resolution);
+ *
+ * - a cached timestamp refreshed at most once per a configured
+ *   interval, gated by the cpu cycle counter, so reads between
+ *   refreshes cost a couple of loads.
+ */
+
+/** Precise monotonic time, ns. The usual full-cost read. */
+static inline uint64_t
+fclock_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/** Coarse monotonic timespec, tick resolution. */
+static inline void
+fclock_coarse_ts(struct timespec *ts)
+{
+#if defined(CLOCK_MONOTONIC_COARSE)
+	clock_gettime(CLOCK_MONOTONIC_COARSE, ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC, ts);
+#endif
+}
+
+/** Coarse monotonic time, ns with tick resolution. */
+static inline uint64_t
+fclock_coarse_ns(void)
+{
+	struct timespec ts;
+	fclock_coarse_ts(&ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/** Raw cpu cycle counter, only compared against itself. */
+static inline uint64_t
+fclock_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+	uint64_t value;
+	__asm__ volatile("mrs %0, cntvct_el0" : "=r"(value));
+	return value;
+#else
+	/* No cheap counter - the caller refreshes every read. */
+	return 0;
+#endif
+}
+
+/**
+ * A cached timestamp. Embed one per loop or per thread - the struct
+ * is not thread-safe - and read it freely; it re-reads the coarse
+ * clock only when the cycle counter says the refresh interval has
+ * passed.
+ */
+struct fclock {
+	/** Last coarse reading, ns. */
+	uint64_t ns;
+	/** First reading, for ns-since-start math. */
+	uint64_t start_ns;
+	/** Cycle counter at the last refresh. */
+	uint64_t cycles;
+	/** Refresh when this many cycles have passed. */
+	uint64_t cycles_per_refresh;
+};
+
+/**
+ * Init the cache. @a refresh_us limits how stale a read can get;
+ * pass 0 for the default of one ms. The cycle frequency is estimated
+ * from one short calibration read pair.
+ */
+static inline void
+fclock_create(struct fclock *c, uint64_t refresh_us)
+{
+	if (refresh_us == 0)
+		refresh_us = 1000;
+	uint64_t ns1 = fclock_now_ns();
+	uint64_t cy1 = fclock_cycles();
+	/* Busy-calibrate for ~100 us - enough for a rough ratio. */
+	while (fclock_now_ns() - ns1 < 100 * 1000)
+		;
+	uint64_t ns2 = fclock_now_ns();
+	uint64_t cy2 = fclock_cycles();
+	if (cy2 > cy1 && ns2 > ns1) {
+		c->cycles_per_refresh =
+			(cy2 - cy1) * refresh_us * 1000 / (ns2 - ns1);
+	} else {
+		/* No counter - every read refreshes. */
+		c->cycles_per_refresh = 0;
+	}
+	c->ns = fclock_coarse_ns();
+	c->start_ns = c->ns;
+	c->cycles = fclock_cycles();
+}
+
+/** Force a refresh, e.g. once per event loop iteration. */
+static inline void
+fclock_refresh(struct fclock *c)
+{
+	c->ns = fclock_coarse_ns();
+	c->cycles = fclock_cycles();
+}
+
+/** Cached monotonic ns, at most one refresh interval stale. */
+static inline uint64_t
+fclock_read_ns(struct fclock *c)
+{
+	uint64_t cycles = fclock_cycles();
+	if (cycles - c->cycles >= c->cycles_per_refresh)
+		fclock_refresh(c);
+	return c->ns;
+}
+
+/** Cached ns since fclock_create(). */
+static inline uint64_t
+fclock_elapsed_ns(struct fclock *c)
+{
+	return fclock_read_ns(c) - c->start_ns;
+}
+
+#if defined(__cplusplus)
+}
+#endif
@@ -0,0 +1,232 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/**
+ * CPU topology map. Discovers sockets, physical cores, SMT siblings
+ * and last-level cache sharing from sysfs once, into a compact table,
+ * so thread pool sizing and shard pinning can make placement
+ * decisions from shared cached data instead of each parsing sysfs on
+ * its own. On systems without the sysfs topology files the table
+ * degrades to a flat one-core-per-cpu layout.
+ *
+ * Typical use together with the thread pool:
+ *
+ *     struct cputopo topo;
+ *     cputopo_discover(&topo);
+ *     int cpus[16];
+ *     int count = cputopo_pick_spread(&topo, cpus, 16);
+ *     thread_pool_new_pinned(count, cpus, count, &pool);
+ *     cputopo_destroy(&topo);
+ */
+
+struct cputopo_cpu {
+	/** Logical cpu id, as used by sched_setaffinity(). */
+	int id;
+	/** Socket id. */
+	int package;
+	/** Physical core id. Unique only within one package. */
+	int core;
+	/** Sibling index inside the core. 0 is the first hw thread. */
+	int smt;
+	/**
+	 * Last-level cache group id - the lowest cpu id sharing the
+	 * cache. Cpus with equal llc hit the same L3.
+	 */
+	int llc;
+};
+
+struct cputopo {
+	/** One entry per logical cpu, ordered by cpu id. */
+	struct cputopo_cpu *cpus;
+	int cpu_count;
+	/** Number of sockets. */
+	int package_count;
+	/** Number of physical cores across all sockets. */
+	int core_count;
+	/** Number of distinct last-level cache groups. */
+	int llc_count;
+	/** Max hw threads per core. 1 means no SMT. */
+	int smt_max;
+};
+
+/** Read a single integer from a per-cpu sysfs topology file. */
+static inline int
+cputopo_read_int(int cpu, const char *file)
+{
+	char path[128];
+	snprintf(path, sizeof(path),
+		 "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, file);
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	int value = -1;
+	if (fscanf(f, "%d", &value) != 1)
+		value = -1;
+	fclose(f);
+	return value;
+}
+
+/**
+ * The id of the last-level cache group of a cpu - the first cpu in
+ * the highest cache index' shared_cpu_list. The list is sorted, so
+ * the first entry alone identifies the group.
+ */
+static inline int
+cputopo_read_llc(int cpu)
+{
+	for (int index = 3; index >= 0; --index) {
+		char path[128];
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/"
+			 "cpu%d/cache/index%d/shared_cpu_list", cpu, index);
+		FILE *f = fopen(path, "r");
+		if (f == NULL)
+			continue;
+		int value = -1;
+		if (fscanf(f, "%d", &value) != 1)
+			value = -1;
+		fclose(f);
+		if (value >= 0)
+			return value;
+	}
+	return -1;
+}
+
+/**
+ * Discover the topology into @a t. Returns 0 on success, -1 on an
+ * allocation failure. The table is a plain snapshot - hotplug after
+ * the call is not reflected.
+ */
+static inline int
+cputopo_discover(struct cputopo *t)
+{
+	int count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (count < 1)
+		count = 1;
+	struct cputopo_cpu *cpus = (struct cputopo_cpu *)calloc(
+		count, sizeof(*cpus));
+	if (cpus == NULL)
+		return -1;
+	for (int i = 0; i < count; ++i) {
+		struct cputopo_cpu *c = &cpus[i];
+		c->id = i;
+		c->package = cputopo_read_int(i, "physical_package_id");
+		c->core = cputopo_read_int(i, "core_id");
+		c->llc = cputopo_read_llc(i);
+		/* No sysfs - fall back to a flat layout. */
+		if (c->package < 0)
+			c->package = 0;
+		if (c->core < 0)
+			c->core = i;
+		if (c->llc < 0)
+			c->llc = i;
+	}
+	t->cpus = cpus;
+	t->cpu_count = count;
+	t->package_count = 0;
+	t->core_count = 0;
+	t->llc_count = 0;
+	t->smt_max = 1;
+	/*
+	 * The derived counters and sibling indexes need a 'seen
+	 * before?' check each. The table is small - a linear rescan
+	 * is simpler than a temporary index.
+	 */
+	for (int i = 0; i < count; ++i) {
+		struct cputopo_cpu *c = &cpus[i];
+		int new_package = 1;
+		int new_llc = 1;
+		c->smt = 0;
+		for (int j = 0; j < i; ++j) {
+			const struct cputopo_cpu *o = &cpus[j];
+			if (o->package == c->package) {
+				new_package = 0;
+				if (o->core == c->core)
+					++c->smt;
+			}
+			if (o->llc == c->llc)
+				new_llc = 0;
+		}
+		t->package_count += new_package;
+		t->llc_count += new_llc;
+		if (c->smt == 0)
+			++t->core_count;
+		if (c->smt + 1 > t->smt_max)
+			t->smt_max = c->smt + 1;
+	}
+	return 0;
+}
+
+static inline void
+cputopo_destroy(struct cputopo *t)
+{
+	free(t->cpus);
+	t->cpus = NULL;
+	t->cpu_count = 0;
+}
+
+/**
+ * Fill @a cpus with up to @a count cpu ids for pinning a pool of
+ * workers: all first hw threads of distinct cores come before any SMT
+ * siblings, so threads stop competing for a core only when the cores
+ * run out. Returns how many entries were filled - never more than the
+ * cpu count.
+ */
+static inline int
+cputopo_pick_spread(const struct cputopo *t, int *cpus, int count)
+{
+	int filled = 0;
+	for (int smt = 0; smt < t->smt_max && filled < count; ++smt) {
+		for (int i = 0; i < t->cpu_count && filled < count; ++i) {
+			if (t->cpus[i].smt == smt)
+				cpus[filled++] = t->cpus[i].id;
+		}
+	}
+	return filled;
+}
+
+/**
+ * Fill @a cpus with up to @a capacity cpu ids belonging to the given
+ * socket, for keeping one shard's threads on one socket's memory.
+ * Returns how many entries were filled.
+ */
+static inline int
+cputopo_package_cpus(const struct cputopo *t, int package, int *cpus,
+		     int capacity)
+{
+	int filled = 0;
+	for (int i = 0; i < t->cpu_count && filled < capacity; ++i) {
+		if (t->cpus[i].package == package)
+			cpus[filled++] = t->cpus[i].id;
+	}
+	return filled;
+}
+
+/**
+ * Fill @a cpus with up to @a capacity cpu ids sharing the last-level
+ * cache with @a cpu, itself included. Returns how many entries were
+ * filled, or 0 if @a cpu is out of range.
+ */
+static inline int
+cputopo_llc_cpus(const struct cputopo *t, int cpu, int *cpus, int capacity)
+{
+	if (cpu < 0 || cpu >= t->cpu_count)
+		return 0;
+	int llc = t->cpus[cpu].llc;
+	int filled = 0;
+	for (int i = 0; i < t->cpu_count && filled < capacity; ++i) {
+		if (t->cpus[i].llc == llc)
+			cpus[filled++] = t->cpus[i].id;
+	}
+	return filled;
+}
+
+#if defined(__cplusplus)
+}
+#endif
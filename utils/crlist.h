@@ -0,0 +1,215 @@
+#pragma once
+
+#include "rlist.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/**
+ * Counted list - an rlist head paired with a cached element count.
+ * Gives O(1) size for queue depth checks where walking the list
+ * with rlist_foreach would be O(n). All mutations have to go
+ * through the crlist functions so the count stays honest; the
+ * embedded head can still be read with the usual rlist entry and
+ * foreach macros.
+ */
+struct crlist {
+	struct rlist list;
+	size_t size;
+};
+
+/**
+ * init counted list head
+ */
+static inline void
+crlist_create(struct crlist *head)
+{
+	rlist_create(&head->list);
+	head->size = 0;
+}
+
+/**
+ * return cached element count, O(1)
+ */
+static inline size_t
+crlist_size(const struct crlist *head)
+{
+	return head->size;
+}
+
+/**
+ * return TRUE if list is empty
+ */
+static inline int
+crlist_empty(const struct crlist *head)
+{
+	return head->size == 0;
+}
+
+/**
+ * add item to list
+ */
+static inline void
+crlist_add(struct crlist *head, struct rlist *item)
+{
+	rlist_add(&head->list, item);
+	++head->size;
+}
+
+/**
+ * add item to list tail
+ */
+static inline void
+crlist_add_tail(struct crlist *head, struct rlist *item)
+{
+	rlist_add_tail(&head->list, item);
+	++head->size;
+}
+
+/**
+ * delete element; unlike rlist_del the head is needed, to keep
+ * the count in sync
+ */
+static inline void
+crlist_del(struct crlist *head, struct rlist *item)
+{
+	rlist_del(item);
+	--head->size;
+}
+
+/**
+ * remove first element from the list and return it
+ * @pre the list is not empty
+ */
+static inline struct rlist *
+crlist_shift(struct crlist *head)
+{
+	--head->size;
+	return rlist_shift(&head->list);
+}
+
+/**
+ * remove last element from the list and return it
+ * @pre the list is not empty
+ */
+static inline struct rlist *
+crlist_shift_tail(struct crlist *head)
+{
+	--head->size;
+	return rlist_shift_tail(&head->list);
+}
+
+/**
+ * return first element
+ */
+static inline struct rlist *
+crlist_first(const struct crlist *head)
+{
+	return rlist_first(&head->list);
+}
+
+/**
+ * return last element
+ */
+static inline struct rlist *
+crlist_last(const struct crlist *head)
+{
+	return rlist_last(&head->list);
+}
+
+/**
+ * move all items of list head2 to the head of list head1; both
+ * counts are updated in O(1), this is the batch-move primitive
+ * for schedulers shuffling whole queues
+ */
+static inline void
+crlist_splice(struct crlist *head1, struct crlist *head2)
+{
+	rlist_splice(&head1->list, &head2->list);
+	head1->size += head2->size;
+	head2->size = 0;
+}
+
+/**
+ * move all items of list head2 to the tail of list head1
+ */
+static inline void
+crlist_splice_tail(struct crlist *head1, struct crlist *head2)
+{
+	rlist_splice_tail(&head1->list, &head2->list);
+	head1->size += head2->size;
+	head2->size = 0;
+}
+
+/**
+ * counted list head initializer
+ */
+#define CRLIST_HEAD_INITIALIZER(name) { RLIST_HEAD_INITIALIZER(name.list), 0 }
+
+/**
+ * allocate and init head of counted list
+ */
+#define CRLIST_HEAD(name)	\
+	struct crlist name = CRLIST_HEAD_INITIALIZER(name)
+
+/**
+ * return first entry
+ */
+#define crlist_first_entry(head, type, member)				\
+	rlist_first_entry(&(head)->list, type, member)
+
+/**
+ * return last entry
+ * @pre the list is not empty
+ */
+#define crlist_last_entry(head, type, member)				\
+	rlist_last_entry(&(head)->list, type, member)
+
+/**
+ * Remove one element from the list and return it
+ * @pre the list is not empty
+ */
+#define crlist_shift_entry(head, type, member)				\
+	rlist_entry(crlist_shift(head), type, member)
+
+/**
+ * Remove one element from the list tail and return it
+ * @pre the list is not empty
+ */
+#define crlist_shift_tail_entry(head, type, member)			\
+	rlist_entry(crlist_shift_tail(head), type, member)
+
+/**
+ * add entry to list
+ */
+#define crlist_add_entry(head, item, member)				\
+	crlist_add((head), &(item)->member)
+
+/**
+ * add entry to list tail
+ */
+#define crlist_add_tail_entry(head, item, member)			\
+	crlist_add_tail((head), &(item)->member)
+
+/**
+ * delete entry from list
+ */
+#define crlist_del_entry(head, item, member)				\
+	crlist_del((head), &((item)->member))
+
+/**
+ * foreach through all list entries
+ */
+#define crlist_foreach_entry(item, head, member)			\
+	rlist_foreach_entry(item, &(head)->list, member)
+
+/**
+ * foreach through all list entries safe against removal
+ */
+#define crlist_foreach_entry_safe(item, head, member, tmp)		\
+	rlist_foreach_entry_safe(item, &(head)->list, member, tmp)
+
+#if defined(__cplusplus)
+} /* extern "C" */
+#endif /* defined(__cplusplus) */
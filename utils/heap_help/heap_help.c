@@ -11,8 +11,16 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
 #include <unistd.h>
 
+#if __APPLE__
+#include <malloc/malloc.h>
+#else
+#include <malloc.h>
+#endif
+
 #if __APPLE__
 #define PLATFORM_IS_APPLE 1
 #define PLATFORM_IS_LINUX 0
@@ -24,6 +32,27 @@
 enum {
 	MAX_BACKTRACE_LEN = 64,
 	ALLOCATION_BATCH_SIZE = 1024,
+	// How many records a thread piles up in its private journal
+	// before they are pushed into the global table under a single
+	// lock acquisition.
+	JOURNAL_BATCH_SIZE = 128,
+	// Power of two, for cheap masking. Real programs have way fewer
+	// distinct malloc call sites.
+	SAMPLE_SITE_CAPACITY = 4096,
+	SAMPLE_REPORT_LIMIT = 10,
+	// Power-of-two size classes, up to 2^47 bytes.
+	HEAP_CLASS_COUNT = 48,
+	// Time buckets of the allocated/freed byte curves. When the run
+	// outgrows them, neighbour buckets are merged pairwise and the
+	// bucket interval doubles.
+	CURVE_CAPACITY = 240,
+	CURVE_START_INTERVAL_US = 1024,
+	// At most this many timeline lines in a report.
+	CURVE_REPORT_LIMIT = 16,
+	// Per-site slots of one named checkpoint. More than the exit report
+	// keeps - a production diff has to catch the small sites too.
+	CHECKPOINT_SITE_CAPACITY = 256,
+	CHECKPOINT_NAME_SIZE = 64,
 };
 
 enum report_mode {
@@ -49,6 +78,16 @@ enum content_mode {
 	CONTENT_MODE_TRASH,
 };
 
+// One allocating call site, aggregated. Used in the sampling mode instead
+// of per-allocation tracking. The slot is claimed with a CAS on the site
+// address, the counters are plain atomic increments - no locks anywhere on
+// the allocation path.
+struct sample_site {
+	void *site;
+	uint64_t count;
+	uint64_t bytes;
+};
+
 // Single allocation done on the heap by a user.
 struct allocation {
 	void *trace[MAX_BACKTRACE_LEN];
@@ -56,6 +95,8 @@ struct allocation {
 	int depth;
 	void *mem;
 	size_t size;
+	// Return address of the allocating call, for per-site aggregation.
+	void *site;
 	struct allocation *next;
 };
 
@@ -66,6 +107,32 @@ struct allocation_batch {
 	int used;
 };
 
+// Per-thread allocation journal. The threads record their mallocs and
+// frees here and flush them into the global table in batches, so the
+// global lock is taken once per JOURNAL_BATCH_SIZE operations instead of
+// on every single one. The journal has a lock of its own, but it is
+// uncontended in the common case - it only lets other threads scavenge
+// the journal for the stats and the exit report.
+struct thread_journal {
+	bool lock;
+	// Fresh allocations, not yet in the global table.
+	struct allocation *allocs;
+	int alloc_count;
+	// Allocations ever recorded, to carry into alloc_count_total.
+	uint64_t total_count;
+	// Frees which didn't match a local allocation. Resolved against the
+	// global table at flush time.
+	void *frees[JOURNAL_BATCH_SIZE];
+	int free_count;
+	// Private node cache, refilled via mmap() like the global one.
+	struct allocation *pool;
+	struct allocation_batch *batch;
+	// All journals ever created, linked for the scavengers. Never
+	// removed - a dead thread's journal keeps its unflushed records
+	// until somebody flushes them.
+	struct thread_journal *next;
+};
+
 struct symbol {
 	const char *file;
 	const char *name;
@@ -80,6 +147,49 @@ static enum report_mode report_mode = REPORT_MODE_LEAKS;
 static enum content_mode content_mode = CONTENT_MODE_ORIGINAL;
 static enum backtrace_mode backtrace_mode = BACKTRACE_ON;
 
+// Sampling mode: record only every N-th allocation, aggregated per call
+// site instead of stored individually. Cheap enough to keep enabled in
+// production, unlike the full tracking. 0 means off.
+static uint64_t sample_rate = 0;
+// Per-thread tick so the threads don't fight over one counter.
+static __thread uint64_t sample_tick = 0;
+static struct sample_site *sample_sites = NULL;
+// Allocations which found the table full of other sites.
+static uint64_t sample_skip_count = 0;
+static uint64_t sample_alloc_count = 0;
+static uint64_t sample_free_count = 0;
+
+// One power-of-two size class of the heap profile. The class of an
+// allocation is taken from its usable size, so a pointer lands in the same
+// class at the allocation and at the free - no per-pointer state is needed
+// and the counters work even in the sampling mode.
+struct heap_class {
+	uint64_t alloc_count;
+	uint64_t free_count;
+	// What the callers asked for, cumulative.
+	uint64_t requested_bytes;
+	// What the allocator actually handed out, cumulative. The gap
+	// against the requested bytes is the internal fragmentation of
+	// the class.
+	uint64_t usable_bytes;
+	// Usable bytes allocated and not freed yet.
+	uint64_t live_usable_bytes;
+};
+
+// One time bucket of the live-vs-freed byte curves.
+struct curve_point {
+	uint64_t alloc_bytes;
+	uint64_t freed_bytes;
+};
+
+static struct heap_class heap_classes[HEAP_CLASS_COUNT];
+static struct curve_point curve[CURVE_CAPACITY];
+static bool curve_lock = false;
+static uint64_t curve_interval_us = CURVE_START_INTERVAL_US;
+static uint64_t curve_start_us = 0;
+// Print the heap profile at exit even in the leaks-only report mode.
+static bool heap_profile_at_exit = false;
+
 // Before the original heap functions are retrieved, there is a dummy static
 // allocator working. It is needed because on some platforms the original
 // functions getting via dlsym() itself can do allocations. Which means there
@@ -91,11 +201,41 @@ static uint8_t* static_buf = NULL;
 static bool allocs_lock = false;
 static int64_t alloc_count = 0;
 static uint64_t alloc_count_total = 0;
+// Total size of the live allocations.
+static uint64_t alloc_size = 0;
 static struct allocation *allocs = NULL;
 // Unused allocation objects. For re-use.
 static struct allocation *alloc_pool = NULL;
 // Freshly created allocation objects. Taken from here when the pool is empty.
 static struct allocation_batch *alloc_batch = NULL;
+// Frees which arrived at the global table before their allocation did -
+// the latter can sit in another thread's journal for a while. They are
+// matched against the incoming allocations; whatever stays unmatched at
+// exit was a genuine bad free.
+static struct allocation *orphan_frees = NULL;
+static int64_t orphan_count = 0;
+
+// Named snapshot of the live heap - the per-site aggregation at one moment
+// of a long run. Two of them bracket a suspect interval and the diff names
+// the sites which grew in between, without restarting the process.
+struct checkpoint {
+	char name[CHECKPOINT_NAME_SIZE];
+	uint64_t time_us;
+	uint64_t live_count;
+	uint64_t live_bytes;
+	int site_count;
+	struct heaph_site_stat sites[CHECKPOINT_SITE_CAPACITY];
+	struct checkpoint *next;
+};
+
+// Created via mmap() like everything else here - taking a checkpoint must
+// not disturb the heap it is snapshotting. Never removed.
+static bool checkpoint_lock = false;
+static struct checkpoint *checkpoints = NULL;
+
+static __thread struct thread_journal *journal = NULL;
+// Lock-free registry of all journals, pushed to with a CAS.
+static struct thread_journal *journals = NULL;
 
 static void *(*default_malloc)(size_t) = NULL;
 static void (*default_free)(void *) = NULL;
@@ -108,15 +248,30 @@ static int (*default_getaddrinfo)(
 	struct addrinfo **) = NULL;
 static void (*default_freeaddrinfo)(struct addrinfo *) = NULL;
 
+static void
+heaph_vfdprintf(int fd, const char *format, va_list args)
+{
+	char msg[1024];
+	vsnprintf(msg, sizeof(msg), format, args);
+	write(fd, msg, strlen(msg));
+}
+
+static void
+heaph_fdprintf(int fd, const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	heaph_vfdprintf(fd, format, args);
+	va_end(args);
+}
+
 static void
 heaph_printf(const char *format, ...)
 {
 	va_list args;
 	va_start(args, format);
-	char msg[1024];
-	vsnprintf(msg, sizeof(msg), format, args);
+	heaph_vfdprintf(STDOUT_FILENO, format, args);
 	va_end(args);
-	write(STDOUT_FILENO, msg, strlen(msg));
 }
 
 static void
@@ -168,66 +323,352 @@ alloc_is_static(const void *ptr)
 }
 
 static void
-alloc_trace_new(void *ptr, size_t size)
+sample_record(void *site, size_t size)
 {
-	if (alloc_is_static(ptr))
+	if (++sample_tick % sample_rate != 0)
 		return;
-	// Have to skip allocations inside allocations. The reason is that on
-	// some platforms it was seen that getaddrinfo() internal allocations
-	// were not intercepted, but freeaddrinfo() did call free() which was
-	// caught. As a result there was a free() for an untracked allocation.
-	if (depth > 1)
-		return;
-	heaph_assert(depth > 0);
-	heaph_assert(is_init_done);
-	if (is_exit_done)
+	uint64_t hash = (uintptr_t)site;
+	hash *= 0x9E3779B97F4A7C15ULL;
+	for (uint32_t i = 0; i < SAMPLE_SITE_CAPACITY; ++i) {
+		struct sample_site *s =
+			&sample_sites[(hash + i) & (SAMPLE_SITE_CAPACITY - 1)];
+		void *owner = __atomic_load_n(&s->site, __ATOMIC_ACQUIRE);
+		if (owner == NULL) {
+			void *expected = NULL;
+			if (__atomic_compare_exchange_n(&s->site, &expected,
+			    site, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+				owner = site;
+			else
+				owner = expected;
+		}
+		if (owner != site)
+			continue;
+		__atomic_add_fetch(&s->count, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&s->bytes, size, __ATOMIC_RELAXED);
 		return;
-	spinlock_acq(&allocs_lock);
+	}
+	__atomic_add_fetch(&sample_skip_count, 1, __ATOMIC_RELAXED);
+}
+
+static size_t
+heaph_usable_size(void *ptr)
+{
+#if PLATFORM_IS_APPLE
+	return malloc_size(ptr);
+#else
+	return malloc_usable_size(ptr);
+#endif
+}
+
+static uint64_t
+heaph_now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static uint32_t
+heap_class_of(size_t size)
+{
+	if (size <= 1)
+		return 0;
+	uint32_t cls = 64 - __builtin_clzll(size - 1);
+	if (cls >= HEAP_CLASS_COUNT)
+		cls = HEAP_CLASS_COUNT - 1;
+	return cls;
+}
+
+static void
+curve_add(uint64_t alloc_bytes, uint64_t freed_bytes)
+{
+	uint64_t elapsed = heaph_now_us() - curve_start_us;
+	uint64_t interval = __atomic_load_n(&curve_interval_us,
+					    __ATOMIC_ACQUIRE);
+	uint64_t idx = elapsed / interval;
+	if (idx >= CURVE_CAPACITY) {
+		spinlock_acq(&curve_lock);
+		while (elapsed / curve_interval_us >= CURVE_CAPACITY) {
+			// The merge reads the buckets plainly while other
+			// threads keep adding into them - a delta can land
+			// in a just-merged bucket and end up one bucket
+			// off. Tolerated, it is telemetry.
+			for (uint32_t i = 0; i < CURVE_CAPACITY / 2; ++i) {
+				curve[i].alloc_bytes =
+					curve[2 * i].alloc_bytes +
+					curve[2 * i + 1].alloc_bytes;
+				curve[i].freed_bytes =
+					curve[2 * i].freed_bytes +
+					curve[2 * i + 1].freed_bytes;
+			}
+			memset(&curve[CURVE_CAPACITY / 2], 0,
+			       sizeof(curve) / 2);
+			__atomic_store_n(&curve_interval_us,
+					 curve_interval_us * 2,
+					 __ATOMIC_RELEASE);
+		}
+		interval = curve_interval_us;
+		spinlock_rel(&curve_lock);
+		idx = elapsed / interval;
+	}
+	if (alloc_bytes != 0) {
+		__atomic_add_fetch(&curve[idx].alloc_bytes, alloc_bytes,
+				   __ATOMIC_RELAXED);
+	}
+	if (freed_bytes != 0) {
+		__atomic_add_fetch(&curve[idx].freed_bytes, freed_bytes,
+				   __ATOMIC_RELAXED);
+	}
+}
+
+static void
+heap_profile_on_alloc(void *ptr, size_t requested)
+{
+	size_t usable = heaph_usable_size(ptr);
+	struct heap_class *c = &heap_classes[heap_class_of(usable)];
+	__atomic_add_fetch(&c->alloc_count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&c->requested_bytes, requested, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&c->usable_bytes, usable, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&c->live_usable_bytes, usable, __ATOMIC_RELAXED);
+	curve_add(usable, 0);
+}
+
+static void
+heap_profile_on_free(void *ptr)
+{
+	size_t usable = heaph_usable_size(ptr);
+	struct heap_class *c = &heap_classes[heap_class_of(usable)];
+	__atomic_add_fetch(&c->free_count, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&c->live_usable_bytes, usable, __ATOMIC_RELAXED);
+	curve_add(0, usable);
+}
+
+// Take a node from the global cache. The allocs_lock has to be held.
+static struct allocation *
+alloc_node_new(void)
+{
 	struct allocation *a = alloc_pool;
 	if (a != NULL) {
 		alloc_pool = a->next;
+		return a;
+	}
+	if (alloc_batch == NULL ||
+	    alloc_batch->used == ALLOCATION_BATCH_SIZE) {
+		alloc_batch = mmap(NULL,
+			sizeof(*alloc_batch), PROT_READ | PROT_WRITE,
+			MAP_ANON | MAP_PRIVATE, -1, 0);
+		heaph_assert(alloc_batch != MAP_FAILED);
+		alloc_batch->used = 0;
 	} else {
-		if (alloc_batch == NULL ||
-		    alloc_batch->used == ALLOCATION_BATCH_SIZE) {
-			alloc_batch = mmap(NULL,
-				sizeof(*alloc_batch), PROT_READ | PROT_WRITE,
-				MAP_ANON | MAP_PRIVATE, -1, 0);
-			heaph_assert(alloc_batch != MAP_FAILED);
-			alloc_batch->used = 0;
-		} else {
-			heaph_assert(alloc_batch->used < ALLOCATION_BATCH_SIZE);
-		}
-		a = &alloc_batch->allocs[alloc_batch->used++];
+		heaph_assert(alloc_batch->used < ALLOCATION_BATCH_SIZE);
 	}
-	spinlock_rel(&allocs_lock);
+	return &alloc_batch->allocs[alloc_batch->used++];
+}
 
+static void
+alloc_node_fill(struct allocation *a, void *ptr, size_t size, void *site)
+{
 	a->mem = ptr;
 	a->size = size;
 	a->depth = depth;
+	a->site = site;
 	if (depth == 1 && backtrace_mode == BACKTRACE_ON)
 		a->trace_size = backtrace(a->trace, MAX_BACKTRACE_LEN);
 	else
 		a->trace_size = 0;
 	heaph_assert(a->trace_size >= 0);
+}
 
+// Look the pointer up in the parked frees and consume the match if any.
+// The allocs_lock has to be held.
+static bool
+orphan_match(void *ptr)
+{
+	struct allocation *o = orphan_frees;
+	struct allocation *prev = NULL;
+	while (o != NULL) {
+		if (o->mem == ptr) {
+			if (prev == NULL)
+				orphan_frees = o->next;
+			else
+				prev->next = o->next;
+			o->next = alloc_pool;
+			alloc_pool = o;
+			--orphan_count;
+			return true;
+		}
+		prev = o;
+		o = o->next;
+	}
+	return false;
+}
+
+static struct thread_journal *
+journal_touch(void)
+{
+	struct thread_journal *j = journal;
+	if (j != NULL)
+		return j;
+	j = mmap(NULL, sizeof(*j), PROT_READ | PROT_WRITE,
+		 MAP_ANON | MAP_PRIVATE, -1, 0);
+	heaph_assert(j != MAP_FAILED);
+	struct thread_journal *head =
+		__atomic_load_n(&journals, __ATOMIC_ACQUIRE);
+	do {
+		j->next = head;
+	} while (!__atomic_compare_exchange_n(&journals, &head, j, false,
+		 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+	journal = j;
+	return j;
+}
+
+// Take a node from the journal's private cache. The journal lock has to
+// be held.
+static struct allocation *
+journal_node_new(struct thread_journal *j)
+{
+	struct allocation *a = j->pool;
+	if (a != NULL) {
+		j->pool = a->next;
+		return a;
+	}
+	if (j->batch == NULL || j->batch->used == ALLOCATION_BATCH_SIZE) {
+		j->batch = mmap(NULL, sizeof(*j->batch),
+			PROT_READ | PROT_WRITE,
+			MAP_ANON | MAP_PRIVATE, -1, 0);
+		heaph_assert(j->batch != MAP_FAILED);
+		j->batch->used = 0;
+	}
+	return &j->batch->allocs[j->batch->used++];
+}
+
+// Push the journal's records into the global table. The journal lock has
+// to be held; the locks nest in journal -> global order, everywhere.
+static void
+journal_flush(struct thread_journal *j)
+{
 	spinlock_acq(&allocs_lock);
-	a->next = allocs;
-	allocs = a;
-	++alloc_count;
-	++alloc_count_total;
+	// The pending frees go first - they can't refer to this journal's
+	// own allocations, those would have matched locally.
+	for (int i = 0; i < j->free_count; ++i) {
+		void *ptr = j->frees[i];
+		struct allocation *a = allocs;
+		struct allocation *prev = NULL;
+		while (a != NULL && a->mem != ptr) {
+			prev = a;
+			a = a->next;
+		}
+		if (a != NULL) {
+			if (prev == NULL)
+				allocs = a->next;
+			else
+				prev->next = a->next;
+			--alloc_count;
+			alloc_size -= a->size;
+			a->next = alloc_pool;
+			alloc_pool = a;
+			continue;
+		}
+		// The allocation might still sit in another thread's
+		// journal. Park the free until that journal arrives.
+		a = alloc_node_new();
+		a->mem = ptr;
+		a->next = orphan_frees;
+		orphan_frees = a;
+		++orphan_count;
+	}
+	j->free_count = 0;
+	struct allocation *a = j->allocs;
+	while (a != NULL) {
+		struct allocation *next = a->next;
+		if (orphan_count != 0 && orphan_match(a->mem)) {
+			a->next = alloc_pool;
+			alloc_pool = a;
+		} else {
+			a->next = allocs;
+			allocs = a;
+			++alloc_count;
+			alloc_size += a->size;
+		}
+		a = next;
+	}
+	j->allocs = NULL;
+	j->alloc_count = 0;
+	alloc_count_total += j->total_count;
+	j->total_count = 0;
 	spinlock_rel(&allocs_lock);
 }
 
-static size_t
-alloc_untrace(void *ptr)
+// Push every thread's journal into the global table. Used by the readers
+// - the stats and the exit report - to see the complete picture.
+static void
+journal_flush_all(void)
+{
+	struct thread_journal *j =
+		__atomic_load_n(&journals, __ATOMIC_ACQUIRE);
+	for (; j != NULL; j = j->next) {
+		spinlock_acq(&j->lock);
+		journal_flush(j);
+		spinlock_rel(&j->lock);
+	}
+}
+
+static void
+alloc_trace_new(void *ptr, size_t size, void *site)
 {
 	if (alloc_is_static(ptr))
-		return 0;
+		return;
+	// Have to skip allocations inside allocations. The reason is that on
+	// some platforms it was seen that getaddrinfo() internal allocations
+	// were not intercepted, but freeaddrinfo() did call free() which was
+	// caught. As a result there was a free() for an untracked allocation.
 	if (depth > 1)
-		return 0;
+		return;
+	heaph_assert(depth > 0);
 	heaph_assert(is_init_done);
 	if (is_exit_done)
-		return 0;
+		return;
+	heap_profile_on_alloc(ptr, size);
+	if (sample_rate != 0) {
+		__atomic_add_fetch(&sample_alloc_count, 1, __ATOMIC_RELAXED);
+		sample_record(site, size);
+		return;
+	}
+	if (content_mode == CONTENT_MODE_TRASH) {
+		// The trash mode resolves the frees synchronously to know
+		// the sizes, hence no journaling - everything goes straight
+		// into the global table.
+		spinlock_acq(&allocs_lock);
+		struct allocation *a = alloc_node_new();
+		spinlock_rel(&allocs_lock);
+
+		alloc_node_fill(a, ptr, size, site);
+
+		spinlock_acq(&allocs_lock);
+		a->next = allocs;
+		allocs = a;
+		++alloc_count;
+		++alloc_count_total;
+		alloc_size += size;
+		spinlock_rel(&allocs_lock);
+		return;
+	}
+	struct thread_journal *j = journal_touch();
+	spinlock_acq(&j->lock);
+	struct allocation *a = journal_node_new(j);
+	alloc_node_fill(a, ptr, size, site);
+	a->next = j->allocs;
+	j->allocs = a;
+	++j->alloc_count;
+	++j->total_count;
+	if (j->alloc_count >= JOURNAL_BATCH_SIZE)
+		journal_flush(j);
+	spinlock_rel(&j->lock);
+}
+
+static size_t
+alloc_untrace_global(void *ptr)
+{
 	spinlock_acq(&allocs_lock);
 	struct allocation *a = allocs;
 	struct allocation *prev = NULL;
@@ -240,6 +681,7 @@ alloc_untrace(void *ptr)
 			a->next = alloc_pool;
 			alloc_pool = a;
 			int64_t new_count = --alloc_count;
+			alloc_size -= a->size;
 			spinlock_rel(&allocs_lock);
 
 			heaph_assert(new_count >= 0 && "freeing bad memory");
@@ -253,6 +695,55 @@ alloc_untrace(void *ptr)
 	return 0;
 }
 
+static size_t
+alloc_untrace(void *ptr)
+{
+	if (alloc_is_static(ptr))
+		return 0;
+	if (depth > 1)
+		return 0;
+	heaph_assert(is_init_done);
+	if (is_exit_done)
+		return 0;
+	heap_profile_on_free(ptr);
+	if (sample_rate != 0) {
+		// The individual allocations are not tracked - can't tell the
+		// size, and can't catch a bad free either.
+		__atomic_add_fetch(&sample_free_count, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	if (content_mode == CONTENT_MODE_TRASH)
+		return alloc_untrace_global(ptr);
+	struct thread_journal *j = journal_touch();
+	spinlock_acq(&j->lock);
+	struct allocation *a = j->allocs;
+	struct allocation *prev = NULL;
+	while (a != NULL) {
+		if (a->mem == ptr) {
+			if (prev == NULL)
+				j->allocs = a->next;
+			else
+				prev->next = a->next;
+			size_t size = a->size;
+			a->next = j->pool;
+			j->pool = a;
+			--j->alloc_count;
+			spinlock_rel(&j->lock);
+			return size;
+		}
+		prev = a;
+		a = a->next;
+	}
+	// Not this thread's recent allocation. Park the free, it is
+	// resolved against the global table at the next flush. Means the
+	// bad frees are caught only at exit, but the fast path stays fast.
+	j->frees[j->free_count++] = ptr;
+	if (j->free_count == JOURNAL_BATCH_SIZE)
+		journal_flush(j);
+	spinlock_rel(&j->lock);
+	return 0;
+}
+
 static const struct allocation *
 alloc_find(void *ptr)
 {
@@ -263,6 +754,8 @@ alloc_find(void *ptr)
 	heaph_assert(is_init_done);
 	if (is_exit_done)
 		return NULL;
+	if (sample_rate != 0)
+		return NULL;
 	spinlock_acq(&allocs_lock);
 	struct allocation *a = allocs;
 	while (a != NULL) {
@@ -403,6 +896,66 @@ trace_resolve(void *const *addrs, int count, struct symbol *syms)
 	return failures;
 }
 
+static void
+heaph_sample_report(void)
+{
+	uint64_t alloc_n = __atomic_load_n(&sample_alloc_count,
+					   __ATOMIC_RELAXED);
+	uint64_t free_n = __atomic_load_n(&sample_free_count, __ATOMIC_RELAXED);
+	int64_t alive = (int64_t)(alloc_n - free_n);
+	if (alive == 0 && report_mode != REPORT_MODE_VERBOSE)
+		return;
+	heaph_printf("\n");
+	heaph_printf("HH: sampling mode, every %llu-th allocation is recorded\n",
+		     (long long)sample_rate);
+	heaph_printf("HH: alloc count - %llu, free count - %llu, "
+		     "alive - %lld\n", (long long)alloc_n, (long long)free_n,
+		     (long long)alive);
+	// The top sites by sampled bytes. Selection over the table, no
+	// allocations at exit time.
+	struct sample_site *reported[SAMPLE_REPORT_LIMIT];
+	int report_count = 0;
+	while (report_count < SAMPLE_REPORT_LIMIT) {
+		struct sample_site *best = NULL;
+		for (uint32_t i = 0; i < SAMPLE_SITE_CAPACITY; ++i) {
+			struct sample_site *s = &sample_sites[i];
+			if (s->site == NULL || s->count == 0)
+				continue;
+			bool is_reported = false;
+			for (int j = 0; j < report_count; ++j)
+				is_reported = is_reported || reported[j] == s;
+			if (is_reported)
+				continue;
+			if (best == NULL || s->bytes > best->bytes)
+				best = s;
+		}
+		if (best == NULL)
+			break;
+		reported[report_count++] = best;
+		const char *name = "??";
+		const char *file = "??";
+		Dl_info info;
+		if (dladdr(best->site, &info) != 0) {
+			if (info.dli_sname != NULL)
+				name = info.dli_sname;
+			if (info.dli_fname != NULL)
+				file = info.dli_fname;
+		}
+		heaph_printf("#### Site %d - %s (%s) ####\n", report_count,
+			     name, file);
+		// The estimates assume the site's allocations are uniform
+		// enough for the sampling to be representative.
+		heaph_printf("~%llu allocations, ~%llu bytes\n",
+			     (long long)(best->count * sample_rate),
+			     (long long)(best->bytes * sample_rate));
+	}
+	uint64_t skipped = __atomic_load_n(&sample_skip_count, __ATOMIC_RELAXED);
+	if (skipped != 0) {
+		heaph_printf("HH: site table was full for %llu samples\n",
+			     (long long)skipped);
+	}
+}
+
 static void
 heaph_atexit(void)
 {
@@ -412,6 +965,18 @@ heaph_atexit(void)
 		return;
 	if (report_mode == REPORT_MODE_QUIET)
 		return;
+	if (heap_profile_at_exit || report_mode == REPORT_MODE_VERBOSE)
+		heaph_dump_heap_profile(STDOUT_FILENO);
+	if (sample_rate != 0) {
+		heaph_sample_report();
+		return;
+	}
+	journal_flush_all();
+	if (orphan_count != 0) {
+		heaph_printf("\nHH: %lld frees of unknown memory\n",
+			     (long long)orphan_count);
+		heaph_assert(!"freeing bad memory");
+	}
 	spinlock_acq(&allocs_lock);
 	int64_t count = alloc_count;
 	if (count == 0) {
@@ -534,6 +1099,22 @@ heaph_init(void)
 		else if (strcmp(bt_mode, "off") == 0)
 			backtrace_mode = BACKTRACE_OFF;
 	}
+
+	const char *hh_heap = getenv("HHHEAP");
+	if (hh_heap != NULL && strcmp(hh_heap, "on") == 0)
+		heap_profile_at_exit = true;
+	curve_start_us = heaph_now_us();
+
+	const char *hh_sample = getenv("HHSAMPLE");
+	if (hh_sample != NULL) {
+		sample_rate = strtoull(hh_sample, NULL, 10);
+		if (sample_rate != 0) {
+			sample_sites = mmap(NULL, SAMPLE_SITE_CAPACITY *
+				sizeof(*sample_sites), PROT_READ | PROT_WRITE,
+				MAP_ANON | MAP_PRIVATE, -1, 0);
+			heaph_assert(sample_sites != MAP_FAILED);
+		}
+	}
 	atexit(heaph_atexit);
 }
 
@@ -559,14 +1140,15 @@ getline(char **linep, size_t *linecapp, FILE *stream)
 	++depth;
 	char *line_old = *linep;
 	heaph_assert(!alloc_is_static(line_old));
+	void *site = __builtin_return_address(0);
 	ssize_t res = default_getline(linep, linecapp, stream);
 	if (line_old == NULL && *linep != NULL) {
-		alloc_trace_new(*linep, strlen(*linep) + 1);
+		alloc_trace_new(*linep, strlen(*linep) + 1, site);
 	} else if (line_old != NULL && *linep == NULL) {
 		heaph_assert(false);
 	} else if (line_old != NULL && *linep != NULL && line_old != *linep) {
 		alloc_untrace(line_old);
-		alloc_trace_new(*linep, strlen(*linep) + 1);
+		alloc_trace_new(*linep, strlen(*linep) + 1, site);
 	} else if (line_old != *linep) {
 		heaph_assert(false);
 	}
@@ -583,7 +1165,8 @@ strdup(const char *ptr)
 	++depth;
 	char *res = default_strdup(ptr);
 	if (res != NULL)
-		alloc_trace_new(res, strlen(res) + 1);
+		alloc_trace_new(res, strlen(res) + 1,
+				__builtin_return_address(0));
 	--depth;
 	return res;
 }
@@ -595,7 +1178,7 @@ malloc(size_t size)
 	++depth;
 	void *res = default_malloc(size);
 	if (res != NULL) {
-		alloc_trace_new(res, size);
+		alloc_trace_new(res, size, __builtin_return_address(0));
 		if (content_mode == CONTENT_MODE_TRASH)
 			memset(res, '#', size);
 	}
@@ -610,7 +1193,8 @@ calloc(size_t num, size_t size)
 	++depth;
 	void *res = default_calloc(num, size);
 	if (res != NULL)
-		alloc_trace_new(res, num * size);
+		alloc_trace_new(res, num * size,
+				__builtin_return_address(0));
 	--depth;
 	return res;
 }
@@ -643,12 +1227,12 @@ realloc(void *ptr, size_t size)
 	}
 
 	if (ptr == NULL && res != NULL) {
-		alloc_trace_new(res, size);
+		alloc_trace_new(res, size, __builtin_return_address(0));
 	} else if (ptr != NULL && res == NULL) {
 		alloc_untrace(ptr);
 	} else {
 		alloc_untrace(ptr);
-		alloc_trace_new(res, size);
+		alloc_trace_new(res, size, __builtin_return_address(0));
 	}
 	--depth;
 	return res;
@@ -678,7 +1262,8 @@ getaddrinfo(const char *hostname, const char *servname,
 	++depth;
 	int rc = default_getaddrinfo(hostname, servname, hints, res);
 	if (rc == 0 && *res != NULL)
-		alloc_trace_new(*res, sizeof(**res));
+		alloc_trace_new(*res, sizeof(**res),
+				__builtin_return_address(0));
 	--depth;
 	return rc;
 }
@@ -696,9 +1281,402 @@ freeaddrinfo(struct addrinfo *ai)
 	--depth;
 }
 
+static uint64_t
+peak_rss_get(void)
+{
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+#if PLATFORM_IS_APPLE
+	// Bytes here.
+	return (uint64_t)usage.ru_maxrss;
+#else
+	// But kilobytes here.
+	return (uint64_t)usage.ru_maxrss * 1024;
+#endif
+}
+
+void
+heaph_get_stats(struct heaph_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	stats->peak_rss = peak_rss_get();
+	for (uint32_t i = 0; i < HEAP_CLASS_COUNT; ++i) {
+		struct heap_class *c = &heap_classes[i];
+		stats->live_usable_bytes += __atomic_load_n(
+			&c->live_usable_bytes, __ATOMIC_RELAXED);
+		stats->total_requested_bytes += __atomic_load_n(
+			&c->requested_bytes, __ATOMIC_RELAXED);
+		stats->total_usable_bytes += __atomic_load_n(
+			&c->usable_bytes, __ATOMIC_RELAXED);
+	}
+	if (sample_rate != 0) {
+		uint64_t alloc_n = __atomic_load_n(&sample_alloc_count,
+						   __ATOMIC_RELAXED);
+		uint64_t free_n = __atomic_load_n(&sample_free_count,
+						  __ATOMIC_RELAXED);
+		stats->live_count = alloc_n - free_n;
+		stats->total_count = alloc_n;
+		return;
+	}
+	journal_flush_all();
+	spinlock_acq(&allocs_lock);
+	stats->live_count = alloc_count;
+	stats->live_bytes = alloc_size;
+	stats->total_count = alloc_count_total;
+	spinlock_rel(&allocs_lock);
+}
+
+// Aggregate the live allocations by their call site into the caller's
+// buffer, return the filled count. Flushes the journals and takes the
+// global lock itself.
+static int
+live_sites_collect(struct heaph_site_stat *agg, int capacity)
+{
+	int agg_count = 0;
+	journal_flush_all();
+	spinlock_acq(&allocs_lock);
+	for (const struct allocation *a = allocs; a != NULL; a = a->next) {
+		if (a->depth > 1)
+			continue;
+		int j;
+		for (j = 0; j < agg_count; ++j) {
+			if (agg[j].site == a->site)
+				break;
+		}
+		if (j == agg_count) {
+			// Too many distinct sites - drop the rest.
+			if (agg_count == capacity)
+				continue;
+			agg[j].site = a->site;
+			agg[j].count = 0;
+			agg[j].bytes = 0;
+			++agg_count;
+		}
+		agg[j].count += 1;
+		agg[j].bytes += a->size;
+	}
+	spinlock_rel(&allocs_lock);
+	return agg_count;
+}
+
+int
+heaph_get_top_sites(struct heaph_site_stat *sites, int capacity)
+{
+	if (capacity <= 0)
+		return 0;
+	if (sample_rate != 0) {
+		// Repeated selection over the hash. The counters keep changing
+		// under the readers - the snapshot is approximate anyway.
+		int count = 0;
+		while (count < capacity) {
+			struct sample_site *best = NULL;
+			uint64_t best_bytes = 0;
+			for (uint32_t i = 0; i < SAMPLE_SITE_CAPACITY; ++i) {
+				struct sample_site *s = &sample_sites[i];
+				void *site = __atomic_load_n(&s->site,
+							     __ATOMIC_ACQUIRE);
+				if (site == NULL)
+					continue;
+				bool is_taken = false;
+				for (int j = 0; j < count; ++j) {
+					is_taken = is_taken ||
+						sites[j].site == site;
+				}
+				if (is_taken)
+					continue;
+				uint64_t bytes = __atomic_load_n(&s->bytes,
+					__ATOMIC_RELAXED);
+				if (best == NULL || bytes > best_bytes) {
+					best = s;
+					best_bytes = bytes;
+				}
+			}
+			if (best == NULL)
+				break;
+			sites[count].site = best->site;
+			sites[count].count = best->count * sample_rate;
+			sites[count].bytes = best_bytes * sample_rate;
+			++count;
+		}
+		return count;
+	}
+	// Aggregate the live allocations by their call site. Into a buffer on
+	// the stack - can't allocate here.
+	enum { AGG_CAPACITY = 64 };
+	struct heaph_site_stat agg[AGG_CAPACITY];
+	int agg_count = live_sites_collect(agg, AGG_CAPACITY);
+	// Selection sort by bytes, the table is small.
+	for (int i = 0; i + 1 < agg_count; ++i) {
+		int max = i;
+		for (int j = i + 1; j < agg_count; ++j) {
+			if (agg[j].bytes > agg[max].bytes)
+				max = j;
+		}
+		struct heaph_site_stat tmp = agg[i];
+		agg[i] = agg[max];
+		agg[max] = tmp;
+	}
+	if (capacity > agg_count)
+		capacity = agg_count;
+	memcpy(sites, agg, capacity * sizeof(*sites));
+	return capacity;
+}
+
+void
+heaph_dump(int fd)
+{
+	struct heaph_stats stats;
+	heaph_get_stats(&stats);
+	heaph_fdprintf(fd, "HH: live count - %llu, live bytes - %llu, "
+		       "total count - %llu, peak RSS - %llu KB\n",
+		       (long long)stats.live_count,
+		       (long long)stats.live_bytes,
+		       (long long)stats.total_count,
+		       (long long)(stats.peak_rss / 1024));
+	if (stats.live_bytes != 0 && stats.live_usable_bytes != 0) {
+		heaph_fdprintf(fd, "HH: live usable bytes - %llu, "
+			       "fragmentation overhead - %llu%%\n",
+			       (long long)stats.live_usable_bytes,
+			       (long long)((stats.live_usable_bytes -
+					    stats.live_bytes) * 100 /
+					   stats.live_usable_bytes));
+	}
+	struct heaph_site_stat sites[SAMPLE_REPORT_LIMIT];
+	int count = heaph_get_top_sites(sites, SAMPLE_REPORT_LIMIT);
+	if (sample_rate != 0 && count > 0) {
+		heaph_fdprintf(fd, "HH: the site numbers are estimates, every "
+			       "%llu-th allocation is sampled\n",
+			       (long long)sample_rate);
+	}
+	for (int i = 0; i < count; ++i) {
+		const char *name = "??";
+		const char *file = "??";
+		Dl_info info;
+		if (dladdr(sites[i].site, &info) != 0) {
+			if (info.dli_sname != NULL)
+				name = info.dli_sname;
+			if (info.dli_fname != NULL)
+				file = info.dli_fname;
+		}
+		heaph_fdprintf(fd, "HH: site %d - %s (%s) - "
+			       "%llu allocations, %llu bytes\n", i + 1, name,
+			       file, (long long)sites[i].count,
+			       (long long)sites[i].bytes);
+	}
+}
+
+// The checkpoint_lock has to be held.
+static struct checkpoint *
+checkpoint_find(const char *name)
+{
+	struct checkpoint *c = checkpoints;
+	while (c != NULL && strcmp(c->name, name) != 0)
+		c = c->next;
+	return c;
+}
+
+void
+heaph_checkpoint(const char *name)
+{
+	spinlock_acq(&checkpoint_lock);
+	struct checkpoint *c = checkpoint_find(name);
+	if (c == NULL) {
+		c = mmap(NULL, sizeof(*c), PROT_READ | PROT_WRITE,
+			 MAP_ANON | MAP_PRIVATE, -1, 0);
+		heaph_assert(c != MAP_FAILED);
+		strncpy(c->name, name, CHECKPOINT_NAME_SIZE - 1);
+		c->next = checkpoints;
+		checkpoints = c;
+	}
+	c->time_us = heaph_now_us();
+	if (sample_rate != 0) {
+		// No live table in the sampling mode - snapshot the cumulative
+		// per-site estimates instead. The diff then shows what was
+		// allocated in the interval, the frees are not attributed.
+		int count = 0;
+		for (uint32_t i = 0; i < SAMPLE_SITE_CAPACITY &&
+		     count < CHECKPOINT_SITE_CAPACITY; ++i) {
+			struct sample_site *s = &sample_sites[i];
+			void *site = __atomic_load_n(&s->site, __ATOMIC_ACQUIRE);
+			if (site == NULL)
+				continue;
+			c->sites[count].site = site;
+			c->sites[count].count = __atomic_load_n(&s->count,
+				__ATOMIC_RELAXED) * sample_rate;
+			c->sites[count].bytes = __atomic_load_n(&s->bytes,
+				__ATOMIC_RELAXED) * sample_rate;
+			++count;
+		}
+		c->site_count = count;
+		c->live_count = __atomic_load_n(&sample_alloc_count,
+			__ATOMIC_RELAXED) - __atomic_load_n(&sample_free_count,
+			__ATOMIC_RELAXED);
+		c->live_bytes = 0;
+		spinlock_rel(&checkpoint_lock);
+		return;
+	}
+	c->site_count = live_sites_collect(c->sites, CHECKPOINT_SITE_CAPACITY);
+	spinlock_acq(&allocs_lock);
+	c->live_count = alloc_count;
+	c->live_bytes = alloc_size;
+	spinlock_rel(&allocs_lock);
+	spinlock_rel(&checkpoint_lock);
+}
+
+int
+heaph_diff_dump(const char *from, const char *to, int fd)
+{
+	spinlock_acq(&checkpoint_lock);
+	struct checkpoint *a = checkpoint_find(from);
+	struct checkpoint *b = checkpoint_find(to);
+	if (a == NULL || b == NULL) {
+		spinlock_rel(&checkpoint_lock);
+		return -1;
+	}
+	heaph_fdprintf(fd, "HH: heap diff '%s' -> '%s', %.3fs apart\n",
+		       a->name, b->name,
+		       (double)(b->time_us - a->time_us) / 1000000);
+	if (sample_rate != 0) {
+		heaph_fdprintf(fd, "HH: net allocations %+lld, sampled "
+			       "estimates - the frees are not attributed\n",
+			       (long long)(b->live_count - a->live_count));
+	} else {
+		heaph_fdprintf(fd, "HH: net allocations %+lld, net bytes "
+			       "%+lld\n",
+			       (long long)(b->live_count - a->live_count),
+			       (long long)(b->live_bytes - a->live_bytes));
+	}
+	// The sites which grew, biggest byte delta first. Repeated selection
+	// over the arrays - no allocations and no sorting in place.
+	bool reported[CHECKPOINT_SITE_CAPACITY];
+	memset(reported, 0, sizeof(reported));
+	int report_count = 0;
+	while (report_count < SAMPLE_REPORT_LIMIT) {
+		int best = -1;
+		int64_t best_bytes = 0;
+		int64_t best_count = 0;
+		for (int i = 0; i < b->site_count; ++i) {
+			if (reported[i])
+				continue;
+			int64_t dcount = b->sites[i].count;
+			int64_t dbytes = b->sites[i].bytes;
+			for (int j = 0; j < a->site_count; ++j) {
+				if (a->sites[j].site != b->sites[i].site)
+					continue;
+				dcount -= a->sites[j].count;
+				dbytes -= a->sites[j].bytes;
+				break;
+			}
+			if (dbytes <= 0)
+				continue;
+			if (best == -1 || dbytes > best_bytes) {
+				best = i;
+				best_bytes = dbytes;
+				best_count = dcount;
+			}
+		}
+		if (best == -1)
+			break;
+		reported[best] = true;
+		const char *name = "??";
+		const char *file = "??";
+		Dl_info info;
+		if (dladdr(b->sites[best].site, &info) != 0) {
+			if (info.dli_sname != NULL)
+				name = info.dli_sname;
+			if (info.dli_fname != NULL)
+				file = info.dli_fname;
+		}
+		heaph_fdprintf(fd, "HH: site %d - %s (%s) - %+lld allocations, "
+			       "%+lld bytes\n", ++report_count, name, file,
+			       (long long)best_count, (long long)best_bytes);
+	}
+	if (report_count == 0)
+		heaph_fdprintf(fd, "HH: no site grew between the checkpoints\n");
+	spinlock_rel(&checkpoint_lock);
+	return 0;
+}
+
+void
+heaph_dump_heap_profile(int fd)
+{
+	heaph_fdprintf(fd, "HH: heap profile, by usable size class\n");
+	heaph_fdprintf(fd, "HH: %12s %12s %12s %12s %12s %7s\n", "class <=",
+		       "allocs", "freed", "live", "live KB", "frag %");
+	uint64_t total_requested = 0;
+	uint64_t total_usable = 0;
+	uint64_t live_usable = 0;
+	for (uint32_t i = 0; i < HEAP_CLASS_COUNT; ++i) {
+		struct heap_class *c = &heap_classes[i];
+		uint64_t allocs = __atomic_load_n(&c->alloc_count,
+						  __ATOMIC_RELAXED);
+		if (allocs == 0)
+			continue;
+		uint64_t frees = __atomic_load_n(&c->free_count,
+						 __ATOMIC_RELAXED);
+		uint64_t requested = __atomic_load_n(&c->requested_bytes,
+						     __ATOMIC_RELAXED);
+		uint64_t usable = __atomic_load_n(&c->usable_bytes,
+						  __ATOMIC_RELAXED);
+		uint64_t live = __atomic_load_n(&c->live_usable_bytes,
+						__ATOMIC_RELAXED);
+		total_requested += requested;
+		total_usable += usable;
+		live_usable += live;
+		// The class's internal fragmentation - how much of what the
+		// allocator hands out was never asked for.
+		uint64_t frag = 0;
+		if (usable != 0)
+			frag = (usable - requested) * 100 / usable;
+		heaph_fdprintf(fd, "HH: %12llu %12llu %12llu %12llu %12llu "
+			       "%7llu\n", 1ULL << i, (long long)allocs,
+			       (long long)frees, (long long)(allocs - frees),
+			       (long long)(live / 1024), (long long)frag);
+	}
+	if (total_usable != 0) {
+		heaph_fdprintf(fd, "HH: requested %llu KB, usable %llu KB - "
+			       "%llu%% overhead, %llu KB usable still live\n",
+			       (long long)(total_requested / 1024),
+			       (long long)(total_usable / 1024),
+			       (long long)((total_usable - total_requested) *
+					   100 / total_usable),
+			       (long long)(live_usable / 1024));
+	}
+	uint64_t interval = __atomic_load_n(&curve_interval_us,
+					    __ATOMIC_ACQUIRE);
+	uint64_t used = (heaph_now_us() - curve_start_us) / interval + 1;
+	if (used > CURVE_CAPACITY)
+		used = CURVE_CAPACITY;
+	uint64_t group = (used + CURVE_REPORT_LIMIT - 1) / CURVE_REPORT_LIMIT;
+	heaph_fdprintf(fd, "HH: timeline, cumulative usable bytes\n");
+	uint64_t alloc_acc = 0;
+	uint64_t freed_acc = 0;
+	for (uint64_t i = 0; i < used; i += group) {
+		uint64_t end = i + group < used ? i + group : used;
+		for (uint64_t j = i; j < end; ++j) {
+			alloc_acc += __atomic_load_n(&curve[j].alloc_bytes,
+						     __ATOMIC_RELAXED);
+			freed_acc += __atomic_load_n(&curve[j].freed_bytes,
+						     __ATOMIC_RELAXED);
+		}
+		heaph_fdprintf(fd, "HH: t=%.3fs - allocated %llu KB, "
+			       "freed %llu KB, live %llu KB\n",
+			       (double)(end * interval) / 1000000,
+			       (long long)(alloc_acc / 1024),
+			       (long long)(freed_acc / 1024),
+			       (long long)((alloc_acc - freed_acc) / 1024));
+	}
+}
+
 uint64_t
 heaph_get_alloc_count(void)
 {
+	if (sample_rate != 0) {
+		return __atomic_load_n(&sample_alloc_count, __ATOMIC_RELAXED) -
+			__atomic_load_n(&sample_free_count, __ATOMIC_RELAXED);
+	}
+	journal_flush_all();
 	spinlock_acq(&allocs_lock);
 	uint64_t res = alloc_count;
 	spinlock_rel(&allocs_lock);
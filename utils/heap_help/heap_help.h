@@ -4,3 +4,68 @@
 
 uint64_t
 heaph_get_alloc_count(void);
+
+// Aggregated stats of one allocating call site.
+struct heaph_site_stat {
+	void *site;
+	uint64_t count;
+	uint64_t bytes;
+};
+
+// Snapshot of the heap state, for periodic telemetry in long-running
+// services.
+struct heaph_stats {
+	// Allocations which are not freed yet.
+	uint64_t live_count;
+	// Their total size. Not known in the sampling mode - zero then.
+	uint64_t live_bytes;
+	// All allocations ever done.
+	uint64_t total_count;
+	// Peak RSS of the process, in bytes.
+	uint64_t peak_rss;
+	// Usable (malloc_usable_size()) bytes of the live allocations. The
+	// gap against live_bytes is the allocator's internal fragmentation.
+	// Works in every mode, including sampling.
+	uint64_t live_usable_bytes;
+	// Requested and usable bytes of all allocations ever done.
+	uint64_t total_requested_bytes;
+	uint64_t total_usable_bytes;
+};
+
+void
+heaph_get_stats(struct heaph_stats *stats);
+
+// Fill up to capacity top allocating sites ordered by bytes, return the
+// filled count. In the full tracking mode the numbers cover the currently
+// live allocations; in the sampling mode they are estimates of everything
+// ever allocated, scaled by the sampling rate.
+int
+heaph_get_top_sites(struct heaph_site_stat *sites, int capacity);
+
+// Write a human-readable snapshot of all of the above into the fd. Does no
+// allocations itself, safe to call at any moment.
+void
+heaph_dump(int fd);
+
+// Remember the live heap under the name - the per-site aggregation of what
+// is allocated and not freed yet. Taking a checkpoint with an existing name
+// overwrites it, so a pair of names can bracket a suspect interval again
+// and again. In the sampling mode the cumulative per-site estimates are
+// snapshotted instead. Does no heap allocations itself.
+void
+heaph_checkpoint(const char *name);
+
+// Write into the fd which call sites grew between the two checkpoints -
+// new allocations and net bytes per site, biggest growth first. Returns -1
+// when either checkpoint does not exist, 0 otherwise. Does no allocations,
+// safe to call at any moment.
+int
+heaph_diff_dump(const char *from, const char *to, int fd);
+
+// Write the heap profile into the fd: the per-size-class histogram with
+// each class's internal fragmentation (requested vs usable bytes), and the
+// allocated-vs-freed byte timeline of the whole run. Printed automatically
+// at exit in the verbose report mode or with HHHEAP=on. Does no
+// allocations, safe to call at any moment.
+void
+heaph_dump_heap_profile(int fd);
@@ -0,0 +1,304 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/**
+ * NUMA-aware arena of fixed-size blocks, a placement layer for the
+ * pools - block tables, task recycling, message buffers. On a
+ * multi-socket machine a pool refilled by whichever thread happened
+ * to run first serves remote memory to everyone else, and every
+ * access pays the cross-node latency. The arena instead keeps one
+ * freelist per node and refills each from memory placed on that
+ * node, so a block allocated by a thread is local to it.
+ *
+ * The placement has two mechanisms, both degrading gracefully:
+ *
+ * - First touch. A refill chunk is mmap()ed and faulted in by the
+ *   requesting thread, which lands the pages on its node under the
+ *   default kernel policy. Works everywhere, needs nothing.
+ *
+ * - Explicit selection. numa_arena_alloc_on() asks for a concrete
+ *   node; the refill then mbind()s the chunk there before touching
+ *   it. The raw syscall is used so utils/ stays free of a libnuma
+ *   dependency; where the syscall is missing the chunk just stays
+ *   first-touch.
+ *
+ * In front of the per-node lists sits a small thread-local cache, so
+ * the steady state of an alloc/free-heavy thread is a few loads with
+ * no shared state at all. The cache binds to one arena at a time -
+ * a thread juggling several arenas flushes it on every switch, so
+ * dedicate the hot threads to one arena each.
+ *
+ * A single-node machine works unchanged: everything collapses into
+ * one list and the arena behaves like a plain block pool.
+ *
+ * The arena must be destroyed only when no thread uses it anymore;
+ * blocks still sitting in other threads' caches die with the chunks.
+ */
+
+enum {
+	/** More nodes than any of our machines; the rest are folded into the last. */
+	NUMA_ARENA_NODE_MAX = 8,
+	/** Blocks kept thread-locally before spilling to the node list. */
+	NUMA_ARENA_CACHE_SIZE = 16,
+	/** Blocks carved from one refill chunk. */
+	NUMA_ARENA_CHUNK_BLOCKS = 32,
+};
+
+/** Header of every block, live or free. */
+struct numa_arena_block {
+	/** Home node; the free path returns the block to its list. */
+	int node;
+	/** Next free block; garbage while the block is allocated. */
+	struct numa_arena_block *next;
+};
+
+/** Header of a refill chunk, for unmapping at destroy. */
+struct numa_arena_chunk {
+	struct numa_arena_chunk *next;
+	size_t size;
+};
+
+struct numa_arena_node {
+	pthread_mutex_t lock;
+	struct numa_arena_block *free_list;
+	struct numa_arena_chunk *chunks;
+} __attribute__((aligned(64)));
+
+struct numa_arena {
+	/** Payload bytes of one block. */
+	size_t block_size;
+	/** Block header plus payload, both 16-byte aligned. */
+	size_t block_stride;
+	int node_count;
+	struct numa_arena_node nodes[NUMA_ARENA_NODE_MAX];
+};
+
+/** Per-thread block cache, bound to one arena and one node. */
+struct numa_arena_cache {
+	const struct numa_arena *arena;
+	int node;
+	int count;
+	struct numa_arena_block *blocks[NUMA_ARENA_CACHE_SIZE];
+};
+
+static __thread struct numa_arena_cache numa_arena_tls = {NULL, 0, 0, {NULL}};
+
+/** Node the calling thread runs on right now, clamped to the arena's table. */
+static inline int
+numa_arena_node_of_caller(const struct numa_arena *arena)
+{
+	unsigned cpu = 0;
+	unsigned node = 0;
+#if defined(SYS_getcpu)
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+		node = 0;
+#endif
+	(void)cpu;
+	if ((int)node >= arena->node_count)
+		node = arena->node_count - 1;
+	return node;
+}
+
+static inline int
+numa_arena_create(struct numa_arena *arena, size_t block_size)
+{
+	if (block_size == 0)
+		return -1;
+	memset(arena, 0, sizeof(*arena));
+	arena->block_size = block_size;
+	arena->block_stride = (sizeof(struct numa_arena_block) + 15) / 16 * 16 +
+		(block_size + 15) / 16 * 16;
+	/*
+	 * Count the nodes from sysfs, like cputopo does for the cpus. No
+	 * node directories - a kernel without NUMA - means one node.
+	 */
+	arena->node_count = 0;
+	while (arena->node_count < NUMA_ARENA_NODE_MAX) {
+		char path[64];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d",
+			 arena->node_count);
+		if (access(path, F_OK) != 0)
+			break;
+		++arena->node_count;
+	}
+	if (arena->node_count == 0)
+		arena->node_count = 1;
+	for (int i = 0; i < arena->node_count; ++i)
+		pthread_mutex_init(&arena->nodes[i].lock, NULL);
+	return 0;
+}
+
+/**
+ * Map a chunk of blocks for the node and thread them onto its
+ * freelist. Called under the node lock. The faulting memset comes
+ * from the requesting thread - that is the first touch; the optional
+ * mbind() beforehand overrides it when the requester sits elsewhere.
+ */
+static inline int
+numa_arena_refill_locked(struct numa_arena *arena, int node)
+{
+	struct numa_arena_node *n = &arena->nodes[node];
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t size = sizeof(struct numa_arena_chunk) +
+		arena->block_stride * NUMA_ARENA_CHUNK_BLOCKS;
+	size = (size + page - 1) / page * page;
+	void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		return -1;
+#if defined(SYS_mbind)
+	if (arena->node_count > 1) {
+		/* MPOL_PREFERRED = 1 - prefer the node, fall back instead
+		 * of failing when it is full. */
+		unsigned long mask = 1UL << node;
+		syscall(SYS_mbind, mem, size, 1, &mask, sizeof(mask) * 8 + 1, 0);
+	}
+#endif
+	memset(mem, 0, size);
+	struct numa_arena_chunk *chunk = (struct numa_arena_chunk *)mem;
+	chunk->size = size;
+	chunk->next = n->chunks;
+	n->chunks = chunk;
+	char *pos = (char *)mem + sizeof(*chunk);
+	/* The rounding in 'size' can leave less than the full count. */
+	size_t count = ((char *)mem + size - pos) / arena->block_stride;
+	for (size_t i = 0; i < count; ++i) {
+		struct numa_arena_block *block = (struct numa_arena_block *)pos;
+		block->node = node;
+		block->next = n->free_list;
+		n->free_list = block;
+		pos += arena->block_stride;
+	}
+	return 0;
+}
+
+static inline void *
+numa_arena_block_to_mem(struct numa_arena_block *block)
+{
+	return (char *)block + (sizeof(*block) + 15) / 16 * 16;
+}
+
+static inline struct numa_arena_block *
+numa_arena_mem_to_block(void *mem)
+{
+	return (struct numa_arena_block *)
+		((char *)mem - (sizeof(struct numa_arena_block) + 15) / 16 * 16);
+}
+
+/** Return the thread's cached blocks to their node lists. */
+static inline void
+numa_arena_cache_flush(void)
+{
+	struct numa_arena_cache *cache = &numa_arena_tls;
+	if (cache->arena == NULL || cache->count == 0) {
+		cache->arena = NULL;
+		return;
+	}
+	/* The cache is homogeneous - one lock round covers all of it. */
+	struct numa_arena_node *n = (struct numa_arena_node *)
+		&cache->arena->nodes[cache->node];
+	pthread_mutex_lock(&n->lock);
+	while (cache->count > 0) {
+		struct numa_arena_block *block = cache->blocks[--cache->count];
+		block->next = n->free_list;
+		n->free_list = block;
+	}
+	pthread_mutex_unlock(&n->lock);
+	cache->arena = NULL;
+}
+
+/** Allocate a block placed on the given node. */
+static inline void *
+numa_arena_alloc_on(struct numa_arena *arena, int node)
+{
+	if (node < 0 || node >= arena->node_count)
+		return NULL;
+	struct numa_arena_cache *cache = &numa_arena_tls;
+	if (cache->arena == arena && cache->node == node && cache->count > 0)
+		return numa_arena_block_to_mem(cache->blocks[--cache->count]);
+	struct numa_arena_node *n = &arena->nodes[node];
+	pthread_mutex_lock(&n->lock);
+	if (n->free_list == NULL && numa_arena_refill_locked(arena, node) != 0) {
+		pthread_mutex_unlock(&n->lock);
+		return NULL;
+	}
+	struct numa_arena_block *block = n->free_list;
+	n->free_list = block->next;
+	pthread_mutex_unlock(&n->lock);
+	return numa_arena_block_to_mem(block);
+}
+
+/** Allocate a block placed on the calling thread's node. */
+static inline void *
+numa_arena_alloc(struct numa_arena *arena)
+{
+	return numa_arena_alloc_on(arena, numa_arena_node_of_caller(arena));
+}
+
+static inline void
+numa_arena_free(struct numa_arena *arena, void *mem)
+{
+	if (mem == NULL)
+		return;
+	struct numa_arena_block *block = numa_arena_mem_to_block(mem);
+	struct numa_arena_cache *cache = &numa_arena_tls;
+	/*
+	 * Cache only the blocks of the caller's own node - a remote
+	 * block handed back to this thread would otherwise be re-served
+	 * locally and defeat the placement.
+	 */
+	if (cache->arena != arena || cache->node != block->node ||
+	    cache->count == NUMA_ARENA_CACHE_SIZE)
+		numa_arena_cache_flush();
+	if (cache->arena == NULL &&
+	    block->node == numa_arena_node_of_caller(arena)) {
+		cache->arena = arena;
+		cache->node = block->node;
+		cache->count = 0;
+	}
+	if (cache->arena == arena && cache->node == block->node) {
+		cache->blocks[cache->count++] = block;
+		return;
+	}
+	struct numa_arena_node *n = &arena->nodes[block->node];
+	pthread_mutex_lock(&n->lock);
+	block->next = n->free_list;
+	n->free_list = block;
+	pthread_mutex_unlock(&n->lock);
+}
+
+static inline void
+numa_arena_destroy(struct numa_arena *arena)
+{
+	/* This thread's cached blocks are about to be unmapped. */
+	if (numa_arena_tls.arena == arena) {
+		numa_arena_tls.arena = NULL;
+		numa_arena_tls.count = 0;
+	}
+	for (int i = 0; i < arena->node_count; ++i) {
+		struct numa_arena_node *n = &arena->nodes[i];
+		struct numa_arena_chunk *chunk = n->chunks;
+		while (chunk != NULL) {
+			struct numa_arena_chunk *next = chunk->next;
+			munmap(chunk, chunk->size);
+			chunk = next;
+		}
+		pthread_mutex_destroy(&n->lock);
+	}
+	memset(arena, 0, sizeof(*arena));
+}
+
+#if defined(__cplusplus)
+} /* extern "C" */
+#endif /* defined(__cplusplus) */
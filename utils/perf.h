@@ -0,0 +1,220 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/**
+ * High-resolution timing and log-bucketed latency histograms, shared by
+ * all the subsystems. Everything is static inline and fixed-size - can
+ * be used from C and C++ without linking anything or allocating.
+ */
+
+enum {
+	/** One bucket per power of two of nanoseconds. */
+	PERF_HISTOGRAM_BUCKET_COUNT = 64,
+};
+
+static inline uint64_t
+perf_time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Raw timestamp counter. On x86 it is the TSC - a couple of cycles to
+ * read, much cheaper than even the vDSO clock_gettime(). On the other
+ * platforms it falls back to the monotonic clock, which then makes the
+ * calibration a no-op.
+ */
+static inline uint64_t
+perf_tsc(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	uint32_t lo, hi;
+	__asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((uint64_t)hi << 32) | lo;
+#else
+	return perf_time_ns();
+#endif
+}
+
+/**
+ * TSC ticks per millisecond. Calibrated against the monotonic clock on
+ * the first use, over a 10ms sleep.
+ */
+static inline uint64_t
+perf_tsc_per_ms(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	static uint64_t cached = 0;
+	uint64_t res = __atomic_load_n(&cached, __ATOMIC_RELAXED);
+	if (res != 0)
+		return res;
+	uint64_t ns0 = perf_time_ns();
+	uint64_t tsc0 = perf_tsc();
+	usleep(10 * 1000);
+	uint64_t ns1 = perf_time_ns();
+	uint64_t tsc1 = perf_tsc();
+	res = (tsc1 - tsc0) * 1000000 / (ns1 - ns0);
+	__atomic_store_n(&cached, res, __ATOMIC_RELAXED);
+	return res;
+#else
+	return 1000000;
+#endif
+}
+
+/**
+ * Turn a TSC tick interval into nanoseconds.
+ */
+static inline uint64_t
+perf_tsc_to_ns(uint64_t ticks)
+{
+	return ticks * 1000000 / perf_tsc_per_ms();
+}
+
+/**
+ * Log-bucketed histogram - each bucket covers a power of two of
+ * nanoseconds, so the whole uint64 range fits into fixed memory with a
+ * bounded relative error.
+ */
+struct perf_histogram {
+	uint64_t buckets[PERF_HISTOGRAM_BUCKET_COUNT];
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+};
+
+static inline void
+perf_histogram_create(struct perf_histogram *h)
+{
+	memset(h, 0, sizeof(*h));
+	h->min = UINT64_MAX;
+}
+
+static inline int
+perf_histogram_bucket_of(uint64_t ns)
+{
+	return 63 - __builtin_clzll(ns | 1);
+}
+
+static inline void
+perf_histogram_add(struct perf_histogram *h, uint64_t ns)
+{
+	++h->buckets[perf_histogram_bucket_of(ns)];
+	++h->count;
+	h->sum += ns;
+	if (ns < h->min)
+		h->min = ns;
+	if (ns > h->max)
+		h->max = ns;
+}
+
+/**
+ * Fold src into dst. Handy when every thread keeps its own histogram
+ * and the totals are wanted in the end.
+ */
+static inline void
+perf_histogram_merge(struct perf_histogram *dst,
+		     const struct perf_histogram *src)
+{
+	for (int i = 0; i < PERF_HISTOGRAM_BUCKET_COUNT; ++i)
+		dst->buckets[i] += src->buckets[i];
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+/**
+ * Upper bound of the bucket holding the given percentile. An estimate -
+ * the real value is within 2x below it.
+ */
+static inline uint64_t
+perf_histogram_percentile(const struct perf_histogram *h, int pct)
+{
+	if (h->count == 0)
+		return 0;
+	uint64_t target = (h->count * pct + 99) / 100;
+	uint64_t seen = 0;
+	for (int i = 0; i < PERF_HISTOGRAM_BUCKET_COUNT; ++i) {
+		seen += h->buckets[i];
+		if (seen < target)
+			continue;
+		if (i >= 63)
+			break;
+		uint64_t bound = (uint64_t)2 << i;
+		return bound < h->max ? bound : h->max;
+	}
+	return h->max;
+}
+
+/**
+ * One machine-readable summary line followed by the non-empty buckets.
+ */
+static inline void
+perf_histogram_print(const struct perf_histogram *h, const char *name,
+		     FILE *out)
+{
+	fprintf(out, "histogram - %s: count=%llu avg_ns=%llu min_ns=%llu "
+		"max_ns=%llu p50_ns=%llu p99_ns=%llu\n", name,
+		(unsigned long long)h->count,
+		(unsigned long long)(h->count == 0 ? 0 : h->sum / h->count),
+		(unsigned long long)(h->count == 0 ? 0 : h->min),
+		(unsigned long long)h->max,
+		(unsigned long long)perf_histogram_percentile(h, 50),
+		(unsigned long long)perf_histogram_percentile(h, 99));
+	for (int i = 0; i < PERF_HISTOGRAM_BUCKET_COUNT; ++i) {
+		if (h->buckets[i] == 0)
+			continue;
+		uint64_t lower = i == 0 ? 0 : (uint64_t)1 << i;
+		if (i >= 63) {
+			fprintf(out, "  [%llu, inf) ns - %llu\n",
+				(unsigned long long)lower,
+				(unsigned long long)h->buckets[i]);
+			continue;
+		}
+		fprintf(out, "  [%llu, %llu) ns - %llu\n",
+			(unsigned long long)lower,
+			(unsigned long long)((uint64_t)2 << i),
+			(unsigned long long)h->buckets[i]);
+	}
+}
+
+struct perf_scoped_timer {
+	struct perf_histogram *hist;
+	uint64_t start;
+};
+
+static inline void
+perf_scoped_timer_close(struct perf_scoped_timer *t)
+{
+	perf_histogram_add(t->hist, perf_tsc_to_ns(perf_tsc() - t->start));
+}
+
+#define PERF_CONCAT_DO(a, b) a##b
+#define PERF_CONCAT(a, b) PERF_CONCAT_DO(a, b)
+
+/**
+ * Time the rest of the current scope into the histogram. The cleanup
+ * attribute makes it work the same in C and C++.
+ */
+#define perf_timer_scope(hist)						\
+	struct perf_scoped_timer PERF_CONCAT(perf_timer_, __LINE__)	\
+		__attribute__((cleanup(perf_scoped_timer_close)))	\
+		= {(hist), perf_tsc()}
+
+#if defined(__cplusplus)
+} /* extern "C" */
+#endif /* defined(__cplusplus) */
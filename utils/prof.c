@@ -0,0 +1,169 @@
+#define _GNU_SOURCE
+#include "prof.h"
+
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+enum {
+	/** Frames kept per sample, deeper stacks are truncated. */
+	PROF_MAX_DEPTH = 32,
+	/**
+	 * The handler's own frame and the kernel's signal trampoline,
+	 * always on top of a captured stack and dropped at dump.
+	 */
+	PROF_SKIP_DEPTH = 2,
+	/** Samples kept; ~2.5 minutes at the default 99 Hz. */
+	PROF_RING_SIZE = 16 * 1024,
+	PROF_DEFAULT_HZ = 99,
+};
+
+/** The current coroutine, NULL-resolved without 1/libcoro.c. */
+struct coro;
+__attribute__((weak)) struct coro *
+coro_this(void);
+
+struct prof_sample {
+	void *frames[PROF_MAX_DEPTH];
+	int depth;
+	struct coro *coro;
+};
+
+static struct prof_sample *prof_ring = NULL;
+/** Total samples taken, the ring slot is this modulo the size. */
+static size_t prof_pos = 0;
+static int prof_is_running = 0;
+static struct sigaction prof_old_action;
+
+static void
+prof_on_sigprof(int signum)
+{
+	(void)signum;
+	struct prof_sample *sample = &prof_ring[prof_pos % PROF_RING_SIZE];
+	sample->depth = backtrace(sample->frames, PROF_MAX_DEPTH);
+	sample->coro = coro_this != NULL ? coro_this() : NULL;
+	++prof_pos;
+}
+
+int
+prof_start(int hz)
+{
+	if (prof_is_running)
+		return -1;
+	if (hz <= 0)
+		hz = PROF_DEFAULT_HZ;
+	if (prof_ring == NULL) {
+		prof_ring = calloc(PROF_RING_SIZE, sizeof(*prof_ring));
+		if (prof_ring == NULL)
+			return -1;
+	}
+	prof_pos = 0;
+	/*
+	 * The first backtrace() call loads the unwinder library. Do
+	 * it here - in the handler it would malloc under the hood.
+	 */
+	void *warmup[2];
+	backtrace(warmup, 2);
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = prof_on_sigprof;
+	sigemptyset(&action.sa_mask);
+	action.sa_flags = SA_RESTART;
+	if (sigaction(SIGPROF, &action, &prof_old_action) != 0)
+		return -1;
+
+	struct itimerval timer;
+	timer.it_interval.tv_sec = 0;
+	timer.it_interval.tv_usec = 1000000 / hz;
+	timer.it_value = timer.it_interval;
+	if (setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+		sigaction(SIGPROF, &prof_old_action, NULL);
+		return -1;
+	}
+	prof_is_running = 1;
+	return 0;
+}
+
+void
+prof_stop(void)
+{
+	if (!prof_is_running)
+		return;
+	struct itimerval timer;
+	memset(&timer, 0, sizeof(timer));
+	setitimer(ITIMER_PROF, &timer, NULL);
+	sigaction(SIGPROF, &prof_old_action, NULL);
+	prof_is_running = 0;
+}
+
+size_t
+prof_sample_count(void)
+{
+	return prof_pos < PROF_RING_SIZE ? prof_pos : PROF_RING_SIZE;
+}
+
+size_t
+prof_dropped_count(void)
+{
+	return prof_pos < PROF_RING_SIZE ? 0 : prof_pos - PROF_RING_SIZE;
+}
+
+static int
+prof_sample_cmp(const void *lhs_void, const void *rhs_void)
+{
+	const struct prof_sample *lhs = lhs_void;
+	const struct prof_sample *rhs = rhs_void;
+	if (lhs->coro != rhs->coro)
+		return lhs->coro < rhs->coro ? -1 : 1;
+	if (lhs->depth != rhs->depth)
+		return lhs->depth < rhs->depth ? -1 : 1;
+	return memcmp(lhs->frames, rhs->frames,
+		      lhs->depth * sizeof(lhs->frames[0]));
+}
+
+static void
+prof_print_frame(FILE *out, void *frame)
+{
+	/*
+	 * The captured addresses are return addresses - step one byte
+	 * back to land inside the calling instruction's function.
+	 */
+	Dl_info info;
+	if (dladdr((char *)frame - 1, &info) != 0 && info.dli_sname != NULL)
+		fprintf(out, "%s", info.dli_sname);
+	else
+		fprintf(out, "0x%zx", (size_t)frame);
+}
+
+int
+prof_dump_folded(FILE *out)
+{
+	if (prof_is_running || prof_pos == 0)
+		return -1;
+	size_t count = prof_sample_count();
+	qsort(prof_ring, count, sizeof(*prof_ring), prof_sample_cmp);
+	for (size_t i = 0; i < count;) {
+		size_t j = i + 1;
+		while (j < count &&
+		       prof_sample_cmp(&prof_ring[i], &prof_ring[j]) == 0)
+			++j;
+		const struct prof_sample *sample = &prof_ring[i];
+		if (sample->coro != NULL)
+			fprintf(out, "coro_0x%zx", (size_t)sample->coro);
+		else
+			fprintf(out, "thread");
+		/* Root first, like flamegraph.pl wants it. */
+		for (int f = sample->depth - 1; f >= PROF_SKIP_DEPTH; --f) {
+			fputc(';', out);
+			prof_print_frame(out, sample->frames[f]);
+		}
+		fprintf(out, " %zu\n", j - i);
+		i = j;
+	}
+	return 0;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/**
+ * In-process sampling profiler for the places where perf can't go -
+ * locked-down pods, or just a service already misbehaving in
+ * production. A SIGPROF timer fires 'hz' times a second of consumed
+ * CPU time and the handler records the interrupted call stack into a
+ * preallocated ring; nothing is allocated and no lock is taken on
+ * the hot path, so the overhead is around a percent at the default
+ * rate and zero when stopped.
+ *
+ * When the binary is linked with 1/libcoro.c the sampler also
+ * records the coroutine being executed at each sample - coro_this()
+ * is looked up as a weak symbol, so linking the profiler alone costs
+ * nothing.
+ *
+ * The dump is the folded-stacks text format eaten by
+ * flamegraph.pl: one "frame;frame;frame count" line per distinct
+ * stack. Symbol names come from dladdr(), so link the executable
+ * with -rdynamic to see the names of non-static functions; the rest
+ * show as raw addresses.
+ */
+
+/**
+ * Start sampling at the given rate, 99 Hz when 'hz' is 0 or
+ * negative. Any samples of a previous run are discarded.
+ *
+ * @retval 0 Success.
+ * @retval -1 Already running or out of memory.
+ */
+int
+prof_start(int hz);
+
+/** Stop sampling. The collected samples stay for dumping. */
+void
+prof_stop(void);
+
+/** How many samples the ring currently holds. */
+size_t
+prof_sample_count(void);
+
+/** How many samples were overwritten because the ring went around. */
+size_t
+prof_dropped_count(void);
+
+/**
+ * Aggregate the collected samples and print them as folded stacks.
+ * Has to be called with the sampling stopped.
+ *
+ * @retval 0 Success.
+ * @retval -1 Still running or nothing collected.
+ */
+int
+prof_dump_folded(FILE *out);
+
+#if defined(__cplusplus)
+} /* extern "C" */
+#endif /* defined(__cplusplus) */
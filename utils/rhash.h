@@ -0,0 +1,330 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+#ifndef typeof
+/** 'typeof' is a GNU extension. */
+#define typeof __typeof__
+#endif
+
+#ifndef offsetof
+#define offsetof(type, member) ((size_t)&((type *)0)->member)
+#endif
+
+/**
+ * Intrusive open-addressing hash table, a companion of rlist. The
+ * table stores pointers to entries embedded into the user's objects,
+ * so an insertion never allocates - only the slot array itself is
+ * ever malloced. Collisions are resolved by linear probing, which
+ * keeps a whole probe cluster on a few adjacent cache lines; the
+ * slot array is allocated RHASH_GROUP_BYTES-aligned so a group of
+ * neighbouring slots shares a line.
+ *
+ * Growth is incremental: when the load factor is crossed, a twice
+ * bigger array is allocated and every following operation migrates a
+ * few old slots, so no single insert ever pays for a full rehash.
+ * While the migration runs the lookups simply check both arrays.
+ *
+ * The table does not compare keys - it stores the caller-computed
+ * hash in the entry and on lookup yields every entry with a matching
+ * hash, letting the caller do the final key comparison via
+ * rhash_foreach_same(). This keeps the header free of function
+ * pointers and usable for any key type.
+ */
+struct rhash_entry {
+	/** Cached full hash of the entry's key. */
+	size_t hash;
+};
+
+/** Sentinel for a deleted slot of the old array. See rhash_remove(). */
+#define RHASH_SLOT_DELETED ((struct rhash_entry *)1)
+
+/** One cache line of slots, the unit of alignment and migration. */
+enum {
+	RHASH_GROUP_BYTES = 64,
+	RHASH_INIT_CAPACITY = 16,
+	RHASH_MIGRATE_STEP = 8,
+};
+
+struct rhash {
+	/** Current slot array, a power of two of slots. */
+	struct rhash_entry **slots;
+	size_t capacity;
+	/** Number of live entries in both arrays. */
+	size_t count;
+	/** Previous array, not NULL only while a rehash is running. */
+	struct rhash_entry **old_slots;
+	size_t old_capacity;
+	/** First not yet migrated old slot. */
+	size_t migrate_pos;
+};
+
+/** init an empty table, no allocation until the first insert */
+static inline void
+rhash_create(struct rhash *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+/** free the slot arrays; the entries belong to the caller */
+static inline void
+rhash_destroy(struct rhash *h)
+{
+	free(h->slots);
+	free(h->old_slots);
+	memset(h, 0, sizeof(*h));
+}
+
+static inline size_t
+rhash_count(const struct rhash *h)
+{
+	return h->count;
+}
+
+/** FNV-1a over the 0-terminated string */
+static inline size_t
+rhash_hash_str(const char *str)
+{
+	size_t hash = 0xCBF29CE484222325ULL;
+	while (*str != 0)
+		hash = (hash ^ (unsigned char)*str++) * 0x100000001B3ULL;
+	return hash;
+}
+
+/** splitmix64 finalizer, good enough for ints and pointers */
+static inline size_t
+rhash_hash_u64(unsigned long long value)
+{
+	value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+	return value ^ (value >> 31);
+}
+
+static inline struct rhash_entry **
+rhash_slots_new(size_t capacity)
+{
+	size_t size = capacity * sizeof(struct rhash_entry *);
+	struct rhash_entry **slots =
+		(struct rhash_entry **)aligned_alloc(RHASH_GROUP_BYTES, size);
+	if (slots != NULL)
+		memset(slots, 0, size);
+	return slots;
+}
+
+/** place the entry into a free slot, the array can't be full */
+static inline void
+rhash_slots_insert(struct rhash_entry **slots, size_t capacity,
+		   struct rhash_entry *entry)
+{
+	size_t mask = capacity - 1;
+	size_t pos = entry->hash & mask;
+	while (slots[pos] != NULL)
+		pos = (pos + 1) & mask;
+	slots[pos] = entry;
+}
+
+/**
+ * Empty the slot and shift the rest of the probe cluster backwards
+ * so no hole is left inside it - the current array never needs
+ * deleted-slot markers.
+ */
+static inline void
+rhash_slots_remove(struct rhash_entry **slots, size_t capacity, size_t pos)
+{
+	size_t mask = capacity - 1;
+	slots[pos] = NULL;
+	size_t hole = pos;
+	while (1) {
+		pos = (pos + 1) & mask;
+		if (slots[pos] == NULL)
+			return;
+		size_t home = slots[pos]->hash & mask;
+		/* Stays if its home is cyclically inside (hole, pos]. */
+		if (hole < pos ? (home > hole && home <= pos) :
+		    (home > hole || home <= pos))
+			continue;
+		slots[hole] = slots[pos];
+		slots[pos] = NULL;
+		hole = pos;
+	}
+}
+
+/** move a few old slots into the current array */
+static inline void
+rhash_migrate_some(struct rhash *h)
+{
+	if (h->old_slots == NULL)
+		return;
+	for (int i = 0; i < RHASH_MIGRATE_STEP; ++i) {
+		if (h->migrate_pos == h->old_capacity) {
+			free(h->old_slots);
+			h->old_slots = NULL;
+			h->old_capacity = 0;
+			h->migrate_pos = 0;
+			return;
+		}
+		struct rhash_entry *e = h->old_slots[h->migrate_pos];
+		if (e != NULL && e != RHASH_SLOT_DELETED) {
+			/*
+			 * The old array only loses entries, so a
+			 * deleted marker instead of a shift is fine -
+			 * the markers die with the array anyway. The
+			 * empty slots stay empty - the probe loops
+			 * need them to terminate.
+			 */
+			h->old_slots[h->migrate_pos] = RHASH_SLOT_DELETED;
+			rhash_slots_insert(h->slots, h->capacity, e);
+		}
+		++h->migrate_pos;
+	}
+}
+
+/**
+ * Insert the entry under the given hash. The entry must not be in
+ * the table already.
+ *
+ * @retval 0 Success.
+ * @retval -1 The slot array couldn't grow and is full. The load
+ *     factor alone doesn't fail an insert - on an allocation error
+ *     the table keeps filling the array it has.
+ */
+static inline int
+rhash_insert(struct rhash *h, struct rhash_entry *entry, size_t hash)
+{
+	rhash_migrate_some(h);
+	if (h->capacity == 0) {
+		h->slots = rhash_slots_new(RHASH_INIT_CAPACITY);
+		if (h->slots == NULL)
+			return -1;
+		h->capacity = RHASH_INIT_CAPACITY;
+	} else if ((h->count + 1) * 4 > h->capacity * 3) {
+		/* A previous rehash has to finish before a next one. */
+		while (h->old_slots != NULL)
+			rhash_migrate_some(h);
+		struct rhash_entry **slots = rhash_slots_new(h->capacity * 2);
+		if (slots != NULL) {
+			h->old_slots = h->slots;
+			h->old_capacity = h->capacity;
+			h->migrate_pos = 0;
+			h->slots = slots;
+			h->capacity *= 2;
+		} else if (h->count == h->capacity) {
+			return -1;
+		}
+	}
+	entry->hash = hash;
+	rhash_slots_insert(h->slots, h->capacity, entry);
+	++h->count;
+	return 0;
+}
+
+/**
+ * Remove the entry, a no-op when it isn't in the table. Uses the
+ * hash cached at insertion, so the key may already be destroyed.
+ */
+static inline void
+rhash_remove(struct rhash *h, struct rhash_entry *entry)
+{
+	rhash_migrate_some(h);
+	if (h->capacity == 0)
+		return;
+	size_t mask = h->capacity - 1;
+	size_t pos = entry->hash & mask;
+	while (h->slots[pos] != NULL) {
+		if (h->slots[pos] == entry) {
+			rhash_slots_remove(h->slots, h->capacity, pos);
+			--h->count;
+			return;
+		}
+		pos = (pos + 1) & mask;
+	}
+	if (h->old_slots == NULL)
+		return;
+	mask = h->old_capacity - 1;
+	pos = entry->hash & mask;
+	while (h->old_slots[pos] != NULL) {
+		if (h->old_slots[pos] == entry) {
+			h->old_slots[pos] = RHASH_SLOT_DELETED;
+			--h->count;
+			return;
+		}
+		pos = (pos + 1) & mask;
+	}
+}
+
+/** Candidate walk state of one hash value. */
+struct rhash_iterator {
+	const struct rhash *hash;
+	size_t wanted;
+	size_t pos;
+	/** The array being walked, flips to the old one on its end. */
+	struct rhash_entry **slots;
+	size_t capacity;
+};
+
+static inline struct rhash_entry *
+rhash_iterator_step(struct rhash_iterator *it)
+{
+	while (1) {
+		while (1) {
+			struct rhash_entry *e = it->slots[it->pos];
+			if (e == NULL)
+				break;
+			it->pos = (it->pos + 1) & (it->capacity - 1);
+			if (e != RHASH_SLOT_DELETED && e->hash == it->wanted)
+				return e;
+		}
+		const struct rhash *h = it->hash;
+		if (it->slots != h->slots || h->old_slots == NULL)
+			return NULL;
+		it->slots = h->old_slots;
+		it->capacity = h->old_capacity;
+		it->pos = it->wanted & (it->capacity - 1);
+	}
+}
+
+/**
+ * Start a walk over the entries whose full hash equals 'hash'. The
+ * caller compares the actual keys - see rhash_foreach_same(). The
+ * table must not be modified during the walk.
+ */
+static inline struct rhash_entry *
+rhash_find_first(const struct rhash *h, size_t hash,
+		 struct rhash_iterator *it)
+{
+	if (h->capacity == 0)
+		return NULL;
+	it->hash = h;
+	it->wanted = hash;
+	it->slots = h->slots;
+	it->capacity = h->capacity;
+	it->pos = hash & (it->capacity - 1);
+	return rhash_iterator_step(it);
+}
+
+static inline struct rhash_entry *
+rhash_find_next(struct rhash_iterator *it)
+{
+	return rhash_iterator_step(it);
+}
+
+/** return entry of type `type', which contains rhash_entry `member' */
+#define rhash_entry(item, type, member) ({				\
+	const typeof( ((type *)0)->member ) *__mptr = (item);		\
+	(type *)( (char *)__mptr - offsetof(type,member) );		\
+})
+
+/** foreach through the entries with the given full hash */
+#define rhash_foreach_same(item, h, hash_value, it)			\
+	for ((item) = rhash_find_first((h), (hash_value), (it));	\
+	     (item) != NULL; (item) = rhash_find_next((it)))
+
+#if defined(__cplusplus)
+} /* extern "C" */
+#endif /* defined(__cplusplus) */
@@ -0,0 +1,303 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/**
+ * Bounded lock-free rings, companions of rlist and rhash. Two
+ * flavours:
+ *
+ * - ring_spsc - single producer, single consumer. Each side owns its
+ *   cursor and only ever loads the other side's, so a transfer is a
+ *   couple of plain stores plus one release store, and a batch pays
+ *   the synchronization once for all its items.
+ *
+ * - ring_mpsc - multiple producers, single consumer. The producers
+ *   claim slots by advancing the shared head with a CAS and publish
+ *   each claimed slot with its own sequence number, so a stalled
+ *   producer delays only its own items, never the claiming of the
+ *   others. A push never takes a lock and never blocks, which makes
+ *   it usable from a signal handler as long as the handler doesn't
+ *   interrupt a pop of the same ring's consumer.
+ *
+ * Both transfer void pointers, require a power-of-two capacity and
+ * keep the producer's and the consumer's hot state on separate cache
+ * lines so the sides don't false-share. The atomics are the __atomic
+ * builtins rather than <stdatomic.h> - same codegen, but the header
+ * stays includable from C++.
+ */
+enum {
+	RING_CACHE_LINE = 64,
+};
+
+struct ring_spsc {
+	void **items;
+	size_t mask;
+	/**
+	 * Producer's line: its own cursor and a stale copy of the
+	 * consumer's one, refreshed only when the ring looks full.
+	 */
+	struct {
+		size_t head;
+		size_t tail_seen;
+	} prod __attribute__((aligned(RING_CACHE_LINE)));
+	/** Consumer's line, mirror of the above. */
+	struct {
+		size_t tail;
+		size_t head_seen;
+	} cons __attribute__((aligned(RING_CACHE_LINE)));
+};
+
+/**
+ * init the ring for the given power-of-two capacity
+ *
+ * @retval 0 Success.
+ * @retval -1 Bad capacity or out of memory.
+ */
+static inline int
+ring_spsc_create(struct ring_spsc *ring, size_t capacity)
+{
+	if (capacity == 0 || (capacity & (capacity - 1)) != 0)
+		return -1;
+	ring->items = (void **)malloc(capacity * sizeof(void *));
+	if (ring->items == NULL)
+		return -1;
+	ring->mask = capacity - 1;
+	ring->prod.head = 0;
+	ring->prod.tail_seen = 0;
+	ring->cons.tail = 0;
+	ring->cons.head_seen = 0;
+	return 0;
+}
+
+/** free the slot array; the queued items belong to the caller */
+static inline void
+ring_spsc_destroy(struct ring_spsc *ring)
+{
+	free(ring->items);
+	ring->items = NULL;
+}
+
+/**
+ * Push up to 'count' items, producer thread only. Returns how many
+ * were pushed - less than 'count' when the ring is getting full, 0
+ * when it is.
+ */
+static inline size_t
+ring_spsc_push_batch(struct ring_spsc *ring, void **items, size_t count)
+{
+	size_t head = ring->prod.head;
+	size_t vacant = ring->mask + 1 - (head - ring->prod.tail_seen);
+	if (vacant < count) {
+		ring->prod.tail_seen = __atomic_load_n(&ring->cons.tail,
+						       __ATOMIC_ACQUIRE);
+		vacant = ring->mask + 1 - (head - ring->prod.tail_seen);
+		if (vacant < count)
+			count = vacant;
+	}
+	for (size_t i = 0; i < count; ++i)
+		ring->items[(head + i) & ring->mask] = items[i];
+	if (count > 0)
+		__atomic_store_n(&ring->prod.head, head + count,
+				 __ATOMIC_RELEASE);
+	return count;
+}
+
+/**
+ * Pop up to 'capacity' items, consumer thread only. Returns how many
+ * were popped.
+ */
+static inline size_t
+ring_spsc_pop_batch(struct ring_spsc *ring, void **items, size_t capacity)
+{
+	size_t tail = ring->cons.tail;
+	size_t ready = ring->cons.head_seen - tail;
+	if (ready < capacity) {
+		ring->cons.head_seen = __atomic_load_n(&ring->prod.head,
+						       __ATOMIC_ACQUIRE);
+		ready = ring->cons.head_seen - tail;
+		if (ready < capacity)
+			capacity = ready;
+	}
+	for (size_t i = 0; i < capacity; ++i)
+		items[i] = ring->items[(tail + i) & ring->mask];
+	if (capacity > 0)
+		__atomic_store_n(&ring->cons.tail, tail + capacity,
+				 __ATOMIC_RELEASE);
+	return capacity;
+}
+
+/**
+ * Push one item.
+ *
+ * @retval 0 Success.
+ * @retval -1 The ring is full.
+ */
+static inline int
+ring_spsc_push(struct ring_spsc *ring, void *item)
+{
+	return ring_spsc_push_batch(ring, &item, 1) == 1 ? 0 : -1;
+}
+
+/**
+ * Pop one item.
+ *
+ * @retval 0 Success, 'item' is set.
+ * @retval -1 The ring is empty.
+ */
+static inline int
+ring_spsc_pop(struct ring_spsc *ring, void **item)
+{
+	return ring_spsc_pop_batch(ring, item, 1) == 1 ? 0 : -1;
+}
+
+struct ring_mpsc_slot {
+	/**
+	 * Lap counter. Equals the slot's global position when the
+	 * slot is free for that position's producer, position + 1
+	 * when the item is published for the consumer.
+	 */
+	size_t seq;
+	void *item;
+};
+
+struct ring_mpsc {
+	struct ring_mpsc_slot *slots;
+	size_t mask;
+	/** Claim cursor shared by the producers. */
+	size_t head __attribute__((aligned(RING_CACHE_LINE)));
+	/** Consumer's cursor, never touched by the producers. */
+	size_t tail __attribute__((aligned(RING_CACHE_LINE)));
+};
+
+/**
+ * init the ring for the given power-of-two capacity
+ *
+ * @retval 0 Success.
+ * @retval -1 Bad capacity or out of memory.
+ */
+static inline int
+ring_mpsc_create(struct ring_mpsc *ring, size_t capacity)
+{
+	if (capacity == 0 || (capacity & (capacity - 1)) != 0)
+		return -1;
+	ring->slots = (struct ring_mpsc_slot *)malloc(
+		capacity * sizeof(*ring->slots));
+	if (ring->slots == NULL)
+		return -1;
+	for (size_t i = 0; i < capacity; ++i)
+		ring->slots[i].seq = i;
+	ring->mask = capacity - 1;
+	ring->head = 0;
+	ring->tail = 0;
+	return 0;
+}
+
+/** free the slot array; the queued items belong to the caller */
+static inline void
+ring_mpsc_destroy(struct ring_mpsc *ring)
+{
+	free(ring->slots);
+	ring->slots = NULL;
+}
+
+/**
+ * Push up to 'count' items, any thread. The slots are claimed with
+ * one CAS for the whole batch and published one by one in order.
+ * Returns how many items were pushed - less than 'count' when the
+ * ring is getting full, 0 when it is.
+ */
+static inline size_t
+ring_mpsc_push_batch(struct ring_mpsc *ring, void **items, size_t count)
+{
+	size_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+retry:;
+	/*
+	 * Find how much fits. The consumer frees the slots in order,
+	 * so the batch's last slot being free means all of them are.
+	 */
+	size_t n = count;
+	for (; n > 0; --n) {
+		size_t pos = head + n - 1;
+		size_t seq = __atomic_load_n(&ring->slots[pos & ring->mask].seq,
+					     __ATOMIC_ACQUIRE);
+		ptrdiff_t diff = (ptrdiff_t)(seq - pos);
+		if (diff == 0)
+			break;
+		if (diff > 0) {
+			/* Claimed past 'pos' already - 'head' is stale. */
+			head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+			goto retry;
+		}
+		/* The slot still holds an unconsumed older item. */
+	}
+	if (n == 0)
+		return 0;
+	if (!__atomic_compare_exchange_n(&ring->head, &head, head + n, 0,
+					 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		goto retry;
+	for (size_t i = 0; i < n; ++i) {
+		struct ring_mpsc_slot *slot =
+			&ring->slots[(head + i) & ring->mask];
+		slot->item = items[i];
+		__atomic_store_n(&slot->seq, head + i + 1, __ATOMIC_RELEASE);
+	}
+	return n;
+}
+
+/**
+ * Pop up to 'capacity' items, consumer thread only. Stops at the
+ * first slot claimed but not yet published. Returns how many were
+ * popped.
+ */
+static inline size_t
+ring_mpsc_pop_batch(struct ring_mpsc *ring, void **items, size_t capacity)
+{
+	size_t tail = ring->tail;
+	size_t n = 0;
+	while (n < capacity) {
+		struct ring_mpsc_slot *slot = &ring->slots[tail & ring->mask];
+		size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if ((ptrdiff_t)(seq - (tail + 1)) < 0)
+			break;
+		items[n++] = slot->item;
+		/* Free the slot for the next lap's producer. */
+		__atomic_store_n(&slot->seq, tail + ring->mask + 1,
+				 __ATOMIC_RELEASE);
+		++tail;
+	}
+	ring->tail = tail;
+	return n;
+}
+
+/**
+ * Push one item, any thread.
+ *
+ * @retval 0 Success.
+ * @retval -1 The ring is full.
+ */
+static inline int
+ring_mpsc_push(struct ring_mpsc *ring, void *item)
+{
+	return ring_mpsc_push_batch(ring, &item, 1) == 1 ? 0 : -1;
+}
+
+/**
+ * Pop one item, consumer thread only.
+ *
+ * @retval 0 Success, 'item' is set.
+ * @retval -1 The ring is empty.
+ */
+static inline int
+ring_mpsc_pop(struct ring_mpsc *ring, void **item)
+{
+	return ring_mpsc_pop_batch(ring, item, 1) == 1 ? 0 : -1;
+}
+
+#if defined(__cplusplus)
+} /* extern "C" */
+#endif /* defined(__cplusplus) */
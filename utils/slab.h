@@ -0,0 +1,355 @@
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/**
+ * Slab cache of fixed-size objects, companion of ring and rlist. The
+ * tree grew several hand-rolled free-lists for the same job - cheap
+ * reuse of one hot struct type - and this header is the shared
+ * implementation they can sit on.
+ *
+ * One cache serves one size class. Objects live in slabs - malloc'ed
+ * chunks carved into equal cells - so the backing memory shows up in
+ * heap_help like any other allocation and a leak report points at the
+ * cache, not at a pile of anonymous cells. Free objects are kept in
+ * two tiers:
+ *
+ * - a per-thread magazine of up to SLAB_MAGAZINE_CAP pointers, so the
+ *   steady-state alloc/free pair is a couple of plain ops plus one
+ *   relaxed counter update and takes no lock;
+ *
+ * - a mutex-guarded depot shared by all threads, refilling and
+ *   draining the magazines half a magazine at a time so a thread
+ *   bouncing on the magazine boundary doesn't pay the lock on every
+ *   call.
+ *
+ * The constructor hook runs once per object, when its slab is carved -
+ * not on every allocation. A freed object returns to the cache still
+ * constructed, which is the point: the expensive part of the init is
+ * paid once per cell, not once per use. When a hook is given the
+ * free-list link is stored past the object, so the constructed state
+ * survives the stay on the free-list intact. The destructor hook runs
+ * once per object too, in slab_cache_destroy().
+ *
+ * Magazines flush back to the depot at thread exit. Destroy the cache
+ * only after every object was freed and every thread that used the
+ * cache has exited - the usual shape anyway for the process-lifetime
+ * pools this is meant for. The atomics are the __atomic builtins
+ * rather than <stdatomic.h> so the header stays includable from C++.
+ */
+enum {
+	/** Free pointers a thread keeps to itself. */
+	SLAB_MAGAZINE_CAP = 64,
+	/** Gross size one slab aims at, header included. */
+	SLAB_TARGET_BYTES = 16 * 1024,
+	/** Cells keep this alignment, enough for any scalar. */
+	SLAB_CELL_ALIGN = 16,
+};
+
+struct slab_stats {
+	/** Objects handed out and not yet freed back. */
+	size_t used_count;
+	/** Constructed objects resting in the depot and the magazines. */
+	size_t cached_count;
+	size_t slab_count;
+	/** Heap bytes held in slabs, headers included. */
+	size_t mem_bytes;
+};
+
+struct slab {
+	struct slab *next;
+};
+
+/** Free-list link, overlaid on the cell or appended after it. */
+struct slab_cell {
+	struct slab_cell *next;
+};
+
+struct slab_magazine {
+	struct slab_cache *cache;
+	int count;
+	void *objs[SLAB_MAGAZINE_CAP];
+};
+
+struct slab_cache {
+	/** For reports. Not copied, must outlive the cache. */
+	const char *name;
+	size_t obj_size;
+	/** Object rounded up to the cell alignment, plus the link. */
+	size_t cell_size;
+	/** Where in the cell the free-list link lives. */
+	size_t link_offset;
+	size_t cells_per_slab;
+	void (*ctor)(void *obj, void *arg);
+	void (*dtor)(void *obj, void *arg);
+	void *hook_arg;
+	pthread_key_t magazine_key;
+	/** Guards all the members below. */
+	pthread_mutex_t lock;
+	struct slab_cell *depot;
+	size_t depot_count;
+	struct slab *slabs;
+	size_t slab_count;
+	size_t mem_bytes;
+	/** Objects ever carved; never decreases until destroy. */
+	size_t carved_count;
+	/** Updated with relaxed __atomic ops, lock not needed. */
+	size_t used_count;
+};
+
+static inline struct slab_cell *
+slab_cell_link(const struct slab_cache *cache, void *obj)
+{
+	return (struct slab_cell *)((char *)obj + cache->link_offset);
+}
+
+/** Give the depot 'count' objects out of the magazine's bottom. */
+static inline void
+slab_magazine_flush(struct slab_cache *cache, struct slab_magazine *mag,
+		    int count)
+{
+	pthread_mutex_lock(&cache->lock);
+	for (int i = 0; i < count; ++i) {
+		void *obj = mag->objs[i];
+		slab_cell_link(cache, obj)->next = cache->depot;
+		cache->depot = slab_cell_link(cache, obj);
+		++cache->depot_count;
+	}
+	pthread_mutex_unlock(&cache->lock);
+	mag->count -= count;
+	for (int i = 0; i < mag->count; ++i)
+		mag->objs[i] = mag->objs[i + count];
+}
+
+/** Thread exit - the magazine's objects go back to the depot. */
+static inline void
+slab_magazine_exit(void *arg)
+{
+	struct slab_magazine *mag = (struct slab_magazine *)arg;
+	slab_magazine_flush(mag->cache, mag, mag->count);
+	free(mag);
+}
+
+/**
+ * Create a cache of 'obj_size' objects. The hooks are optional and
+ * run once per object each: 'ctor' when the object's slab is carved,
+ * 'dtor' in slab_cache_destroy().
+ *
+ * @retval 0 Success.
+ * @retval -1 Out of resources.
+ */
+static inline int
+slab_cache_create(struct slab_cache *cache, const char *name, size_t obj_size,
+		  void (*ctor)(void *obj, void *arg),
+		  void (*dtor)(void *obj, void *arg), void *hook_arg)
+{
+	if (pthread_key_create(&cache->magazine_key, slab_magazine_exit) != 0)
+		return -1;
+	cache->name = name;
+	cache->obj_size = obj_size;
+	size_t payload = (obj_size + SLAB_CELL_ALIGN - 1) &
+		~(size_t)(SLAB_CELL_ALIGN - 1);
+	if (payload == 0)
+		payload = SLAB_CELL_ALIGN;
+	if (ctor != NULL || dtor != NULL) {
+		/* The link past the object, the constructed state is holy. */
+		cache->link_offset = payload;
+		cache->cell_size = payload + SLAB_CELL_ALIGN;
+	} else {
+		cache->link_offset = 0;
+		cache->cell_size = payload;
+	}
+	size_t header = (sizeof(struct slab) + SLAB_CELL_ALIGN - 1) &
+		~(size_t)(SLAB_CELL_ALIGN - 1);
+	cache->cells_per_slab = (SLAB_TARGET_BYTES - header) / cache->cell_size;
+	if (cache->cells_per_slab == 0)
+		cache->cells_per_slab = 1;
+	cache->ctor = ctor;
+	cache->dtor = dtor;
+	cache->hook_arg = hook_arg;
+	pthread_mutex_init(&cache->lock, NULL);
+	cache->depot = NULL;
+	cache->depot_count = 0;
+	cache->slabs = NULL;
+	cache->slab_count = 0;
+	cache->mem_bytes = 0;
+	cache->carved_count = 0;
+	cache->used_count = 0;
+	return 0;
+}
+
+/**
+ * Carve one more slab into the depot, constructing every cell. Needs
+ * the cache lock. Returns -1 when the allocation fails.
+ */
+static inline int
+slab_cache_grow(struct slab_cache *cache)
+{
+	size_t header = (sizeof(struct slab) + SLAB_CELL_ALIGN - 1) &
+		~(size_t)(SLAB_CELL_ALIGN - 1);
+	size_t size = header + cache->cells_per_slab * cache->cell_size;
+	struct slab *slab = (struct slab *)malloc(size);
+	if (slab == NULL)
+		return -1;
+	slab->next = cache->slabs;
+	cache->slabs = slab;
+	char *cell = (char *)slab + header;
+	for (size_t i = 0; i < cache->cells_per_slab; ++i) {
+		if (cache->ctor != NULL)
+			cache->ctor(cell, cache->hook_arg);
+		slab_cell_link(cache, cell)->next = cache->depot;
+		cache->depot = slab_cell_link(cache, cell);
+		cell += cache->cell_size;
+	}
+	cache->depot_count += cache->cells_per_slab;
+	cache->carved_count += cache->cells_per_slab;
+	++cache->slab_count;
+	cache->mem_bytes += size;
+	return 0;
+}
+
+static inline struct slab_magazine *
+slab_magazine_get(struct slab_cache *cache)
+{
+	struct slab_magazine *mag = (struct slab_magazine *)
+		pthread_getspecific(cache->magazine_key);
+	if (mag != NULL)
+		return mag;
+	mag = (struct slab_magazine *)malloc(sizeof(*mag));
+	if (mag == NULL)
+		return NULL;
+	if (pthread_setspecific(cache->magazine_key, mag) != 0) {
+		free(mag);
+		return NULL;
+	}
+	mag->cache = cache;
+	mag->count = 0;
+	return mag;
+}
+
+/**
+ * Allocate an object. It comes out constructed - either fresh from
+ * the constructor hook or exactly as the previous owner freed it.
+ * Returns NULL when the heap is exhausted.
+ */
+static inline void *
+slab_alloc(struct slab_cache *cache)
+{
+	struct slab_magazine *mag = slab_magazine_get(cache);
+	void *obj;
+	if (mag != NULL && mag->count > 0) {
+		obj = mag->objs[--mag->count];
+	} else {
+		pthread_mutex_lock(&cache->lock);
+		if (cache->depot == NULL && slab_cache_grow(cache) != 0) {
+			pthread_mutex_unlock(&cache->lock);
+			return NULL;
+		}
+		obj = cache->depot;
+		cache->depot = cache->depot->next;
+		--cache->depot_count;
+		/*
+		 * Half a magazine on top, so the next allocations of
+		 * this thread stay off the lock.
+		 */
+		if (mag != NULL) {
+			while (mag->count < SLAB_MAGAZINE_CAP / 2 &&
+			       cache->depot != NULL) {
+				struct slab_cell *cell = cache->depot;
+				cache->depot = cell->next;
+				--cache->depot_count;
+				mag->objs[mag->count++] = (char *)cell -
+					cache->link_offset;
+			}
+		}
+		pthread_mutex_unlock(&cache->lock);
+		obj = (char *)obj - cache->link_offset;
+	}
+	__atomic_fetch_add(&cache->used_count, 1, __ATOMIC_RELAXED);
+	return obj;
+}
+
+/** Free an object back into the cache. */
+static inline void
+slab_free(struct slab_cache *cache, void *obj)
+{
+	__atomic_fetch_sub(&cache->used_count, 1, __ATOMIC_RELAXED);
+	struct slab_magazine *mag = slab_magazine_get(cache);
+	if (mag == NULL) {
+		pthread_mutex_lock(&cache->lock);
+		slab_cell_link(cache, obj)->next = cache->depot;
+		cache->depot = slab_cell_link(cache, obj);
+		++cache->depot_count;
+		pthread_mutex_unlock(&cache->lock);
+		return;
+	}
+	if (mag->count == SLAB_MAGAZINE_CAP) {
+		/*
+		 * Half, not all - a thread bouncing on the boundary
+		 * shouldn't pay the lock on every call.
+		 */
+		slab_magazine_flush(cache, mag, SLAB_MAGAZINE_CAP / 2);
+	}
+	mag->objs[mag->count++] = obj;
+}
+
+/** Fill 'stats' with a consistent snapshot of the cache's counters. */
+static inline void
+slab_cache_stats(struct slab_cache *cache, struct slab_stats *stats)
+{
+	pthread_mutex_lock(&cache->lock);
+	stats->used_count = __atomic_load_n(&cache->used_count,
+					    __ATOMIC_RELAXED);
+	stats->cached_count = cache->carved_count - stats->used_count;
+	stats->slab_count = cache->slab_count;
+	stats->mem_bytes = cache->mem_bytes;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * Destroy the cache: run the destructor hook on every carved object
+ * and give the slabs back to the heap. Every object must have been
+ * freed and every other thread that used the cache must have exited,
+ * so their magazines are flushed.
+ */
+static inline void
+slab_cache_destroy(struct slab_cache *cache)
+{
+	struct slab_magazine *mag = (struct slab_magazine *)
+		pthread_getspecific(cache->magazine_key);
+	if (mag != NULL) {
+		pthread_setspecific(cache->magazine_key, NULL);
+		free(mag);
+	}
+	pthread_key_delete(cache->magazine_key);
+	size_t header = (sizeof(struct slab) + SLAB_CELL_ALIGN - 1) &
+		~(size_t)(SLAB_CELL_ALIGN - 1);
+	while (cache->slabs != NULL) {
+		struct slab *slab = cache->slabs;
+		cache->slabs = slab->next;
+		if (cache->dtor != NULL) {
+			char *cell = (char *)slab + header;
+			for (size_t i = 0; i < cache->cells_per_slab; ++i) {
+				cache->dtor(cell, cache->hook_arg);
+				cell += cache->cell_size;
+			}
+		}
+		free(slab);
+	}
+	cache->depot = NULL;
+	cache->depot_count = 0;
+	cache->slab_count = 0;
+	cache->mem_bytes = 0;
+	cache->carved_count = 0;
+	pthread_mutex_destroy(&cache->lock);
+}
+
+#if defined(__cplusplus)
+} /* extern "C" */
+#endif /* defined(__cplusplus) */
@@ -0,0 +1,50 @@
+#pragma once
+
+/**
+ * Compiled-in USDT tracepoints, systemtap SDT style. On a system
+ * with <sys/sdt.h> every probe becomes a single nop carrying an ELF
+ * note which bpftrace and perf attach to by name - zero cost until a
+ * tracer arms it, and no redeploy to start measuring. Without the
+ * header the probes compile away entirely, so the code is free to
+ * use them unconditionally.
+ *
+ * Example - queueing delay of every pool task:
+ *
+ *     bpftrace -e '
+ *         usdt:./test:tpool:task_push { @t[arg0] = nsecs; }
+ *         usdt:./test:tpool:task_start /@t[arg0]/ {
+ *             @wait = hist(nsecs - @t[arg0]); delete(@t[arg0]); }'
+ */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_HAVE_SDT 1
+#endif
+#endif
+
+#if defined(TRACE_HAVE_SDT)
+
+#define TRACE_PROBE(provider, name) DTRACE_PROBE(provider, name)
+#define TRACE_PROBE1(provider, name, a1) DTRACE_PROBE1(provider, name, a1)
+#define TRACE_PROBE2(provider, name, a1, a2)				\
+	DTRACE_PROBE2(provider, name, a1, a2)
+#define TRACE_PROBE3(provider, name, a1, a2, a3)			\
+	DTRACE_PROBE3(provider, name, a1, a2, a3)
+
+#else
+
+#define TRACE_PROBE(provider, name) do {} while (0)
+#define TRACE_PROBE1(provider, name, a1) do {				\
+	(void)(a1);							\
+} while (0)
+#define TRACE_PROBE2(provider, name, a1, a2) do {			\
+	(void)(a1);							\
+	(void)(a2);							\
+} while (0)
+#define TRACE_PROBE3(provider, name, a1, a2, a3) do {			\
+	(void)(a1);							\
+	(void)(a2);							\
+	(void)(a3);							\
+} while (0)
+
+#endif
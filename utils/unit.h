@@ -3,6 +3,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
 
 #define unit_test_start() \
 	printf("\t-------- %s started --------\n", __func__)
@@ -34,4 +36,81 @@
 	}								\
 } while(0)
 
+enum {
+	/* One warmup run plus median of these runs, to shake off cache
+	 * and CPU frequency noise. */
+	UNIT_BENCH_WARMUP_COUNT = 1,
+	UNIT_BENCH_RUN_COUNT = 5,
+};
+
+/* Per-iteration time of the latest unit_bench(), in nanoseconds. */
+static uint64_t unit_bench_last_ns __attribute__((unused));
+
+static inline uint64_t
+unit_bench_time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline uint64_t
+unit_bench_median(uint64_t *runs, int count)
+{
+	for (int i = 1; i < count; ++i) {
+		uint64_t v = runs[i];
+		int j = i;
+		while (j > 0 && runs[j - 1] > v) {
+			runs[j] = runs[j - 1];
+			--j;
+		}
+		runs[j] = v;
+	}
+	return runs[count / 2];
+}
+
+/*
+ * Run the body iters times per run and report the median run in a
+ * machine-readable line, for CI to parse. The result can be gated
+ * right after with unit_assert_faster_than().
+ */
+#define unit_bench(name, iters, body) do {				\
+	uint64_t unit_runs_[UNIT_BENCH_RUN_COUNT];			\
+	for (int unit_run_ = -UNIT_BENCH_WARMUP_COUNT;			\
+	     unit_run_ < UNIT_BENCH_RUN_COUNT; ++unit_run_) {		\
+		uint64_t unit_t0_ = unit_bench_time_ns();		\
+		for (uint64_t unit_i_ = 0;				\
+		     unit_i_ < (uint64_t)(iters); ++unit_i_) {		\
+			body;						\
+		}							\
+		if (unit_run_ >= 0) {					\
+			unit_runs_[unit_run_] =				\
+				unit_bench_time_ns() - unit_t0_;	\
+		}							\
+	}								\
+	uint64_t unit_median_ = unit_bench_median(			\
+		unit_runs_, UNIT_BENCH_RUN_COUNT);			\
+	unit_bench_last_ns =						\
+		(unit_median_ + (iters) / 2) / (iters);			\
+	printf("bench - %s: iters=%llu median_run_ns=%llu "		\
+	       "ns_per_iter=%llu\n", (name),				\
+	       (unsigned long long)(iters),				\
+	       (unsigned long long)unit_median_,			\
+	       (unsigned long long)unit_bench_last_ns);			\
+} while (0)
+
+/* Fail if the latest unit_bench() iteration took longer than this. */
+#define unit_assert_faster_than(ns) do {				\
+	if (unit_bench_last_ns > (uint64_t)(ns)) {			\
+		printf("not ok - bench is too slow: %llu ns per "	\
+		       "iter, limit is %llu\n",				\
+		       (unsigned long long)unit_bench_last_ns,		\
+		       (unsigned long long)(ns));			\
+		unit_fail_if(true);					\
+	} else {							\
+		printf("ok - bench fits into %llu ns per iter\n",	\
+		       (unsigned long long)(ns));			\
+	}								\
+} while (0)
+
 bool doCmdMaxPoints(int argc, char **argv);
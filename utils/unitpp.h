@@ -1,5 +1,8 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
+#include <ctime>
 #include <iostream>
 
 class UnitTestCaseGuard
@@ -24,7 +27,7 @@ private:
 #define unit_test_start() UnitTestCaseGuard test_case_guard(__func__)
 
 #define unit_assert(cond) do {													\
-	if (cond) {																	\
+	if (not (cond)) {															\
 		std::cout <<"Test failed, line " << __LINE__ << "\n";					\
 		exit(-1);																\
 	}																			\
@@ -42,3 +45,54 @@ private:
 		std::cout << "ok - " << msg << '\n';									\
 	}																			\
 } while(0)
+
+enum {
+	// One warmup run plus median of these runs, to shake off cache and CPU
+	// frequency noise.
+	UNIT_BENCH_WARMUP_COUNT = 1,
+	UNIT_BENCH_RUN_COUNT = 5,
+};
+
+// Per-iteration time of the latest unit_bench(), in nanoseconds.
+inline uint64_t unit_bench_last_ns = 0;
+
+inline uint64_t
+unitBenchTimeNs()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Run the body iters times per run and report the median run in a
+// machine-readable line, for CI to parse. The result can be gated right after
+// with unit_assert_faster_than().
+#define unit_bench(name, iters, body) do {										\
+	uint64_t unitRuns[UNIT_BENCH_RUN_COUNT];									\
+	for (int unitRun = -UNIT_BENCH_WARMUP_COUNT;								\
+	     unitRun < UNIT_BENCH_RUN_COUNT; ++unitRun) {							\
+		uint64_t unitT0 = unitBenchTimeNs();									\
+		for (uint64_t unitI = 0; unitI < (uint64_t)(iters); ++unitI) {			\
+			body;																\
+		}																		\
+		if (unitRun >= 0)														\
+			unitRuns[unitRun] = unitBenchTimeNs() - unitT0;						\
+	}																			\
+	std::sort(unitRuns, unitRuns + UNIT_BENCH_RUN_COUNT);						\
+	uint64_t unitMedian = unitRuns[UNIT_BENCH_RUN_COUNT / 2];					\
+	unit_bench_last_ns = (unitMedian + (iters) / 2) / (iters);					\
+	std::cout << "bench - " << (name) << ": iters=" << (iters)					\
+		<< " median_run_ns=" << unitMedian										\
+		<< " ns_per_iter=" << unit_bench_last_ns << '\n';						\
+} while (0)
+
+// Fail if the latest unit_bench() iteration took longer than this.
+#define unit_assert_faster_than(ns) do {										\
+	if (unit_bench_last_ns > (uint64_t)(ns)) {									\
+		std::cout << "not ok - bench is too slow: " << unit_bench_last_ns		\
+			<< " ns per iter, limit is " << (ns) << '\n';						\
+		unit_assert(false);														\
+	} else {																	\
+		std::cout << "ok - bench fits into " << (ns) << " ns per iter\n";		\
+	}																			\
+} while (0)